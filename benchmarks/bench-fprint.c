@@ -0,0 +1,343 @@
+/*
+ * Benchmarks for the libfprint image processing and matching stages
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Every stage runs in its own process, so that the reported peak RSS
+ * belongs to that stage only. Results are printed to stdout as one JSON
+ * object per input:
+ *
+ *   {"benchmark": "get_minutiae", "input": "examples/prints/arch.png",
+ *    "iterations": 120, "ns_per_op": 4123456, "ops_per_sec": 242.5,
+ *    "bytes_per_sec": 14898765, "peak_rss_kib": 10240}
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+
+#include "fpi-assembling.h"
+#include "fpi-image.h"
+#include "fp-print-private.h"
+#include "bench-utils.h"
+
+static gdouble min_time = 1.0;
+
+
+typedef void (*BenchFunc) (gpointer user_data);
+
+/* Runs @func until at least min_time seconds have passed, doubling the
+ * batch size so that the clock is not read for every cheap operation. */
+static void
+bench_run (const gchar *name,
+           const gchar *input,
+           gsize        bytes_per_op,
+           BenchFunc    func,
+           gpointer     user_data)
+{
+  gint64 start, elapsed;
+  guint64 iterations = 0;
+  guint64 batch = 1;
+  gdouble ns_per_op, ops_per_sec;
+
+  /* Warm up caches and lazily created state */
+  func (user_data);
+
+  start = g_get_monotonic_time ();
+  do
+    {
+      for (guint64 i = 0; i < batch; i++)
+        func (user_data);
+      iterations += batch;
+      batch *= 2;
+      elapsed = g_get_monotonic_time () - start;
+    }
+  while (elapsed < min_time * G_USEC_PER_SEC);
+
+  ns_per_op = (gdouble) elapsed * 1000 / iterations;
+  ops_per_sec = 1e9 / ns_per_op;
+
+  g_print ("{\"benchmark\": \"%s\", \"input\": \"%s\", "
+           "\"iterations\": %" G_GUINT64_FORMAT ", \"ns_per_op\": %.0f, "
+           "\"ops_per_sec\": %.2f, \"bytes_per_sec\": %.0f, "
+           "\"peak_rss_kib\": %ld}\n",
+           name, input, iterations, ns_per_op, ops_per_sec,
+           ops_per_sec * bytes_per_op, bench_get_peak_rss ());
+}
+
+static void
+bench_get_minutiae_func (gpointer user_data)
+{
+  FpImage *img = user_data;
+  MINUTIAE *minutiae;
+  gint *direction_map, *low_contrast_map, *low_flow_map;
+  gint *high_curve_map, *quality_map;
+  guchar *bdata;
+  gint map_w, map_h, bw, bh, bd;
+  gint r;
+
+  r = get_minutiae (&minutiae, &quality_map, &direction_map,
+                    &low_contrast_map, &low_flow_map, &high_curve_map,
+                    &map_w, &map_h, &bdata, &bw, &bh, &bd,
+                    img->data, img->width, img->height, 8,
+                    img->ppmm, &g_lfsparms_V2);
+  if (r)
+    g_error ("get_minutiae failed with code %d", r);
+
+  free_minutiae (minutiae);
+  free (quality_map);
+  free (direction_map);
+  free (low_contrast_map);
+  free (low_flow_map);
+  free (high_curve_map);
+  free (bdata);
+}
+
+static void
+bench_get_minutiae (void)
+{
+  for (guint i = 0; i < bench_n_sample_images; i++)
+    {
+      g_autoptr(FpImage) img = bench_load_image (bench_sample_images[i]);
+
+      bench_run ("get_minutiae", bench_sample_images[i], img->width * img->height,
+                 bench_get_minutiae_func, img);
+    }
+}
+
+typedef struct
+{
+  struct xyt_struct *probe;
+  struct xyt_struct *gallery;
+} BozorthPair;
+
+static void
+bench_bozorth_func (gpointer user_data)
+{
+  BozorthPair *pair = user_data;
+  gint probe_len;
+
+  probe_len = bozorth_probe_init (pair->probe);
+  bozorth_to_gallery (probe_len, pair->probe, pair->gallery);
+}
+
+static void
+bench_bozorth_to_gallery (void)
+{
+  struct xyt_struct *xyts;
+  guint n = bench_n_sample_images;
+
+  xyts = g_new0 (struct xyt_struct, n);
+  for (guint i = 0; i < n; i++)
+    {
+      g_autoptr(FpPrint) print = bench_load_print (bench_sample_images[i]);
+
+      xyts[i] = *fpi_print_get_xyt (print, 0, &xyts[i]);
+    }
+
+  /* A genuine comparison of each print against itself, and an impostor
+   * one against the next sample. */
+  for (guint i = 0; i < n; i++)
+    {
+      BozorthPair genuine = { &xyts[i], &xyts[i] };
+      BozorthPair impostor = { &xyts[i], &xyts[(i + 1) % n] };
+      g_autofree gchar *impostor_name = NULL;
+
+      impostor_name = g_strdup_printf ("%s vs %s", bench_sample_images[i],
+                                       bench_sample_images[(i + 1) % n]);
+
+      bench_run ("bozorth_to_gallery", bench_sample_images[i], 0,
+                 bench_bozorth_func, &genuine);
+      bench_run ("bozorth_to_gallery", impostor_name, 0,
+                 bench_bozorth_func, &impostor);
+    }
+
+  g_free (xyts);
+}
+
+typedef struct
+{
+  struct fpi_frame frame;
+  guchar          *data;
+  guint            width;
+  guint            y;
+} PackedFrame;
+
+typedef struct
+{
+  struct fpi_frame_asmbl_ctx ctx;
+  GSList                    *frames;
+} AssembleData;
+
+static unsigned char
+packed_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
+                  struct fpi_frame           *frame,
+                  unsigned int                x,
+                  unsigned int                y)
+{
+  PackedFrame *p_frame = (void *) frame;
+
+  return p_frame->data[x + (y + p_frame->y) * p_frame->width];
+}
+
+static const unsigned char *
+packed_get_row (struct fpi_frame_asmbl_ctx *ctx,
+                struct fpi_frame           *frame,
+                unsigned int                y)
+{
+  PackedFrame *p_frame = (void *) frame;
+
+  return p_frame->data + (y + p_frame->y) * p_frame->width;
+}
+
+static void
+bench_assemble_func (gpointer user_data)
+{
+  AssembleData *data = user_data;
+  g_autoptr(FpImage) img = NULL;
+
+  fpi_do_movement_estimation (&data->ctx, data->frames);
+  img = fpi_assemble_frames (&data->ctx, data->frames);
+}
+
+static void
+bench_assemble_frames (void)
+{
+  const gchar *name = "tests/vfs5011/capture.png";
+  g_autoptr(FpImage) img = bench_load_image (name);
+  AssembleData data = { { 0, }, };
+  guint n_frames = 0;
+
+  data.ctx.frame_width = img->width;
+  data.ctx.frame_height = 20;
+  data.ctx.image_width = img->width;
+  data.ctx.get_pixel = packed_get_pixel;
+  data.ctx.get_row = packed_get_row;
+
+  /* Overlapping frames as a swipe sensor would deliver them */
+  for (guint y = 0; y + data.ctx.frame_height < img->height; y += 10)
+    {
+      PackedFrame *frame = g_new0 (PackedFrame, 1);
+
+      frame->data = img->data;
+      frame->width = img->width;
+      frame->y = y;
+      data.frames = g_slist_prepend (data.frames, frame);
+      n_frames++;
+    }
+  data.frames = g_slist_reverse (data.frames);
+
+  bench_run ("fpi_assemble_frames", name,
+             n_frames * data.ctx.frame_width * data.ctx.frame_height,
+             bench_assemble_func, &data);
+
+  data.ctx.hierarchical_search = TRUE;
+  bench_run ("fpi_assemble_frames", "tests/vfs5011/capture.png (hierarchical)",
+             n_frames * data.ctx.frame_width * data.ctx.frame_height,
+             bench_assemble_func, &data);
+
+  g_slist_free_full (data.frames, g_free);
+}
+
+typedef struct
+{
+  guchar *data;
+  gsize   length;
+} SerializedPrint;
+
+static void
+bench_deserialize_func (gpointer user_data)
+{
+  SerializedPrint *serialized = user_data;
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(GError) error = NULL;
+
+  print = fp_print_deserialize (serialized->data, serialized->length, &error);
+  if (!print)
+    g_error ("Could not deserialize print: %s", error->message);
+}
+
+static void
+bench_print_deserialize (void)
+{
+  g_autoptr(FpPrint) print = bench_load_print (bench_sample_images[0]);
+  g_autoptr(GError) error = NULL;
+  SerializedPrint serialized;
+
+  /* An enrolled print holds several samples of the same finger */
+  for (guint i = 1; i < bench_n_sample_images; i++)
+    {
+      g_autoptr(FpPrint) other = bench_load_print (bench_sample_images[i]);
+
+      fpi_print_add_print (print, other);
+    }
+  fp_print_set_username (print, "bench");
+
+  if (!fp_print_serialize (print, &serialized.data, &serialized.length, &error))
+    g_error ("Could not serialize print: %s", error->message);
+
+  bench_run ("fp_print_deserialize", "examples/prints + captures",
+             serialized.length, bench_deserialize_func, &serialized);
+
+  g_free (serialized.data);
+}
+
+static const struct
+{
+  const gchar *name;
+  void         (*func) (void);
+} benchmarks[] = {
+  { "get_minutiae", bench_get_minutiae },
+  { "bozorth_to_gallery", bench_bozorth_to_gallery },
+  { "fpi_assemble_frames", bench_assemble_frames },
+  { "fp_print_deserialize", bench_print_deserialize },
+};
+
+int
+main (int argc, char *argv[])
+{
+  const gchar *min_time_env;
+  gboolean found = FALSE;
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s BENCHMARK|all\n", argv[0]);
+      return 1;
+    }
+
+  min_time_env = g_getenv ("FP_BENCH_MIN_TIME");
+  if (min_time_env)
+    min_time = g_ascii_strtod (min_time_env, NULL);
+
+  for (guint i = 0; i < G_N_ELEMENTS (benchmarks); i++)
+    {
+      if (g_strcmp0 (argv[1], "all") != 0 &&
+          g_strcmp0 (argv[1], benchmarks[i].name) != 0)
+        continue;
+
+      benchmarks[i].func ();
+      found = TRUE;
+    }
+
+  if (!found)
+    {
+      g_printerr ("Unknown benchmark %s\n", argv[1]);
+      return 1;
+    }
+
+  return 0;
+}
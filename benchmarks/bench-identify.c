@@ -0,0 +1,265 @@
+/*
+ * 1:N identification benchmark on synthetic galleries
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The gallery is made of synthetic fingers derived from the minutiae of
+ * the sample images. Every minutia of a sample is displaced far beyond
+ * the bozorth3 tolerances, so that each synthetic finger keeps the
+ * minutiae count and density of a real one, but has its own geometry.
+ *
+ * Enrolled templates and probes are then separate "captures" of such a
+ * finger: rotated, translated, with some minutiae dropped and the others
+ * jittered a little.
+ *
+ * For every gallery size, genuine probes (of an enrolled finger) and
+ * impostor probes (of a finger that is not enrolled) are identified both
+ * by calling fpi_print_bz3_match() on every template in turn, and with
+ * fpi_print_bz3_identify(), which is what #FpImageDevice uses. The
+ * results are printed as one JSON object per gallery size and path.
+ */
+
+#include <glib.h>
+
+#include "fp-print-private.h"
+#include "bench-utils.h"
+
+static gchar *sizes_arg = NULL;
+static gint n_probes = 20;
+static gint bz3_threshold = 40;
+static gint seed = 0;
+
+static GOptionEntry entries[] = {
+  { "sizes", 0, 0, G_OPTION_ARG_STRING, &sizes_arg,
+    "Comma separated gallery sizes (default: 10,100,1000,10000)", "SIZES" },
+  { "probes", 0, 0, G_OPTION_ARG_INT, &n_probes,
+    "Genuine and impostor probes per gallery size (default: 20)", "N" },
+  { "threshold", 0, 0, G_OPTION_ARG_INT, &bz3_threshold,
+    "BZ3 match threshold (default: 40)", "SCORE" },
+  { "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+    "Seed for the synthetic galleries (default: 0)", "SEED" },
+  { NULL }
+};
+
+typedef struct
+{
+  GPtrArray *templates;
+  /* Probes and the index of the enrolled finger, or -1 for impostors */
+  GPtrArray *probes;
+  GArray    *probe_fingers;
+} Gallery;
+
+static void
+gallery_clear (Gallery *gallery)
+{
+  g_clear_pointer (&gallery->templates, g_ptr_array_unref);
+  g_clear_pointer (&gallery->probes, g_ptr_array_unref);
+  g_clear_pointer (&gallery->probe_fingers, g_array_unref);
+}
+
+static void
+gallery_init (Gallery *gallery, GPtrArray *samples, guint size, GRand *rand)
+{
+  GPtrArray *fingers = g_ptr_array_new_with_free_func (g_free);
+
+  /* The additional fingers are never enrolled */
+  for (guint i = 0; i < size + n_probes; i++)
+    g_ptr_array_add (fingers,
+                     bench_finger_new (g_ptr_array_index (samples, i % samples->len), rand));
+
+  gallery->templates = g_ptr_array_new_with_free_func (g_object_unref);
+  for (guint i = 0; i < size; i++)
+    g_ptr_array_add (gallery->templates,
+                     bench_print_new (bench_capture_new (g_ptr_array_index (fingers, i), rand)));
+
+  gallery->probes = g_ptr_array_new_with_free_func (g_object_unref);
+  gallery->probe_fingers = g_array_new (FALSE, FALSE, sizeof (gint));
+  for (gint i = 0; i < n_probes; i++)
+    {
+      gint genuine = g_rand_int_range (rand, 0, size);
+      gint not_enrolled = -1;
+
+      g_ptr_array_add (gallery->probes,
+                       bench_print_new (bench_capture_new (g_ptr_array_index (fingers, genuine), rand)));
+      g_array_append_val (gallery->probe_fingers, genuine);
+
+      g_ptr_array_add (gallery->probes,
+                       bench_print_new (bench_capture_new (g_ptr_array_index (fingers, size + i), rand)));
+      g_array_append_val (gallery->probe_fingers, not_enrolled);
+    }
+
+  g_ptr_array_unref (fingers);
+}
+
+typedef gint (*IdentifyFunc) (GPtrArray *templates,
+                              FpPrint   *probe);
+
+static gint
+identify_match (GPtrArray *templates, FpPrint *probe)
+{
+  for (guint i = 0; i < templates->len; i++)
+    {
+      g_autoptr(GError) error = NULL;
+
+      if (fpi_print_bz3_match (g_ptr_array_index (templates, i), probe,
+                               bz3_threshold, &error) == FPI_MATCH_SUCCESS)
+        return i;
+
+      if (error)
+        g_error ("Matching failed: %s", error->message);
+    }
+
+  return -1;
+}
+
+static gint
+identify_identify (GPtrArray *templates, FpPrint *probe)
+{
+  g_autoptr(GError) error = NULL;
+  FpPrint *match;
+  guint idx;
+
+  match = fpi_print_bz3_identify (templates, probe, bz3_threshold, NULL, &error);
+  if (error)
+    g_error ("Identification failed: %s", error->message);
+
+  if (!match)
+    return -1;
+
+  g_assert_true (g_ptr_array_find (templates, match, &idx));
+
+  return idx;
+}
+
+static gint
+compare_int64 (gconstpointer a, gconstpointer b)
+{
+  const gint64 *ia = a;
+  const gint64 *ib = b;
+
+  return (*ia > *ib) - (*ia < *ib);
+}
+
+static gdouble
+percentile (GArray *sorted, gdouble p)
+{
+  guint idx = (guint) ceil (p * sorted->len);
+
+  return g_array_index (sorted, gint64, CLAMP (idx, 1, sorted->len) - 1) * 1000.0;
+}
+
+static void
+bench_identify (Gallery *gallery, const gchar *name, IdentifyFunc func)
+{
+  g_autoptr(GArray) latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+  guint genuine = 0, impostor = 0;
+  guint false_matches = 0, false_non_matches = 0, misidentified = 0;
+
+  /* An impostor probe goes through the whole gallery, which builds all the
+   * cached gallery Webs, like on a device that holds on to the prints. */
+  func (gallery->templates, g_ptr_array_index (gallery->probes, 1));
+
+  for (guint i = 0; i < gallery->probes->len; i++)
+    {
+      gint finger = g_array_index (gallery->probe_fingers, gint, i);
+      gint64 start, elapsed;
+      gint result;
+
+      start = g_get_monotonic_time ();
+      result = func (gallery->templates, g_ptr_array_index (gallery->probes, i));
+      elapsed = g_get_monotonic_time () - start;
+      g_array_append_val (latencies, elapsed);
+
+      if (finger < 0)
+        {
+          impostor++;
+          if (result >= 0)
+            false_matches++;
+        }
+      else
+        {
+          genuine++;
+          if (result < 0)
+            false_non_matches++;
+          else if (result != finger)
+            misidentified++;
+        }
+    }
+
+  g_array_sort (latencies, compare_int64);
+
+  g_print ("{\"benchmark\": \"identify\", \"path\": \"%s\", "
+           "\"gallery_size\": %u, \"probes\": %u, \"threshold\": %d, "
+           "\"p50_ns\": %.0f, \"p90_ns\": %.0f, \"p99_ns\": %.0f, \"max_ns\": %.0f, "
+           "\"false_match_rate\": %.4f, \"false_non_match_rate\": %.4f, "
+           "\"misidentification_rate\": %.4f, "
+           "\"peak_rss_kib\": %lu}\n",
+           name, gallery->templates->len, latencies->len, bz3_threshold,
+           percentile (latencies, 0.5), percentile (latencies, 0.9),
+           percentile (latencies, 0.99), percentile (latencies, 1.0),
+           (gdouble) false_matches / impostor,
+           (gdouble) false_non_matches / genuine,
+           (gdouble) misidentified / genuine,
+           bench_get_peak_rss ());
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GPtrArray) samples = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GStrv) sizes = NULL;
+
+  context = g_option_context_new ("- benchmark 1:N identification");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (n_probes < 1)
+    {
+      g_printerr ("At least one probe is needed\n");
+      return 1;
+    }
+
+  samples = bench_load_sample_xyts ();
+
+  sizes = g_strsplit (sizes_arg ? sizes_arg : "10,100,1000,10000", ",", -1);
+  for (guint i = 0; sizes[i]; i++)
+    {
+      g_autoptr(GRand) rand = g_rand_new_with_seed (seed);
+      Gallery gallery = { NULL, };
+      guint64 size;
+
+      if (!g_ascii_string_to_unsigned (sizes[i], 10, 1, G_MAXINT, &size, &error))
+        {
+          g_printerr ("Invalid gallery size: %s\n", error->message);
+          return 1;
+        }
+
+      gallery_init (&gallery, samples, size, rand);
+      bench_identify (&gallery, "fpi_print_bz3_match", identify_match);
+      bench_identify (&gallery, "fpi_print_bz3_identify", identify_identify);
+      gallery_clear (&gallery);
+    }
+
+  return 0;
+}
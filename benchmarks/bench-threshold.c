@@ -0,0 +1,472 @@
+/*
+ * BZ3 threshold evaluation from a cached score matrix
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Every print of a dataset is matched against every other print of the
+ * same dataset exactly once, which gives the full genuine and impostor
+ * score matrix. The matrices can be cached in a file, so that sweeping
+ * another range of thresholds does not need to match anything again.
+ *
+ * The dataset is either made of synthetic fingers (see bench-identify.c),
+ * or a directory with one subdirectory per driver, each holding one
+ * subdirectory of PNG captures per finger:
+ *
+ *   DIR/<driver>/<finger>/<capture>.png
+ *
+ * For every driver and threshold, the false accept and false reject
+ * rates are printed as one JSON object. A last object per driver gives
+ * the threshold that is closest to the equal error rate.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "bench-utils.h"
+
+#define CACHE_TYPE G_VARIANT_TYPE ("a(saiai)")
+
+static gchar *dataset_dir = NULL;
+static gchar *cache_file = NULL;
+static gchar *thresholds_arg = NULL;
+static gint n_fingers = 20;
+static gint n_captures = 5;
+static gint seed = 0;
+
+static GOptionEntry entries[] = {
+  { "dataset", 0, 0, G_OPTION_ARG_FILENAME, &dataset_dir,
+    "Directory with DRIVER/FINGER/CAPTURE.png images (default: synthetic)", "DIR" },
+  { "cache", 0, 0, G_OPTION_ARG_FILENAME, &cache_file,
+    "Load the score matrices from FILE, or save them there if it does not exist", "FILE" },
+  { "thresholds", 0, 0, G_OPTION_ARG_STRING, &thresholds_arg,
+    "Thresholds to evaluate (default: 10:100:2)", "MIN:MAX:STEP" },
+  { "fingers", 0, 0, G_OPTION_ARG_INT, &n_fingers,
+    "Number of synthetic fingers (default: 20)", "N" },
+  { "captures", 0, 0, G_OPTION_ARG_INT, &n_captures,
+    "Captures per synthetic finger (default: 5)", "N" },
+  { "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+    "Seed for the synthetic fingers (default: 0)", "SEED" },
+  { NULL }
+};
+
+typedef struct
+{
+  gchar  *driver;
+  /* The finger of every print */
+  GArray *fingers;
+  /* Score of print i as the probe against print j, at i * n + j */
+  GArray *scores;
+} ScoreMatrix;
+
+static void
+score_matrix_free (ScoreMatrix *matrix)
+{
+  g_free (matrix->driver);
+  g_array_unref (matrix->fingers);
+  g_array_unref (matrix->scores);
+  g_free (matrix);
+}
+
+static ScoreMatrix *
+score_matrix_compute (const gchar *driver,
+                      GPtrArray   *prints,
+                      GArray      *fingers)
+{
+  g_autoptr(GHashTable) index = g_hash_table_new (NULL, NULL);
+  ScoreMatrix *matrix;
+  guint n = prints->len;
+  gint64 start = g_get_monotonic_time ();
+
+  matrix = g_new0 (ScoreMatrix, 1);
+  matrix->driver = g_strdup (driver);
+  matrix->fingers = g_array_ref (fingers);
+  matrix->scores = g_array_new (FALSE, TRUE, sizeof (gint));
+  g_array_set_size (matrix->scores, n * n);
+
+  for (guint i = 0; i < n; i++)
+    g_hash_table_insert (index, g_ptr_array_index (prints, i), GUINT_TO_POINTER (i));
+
+  /* Each probe is scored against all prints in parallel */
+  for (guint i = 0; i < n; i++)
+    {
+      g_autoptr(GArray) results = NULL;
+      g_autoptr(GError) error = NULL;
+
+      results = fpi_print_bz3_identify_scores (prints, g_ptr_array_index (prints, i),
+                                               0, &error);
+      if (!results)
+        g_error ("Matching failed: %s", error->message);
+
+      for (guint r = 0; r < results->len; r++)
+        {
+          FpiBz3Score *result = &g_array_index (results, FpiBz3Score, r);
+          guint j = GPOINTER_TO_UINT (g_hash_table_lookup (index, result->template));
+
+          g_array_index (matrix->scores, gint, i * n + j) = result->score;
+        }
+    }
+
+  g_printerr ("Scored %u prints of %s in %.1f s\n", n, driver,
+              (g_get_monotonic_time () - start) / (gdouble) G_USEC_PER_SEC);
+
+  return matrix;
+}
+
+static GPtrArray *
+dataset_synthetic (void)
+{
+  g_autoptr(GPtrArray) samples = bench_load_sample_xyts ();
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GArray) fingers = g_array_new (FALSE, FALSE, sizeof (gint));
+  g_autoptr(GRand) rand = g_rand_new_with_seed (seed);
+  GPtrArray *matrices = g_ptr_array_new_with_free_func ((GDestroyNotify) score_matrix_free);
+
+  for (gint f = 0; f < n_fingers; f++)
+    {
+      g_autofree struct xyt_struct *finger = NULL;
+
+      finger = bench_finger_new (g_ptr_array_index (samples, f % samples->len), rand);
+      for (gint c = 0; c < n_captures; c++)
+        {
+          g_ptr_array_add (prints, bench_print_new (bench_capture_new (finger, rand)));
+          g_array_append_val (fingers, f);
+        }
+    }
+
+  g_ptr_array_add (matrices, score_matrix_compute ("synthetic", prints, fingers));
+
+  return matrices;
+}
+
+static gint
+compare_names (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* The sorted names of the entries of @path that satisfy @test */
+static GPtrArray *
+list_dir (const gchar *path, GFileTest test, const gchar *suffix)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GDir) dir = NULL;
+  GPtrArray *names;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, &error);
+  if (!dir)
+    g_error ("Could not open %s: %s", path, error->message);
+
+  names = g_ptr_array_new_with_free_func (g_free);
+  while ((name = g_dir_read_name (dir)))
+    {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+
+      if (suffix && !g_str_has_suffix (name, suffix))
+        continue;
+
+      if (g_file_test (child, test))
+        g_ptr_array_add (names, g_strdup (name));
+    }
+  g_ptr_array_sort (names, compare_names);
+
+  return names;
+}
+
+static GPtrArray *
+dataset_load (const gchar *path)
+{
+  g_autoptr(GPtrArray) drivers = list_dir (path, G_FILE_TEST_IS_DIR, NULL);
+  GPtrArray *matrices = g_ptr_array_new_with_free_func ((GDestroyNotify) score_matrix_free);
+
+  for (guint d = 0; d < drivers->len; d++)
+    {
+      const gchar *driver = g_ptr_array_index (drivers, d);
+      g_autofree gchar *driver_path = g_build_filename (path, driver, NULL);
+      g_autoptr(GPtrArray) finger_names = list_dir (driver_path, G_FILE_TEST_IS_DIR, NULL);
+      g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+      g_autoptr(GArray) fingers = g_array_new (FALSE, FALSE, sizeof (gint));
+
+      for (guint f = 0; f < finger_names->len; f++)
+        {
+          g_autofree gchar *finger_path = NULL;
+          g_autoptr(GPtrArray) captures = NULL;
+
+          finger_path = g_build_filename (driver_path, g_ptr_array_index (finger_names, f), NULL);
+          captures = list_dir (finger_path, G_FILE_TEST_IS_REGULAR, ".png");
+
+          for (guint c = 0; c < captures->len; c++)
+            {
+              g_autofree gchar *capture_path = NULL;
+
+              capture_path = g_build_filename (finger_path, g_ptr_array_index (captures, c), NULL);
+              g_ptr_array_add (prints, bench_load_print (capture_path));
+              g_array_append_val (fingers, f);
+            }
+        }
+
+      g_ptr_array_add (matrices, score_matrix_compute (driver, prints, fingers));
+    }
+
+  return matrices;
+}
+
+static GPtrArray *
+cache_load (const gchar *path, GError **error)
+{
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GVariantIter) iter = NULL;
+  GPtrArray *matrices;
+  const gchar *driver;
+  GVariant *fingers_var, *scores_var;
+  gchar *contents;
+  gsize length;
+
+  if (!g_file_get_contents (path, &contents, &length, error))
+    return NULL;
+
+  cache = g_variant_new_from_data (CACHE_TYPE, contents, length, FALSE,
+                                   g_free, contents);
+  g_variant_ref_sink (cache);
+
+  matrices = g_ptr_array_new_with_free_func ((GDestroyNotify) score_matrix_free);
+
+  g_variant_get (cache, "a(saiai)", &iter);
+  while (g_variant_iter_next (iter, "(&s@ai@ai)", &driver, &fingers_var, &scores_var))
+    {
+      g_autoptr(GVariant) fingers_owned = fingers_var;
+      g_autoptr(GVariant) scores_owned = scores_var;
+      ScoreMatrix *matrix;
+      const gint32 *data;
+      gsize n, n_scores;
+
+      data = g_variant_get_fixed_array (fingers_owned, &n, sizeof (gint32));
+      matrix = g_new0 (ScoreMatrix, 1);
+      matrix->driver = g_strdup (driver);
+      matrix->fingers = g_array_new (FALSE, FALSE, sizeof (gint));
+      g_array_append_vals (matrix->fingers, data, n);
+
+      data = g_variant_get_fixed_array (scores_owned, &n_scores, sizeof (gint32));
+      matrix->scores = g_array_new (FALSE, FALSE, sizeof (gint));
+      g_array_append_vals (matrix->scores, data, n_scores);
+
+      g_ptr_array_add (matrices, matrix);
+
+      if (n_scores != n * n)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "Score matrix of %s in %s is corrupt", driver, path);
+          g_ptr_array_unref (matrices);
+          return NULL;
+        }
+    }
+
+  return matrices;
+}
+
+static gboolean
+cache_save (const gchar *path, GPtrArray *matrices, GError **error)
+{
+  g_autoptr(GVariant) cache = NULL;
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, CACHE_TYPE);
+  for (guint i = 0; i < matrices->len; i++)
+    {
+      ScoreMatrix *matrix = g_ptr_array_index (matrices, i);
+
+      g_variant_builder_add (&builder, "(s@ai@ai)", matrix->driver,
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                        matrix->fingers->data,
+                                                        matrix->fingers->len,
+                                                        sizeof (gint32)),
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
+                                                        matrix->scores->data,
+                                                        matrix->scores->len,
+                                                        sizeof (gint32)));
+    }
+  cache = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  return g_file_set_contents (path, g_variant_get_data (cache),
+                              g_variant_get_size (cache), error);
+}
+
+static gint
+compare_int (gconstpointer a, gconstpointer b)
+{
+  const gint *ia = a;
+  const gint *ib = b;
+
+  return (*ia > *ib) - (*ia < *ib);
+}
+
+/* Number of scores in @sorted that are below @threshold */
+static guint
+count_below (GArray *sorted, gint threshold)
+{
+  guint lo = 0, hi = sorted->len;
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+
+      if (g_array_index (sorted, gint, mid) < threshold)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+/* A match is reported for scores at or above the threshold */
+static void
+sweep (ScoreMatrix *matrix, gint min, gint max, gint step)
+{
+  g_autoptr(GArray) genuine = g_array_new (FALSE, FALSE, sizeof (gint));
+  g_autoptr(GArray) impostor = g_array_new (FALSE, FALSE, sizeof (gint));
+  guint n = matrix->fingers->len;
+  gdouble best_diff = G_MAXDOUBLE;
+  gdouble best_far = 0, best_frr = 0;
+  gint best_threshold = min;
+
+  for (guint i = 0; i < n; i++)
+    for (guint j = 0; j < n; j++)
+      {
+        gint score = g_array_index (matrix->scores, gint, i * n + j);
+
+        if (i == j)
+          continue;
+
+        if (g_array_index (matrix->fingers, gint, i) == g_array_index (matrix->fingers, gint, j))
+          g_array_append_val (genuine, score);
+        else
+          g_array_append_val (impostor, score);
+      }
+
+  if (genuine->len == 0 || impostor->len == 0)
+    {
+      g_printerr ("Skipping %s, it needs several captures of several fingers\n",
+                  matrix->driver);
+      return;
+    }
+
+  g_array_sort (genuine, compare_int);
+  g_array_sort (impostor, compare_int);
+
+  for (gint threshold = min; threshold <= max; threshold += step)
+    {
+      gdouble frr = (gdouble) count_below (genuine, threshold) / genuine->len;
+      gdouble far = (gdouble) (impostor->len - count_below (impostor, threshold)) / impostor->len;
+
+      g_print ("{\"benchmark\": \"threshold\", \"driver\": \"%s\", \"threshold\": %d, "
+               "\"genuine\": %u, \"impostor\": %u, "
+               "\"false_accept_rate\": %.4f, \"false_reject_rate\": %.4f}\n",
+               matrix->driver, threshold, genuine->len, impostor->len, far, frr);
+
+      if (ABS (far - frr) < best_diff)
+        {
+          best_diff = ABS (far - frr);
+          best_threshold = threshold;
+          best_far = far;
+          best_frr = frr;
+        }
+    }
+
+  g_print ("{\"benchmark\": \"threshold-eer\", \"driver\": \"%s\", \"threshold\": %d, "
+           "\"false_accept_rate\": %.4f, \"false_reject_rate\": %.4f}\n",
+           matrix->driver, best_threshold, best_far, best_frr);
+}
+
+static gboolean
+parse_thresholds (const gchar *arg, gint *min, gint *max, gint *step, GError **error)
+{
+  g_auto(GStrv) parts = g_strsplit (arg, ":", -1);
+  gint64 values[3];
+
+  if (g_strv_length (parts) != 3)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Thresholds must be given as MIN:MAX:STEP");
+      return FALSE;
+    }
+
+  for (guint i = 0; i < 3; i++)
+    if (!g_ascii_string_to_signed (parts[i], 10, i == 2 ? 1 : 0, G_MAXINT / 2,
+                                   &values[i], error))
+      return FALSE;
+
+  *min = values[0];
+  *max = values[1];
+  *step = values[2];
+
+  return TRUE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GPtrArray) matrices = NULL;
+  g_autoptr(GError) error = NULL;
+  gint min, max, step;
+
+  context = g_option_context_new ("- evaluate BZ3 match thresholds");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error) ||
+      !parse_thresholds (thresholds_arg ? thresholds_arg : "10:100:2",
+                         &min, &max, &step, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (n_fingers < 2 || n_captures < 2)
+    {
+      g_printerr ("At least two fingers with two captures each are needed\n");
+      return 1;
+    }
+
+  if (cache_file && g_file_test (cache_file, G_FILE_TEST_EXISTS))
+    {
+      matrices = cache_load (cache_file, &error);
+      if (!matrices)
+        {
+          g_printerr ("Could not load the cache: %s\n", error->message);
+          return 1;
+        }
+    }
+  else
+    {
+      if (dataset_dir)
+        matrices = dataset_load (dataset_dir);
+      else
+        matrices = dataset_synthetic ();
+
+      if (cache_file && !cache_save (cache_file, matrices, &error))
+        {
+          g_printerr ("Could not save the cache: %s\n", error->message);
+          return 1;
+        }
+    }
+
+  for (guint i = 0; i < matrices->len; i++)
+    sweep (g_ptr_array_index (matrices, i), min, max, step);
+
+  return 0;
+}
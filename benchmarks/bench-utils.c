@@ -0,0 +1,246 @@
+/*
+ * Helpers for the libfprint benchmarks
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <cairo.h>
+#include <math.h>
+#include <sys/resource.h>
+
+#include "fp-print-private.h"
+#include "bench-utils.h"
+#include "bench-config.h"
+
+/* Most sensors are run at 500 dpi */
+#define BENCH_PPMM 19.685
+
+const gchar * const bench_sample_images[] = {
+  "examples/prints/arch.png",
+  "examples/prints/loop-right.png",
+  "examples/prints/tented_arch.png",
+  "examples/prints/whorl.png",
+  "tests/elan/capture.png",
+  "tests/vfs5011/capture.png",
+};
+const guint bench_n_sample_images = G_N_ELEMENTS (bench_sample_images);
+
+/* Loads the green channel of a sample image as 8-bit grey pixels, @name
+ * is relative to the source root unless it is absolute */
+FpImage *
+bench_load_image (const gchar *name)
+{
+  g_autofree gchar *path = NULL;
+  cairo_surface_t *surf;
+  FpImage *img;
+  guchar *data;
+  gint width, height, stride;
+
+  if (g_path_is_absolute (name))
+    path = g_strdup (name);
+  else
+    path = g_build_filename (SOURCE_ROOT, name, NULL);
+  surf = cairo_image_surface_create_from_png (path);
+  if (cairo_surface_status (surf) != CAIRO_STATUS_SUCCESS)
+    g_error ("Could not load %s: %s", path,
+             cairo_status_to_string (cairo_surface_status (surf)));
+
+  width = cairo_image_surface_get_width (surf);
+  height = cairo_image_surface_get_height (surf);
+  stride = cairo_image_surface_get_stride (surf);
+  data = cairo_image_surface_get_data (surf);
+
+  img = fp_image_new (width, height);
+  img->ppmm = BENCH_PPMM;
+  for (gint y = 0; y < height; y++)
+    for (gint x = 0; x < width; x++)
+      img->data[x + y * width] = data[x * 4 + y * stride + 1];
+
+  cairo_surface_destroy (surf);
+
+  return img;
+}
+
+static void
+detect_minutiae_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  gboolean *done = user_data;
+
+  if (!fp_image_detect_minutiae_finish (FP_IMAGE (source_object), res, &error))
+    g_error ("Minutiae detection failed: %s", error->message);
+
+  *done = TRUE;
+}
+
+FpPrint *
+bench_load_print (const gchar *name)
+{
+  g_autoptr(FpImage) img = bench_load_image (name);
+  g_autoptr(GError) error = NULL;
+  FpPrint *print;
+  gboolean done = FALSE;
+
+  fp_image_detect_minutiae (img, NULL, detect_minutiae_cb, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  print = g_object_new (FP_TYPE_PRINT,
+                        "driver", "bench",
+                        "device-id", "bench",
+                        NULL);
+  g_object_ref_sink (print);
+  fpi_print_set_type (print, FPI_PRINT_NBIS);
+  if (!fpi_print_add_from_image (print, img, &error))
+    g_error ("Could not create print from %s: %s", name, error->message);
+
+  return print;
+}
+
+/* The minutiae of all sample images, as struct xyt_struct */
+GPtrArray *
+bench_load_sample_xyts (void)
+{
+  GPtrArray *samples = g_ptr_array_new_with_free_func (g_free);
+
+  for (guint i = 0; i < bench_n_sample_images; i++)
+    {
+      g_autoptr(FpPrint) print = bench_load_print (bench_sample_images[i]);
+      struct xyt_struct scratch;
+
+      g_ptr_array_add (samples, g_memdup (fpi_print_get_xyt (print, 0, &scratch),
+                                          sizeof (struct xyt_struct)));
+    }
+
+  return samples;
+}
+
+/* Synthetic fingers and captures of them, for benchmarks that need
+ * more prints than there are sample images. See bench-identify.c for
+ * how they are derived. */
+
+/* Displacement that turns a sample into a different finger */
+#define FINGER_SHIFT    30
+#define FINGER_ROTATION 40
+
+/* Differences between two captures of the same finger */
+#define CAPTURE_ROTATION 15
+#define CAPTURE_SHIFT    20
+#define CAPTURE_JITTER   2
+#define CAPTURE_THETA    5
+#define CAPTURE_DROPOUT  0.2
+
+static gint
+normalize_theta (gint theta)
+{
+  theta %= 360;
+  if (theta > 180)
+    theta -= 360;
+  else if (theta <= -180)
+    theta += 360;
+
+  return theta;
+}
+
+struct xyt_struct *
+bench_finger_new (const struct xyt_struct *sample, GRand *rand)
+{
+  struct xyt_struct *finger = g_new0 (struct xyt_struct, 1);
+
+  for (gint i = 0; i < sample->nrows; i++)
+    {
+      finger->xcol[i] = sample->xcol[i] + g_rand_int_range (rand, -FINGER_SHIFT, FINGER_SHIFT + 1);
+      finger->ycol[i] = sample->ycol[i] + g_rand_int_range (rand, -FINGER_SHIFT, FINGER_SHIFT + 1);
+      finger->thetacol[i] = normalize_theta (sample->thetacol[i] +
+                                             g_rand_int_range (rand, -FINGER_ROTATION, FINGER_ROTATION + 1));
+    }
+  finger->nrows = sample->nrows;
+
+  return finger;
+}
+
+/* The xyt coordinates have the y axis pointing up and counter-clockwise
+ * angles, so a rotation by a turns every minutia by a as well. */
+struct xyt_struct *
+bench_capture_new (const struct xyt_struct *finger, GRand *rand)
+{
+  struct xyt_struct *capture = g_new0 (struct xyt_struct, 1);
+  gdouble cx = 0, cy = 0;
+  gdouble angle, cos_a, sin_a;
+  gint rotation, dx, dy;
+
+  for (gint i = 0; i < finger->nrows; i++)
+    {
+      cx += finger->xcol[i];
+      cy += finger->ycol[i];
+    }
+  cx /= MAX (finger->nrows, 1);
+  cy /= MAX (finger->nrows, 1);
+
+  rotation = g_rand_int_range (rand, -CAPTURE_ROTATION, CAPTURE_ROTATION + 1);
+  angle = rotation * G_PI / 180;
+  cos_a = cos (angle);
+  sin_a = sin (angle);
+  dx = g_rand_int_range (rand, -CAPTURE_SHIFT, CAPTURE_SHIFT + 1);
+  dy = g_rand_int_range (rand, -CAPTURE_SHIFT, CAPTURE_SHIFT + 1);
+
+  for (gint i = 0; i < finger->nrows; i++)
+    {
+      gdouble x = finger->xcol[i] - cx;
+      gdouble y = finger->ycol[i] - cy;
+      gint n = capture->nrows;
+
+      if (g_rand_double (rand) < CAPTURE_DROPOUT)
+        continue;
+
+      capture->xcol[n] = (gint) round (cx + cos_a * x - sin_a * y) + dx +
+                         g_rand_int_range (rand, -CAPTURE_JITTER, CAPTURE_JITTER + 1);
+      capture->ycol[n] = (gint) round (cy + sin_a * x + cos_a * y) + dy +
+                         g_rand_int_range (rand, -CAPTURE_JITTER, CAPTURE_JITTER + 1);
+      capture->thetacol[n] = normalize_theta (finger->thetacol[i] + rotation +
+                                              g_rand_int_range (rand, -CAPTURE_THETA, CAPTURE_THETA + 1));
+      capture->nrows++;
+    }
+
+  return capture;
+}
+
+FpPrint *
+bench_print_new (struct xyt_struct *xyt)
+{
+  FpPrint *print;
+
+  print = g_object_new (FP_TYPE_PRINT,
+                        "driver", "bench",
+                        "device-id", "bench",
+                        NULL);
+  g_object_ref_sink (print);
+  fpi_print_set_type (print, FPI_PRINT_NBIS);
+  g_ptr_array_add (print->prints, xyt);
+
+  return print;
+}
+
+/* Peak resident set size of the process in KiB */
+gulong
+bench_get_peak_rss (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+
+  return usage.ru_maxrss;
+}
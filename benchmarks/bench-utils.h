@@ -0,0 +1,41 @@
+/*
+ * Helpers for the libfprint benchmarks
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <glib.h>
+#include "fpi-image.h"
+#include "fpi-print.h"
+
+/* The examples/prints images and the umockdev test captures, relative
+ * to the source root */
+extern const gchar * const bench_sample_images[];
+extern const guint bench_n_sample_images;
+
+FpImage * bench_load_image (const gchar *name);
+FpPrint * bench_load_print (const gchar *name);
+GPtrArray * bench_load_sample_xyts (void);
+
+struct xyt_struct * bench_finger_new (const struct xyt_struct *sample,
+                                      GRand                   *rand);
+struct xyt_struct * bench_capture_new (const struct xyt_struct *finger,
+                                       GRand                   *rand);
+FpPrint * bench_print_new (struct xyt_struct *xyt);
+
+gulong bench_get_peak_rss (void);
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+
+# Replays the umockdev recordings of a driver test as fast as possible and
+# prints the time spent in each phase as one JSON object per run.
+#
+# Usage: replay-benchmark.py [--runs N] DIRECTORY
+
+import argparse
+import json
+import os
+import os.path
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--runs', type=int, default=5)
+parser.add_argument('ddir', help='directory with the test data')
+args = parser.parse_args()
+
+try:
+    subprocess.check_output(['umockdev-run', '--version'])
+except FileNotFoundError:
+    print('umockdev-run not found, skipping benchmark!')
+    sys.exit(77)
+
+bdir = os.path.dirname(sys.argv[0])
+tdir = os.path.join(os.getenv('MESON_SOURCE_ROOT', os.path.join(bdir, '..')), 'tests')
+ddir = args.ddir
+driver = os.path.basename(os.path.normpath(ddir))
+
+assert os.path.isfile(os.path.join(ddir, "device"))
+
+# Timings that libfprint itself logs, e.g. "Minutiae scan completed in 0.1 secs"
+core_timings = {
+    'calc delta': 'movement-estimation',
+    'Frame assembling': 'assemble',
+    'Line assembling': 'assemble',
+    'Minutiae scan': 'minutiae-scan',
+}
+core_timing_re = re.compile(r'(%s) completed in ([0-9.]+) secs' %
+                            '|'.join(re.escape(k) for k in core_timings))
+
+def get_umockdev_runner(ioctl_basename):
+    ioctl = os.path.join(ddir, "{}.ioctl".format(ioctl_basename))
+    device = os.path.join(ddir, "device")
+    dev = open(ioctl).readline().strip()
+    assert dev.startswith('@DEV ')
+    dev = dev[5:]
+
+    return ['umockdev-run', '-d', device,
+            '-i', "%s=%s" % (dev, ioctl),
+            '--', sys.executable, os.path.join(bdir, 'replay-timing.py')]
+
+def replay(recording, script_args, tmpdir):
+    output = os.path.join(tmpdir, 'timing.json')
+    env = dict(os.environ)
+    env['REPLAY_TIMING_OUTPUT'] = output
+    # The core timings are only available as debug messages
+    env['G_MESSAGES_DEBUG'] = 'all'
+
+    res = subprocess.run(get_umockdev_runner(recording) + script_args,
+                         env=env, stdout=subprocess.DEVNULL,
+                         stderr=subprocess.PIPE, universal_newlines=True)
+    if res.returncode != 0:
+        sys.stderr.write(res.stderr)
+        raise subprocess.CalledProcessError(res.returncode, res.args)
+
+    with open(output) as f:
+        phases = json.load(f)
+
+    core = {}
+    for line in res.stderr.splitlines():
+        m = core_timing_re.search(line)
+        if m:
+            name = core_timings[m.group(1)]
+            core[name] = core.get(name, 0) + int(float(m.group(2)) * 1e9)
+
+    return phases, core
+
+recordings = []
+if os.path.exists(os.path.join(ddir, "capture.ioctl")):
+    recordings.append(("capture", lambda tmpdir: [os.path.join(tdir, "capture.py"),
+                                                  os.path.join(tmpdir, "capture.png")]))
+if os.path.exists(os.path.join(ddir, "custom.ioctl")):
+    recordings.append(("custom", lambda tmpdir: [os.path.join(ddir, "custom.py")]))
+
+tmpdir = tempfile.mkdtemp(prefix='libfprint-replay-benchmark-')
+try:
+    for recording, script_args in recordings:
+        for run in range(args.runs):
+            phases, core = replay(recording, script_args(tmpdir), tmpdir)
+            print(json.dumps({
+                'benchmark': 'replay',
+                'driver': driver,
+                'recording': recording,
+                'run': run,
+                'phases': phases,
+                'core_ns': core,
+            }))
+finally:
+    shutil.rmtree(tmpdir)
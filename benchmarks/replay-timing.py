@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+
+# Runs a umockdev test script (capture.py or a driver's custom.py) and
+# records how long each device operation took. The results are written as
+# JSON to the file named by the REPLAY_TIMING_OUTPUT environment variable.
+
+import json
+import os
+import runpy
+import sys
+import time
+
+import gi
+gi.require_version('FPrint', '2.0')
+from gi.repository import FPrint, GLib
+
+if len(sys.argv) < 2:
+    print("Please specify the script to run and its arguments")
+    sys.exit(1)
+
+# The FpiImageDeviceState values
+STATE_INACTIVE = 0
+STATE_AWAIT_FINGER_ON = 1
+STATE_CAPTURE = 2
+STATE_AWAIT_FINGER_OFF = 3
+
+phases = []
+state_changes = []
+
+def now():
+    return time.monotonic(), time.process_time()
+
+def add_phase(name, start, end):
+    phases.append({
+        'phase': name,
+        'wall_ns': int((end[0] - start[0]) * 1e9),
+        'cpu_ns': int((end[1] - start[1]) * 1e9),
+    })
+
+def state_changed(dev, pspec):
+    try:
+        state = int(dev.get_property('fpi-image-device-state'))
+    except TypeError:
+        return
+    state_changes.append((state, now()))
+
+def add_image_phases(action_start, action_end):
+    # Between these, the driver activates the sensor and waits for the
+    # finger, captures the image and finally deactivates the sensor again.
+    capture_start = None
+    capture_end = None
+    deactivate_start = None
+
+    for state, t in state_changes:
+        if state == STATE_CAPTURE and capture_start is None:
+            capture_start = t
+        elif state == STATE_AWAIT_FINGER_OFF and capture_start is not None and capture_end is None:
+            capture_end = t
+        elif state == STATE_INACTIVE:
+            deactivate_start = t
+
+    if capture_start:
+        add_phase('activate', action_start, capture_start)
+    if capture_start and capture_end:
+        add_phase('capture', capture_start, capture_end)
+    if deactivate_start:
+        add_phase('deactivate', deactivate_start, action_end)
+
+    del state_changes[:]
+
+def detect_minutiae(img):
+    result = []
+
+    def done_cb(img, res):
+        try:
+            result.append(img.detect_minutiae_finish(res))
+        except GLib.Error as e:
+            result.append(e)
+
+    start = now()
+    img.detect_minutiae(None, done_cb)
+    ctx = GLib.main_context_default()
+    while not result:
+        ctx.iteration(True)
+    add_phase('detect', start, now())
+
+def wrap(name, phase, image_phases=False):
+    orig = getattr(FPrint.Device, name)
+
+    def timed(dev, *args, **kwargs):
+        if image_phases and isinstance(dev, FPrint.ImageDevice):
+            handler = dev.connect('notify::fpi-image-device-state', state_changed)
+        else:
+            handler = None
+
+        start = now()
+        try:
+            res = orig(dev, *args, **kwargs)
+        finally:
+            end = now()
+            add_phase(phase, start, end)
+            if handler is not None:
+                dev.disconnect(handler)
+                add_image_phases(start, end)
+
+        if name == 'capture_sync' and res is not None:
+            detect_minutiae(res)
+
+        return res
+
+    setattr(FPrint.Device, name, timed)
+
+wrap('open_sync', 'open')
+wrap('close_sync', 'close')
+wrap('capture_sync', 'capture-action', image_phases=True)
+wrap('enroll_sync', 'enroll-action', image_phases=True)
+wrap('verify_sync', 'match', image_phases=True)
+wrap('identify_sync', 'match', image_phases=True)
+wrap('list_prints_sync', 'list')
+wrap('delete_print_sync', 'delete')
+
+script = sys.argv[1]
+sys.argv = sys.argv[1:]
+try:
+    runpy.run_path(script, run_name='__main__')
+finally:
+    output = os.getenv('REPLAY_TIMING_OUTPUT')
+    if output:
+        with open(output, 'w') as f:
+            json.dump(phases, f)
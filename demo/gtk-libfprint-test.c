@@ -53,6 +53,8 @@ struct _LibfprintDemoWindow
   FpDevice            *dev;
 
   FpImage             *img;
+  GdkPixbuf           *raw_pixbuf;
+  GdkPixbuf           *binary_pixbuf;
   ImageDisplayFlags    img_flags;
 };
 
@@ -70,6 +72,7 @@ typedef enum {
 
 static void libfprint_demo_set_mode (LibfprintDemoWindow *win,
                                      LibfprintDemoMode    mode);
+static void update_image (LibfprintDemoWindow *win);
 
 static unsigned char *
 img_to_rgbdata (const guint8 *imgdata,
@@ -93,98 +96,111 @@ img_to_rgbdata (const guint8 *imgdata,
   return rgbdata;
 }
 
+static GdkPixbuf *
+rgbdata_to_pixbuf (const guint8 *imgdata,
+                   int           width,
+                   int           height)
+{
+  unsigned char *rgbdata;
+
+  if (!imgdata)
+    return NULL;
+
+  rgbdata = img_to_rgbdata (imgdata, width, height);
+
+  return gdk_pixbuf_new_from_data (rgbdata, GDK_COLORSPACE_RGB,
+                                   FALSE, 8, width, height,
+                                   width * 3, (GdkPixbufDestroyNotify) g_free,
+                                   NULL);
+}
+
 static void
-plot_minutiae (unsigned char *rgbdata,
-               int            width,
-               int            height,
-               GPtrArray     *minutiae)
+plot_minutiae (cairo_t   *cr,
+               GPtrArray *minutiae)
 {
   int i;
 
-#define write_pixel(num) do { \
-      rgbdata[((num) * 3)] = 0xff; \
-      rgbdata[((num) * 3) + 1] = 0; \
-      rgbdata[((num) * 3) + 2] = 0; \
-  } while(0)
+  cairo_set_source_rgb (cr, 1.0, 0.0, 0.0);
 
   for (i = 0; i < minutiae->len; i++)
     {
       struct fp_minutia *min = g_ptr_array_index (minutiae, i);
       int x, y;
-      size_t pixel_offset;
 
       fp_minutia_get_coords (min, &x, &y);
-      pixel_offset = (y * width) + x;
-      write_pixel (pixel_offset - 2);
-      write_pixel (pixel_offset - 1);
-      write_pixel (pixel_offset);
-      write_pixel (pixel_offset + 1);
-      write_pixel (pixel_offset + 2);
-
-      write_pixel (pixel_offset - (width * 2));
-      write_pixel (pixel_offset - (width * 1) - 1);
-      write_pixel (pixel_offset - (width * 1));
-      write_pixel (pixel_offset - (width * 1) + 1);
-      write_pixel (pixel_offset + (width * 1) - 1);
-      write_pixel (pixel_offset + (width * 1));
-      write_pixel (pixel_offset + (width * 1) + 1);
-      write_pixel (pixel_offset + (width * 2));
+      cairo_arc (cr, x + 0.5, y + 0.5, 2.5, 0, 2 * G_PI);
+      cairo_fill (cr);
     }
 }
 
-static GdkPixbuf *
-img_to_pixbuf (FpImage          *img,
-               ImageDisplayFlags flags)
+static gboolean
+capture_image_draw_cb (GtkWidget           *widget,
+                       cairo_t             *cr,
+                       LibfprintDemoWindow *win)
 {
-  int width;
-  int height;
-  const guint8 *data;
-  unsigned char *rgbdata;
-
-  width = fp_image_get_width (img);
-  height = fp_image_get_height (img);
+  GdkPixbuf *pixbuf;
+  int x, y;
 
-  if (flags & IMAGE_DISPLAY_BINARY)
-    data = fp_image_get_binarized (img, NULL);
+  if (win->img_flags & IMAGE_DISPLAY_BINARY)
+    pixbuf = win->binary_pixbuf;
   else
-    data = fp_image_get_data (img, NULL);
+    pixbuf = win->raw_pixbuf;
 
-  if (!data)
-    return NULL;
+  if (!pixbuf)
+    return FALSE;
+
+  x = (gtk_widget_get_allocated_width (widget) - gdk_pixbuf_get_width (pixbuf)) / 2;
+  y = (gtk_widget_get_allocated_height (widget) - gdk_pixbuf_get_height (pixbuf)) / 2;
+  cairo_translate (cr, x, y);
 
-  rgbdata = img_to_rgbdata (data, width, height);
+  gdk_cairo_set_source_pixbuf (cr, pixbuf, 0, 0);
+  cairo_paint (cr);
 
-  if (flags & IMAGE_DISPLAY_MINUTIAE)
+  /* Drawn on top, so toggling it does not touch the image */
+  if (win->img_flags & IMAGE_DISPLAY_MINUTIAE)
     {
-      GPtrArray *minutiae;
+      GPtrArray *minutiae = fp_image_get_minutiae (win->img);
 
-      minutiae = fp_image_get_minutiae (img);
-      plot_minutiae (rgbdata, width, height, minutiae);
+      if (minutiae)
+        plot_minutiae (cr, minutiae);
     }
 
-  return gdk_pixbuf_new_from_data (rgbdata, GDK_COLORSPACE_RGB,
-                                   FALSE, 8, width, height,
-                                   width * 3, (GdkPixbufDestroyNotify) g_free,
-                                   NULL);
+  return FALSE;
 }
 
+/* Converts both versions of the image once, switching between them
+ * only needs a redraw. */
 static void
-update_image (LibfprintDemoWindow *win)
+set_image (LibfprintDemoWindow *win,
+           FpImage             *img)
 {
-  GdkPixbuf *pixbuf;
+  g_clear_object (&win->img);
+  g_clear_object (&win->raw_pixbuf);
+  g_clear_object (&win->binary_pixbuf);
 
-  if (win->img == NULL)
+  win->img = img;
+
+  if (img)
     {
-      gtk_image_clear (GTK_IMAGE (win->capture_image));
-      return;
+      int width = fp_image_get_width (img);
+      int height = fp_image_get_height (img);
+
+      win->raw_pixbuf = rgbdata_to_pixbuf (fp_image_get_data (img, NULL),
+                                           width, height);
+      win->binary_pixbuf = rgbdata_to_pixbuf (fp_image_get_binarized (img, NULL),
+                                              width, height);
     }
 
+  update_image (win);
+}
+
+static void
+update_image (LibfprintDemoWindow *win)
+{
   g_debug ("Updating image, minutiae %s, binary mode %s",
            win->img_flags & IMAGE_DISPLAY_MINUTIAE ? "shown" : "hidden",
            win->img_flags & IMAGE_DISPLAY_BINARY ? "on" : "off");
-  pixbuf = img_to_pixbuf (win->img, win->img_flags);
-  gtk_image_set_from_pixbuf (GTK_IMAGE (win->capture_image), pixbuf);
-  g_object_unref (pixbuf);
+  gtk_widget_queue_draw (win->capture_image);
 }
 
 static void
@@ -246,9 +262,7 @@ dev_capture_start_cb (FpDevice     *dev,
       return;
     }
 
-  g_clear_object (&win->img);
-  win->img = image;
-  update_image (win);
+  set_image (win, image);
 
   libfprint_demo_set_mode (win, CAPTURE_MODE);
 }
@@ -286,7 +300,7 @@ activate_capture (GSimpleAction *action,
   LibfprintDemoWindow *win = user_data;
 
   libfprint_demo_set_mode (win, SPINNER_MODE);
-  g_clear_pointer (&win->img, g_object_unref);
+  set_image (win, NULL);
 
   g_clear_object (&win->cancellable);
   win->cancellable = g_cancellable_new ();
@@ -502,6 +516,8 @@ libfprint_demo_window_init (LibfprintDemoWindow *window)
   GPtrArray *devices;
 
   gtk_widget_init_template (GTK_WIDGET (window));
+  g_signal_connect (window->capture_image, "draw",
+                    G_CALLBACK (capture_image_draw_cb), window);
   gtk_window_set_default_size (GTK_WINDOW (window), 700, 500);
 
   g_action_map_add_action_entries (G_ACTION_MAP (window),
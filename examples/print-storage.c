@@ -0,0 +1,409 @@
+/*
+ * Log structured print storage for example programs
+ *
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The storage file is an append-only log of records:
+ *
+ *   "FPSTLOG1"                          file header
+ *   guint32 key length (LE)             record header
+ *   guint32 data length (LE)            or STORAGE_TOMBSTONE for a removal
+ *   key bytes, data bytes
+ *
+ * Saving a print appends a record, so it never rewrites what is already
+ * stored. Opening the file maps it and builds an index of the record
+ * headers, without reading the print data itself; lookups then return
+ * the data straight from the mapping. A record cut short by a crash is
+ * ignored and overwritten by the next append.
+ */
+
+#include "print-storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#define STORAGE_MAGIC "FPSTLOG1"
+#define STORAGE_MAGIC_LEN 8
+#define STORAGE_RECORD_HEADER_LEN 8
+#define STORAGE_TOMBSTONE G_MAXUINT32
+
+typedef struct
+{
+  gsize offset;      /* of the data */
+  gsize length;      /* of the data */
+  gsize record_size; /* including the record header and key */
+} RecordEntry;
+
+struct _PrintStorage
+{
+  char        *path;
+  GMappedFile *map;
+  GHashTable  *index;
+  gsize        end;
+  gsize        live_bytes;
+};
+
+static gboolean
+storage_map (PrintStorage *storage, GError **error)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  g_clear_pointer (&storage->map, g_mapped_file_unref);
+
+  storage->map = g_mapped_file_new (storage->path, FALSE, &local_error);
+  if (!storage->map && !g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static const guint8 *
+storage_get_data (PrintStorage *storage, gsize *size)
+{
+  if (!storage->map)
+    {
+      *size = 0;
+      return NULL;
+    }
+
+  *size = g_mapped_file_get_length (storage->map);
+  return (const guint8 *) g_mapped_file_get_contents (storage->map);
+}
+
+static void
+storage_index_insert (PrintStorage *storage,
+                      const char   *key,
+                      RecordEntry  *entry)
+{
+  RecordEntry *old;
+
+  old = g_hash_table_lookup (storage->index, key);
+  if (old)
+    storage->live_bytes -= old->record_size;
+
+  if (entry)
+    {
+      storage->live_bytes += entry->record_size;
+      g_hash_table_insert (storage->index, g_strdup (key), entry);
+    }
+  else
+    {
+      g_hash_table_remove (storage->index, key);
+    }
+}
+
+static gboolean
+storage_load_index (PrintStorage *storage, GError **error)
+{
+  const guint8 *data;
+  gsize size, pos;
+
+  data = storage_get_data (storage, &size);
+  if (size == 0)
+    return TRUE;
+
+  if (size < STORAGE_MAGIC_LEN || memcmp (data, STORAGE_MAGIC, STORAGE_MAGIC_LEN) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "%s is not a print storage file", storage->path);
+      return FALSE;
+    }
+
+  pos = STORAGE_MAGIC_LEN;
+  while (size - pos >= STORAGE_RECORD_HEADER_LEN)
+    {
+      g_autofree char *key = NULL;
+      RecordEntry *entry = NULL;
+      guint32 key_len, data_len;
+      gsize record_size;
+
+      memcpy (&key_len, data + pos, sizeof (key_len));
+      memcpy (&data_len, data + pos + 4, sizeof (data_len));
+      key_len = GUINT32_FROM_LE (key_len);
+      data_len = GUINT32_FROM_LE (data_len);
+
+      record_size = (gsize) STORAGE_RECORD_HEADER_LEN + key_len;
+      if (data_len != STORAGE_TOMBSTONE)
+        record_size += data_len;
+
+      /* Truncated record, the next append overwrites it */
+      if (record_size > size - pos)
+        break;
+
+      key = g_strndup ((const char *) data + pos + STORAGE_RECORD_HEADER_LEN, key_len);
+
+      if (data_len != STORAGE_TOMBSTONE)
+        {
+          entry = g_new0 (RecordEntry, 1);
+          entry->offset = pos + STORAGE_RECORD_HEADER_LEN + key_len;
+          entry->length = data_len;
+          entry->record_size = record_size;
+        }
+      storage_index_insert (storage, key, entry);
+
+      pos += record_size;
+    }
+
+  storage->end = pos;
+
+  return TRUE;
+}
+
+PrintStorage *
+print_storage_open (const char *path, GError **error)
+{
+  g_autoptr(PrintStorage) storage = NULL;
+
+  storage = g_new0 (PrintStorage, 1);
+  storage->path = g_strdup (path);
+  storage->index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  if (!storage_map (storage, error))
+    return NULL;
+
+  if (!storage_load_index (storage, error))
+    return NULL;
+
+  return g_steal_pointer (&storage);
+}
+
+void
+print_storage_free (PrintStorage *storage)
+{
+  g_clear_pointer (&storage->map, g_mapped_file_unref);
+  g_hash_table_destroy (storage->index);
+  g_free (storage->path);
+  g_free (storage);
+}
+
+GBytes *
+print_storage_lookup (PrintStorage *storage, const char *key)
+{
+  RecordEntry *entry;
+  const guint8 *data;
+  gsize size;
+
+  entry = g_hash_table_lookup (storage->index, key);
+  if (!entry)
+    return NULL;
+
+  /* Records appended since the file was mapped need a new mapping */
+  data = storage_get_data (storage, &size);
+  if (entry->offset + entry->length > size)
+    {
+      if (!storage_map (storage, NULL))
+        return NULL;
+
+      data = storage_get_data (storage, &size);
+      if (entry->offset + entry->length > size)
+        return NULL;
+    }
+
+  return g_bytes_new_with_free_func (data + entry->offset, entry->length,
+                                     (GDestroyNotify) g_mapped_file_unref,
+                                     g_mapped_file_ref (storage->map));
+}
+
+static gboolean
+write_all (int fd, const guint8 *data, gsize length)
+{
+  while (length > 0)
+    {
+      gssize r = write (fd, data, length);
+
+      if (r < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+
+      data += r;
+      length -= r;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+storage_append (PrintStorage *storage,
+                const char   *key,
+                const guint8 *data,
+                guint32       data_len,
+                gsize        *data_offset,
+                GError      **error)
+{
+  g_autoptr(GByteArray) record = g_byte_array_new ();
+  guint32 key_len = strlen (key);
+  guint32 val;
+  int saved_errno;
+  int fd;
+
+  if (storage->end == 0)
+    g_byte_array_append (record, (const guint8 *) STORAGE_MAGIC, STORAGE_MAGIC_LEN);
+
+  val = GUINT32_TO_LE (key_len);
+  g_byte_array_append (record, (const guint8 *) &val, sizeof (val));
+  val = GUINT32_TO_LE (data_len);
+  g_byte_array_append (record, (const guint8 *) &val, sizeof (val));
+  g_byte_array_append (record, (const guint8 *) key, key_len);
+  if (data_len != STORAGE_TOMBSTONE)
+    g_byte_array_append (record, data, data_len);
+
+  fd = g_open (storage->path, O_WRONLY | O_CREAT, 0666);
+  if (fd < 0)
+    goto error;
+
+  /* Drop a truncated record that may follow the last valid one */
+  if (ftruncate (fd, storage->end) < 0 ||
+      lseek (fd, storage->end, SEEK_SET) < 0 ||
+      !write_all (fd, record->data, record->len) ||
+      fsync (fd) < 0)
+    {
+      saved_errno = errno;
+      close (fd);
+      errno = saved_errno;
+      goto error;
+    }
+
+  if (close (fd) < 0)
+    goto error;
+
+  if (data_offset)
+    *data_offset = storage->end + record->len - (data_len != STORAGE_TOMBSTONE ? data_len : 0);
+  storage->end += record->len;
+
+  return TRUE;
+
+error:
+  saved_errno = errno;
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+               "Error writing to %s: %s", storage->path, g_strerror (saved_errno));
+  return FALSE;
+}
+
+gboolean
+print_storage_store (PrintStorage *storage,
+                     const char   *key,
+                     const guint8 *data,
+                     gsize         length,
+                     GError      **error)
+{
+  RecordEntry *entry;
+  gsize offset;
+
+  if (length >= STORAGE_TOMBSTONE || strlen (key) >= G_MAXUINT32)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FBIG,
+                   "Record for %s is too large", key);
+      return FALSE;
+    }
+
+  if (!storage_append (storage, key, data, length, &offset, error))
+    return FALSE;
+
+  entry = g_new0 (RecordEntry, 1);
+  entry->offset = offset;
+  entry->length = length;
+  entry->record_size = STORAGE_RECORD_HEADER_LEN + strlen (key) + length;
+  storage_index_insert (storage, key, entry);
+
+  return TRUE;
+}
+
+gboolean
+print_storage_remove (PrintStorage *storage,
+                      const char   *key,
+                      GError      **error)
+{
+  if (!g_hash_table_contains (storage->index, key))
+    return TRUE;
+
+  if (!storage_append (storage, key, NULL, STORAGE_TOMBSTONE, NULL, error))
+    return FALSE;
+
+  storage_index_insert (storage, key, NULL);
+
+  return TRUE;
+}
+
+/* Whether more than half of the file is taken by replaced or removed
+ * records. */
+gboolean
+print_storage_needs_compaction (PrintStorage *storage)
+{
+  if (storage->end <= STORAGE_MAGIC_LEN)
+    return FALSE;
+
+  return storage->end - STORAGE_MAGIC_LEN - storage->live_bytes > storage->live_bytes;
+}
+
+/* Rewrites the file with only the live records, atomically replacing it */
+gboolean
+print_storage_compact (PrintStorage *storage, GError **error)
+{
+  g_autoptr(GByteArray) contents = g_byte_array_new ();
+  GHashTableIter iter;
+  const guint8 *data;
+  RecordEntry *entry;
+  const char *key;
+  gsize size;
+
+  if (!storage_map (storage, error))
+    return FALSE;
+
+  data = storage_get_data (storage, &size);
+  if (size < storage->end)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_IO,
+                   "%s was truncated", storage->path);
+      return FALSE;
+    }
+
+  g_byte_array_append (contents, (const guint8 *) STORAGE_MAGIC, STORAGE_MAGIC_LEN);
+
+  g_hash_table_iter_init (&iter, storage->index);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &key, (gpointer *) &entry))
+    {
+      gsize record_start = entry->offset + entry->length - entry->record_size;
+
+      g_byte_array_append (contents, data + record_start, entry->record_size);
+    }
+
+  if (!g_file_set_contents (storage->path, (const char *) contents->data,
+                            contents->len, error))
+    return FALSE;
+
+  /* The index is unchanged, so it iterates in the same order again */
+  storage->end = STORAGE_MAGIC_LEN;
+  g_hash_table_iter_init (&iter, storage->index);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &key, (gpointer *) &entry))
+    {
+      storage->end += entry->record_size;
+      entry->offset = storage->end - entry->length;
+    }
+
+  return storage_map (storage, error);
+}
@@ -0,0 +1,45 @@
+/*
+ * Log structured print storage for example programs
+ *
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct _PrintStorage PrintStorage;
+
+PrintStorage * print_storage_open (const char *path,
+                                   GError    **error);
+void print_storage_free (PrintStorage *storage);
+
+GBytes * print_storage_lookup (PrintStorage *storage,
+                               const char   *key);
+gboolean print_storage_store (PrintStorage *storage,
+                              const char   *key,
+                              const guint8 *data,
+                              gsize         length,
+                              GError      **error);
+gboolean print_storage_remove (PrintStorage *storage,
+                               const char   *key,
+                               GError      **error);
+gboolean print_storage_compact (PrintStorage *storage,
+                                GError      **error);
+gboolean print_storage_needs_compaction (PrintStorage *storage);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PrintStorage, print_storage_free)
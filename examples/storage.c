@@ -23,6 +23,7 @@
 
 #include <libfprint/fprint.h>
 #include <libfprint/fpi-compat.h>
+#include "print-storage.h"
 #include "storage.h"
 
 #include <errno.h>
@@ -30,7 +31,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-#define STORAGE_FILE "test-storage.variant"
+#define STORAGE_FILE "test-storage.log"
 
 static char *
 get_print_data_descriptor (FpPrint *print, FpDevice *dev, FpFinger finger)
@@ -55,51 +56,17 @@ get_print_data_descriptor (FpPrint *print, FpDevice *dev, FpFinger finger)
                           finger);
 }
 
-static GVariantDict *
-load_data (void)
+static PrintStorage *
+open_storage (void)
 {
-  GVariantDict *res;
-  GVariant *var;
-  gchar *contents = NULL;
-  gsize length = 0;
-
-  if (!g_file_get_contents (STORAGE_FILE, &contents, &length, NULL))
-    {
-      g_warning ("Error loading storage, assuming it is empty");
-      return g_variant_dict_new (NULL);
-    }
-
-  var = g_variant_new_from_data (G_VARIANT_TYPE_VARDICT,
-                                 contents,
-                                 length,
-                                 FALSE,
-                                 g_free,
-                                 contents);
-
-  res = g_variant_dict_new (var);
-  g_variant_unref (var);
-  return res;
-}
-
-static int
-save_data (GVariant *data)
-{
-  const gchar *contents = NULL;
-  gsize length;
-
-  length = g_variant_get_size (data);
-  contents = (gchar *) g_variant_get_data (data);
-
-  if (!g_file_set_contents (STORAGE_FILE, contents, length, NULL))
-    {
-      g_warning ("Error saving storage,!");
-      return -1;
-    }
+  g_autoptr(GError) error = NULL;
+  PrintStorage *storage;
 
-  g_variant_ref_sink (data);
-  g_variant_unref (data);
+  storage = print_storage_open (STORAGE_FILE, &error);
+  if (!storage)
+    g_warning ("Error opening storage: %s", error->message);
 
-  return 0;
+  return storage;
 }
 
 int
@@ -108,13 +75,13 @@ print_data_save (FpPrint *print, FpFinger finger)
   g_autofree gchar *descr = get_print_data_descriptor (print, NULL, finger);
 
   g_autoptr(GError) error = NULL;
-  g_autoptr(GVariantDict) dict = NULL;
+  g_autoptr(PrintStorage) storage = NULL;
   g_autofree guchar *data = NULL;
-  GVariant *val;
   gsize size;
-  int res;
 
-  dict = load_data ();
+  storage = open_storage ();
+  if (!storage)
+    return -1;
 
   fp_print_serialize (print, &data, &size, &error);
   if (error)
@@ -122,12 +89,18 @@ print_data_save (FpPrint *print, FpFinger finger)
       g_warning ("Error serializing data: %s", error->message);
       return -1;
     }
-  val = g_variant_new_fixed_array (G_VARIANT_TYPE ("y"), data, size, 1);
-  g_variant_dict_insert_value (dict, descr, val);
 
-  res = save_data (g_variant_dict_end (dict));
+  if (!print_storage_store (storage, descr, data, size, &error))
+    {
+      g_warning ("Error saving storage: %s", error->message);
+      return -1;
+    }
+
+  if (print_storage_needs_compaction (storage) &&
+      !print_storage_compact (storage, &error))
+    g_warning ("Error compacting storage: %s", error->message);
 
-  return res;
+  return 0;
 }
 
 FpPrint *
@@ -135,20 +108,23 @@ print_data_load (FpDevice *dev, FpFinger finger)
 {
   g_autofree gchar *descr = get_print_data_descriptor (NULL, dev, finger);
 
-  g_autoptr(GVariant) val = NULL;
-  g_autoptr(GVariantDict) dict = NULL;
-  const guchar *stored_data = NULL;
-  gsize stored_len;
+  g_autoptr(PrintStorage) storage = NULL;
+  g_autoptr(GBytes) val = NULL;
+
+  storage = open_storage ();
+  if (!storage)
+    return NULL;
 
-  dict = load_data ();
-  val = g_variant_dict_lookup_value (dict, descr, G_VARIANT_TYPE ("ay"));
+  val = print_storage_lookup (storage, descr);
 
   if (val)
     {
       FpPrint *print;
       g_autoptr(GError) error = NULL;
+      const guchar *stored_data;
+      gsize stored_len;
 
-      stored_data = (const guchar *) g_variant_get_fixed_array (val, &stored_len, 1);
+      stored_data = g_bytes_get_data (val, &stored_len);
       print = fp_print_deserialize (stored_data, stored_len, &error);
 
       if (error)
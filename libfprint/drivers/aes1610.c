@@ -75,8 +75,7 @@ struct _FpiDeviceAes1610
   FpImageDevice parent;
 
   guint8        read_regs_retry_count;
-  GSList       *strips;
-  gsize         strips_len;
+  struct fpi_frame_ring *strips;
   gboolean      deactivating;
   guint8        blanks_count;
 };
@@ -89,6 +88,8 @@ static struct fpi_frame_asmbl_ctx assembling_ctx = {
   .frame_height = FRAME_HEIGHT,
   .image_width = IMAGE_WIDTH,
   .get_pixel = aes_get_pixel,
+  .get_row = aes_get_row,
+  .duplicate_threshold = AES_DUPLICATE_THRESHOLD,
 };
 
 typedef void (*aes1610_read_regs_cb)(FpImageDevice *dev,
@@ -181,7 +182,6 @@ finger_det_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
 {
   FpImageDevice *dev = FP_IMAGE_DEVICE (device);
   unsigned char *data = transfer->buffer;
-  int i;
   int sum = 0;
 
   if (error)
@@ -191,8 +191,7 @@ finger_det_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
     }
 
   /* examine histogram to determine finger presence */
-  for (i = 3; i < 17; i++)
-    sum += (data[i] & 0xf) + (data[i] >> 4);
+  sum = aes_sum_nibbles (data + 3, 14);
   if (sum > 20)
     {
       /* reset default gain */
@@ -554,7 +553,6 @@ static void
 capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *device,
                        gpointer user_data, GError *error)
 {
-  unsigned char *stripdata;
   FpImageDevice *dev = FP_IMAGE_DEVICE (device);
   FpiDeviceAes1610 *self = FPI_DEVICE_AES1610 (dev);
   unsigned char *data = transfer->buffer;
@@ -566,8 +564,6 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *device,
       return;
     }
 
-  /* FIXME: would preallocating strip buffers be a decent optimization? */
-
   sum = 0;
   for (i = 516; i < 530; i++)
     /* histogram[i] = number of pixels of value i
@@ -577,14 +573,9 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *device,
   fp_dbg ("sum=%d", sum);
   if (sum > 0)
     {
-      /* FIXME: would preallocating strip buffers be a decent optimization? */
-      struct fpi_frame *stripe = g_malloc (FRAME_WIDTH * (FRAME_HEIGHT / 2) + sizeof (struct fpi_frame));
-      stripe->delta_x = 0;
-      stripe->delta_y = 0;
-      stripdata = stripe->data;
-      memcpy (stripdata, data + 1, FRAME_WIDTH * (FRAME_HEIGHT / 2));
-      self->strips = g_slist_prepend (self->strips, stripe);
-      self->strips_len++;
+      struct fpi_frame *stripe = fpi_frame_ring_push (self->strips);
+
+      aes_frame_unpack (&assembling_ctx, stripe, data + 1);
       self->blanks_count = 0;
     }
   else
@@ -603,21 +594,18 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *device,
   adjust_gain (data, GAIN_STATUS_NORMAL);
 
   /* stop capturing if MAX_FRAMES is reached */
-  if (self->blanks_count > 10 || g_slist_length (self->strips) >= MAX_FRAMES)
+  if (self->blanks_count > 10 || fpi_frame_ring_get_length (self->strips) >= MAX_FRAMES)
     {
       FpImage *img;
 
       fp_dbg ("sending stop capture.... blanks=%d  frames=%d",
-              self->blanks_count, g_slist_length (self->strips));
+              self->blanks_count, fpi_frame_ring_get_length (self->strips));
       /* send stop capture bits */
       aes_write_regv (dev, capture_stop, G_N_ELEMENTS (capture_stop), stub_capture_stop_cb, NULL);
-      self->strips = g_slist_reverse (self->strips);
-      fpi_do_movement_estimation (&assembling_ctx, self->strips);
-      img = fpi_assemble_frames (&assembling_ctx, self->strips);
+      fpi_do_movement_estimation_ring (&assembling_ctx, self->strips);
+      img = fpi_assemble_frames_ring (&assembling_ctx, self->strips);
 
-      g_slist_free_full (self->strips, g_free);
-      self->strips = NULL;
-      self->strips_len = 0;
+      fpi_frame_ring_clear (self->strips);
       self->blanks_count = 0;
       fpi_image_device_image_captured (dev, img);
       fpi_image_device_report_finger_status (dev, FALSE);
@@ -792,9 +780,7 @@ complete_deactivation (FpImageDevice *dev)
    * maybe we can do this with a master reset, unconditionally? */
 
   self->deactivating = FALSE;
-  g_slist_free (self->strips);
-  self->strips = NULL;
-  self->strips_len = 0;
+  fpi_frame_ring_clear (self->strips);
   self->blanks_count = 0;
   fpi_image_device_deactivate_complete (dev, NULL);
 }
@@ -802,6 +788,7 @@ complete_deactivation (FpImageDevice *dev)
 static void
 dev_init (FpImageDevice *dev)
 {
+  FpiDeviceAes1610 *self = FPI_DEVICE_AES1610 (dev);
   GError *error = NULL;
 
   /* FIXME check endpoints */
@@ -812,20 +799,26 @@ dev_init (FpImageDevice *dev)
       return;
     }
 
+  /* Capturing stops once this many frames are received */
+  self->strips = fpi_frame_ring_new (&assembling_ctx, MAX_FRAMES);
+
   fpi_image_device_open_complete (dev, NULL);
 }
 
 static void
 dev_deinit (FpImageDevice *dev)
 {
+  FpiDeviceAes1610 *self = FPI_DEVICE_AES1610 (dev);
   GError *error = NULL;
 
+  g_clear_pointer (&self->strips, fpi_frame_ring_free);
+
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)),
                                   0, 0, &error);
   fpi_image_device_close_complete (dev, error);
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_aes1610_id_table[] = {
   { .vid = 0x08ff,  .pid = 0x1600, },/* AES1600 */
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
 };
@@ -843,7 +836,7 @@ fpi_device_aes1610_class_init (FpiDeviceAes1610Class *klass)
   dev_class->id = "aes1610";
   dev_class->full_name = "AuthenTec AES1610";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_aes1610_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->img_open = dev_init;
@@ -68,7 +68,7 @@ struct _FpiDeviceAes2501
   FpImageDevice parent;
 
   guint8        read_regs_retry_count;
-  GSList       *strips;
+  struct fpi_frame_asmbl_stream *strips;
   size_t        strips_len;
   gboolean      deactivating;
   int           no_finger_cnt;
@@ -82,6 +82,8 @@ static struct fpi_frame_asmbl_ctx assembling_ctx = {
   .frame_height = FRAME_HEIGHT,
   .image_width = IMAGE_WIDTH,
   .get_pixel = aes_get_pixel,
+  .get_row = aes_get_row,
+  .duplicate_threshold = AES_DUPLICATE_THRESHOLD,
 };
 
 typedef void (*aes2501_read_regs_cb)(FpImageDevice *dev,
@@ -252,13 +254,18 @@ static const struct aes_regwrite finger_det_reqs[] = {
 
 static void start_finger_detection (FpImageDevice *dev);
 
+static void
+finger_det_poll_cb (FpDevice *device, gpointer user_data)
+{
+  start_finger_detection (FP_IMAGE_DEVICE (device));
+}
+
 static void
 finger_det_data_cb (FpiUsbTransfer *transfer, FpDevice *_dev,
                     gpointer user_data, GError *error)
 {
   FpImageDevice *dev = FP_IMAGE_DEVICE (_dev);
   unsigned char *data = transfer->buffer;
-  int i;
   int sum = 0;
 
   if (error)
@@ -268,8 +275,7 @@ finger_det_data_cb (FpiUsbTransfer *transfer, FpDevice *_dev,
     }
 
   /* examine histogram to determine finger presence */
-  for (i = 1; i < 9; i++)
-    sum += (data[i] & 0xf) + (data[i] >> 4);
+  sum = aes_sum_nibbles (data + 1, 8);
   if (sum > 20)
     {
       /* finger present, start capturing */
@@ -278,8 +284,14 @@ finger_det_data_cb (FpiUsbTransfer *transfer, FpDevice *_dev,
     }
   else
     {
-      /* no finger, poll for a new histogram */
-      start_finger_detection (dev);
+      /* no finger, poll for a new histogram, right away if there was
+       * some contact */
+      guint delay = fpi_image_device_get_poll_delay (dev, 0, sum > 10);
+
+      if (delay == 0)
+        start_finger_detection (dev);
+      else
+        fpi_device_add_timeout (_dev, delay, finger_det_poll_cb, NULL, NULL);
     }
 }
 
@@ -399,7 +411,6 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *_dev,
                        gpointer user_data, GError *error)
 {
   FpiSsm *ssm = transfer->ssm;
-  unsigned char *stripdata;
   FpImageDevice *dev = FP_IMAGE_DEVICE (_dev);
   FpiDeviceAes2501 *self = FPI_DEVICE_AES2501 (_dev);
   unsigned char *data = transfer->buffer;
@@ -454,12 +465,8 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *_dev,
         {
           FpImage *img;
 
-          self->strips = g_slist_reverse (self->strips);
-          fpi_do_movement_estimation (&assembling_ctx, self->strips);
-          img = fpi_assemble_frames (&assembling_ctx,
-                                     self->strips);
-          g_slist_free_full (self->strips, g_free);
-          self->strips = NULL;
+          /* Strips were assembled as they came in */
+          img = fpi_frame_asmbl_stream_finish (g_steal_pointer (&self->strips));
           self->strips_len = 0;
           fpi_image_device_image_captured (dev, img);
           fpi_image_device_report_finger_status (dev, FALSE);
@@ -475,13 +482,12 @@ capture_read_strip_cb (FpiUsbTransfer *transfer, FpDevice *_dev,
     {
       /* obtain next strip */
       /* FIXME: would preallocating strip buffers be a decent optimization? */
-      struct fpi_frame *stripe = g_malloc (FRAME_WIDTH * FRAME_HEIGHT / 2 + sizeof (struct fpi_frame));
-      stripe->delta_x = 0;
-      stripe->delta_y = 0;
-      stripdata = stripe->data;
-      memcpy (stripdata, data + 1, 192 * 8);
+      struct fpi_frame *stripe = aes_frame_new_unpacked (&assembling_ctx, data + 1);
+
       self->no_finger_cnt = 0;
-      self->strips = g_slist_prepend (self->strips, stripe);
+      if (!self->strips)
+        self->strips = fpi_frame_asmbl_stream_new (&assembling_ctx);
+      fpi_frame_asmbl_stream_push_frame (self->strips, stripe);
       self->strips_len++;
 
       fpi_ssm_jump_to_state (ssm, CAPTURE_REQUEST_STRIP);
@@ -822,8 +828,7 @@ complete_deactivation (FpImageDevice *dev)
    * maybe we can do this with a master reset, unconditionally? */
 
   self->deactivating = FALSE;
-  g_slist_free (self->strips);
-  self->strips = NULL;
+  g_clear_pointer (&self->strips, fpi_frame_asmbl_stream_free);
   self->strips_len = 0;
   fpi_image_device_deactivate_complete (dev, NULL);
 }
@@ -849,7 +854,7 @@ dev_deinit (FpImageDevice *dev)
   fpi_image_device_close_complete (dev, error);
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_aes2501_id_table[] = {
   { .vid = 0x08ff,  .pid = 0x2500, },/* AES2500 */
   { .vid = 0x08ff,  .pid = 0x2580, },/* AES2501 */
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
@@ -868,7 +873,7 @@ fpi_device_aes2501_class_init (FpiDeviceAes2501Class *klass)
   dev_class->id = "aes2501";
   dev_class->full_name = "AuthenTec AES2501";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_aes2501_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->img_open = dev_init;
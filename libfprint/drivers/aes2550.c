@@ -69,6 +69,7 @@ static struct fpi_frame_asmbl_ctx assembling_ctx = {
   .frame_height = FRAME_HEIGHT,
   .image_width = IMAGE_WIDTH,
   .get_pixel = aes_get_pixel,
+  .get_row = aes_get_row,
 };
 
 /****** FINGER PRESENCE DETECTION ******/
@@ -86,6 +87,12 @@ static unsigned char finger_det_reqs[] = {
 
 static void start_finger_detection (FpImageDevice *dev);
 
+static void
+finger_det_poll_cb (FpDevice *device, gpointer user_data)
+{
+  start_finger_detection (FP_IMAGE_DEVICE (device));
+}
+
 static void
 finger_det_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
                     gpointer user_data, GError *error)
@@ -112,7 +119,12 @@ finger_det_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
   else
     {
       /* no finger, poll for a new histogram */
-      start_finger_detection (dev);
+      guint delay = fpi_image_device_get_poll_delay (dev, 0, FALSE);
+
+      if (delay == 0)
+        start_finger_detection (dev);
+      else
+        fpi_device_add_timeout (device, delay, finger_det_poll_cb, NULL, NULL);
     }
 }
 
@@ -190,7 +202,6 @@ static gboolean
 process_strip_data (FpiSsm *ssm, FpImageDevice *dev,
                     unsigned char *data)
 {
-  unsigned char *stripdata;
   FpiDeviceAes2550 *self = FPI_DEVICE_AES2550 (dev);
   struct fpi_frame *stripe;
   int len;
@@ -203,11 +214,9 @@ process_strip_data (FpiSsm *ssm, FpImageDevice *dev,
   len = data[1] * 256 + data[2];
   if (len != (AES2550_STRIP_SIZE - 3))
     fp_dbg ("Bogus frame len: %.4x\n", len);
-  stripe = g_malloc0 (FRAME_WIDTH * FRAME_HEIGHT / 2 + sizeof (struct fpi_frame));     /* 4 bits per pixel */
+  stripe = aes_frame_new_unpacked (&assembling_ctx, data + 33);
   stripe->delta_x = (int8_t) data[6];
   stripe->delta_y = -(int8_t) data[7];
-  stripdata = stripe->data;
-  memcpy (stripdata, data + 33, FRAME_WIDTH * FRAME_HEIGHT / 2);
   self->strips = g_slist_prepend (self->strips, stripe);
   self->strips_len++;
 
@@ -549,7 +558,7 @@ dev_deinit (FpImageDevice *dev)
   fpi_image_device_close_complete (dev, error);
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_aes2550_id_table[] = {
   { .vid = 0x08ff,  .pid = 0x2550, },/* AES2550 */
   { .vid = 0x08ff,  .pid = 0x2810, },/* AES2810 */
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
@@ -568,7 +577,7 @@ fpi_device_aes2550_class_init (FpiDeviceAes2550Class *klass)
   dev_class->id = "aes2550";
   dev_class->full_name = "AuthenTec AES2550/AES2810";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_aes2550_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->img_open = dev_init;
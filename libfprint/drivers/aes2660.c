@@ -40,9 +40,10 @@ static struct fpi_frame_asmbl_ctx assembling_ctx = {
   .frame_height = AESX660_FRAME_HEIGHT,
   .image_width = IMAGE_WIDTH,
   .get_pixel = aes_get_pixel,
+  .get_row = aes_get_row,
 };
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_aes2660_id_table[] = {
   { .vid = 0x08ff,  .pid = 0x2660, },
   { .vid = 0x08ff,  .pid = 0x2680, },
   { .vid = 0x08ff,  .pid = 0x2681, },
@@ -79,7 +80,7 @@ fpi_device_aes2660_class_init (FpiDeviceAes2660Class *klass)
   dev_class->id = "aes2660";
   dev_class->full_name = "AuthenTec AES2660";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_aes2660_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->bz3_threshold = 20;
@@ -124,7 +124,7 @@ G_DECLARE_FINAL_TYPE (FpiDeviceAes3500, fpi_device_aes3500, FPI,
 G_DEFINE_TYPE (FpiDeviceAes3500, fpi_device_aes3500, FPI_TYPE_DEVICE_AES3K);
 
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_aes3500_id_table[] = {
   { .vid = 0x08ff, .pid = 0x5731 },
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
 };
@@ -143,7 +143,7 @@ fpi_device_aes3500_class_init (FpiDeviceAes3500Class *klass)
 
   dev_class->id = "aes3500";
   dev_class->full_name = "AuthenTec AES3500";
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_aes3500_id_table;
 
   img_class->img_height = FRAME_WIDTH * ENLARGE_FACTOR;
   img_class->img_width = FRAME_WIDTH * ENLARGE_FACTOR;
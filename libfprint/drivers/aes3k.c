@@ -54,18 +54,29 @@ static void do_capture (FpImageDevice *dev);
 
 G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE (FpiDeviceAes3k, fpi_device_aes3k, FP_TYPE_IMAGE_DEVICE);
 
+/* Unpacks a frame of 4 bit pixels, sent column by column, into rows
+ * [first_row, first_row + height) of an image of width x image_height.
+ * The sensor image is upside down, mirrored and inverted, that is undone
+ * right away so that the image does not need to be normalized later. */
 static void
 aes3k_assemble_image (unsigned char *input, size_t width, size_t height,
+                      size_t first_row, size_t image_height,
                       unsigned char *output)
 {
   size_t row, column;
 
   for (column = 0; column < width; column++)
     {
+      /* The pixel at (column, first_row + row) ends up mirrored */
+      unsigned char *out = output + width * (image_height - first_row - 1) +
+                           (width - column - 1);
+
       for (row = 0; row < height; row += 2)
         {
-          output[width * row + column] = (*input & 0x0f) * 17;
-          output[width * (row + 1) + column] = ((*input & 0xf0) >> 4) * 17;
+          /* Inverted, 0xff - v * 17 == (15 - v) * 17 */
+          out[0] = (15 - (*input & 0x0f)) * 17;
+          out[-(gssize) width] = (15 - ((*input & 0xf0) >> 4)) * 17;
+          out -= 2 * width;
           input++;
         }
     }
@@ -104,20 +115,20 @@ img_cb (FpiUsbTransfer *transfer, FpDevice *device,
 
   fpi_image_device_report_finger_status (dev, TRUE);
 
-  tmp = fp_image_new (cls->frame_width, cls->frame_width);
-  tmp->width = cls->frame_width;
-  tmp->height = cls->frame_width;
-  tmp->flags = FPI_IMAGE_COLORS_INVERTED | FPI_IMAGE_V_FLIPPED | FPI_IMAGE_H_FLIPPED;
+  /* All frames together fill the temporary image */
+  tmp = fpi_image_new_pooled (FP_DEVICE (dev), cls->frame_width, cls->frame_width, FALSE);
   for (i = 0; i < cls->frame_number; i++)
     {
       fp_dbg ("frame header byte %02x", *ptr);
       ptr++;
-      aes3k_assemble_image (ptr, cls->frame_width, AES3K_FRAME_HEIGHT, tmp->data + (i * cls->frame_width * AES3K_FRAME_HEIGHT));
+      aes3k_assemble_image (ptr, cls->frame_width, AES3K_FRAME_HEIGHT,
+                            i * AES3K_FRAME_HEIGHT, cls->frame_width, tmp->data);
       ptr += cls->frame_size;
     }
 
   /* FIXME: this is an ugly hack to make the image big enough for NBIS
-   * to process reliably */
+   * to process reliably. The image is already normalized, so the enlarged
+   * one is final and detection does not need another pass over it. */
   img = fpi_image_resize (tmp, cls->enlarge_factor, cls->enlarge_factor);
   g_object_unref (tmp);
   fpi_image_device_image_captured (dev, img);
@@ -121,7 +121,7 @@ G_DECLARE_FINAL_TYPE (FpiDeviceAes4000, fpi_device_aes4000, FPI,
 G_DEFINE_TYPE (FpiDeviceAes4000, fpi_device_aes4000, FPI_TYPE_DEVICE_AES3K);
 
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_aes4000_id_table[] = {
   { .pid = 0x08ff, .vid = 0x5501 },
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
 };
@@ -140,7 +140,7 @@ fpi_device_aes4000_class_init (FpiDeviceAes4000Class *klass)
 
   dev_class->id = "aes4000";
   dev_class->full_name = "AuthenTec AES4000";
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_aes4000_id_table;
 
   img_class->img_height = FRAME_WIDTH * ENLARGE_FACTOR;
   img_class->img_width = FRAME_WIDTH * ENLARGE_FACTOR;
@@ -34,18 +34,30 @@
 
 struct write_regv_data
 {
-  unsigned int               num_regs;
-  const struct aes_regwrite *regs;
-  unsigned int               offset;
-  aes_write_regv_cb          callback;
-  void                      *user_data;
+  unsigned int      pending;
+  GError           *error;
+  GCancellable     *cancellable;
+  aes_write_regv_cb callback;
+  void             *user_data;
 };
 
-static void continue_write_regv (FpImageDevice          *dev,
-                                 struct write_regv_data *wdata);
+/* drop a reference to the transaction, and indicate completion to the caller
+ * once all transfers have returned */
+static void
+write_regv_unref (FpImageDevice *dev, struct write_regv_data *wdata)
+{
+  if (--wdata->pending > 0)
+    return;
+
+  if (!wdata->error)
+    fp_dbg ("all registers written");
+
+  wdata->callback (dev, wdata->error, wdata->user_data);
+  g_object_unref (wdata->cancellable);
+  g_free (wdata);
+}
 
-/* libusb bulk callback for regv write completion transfer. continues the
- * transaction */
+/* libusb bulk callback for regv write completion transfer */
 static void
 write_regv_trf_complete (FpiUsbTransfer *transfer, FpDevice *device,
                          gpointer user_data, GError *error)
@@ -54,20 +66,27 @@ write_regv_trf_complete (FpiUsbTransfer *transfer, FpDevice *device,
 
   if (error)
     {
-      wdata->callback (FP_IMAGE_DEVICE (device), error, wdata->user_data);
-      g_free (wdata);
-    }
-  else
-    {
-      continue_write_regv (FP_IMAGE_DEVICE (device), wdata);
+      /* report the first error, and drop the writes queued behind it */
+      if (!wdata->error)
+        {
+          wdata->error = error;
+          g_cancellable_cancel (wdata->cancellable);
+        }
+      else
+        {
+          g_error_free (error);
+        }
     }
+
+  write_regv_unref (FP_IMAGE_DEVICE (device), wdata);
 }
 
-/* write from wdata->offset to upper_bound (inclusive) of wdata->regs */
+/* write regs[offset] to regs[upper_bound] (inclusive) in one transfer */
 static void
-do_write_regv (FpImageDevice *dev, struct write_regv_data *wdata, int upper_bound)
+do_write_regv (FpImageDevice *dev, struct write_regv_data *wdata,
+               const struct aes_regwrite *regs,
+               unsigned int offset, unsigned int upper_bound)
 {
-  unsigned int offset = wdata->offset;
   unsigned int num = upper_bound - offset + 1;
   size_t alloc_size = num * 2;
   unsigned int i;
@@ -78,79 +97,108 @@ do_write_regv (FpImageDevice *dev, struct write_regv_data *wdata, int upper_boun
 
   for (i = offset; i < offset + num; i++)
     {
-      const struct aes_regwrite *regwrite = &wdata->regs[i];
+      const struct aes_regwrite *regwrite = &regs[i];
       transfer->buffer[data_offset++] = regwrite->reg;
       transfer->buffer[data_offset++] = regwrite->value;
     }
 
+  wdata->pending++;
   transfer->short_is_error = TRUE;
-  fpi_usb_transfer_submit (transfer, BULK_TIMEOUT, NULL,
+  fpi_usb_transfer_submit (transfer, BULK_TIMEOUT, wdata->cancellable,
                            write_regv_trf_complete, wdata);
 }
 
-/* write the next batch of registers to be written, or if there are no more,
- * indicate completion to the caller */
-static void
-continue_write_regv (FpImageDevice *dev, struct write_regv_data *wdata)
+/* write a load of registers to the device, combining multiple writes in a
+ * single URB up to a limit. insert writes to non-existent register 0 to force
+ * specific groups of writes to be separated by different URBs.
+ *
+ * All URBs are queued at once, the endpoint delivers them in order without
+ * waiting for a round trip through the main loop between them. */
+void
+aes_write_regv (FpImageDevice *dev, const struct aes_regwrite *regs,
+                unsigned int num_regs, aes_write_regv_cb callback,
+                void *user_data)
 {
-  unsigned int offset = wdata->offset;
-  unsigned int regs_remaining;
-  unsigned int limit;
-  unsigned int upper_bound;
-  int i;
-
-  /* skip all zeros and ensure there is still work to do */
-  while (TRUE)
+  struct write_regv_data *wdata;
+  unsigned int offset = 0;
+
+  fp_dbg ("write %d regs", num_regs);
+  wdata = g_new0 (struct write_regv_data, 1);
+  /* held until all transfers are queued */
+  wdata->pending = 1;
+  wdata->cancellable = g_cancellable_new ();
+  wdata->callback = callback;
+  wdata->user_data = user_data;
+
+  while (offset < num_regs)
     {
-      if (offset >= wdata->num_regs)
+      unsigned int upper_bound;
+      unsigned int i;
+
+      /* skip all zeros */
+      if (!regs[offset].reg)
         {
-          fp_dbg ("all registers written");
-          wdata->callback (dev, 0, wdata->user_data);
-          g_free (wdata);
-          return;
+          offset++;
+          continue;
         }
-      if (wdata->regs[offset].reg)
-        break;
-      offset++;
+
+      upper_bound = offset + MIN (num_regs - offset, MAX_REGWRITES_PER_REQUEST) - 1;
+
+      /* determine if we can write the entire of the regs at once, or if there
+       * is a zero dividing things up */
+      for (i = offset; i <= upper_bound; i++)
+        if (!regs[i].reg)
+          {
+            upper_bound = i - 1;
+            break;
+          }
+
+      do_write_regv (dev, wdata, regs, offset, upper_bound);
+      offset = upper_bound + 1;
     }
 
-  wdata->offset = offset;
-  regs_remaining = wdata->num_regs - offset;
-  limit = MIN (regs_remaining, MAX_REGWRITES_PER_REQUEST);
-  upper_bound = offset + limit - 1;
+  write_regv_unref (dev, wdata);
+}
 
-  /* determine if we can write the entire of the regs at once, or if there
-   * is a zero dividing things up */
-  for (i = offset; i <= upper_bound; i++)
-    if (!wdata->regs[i].reg)
-      {
-        upper_bound = i - 1;
-        break;
-      }
+/* The sensors send frames column by column with 4 bits per pixel, the
+ * lower nibble being the upper pixel. They are unpacked once when they
+ * are received, so that frame assembling can compare whole rows. */
+struct fpi_frame *
+aes_frame_new_unpacked (struct fpi_frame_asmbl_ctx *ctx,
+                        const unsigned char        *data)
+{
+  struct fpi_frame *frame;
 
-  do_write_regv (dev, wdata, upper_bound);
+  frame = g_malloc (ctx->frame_width * ctx->frame_height + sizeof (struct fpi_frame));
+  frame->delta_x = 0;
+  frame->delta_y = 0;
+  aes_frame_unpack (ctx, frame, data);
 
-  wdata->offset = upper_bound + 1;
+  return frame;
 }
 
-/* write a load of registers to the device, combining multiple writes in a
- * single URB up to a limit. insert writes to non-existent register 0 to force
- * specific groups of writes to be separated by different URBs. */
+/* As aes_frame_new_unpacked(), into an existing frame, e.g. one of a
+ * #fpi_frame_ring */
 void
-aes_write_regv (FpImageDevice *dev, const struct aes_regwrite *regs,
-                unsigned int num_regs, aes_write_regv_cb callback,
-                void *user_data)
+aes_frame_unpack (struct fpi_frame_asmbl_ctx *ctx,
+                  struct fpi_frame           *frame,
+                  const unsigned char        *data)
 {
-  struct write_regv_data *wdata;
+  unsigned int width = ctx->frame_width;
+  unsigned int height = ctx->frame_height;
+  unsigned int x, y;
 
-  fp_dbg ("write %d regs", num_regs);
-  wdata = g_malloc (sizeof (*wdata));
-  wdata->num_regs = num_regs;
-  wdata->regs = regs;
-  wdata->offset = 0;
-  wdata->callback = callback;
-  wdata->user_data = user_data;
-  continue_write_regv (dev, wdata);
+  for (x = 0; x < width; x++)
+    {
+      unsigned char *out = frame->data + x;
+
+      for (y = 0; y < height; y += 2)
+        {
+          out[y * width] = (*data & 0x0f) * 17;
+          out[(y + 1) * width] = (*data >> 4) * 17;
+          data++;
+        }
+    }
 }
 
 unsigned char
@@ -159,11 +207,43 @@ aes_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
                unsigned int                x,
                unsigned int                y)
 {
-  unsigned char ret;
+  return frame->data[x + y * ctx->frame_width];
+}
+
+const unsigned char *
+aes_get_row (struct fpi_frame_asmbl_ctx *ctx,
+             struct fpi_frame           *frame,
+             unsigned int                y)
+{
+  return frame->data + y * ctx->frame_width;
+}
+
+/* Sum of both nibbles of all bytes, eight bytes at a time. Each byte
+ * sums to at most 30, so the eight of them fit into one byte. */
+int
+aes_sum_nibbles (const unsigned char *data,
+                 size_t               len)
+{
+  int sum = 0;
 
-  ret = frame->data[x * (ctx->frame_height >> 1) + (y >> 1)];
-  ret = y % 2 ? ret >> 4 : ret & 0xf;
-  ret *= 17;
+  while (len >= 8)
+    {
+      guint64 v;
+
+      memcpy (&v, data, sizeof (v));
+      v = (v & G_GUINT64_CONSTANT (0x0f0f0f0f0f0f0f0f)) +
+          ((v >> 4) & G_GUINT64_CONSTANT (0x0f0f0f0f0f0f0f0f));
+      sum += (v * G_GUINT64_CONSTANT (0x0101010101010101)) >> 56;
+
+      data += 8;
+      len -= 8;
+    }
+
+  while (len--)
+    {
+      sum += (*data & 0x0f) + (*data >> 4);
+      data++;
+    }
 
-  return ret;
+  return sum;
 }
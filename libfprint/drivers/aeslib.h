@@ -30,6 +30,11 @@ struct aes_regwrite
 struct fpi_frame;
 struct fpi_frame_asmbl_ctx;
 
+/* The frames have 16 grey levels, 17 apart once unpacked. Frames in which
+ * less than about a fifth of the pixels differ by one level are duplicates,
+ * any actual movement across the ridges differs by far more. */
+#define AES_DUPLICATE_THRESHOLD 64
+
 typedef void (*aes_write_regv_cb)(FpImageDevice *dev,
                                   GError        *error,
                                   void          *user_data);
@@ -40,7 +45,19 @@ void aes_write_regv (FpImageDevice             *dev,
                      aes_write_regv_cb          callback,
                      void                      *user_data);
 
+struct fpi_frame *aes_frame_new_unpacked (struct fpi_frame_asmbl_ctx *ctx,
+                                          const unsigned char        *data);
+void aes_frame_unpack (struct fpi_frame_asmbl_ctx *ctx,
+                       struct fpi_frame           *frame,
+                       const unsigned char        *data);
+
 unsigned char aes_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
                              struct fpi_frame           *frame,
                              unsigned int                x,
                              unsigned int                y);
+const unsigned char *aes_get_row (struct fpi_frame_asmbl_ctx *ctx,
+                                  struct fpi_frame           *frame,
+                                  unsigned int                y);
+
+int aes_sum_nibbles (const unsigned char *data,
+                     size_t               len);
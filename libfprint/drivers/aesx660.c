@@ -89,13 +89,12 @@ aesX660_read_response (FpiSsm                *ssm,
                        FpiUsbTransferCallback callback)
 {
   FpiUsbTransfer *transfer = fpi_usb_transfer_new (_dev);
-  unsigned char *data;
   GCancellable *cancel = NULL;
 
   if (cancellable)
     cancel = fpi_device_get_cancellable (_dev);
-  data = g_malloc (buf_len);
-  fpi_usb_transfer_fill_bulk_full (transfer, EP_IN, data, buf_len, NULL);
+  /* Response buffers are recycled by the device */
+  fpi_usb_transfer_fill_bulk (transfer, EP_IN, buf_len);
   transfer->ssm = ssm;
   transfer->short_is_error = short_is_error;
   fpi_usb_transfer_submit (transfer, BULK_TIMEOUT, cancel, callback, NULL);
@@ -283,7 +282,6 @@ process_stripe_data (FpiSsm *ssm, FpiDeviceAesX660 *self,
   FpiDeviceAesX660Private *priv = fpi_device_aes_x660_get_instance_private (self);
   FpiDeviceAesX660Class *cls = FPI_DEVICE_AES_X660_GET_CLASS (self);
   struct fpi_frame *stripe;
-  unsigned char *stripdata;
 
   if (length < AESX660_IMAGE_OFFSET + cls->assembling_ctx->frame_width * FRAME_HEIGHT / 2)
     {
@@ -293,26 +291,24 @@ process_stripe_data (FpiSsm *ssm, FpiDeviceAesX660 *self,
       return 0;
     }
 
-  stripe = g_malloc (cls->assembling_ctx->frame_width * FRAME_HEIGHT / 2 + sizeof (struct fpi_frame));     /* 4 bpp */
-  stripdata = stripe->data;
-
   fp_dbg ("Processing frame %.2x %.2x", data[AESX660_IMAGE_OK_OFFSET],
           data[AESX660_LAST_FRAME_OFFSET]);
 
-  stripe->delta_x = (int8_t) data[AESX660_FRAME_DELTA_X_OFFSET];
-  stripe->delta_y = -(int8_t) data[AESX660_FRAME_DELTA_Y_OFFSET];
-  fp_dbg ("Offset to previous frame: %d %d", stripe->delta_x, stripe->delta_y);
+  fp_dbg ("Offset to previous frame: %d %d",
+          (int8_t) data[AESX660_FRAME_DELTA_X_OFFSET],
+          -(int8_t) data[AESX660_FRAME_DELTA_Y_OFFSET]);
 
   if (data[AESX660_IMAGE_OK_OFFSET] == AESX660_IMAGE_OK)
     {
-      memcpy (stripdata, data + AESX660_IMAGE_OFFSET, cls->assembling_ctx->frame_width * FRAME_HEIGHT / 2);
+      stripe = aes_frame_new_unpacked (cls->assembling_ctx, data + AESX660_IMAGE_OFFSET);
+      stripe->delta_x = (int8_t) data[AESX660_FRAME_DELTA_X_OFFSET];
+      stripe->delta_y = -(int8_t) data[AESX660_FRAME_DELTA_Y_OFFSET];
 
       priv->strips = g_slist_prepend (priv->strips, stripe);
       priv->strips_len++;
       return data[AESX660_LAST_FRAME_OFFSET] & AESX660_LAST_FRAME_BIT;
     }
 
-  g_free (stripe);
   return 0;
 }
 
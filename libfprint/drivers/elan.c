@@ -39,6 +39,7 @@
 #define FP_COMPONENT "elan"
 
 #include "drivers_api.h"
+#include "fpi-byte-reader.h"
 #include "elan.h"
 
 static unsigned char
@@ -49,11 +50,19 @@ elan_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
   return frame->data[x + y * ctx->frame_width];
 }
 
+static const unsigned char *
+elan_get_row (struct fpi_frame_asmbl_ctx *ctx,
+              struct fpi_frame *frame, unsigned int y)
+{
+  return frame->data + y * ctx->frame_width;
+}
+
 static struct fpi_frame_asmbl_ctx assembling_ctx = {
   .frame_width = 0,
   .frame_height = 0,
   .image_width = 0,
   .get_pixel = elan_get_pixel,
+  .get_row = elan_get_row,
 };
 
 struct _FpiDeviceElan
@@ -80,6 +89,7 @@ struct _FpiDeviceElan
   unsigned char       calib_atts_left;
   unsigned char       calib_status;
   unsigned short     *background;
+  gboolean            calibration_cached;
   unsigned char       frame_width;
   unsigned char       frame_height;
   unsigned char       raw_frame_height;
@@ -91,12 +101,6 @@ G_DECLARE_FINAL_TYPE (FpiDeviceElan, fpi_device_elan, FPI, DEVICE_ELAN,
                       FpImageDevice);
 G_DEFINE_TYPE (FpiDeviceElan, fpi_device_elan, FP_TYPE_IMAGE_DEVICE);
 
-static int
-cmp_short (const void *a, const void *b)
-{
-  return (int) (*(short *) a - *(short *) b);
-}
-
 static void
 elan_dev_reset_state (FpiDeviceElan *elandev)
 {
@@ -140,13 +144,23 @@ elan_save_frame (FpiDeviceElan *self, unsigned short *frame)
   unsigned char frame_margin = (raw_height - self->frame_height) / 2;
   int frame_idx, raw_idx;
 
+  if (self->dev_type & ELAN_NOT_ROTATED)
+    {
+      /* The rows are already in order, so this is a single copy */
+      FpiByteReader reader;
+
+      fpi_byte_reader_init (&reader,
+                            self->last_read + frame_margin * frame_width * 2,
+                            frame_width * frame_height * 2);
+      fpi_byte_reader_get_uint16_le_array (&reader, frame_width * frame_height,
+                                           frame);
+      return;
+    }
+
   for (int y = 0; y < frame_height; y++)
     for (int x = 0; x < frame_width; x++)
       {
-        if (self->dev_type & ELAN_NOT_ROTATED)
-          raw_idx = x + (y + frame_margin) * frame_width;
-        else
-          raw_idx = frame_margin + y + x * raw_height;
+        raw_idx = frame_margin + y + x * raw_height;
         frame_idx = x + y * frame_width;
         frame[frame_idx] =
           ((unsigned short *) self->last_read)[raw_idx];
@@ -210,12 +224,12 @@ elan_save_img_frame (FpiDeviceElan *elandev)
   elan_save_frame (elandev, frame);
   unsigned int sum = 0;
 
+  /* Branchless so that the subtraction can be vectorized */
   for (int i = 0; i < frame_size; i++)
     {
-      if (elandev->background[i] > frame[i])
-        frame[i] = 0;
-      else
-        frame[i] -= elandev->background[i];
+      unsigned short bg = elandev->background[i];
+
+      frame[i] = frame[i] > bg ? frame[i] - bg : 0;
       sum += frame[i];
     }
 
@@ -232,6 +246,40 @@ elan_save_img_frame (FpiDeviceElan *elandev)
   return 0;
 }
 
+/* Normalization divides numerators below 2^24 by divisors below 2^16. With
+ * a 40 bit shift, multiplying by the rounded up reciprocal gives exactly
+ * the same result as the division does. */
+#define ELAN_RECIPROCAL_SHIFT 40
+
+static guint64
+elan_reciprocal (unsigned int divisor)
+{
+  return ((G_GUINT64_CONSTANT (1) << ELAN_RECIPROCAL_SHIFT) + divisor - 1) / divisor;
+}
+
+/* Pixel values are split into a coarse histogram over the high byte, which
+ * is built once per frame, and a fine one over the low byte of the bin the
+ * requested rank falls into. This finds the same value as sorting would. */
+static unsigned short
+elan_select_rank (const unsigned short *raw_frame, unsigned int frame_size,
+                  const unsigned int *coarse, unsigned int rank)
+{
+  unsigned int fine[256] = { 0 };
+  unsigned int hi = 0, lo = 0;
+
+  while (rank >= coarse[hi])
+    rank -= coarse[hi++];
+
+  for (int i = 0; i < frame_size; i++)
+    if ((raw_frame[i] >> 8) == hi)
+      fine[raw_frame[i] & 0xff]++;
+
+  while (rank >= fine[lo])
+    rank -= fine[lo++];
+
+  return hi << 8 | lo;
+}
+
 static void
 elan_process_frame_linear (unsigned short *raw_frame,
                            GSList       ** frames)
@@ -246,21 +294,15 @@ elan_process_frame_linear (unsigned short *raw_frame,
   unsigned short min = 0xffff, max = 0;
   for (int i = 0; i < frame_size; i++)
     {
-      if (raw_frame[i] < min)
-        min = raw_frame[i];
-      if (raw_frame[i] > max)
-        max = raw_frame[i];
+      min = MIN (min, raw_frame[i]);
+      max = MAX (max, raw_frame[i]);
     }
 
   g_assert (max != min);
 
-  unsigned short px;
+  guint64 scale = elan_reciprocal (max - min);
   for (int i = 0; i < frame_size; i++)
-    {
-      px = raw_frame[i];
-      px = (px - min) * 0xff / (max - min);
-      frame->data[i] = (unsigned char) px;
-    }
+    frame->data[i] = ((raw_frame[i] - min) * 0xff * scale) >> ELAN_RECIPROCAL_SHIFT;
 
   *frames = g_slist_prepend (*frames, frame);
 }
@@ -276,26 +318,32 @@ elan_process_frame_thirds (unsigned short *raw_frame,
   struct fpi_frame *frame =
     g_malloc (frame_size + sizeof (struct fpi_frame));
 
-  unsigned short lvl0, lvl1, lvl2, lvl3;
-  unsigned short *sorted = g_malloc (frame_size * sizeof (short));
-  memcpy (sorted, raw_frame, frame_size * sizeof (short));
-  qsort (sorted, frame_size, sizeof (short), cmp_short);
-  lvl0 = sorted[0];
-  lvl1 = sorted[frame_size * 3 / 10];
-  lvl2 = sorted[frame_size * 65 / 100];
-  lvl3 = sorted[frame_size - 1];
-  g_free (sorted);
+  unsigned int coarse[256] = { 0 };
+  unsigned short lvl0 = 0xffff, lvl1, lvl2, lvl3 = 0;
+  for (int i = 0; i < frame_size; i++)
+    {
+      coarse[raw_frame[i] >> 8]++;
+      lvl0 = MIN (lvl0, raw_frame[i]);
+      lvl3 = MAX (lvl3, raw_frame[i]);
+    }
+  lvl1 = elan_select_rank (raw_frame, frame_size, coarse, frame_size * 3 / 10);
+  lvl2 = elan_select_rank (raw_frame, frame_size, coarse, frame_size * 65 / 100);
+
+  /* A divisor is only used if its range contains pixels */
+  guint64 scale1 = lvl1 > lvl0 ? elan_reciprocal (lvl1 - lvl0) : 0;
+  guint64 scale2 = lvl2 > lvl1 ? elan_reciprocal (lvl2 - lvl1) : 0;
+  guint64 scale3 = lvl3 > lvl2 ? elan_reciprocal (lvl3 - lvl2) : 0;
 
   unsigned short px;
   for (int i = 0; i < frame_size; i++)
     {
       px = raw_frame[i];
-      if (lvl0 <= px && px < lvl1)
-        px = (px - lvl0) * 99 / (lvl1 - lvl0);
-      else if (lvl1 <= px && px < lvl2)
-        px = 99 + ((px - lvl1) * 56 / (lvl2 - lvl1));
+      if (px < lvl1)
+        px = ((px - lvl0) * 99 * scale1) >> ELAN_RECIPROCAL_SHIFT;
+      else if (px < lvl2)
+        px = 99 + (((px - lvl1) * 56 * scale2) >> ELAN_RECIPROCAL_SHIFT);
       else                      // (lvl2 <= px && px <= lvl3)
-        px = 155 + ((px - lvl2) * 100 / (lvl3 - lvl2));
+        px = 155 + (((px - lvl2) * 100 * scale3) >> ELAN_RECIPROCAL_SHIFT);
       frame->data[i] = (unsigned char) px;
     }
 
@@ -559,7 +607,16 @@ capture_run_state (FpiSsm *ssm, FpDevice *dev)
 
     case CAPTURE_CHECK_ENOUGH_FRAMES:
       r = elan_save_img_frame (self);
-      if (r < 0)
+      if (r < 0 && self->calibration_cached)
+        {
+          /* The sensor drifted since the background was taken, calibrate
+           * again for the next attempt. */
+          fp_dbg ("cached calibration is stale");
+          fpi_device_clear_calibration (dev);
+          self->calibration_cached = FALSE;
+          fpi_ssm_mark_failed (ssm, fpi_device_retry_new (FP_DEVICE_RETRY_REMOVE_FINGER));
+        }
+      else if (r < 0)
         {
           fpi_ssm_mark_failed (ssm, fpi_device_error_new (FP_DEVICE_ERROR_GENERAL));
         }
@@ -602,6 +659,11 @@ capture_complete (FpiSsm *ssm, FpDevice *_dev, GError *error)
         }
       g_clear_error (&error);
     }
+  else if (error->domain == FP_DEVICE_RETRY)
+    {
+      fpi_image_device_retry_scan (dev, error->code);
+      g_clear_error (&error);
+    }
   else
     {
       fpi_image_device_session_error (dev, error);
@@ -766,6 +828,34 @@ calibrate_run_state (FpiSsm *ssm, FpDevice *dev)
     }
 }
 
+static void
+elan_store_calibration (FpiDeviceElan *self)
+{
+  g_autoptr(GBytes) data = NULL;
+
+  data = g_bytes_new (self->background,
+                      self->frame_width * self->frame_height * sizeof (short));
+  fpi_device_store_calibration (FP_DEVICE (self), data);
+}
+
+/* The background only stays valid as long as the sensor does not drift,
+ * stale data is detected when frames end up darker than it. */
+static gboolean
+elan_restore_calibration (FpiDeviceElan *self)
+{
+  g_autoptr(GBytes) data = NULL;
+  gsize frame_size = self->frame_width * self->frame_height * sizeof (short);
+
+  data = fpi_device_lookup_calibration (FP_DEVICE (self), ELAN_CALIBRATION_CACHE_AGE);
+  if (!data || g_bytes_get_size (data) != frame_size)
+    return FALSE;
+
+  g_free (self->background);
+  self->background = g_memdup (g_bytes_get_data (data, NULL), frame_size);
+
+  return TRUE;
+}
+
 static void
 calibrate_complete (FpiSsm *ssm, FpDevice *dev, GError *error)
 {
@@ -780,6 +870,7 @@ calibrate_complete (FpiSsm *ssm, FpDevice *dev, GError *error)
     }
   else
     {
+      elan_store_calibration (self);
       elan_capture (dev);
     }
 
@@ -793,6 +884,15 @@ elan_calibrate (FpDevice *dev)
   G_DEBUG_HERE ();
 
   elan_dev_reset_state (self);
+
+  self->calibration_cached = elan_restore_calibration (self);
+  if (self->calibration_cached)
+    {
+      fp_dbg ("using cached calibration");
+      elan_capture (dev);
+      return;
+    }
+
   self->calib_atts_left = ELAN_CALIBRATION_ATTEMPTS;
 
   FpiSsm *ssm = fpi_ssm_new (FP_DEVICE (dev), calibrate_run_state,
@@ -1074,7 +1174,7 @@ fpi_device_elan_class_init (FpiDeviceElanClass *klass)
   dev_class->id = "elan";
   dev_class->full_name = "ElanTech Fingerprint Sensor";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = elan_id_table;
+  dev_class->id_table = fpi_device_elan_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->img_open = dev_init;
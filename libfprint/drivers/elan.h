@@ -42,6 +42,9 @@
  * (the response value of get_calib_mean_cmd)*/
 #define ELAN_CALIBRATION_MAX_DELTA 500
 
+/* reuse the background and calibration of earlier activations for this long */
+#define ELAN_CALIBRATION_CACHE_AGE (30 * G_TIME_SPAN_MINUTE)
+
 /* times to retry reading calibration status during one session
  * generally prevents calibration from looping indefinitely */
 #define ELAN_CALIBRATION_ATTEMPTS 10
@@ -156,7 +159,7 @@ static const struct elan_cmd stop_cmd = {
   .never_cancel = TRUE,
 };
 
-static const FpIdEntry elan_id_table[] = {
+const FpIdEntry fpi_device_elan_id_table[] = {
   {.vid = ELAN_VEND_ID,  .pid = 0x0903, .driver_data = ELAN_ALL_DEV},
   {.vid = ELAN_VEND_ID,  .pid = 0x0907, .driver_data = ELAN_0907},
   {.vid = ELAN_VEND_ID,  .pid = 0x0c01, .driver_data = ELAN_ALL_DEV},
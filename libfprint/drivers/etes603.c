@@ -58,6 +58,8 @@
 #define DTVRT_MAX 0x3A          /* Maximum value for DTVRT */
 #define DCOFFSET_MIN 0x00       /* Minimum value for DCoffset */
 #define DCOFFSET_MAX 0x35       /* Maximum value for DCoffset */
+/* Reuse the tuning of an earlier instance of the device for this long */
+#define TUNING_CACHE_AGE (2 * G_TIME_SPAN_HOUR)
 
 /* es603 commands */
 #define CMD_READ_REG 0x01
@@ -204,7 +206,7 @@ struct _FpiDeviceEtes603
   struct egis_msg *ans;
   size_t           ans_len;
 
-  guint8          *fp;
+  guint8          *fp;        /* 8bpp, up to two Fly-Estimation frames */
   guint16          fp_height;
 
   guint8           tunedc_min;
@@ -215,6 +217,7 @@ struct _FpiDeviceEtes603
   guint8       dcoffset;
   guint8       vrt;
   guint8       vrb;
+  gboolean     tuning_cached;
 
   unsigned int is_active;
 };
@@ -486,57 +489,49 @@ msg_set_mode_control (FpiDeviceEtes603 *self, guint8 mode)
 /* Processing functions */
 
 /*
- * Return the brightness of a 4bpp frame
+ * Pixel counts of a 4bpp frame, full black and full white pixels are not
+ * counted as black or white.
  */
-static unsigned int
-process_get_brightness (guint8 *f, size_t s)
+typedef struct
 {
-  unsigned int i, sum = 0;
+  guint n_pixels;
+  guint full_black;
+  guint black;
+  guint white;
+  guint full_white;
+} FrameHist;
 
-  for (i = 0; i < s; i++)
-    {
-      sum += f[i] >> 4;
-      sum += f[i] & 0x0F;
-    }
-  return sum;
-}
+/* Whether @count is more than @percent of the pixels of @hist */
+#define HIST_ABOVE(hist, count, percent) \
+  ((count) * 100 > (hist)->n_pixels * (percent))
 
 /*
  * Return the histogram of a 4bpp frame
  */
 static void
-process_hist (guint8 *f, size_t s, float stat[5])
+process_hist (guint8 *f, size_t s, FrameHist *stat)
 {
-  float hist[16];
-  float black_mean, white_mean;
-  int i;
+  guint hist[16] = { 0, };
+  size_t i;
 
-  /* Clean histogram */
-  for (i = 0; i < 16; i++)
-    hist[i] = 0.0;
   for (i = 0; i < s; i++)
     {
       hist[f[i] >> 4]++;
       hist[f[i] & 0x0F]++;
     }
-  /* histogram average */
-  for (i = 0; i < 16; i++)
-    hist[i] = hist[i] / (s * 2);
-  /* Average black/white pixels (full black and full white pixels
-   * are excluded). */
-  black_mean = white_mean = 0.0;
+
+  memset (stat, 0, sizeof (FrameHist));
+  stat->n_pixels = s * 2;
+  stat->full_black = hist[0];
+  stat->full_white = hist[15];
   for (i = 1; i < 8; i++)
-    black_mean += hist[i];
+    stat->black += hist[i];
   for (i = 8; i < 15; i++)
-    white_mean += hist[i];
-  stat[0] = hist[0];
-  stat[1] = black_mean;
-  stat[2] = black_mean + white_mean;
-  stat[3] = white_mean;
-  stat[4] = hist[15];
-  fp_dbg ("fullb=%6f black=%6f grey=%6f white=%6f fullw=%6f",
-          hist[0], black_mean, black_mean + white_mean, white_mean,
-          hist[15]);
+    stat->white += hist[i];
+
+  fp_dbg ("fullb=%u black=%u white=%u fullw=%u of %u pixels",
+          stat->full_black, stat->black, stat->white, stat->full_white,
+          stat->n_pixels);
 }
 
 /*
@@ -545,9 +540,38 @@ process_hist (guint8 *f, size_t s, float stat[5])
 static int
 process_frame_empty (guint8 *frame, size_t size)
 {
-  unsigned int sum = process_get_brightness (frame, size);
+  const guint64 low = G_GUINT64_CONSTANT (0x0f0f0f0f0f0f0f0f);
+  const guint64 low16 = G_GUINT64_CONSTANT (0x00ff00ff00ff00ff);
+  unsigned int sum = 0;
+  size_t i = 0;
+
+  /* Allow an average of 'threshold' luminosity per pixel. The nibbles of
+   * 8 bytes are added at once, with at most 8 * 30 in each byte lane of
+   * the accumulator, and the scan stops once the frame is bright enough. */
+  while (i + 64 <= size)
+    {
+      guint64 acc = 0;
+      guint k;
+
+      for (k = 0; k < 8; k++, i += 8)
+        {
+          guint64 v;
+
+          memcpy (&v, frame + i, sizeof (v));
+          acc += (v & low) + ((v >> 4) & low);
+        }
+
+      /* Widen to 16 bit lanes and add them up */
+      acc = (acc & low16) + ((acc >> 8) & low16);
+      sum += (acc * G_GUINT64_CONSTANT (0x0001000100010001)) >> 48;
+
+      if (sum >= size)
+        return 0;
+    }
+
+  for (; i < size; i++)
+    sum += (frame[i] >> 4) + (frame[i] & 0x0F);
 
-  /* Allow an average of 'threshold' luminosity per pixel */
   if (sum < size)
     return 1;
   return 0;
@@ -555,7 +579,7 @@ process_frame_empty (guint8 *frame, size_t size)
 
 /* Transform 4 bits image to 8 bits image */
 static void
-process_4to8_bpp (guint8 *input, unsigned int input_size,
+process_4to8_bpp (const guint8 *input, unsigned int input_size,
                   guint8 *output)
 {
   unsigned int i, j = 0;
@@ -576,10 +600,10 @@ process_removefpi_end (FpiDeviceEtes603 *dev)
 {
   unsigned int i;
   /* 2 last lines with Fly-Estimation are the empty pattern. */
-  guint8 *pattern = dev->fp + (dev->fp_height - 2) * FE_WIDTH / 2;
+  guint8 *pattern = dev->fp + (dev->fp_height - 2) * FE_WIDTH;
 
   for (i = 2; i < dev->fp_height; i += 2)
-    if (memcmp (pattern, pattern - (i * FE_WIDTH / 2), FE_WIDTH))
+    if (memcmp (pattern, pattern - (i * FE_WIDTH), 2 * FE_WIDTH))
       break;
   dev->fp_height -= i;
   fp_dbg ("Removing %d empty lines from image", i - 2);
@@ -594,6 +618,39 @@ reset_param (FpiDeviceEtes603 *dev)
   dev->gain = 0;
 }
 
+static void
+store_param (FpiDeviceEtes603 *dev)
+{
+  guint8 param[4] = { dev->gain, dev->dcoffset, dev->vrt, dev->vrb };
+  g_autoptr(GBytes) data = g_bytes_new (param, sizeof (param));
+
+  fpi_device_store_calibration (FP_DEVICE (dev), data);
+}
+
+/* Restores the tuning of an earlier instance of the same sensor, e.g. if
+ * it was re-enumerated after a resume. */
+static gboolean
+restore_param (FpiDeviceEtes603 *dev)
+{
+  g_autoptr(GBytes) data = NULL;
+  const guint8 *param;
+
+  data = fpi_device_lookup_calibration (FP_DEVICE (dev), TUNING_CACHE_AGE);
+  if (!data || g_bytes_get_size (data) != 4)
+    return FALSE;
+
+  param = g_bytes_get_data (data, NULL);
+  if (param[1] == 0)
+    return FALSE;
+
+  dev->gain = param[0];
+  dev->dcoffset = param[1];
+  dev->vrt = param[2];
+  dev->vrb = param[3];
+
+  return TRUE;
+}
+
 
 /* Asynchronous stuff */
 
@@ -817,7 +874,7 @@ m_capture_state (FpiSsm *ssm, FpDevice *dev)
     case CAP_FP_INIT_SET_REG10_REQ:
       /* Reset fingerprint */
       fp_dbg ("Capturing a fingerprint...");
-      memset (self->fp, 0, FE_SIZE * 2);
+      memset (self->fp, 0, FE_SIZE * 4);
       self->fp_height = 0;
       msg_set_regs (self, 2, REG_10, 0x92);
       async_tx (dev, EP_OUT, async_tx_cb, ssm);
@@ -847,8 +904,9 @@ m_capture_state (FpiSsm *ssm, FpDevice *dev)
       break;
 
     case CAP_FP_GET_FP_ANS:
-      memcpy (self->fp + self->fp_height * FE_WIDTH / 2, self->ans,
-              FE_SIZE);
+      /* Expanded to 8bpp right away, the image is then a plain copy */
+      process_4to8_bpp ((guint8 *) self->ans, FE_SIZE,
+                        self->fp + self->fp_height * FE_WIDTH);
       self->fp_height += FE_HEIGHT;
       if (self->fp_height <= FE_HEIGHT)
         {
@@ -872,7 +930,7 @@ m_capture_state (FpiSsm *ssm, FpDevice *dev)
               /* TODO detect sweep direction */
               img->flags = FPI_IMAGE_COLORS_INVERTED | FPI_IMAGE_V_FLIPPED;
               img->height = self->fp_height;
-              process_4to8_bpp (self->fp, img_size / 2, img->data);
+              memcpy (img->data, self->fp, img_size);
               fp_dbg ("Sending the raw fingerprint image (%dx%d)",
                       img->width, img->height);
               fpi_image_device_image_captured (idev, img);
@@ -1018,7 +1076,12 @@ m_finger_state (FpiSsm *ssm, FpDevice *dev)
     case FGR_FPA_GET_FRAME_ANS:
       if (process_frame_empty ((guint8 *) self->ans, FRAME_SIZE))
         {
-          fpi_ssm_jump_to_state (ssm, FGR_FPA_GET_FRAME_REQ);
+          guint delay = fpi_image_device_get_poll_delay (FP_IMAGE_DEVICE (dev), 0, FALSE);
+
+          if (delay == 0)
+            fpi_ssm_jump_to_state (ssm, FGR_FPA_GET_FRAME_REQ);
+          else
+            fpi_ssm_jump_to_state_delayed (ssm, FGR_FPA_GET_FRAME_REQ, delay, NULL);
         }
       else
         {
@@ -1083,7 +1146,7 @@ static void
 m_tunevrb_state (FpiSsm *ssm, FpDevice *dev)
 {
   FpiDeviceEtes603 *self = FPI_DEVICE_ETES603 (dev);
-  float hist[5];
+  FrameHist hist;
 
   if (self->is_active == FALSE)
     {
@@ -1094,8 +1157,14 @@ m_tunevrb_state (FpiSsm *ssm, FpDevice *dev)
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case TUNEVRB_INIT:
-      fp_dbg ("Tuning of VRT/VRB");
       g_assert (self->dcoffset);
+      if (self->tuning_cached)
+        {
+          /* Only write the restored values */
+          fpi_ssm_jump_to_state (ssm, TUNEVRB_FINAL_SET_DCOFFSET_REQ);
+          break;
+        }
+      fp_dbg ("Tuning of VRT/VRB");
       /* VRT(reg E1)=0x0A and VRB(reg E2)=0x10 are starting values */
       self->vrt = 0x0A;
       self->vrb = 0x10;
@@ -1143,9 +1212,9 @@ m_tunevrb_state (FpiSsm *ssm, FpDevice *dev)
       break;
 
     case TUNEVRB_FRAME_ANS:
-      process_hist ((guint8 *) self->ans, FRAME_SIZE, hist);
+      process_hist ((guint8 *) self->ans, FRAME_SIZE, &hist);
       /* Note that this tuning could probably be improved */
-      if (hist[0] + hist[1] > 0.95)
+      if (HIST_ABOVE (&hist, hist.full_black + hist.black, 95))
         {
           if (self->vrt <= 0 || self->vrb <= 0)
             {
@@ -1161,14 +1230,14 @@ m_tunevrb_state (FpiSsm *ssm, FpDevice *dev)
             }
           break;
         }
-      if (hist[4] > 0.95)
+      if (HIST_ABOVE (&hist, hist.full_white, 95))
         {
           fp_dbg ("Image is too bright, increasing DCOffset");
           self->dcoffset++;
           fpi_ssm_jump_to_state (ssm, TUNEVRB_INIT);
           break;
         }
-      if (hist[4] + hist[3] > 0.4)
+      if (HIST_ABOVE (&hist, hist.full_white + hist.white, 40))
         {
           if (self->vrt >= 2 * self->vrb - 0x0a)
             {
@@ -1258,6 +1327,18 @@ m_tunevrb_complete (FpiSsm *ssm, FpDevice *dev, GError *error)
   FpiDeviceEtes603 *self = FPI_DEVICE_ETES603 (dev);
   FpImageDevice *idev = FP_IMAGE_DEVICE (dev);
 
+  if (error && self->tuning_cached)
+    {
+      /* Tune again on the next activation */
+      fpi_device_clear_calibration (dev);
+      reset_param (self);
+    }
+  else if (!error && !self->tuning_cached)
+    {
+      store_param (self);
+    }
+  self->tuning_cached = FALSE;
+
   fpi_image_device_activate_complete (idev, error);
   if (!error)
     {
@@ -1530,8 +1611,16 @@ static void
 m_init_complete (FpiSsm *ssm, FpDevice *dev, GError *error)
 {
   FpImageDevice *idev = FP_IMAGE_DEVICE (dev);
+  FpiDeviceEtes603 *self = FPI_DEVICE_ETES603 (dev);
 
-  if (!error)
+  if (!error && self->tuning_cached)
+    {
+      FpiSsm *ssm_tune;
+      ssm_tune = fpi_ssm_new (FP_DEVICE (idev), m_tunevrb_state,
+                              TUNEVRB_NUM_STATES);
+      fpi_ssm_start (ssm_tune, m_tunevrb_complete);
+    }
+  else if (!error)
     {
       FpiSsm *ssm_tune;
       ssm_tune = fpi_ssm_new (FP_DEVICE (idev), m_tunedc_state,
@@ -1541,7 +1630,8 @@ m_init_complete (FpiSsm *ssm, FpDevice *dev, GError *error)
   else
     {
       fp_err ("Error initializing the device");
-      reset_param (FPI_DEVICE_ETES603 (dev));
+      self->tuning_cached = FALSE;
+      reset_param (self);
       fpi_image_device_session_error (idev, error);
     }
 }
@@ -1557,7 +1647,16 @@ dev_activate (FpImageDevice *idev)
   /* Reset info and data */
   self->is_active = TRUE;
 
-  if (self->dcoffset == 0)
+  if (self->dcoffset == 0 && restore_param (self))
+    {
+      fp_dbg ("Initializing device with cached tuning (DCOFFSET=0x%02X,"
+              "VRT=0x%02X,VRB=0x%02X,GAIN=0x%02X).", self->dcoffset,
+              self->vrt, self->vrb, self->gain);
+      self->tuning_cached = TRUE;
+      ssm = fpi_ssm_new (FP_DEVICE (idev), m_init_state, INIT_NUM_STATES);
+      fpi_ssm_start (ssm, m_init_complete);
+    }
+  else if (self->dcoffset == 0)
     {
       fp_dbg ("Tuning device...");
       ssm = fpi_ssm_new (FP_DEVICE (idev), m_init_state, INIT_NUM_STATES);
@@ -1622,7 +1721,7 @@ dev_close (FpImageDevice *idev)
   fpi_image_device_close_complete (idev, error);
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_etes603_id_table[] = {
   /* EgisTec (aka Lightuning) ES603 */
   { .vid = 0x1c7a,  .pid = 0x0603, },
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
@@ -1641,7 +1740,7 @@ fpi_device_etes603_class_init (FpiDeviceEtes603Class *klass)
   dev_class->id = "etes603";
   dev_class->full_name = "EgisTec ES603";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_etes603_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->img_open = dev_open;
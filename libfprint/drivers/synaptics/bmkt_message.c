@@ -17,6 +17,8 @@
  */
 
 #include <glib.h>
+#include <string.h>
+#include "fpi-byte-reader.h"
 #include "bmkt_response.h"
 #include "bmkt_message.h"
 
@@ -193,32 +195,38 @@ parse_get_enrolled_fingers_report (bmkt_msg_resp_t *msg_resp, bmkt_response_t *r
 static int
 parse_get_enrolled_users_report (bmkt_msg_resp_t *msg_resp, bmkt_response_t *resp)
 {
-  int offset = 0;
-  int i = 0;
+  FpiByteReader reader;
+
+  fpi_byte_reader_init (&reader, msg_resp->payload, msg_resp->payload_len);
 
   /* the payload is 2 bytes + template data */
-  if (msg_resp->payload_len < 2)
+  if (!fpi_byte_reader_ensure_remaining (&reader, 2))
     return BMKT_UNRECOGNIZED_MESSAGE;
 
   bmkt_enroll_templates_resp_t *get_enroll_templates_resp = &resp->response.enroll_templates_resp;
 
-  get_enroll_templates_resp->total_query_messages = extract8 (msg_resp->payload, &offset);
-  get_enroll_templates_resp->query_sequence = extract8 (msg_resp->payload, &offset);
+  get_enroll_templates_resp->total_query_messages = fpi_byte_reader_get_uint8_unchecked (&reader);
+  get_enroll_templates_resp->query_sequence = fpi_byte_reader_get_uint8_unchecked (&reader);
 
   int n = 0;
   for (n = 0; n < BMKT_MAX_NUM_TEMPLATES_INTERNAL_FLASH; n++)
     {
-      if (offset >= msg_resp->payload_len)
+      bmkt_enroll_template_t *template = &get_enroll_templates_resp->templates[n];
+
+      /* each record is length, status and finger ID, followed by the user ID */
+      if (!fpi_byte_reader_ensure_remaining (&reader, 3))
         break;
-      get_enroll_templates_resp->templates[n].user_id_len = extract8 (msg_resp->payload, &offset) - 2;
-      if(get_enroll_templates_resp->templates[n].user_id_len > BMKT_MAX_USER_ID_LEN)
+      template->user_id_len = fpi_byte_reader_get_uint8_unchecked (&reader) - 2;
+      if (template->user_id_len > BMKT_MAX_USER_ID_LEN)
+        return BMKT_UNRECOGNIZED_MESSAGE;
+      template->template_status = fpi_byte_reader_get_uint8_unchecked (&reader);
+      template->finger_id = fpi_byte_reader_get_uint8_unchecked (&reader);
+
+      if (!fpi_byte_reader_ensure_remaining (&reader, template->user_id_len))
         return BMKT_UNRECOGNIZED_MESSAGE;
-      get_enroll_templates_resp->templates[n].template_status = extract8 (msg_resp->payload, &offset);
-      get_enroll_templates_resp->templates[n].finger_id = extract8 (msg_resp->payload, &offset);
-      for (i = 0; i < get_enroll_templates_resp->templates[n].user_id_len; i++)
-        get_enroll_templates_resp->templates[n].user_id[i] = extract8 (msg_resp->payload, &offset);
-      get_enroll_templates_resp->templates[n].user_id[i] = '\0';
+      template->user_id = fpi_byte_reader_get_data_unchecked (&reader, template->user_id_len);
     }
+  get_enroll_templates_resp->num_templates = n;
 
   return BMKT_SUCCESS;
 }
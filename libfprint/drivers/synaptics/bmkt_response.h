@@ -418,7 +418,7 @@ typedef struct bmkt_enroll_template
   uint8_t user_id_len;                              /**< Length of user_id string */
   uint8_t template_status;                          /**< Template record status  */
   uint8_t finger_id;                                /**< ID of enrolled finger */
-  uint8_t user_id[BMKT_MAX_USER_ID_LEN + 1];        /**< Name of the enrolled user */
+  const uint8_t *user_id;                           /**< Name of the enrolled user, points into the message and is not nul terminated */
 } bmkt_enroll_template_t;
 
 /**
@@ -429,6 +429,7 @@ typedef struct bmkt_enroll_templates_resp
 {
   uint8_t                total_query_messages;                                   /**< Total query response messages */
   uint8_t                query_sequence;                                         /**< Query response sequence number */
+  uint8_t                num_templates;                                          /**< Number of entries of templates */
   bmkt_enroll_template_t templates[BMKT_MAX_NUM_TEMPLATES_INTERNAL_FLASH];       /**< Enrolled user template records list */
 } bmkt_enroll_templates_resp_t;
 
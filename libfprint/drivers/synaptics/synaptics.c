@@ -27,7 +27,7 @@
 
 G_DEFINE_TYPE (FpiDeviceSynaptics, fpi_device_synaptics, FP_TYPE_DEVICE)
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_synaptics_id_table[] = {
   { .vid = SYNAPTICS_VENDOR_ID,  .pid = 0xBD,  },
 
   { .vid = 0,  .pid = 0,  .driver_data = 0 },   /* terminating entry */
@@ -35,13 +35,12 @@ static const FpIdEntry id_table[] = {
 
 
 static void
-cmd_receive_cb (FpiUsbTransfer *transfer,
-                FpDevice       *device,
-                gpointer        user_data,
-                GError         *error)
+cmd_process_reply (FpiUsbTransfer *transfer,
+                   FpDevice       *device,
+                   GError         *error)
 {
   FpiDeviceSynaptics *self = FPI_DEVICE_SYNAPTICS (device);
-  SynCmdMsgCallback callback = user_data;
+  SynCmdMsgCallback callback = fpi_ssm_get_data (transfer->ssm);
   int res;
   bmkt_msg_resp_t msg_resp;
   bmkt_response_t resp;
@@ -146,7 +145,7 @@ cmd_receive_cb (FpiUsbTransfer *transfer,
         {
           fp_dbg ("Received message with 0 sequence number 0x%02x, ignoring!",
                   msg_resp.msg_id);
-          fpi_ssm_next_state (transfer->ssm);
+          fpi_ssm_jump_to_state (transfer->ssm, SYNAPTICS_CMD_WAIT_INTERRUPT);
           return;
         }
     }
@@ -161,7 +160,16 @@ cmd_receive_cb (FpiUsbTransfer *transfer,
     }
 
   if (callback)
-    callback (self, &resp, NULL);
+    {
+      /* Keeps the transfer alive for responses that point into it */
+      if (msg_resp.payload_len > 0)
+        self->cmd_reply_payload =
+          g_bytes_new_with_free_func (msg_resp.payload, msg_resp.payload_len,
+                                      (GDestroyNotify) fpi_usb_transfer_unref,
+                                      fpi_usb_transfer_ref (transfer));
+      callback (self, &resp, NULL);
+      g_clear_pointer (&self->cmd_reply_payload, g_bytes_unref);
+    }
 
   /* Callback may have queued a follow up command, then we need
    * to restart the SSM. If not, we'll finish/wait for interrupt
@@ -169,11 +177,95 @@ cmd_receive_cb (FpiUsbTransfer *transfer,
   if (self->cmd_pending_transfer)
     fpi_ssm_jump_to_state (transfer->ssm, SYNAPTICS_CMD_SEND_PENDING);
   else if (!resp.complete || self->cmd_complete_on_removal)
-    fpi_ssm_next_state (transfer->ssm);             /* SYNAPTICS_CMD_WAIT_INTERRUPT */
+    fpi_ssm_jump_to_state (transfer->ssm, SYNAPTICS_CMD_WAIT_INTERRUPT);
   else
     fpi_ssm_mark_completed (transfer->ssm);
 }
 
+static void
+cmd_receive_cb (FpiUsbTransfer *transfer,
+                FpDevice       *device,
+                gpointer        user_data,
+                GError         *error)
+{
+  FpiDeviceSynaptics *self = FPI_DEVICE_SYNAPTICS (device);
+
+  if (self->cmd_sending)
+    {
+      /* Only handle the reply once the request was confirmed */
+      self->cmd_reply = fpi_usb_transfer_ref (transfer);
+      self->cmd_reply_error = error;
+      return;
+    }
+
+  if (self->cmd_send_error)
+    {
+      g_clear_error (&error);
+      fpi_ssm_mark_failed (transfer->ssm, g_steal_pointer (&self->cmd_send_error));
+      return;
+    }
+
+  cmd_process_reply (transfer, device, error);
+}
+
+static void
+cmd_send_cb (FpiUsbTransfer *transfer,
+             FpDevice       *device,
+             gpointer        user_data,
+             GError         *error)
+{
+  FpiDeviceSynaptics *self = FPI_DEVICE_SYNAPTICS (device);
+
+  self->cmd_sending = FALSE;
+
+  if (error)
+    {
+      /* No reply is going to come */
+      self->cmd_send_error = error;
+      g_cancellable_cancel (self->cmd_reply_cancellable);
+    }
+
+  if (self->cmd_reply)
+    {
+      g_autoptr(FpiUsbTransfer) reply = g_steal_pointer (&self->cmd_reply);
+
+      cmd_receive_cb (reply, device, NULL, g_steal_pointer (&self->cmd_reply_error));
+    }
+}
+
+static void
+cmd_receive (FpiSsm *ssm, FpDevice *dev)
+{
+  FpiDeviceSynaptics *self = FPI_DEVICE_SYNAPTICS (dev);
+  FpiUsbTransfer *transfer;
+
+  g_clear_object (&self->cmd_reply_cancellable);
+  self->cmd_reply_cancellable = g_cancellable_new ();
+
+  transfer = fpi_usb_transfer_new (dev);
+  transfer->ssm = ssm;
+  fpi_usb_transfer_fill_bulk (transfer, USB_EP_REPLY, MAX_TRANSFER_LEN);
+  fpi_usb_transfer_submit (transfer,
+                           5000,
+                           self->cmd_reply_cancellable,
+                           cmd_receive_cb,
+                           NULL);
+}
+
+/* Sends @request and reads the reply at the same time, which saves waiting
+ * for the request to be confirmed before the read is queued. */
+static void
+cmd_send_and_receive (FpiSsm *ssm, FpDevice *dev, FpiUsbTransfer *request)
+{
+  FpiDeviceSynaptics *self = FPI_DEVICE_SYNAPTICS (dev);
+
+  self->cmd_sending = TRUE;
+  request->ssm = ssm;
+  fpi_usb_transfer_submit (request, 1000, NULL, cmd_send_cb, NULL);
+
+  cmd_receive (ssm, dev);
+}
+
 static void
 cmd_interrupt_cb (FpiUsbTransfer *transfer,
                   FpDevice       *device,
@@ -212,31 +304,13 @@ synaptics_cmd_run_state (FpiSsm   *ssm,
     {
     case SYNAPTICS_CMD_SEND_PENDING:
       if (self->cmd_pending_transfer)
-        {
-          self->cmd_pending_transfer->ssm = ssm;
-          fpi_usb_transfer_submit (self->cmd_pending_transfer,
-                                   1000,
-                                   NULL,
-                                   fpi_ssm_usb_transfer_cb,
-                                   NULL);
-          self->cmd_pending_transfer = NULL;
-        }
+        cmd_send_and_receive (ssm, dev, g_steal_pointer (&self->cmd_pending_transfer));
       else
-        {
-          fpi_ssm_next_state (ssm);
-        }
+        fpi_ssm_next_state (ssm);
       break;
 
     case SYNAPTICS_CMD_GET_RESP:
-      transfer = fpi_usb_transfer_new (dev);
-      transfer->ssm = ssm;
-      fpi_usb_transfer_fill_bulk (transfer, USB_EP_REPLY, MAX_TRANSFER_LEN);
-      fpi_usb_transfer_submit (transfer,
-                               5000,
-                               NULL,
-                               cmd_receive_cb,
-                               fpi_ssm_get_data (ssm));
-
+      cmd_receive (ssm, dev);
       break;
 
     case SYNAPTICS_CMD_WAIT_INTERRUPT:
@@ -256,16 +330,7 @@ synaptics_cmd_run_state (FpiSsm   *ssm,
       transfer->ssm = ssm;
       fpi_usb_transfer_fill_bulk (transfer, USB_EP_REQUEST, SENSOR_FW_CMD_HEADER_LEN);
       transfer->buffer[0] = SENSOR_CMD_ASYNCMSG_READ;
-      fpi_usb_transfer_submit (transfer,
-                               1000,
-                               NULL,
-                               fpi_ssm_usb_transfer_cb,
-                               NULL);
-
-      break;
-
-    case SYNAPTICS_CMD_RESTART:
-      fpi_ssm_jump_to_state (ssm, SYNAPTICS_CMD_SEND_PENDING);
+      cmd_send_and_receive (ssm, dev, transfer);
       break;
     }
 }
@@ -440,7 +505,6 @@ list_msg_cb (FpiDeviceSynaptics *self,
 
   if (error)
     {
-      g_clear_pointer (&self->list_result, g_ptr_array_unref);
       fpi_device_list_complete (FP_DEVICE (self), NULL, error);
       return;
     }
@@ -454,14 +518,11 @@ list_msg_cb (FpiDeviceSynaptics *self,
         {
           fp_info ("Database is empty");
 
-          fpi_device_list_complete (FP_DEVICE (self),
-                                    g_steal_pointer (&self->list_result),
-                                    NULL);
+          fpi_device_list_complete (FP_DEVICE (self), NULL, NULL);
         }
       else
         {
           fp_info ("Failed to query enrolled users: %d", resp->result);
-          g_clear_pointer (&self->list_result, g_ptr_array_unref);
           fpi_device_list_complete (FP_DEVICE (self),
                                     NULL,
                                     fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
@@ -473,51 +534,56 @@ list_msg_cb (FpiDeviceSynaptics *self,
     case BMKT_RSP_QUERY_RESPONSE_COMPLETE:
       fp_info ("Query complete!");
 
-      fpi_device_list_complete (FP_DEVICE (self),
-                                g_steal_pointer (&self->list_result),
-                                NULL);
+      fpi_device_list_complete (FP_DEVICE (self), NULL, NULL);
 
       break;
 
     case BMKT_RSP_TEMPLATE_RECORDS_REPORT:
 
-      for (int n = 0; n < BMKT_MAX_NUM_TEMPLATES_INTERNAL_FLASH; n++)
+      for (int n = 0; n < get_enroll_templates_resp->num_templates; n++)
         {
+          bmkt_enroll_template_t *template = &get_enroll_templates_resp->templates[n];
+          g_autoptr(GBytes) uid_bytes = NULL;
+          g_autofree gchar *userid = NULL;
           GVariant *data = NULL;
           GVariant *uid = NULL;
           FpPrint *print;
-          gchar *userid;
 
-          if (get_enroll_templates_resp->templates[n].user_id_len == 0)
+          if (template->user_id_len == 0)
             continue;
 
-          fp_info ("![query %d of %d] template %d: status=0x%x, userId=%s, fingerId=%d",
+          fp_info ("![query %d of %d] template %d: status=0x%x, userId=%.*s, fingerId=%d",
                    get_enroll_templates_resp->query_sequence,
                    get_enroll_templates_resp->total_query_messages,
                    n,
-                   get_enroll_templates_resp->templates[n].template_status,
-                   get_enroll_templates_resp->templates[n].user_id,
-                   get_enroll_templates_resp->templates[n].finger_id);
+                   template->template_status,
+                   template->user_id_len, template->user_id,
+                   template->finger_id);
 
-          userid = (gchar *) get_enroll_templates_resp->templates[n].user_id;
+          userid = g_strndup ((const gchar *) template->user_id, template->user_id_len);
 
+          /* The user ID is not copied, the print data refers to the reply */
+          uid_bytes = g_bytes_new_from_bytes (self->cmd_reply_payload,
+                                              template->user_id -
+                                              (const guint8 *) g_bytes_get_data (self->cmd_reply_payload, NULL),
+                                              template->user_id_len);
           print = fp_print_new (FP_DEVICE (self));
-          uid = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
-                                           get_enroll_templates_resp->templates[n].user_id,
-                                           get_enroll_templates_resp->templates[n].user_id_len,
-                                           1);
+          uid = g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING, uid_bytes, TRUE);
           data = g_variant_new ("(y@ay)",
-                                get_enroll_templates_resp->templates[n].finger_id,
+                                template->finger_id,
                                 uid);
 
           fpi_print_set_type (print, FPI_PRINT_RAW);
           fpi_print_set_device_stored (print, TRUE);
           g_object_set (print, "fpi-data", data, NULL);
-          g_object_set (print, "description", get_enroll_templates_resp->templates[n].user_id, NULL);
+          g_object_set (print, "description", userid, NULL);
 
           fpi_print_fill_from_user_id (print, userid);
 
-          g_ptr_array_add (self->list_result, g_object_ref_sink (print));
+          /* There is no way to abort the query, so once the caller stopped
+           * listing the remaining reports are only drained. */
+          if (!fpi_device_list_report (FP_DEVICE (self), print))
+            break;
         }
 
       synaptics_sensor_cmd (self,
@@ -538,7 +604,6 @@ list (FpDevice *device)
 
   G_DEBUG_HERE ();
 
-  self->list_result = g_ptr_array_new_with_free_func (g_object_unref);
   synaptics_sensor_cmd (self, 0, BMKT_CMD_GET_TEMPLATE_RECORDS, NULL, 0, list_msg_cb);
 }
 
@@ -884,6 +949,140 @@ delete_print (FpDevice *device)
   synaptics_sensor_cmd (self, 0, BMKT_CMD_DEL_USER_FP, payload, user_id_len + 1, delete_msg_cb);
 }
 
+static void
+clear_storage_msg_cb (FpiDeviceSynaptics *self,
+                      bmkt_response_t    *resp,
+                      GError             *error)
+{
+  FpDevice *device = FP_DEVICE (self);
+
+  if (error)
+    {
+      fpi_device_clear_storage_complete (device, error);
+      return;
+    }
+
+  switch (resp->response_id)
+    {
+    case BMKT_RSP_DELETE_PROGRESS:
+      fp_info ("Deleting all enrolled users is %d%% complete",
+               resp->response.del_all_users_resp.progress);
+      break;
+
+    case BMKT_RSP_DEL_FULL_DB_FAIL:
+      fp_info ("Failed to delete all enrolled users: %d", resp->result);
+      fpi_device_clear_storage_complete (device,
+                                         fpi_device_error_new (FP_DEVICE_ERROR_GENERAL));
+      break;
+
+    case BMKT_RSP_DEL_FULL_DB_OK:
+      fp_info ("Successfully deleted all enrolled users");
+      fpi_device_clear_storage_complete (device, NULL);
+      break;
+    }
+}
+
+static void
+clear_storage (FpDevice *device)
+{
+  FpiDeviceSynaptics *self = FPI_DEVICE_SYNAPTICS (device);
+
+  G_DEBUG_HERE ();
+
+  synaptics_sensor_cmd (self, 0, BMKT_CMD_DEL_FULL_DB, NULL, 0, clear_storage_msg_cb);
+}
+
+/* Probe cache
+ *
+ * Keep the firmware version of each sensor, so that re-enumerating it only
+ * needs the serial string descriptor to be read before it is probed again.
+ * The key is read from the unit itself: the USB serial, together with the
+ * release number of the device descriptor, which changes when the firmware
+ * is updated. The entry is dropped if opening the device fails. */
+
+typedef struct
+{
+  bmkt_sensor_version_t mis_version;
+} SynapticsProbeCache;
+
+static GHashTable *probe_caches = NULL;
+G_LOCK_DEFINE_STATIC (probe_caches);
+
+static void
+probe_cache_free (SynapticsProbeCache *cache)
+{
+  g_free (cache);
+}
+
+static gchar *
+probe_cache_key (FpiDeviceSynaptics *self, const gchar *serial)
+{
+  GUsbDevice *usb_dev = fpi_device_get_usb_device (FP_DEVICE (self));
+
+  if (!serial || !*serial)
+    return NULL;
+
+  return g_strdup_printf ("%04x:%04x:%04x:%s",
+                          g_usb_device_get_vid (usb_dev),
+                          g_usb_device_get_pid (usb_dev),
+                          g_usb_device_get_release (usb_dev),
+                          serial);
+}
+
+static gboolean
+probe_cache_lookup (FpiDeviceSynaptics *self, const gchar *serial)
+{
+  g_autofree gchar *key = probe_cache_key (self, serial);
+  SynapticsProbeCache *cache = NULL;
+
+  if (!key)
+    return FALSE;
+
+  G_LOCK (probe_caches);
+  if (probe_caches)
+    cache = g_hash_table_lookup (probe_caches, key);
+  if (cache)
+    self->mis_version = cache->mis_version;
+  G_UNLOCK (probe_caches);
+
+  return cache != NULL;
+}
+
+static void
+probe_cache_store (FpiDeviceSynaptics *self, const gchar *serial)
+{
+  g_autofree gchar *key = probe_cache_key (self, serial);
+  SynapticsProbeCache *cache;
+
+  if (!key)
+    return;
+
+  cache = g_new0 (SynapticsProbeCache, 1);
+  cache->mis_version = self->mis_version;
+
+  G_LOCK (probe_caches);
+  if (!probe_caches)
+    probe_caches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify) probe_cache_free);
+  g_hash_table_replace (probe_caches, g_steal_pointer (&key), cache);
+  G_UNLOCK (probe_caches);
+}
+
+static void
+probe_cache_clear (FpiDeviceSynaptics *self)
+{
+  g_autofree gchar *key = probe_cache_key (self,
+                                           fp_device_get_device_id (FP_DEVICE (self)));
+
+  if (!key)
+    return;
+
+  G_LOCK (probe_caches);
+  if (probe_caches)
+    g_hash_table_remove (probe_caches, key);
+  G_UNLOCK (probe_caches);
+}
+
 static void
 dev_probe (FpDevice *device)
 {
@@ -908,6 +1107,29 @@ dev_probe (FpDevice *device)
       return;
     }
 
+  /* This is the same as the serial_number of the version query, hex
+   * encoded and somewhat reordered */
+  /* Should we add in more, e.g. the chip revision? */
+  if (g_strcmp0 (g_getenv ("FP_DEVICE_EMULATION"), "1") == 0)
+    serial = g_strdup ("emulated-device");
+  else
+    serial = g_usb_device_get_string_descriptor (usb_dev,
+                                                 g_usb_device_get_serial_number_index (usb_dev),
+                                                 &error);
+  if (!serial)
+    goto err_close;
+
+  if (probe_cache_lookup (self, serial))
+    {
+      fp_dbg ("Using cached firmware version %d.%d with build number %d",
+              self->mis_version.version_major,
+              self->mis_version.version_minor,
+              self->mis_version.build_num);
+      g_usb_device_close (usb_dev, NULL);
+      fpi_device_probe_complete (device, serial, NULL, NULL);
+      return;
+    }
+
   if (!g_usb_device_reset (usb_dev, &error))
     goto err_close;
 
@@ -997,18 +1219,11 @@ dev_probe (FpDevice *device)
       goto err_close;
     }
 
-  /* This is the same as the serial_number from above, hex encoded and somewhat reordered */
-  /* Should we add in more, e.g. the chip revision? */
-  if (g_strcmp0 (g_getenv ("FP_DEVICE_EMULATION"), "1") == 0)
-    serial = g_strdup ("emulated-device");
-  else
-    serial = g_usb_device_get_string_descriptor (usb_dev,
-                                                 g_usb_device_get_serial_number_index (usb_dev),
-                                                 &error);
-
   g_usb_device_close (usb_dev, NULL);
 
-  fpi_device_probe_complete (device, serial, NULL, error);
+  probe_cache_store (self, serial);
+
+  fpi_device_probe_complete (device, serial, NULL, NULL);
 
   return;
 
@@ -1024,6 +1239,7 @@ fps_init_msg_cb (FpiDeviceSynaptics *self,
 {
   if (error)
     {
+      probe_cache_clear (self);
       fpi_device_open_complete (FP_DEVICE (self), error);
       return;
     }
@@ -1036,6 +1252,7 @@ fps_init_msg_cb (FpiDeviceSynaptics *self,
   else
     {
       g_warning ("Initializing fingerprint sensor failed with %d!", resp->result);
+      probe_cache_clear (self);
       fpi_device_open_complete (FP_DEVICE (self),
                                 fpi_device_error_new (FP_DEVICE_ERROR_GENERAL));
     }
@@ -1049,6 +1266,7 @@ fps_deinit_cb (FpiDeviceSynaptics *self,
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (self)), 0, 0, &error);
 
   g_clear_object (&self->interrupt_cancellable);
+  g_clear_object (&self->cmd_reply_cancellable);
 
   if (!error)
     {
@@ -1091,6 +1309,7 @@ dev_init (FpDevice *device)
   return;
 
 error:
+  probe_cache_clear (self);
   fpi_device_open_complete (FP_DEVICE (self), error);
 }
 
@@ -1135,7 +1354,7 @@ fpi_device_synaptics_class_init (FpiDeviceSynapticsClass *klass)
 
   dev_class->type = FP_DEVICE_TYPE_USB;
   dev_class->scan_type = FP_SCAN_TYPE_PRESS;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_synaptics_id_table;
   dev_class->nr_enroll_stages = ENROLL_SAMPLES;
 
   dev_class->open = dev_init;
@@ -1144,6 +1363,7 @@ fpi_device_synaptics_class_init (FpiDeviceSynapticsClass *klass)
   dev_class->verify = verify;
   dev_class->enroll = enroll;
   dev_class->delete = delete_print;
+  dev_class->clear_storage = clear_storage;
   dev_class->cancel = cancel;
   dev_class->list = list;
 }
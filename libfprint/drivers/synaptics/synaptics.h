@@ -92,7 +92,6 @@ typedef enum {
   SYNAPTICS_CMD_GET_RESP,
   SYNAPTICS_CMD_WAIT_INTERRUPT,
   SYNAPTICS_CMD_SEND_ASYNC,
-  SYNAPTICS_CMD_RESTART,
   SYNAPTICS_CMD_NUM_STATES,
 } SynapticsCmdState;
 
@@ -111,13 +110,22 @@ struct _FpiDeviceSynaptics
   FpiUsbTransfer       *cmd_pending_transfer;
   gboolean              cmd_complete_on_removal;
 
+  /* The reply is read while the request is being sent */
+  gboolean              cmd_sending;
+  GError               *cmd_send_error;
+  FpiUsbTransfer       *cmd_reply;
+  GError               *cmd_reply_error;
+  GCancellable         *cmd_reply_cancellable;
+  /* The payload of the reply while its callback runs, responses may
+   * point into it */
+  GBytes               *cmd_reply_payload;
+
   bmkt_sensor_version_t mis_version;
 
   GCancellable         *interrupt_cancellable;
 
   gint                  enroll_stage;
   gboolean              finger_on_sensor;
-  GPtrArray            *list_result;
 
 
   struct syna_enroll_resp_data enroll_resp_data;
@@ -18,6 +18,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <glib.h>
+
 #include "upek_proto.h"
 
 static const uint16_t crc_table[256] = {
@@ -55,11 +57,50 @@ static const uint16_t crc_table[256] = {
   0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
 };
 
+/* crc_slices[k][b] is the CRC of the byte b followed by k zero bytes,
+ * which allows processing 8 bytes per step */
+static uint16_t crc_slices[8][256];
+
+static void
+udf_crc_init_slices (void)
+{
+  int b, k;
+
+  for (b = 0; b < 256; b++)
+    {
+      crc_slices[0][b] = crc_table[b];
+      for (k = 1; k < 8; k++)
+        {
+          uint16_t prev = crc_slices[k - 1][b];
+
+          crc_slices[k][b] = (uint16_t) ((prev << 8) ^ crc_table[prev >> 8]);
+        }
+    }
+}
+
 uint16_t
 udf_crc (unsigned char *buffer, size_t size)
 {
+  static gsize slices_initialized = 0;
   uint16_t crc = 0;
 
+  if (g_once_init_enter (&slices_initialized))
+    {
+      udf_crc_init_slices ();
+      g_once_init_leave (&slices_initialized, 1);
+    }
+
+  while (size >= 8)
+    {
+      crc ^= (uint16_t) ((buffer[0] << 8) | buffer[1]);
+      crc = crc_slices[7][crc >> 8] ^ crc_slices[6][crc & 0xff] ^
+            crc_slices[5][buffer[2]] ^ crc_slices[4][buffer[3]] ^
+            crc_slices[3][buffer[4]] ^ crc_slices[2][buffer[5]] ^
+            crc_slices[1][buffer[6]] ^ crc_slices[0][buffer[7]];
+      buffer += 8;
+      size -= 8;
+    }
+
   while (size--)
     crc = (uint16_t) ((crc << 8) ^
                       crc_table[((crc >> 8) & 0x00ff) ^ *buffer++]);
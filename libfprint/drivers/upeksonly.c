@@ -80,11 +80,12 @@ struct _FpiDeviceUpeksonly
   FpiSsm       *loopsm;
 
   /* Do we really need multiple concurrent transfers? */
-  GCancellable                    *img_cancellable;
-  GPtrArray                       *img_transfers;
-  int                              num_flying;
+  FpiUsbTransferStream            *img_stream;
 
-  GSList                          *rows;
+  /* MAX_ROWS + 1 row slots, the row after the accepted ones is filled */
+  unsigned char                   *row_slots;
+  /* List nodes linking the accepted rows, in the order they were seen */
+  GSList                          *row_index;
   size_t                           num_rows;
   unsigned char                   *rowbuf;
   int                              rowbuf_offset;
@@ -164,9 +165,7 @@ upeksonly_get_pixel (struct fpi_line_asmbl_ctx *ctx,
 static void
 free_img_transfers (FpiDeviceUpeksonly *sdev)
 {
-  g_cancellable_cancel (sdev->img_cancellable);
-  g_clear_object (&sdev->img_cancellable);
-  g_clear_pointer (&sdev->img_transfers, g_ptr_array_unref);
+  g_clear_pointer (&sdev->img_stream, fpi_usb_transfer_stream_free);
 }
 
 static void
@@ -201,9 +200,10 @@ cancel_img_transfers (FpImageDevice *dev)
 {
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
 
-  g_cancellable_cancel (self->img_cancellable);
-
-  if (self->num_flying == 0)
+  /* Otherwise img_stream_done_cb() is called once all transfers returned */
+  if (fpi_usb_transfer_stream_is_active (self->img_stream))
+    fpi_usb_transfer_stream_stop (self->img_stream);
+  else
     last_transfer_killed (dev);
 }
 
@@ -219,21 +219,14 @@ handoff_img (FpImageDevice *dev)
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
   FpImage *img;
 
-  GSList *elem = self->rows;
-
-  if (!elem)
+  if (!self->num_rows)
     {
       fp_err ("no rows?");
       return;
     }
 
-  self->rows = g_slist_reverse (self->rows);
-
   fp_dbg ("%lu rows", self->num_rows);
-  img = fpi_assemble_lines (&self->assembling_ctx, self->rows, self->num_rows);
-
-  g_slist_free_full (self->rows, g_free);
-  self->rows = NULL;
+  img = fpi_assemble_lines (&self->assembling_ctx, self->row_index, self->num_rows);
 
   fpi_image_device_image_captured (dev, img);
   fpi_image_device_report_finger_status (dev, FALSE);
@@ -243,6 +236,25 @@ handoff_img (FpImageDevice *dev)
   cancel_img_transfers (dev);
 }
 
+static unsigned char *
+last_row (FpiDeviceUpeksonly *self)
+{
+  return self->row_index[self->num_rows - 1].data;
+}
+
+static void
+accept_row (FpiDeviceUpeksonly *self)
+{
+  GSList *node = &self->row_index[self->num_rows];
+
+  node->data = self->rowbuf;
+  node->next = NULL;
+  if (self->num_rows > 0)
+    self->row_index[self->num_rows - 1].next = node;
+
+  self->num_rows++;
+}
+
 static void
 row_complete (FpImageDevice *dev)
 {
@@ -252,7 +264,7 @@ row_complete (FpImageDevice *dev)
 
   if (self->num_rows > 0)
     {
-      unsigned char *lastrow = self->rows->data;
+      unsigned char *lastrow = last_row (self);
       int std_sq_dev, mean_sq_diff;
 
       std_sq_dev = fpi_std_sq_dev (self->rowbuf, self->img_width);
@@ -325,23 +337,16 @@ row_complete (FpImageDevice *dev)
     {
     case AWAIT_FINGER:
       if (!self->num_rows)
-        {
-          self->rows = g_slist_prepend (self->rows, self->rowbuf);
-          self->num_rows++;
-        }
+        accept_row (self);
       else
-        {
-          return;
-        }
+        return;
       break;
 
     case FINGER_DETECTED:
     case FINGER_REMOVED:
-      self->rows = g_slist_prepend (self->rows, self->rowbuf);
-      self->num_rows++;
+      accept_row (self);
       break;
     }
-  self->rowbuf = NULL;
 
   if (self->num_rows >= MAX_ROWS)
     {
@@ -367,8 +372,8 @@ static void
 start_new_row (FpiDeviceUpeksonly *self, unsigned char *data,
                int size)
 {
-  if (!self->rowbuf)
-    self->rowbuf = g_malloc (self->img_width);
+  /* Rows that are not accepted are overwritten by the next one */
+  self->rowbuf = self->row_slots + self->num_rows * self->img_width;
   memcpy (self->rowbuf, data, size);
   self->rowbuf_offset = size;
 }
@@ -422,21 +427,20 @@ handle_packet (FpImageDevice *dev, unsigned char *data)
               if (self->num_rows > 1)
                 {
                   int row_left = self->img_width - self->rowbuf_offset;
-                  unsigned char *last_row = g_slist_nth_data (self->rows,
-                                                              0);
+                  unsigned char *prev_row = last_row (self);
 
                   if (row_left >= 62)
                     {
                       memcpy (dummy_data,
-                              last_row + self->rowbuf_offset,
+                              prev_row + self->rowbuf_offset,
                               62);
                     }
                   else
                     {
                       memcpy (dummy_data,
-                              last_row + self->rowbuf_offset,
+                              prev_row + self->rowbuf_offset,
                               row_left);
-                      memcpy (dummy_data + row_left, last_row, 62 - row_left);
+                      memcpy (dummy_data + row_left, prev_row, 62 - row_left);
                     }
                 }
 
@@ -512,40 +516,13 @@ handle_packet (FpImageDevice *dev, unsigned char *data)
 }
 
 static void
-img_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
-             gpointer user_data, GError *error)
+img_data_cb (FpiUsbTransferStream *stream, FpiUsbTransfer *transfer,
+             FpDevice *device, gpointer user_data)
 {
   FpImageDevice *dev = FP_IMAGE_DEVICE (device);
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
   int i;
 
-  self->num_flying--;
-
-  if (self->killing_transfers)
-    {
-      if (self->num_flying == 0)
-        last_transfer_killed (dev);
-
-      /* don't care about error or success if we're terminating */
-      g_clear_error (&error);
-      return;
-    }
-
-  if (error)
-    {
-      fp_warn ("bad status %s, terminating session", error->message);
-      self->killing_transfers = IMG_SESSION_ERROR;
-
-      /* This cannot really happen, but just in case. */
-      if (!self->kill_error)
-        self->kill_error = error;
-      else
-        g_error_free (error);
-
-      cancel_img_transfers (dev);
-      return;
-    }
-
   /* there are 64 packets in the transfer buffer
    * each packet is 64 bytes in length
    * the first 2 bytes are a sequence number
@@ -554,19 +531,34 @@ img_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
   for (i = 0; i < 4096; i += 64)
     {
       if (!is_capturing (self))
-        return;
+        break;
       handle_packet (dev, transfer->buffer + i);
     }
 
-  if (is_capturing (self))
+  if (!is_capturing (self))
+    fpi_usb_transfer_stream_stop (stream);
+}
+
+static void
+img_stream_done_cb (FpiUsbTransferStream *stream, FpDevice *device,
+                    gpointer user_data, GError *error)
+{
+  FpImageDevice *dev = FP_IMAGE_DEVICE (device);
+  FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
+
+  /* don't care about error or success if we're terminating */
+  if (error && !self->killing_transfers)
+    {
+      fp_warn ("bad status %s, terminating session", error->message);
+      self->killing_transfers = IMG_SESSION_ERROR;
+      self->kill_error = error;
+    }
+  else
     {
-      fpi_usb_transfer_submit (transfer,
-                               0,
-                               self->img_cancellable,
-                               img_data_cb,
-                               user_data);
-      self->num_flying++;
+      g_clear_error (&error);
     }
+
+  last_transfer_killed (dev);
 }
 
 /***** STATE MACHINE HELPERS *****/
@@ -900,21 +892,11 @@ capsm_fire_bulk (FpiSsm   *ssm,
                  FpDevice *dev)
 {
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
-  int i;
 
   g_assert (self->capturing == FALSE);
 
-  g_clear_object (&self->img_cancellable);
-  self->img_cancellable = g_cancellable_new ();
-  for (i = 0; i < self->img_transfers->len; i++)
-    {
-      fpi_usb_transfer_submit (g_ptr_array_index (self->img_transfers, i),
-                               0,
-                               self->img_cancellable,
-                               img_data_cb,
-                               NULL);
-      self->num_flying++;
-    }
+  fpi_usb_transfer_stream_start (self->img_stream, 0, NULL,
+                                 img_data_cb, img_stream_done_cb, NULL);
   self->capturing = TRUE;
   fpi_ssm_next_state (ssm);
 }
@@ -1334,11 +1316,6 @@ deactivate_done (FpImageDevice *dev, GError *error)
 
   G_DEBUG_HERE ();
   free_img_transfers (self);
-  g_free (self->rowbuf);
-  self->rowbuf = NULL;
-
-  g_slist_free_full (self->rows, g_free);
-  self->rows = NULL;
 
   fpi_image_device_deactivate_complete (dev, error);
 }
@@ -1400,22 +1377,13 @@ dev_activate (FpImageDevice *dev)
 {
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
   FpiSsm *ssm = NULL;
-  int i;
 
   self->deactivating = FALSE;
   self->capturing = FALSE;
 
-  self->num_flying = 0;
-
-  for (i = 0; i < self->img_transfers->len; i++)
-    {
-      FpiUsbTransfer *transfer;
-
-      transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
-      fpi_usb_transfer_fill_bulk (transfer, 0x81, 4096);
-
-      g_ptr_array_add (self->img_transfers, transfer);
-    }
+  self->img_stream = fpi_usb_transfer_stream_new (FP_DEVICE (dev),
+                                                  FP_TRANSFER_BULK, 0x81, 4096,
+                                                  NUM_BULK_TRANSFERS);
 
   switch (self->dev_model)
     {
@@ -1445,8 +1413,13 @@ static void dev_init (FpImageDevice *dev);
 static void
 dev_deinit (FpImageDevice *dev)
 {
+  FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
   GError *error = NULL;
 
+  g_clear_pointer (&self->row_slots, g_free);
+  g_clear_pointer (&self->row_index, g_free);
+  self->rowbuf = NULL;
+
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)),
                                   0, 0, &error);
   fpi_image_device_close_complete (dev, error);
@@ -1471,7 +1444,7 @@ dev_discover (GUsbDevice *usb_device)
   return 0;
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_upeksonly_id_table[] = {
   { .vid = 0x147e,  .pid = 0x2016, .driver_data = UPEKSONLY_2016 },
   { .vid = 0x147e,  .pid = 0x1000, .driver_data = UPEKSONLY_1000 },
   { .vid = 0x147e,  .pid = 0x1001, .driver_data = UPEKSONLY_1001 },
@@ -1491,7 +1464,7 @@ fpi_device_upeksonly_class_init (FpiDeviceUpeksonlyClass *klass)
   dev_class->id = "upeksonly";
   dev_class->full_name = "UPEK TouchStrip Sensor-Only";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_upeksonly_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   dev_class->usb_discover = dev_discover;
@@ -1555,5 +1528,10 @@ dev_init (FpImageDevice *dev)
     default:
       g_assert_not_reached ();
     }
+
+  /* Rows are stored in place during a scan, nothing is allocated then */
+  self->row_slots = g_malloc ((MAX_ROWS + 1) * self->img_width);
+  self->row_index = g_new (GSList, MAX_ROWS);
+
   fpi_image_device_open_complete (dev, NULL);
 }
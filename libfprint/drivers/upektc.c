@@ -261,7 +261,7 @@ capture_read_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
                       gpointer user_data, GError *error)
 {
   FpImageDevice *dev = FP_IMAGE_DEVICE (device);
-  FpImage *img;
+  FpImage *img = user_data;
 
   if (error)
     {
@@ -270,9 +270,8 @@ capture_read_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
       return;
     }
 
-  img = fp_image_new (IMAGE_WIDTH, IMAGE_HEIGHT);
-  memcpy (img->data, transfer->buffer, IMAGE_SIZE);
-  fpi_image_device_image_captured (dev, img);
+  /* The data was read straight into the image */
+  fpi_image_device_image_captured (dev, g_object_ref (img));
   fpi_image_device_report_finger_status (dev, FALSE);
   fpi_ssm_mark_completed (transfer->ssm);
 }
@@ -301,13 +300,16 @@ capture_run_state (FpiSsm *ssm, FpDevice *_dev)
     case CAPTURE_READ_DATA:
       {
         FpiUsbTransfer *transfer = fpi_usb_transfer_new (_dev);
+        /* A short read is an error, so the data is always overwritten */
+        g_autoptr(FpImage) img = fpi_image_new_pooled (_dev, IMAGE_WIDTH, IMAGE_HEIGHT, FALSE);
 
-        fpi_usb_transfer_fill_bulk (transfer, self->ep_in,
-                                    IMAGE_SIZE);
+        /* The transfer keeps the image alive until the callback ran */
+        fpi_usb_transfer_fill_bulk_image (transfer, self->ep_in,
+                                          img, 0, IMAGE_SIZE);
         transfer->ssm = ssm;
         transfer->short_is_error = TRUE;
         fpi_usb_transfer_submit (transfer, BULK_TIMEOUT, NULL,
-                                 capture_read_data_cb, NULL);
+                                 capture_read_data_cb, img);
       }
       break;
     }
@@ -429,7 +431,7 @@ dev_deinit (FpImageDevice *dev)
   fpi_image_device_close_complete (dev, error);
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_upektc_id_table[] = {
   { .vid = 0x0483,  .pid = 0x2015, .driver_data = UPEKTC_2015 },
   { .vid = 0x147e,  .pid = 0x3001, .driver_data = UPEKTC_3001 },
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
@@ -448,7 +450,7 @@ fpi_device_upektc_class_init (FpiDeviceUpektcClass *klass)
   dev_class->id = "upektc";
   dev_class->full_name = "UPEK TouchChip/Eikon Touch 300";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_upektc_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_PRESS;
 
   img_class->img_open = dev_init;
@@ -43,7 +43,6 @@ struct _FpiDeviceUpektcImg
 {
   FpImageDevice  parent;
 
-  unsigned char  cmd[MAX_CMD_SIZE];
   unsigned char  response[MAX_RESPONSE_SIZE];
   unsigned char *image_bits;
   unsigned char  seq;
@@ -78,25 +77,69 @@ upektc_img_cmd_update_crc (unsigned char *cmd_buf, size_t size)
   cmd_buf[size - 1] = (crc & 0xff00) >> 8;
 }
 
+/* The sequence number only has 4 bits, so every command is prepared once
+ * for each of them. The CRC of each variant is then computed only once. */
+#define UPEKTC_IMG_N_SEQ 16
+
+typedef struct
+{
+  const unsigned char *tmpl;
+  size_t               size;
+  gsize                prepared;
+} UpektcImgCmd;
+
+#define UPEKTC_IMG_CMD(tmpl) { tmpl, sizeof (tmpl), 0 }
+
+static UpektcImgCmd cmd_init_1 = UPEKTC_IMG_CMD (upek2020_init_1);
+static UpektcImgCmd cmd_init_2 = UPEKTC_IMG_CMD (upek2020_init_2);
+static UpektcImgCmd cmd_init_3 = UPEKTC_IMG_CMD (upek2020_init_3);
+static UpektcImgCmd cmd_init_4 = UPEKTC_IMG_CMD (upek2020_init_4);
+static UpektcImgCmd cmd_init_capture = UPEKTC_IMG_CMD (upek2020_init_capture);
+static UpektcImgCmd cmd_ack_00_28 = UPEKTC_IMG_CMD (upek2020_ack_00_28);
+static UpektcImgCmd cmd_ack_08 = UPEKTC_IMG_CMD (upek2020_ack_08);
+static UpektcImgCmd cmd_ack_frame = UPEKTC_IMG_CMD (upek2020_ack_frame);
+static UpektcImgCmd cmd_deinit = UPEKTC_IMG_CMD (upek2020_deinit);
+
+/* Returns the command with @seq filled in and a valid CRC */
+static const unsigned char *
+upektc_img_cmd_get (UpektcImgCmd *cmd, unsigned char seq)
+{
+  if (g_once_init_enter (&cmd->prepared))
+    {
+      unsigned char *cmds;
+      unsigned int i;
+
+      BUG_ON (cmd->size > MAX_CMD_SIZE);
+
+      cmds = g_malloc (UPEKTC_IMG_N_SEQ * cmd->size);
+      for (i = 0; i < UPEKTC_IMG_N_SEQ; i++)
+        {
+          unsigned char *buf = cmds + i * cmd->size;
+
+          memcpy (buf, cmd->tmpl, cmd->size);
+          upektc_img_cmd_fix_seq (buf, i);
+          upektc_img_cmd_update_crc (buf, cmd->size);
+        }
+
+      g_once_init_leave (&cmd->prepared, (gsize) cmds);
+    }
+
+  return (const unsigned char *) cmd->prepared + (seq % UPEKTC_IMG_N_SEQ) * cmd->size;
+}
+
 static void
 upektc_img_submit_req (FpiSsm                *ssm,
                        FpImageDevice         *dev,
-                       const unsigned char   *buf,
-                       size_t                 buf_size,
+                       UpektcImgCmd          *cmd,
                        unsigned char          seq,
                        FpiUsbTransferCallback cb)
 {
-  FpiDeviceUpektcImg *self = FPI_DEVICE_UPEKTC_IMG (dev);
   FpiUsbTransfer *transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
 
-  BUG_ON (buf_size > MAX_CMD_SIZE);
-
-  memcpy (self->cmd, buf, buf_size);
-  upektc_img_cmd_fix_seq (self->cmd, seq);
-  upektc_img_cmd_update_crc (self->cmd, buf_size);
-
-  fpi_usb_transfer_fill_bulk_full (transfer, EP_OUT, self->cmd, buf_size,
-                                   NULL);
+  /* The prepared commands are never modified, so they are sent as is */
+  fpi_usb_transfer_fill_bulk_full (transfer, EP_OUT,
+                                   (unsigned char *) upektc_img_cmd_get (cmd, seq),
+                                   cmd->size, NULL);
   transfer->ssm = ssm;
   transfer->short_is_error = TRUE;
   fpi_usb_transfer_submit (transfer, BULK_TIMEOUT, NULL, cb, NULL);
@@ -309,9 +352,12 @@ capture_read_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
           BUG_ON (self->image_size != IMAGE_SIZE);
           fp_dbg ("Image size is %lu\n",
                   self->image_size);
-          img = fp_image_new (IMAGE_WIDTH, IMAGE_HEIGHT);
-          memcpy (img->data, self->image_bits,
-                  IMAGE_SIZE);
+          /* Hand the staging buffer over instead of copying it, the
+           * next capture fills its replacement from the start again. */
+          img = fpi_image_new_for_data (IMAGE_WIDTH, IMAGE_HEIGHT,
+                                        g_steal_pointer (&self->image_bits),
+                                        g_free);
+          self->image_bits = g_malloc (IMAGE_SIZE * 2);
           fpi_image_device_image_captured (dev, img);
           fpi_image_device_report_finger_status (dev,
                                                  FALSE);
@@ -344,8 +390,7 @@ capture_run_state (FpiSsm *ssm, FpDevice *_dev)
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case CAPTURE_INIT_CAPTURE:
-      upektc_img_submit_req (ssm, dev, upek2020_init_capture, sizeof (upek2020_init_capture),
-                             self->seq, capture_reqs_cb);
+      upektc_img_submit_req (ssm, dev, &cmd_init_capture, self->seq, capture_reqs_cb);
       self->seq++;
       break;
 
@@ -360,19 +405,16 @@ capture_run_state (FpiSsm *ssm, FpDevice *_dev)
 
     case CAPTURE_ACK_00_28:
     case CAPTURE_ACK_00_28_TERM:
-      upektc_img_submit_req (ssm, dev, upek2020_ack_00_28, sizeof (upek2020_ack_00_28),
-                             self->seq, capture_reqs_cb);
+      upektc_img_submit_req (ssm, dev, &cmd_ack_00_28, self->seq, capture_reqs_cb);
       self->seq++;
       break;
 
     case CAPTURE_ACK_08:
-      upektc_img_submit_req (ssm, dev, upek2020_ack_08, sizeof (upek2020_ack_08),
-                             0, capture_reqs_cb);
+      upektc_img_submit_req (ssm, dev, &cmd_ack_08, 0, capture_reqs_cb);
       break;
 
     case CAPTURE_ACK_FRAME:
-      upektc_img_submit_req (ssm, dev, upek2020_ack_frame, sizeof (upek2020_ack_frame),
-                             self->seq, capture_reqs_cb);
+      upektc_img_submit_req (ssm, dev, &cmd_ack_frame, self->seq, capture_reqs_cb);
       self->seq++;
       break;
     }
@@ -448,8 +490,7 @@ deactivate_run_state (FpiSsm *ssm, FpDevice *_dev)
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case DEACTIVATE_DEINIT:
-      upektc_img_submit_req (ssm, dev, upek2020_deinit, sizeof (upek2020_deinit),
-                             self->seq, deactivate_reqs_cb);
+      upektc_img_submit_req (ssm, dev, &cmd_deinit, self->seq, deactivate_reqs_cb);
       self->seq++;
       break;
 
@@ -549,23 +590,19 @@ activate_run_state (FpiSsm *ssm, FpDevice *dev)
       break;
 
     case ACTIVATE_INIT_1:
-      upektc_img_submit_req (ssm, idev, upek2020_init_1, sizeof (upek2020_init_1),
-                             0, init_reqs_cb);
+      upektc_img_submit_req (ssm, idev, &cmd_init_1, 0, init_reqs_cb);
       break;
 
     case ACTIVATE_INIT_2:
-      upektc_img_submit_req (ssm, idev, upek2020_init_2, sizeof (upek2020_init_2),
-                             0, init_reqs_cb);
+      upektc_img_submit_req (ssm, idev, &cmd_init_2, 0, init_reqs_cb);
       break;
 
     case ACTIVATE_INIT_3:
-      upektc_img_submit_req (ssm, idev, upek2020_init_3, sizeof (upek2020_init_3),
-                             0, init_reqs_cb);
+      upektc_img_submit_req (ssm, idev, &cmd_init_3, 0, init_reqs_cb);
       break;
 
     case ACTIVATE_INIT_4:
-      upektc_img_submit_req (ssm, idev, upek2020_init_4, sizeof (upek2020_init_4),
-                             self->seq, init_reqs_cb);
+      upektc_img_submit_req (ssm, idev, &cmd_init_4, self->seq, init_reqs_cb);
       /* Seq should be updated after 4th init */
       self->seq++;
       break;
@@ -655,7 +692,7 @@ discover (GUsbDevice *usb_device)
   return 0;
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_upektc_img_id_table[] = {
   { .vid = 0x147e,  .pid = 0x2016, },
   { .vid = 0x147e,  .pid = 0x2020, },
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
@@ -674,7 +711,7 @@ fpi_device_upektc_img_class_init (FpiDeviceUpektcImgClass *klass)
   dev_class->id = "upektc_img";
   dev_class->full_name = "Upek TouchChip Fingerprint Coprocessor";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_upektc_img_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
   dev_class->usb_discover = discover;
 
@@ -36,6 +36,8 @@
 
 #define MSG_READ_BUF_SIZE 0x40
 #define MAX_DATA_IN_READ_BUF (MSG_READ_BUF_SIZE - 9)
+/* The length field has 12 bits, plus header and CRC */
+#define MSG_MAX_SIZE (0xfff + 9)
 
 struct _FpiDeviceUpekts
 {
@@ -187,10 +189,11 @@ typedef void (*read_msg_cb_fn)(FpDevice          *dev,
 
 struct read_msg_data
 {
-  gssize         buflen;
-  guint8        *buffer;
   read_msg_cb_fn callback;
   void          *user_data;
+  /* Large enough for any message, so that the remainder of a long one is
+   * read right behind its first packet */
+  guint8         buffer[MSG_MAX_SIZE];
 };
 
 static void __read_msg_async (FpDevice             *dev,
@@ -208,7 +211,6 @@ busy_ack_sent_cb (FpiUsbTransfer *transfer, FpDevice *device,
   if (error)
     {
       READ_MSG_DATA_CB_ERR (device, udata, error);
-      g_free (udata->buffer);
       g_free (udata);
     }
   else
@@ -309,14 +311,17 @@ __handle_incoming_msg (FpDevice             *device,
       innerlen = innerlen - 3;
       _subcmd = innerbuf[5];
       fp_dbg ("device responds to subcmd %x with %d bytes", _subcmd, innerlen);
-      if (innerlen > 0)
+      if (innerlen > len - 6)
         {
-          retdata = g_malloc (innerlen);
-          memcpy (retdata, innerbuf + 6, innerlen);
+          fp_warn ("cmd response data too long (%d > %d)", innerlen, len - 6);
+          error = fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                            "CMD response data too long (%d)", innerlen);
+          goto err;
         }
+      /* The data is only used during the callback, pass it in place */
       udata->callback (device, READ_MSG_RESPONSE, code_b, _subcmd,
-                       retdata, innerlen, udata->user_data, NULL);
-      g_free (retdata);
+                       innerlen > 0 ? innerbuf + 6 : NULL, innerlen,
+                       udata->user_data, NULL);
       goto done;
     }
   else
@@ -331,7 +336,6 @@ __handle_incoming_msg (FpDevice             *device,
 err:
   READ_MSG_DATA_CB_ERR (device, udata, error);
 done:
-  g_free (udata->buffer);
   g_free (udata);
 }
 
@@ -345,7 +349,6 @@ read_msg_extend_cb (FpiUsbTransfer *transfer, FpDevice *device,
     {
       fp_err ("extended msg read failed: %s", error->message);
       READ_MSG_DATA_CB_ERR (device, udata, error);
-      g_free (udata->buffer);
       g_free (udata);
       return;
     }
@@ -396,17 +399,17 @@ read_msg_cb (FpiUsbTransfer *transfer, FpDevice *device,
       goto err;
     }
 
-  /* We use a 64 byte buffer for reading messages. However, sometimes
-   * messages are longer, in which case we have to do another USB bulk read
-   * to read the remainder. This is handled below. */
+  /* We read 64 bytes, one packet, at first. However, sometimes messages
+   * are longer, in which case we have to do another USB bulk read to read
+   * the remainder. It cannot be read in one go, as a message that is a
+   * multiple of the packet size does not end with a short packet, and the
+   * read would wait for the next message. This is handled below. */
   if (len > MAX_DATA_IN_READ_BUF)
     {
       int needed = len - MAX_DATA_IN_READ_BUF;
       FpiUsbTransfer *etransfer = fpi_usb_transfer_new (device);
 
       fp_dbg ("didn't fit in buffer, need to extend by %d bytes", needed);
-      udata->buffer = g_realloc ((gpointer) udata->buffer, len);
-      udata->buflen = len;
 
       fpi_usb_transfer_fill_bulk_full (etransfer, EP_IN,
                                        udata->buffer + MSG_READ_BUF_SIZE,
@@ -423,7 +426,6 @@ read_msg_cb (FpiUsbTransfer *transfer, FpDevice *device,
   return;
 err:
   READ_MSG_DATA_CB_ERR (device, udata, error);
-  g_free (udata->buffer);
   g_free (udata);
 }
 
@@ -432,13 +434,7 @@ __read_msg_async (FpDevice *device, struct read_msg_data *udata)
 {
   FpiUsbTransfer *transfer = fpi_usb_transfer_new (device);
 
-  if (udata->buflen != MSG_READ_BUF_SIZE)
-    {
-      udata->buffer = g_realloc (udata->buffer, MSG_READ_BUF_SIZE);
-      udata->buflen = MSG_READ_BUF_SIZE;
-    }
-
-  fpi_usb_transfer_fill_bulk_full (transfer, EP_IN, udata->buffer, udata->buflen, NULL);
+  fpi_usb_transfer_fill_bulk_full (transfer, EP_IN, udata->buffer, MSG_READ_BUF_SIZE, NULL);
   fpi_usb_transfer_submit (transfer, TIMEOUT, NULL, read_msg_cb, udata);
 }
 
@@ -447,10 +443,8 @@ read_msg_async (FpDevice      *dev,
                 read_msg_cb_fn callback,
                 void          *user_data)
 {
-  struct read_msg_data *udata = g_new0 (struct read_msg_data, 1);
+  struct read_msg_data *udata = g_new (struct read_msg_data, 1);
 
-  udata->buflen = 0;
-  udata->buffer = NULL;
   udata->callback = callback;
   udata->user_data = user_data;
   __read_msg_async (dev, udata);
@@ -1544,7 +1538,7 @@ verify (FpDevice *dev)
   fpi_ssm_start (ssm, verify_started);
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_upekts_id_table[] = {
   { .vid = 0x0483, .pid = 0x2016, },
   { .vid = 0,  .pid = 0,  .driver_data = 0 },       /* terminating entry */
 };
@@ -1564,7 +1558,7 @@ fpi_device_upekts_class_init (FpiDeviceUpektsClass *klass)
 
   dev_class->type = FP_DEVICE_TYPE_USB;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_upekts_id_table;
   dev_class->nr_enroll_stages = 3;
 
   dev_class->open = dev_init;
@@ -130,6 +130,16 @@ struct _FpiDeviceUru4000
   FpiUsbTransfer                 *img_transfer;
   void                           *img_data;
   int                             img_data_actual_length;
+  GCancellable                   *img_cancellable;
+  void                           *img_next_data;
+  int                             img_next_actual_length;
+  GError                         *img_next_error;
+  gboolean                        img_next_pending;
+  gboolean                        img_next_ready;
+  gboolean                        img_waiting;
+  gboolean                        img_stopping;
+  guint8                          img_key_pending;
+  GError                         *img_key_error;
   uint16_t                        img_lines_done, img_block;
   uint32_t                        img_enc_seed;
 
@@ -523,7 +533,6 @@ sm_set_hwstat (FpiSsm        *ssm,
 enum imaging_states {
   IMAGING_CAPTURE,
   IMAGING_SEND_INDEX,
-  IMAGING_READ_KEY,
   IMAGING_DECODE,
   IMAGING_REPORT_IMAGE,
   IMAGING_NUM_STATES
@@ -544,6 +553,31 @@ struct uru4k_image
   uint8_t data[IMAGE_HEIGHT][IMAGE_WIDTH];
 };
 
+/* The next image is read while the current one is checked and decoded,
+ * so that the sensor does not wait for the host between images. The
+ * image loop takes it in IMAGING_CAPTURE, waiting for it if it is not
+ * there yet. */
+static gboolean
+imaging_take_image (FpiDeviceUru4000 *self, FpiSsm *ssm)
+{
+  if (!self->img_next_ready)
+    return FALSE;
+
+  self->img_next_ready = FALSE;
+  if (self->img_next_error)
+    {
+      fpi_ssm_mark_failed (ssm, g_steal_pointer (&self->img_next_error));
+      return TRUE;
+    }
+
+  g_free (self->img_data);
+  self->img_data = g_steal_pointer (&self->img_next_data);
+  self->img_data_actual_length = self->img_next_actual_length;
+  fpi_ssm_next_state (ssm);
+
+  return TRUE;
+}
+
 static void
 image_transfer_cb (FpiUsbTransfer *transfer, FpDevice *dev,
                    gpointer user_data, GError *error)
@@ -551,19 +585,80 @@ image_transfer_cb (FpiUsbTransfer *transfer, FpDevice *dev,
   FpiDeviceUru4000 *self = FPI_DEVICE_URU4000 (dev);
   FpiSsm *ssm = transfer->ssm;
 
+  /* The image loop failed while the transfer was pending */
+  if (transfer != self->img_transfer)
+    {
+      g_clear_error (&error);
+      return;
+    }
+
+  self->img_next_pending = FALSE;
+
+  /* The loop was only waiting for this transfer to end */
+  if (self->img_stopping)
+    {
+      g_clear_error (&error);
+      self->img_stopping = FALSE;
+      fpi_ssm_mark_completed (ssm);
+      return;
+    }
+
   if (error)
     {
       fp_dbg ("error");
-      fpi_ssm_mark_failed (ssm, error);
+      self->img_next_error = error;
     }
   else
     {
-      self->img_data = g_memdup (transfer->buffer, sizeof (struct uru4k_image));
-      self->img_data_actual_length = transfer->actual_length;
-      fpi_ssm_next_state (ssm);
+      g_free (self->img_next_data);
+      self->img_next_data = g_memdup (transfer->buffer, sizeof (struct uru4k_image));
+      self->img_next_actual_length = transfer->actual_length;
+    }
+  self->img_next_ready = TRUE;
+
+  if (self->img_waiting)
+    {
+      self->img_waiting = FALSE;
+      imaging_take_image (self, ssm);
     }
 }
 
+static void
+imaging_read_next_image (FpiDeviceUru4000 *self)
+{
+  if (self->img_next_pending || self->img_next_ready)
+    return;
+
+  self->img_next_pending = TRUE;
+  fpi_usb_transfer_submit (fpi_usb_transfer_ref (self->img_transfer), 0,
+                           self->img_cancellable, image_transfer_cb, NULL);
+}
+
+/* Setting the key index and reading the key back are submitted together,
+ * the control endpoint processes them in order. */
+static void
+imaging_key_cb (FpiUsbTransfer *transfer, FpDevice *dev,
+                gpointer user_data, GError *error)
+{
+  FpiDeviceUru4000 *self = FPI_DEVICE_URU4000 (dev);
+  FpiSsm *ssm = user_data;
+
+  if (error && !self->img_key_error)
+    self->img_key_error = error;
+  else if (error)
+    g_error_free (error);
+  else if (transfer->direction == G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST)
+    memcpy (self->last_reg_rd, transfer->buffer, transfer->actual_length);
+
+  if (--self->img_key_pending > 0)
+    return;
+
+  if (self->img_key_error)
+    fpi_ssm_mark_failed (ssm, g_steal_pointer (&self->img_key_error));
+  else
+    fpi_ssm_jump_to_state (ssm, IMAGING_DECODE);
+}
+
 enum {
   BLOCKF_CHANGE_KEY       = 0x80,
   BLOCKF_NO_KEY_UPDATE    = 0x04,
@@ -586,13 +681,105 @@ update_key (uint32_t key)
   return (bit & 0x80000000) | (key >> 1);
 }
 
+/* The key only changes linearly, so the state after 32 steps is the XOR
+ * of the states each byte of the key leads to on its own. */
+static uint32_t key_jump32_table[4][256];
+
+static void
+init_key_jump32_table (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      int b, v, i;
+
+      for (b = 0; b < 4; b++)
+        for (v = 0; v < 256; v++)
+          {
+            uint32_t key = (uint32_t) v << (8 * b);
+
+            for (i = 0; i < 32; i++)
+              key = update_key (key);
+            key_jump32_table[b][v] = key;
+          }
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+static uint32_t
+key_jump32 (uint32_t key)
+{
+  return key_jump32_table[0][key & 0xff] ^
+         key_jump32_table[1][(key >> 8) & 0xff] ^
+         key_jump32_table[2][(key >> 16) & 0xff] ^
+         key_jump32_table[3][key >> 24];
+}
+
+static uint32_t
+skip_key (uint32_t key, int num_steps)
+{
+  init_key_jump32_table ();
+
+  for (; num_steps >= 32; num_steps -= 32)
+    key = key_jump32 (key);
+  for (; num_steps > 0; num_steps--)
+    key = update_key (key);
+
+  return key;
+}
+
+/* Key bits that make up the xor byte, starting with the least significant */
+static const uint8_t xorbyte_key_bits[8] = { 4, 8, 11, 14, 18, 21, 24, 29 };
+
 static uint32_t
 do_decode (uint8_t *data, int num_bytes, uint32_t key)
 {
   uint8_t xorbyte;
-  int i;
+  int i = 0;
 
-  for (i = 0; i < num_bytes - 1; i++)
+  init_key_jump32_table ();
+
+  /* Each step shifts the key right by one, so the keys of 32 consecutive
+   * bytes are windows into the 64 bits formed by the current key and the
+   * one 32 steps later. Collect each xor byte bit of all 32 bytes into a
+   * word and transpose them back into bytes 8 at a time. */
+  for (; i + 32 < num_bytes; i += 32)
+    {
+      uint32_t next = key_jump32 (key);
+      uint64_t window = key | (uint64_t) next << 32;
+      uint32_t bits[8];
+      int b, g;
+
+      for (b = 0; b < 8; b++)
+        bits[b] = window >> xorbyte_key_bits[b];
+
+      for (g = 0; g < 4; g++)
+        {
+          uint64_t x = 0, t, v;
+
+          for (b = 0; b < 8; b++)
+            x |= (uint64_t) ((bits[b] >> (8 * g)) & 0xff) << (8 * b);
+
+          /* 8x8 bit matrix transpose */
+          t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+          x = x ^ t ^ (t << 7);
+          t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+          x = x ^ t ^ (t << 14);
+          t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+          x = x ^ t ^ (t << 28);
+
+          /* decrypt data, reading ahead of what is written */
+          memcpy (&v, &data[i + g * 8 + 1], sizeof (v));
+          v = GUINT64_TO_LE (GUINT64_FROM_LE (v) ^ x);
+          memcpy (&data[i + g * 8], &v, sizeof (v));
+        }
+
+      key = next;
+    }
+
+  for (; i < num_bytes - 1; i++)
     {
       /* calculate xor byte and update key */
       xorbyte  = ((key >>  4) & 1) << 0;
@@ -663,11 +850,17 @@ imaging_run_state (FpiSsm *ssm, FpDevice *_dev)
     case IMAGING_CAPTURE:
       self->img_lines_done = 0;
       self->img_block = 0;
-      fpi_usb_transfer_submit (self->img_transfer, 0, NULL, image_transfer_cb, NULL);
+      imaging_read_next_image (self);
+      if (!imaging_take_image (self, ssm))
+        self->img_waiting = TRUE;
 
       break;
 
     case IMAGING_SEND_INDEX:
+      /* Unless the image turns out to be the last one */
+      if (self->activate_state == FPI_IMAGE_DEVICE_STATE_CAPTURE)
+        imaging_read_next_image (self);
+
       fp_dbg ("hw header lines %d", img->num_lines);
 
       if (img->num_lines >= IMAGE_HEIGHT ||
@@ -696,11 +889,9 @@ imaging_run_state (FpiSsm *ssm, FpDevice *_dev)
       buf[2] = self->img_enc_seed >> 8;
       buf[3] = self->img_enc_seed >> 16;
       buf[4] = self->img_enc_seed >> 24;
-      sm_write_regs (ssm, dev, REG_SCRAMBLE_DATA_INDEX, 5, buf);
-      break;
-
-    case IMAGING_READ_KEY:
-      sm_read_regs (ssm, dev, REG_SCRAMBLE_DATA_KEY, 4);
+      self->img_key_pending = 2;
+      write_regs (dev, REG_SCRAMBLE_DATA_INDEX, 5, buf, imaging_key_cb, ssm);
+      read_regs (dev, REG_SCRAMBLE_DATA_KEY, 4, imaging_key_cb, ssm);
       break;
 
     case IMAGING_DECODE:
@@ -740,8 +931,7 @@ imaging_run_state (FpiSsm *ssm, FpDevice *_dev)
 
             case 0:
               fp_dbg ("skipping %d lines", num_lines);
-              for (r = 0; r < IMAGE_WIDTH * num_lines; r++)
-                key = update_key (key);
+              key = skip_key (key, IMAGE_WIDTH * num_lines);
               break;
             }
           if ((flags & BLOCKF_NOT_PRESENT) == 0)
@@ -752,7 +942,7 @@ imaging_run_state (FpiSsm *ssm, FpDevice *_dev)
       break;
 
     case IMAGING_REPORT_IMAGE:
-      fpimg = fp_image_new (IMAGE_WIDTH, IMAGE_HEIGHT);
+      fpimg = fpi_image_new_pooled (FP_DEVICE (dev), IMAGE_WIDTH, IMAGE_HEIGHT, TRUE);
 
       to = r = 0;
       for (i = 0; i < G_N_ELEMENTS (img->block_info) && r < img->num_lines; i++)
@@ -774,9 +964,19 @@ imaging_run_state (FpiSsm *ssm, FpDevice *_dev)
       fpi_image_device_image_captured (dev, fpimg);
 
       if (self->activate_state == FPI_IMAGE_DEVICE_STATE_CAPTURE)
-        fpi_ssm_jump_to_state (ssm, IMAGING_CAPTURE);
+        {
+          fpi_ssm_jump_to_state (ssm, IMAGING_CAPTURE);
+        }
+      else if (self->img_next_pending)
+        {
+          /* The sensor may not send another image, stop reading it */
+          self->img_stopping = TRUE;
+          g_cancellable_cancel (self->img_cancellable);
+        }
       else
-        fpi_ssm_mark_completed (ssm);
+        {
+          fpi_ssm_mark_completed (ssm);
+        }
       break;
     }
 }
@@ -793,12 +993,21 @@ imaging_complete (FpiSsm *ssm, FpDevice *dev, GError *error)
   if (error)
     fpi_image_device_session_error (FP_IMAGE_DEVICE (dev), error);
 
-  /* Freed by callback or cancellation */
-  self->img_transfer = NULL;
+  /* A transfer of the next image may still be pending if the loop
+   * failed, it is ignored when it completes. */
+  if (self->img_next_pending)
+    g_cancellable_cancel (self->img_cancellable);
+  self->img_next_pending = FALSE;
+  g_clear_pointer (&self->img_transfer, fpi_usb_transfer_unref);
+  g_clear_object (&self->img_cancellable);
 
   g_free (self->img_data);
   self->img_data = NULL;
   self->img_data_actual_length = 0;
+  g_clear_pointer (&self->img_next_data, g_free);
+  g_clear_error (&self->img_next_error);
+  self->img_next_ready = FALSE;
+  self->img_waiting = FALSE;
 
   execute_state_change (FP_IMAGE_DEVICE (dev));
 }
@@ -1216,6 +1425,7 @@ execute_state_change (FpImageDevice *dev)
       ssm = fpi_ssm_new (FP_DEVICE (dev), imaging_run_state,
                          IMAGING_NUM_STATES);
       self->img_enc_seed = rand ();
+      self->img_cancellable = g_cancellable_new ();
       self->img_transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
       self->img_transfer->ssm = ssm;
       self->img_transfer->short_is_error = FALSE;
@@ -1400,7 +1610,7 @@ dev_deinit (FpImageDevice *dev)
   fpi_image_device_close_complete (dev, error);
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_uru4000_id_table[] = {
   /* ms kbd with fp rdr */
   { .vid = 0x045e,  .pid = 0x00bb, .driver_data = MS_KBD },
 
@@ -1440,7 +1650,7 @@ fpi_device_uru4000_class_init (FpiDeviceUru4000Class *klass)
   dev_class->id = "uru4000";
   dev_class->full_name = "Digital Persona U.are.U 4000/4000B/4500";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_uru4000_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_PRESS;
 
   img_class->img_open = dev_init;
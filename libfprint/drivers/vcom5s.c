@@ -198,11 +198,11 @@ capture_iterate (FpiSsm   *ssm,
 
   transfer->ssm = ssm;
   transfer->short_is_error = TRUE;
-  fpi_usb_transfer_fill_bulk_full (transfer,
-                                   EP_IN,
-                                   self->capture_img->data + (RQ_SIZE * iteration),
-                                   RQ_SIZE,
-                                   NULL);
+  fpi_usb_transfer_fill_bulk_image (transfer,
+                                    EP_IN,
+                                    self->capture_img,
+                                    RQ_SIZE * iteration,
+                                    RQ_SIZE);
 
   fpi_usb_transfer_submit (transfer, CTRL_TIMEOUT, NULL, capture_cb, NULL);
 }
@@ -335,7 +335,7 @@ dev_deinit (FpImageDevice *dev)
   fpi_image_device_close_complete (dev, error);
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_vcom5s_id_table[] = {
   { .vid = 0x061a,  .pid = 0x0110, },
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
 };
@@ -354,7 +354,7 @@ fpi_device_vcom5s_class_init (FpDeviceVcom5sClass *klass)
   dev_class->id = "vcom5s";
   dev_class->full_name = "Veridicom 5thSense";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_vcom5s_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_PRESS;
 
   img_class->img_open = dev_init;
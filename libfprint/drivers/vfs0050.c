@@ -172,6 +172,13 @@ vfs0050_get_pixel (struct fpi_line_asmbl_ctx *ctx,
   return ((struct vfs_line *) line->data)->data[x];
 }
 
+/* Line getter for fpi_assemble_lines */
+static const unsigned char *
+vfs0050_get_line (struct fpi_line_asmbl_ctx *ctx, GSList * line)
+{
+  return ((struct vfs_line *) line->data)->data;
+}
+
 /* Deviation getter for fpi_assemble_lines */
 static int
 vfs0050_get_difference (struct fpi_line_asmbl_ctx *ctx,
@@ -216,13 +223,18 @@ static struct fpi_line_asmbl_ctx assembling_ctx = {
   .max_search_offset = 100,
   .get_deviation = vfs0050_get_difference,
   .get_pixel = vfs0050_get_pixel,
+  .get_line = vfs0050_get_line,
 };
 
 /* Processes image before submitting */
 static FpImage *
 prepare_image (FpDeviceVfs0050 *vdev)
 {
-  int height = vdev->bytes / VFS_LINE_SIZE;
+  int height = MIN (vdev->bytes, VFS_MAX_LINES_BYTES) / VFS_LINE_SIZE;
+
+  /* A finger beyond the kept lines means that all of them are used */
+  if (vdev->overflow_finger)
+    height = VFS_MAX_HEIGHT;
 
   /* Noise cleaning. IMHO, it works pretty well
      I've not detected cases when it doesn't work or cuts a part of the finger
@@ -393,6 +405,42 @@ clear_data (FpDeviceVfs0050 *vdev)
   g_free (vdev->lines_buffer);
   vdev->lines_buffer = NULL;
   vdev->memory = vdev->bytes = 0;
+  vdev->overflow_finger = FALSE;
+}
+
+/* Offset in lines_buffer where the next transfer is received */
+static int
+receive_offset (FpDeviceVfs0050 *vdev)
+{
+  if (vdev->bytes <= VFS_MAX_LINES_BYTES)
+    return vdev->bytes;
+
+  /* Beyond the kept lines, only the incomplete last line is kept */
+  return VFS_MAX_LINES_BYTES + (vdev->bytes - VFS_MAX_LINES_BYTES) % VFS_LINE_SIZE;
+}
+
+/* Accounts for @length bytes received at receive_offset(). Lines beyond
+ * VFS_MAX_HEIGHT are only checked for noise and then dropped, so the
+ * buffer never needs to grow. */
+static void
+store_received (FpDeviceVfs0050 *vdev, int length)
+{
+  guint8 *overflow = (guint8 *) vdev->lines_buffer + VFS_MAX_LINES_BYTES;
+  int end = receive_offset (vdev) + length;
+  int n_bytes, n_lines, i;
+
+  vdev->bytes += length;
+  if (vdev->bytes <= VFS_MAX_LINES_BYTES)
+    return;
+
+  n_bytes = end - VFS_MAX_LINES_BYTES;
+  n_lines = n_bytes / VFS_LINE_SIZE;
+
+  for (i = 0; i < n_lines && !vdev->overflow_finger; i++)
+    if (!is_noise ((struct vfs_line *) (overflow + i * VFS_LINE_SIZE)))
+      vdev->overflow_finger = TRUE;
+
+  memmove (overflow, overflow + n_lines * VFS_LINE_SIZE, n_bytes % VFS_LINE_SIZE);
 }
 
 /* After receiving interrupt from EP3 */
@@ -473,7 +521,7 @@ receive_callback (FpiUsbTransfer *transfer, FpDevice *device,
     }
   else
     {
-      self->bytes += transfer->actual_length;
+      store_received (self, transfer->actual_length);
 
       /* Try reading more data */
       fpi_ssm_jump_to_state (transfer->ssm,
@@ -577,27 +625,19 @@ activate_ssm (FpiSsm *ssm, FpDevice *dev)
           {
             /* Initialize fingerprint buffer */
             g_free (self->lines_buffer);
-            self->memory = VFS_USB_BUFFER_SIZE;
+            self->memory = VFS_LINES_BUFFER_SIZE;
             self->lines_buffer = g_malloc (self->memory);
             self->bytes = 0;
+            self->overflow_finger = FALSE;
 
             /* Finger is on the scanner */
             fpi_image_device_report_finger_status (idev, TRUE);
           }
 
-        /* Increase buffer size while it's insufficient */
-        while (self->bytes + VFS_USB_BUFFER_SIZE > self->memory)
-          {
-            self->memory <<= 1;
-            self->lines_buffer =
-              (struct vfs_line *) g_realloc (self->lines_buffer,
-                                             self->memory);
-          }
-
         /* Receive chunk of data */
         transfer = fpi_usb_transfer_new (dev);
         fpi_usb_transfer_fill_bulk_full (transfer, 0x82,
-                                         (guint8 *) self->lines_buffer + self->bytes,
+                                         (guint8 *) self->lines_buffer + receive_offset (self),
                                          VFS_USB_BUFFER_SIZE, NULL);
         transfer->ssm = ssm;
         fpi_usb_transfer_submit (transfer, VFS_USB_TIMEOUT, NULL,
@@ -733,7 +773,7 @@ dev_close (FpImageDevice *idev)
 }
 
 /* Usb id table of device */
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_vfs0050_id_table[] = {
   {.vid = 0x138a,  .pid = 0x0050, },
   {.vid = 0,  .pid = 0,  .driver_data = 0},
 };
@@ -751,7 +791,7 @@ fpi_device_vfs0050_class_init (FpDeviceVfs0050Class *klass)
   dev_class->id = "vfs0050";
   dev_class->full_name = "Validity VFS0050";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_vfs0050_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->img_open = dev_open;
@@ -40,6 +40,10 @@
 #define VFS_IMAGE_WIDTH 100
 /* Maximum image height after assembling */
 #define VFS_MAX_HEIGHT 3000
+/* Size of the lines that are kept for assembling */
+#define VFS_MAX_LINES_BYTES (VFS_MAX_HEIGHT * VFS_LINE_SIZE)
+/* Receive buffer, there is room for a transfer after an incomplete line */
+#define VFS_LINES_BUFFER_SIZE (VFS_MAX_LINES_BYTES + VFS_LINE_SIZE + VFS_USB_BUFFER_SIZE)
 
 /* Size of control packets: turn_on, turn_off, next_receive_*  */
 #define VFS_CONTROL_PACKET_SIZE 125
@@ -101,6 +105,10 @@ struct _FpDeviceVfs0050
   /* Current number of received bytes and current memory used by data */
   int bytes, memory;
 
+  /* Whether the lines beyond VFS_MAX_HEIGHT, which are not kept, contain
+   * more than noise */
+  gboolean overflow_finger;
+
   /* USB buffer for fingerprint */
   char *usb_buffer;
 
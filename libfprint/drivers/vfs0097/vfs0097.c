@@ -21,7 +21,12 @@
 
 #define FP_COMPONENT "vfs0097"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
 #include <openssl/ec.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -33,6 +38,7 @@
 
 #include "fpi-byte-reader.h"
 #include "fpi-byte-writer.h"
+#include "fpi-worker.h"
 
 #include "vfs0097.h"
 
@@ -40,13 +46,13 @@
 #define EP_OUT (1 | FPI_USB_ENDPOINT_OUT)
 #define EP_INTERRUPT (3 | FPI_USB_ENDPOINT_IN)
 
-#define INTERRUPT_CMP(transfer, interrupt) (transfer->actual_length == G_N_ELEMENTS (interrupt) && \
-                                            memcmp (transfer->buffer, interrupt, G_N_ELEMENTS (interrupt)) == 0)
+#define INTERRUPT_CMP(received, interrupt) (received->length == G_N_ELEMENTS (interrupt) && \
+                                            memcmp (received->data, interrupt, G_N_ELEMENTS (interrupt)) == 0)
 
 G_DEFINE_TYPE (FpiDeviceVfs0097, fpi_device_vfs0097, FP_TYPE_DEVICE)
 
 /* Usb id table of device */
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_vfs0097_id_table[] = {
   {.vid = 0x138a,  .pid = 0x0097, },
   {.vid = 0,  .pid = 0,  .driver_data = 0},
 };
@@ -86,6 +92,21 @@ async_write_callback (FpiUsbTransfer *transfer, FpDevice *device,
   fpi_ssm_next_state_delayed (transfer->ssm, VFS_SSM_TIMEOUT, NULL);
 }
 
+/* The send timeout, derived from the observed round-trip times unless the
+ * driver is probing with a short fixed timeout. Replies include the time
+ * the sensor spends on the command (flash, crypto), which varies too much
+ * per command for reads to adapt. */
+static guint
+write_timeout (FpiDeviceVfs0097 *self)
+{
+  if (self->usb_timeout != VFS_USB_TIMEOUT)
+    return self->usb_timeout;
+
+  return fpi_usb_transfer_get_adaptive_timeout (FP_DEVICE (self), EP_OUT,
+                                                VFS_USB_MIN_TIMEOUT,
+                                                VFS_USB_TIMEOUT);
+}
+
 /* Send data to EP_OUT */
 static void
 async_write (FpiSsm   *ssm,
@@ -93,13 +114,14 @@ async_write (FpiSsm   *ssm,
              void     *data,
              int       len)
 {
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
   FpiUsbTransfer *transfer;
 
   transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
   fpi_usb_transfer_fill_bulk_full (transfer, EP_OUT, data, len, NULL);
   transfer->ssm = ssm;
   transfer->short_is_error = TRUE;
-  fpi_usb_transfer_submit (transfer, VFS_USB_TIMEOUT, NULL,
+  fpi_usb_transfer_submit (transfer, write_timeout (self), NULL,
                            async_write_callback, NULL);
 }
 
@@ -128,39 +150,159 @@ async_read (FpiSsm   *ssm,
             guint     len,
             guint    *actual_length)
 {
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
   FpiUsbTransfer *transfer;
-  GDestroyNotify free_func = NULL;
 
   transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
   transfer->ssm = ssm;
   transfer->short_is_error = FALSE; //
 
+  /* Discarded data goes to a scratch buffer kept for the device, nobody
+   * reads it so it is neither zeroed nor reallocated for every read. */
   if (data == NULL)
     {
-      data = g_malloc0 (len);
-      free_func = g_free;
+      g_assert (len <= VFS_USB_BUFFER_SIZE);
+      if (!self->discard_buffer)
+        self->discard_buffer = g_malloc (VFS_USB_BUFFER_SIZE);
+      data = self->discard_buffer;
     }
 
-  fpi_usb_transfer_fill_bulk_full (transfer, EP_IN, data, len, free_func);
+  /* The buffers belong to the device, the transfer must not free them */
+  fpi_usb_transfer_fill_bulk_full (transfer, EP_IN, data, len, NULL);
 
-  fpi_usb_transfer_submit (transfer, VFS_USB_TIMEOUT, NULL,
+  fpi_usb_transfer_submit (transfer, self->usb_timeout, NULL,
                            async_read_callback, actual_length);
 }
 
+/* Interrupt listener */
+
+static void
+interrupt_queue_clear (FpiDeviceVfs0097 *self)
+{
+  self->interrupt_queue_head = 0;
+  self->interrupt_queue_length = 0;
+}
+
+static void
+interrupt_wait_complete (FpiDeviceVfs0097       *self,
+                         const Vfs0097Interrupt *interrupt,
+                         GError                 *error)
+{
+  Vfs0097InterruptCallback callback = self->interrupt_callback;
+  FpiSsm *ssm = self->interrupt_ssm;
+
+  self->interrupt_callback = NULL;
+  self->interrupt_ssm = NULL;
+  g_clear_pointer (&self->interrupt_timeout, g_source_destroy);
+
+  callback (FP_DEVICE (self), ssm, interrupt, error);
+}
+
 static void
-await_interrupt (FpDevice *dev, FpiSsm *ssm, FpiUsbTransferCallback callback)
+interrupt_listener_cb (FpiUsbTransfer *transfer, FpDevice *dev,
+                       gpointer user_data, GError *error)
 {
   FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
-  FpiUsbTransfer *transfer;
+  Vfs0097Interrupt interrupt;
 
-  transfer = fpi_usb_transfer_new (dev);
-  transfer->ssm = ssm;
-  fpi_usb_transfer_fill_interrupt (transfer, EP_INTERRUPT, USB_INTERRUPT_DATA_SIZE);
-  fpi_usb_transfer_submit (transfer,
-                           VFS_INT_TIMEOUT,
-                           self->interrupt_cancellable,
-                           callback,
-                           NULL);
+  if (error)
+    {
+      /* Stop listening, the next await_interrupt() starts again */
+      self->interrupt_listening = FALSE;
+
+      if (self->interrupt_ssm)
+        {
+          interrupt_wait_complete (self, NULL, error);
+          return;
+        }
+
+      /* Pending transfers are cancelled when the device is closed */
+      if (g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_CANCELLED))
+        fp_dbg ("Interrupt transfer cancelled");
+      else
+        fp_warn ("Interrupt transfer failed: %s", error->message);
+      g_error_free (error);
+      return;
+    }
+
+  interrupt.length = MIN (transfer->actual_length, USB_INTERRUPT_DATA_SIZE);
+  memcpy (interrupt.data, transfer->buffer, interrupt.length);
+
+  fpi_usb_transfer_submit (fpi_usb_transfer_ref (transfer), 0,
+                           NULL, interrupt_listener_cb, NULL);
+
+  if (self->interrupt_ssm)
+    {
+      interrupt_wait_complete (self, &interrupt, NULL);
+      return;
+    }
+
+  if (self->interrupt_queue_length == VFS_INTERRUPT_QUEUE_SIZE)
+    {
+      fp_dbg ("Interrupt queue is full, dropping the oldest interrupt");
+      self->interrupt_queue_head = (self->interrupt_queue_head + 1) % VFS_INTERRUPT_QUEUE_SIZE;
+      self->interrupt_queue_length--;
+    }
+
+  self->interrupt_queue[(self->interrupt_queue_head + self->interrupt_queue_length) %
+                        VFS_INTERRUPT_QUEUE_SIZE] = interrupt;
+  self->interrupt_queue_length++;
+}
+
+static void
+interrupt_listener_start (FpiDeviceVfs0097 *self)
+{
+  if (!self->interrupt_transfer)
+    {
+      self->interrupt_transfer = fpi_usb_transfer_new (FP_DEVICE (self));
+      fpi_usb_transfer_fill_interrupt (self->interrupt_transfer, EP_INTERRUPT,
+                                       USB_INTERRUPT_DATA_SIZE);
+    }
+
+  /* No timeout, waiting for a finger may take arbitrarily long */
+  self->interrupt_listening = TRUE;
+  fpi_usb_transfer_submit (fpi_usb_transfer_ref (self->interrupt_transfer), 0,
+                           NULL, interrupt_listener_cb, NULL);
+}
+
+static void
+interrupt_timeout_cb (FpDevice *dev, gpointer user_data)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+
+  self->interrupt_timeout = NULL;
+  interrupt_wait_complete (self, NULL,
+                           g_error_new (G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_TIMED_OUT,
+                                        "Timed out waiting for an interrupt"));
+}
+
+/* Calls @callback with the next interrupt, or with an error if none arrives
+ * within @timeout_ms (0 waits until the action is cancelled). */
+static void
+await_interrupt (FpDevice *dev, FpiSsm *ssm, guint timeout_ms, Vfs0097InterruptCallback callback)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+
+  g_assert (self->interrupt_ssm == NULL);
+
+  if (self->interrupt_queue_length > 0)
+    {
+      Vfs0097Interrupt interrupt = self->interrupt_queue[self->interrupt_queue_head];
+
+      self->interrupt_queue_head = (self->interrupt_queue_head + 1) % VFS_INTERRUPT_QUEUE_SIZE;
+      self->interrupt_queue_length--;
+      callback (dev, ssm, &interrupt, NULL);
+      return;
+    }
+
+  self->interrupt_ssm = ssm;
+  self->interrupt_callback = callback;
+  if (timeout_ms > 0)
+    self->interrupt_timeout = fpi_device_add_timeout (dev, timeout_ms, interrupt_timeout_cb,
+                                                      NULL, NULL);
+
+  if (!self->interrupt_listening)
+    interrupt_listener_start (self);
 }
 
 /* Cryptographic functions */
@@ -175,15 +317,68 @@ HMAC_SHA256 (const guint8 *key, guint32 key_len,
   return HMAC (EVP_sha256 (), key, key_len, data, data_len, result, &unused);
 }
 
+/* HMAC-SHA256 with the key pads hashed once, see RFC 2104 */
+#define HMAC_SHA256_BLOCK_SIZE 64
+
+typedef struct
+{
+  SHA256_CTX inner;
+  SHA256_CTX outer;
+} HmacSha256Key;
+
+static void
+hmac_sha256_key_init (HmacSha256Key *key, const guint8 *secret, guint32 secret_len)
+{
+  guint8 pad[HMAC_SHA256_BLOCK_SIZE] = { 0 };
+  guint i;
+
+  if (secret_len > HMAC_SHA256_BLOCK_SIZE)
+    SHA256 (secret, secret_len, pad);
+  else
+    memcpy (pad, secret, secret_len);
+
+  for (i = 0; i < HMAC_SHA256_BLOCK_SIZE; i++)
+    pad[i] ^= 0x36;
+  SHA256_Init (&key->inner);
+  SHA256_Update (&key->inner, pad, sizeof (pad));
+
+  for (i = 0; i < HMAC_SHA256_BLOCK_SIZE; i++)
+    pad[i] ^= 0x36 ^ 0x5c;
+  SHA256_Init (&key->outer);
+  SHA256_Update (&key->outer, pad, sizeof (pad));
+
+  OPENSSL_cleanse (pad, sizeof (pad));
+}
+
+/* Starts a MAC in ctx, feed it the data with SHA256_Update (). */
+static void
+hmac_sha256_start (const HmacSha256Key *key, SHA256_CTX *ctx)
+{
+  *ctx = key->inner;
+}
+
+static void
+hmac_sha256_finish (const HmacSha256Key *key, SHA256_CTX *ctx, guint8 *result)
+{
+  guint8 inner_hash[SHA256_DIGEST_LENGTH];
+
+  SHA256_Final (inner_hash, ctx);
+  *ctx = key->outer;
+  SHA256_Update (ctx, inner_hash, sizeof (inner_hash));
+  SHA256_Final (result, ctx);
+}
+
 static void
 PRF_SHA256 (const guint8 *secret, guint32 secret_len,
             const guint8 *label, guint32 label_len,
             const guint8 *seed, guint32 seed_len, guint8 *out, guint32 len)
 {
+  HmacSha256Key key;
+  SHA256_CTX ctx;
   guint size;
   guint pos;
   guint8 P[SHA256_DIGEST_LENGTH];
-  guint8 *A;
+  guint8 A[SHA256_DIGEST_LENGTH];
 
   /*
    * RFC 5246, Chapter 5
@@ -195,54 +390,65 @@ PRF_SHA256 (const guint8 *secret, guint32 secret_len,
    *                         HMAC_hash(secret, A(3) + lseed) + ...
    *
    * PRF(secret, label, seed) = P_hash(secret, label + seed)
+   *
+   * The secret is the same for every block, so the key pads are only
+   * hashed once and each HMAC starts from a copy of them.
    */
-
-  // A(0)
-  A = g_malloc0 (SHA256_DIGEST_LENGTH + label_len + seed_len);
-  memcpy (A, label, label_len);
-  memcpy (A + label_len, seed, seed_len);
+  hmac_sha256_key_init (&key, secret, secret_len);
 
   // A(1)
-  HMAC_SHA256 (secret, secret_len, A, label_len + seed_len, A);
+  hmac_sha256_start (&key, &ctx);
+  SHA256_Update (&ctx, label, label_len);
+  SHA256_Update (&ctx, seed, seed_len);
+  hmac_sha256_finish (&key, &ctx, A);
 
   pos = 0;
   while (pos < len)
     {
-      // Concatenate A + label + seed
-      memcpy (A + SHA256_DIGEST_LENGTH, label, label_len);
-      memcpy (A + SHA256_DIGEST_LENGTH + label_len, seed, seed_len);
-
-      // Calculate new P_hash part
-      HMAC_SHA256 (secret, secret_len, A, SHA256_DIGEST_LENGTH + label_len + seed_len, P);
+      // Calculate new P_hash part from A + label + seed
+      hmac_sha256_start (&key, &ctx);
+      SHA256_Update (&ctx, A, SHA256_DIGEST_LENGTH);
+      SHA256_Update (&ctx, label, label_len);
+      SHA256_Update (&ctx, seed, seed_len);
+      hmac_sha256_finish (&key, &ctx, P);
 
       // Calculate next A
-      HMAC_SHA256 (secret, secret_len, A, SHA256_DIGEST_LENGTH, A);
+      hmac_sha256_start (&key, &ctx);
+      SHA256_Update (&ctx, A, SHA256_DIGEST_LENGTH);
+      hmac_sha256_finish (&key, &ctx, A);
 
       size = MIN (len - pos, SHA256_DIGEST_LENGTH);
       memcpy (out + pos, P, size);
       pos += size;
     }
 
-  g_free (A);
+  OPENSSL_cleanse (&key, sizeof (key));
+  OPENSSL_cleanse (&ctx, sizeof (ctx));
+  OPENSSL_cleanse (P, sizeof (P));
+  OPENSSL_cleanse (A, sizeof (A));
 }
 
 /* TLS forward declarations */
 
-static void tls_sign_and_encrypt (guint8   content_type,
-                                  guint8   sign_key[0x20],
-                                  guint8   encryption_key[0x20],
-                                  guint8  *data,
-                                  guint    length,
-                                  guint8 **out,
-                                  guint   *out_len);
-
-static void tls_decrypt_and_validate (guint8   content_type,
-                                      guint8   validation_key[0x20],
-                                      guint8   decryption_key[0x20],
-                                      guint8  *data,
-                                      guint    length,
-                                      guint8 **out,
-                                      guint   *out_len);
+/* Type, version and length */
+#define TLS_RECORD_HEADER_SIZE (1 + G_N_ELEMENTS (TLS_VERSION) + 2)
+/* Offset of the plain text in a record built in place by tls_encrypt_record */
+#define TLS_RECORD_DATA_OFFSET (TLS_RECORD_HEADER_SIZE + 0x10)
+/* Header, IV, data padded to the block size and the HMAC */
+#define TLS_RECORD_SIZE(length) (TLS_RECORD_DATA_OFFSET + (((length) + 16) / 16) * 16 + 0x20)
+
+static gboolean tls_encrypt_record (FpiDeviceVfs0097 *self,
+                                    guint8            content_type,
+                                    const guint8     *data,
+                                    guint             length,
+                                    guint8           *out,
+                                    guint            *out_len);
+
+static gboolean tls_decrypt_record (FpiDeviceVfs0097 *self,
+                                    guint8            content_type,
+                                    guint8           *record,
+                                    guint             length,
+                                    guint            *out_len);
 
 static void tls_create_record (guint8   content_type,
                                guint8  *fragment,
@@ -250,31 +456,606 @@ static void tls_create_record (guint8   content_type,
                                guint8 **out,
                                guint   *out_len);
 
-static void tls_parse_record (guint8   content_type,
-                              guint8  *fragment,
-                              guint    length,
-                              guint8 **out,
-                              guint   *out_len);
+static gboolean tls_parse_record (guint8   content_type,
+                                  guint8  *fragment,
+                                  guint    length,
+                                  guint8 **out,
+                                  guint   *out_len);
 
-/* Initialization from device's flash */
+/* TLS data cache
+ *
+ * Reading the TLS data from flash, unwrapping the private key and doing the
+ * handshake is slow. None of it changes while the process is running, so
+ * keep it around per sensor, keyed by the hash of the sensor's replies to
+ * INIT_SEQUENCE_MSG1 and INIT_SEQUENCE_MSG5 (see flash_identity). The flash
+ * data is only reused once a sensor gave the same replies, which the
+ * driver compares before the flash read.
+ *
+ * As long as the device is not reset, the negotiated session also stays
+ * valid, and re-opening can resume it. That happens before the sensor is
+ * asked for its identity, so only the device object that established the
+ * session resumes it, and the reply to INIT_SEQUENCE_MSG1 must match the
+ * one of the initialization. The entry is dropped once the device object
+ * goes away, i.e. when the sensor is unplugged, and on close errors. */
+
+typedef struct
+{
+  guint8   msg1_hash[SHA256_DIGEST_LENGTH];
+
+  guint8  *certificate;
+  gsize    certificate_length;
+  EC_KEY  *private_key;
+  EC_KEY  *ecdh_q;
+
+  gboolean session_valid;
+  guint8   master_secret[0x30];
+  guint8   sign_key[0x20];
+  guint8   validation_key[0x20];
+  guint8   encryption_key[0x20];
+  guint8   decryption_key[0x20];
+} TlsCache;
+
+G_LOCK_DEFINE_STATIC (tls_caches);
+static GHashTable *tls_caches = NULL;
+
+static void
+tls_cache_free (TlsCache *cache)
+{
+  g_free (cache->certificate);
+  g_clear_pointer (&cache->private_key, EC_KEY_free);
+  g_clear_pointer (&cache->ecdh_q, EC_KEY_free);
+  memset (cache, 0, sizeof (*cache));
+  g_free (cache);
+}
+
+static TlsCache *
+tls_cache_get (FpiDeviceVfs0097 *self, gboolean create)
+{
+  TlsCache *cache = NULL;
+
+  if (!self->tls_identity)
+    return NULL;
+
+  G_LOCK (tls_caches);
+
+  if (!tls_caches && create)
+    tls_caches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify) tls_cache_free);
+
+  if (tls_caches)
+    cache = g_hash_table_lookup (tls_caches, self->tls_identity);
+
+  if (!cache && create)
+    {
+      cache = g_new0 (TlsCache, 1);
+      memcpy (cache->msg1_hash, self->msg1_hash, sizeof (cache->msg1_hash));
+      g_hash_table_insert (tls_caches, g_strdup (self->tls_identity), cache);
+    }
+
+  G_UNLOCK (tls_caches);
+
+  return cache;
+}
+
+/* Drops everything cached for the sensor of @self */
+static void
+tls_cache_forget (FpiDeviceVfs0097 *self)
+{
+  if (!self->tls_identity)
+    return;
+
+  G_LOCK (tls_caches);
+  if (tls_caches)
+    g_hash_table_remove (tls_caches, self->tls_identity);
+  G_UNLOCK (tls_caches);
+}
+
+static void
+tls_cache_store_flash (FpiDeviceVfs0097 *self)
+{
+  TlsCache *cache = tls_cache_get (self, TRUE);
+
+  if (!cache || !self->certificate || !self->private_key || !self->ecdh_q)
+    return;
+
+  g_clear_pointer (&cache->certificate, g_free);
+  g_clear_pointer (&cache->private_key, EC_KEY_free);
+  g_clear_pointer (&cache->ecdh_q, EC_KEY_free);
+
+  cache->certificate = g_memdup (self->certificate, self->certificate_length);
+  cache->certificate_length = self->certificate_length;
+  EC_KEY_up_ref (self->private_key);
+  cache->private_key = self->private_key;
+  EC_KEY_up_ref (self->ecdh_q);
+  cache->ecdh_q = self->ecdh_q;
+}
 
 static gboolean
-init_private_key (FpiDeviceVfs0097 *self, const guint8 *body, guint16 size)
+tls_cache_restore_flash (FpiDeviceVfs0097 *self)
 {
-  gboolean success = FALSE;
+  TlsCache *cache = tls_cache_get (self, FALSE);
+
+  if (!cache || !cache->certificate)
+    return FALSE;
+
+  g_clear_pointer (&self->certificate, g_free);
+  g_clear_pointer (&self->private_key, EC_KEY_free);
+  g_clear_pointer (&self->ecdh_q, EC_KEY_free);
+
+  self->certificate = g_memdup (cache->certificate, cache->certificate_length);
+  self->certificate_length = cache->certificate_length;
+  EC_KEY_up_ref (cache->private_key);
+  self->private_key = cache->private_key;
+  EC_KEY_up_ref (cache->ecdh_q);
+  self->ecdh_q = cache->ecdh_q;
+
+  return TRUE;
+}
+
+static void
+tls_cache_store_session (FpiDeviceVfs0097 *self)
+{
+  TlsCache *cache = tls_cache_get (self, TRUE);
+
+  if (!cache)
+    return;
+
+  memcpy (cache->master_secret, self->master_secret, sizeof (cache->master_secret));
+  memcpy (cache->sign_key, self->sign_key, sizeof (cache->sign_key));
+  memcpy (cache->validation_key, self->validation_key, sizeof (cache->validation_key));
+  memcpy (cache->encryption_key, self->encryption_key, sizeof (cache->encryption_key));
+  memcpy (cache->decryption_key, self->decryption_key, sizeof (cache->decryption_key));
+  cache->session_valid = TRUE;
+}
+
+static gboolean
+tls_cache_has_session (FpiDeviceVfs0097 *self)
+{
+  TlsCache *cache = tls_cache_get (self, FALSE);
+
+  return cache && cache->session_valid;
+}
+
+static gboolean
+tls_cache_restore_session (FpiDeviceVfs0097 *self)
+{
+  TlsCache *cache = tls_cache_get (self, FALSE);
+
+  if (!cache || !cache->session_valid)
+    return FALSE;
+
+  memcpy (self->msg1_hash, cache->msg1_hash, sizeof (self->msg1_hash));
+
+  memcpy (self->master_secret, cache->master_secret, sizeof (self->master_secret));
+  memcpy (self->sign_key, cache->sign_key, sizeof (self->sign_key));
+  memcpy (self->validation_key, cache->validation_key, sizeof (self->validation_key));
+  memcpy (self->encryption_key, cache->encryption_key, sizeof (self->encryption_key));
+  memcpy (self->decryption_key, cache->decryption_key, sizeof (self->decryption_key));
+  self->tls = TRUE;
+
+  return TRUE;
+}
+
+static void
+tls_cache_drop_session (FpiDeviceVfs0097 *self)
+{
+  TlsCache *cache = tls_cache_get (self, FALSE);
+
+  if (!cache)
+    return;
+
+  cache->session_valid = FALSE;
+  memset (cache->master_secret, 0, sizeof (cache->master_secret));
+  memset (cache->sign_key, 0, sizeof (cache->sign_key));
+  memset (cache->validation_key, 0, sizeof (cache->validation_key));
+  memset (cache->encryption_key, 0, sizeof (cache->encryption_key));
+  memset (cache->decryption_key, 0, sizeof (cache->decryption_key));
+}
+
+static void
+tls_cache_drop_flash (FpiDeviceVfs0097 *self)
+{
+  TlsCache *cache = tls_cache_get (self, FALSE);
+
+  if (!cache)
+    return;
+
+  g_clear_pointer (&cache->certificate, g_free);
+  g_clear_pointer (&cache->private_key, EC_KEY_free);
+  g_clear_pointer (&cache->ecdh_q, EC_KEY_free);
+}
+
+/* Flash TLS data cache on disk
+ *
+ * The TLS data in flash only changes when the sensor is paired again, but
+ * reading it is the slowest part of a full initialization. The raw reply is
+ * stored in the user's cache directory, named after a hash of the replies
+ * to INIT_SEQUENCE_MSG1 and INIT_SEQUENCE_MSG5, as:
+ *
+ *   "VFS97TLS"                 magic
+ *   SHA256 of the data
+ *   the INIT_SEQUENCE_MSG6 reply
+ *
+ * The blocks in the data carry their own hashes, which init_keys checks.
+ * If the sensor was paired again, the handshake fails and the open falls
+ * back to reading the flash.
+ *
+ * The data holds the wrapped private key of the sensor, and the wrapping
+ * keys are derived from a constant seed, so the file must only be
+ * accessible by the user: it is written with mode 0600 into a directory
+ * with mode 0700, and files that others can access are not loaded. */
+
+#define FLASH_CACHE_MAGIC "VFS97TLS"
+#define FLASH_CACHE_MAGIC_LEN 8
+#define FLASH_CACHE_HEADER_LEN (FLASH_CACHE_MAGIC_LEN + SHA256_DIGEST_LENGTH)
+
+static gchar *
+flash_cache_get_path (FpiDeviceVfs0097 *self)
+{
+  if (!self->flash_identity)
+    return NULL;
+
+  return g_build_filename (g_get_user_cache_dir (), "libfprint", "vfs0097",
+                           g_checksum_get_string (self->flash_identity), NULL);
+}
+
+/* Whether only the user can access the file or directory */
+static gboolean
+flash_cache_is_private (const struct stat *st)
+{
+  return st->st_uid == getuid () && (st->st_mode & (S_IRWXG | S_IRWXO)) == 0;
+}
+
+static gboolean
+flash_cache_load (FpiDeviceVfs0097 *self)
+{
+  g_autofree gchar *path = flash_cache_get_path (self);
+  g_autoptr(GMappedFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+  guint8 hash[SHA256_DIGEST_LENGTH];
+  const gchar *contents;
+  const guint8 *data;
+  struct stat st;
+  guint32 size;
+  gsize length;
+  gint fd;
+
+  if (!path)
+    return FALSE;
+
+  fd = g_open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+        fp_dbg ("Could not open cached TLS data: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) || !flash_cache_is_private (&st))
+    {
+      fp_warn ("Not using cached TLS data in %s, others can access it", path);
+      close (fd);
+      g_unlink (path);
+      return FALSE;
+    }
+
+  file = g_mapped_file_new_from_fd (fd, FALSE, &error);
+  close (fd);
+  if (!file)
+    {
+      fp_dbg ("Could not read cached TLS data: %s", error->message);
+      return FALSE;
+    }
+
+  contents = g_mapped_file_get_contents (file);
+  length = g_mapped_file_get_length (file);
 
-  guint8 AES_MASTER_KEY[SHA256_DIGEST_LENGTH];
-  guint8 VALIDATION_KEY[SHA256_DIGEST_LENGTH];
+  data = (const guint8 *) contents + FLASH_CACHE_HEADER_LEN;
+  length -= MIN (length, FLASH_CACHE_HEADER_LEN);
 
-  PRF_SHA256 (PRE_KEY, G_N_ELEMENTS (PRE_KEY),
-              LABEL, G_N_ELEMENTS (LABEL),
-              self->seed, self->seed_length,
-              AES_MASTER_KEY, SHA256_DIGEST_LENGTH);
+  if (length < 8 || length > VFS_USB_BUFFER_SIZE ||
+      memcmp (contents, FLASH_CACHE_MAGIC, FLASH_CACHE_MAGIC_LEN) != 0)
+    goto invalid;
 
-  PRF_SHA256 (AES_MASTER_KEY, SHA256_DIGEST_LENGTH,
-              LABEL_SIGN, G_N_ELEMENTS (LABEL_SIGN),
-              SIGN_KEY, G_N_ELEMENTS (SIGN_KEY),
-              VALIDATION_KEY, SHA256_DIGEST_LENGTH);
+  SHA256 (data, length, hash);
+  if (memcmp (hash, contents + FLASH_CACHE_MAGIC_LEN, SHA256_DIGEST_LENGTH) != 0)
+    goto invalid;
+
+  /* init_keys expects the size of the blocks to match the reply */
+  memcpy (&size, data + 2, sizeof (size));
+  if (GUINT32_FROM_LE (size) != length - 8)
+    goto invalid;
+
+  memcpy (self->buffer, data, length);
+  self->buffer_length = length;
+
+  return TRUE;
+
+invalid:
+  fp_warn ("Ignoring invalid cached TLS data in %s", path);
+  g_unlink (path);
+  return FALSE;
+}
+
+/* Atomically replaces @path with @data, readable by the user only */
+static gboolean
+flash_cache_write (const gchar  *path,
+                   const guint8 *data,
+                   gsize         length,
+                   GError      **error)
+{
+#if GLIB_CHECK_VERSION (2, 66, 0)
+  gboolean ret;
+
+  G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+  ret = g_file_set_contents_full (path, (const gchar *) data, length,
+                                  G_FILE_SET_CONTENTS_CONSISTENT, 0600, error);
+  G_GNUC_END_IGNORE_DEPRECATIONS
+
+  return ret;
+#else
+  g_autofree gchar *tmp_path = g_strdup_printf ("%s.XXXXXX", path);
+  gint saved_errno;
+  gint fd;
+
+  fd = g_mkstemp_full (tmp_path, O_WRONLY | O_CLOEXEC, 0600);
+  if (fd < 0)
+    goto error;
+
+  while (length > 0)
+    {
+      gssize written = write (fd, data, length);
+
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written < 0)
+        {
+          saved_errno = errno;
+          close (fd);
+          errno = saved_errno;
+          goto error;
+        }
+
+      data += written;
+      length -= written;
+    }
+
+  if (fsync (fd) < 0)
+    {
+      saved_errno = errno;
+      close (fd);
+      errno = saved_errno;
+      goto error;
+    }
+
+  if (close (fd) < 0 || g_rename (tmp_path, path) < 0)
+    goto error;
+
+  return TRUE;
+
+error:
+  saved_errno = errno;
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+               "Could not write %s: %s", path, g_strerror (saved_errno));
+  if (fd >= 0)
+    g_unlink (tmp_path);
+  return FALSE;
+#endif
+}
+
+static void
+flash_cache_store (FpiDeviceVfs0097 *self, const guint8 *data, gsize length)
+{
+  g_autofree gchar *path = flash_cache_get_path (self);
+  g_autofree gchar *dir = NULL;
+  g_autoptr(GByteArray) contents = NULL;
+  g_autoptr(GError) error = NULL;
+  guint8 hash[SHA256_DIGEST_LENGTH];
+  struct stat st;
+
+  if (!path)
+    return;
+
+  dir = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dir, 0700) < 0)
+    {
+      fp_dbg ("Could not create %s: %s", dir, g_strerror (errno));
+      return;
+    }
+
+  /* The directory may have been created by someone else or before */
+  if (g_lstat (dir, &st) < 0 || !S_ISDIR (st.st_mode) || st.st_uid != getuid () ||
+      ((st.st_mode & (S_IRWXG | S_IRWXO)) != 0 && g_chmod (dir, 0700) < 0))
+    {
+      fp_dbg ("Not caching TLS data, %s is not private", dir);
+      return;
+    }
+
+  SHA256 (data, length, hash);
+
+  contents = g_byte_array_sized_new (FLASH_CACHE_HEADER_LEN + length);
+  g_byte_array_append (contents, (const guint8 *) FLASH_CACHE_MAGIC, FLASH_CACHE_MAGIC_LEN);
+  g_byte_array_append (contents, hash, sizeof (hash));
+  g_byte_array_append (contents, data, length);
+
+  if (!flash_cache_write (path, contents->data, contents->len, &error))
+    fp_dbg ("Could not cache TLS data: %s", error->message);
+}
+
+static void
+flash_cache_remove (FpiDeviceVfs0097 *self)
+{
+  g_autofree gchar *path = flash_cache_get_path (self);
+
+  if (path)
+    g_unlink (path);
+}
+
+/* Host keys
+ *
+ * The private key in flash is wrapped with keys derived from a seed that
+ * identifies the host. Neither changes while the process runs, so the seed
+ * is read and the keys are derived once, for all devices. */
+
+typedef struct
+{
+  guint8 *seed;
+  gsize   seed_length;
+
+  guint8  aes_master_key[SHA256_DIGEST_LENGTH];
+  guint8  validation_key[SHA256_DIGEST_LENGTH];
+} HostKeys;
+
+static gchar *
+read_dmi (const char *filename)
+{
+  FILE *file;
+  gsize length;
+  gchar buffer[1024];
+
+  if (!(file = fopen (filename, "r")))
+    {
+      g_warning ("Could not open DMI node: %s", filename);
+      goto exit;
+    }
+
+  fgets (buffer, G_N_ELEMENTS (buffer), file);
+  if ((length = strlen (buffer)) == 0)
+    {
+      g_warning ("Could not read DMI node value: %s", filename);
+      goto exit;
+    }
+  buffer[length - 1] = 0; // Remove newline
+
+exit:
+  if (file)
+    fclose (file);
+  return g_strdup (buffer);
+}
+
+static const HostKeys *
+host_keys_get (void)
+{
+  static gsize initialized = 0;
+  static HostKeys keys;
+
+  if (g_once_init_enter (&initialized))
+    {
+      keys.seed_length = G_N_ELEMENTS (VIRTUAL_BOX_SEED);
+      keys.seed = g_memdup (VIRTUAL_BOX_SEED, G_N_ELEMENTS (VIRTUAL_BOX_SEED));
+
+      // TODO: Device is initialized via VirtualBox, so real HW id is not useful for now
+
+      //  gchar *name, *serial;
+      //  name = read_dmi (DMI_PRODUCT_NAME_NODE);
+      //  serial = read_dmi (DMI_PRODUCT_SERIAL_NODE);
+      //
+      //  keys.seed_length = strlen (name) + strlen (serial) + 2;
+      //  keys.seed = g_malloc0 (keys.seed_length);
+      //
+      //  strcpy ((gchar *) keys.seed, name);
+      //  strcpy ((gchar *) keys.seed + strlen (name) + 1, serial);
+      //
+      //  g_free (name);
+      //  g_free (serial);
+
+      g_debug ("Initialized seed value: %s", keys.seed);
+
+      PRF_SHA256 (PRE_KEY, G_N_ELEMENTS (PRE_KEY),
+                  LABEL, G_N_ELEMENTS (LABEL),
+                  keys.seed, keys.seed_length,
+                  keys.aes_master_key, SHA256_DIGEST_LENGTH);
+
+      PRF_SHA256 (keys.aes_master_key, SHA256_DIGEST_LENGTH,
+                  LABEL_SIGN, G_N_ELEMENTS (LABEL_SIGN),
+                  SIGN_KEY, G_N_ELEMENTS (SIGN_KEY),
+                  keys.validation_key, SHA256_DIGEST_LENGTH);
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return &keys;
+}
+
+/* Crypto on a worker thread
+ *
+ * The EC key checks, key generation and signing of the handshake take
+ * tens of milliseconds, too long to block the main context of the device
+ * (and with it the application) for. They run on a worker thread while the
+ * SSM that needs them waits, so they may use all state of the device that
+ * the SSM owns, including the TLS contexts. The threads are shared with
+ * the rest of libfprint, see fpi_worker_pool_new(). */
+
+typedef gboolean (*CryptoFunc) (FpiDeviceVfs0097 *self);
+
+typedef struct
+{
+  CryptoFunc func;
+  FpiSsm    *ssm;
+} CryptoJob;
+
+static void
+crypto_worker (gpointer data, gpointer user_data)
+{
+  g_autoptr(GTask) task = data;
+  CryptoJob *job = g_task_get_task_data (task);
+
+  g_task_return_boolean (task,
+                         job->func (FPI_DEVICE_VFS0097 (g_task_get_source_object (task))));
+}
+
+static GThreadPool *
+get_crypto_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    {
+      GThreadPool *p;
+
+      p = fpi_worker_pool_new (crypto_worker, G_MAXUINT, FALSE);
+      g_once_init_leave (&pool, (gsize) p);
+    }
+
+  return (GThreadPool *) pool;
+}
+
+static void
+crypto_done_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  CryptoJob *job = g_task_get_task_data (G_TASK (res));
+
+  if (g_task_propagate_boolean (G_TASK (res), NULL))
+    fpi_ssm_next_state (job->ssm);
+  else
+    fpi_ssm_mark_failed (job->ssm, fpi_device_error_new (FP_DEVICE_ERROR_PROTO));
+}
+
+/* Runs @func on a worker thread, then continues @ssm with the next state
+ * if it returned %TRUE and fails it otherwise. */
+static void
+run_crypto_in_thread (FpDevice *dev, FpiSsm *ssm, CryptoFunc func)
+{
+  g_autoptr(GTask) task = NULL;
+  CryptoJob *job;
+
+  job = g_new0 (CryptoJob, 1);
+  job->func = func;
+  job->ssm = ssm;
+
+  /* Not cancellable, the job is short and the SSM has to wait for it */
+  task = g_task_new (dev, NULL, crypto_done_cb, NULL);
+  g_task_set_task_data (task, job, g_free);
+  g_thread_pool_push (get_crypto_pool (), g_steal_pointer (&task), NULL);
+}
+
+/* Initialization from device's flash */
+
+static gboolean
+init_private_key (FpiDeviceVfs0097 *self, const guint8 *body, guint16 size)
+{
+  gboolean success = FALSE;
+  const HostKeys *keys = host_keys_get ();
 
   if (body[0] != 2)
     {
@@ -286,7 +1067,7 @@ init_private_key (FpiDeviceVfs0097 *self, const guint8 *body, guint16 size)
   const guint8 *hash = &body[size - SHA256_DIGEST_LENGTH];
 
   guint8 calc_hash[SHA256_DIGEST_LENGTH];
-  HMAC_SHA256 (VALIDATION_KEY, SHA256_DIGEST_LENGTH, encrypted, size - 1 - SHA256_DIGEST_LENGTH, calc_hash);
+  HMAC_SHA256 (keys->validation_key, SHA256_DIGEST_LENGTH, encrypted, size - 1 - SHA256_DIGEST_LENGTH, calc_hash);
 
   if (memcmp (calc_hash, hash, SHA256_DIGEST_LENGTH) != 0)
     {
@@ -299,7 +1080,7 @@ init_private_key (FpiDeviceVfs0097 *self, const guint8 *body, guint16 size)
   unsigned char *decrypted = NULL;
   int tlen1 = 0, tlen2;
 
-  if (!EVP_DecryptInit (context, EVP_aes_256_cbc (), AES_MASTER_KEY, encrypted))
+  if (!EVP_DecryptInit (context, EVP_aes_256_cbc (), keys->aes_master_key, encrypted))
     {
       fp_err ("Failed to initialize EVP decrypt, error: %lu, %s",
               ERR_peek_last_error (), ERR_error_string (ERR_peek_last_error (), NULL));
@@ -450,11 +1231,11 @@ init_certificate (FpiDeviceVfs0097 *self, const guint8 *body, guint16 size)
   memcpy (self->certificate, body, size);
 }
 
-static void
-init_keys (FpDevice *dev, FpiSsm *ssm)
+/* Runs on a worker thread, see run_crypto_in_thread() */
+static gboolean
+init_keys (FpiDeviceVfs0097 *self)
 {
   FpiByteReader reader;
-  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
   guint32 size;
 
   guint16 id, body_size;
@@ -486,8 +1267,7 @@ init_keys (FpDevice *dev, FpiSsm *ssm)
       if (memcmp (calc_hash, hash, SHA256_DIGEST_LENGTH) != 0)
         {
           fp_warn ("Hash mismatch for block %d", id);
-          fpi_ssm_mark_failed (ssm, fpi_device_error_new (FP_DEVICE_ERROR_PROTO));
-          return;
+          return FALSE;
         }
 
       switch (id)
@@ -504,7 +1284,7 @@ init_keys (FpDevice *dev, FpiSsm *ssm)
 
         case 4:
           if (!init_private_key (self, body, body_size))
-            goto err;
+            return FALSE;
           break;
 
         case 6:
@@ -517,109 +1297,262 @@ init_keys (FpDevice *dev, FpiSsm *ssm)
         }
     }
 
-  fpi_ssm_next_state (ssm);
-  return;
+  return TRUE;
+}
+
+/* SSM for exec_command */
+
+static void
+exec_command_ssm (FpiSsm *ssm, FpDevice *dev)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+
+  switch (fpi_ssm_get_cur_state (ssm))
+    {
+    case EXEC_COMMAND_SM_ENCRYPT:
+      /* exec_command already placed the command at TLS_RECORD_DATA_OFFSET */
+      if (self->tls &&
+          !tls_encrypt_record (self, CONTENT_TYPE_DATA,
+                               self->send_buffer + TLS_RECORD_DATA_OFFSET, self->send_length,
+                               self->send_buffer, &self->send_length))
+        {
+          fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                              "Failed to encrypt command"));
+          break;
+        }
+
+      fpi_ssm_next_state (ssm);
+      break;
+
+    case EXEC_COMMAND_SM_WRITE:
+      async_write (ssm, dev, self->send_buffer, self->send_length);
+      break;
+
+    case EXEC_COMMAND_SM_READ:
+      async_read (ssm, dev, self->buffer, VFS_USB_BUFFER_SIZE, &self->buffer_length);
+      break;
+
+    case EXEC_COMMAND_SM_DECRYPT:
+      if (self->tls)
+        self->tls_record_valid = tls_decrypt_record (self, CONTENT_TYPE_DATA, self->buffer,
+                                                     self->buffer_length, &self->buffer_length);
+
+      fpi_ssm_next_state (ssm);
+      break;
+
+    default:
+      fp_err ("Unknown EXEC_COMMAND_SM state");
+      fpi_ssm_mark_failed (ssm, fpi_device_error_new (FP_DEVICE_ERROR_PROTO));
+    }
+}
+
+/* Send command and read response */
+static void
+exec_command (FpDevice *dev, FpiSsm *ssm, const guint8 *buffer, guint length)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+  FpiSsm *subsm;
+
+  if (TLS_RECORD_SIZE (length) > VFS_USB_BUFFER_SIZE)
+    {
+      fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
+                                                          "Command of %u bytes is too long", length));
+      return;
+    }
+
+  memcpy (self->send_buffer + (self->tls ? TLS_RECORD_DATA_OFFSET : 0), buffer, length);
+  self->send_length = length;
+
+  subsm = fpi_ssm_new (dev, exec_command_ssm, EXEC_COMMAND_SM_STATES);
+  fpi_ssm_start_subsm (ssm, subsm);
+}
+
+/* Runs an LED script (0x39), unless the same script was sent before and is
+ * still running. The script starts with its duration in ms. */
+static void
+exec_led_command (FpDevice *dev, FpiSsm *ssm, const guint8 *script, guint length)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+  gint64 now = g_get_monotonic_time ();
+  guint32 duration;
+
+  if (self->led_script == script &&
+      now + VFS_LED_REFRESH_MARGIN * (gint64) 1000 < self->led_script_end)
+    {
+      fp_dbg ("LED script is still running, not sending it again");
+      fpi_ssm_next_state (ssm);
+      return;
+    }
+
+  memcpy (&duration, script + 1, sizeof (duration));
+  self->led_script = script;
+  self->led_script_end = now + GUINT32_FROM_LE (duration) * (gint64) 1000;
+
+  exec_command (dev, ssm, script, length);
+}
+
+/* Sets up @writer to build a command in place in the send buffer, so that
+ * exec_written_command() can send it without allocating or copying it.
+ * The send buffer must not be in use, i.e. no command may be running. */
+static void
+command_writer_init (FpiDeviceVfs0097 *self, FpiByteWriter *writer)
+{
+  /* TLS_RECORD_SIZE (length) <= TLS_RECORD_SIZE (0) + length, so the
+   * encrypted record always fits as well. */
+  fpi_byte_writer_init_with_data (writer,
+                                  self->send_buffer + (self->tls ? TLS_RECORD_DATA_OFFSET : 0),
+                                  VFS_USB_BUFFER_SIZE - TLS_RECORD_SIZE (0),
+                                  FALSE);
+}
+
+/* Send the command built with command_writer_init() and read response */
+static void
+exec_written_command (FpDevice *dev, FpiSsm *ssm, FpiByteWriter *writer)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+  FpiSsm *subsm;
+
+  self->send_length = fpi_byte_writer_get_size (writer);
+
+  subsm = fpi_ssm_new (dev, exec_command_ssm, EXEC_COMMAND_SM_STATES);
+  fpi_ssm_start_subsm (ssm, subsm);
+}
+
+static void
+exec_get_user_storage (FpDevice *dev, FpiSsm *ssm)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+  FpiByteWriter writer;
+
+  command_writer_init (self, &writer);
+  if (!fpi_byte_writer_ensure_free_space (&writer, 5 + G_N_ELEMENTS (STORAGE)))
+    g_assert_not_reached ();
 
-err:
-  fpi_ssm_mark_failed (ssm, fpi_device_error_new (FP_DEVICE_ERROR_PROTO));
+  fpi_byte_writer_put_uint8_unchecked (&writer, 0x4b);
+  fpi_byte_writer_put_uint16_le_unchecked (&writer, 0);
+  fpi_byte_writer_put_uint16_le_unchecked (&writer, G_N_ELEMENTS (STORAGE));
+  fpi_byte_writer_put_data_unchecked (&writer, STORAGE, G_N_ELEMENTS (STORAGE));
+
+  exec_written_command (dev, ssm, &writer);
 }
 
-/* SSM for exec_command */
+/* SSM for exec_commands */
 
-struct command_ssm_data_t
+struct exec_commands_data_t
 {
-  guint8 *buffer;
-  guint   length;
+  const Vfs0097Command *commands;
+  guint                 n_commands;
+  guint                 current;
+  gboolean              next_failed;
 };
 
-static void
-command_ssm_data_free (void *data)
+/* Copies or encrypts a command into a buffer of VFS_USB_BUFFER_SIZE */
+static gboolean
+prepare_command (FpiDeviceVfs0097 *self, const Vfs0097Command *command,
+                 guint8 *out, guint *out_len)
 {
-  struct command_ssm_data_t *ssm_data = data;
+  if (!self->tls)
+    {
+      memcpy (out, command->data, command->length);
+      *out_len = command->length;
+      return TRUE;
+    }
 
-  g_free (ssm_data->buffer);
-  g_free (ssm_data);
+  return tls_encrypt_record (self, CONTENT_TYPE_DATA, command->data, command->length,
+                             out, out_len);
 }
 
 static void
-exec_command_ssm (FpiSsm *ssm, FpDevice *dev)
+exec_commands_ssm (FpiSsm *ssm, FpDevice *dev)
 {
   FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
-  struct command_ssm_data_t *data = fpi_ssm_get_data (ssm);
+  struct exec_commands_data_t *data = fpi_ssm_get_data (ssm);
 
   switch (fpi_ssm_get_cur_state (ssm))
     {
-    case EXEC_COMMAND_SM_ENCRYPT:
-      if (self->tls)
-        {
-          guint8 *raw = data->buffer;
-          guint raw_length = data->length;
-
-          guint8 *encrypted;
-          guint encrypted_length;
-
-          tls_sign_and_encrypt (CONTENT_TYPE_DATA, self->sign_key, self->encryption_key, raw, raw_length,
-                                &encrypted, &encrypted_length);
-          tls_create_record (CONTENT_TYPE_DATA, encrypted, encrypted_length, &data->buffer, &data->length);
-
-          g_free (raw);
-          g_free (encrypted);
-        }
-
-      fpi_ssm_next_state (ssm);
-      break;
-
-    case EXEC_COMMAND_SM_WRITE:
-      async_write (ssm, dev, data->buffer, data->length);
+    case EXEC_COMMANDS_SM_WRITE:
+      async_write (ssm, dev, self->send_buffer, self->send_length);
       break;
 
-    case EXEC_COMMAND_SM_READ:
+    case EXEC_COMMANDS_SM_READ:
       async_read (ssm, dev, self->buffer, VFS_USB_BUFFER_SIZE, &self->buffer_length);
+
+      /* Prepare the next command while the device answers this one */
+      if (data->current + 1 < data->n_commands)
+        data->next_failed = !prepare_command (self, &data->commands[data->current + 1],
+                                              self->next_send_buffer, &self->next_send_length);
       break;
 
-    case EXEC_COMMAND_SM_DECRYPT:
+    case EXEC_COMMANDS_SM_DECRYPT:
       if (self->tls)
-        {
-          guint8 *encrypted;
-          guint encrypted_length;
+        self->tls_record_valid = tls_decrypt_record (self, CONTENT_TYPE_DATA, self->buffer,
+                                                     self->buffer_length, &self->buffer_length);
 
-          guint8 *raw;
-          guint raw_length;
+      if (++data->current == data->n_commands)
+        {
+          fpi_ssm_next_state (ssm);
+          break;
+        }
 
-          tls_parse_record (CONTENT_TYPE_DATA, self->buffer, self->buffer_length, &encrypted, &encrypted_length);
-          tls_decrypt_and_validate (CONTENT_TYPE_DATA, self->validation_key, self->decryption_key, encrypted, encrypted_length,
-                                    &raw, &raw_length);
+      if (data->next_failed)
+        {
+          fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                              "Failed to encrypt command"));
+          break;
+        }
 
-          memcpy (self->buffer, raw, raw_length);
-          self->buffer_length = raw_length;
+      {
+        guint8 *buffer = self->send_buffer;
 
-          g_free (raw);
-          g_free (encrypted);
-        }
+        self->send_buffer = self->next_send_buffer;
+        self->send_length = self->next_send_length;
+        self->next_send_buffer = buffer;
+      }
 
-      fpi_ssm_next_state (ssm);
+      fpi_ssm_jump_to_state (ssm, EXEC_COMMANDS_SM_WRITE);
       break;
 
     default:
-      fp_err ("Unknown EXEC_COMMAND_SM state");
+      fp_err ("Unknown EXEC_COMMANDS_SM state");
       fpi_ssm_mark_failed (ssm, fpi_device_error_new (FP_DEVICE_ERROR_PROTO));
     }
 }
 
-/* Send command and read response */
+/* Send a sequence of commands, each one is prepared while the response to
+ * the previous one is being read. Only the last response is kept in
+ * self->buffer, @commands needs to stay valid until the sequence is done. */
 static void
-exec_command (FpDevice *dev, FpiSsm *ssm, const guint8 *buffer, guint length)
+exec_commands (FpDevice *dev, FpiSsm *ssm, const Vfs0097Command *commands, guint n_commands)
 {
-  struct command_ssm_data_t *data;
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+  struct exec_commands_data_t *data;
   FpiSsm *subsm;
 
-  data = g_new0 (struct command_ssm_data_t, 1);
-  data->buffer = g_memdup (buffer, length);
-  data->length = length;
+  g_assert (n_commands > 0);
 
-  subsm = fpi_ssm_new (dev, exec_command_ssm, EXEC_COMMAND_SM_STATES);
-  fpi_ssm_set_data (subsm, data, command_ssm_data_free);
+  for (guint i = 0; i < n_commands; i++)
+    {
+      if (TLS_RECORD_SIZE (commands[i].length) > VFS_USB_BUFFER_SIZE)
+        {
+          fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
+                                                              "Command of %u bytes is too long",
+                                                              commands[i].length));
+          return;
+        }
+    }
+
+  if (!prepare_command (self, &commands[0], self->send_buffer, &self->send_length))
+    {
+      fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                          "Failed to encrypt command"));
+      return;
+    }
 
+  subsm = fpi_ssm_new_with_data (dev, exec_commands_ssm, EXEC_COMMANDS_SM_STATES,
+                                 sizeof (struct exec_commands_data_t));
+  data = fpi_ssm_get_data (subsm);
+  data->commands = commands;
+  data->n_commands = n_commands;
   fpi_ssm_start_subsm (ssm, subsm);
 }
 
@@ -640,13 +1573,14 @@ tls_create_record (guint8 content_type, guint8 *fragment, guint length, guint8 *
   *out = fpi_byte_writer_reset_and_get_data (&writer);
 }
 
-static void
+/* @out points into @fragment */
+static gboolean
 tls_parse_record (guint8 content_type, guint8 *fragment, guint length, guint8 **out, guint *out_len)
 {
   FpiByteReader reader;
-  const guint8 *data;
-  guint16 data_length;
-  guint8 type;
+  const guint8 *data = NULL;
+  guint16 data_length = 0;
+  guint8 type = 0;
 
   fpi_byte_reader_init (&reader, fragment, length);
   fpi_byte_reader_get_uint8 (&reader, &type);
@@ -655,145 +1589,161 @@ tls_parse_record (guint8 content_type, guint8 *fragment, guint length, guint8 **
   if (type != content_type)
     fp_warn ("Unexpected content type: %02x", type);
 
-  fpi_byte_reader_get_uint16_be (&reader, &data_length);
-  fpi_byte_reader_get_data (&reader, data_length, &data);
+  if (!fpi_byte_reader_get_uint16_be (&reader, &data_length) ||
+      !fpi_byte_reader_get_data (&reader, data_length, &data))
+    {
+      fp_warn ("Truncated TLS record");
+      *out = NULL;
+      *out_len = 0;
+      return FALSE;
+    }
 
-  *out = g_memdup (data, data_length);
+  *out = (guint8 *) data;
   *out_len = data_length;
+
+  return TRUE;
 }
 
-static void
-tls_sign_and_encrypt (guint8 content_type, guint8 sign_key[0x20], guint8 encryption_key[0x20],
-                      guint8 *data, guint length, guint8 **out, guint *out_len)
+/* MAC over the record header and the plain text, without building the record */
+static gboolean
+tls_record_hmac (FpiDeviceVfs0097 *self, guint8 content_type, guint8 *key,
+                 const guint8 *data, guint length, guint8 hmac[0x20])
 {
-  guint8 *record;
-  guint record_length;
-  guint8 hmac[0x20];
-  guint8 iv[0x10];
-
-  guint8 *encrypted;
-  guint encrypted_length;
-
-  RAND_bytes (iv, G_N_ELEMENTS (iv));
-
-  tls_create_record (content_type, data, length, &record, &record_length);
-  HMAC_SHA256 (sign_key, 0x20, record, record_length, hmac);
-  g_free (record);
-
-  guint8 *block = g_malloc0 (length + 0x20);
-  memcpy (block, data, length);
-  memcpy (block + length, hmac, 0x20);
-
-  encrypted_length = ((length + 16) / 16) * 16 + 0x10 + 0x20;
-  encrypted = g_malloc0 (encrypted_length);
-  memcpy (encrypted, iv, 0x10);
+  guint8 header[TLS_RECORD_HEADER_SIZE];
+  guint hmac_length;
+
+  header[0] = content_type;
+  memcpy (header + 1, TLS_VERSION, G_N_ELEMENTS (TLS_VERSION));
+  header[TLS_RECORD_HEADER_SIZE - 2] = length >> 8;
+  header[TLS_RECORD_HEADER_SIZE - 1] = length & 0xff;
+
+  return HMAC_Init_ex (self->hmac_ctx, key, 0x20, EVP_sha256 (), NULL) &&
+         HMAC_Update (self->hmac_ctx, header, sizeof (header)) &&
+         HMAC_Update (self->hmac_ctx, data, length) &&
+         HMAC_Final (self->hmac_ctx, hmac, &hmac_length);
+}
 
-  EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new ();
+/* Signs, pads and encrypts @data into a complete record in @out, which needs
+ * to hold TLS_RECORD_SIZE (@length) bytes. Passing
+ * @out + TLS_RECORD_DATA_OFFSET as @data builds the record in place. */
+static gboolean
+tls_encrypt_record (FpiDeviceVfs0097 *self, guint8 content_type,
+                    const guint8 *data, guint length, guint8 *out, guint *out_len)
+{
+  guint8 *iv = out + TLS_RECORD_HEADER_SIZE;
+  guint8 *block = out + TLS_RECORD_DATA_OFFSET;
+  guint pad_len = ((length + 16) / 16) * 16 - length;
+  guint block_length = length + 0x20 + pad_len;
+  gint elen1, elen2;
 
-  gint elen1, elen2, elen3;
+  if (block != data)
+    memmove (block, data, length);
 
-  if (!EVP_EncryptInit (context, EVP_aes_256_cbc (), encryption_key, iv))
+  if (!tls_record_hmac (self, content_type, self->sign_key, block, length, block + length))
     {
-      fp_err ("Failed to initialize EVP decrypt, error: %lu, %s",
+      fp_err ("Failed to sign TLS record, error: %lu, %s",
               ERR_peek_last_error (), ERR_error_string (ERR_peek_last_error (), NULL));
-      return;
+      return FALSE;
     }
 
-  EVP_CIPHER_CTX_set_padding (context, 0);
+  memset (block + length + 0x20, pad_len - 1, pad_len);
 
-  if (!EVP_EncryptUpdate (context, encrypted + 0x10, &elen1, block, (int) length + 0x20))
+  RAND_bytes (iv, 0x10);
+
+  if (!EVP_EncryptInit_ex (self->cipher_ctx, EVP_aes_256_cbc (), NULL, self->encryption_key, iv))
     {
-      fp_err ("Failed to EVP encrypt, error: %lu, %s",
+      fp_err ("Failed to initialize EVP encrypt, error: %lu, %s",
               ERR_peek_last_error (), ERR_error_string (ERR_peek_last_error (), NULL));
-      return;
+      return FALSE;
     }
 
-  g_free (block);
-
-  gint pad_len = encrypted_length - (length + 0x10 + 0x20);
-  if (pad_len == 0)
-    pad_len = 16;
-
-  guint8 *pad = g_malloc0 (pad_len);
-  memset (pad, pad_len - 1, pad_len);
+  EVP_CIPHER_CTX_set_padding (self->cipher_ctx, 0);
 
-  if (!EVP_EncryptUpdate (context, encrypted + 0x10 + elen1, &elen2, pad, pad_len))
+  if (!EVP_EncryptUpdate (self->cipher_ctx, block, &elen1, block, block_length) ||
+      !EVP_EncryptFinal_ex (self->cipher_ctx, block + elen1, &elen2))
     {
       fp_err ("Failed to EVP encrypt, error: %lu, %s",
               ERR_peek_last_error (), ERR_error_string (ERR_peek_last_error (), NULL));
-      return;
+      return FALSE;
     }
 
-  g_free (pad);
+  guint fragment_length = 0x10 + elen1 + elen2;
 
-  if (!EVP_EncryptFinal (context, encrypted + 0x10 + elen1 + elen2, &elen3))
-    {
-      fp_err ("EVP Final encrypt failed, error: %lu, %s",
-              ERR_peek_last_error (), ERR_error_string (ERR_peek_last_error (), NULL));
-      return;
-    }
+  out[0] = content_type;
+  memcpy (out + 1, TLS_VERSION, G_N_ELEMENTS (TLS_VERSION));
+  out[TLS_RECORD_HEADER_SIZE - 2] = fragment_length >> 8;
+  out[TLS_RECORD_HEADER_SIZE - 1] = fragment_length & 0xff;
 
-  EVP_CIPHER_CTX_free (context);
+  *out_len = TLS_RECORD_HEADER_SIZE + fragment_length;
 
-  *out = encrypted;
-  *out_len = 0x10 + elen1 + elen2 + elen3;
+  return TRUE;
 }
 
-static void
-tls_decrypt_and_validate (guint8 content_type, guint8 validation_key[0x20], guint8 decryption_key[0x20],
-                          guint8 *data, guint length, guint8 **out, guint *out_len)
+/* Decrypts and validates the TLS record in @record in place, the plain text
+ * is moved to the start of it. Returns whether the record was valid. */
+static gboolean
+tls_decrypt_record (FpiDeviceVfs0097 *self, guint8 content_type,
+                    guint8 *record, guint length, guint *out_len)
 {
-  guint8 *record;
-  guint record_length;
+  guint8 *fragment;
+  guint fragment_length;
   guint8 hmac[0x20];
-  guint8 iv[0x10];
+  gint delen1, delen2;
 
-  guint8 *decrypted = g_malloc0 (length);
+  *out_len = 0;
 
-  memcpy (iv, data, G_N_ELEMENTS (iv));
+  if (!tls_parse_record (content_type, record, length, &fragment, &fragment_length))
+    return FALSE;
 
-  EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new ();
+  /* IV, at least one block and the HMAC */
+  if (fragment_length < 0x10 + 0x20 || (fragment_length - 0x10) % 0x10 != 0)
+    {
+      fp_warn ("Invalid TLS record length %u", fragment_length);
+      return FALSE;
+    }
 
-  gint delen1, delen2;
+  guint8 *iv = fragment;
+  guint8 *block = fragment + 0x10;
 
-  if (!EVP_DecryptInit (context, EVP_aes_256_cbc (), decryption_key, iv))
+  if (!EVP_DecryptInit_ex (self->cipher_ctx, EVP_aes_256_cbc (), NULL, self->decryption_key, iv))
     {
       fp_err ("Failed to initialize EVP decrypt, error: %lu, %s",
               ERR_peek_last_error (), ERR_error_string (ERR_peek_last_error (), NULL));
-      return;
+      return FALSE;
     }
 
-  EVP_CIPHER_CTX_set_padding (context, 0);
+  EVP_CIPHER_CTX_set_padding (self->cipher_ctx, 0);
 
-  if (!EVP_DecryptUpdate (context, decrypted, &delen1, data + G_N_ELEMENTS (iv), length - G_N_ELEMENTS (iv)))
+  if (!EVP_DecryptUpdate (self->cipher_ctx, block, &delen1, block, fragment_length - 0x10) ||
+      !EVP_DecryptFinal_ex (self->cipher_ctx, block + delen1, &delen2))
     {
       fp_err ("Failed to EVP decrypt, error: %lu, %s",
               ERR_peek_last_error (), ERR_error_string (ERR_peek_last_error (), NULL));
-      return;
+      return FALSE;
     }
 
-  if (!EVP_DecryptFinal (context, decrypted + delen1, &delen2))
+  guint full_length = delen1 + delen2;
+  if (full_length < (guint) block[full_length - 1] + 1 + 0x20)
     {
-      fp_err ("EVP Final decrypt failed, error: %lu, %s",
-              ERR_peek_last_error (), ERR_error_string (ERR_peek_last_error (), NULL));
-      return;
+      fp_warn ("Invalid TLS record padding");
+      return FALSE;
     }
 
-  EVP_CIPHER_CTX_free (context);
-
-  guint full_length = delen1 + delen2;
-  guint no_pad_length = full_length - (decrypted[full_length - 1] + 1);
+  guint no_pad_length = full_length - (block[full_length - 1] + 1);
   guint no_hash_length = no_pad_length - 0x20;
+  gboolean valid = TRUE;
 
-  tls_create_record (content_type, decrypted, no_hash_length, &record, &record_length);
-  HMAC_SHA256 (validation_key, 0x20, record, record_length, hmac);
-  g_free (record);
-
-  if (memcmp (hmac, decrypted + no_hash_length, 0x20) != 0)
-    fp_warn ("TLS record validation failed");
+  if (!tls_record_hmac (self, content_type, self->validation_key, block, no_hash_length, hmac) ||
+      memcmp (hmac, block + no_hash_length, 0x20) != 0)
+    {
+      fp_warn ("TLS record validation failed");
+      valid = FALSE;
+    }
 
-  *out = decrypted;
+  memmove (record, block, no_hash_length);
   *out_len = no_hash_length;
+
+  return valid;
 }
 
 static void
@@ -855,7 +1805,7 @@ tls_prepare_client_hello (FpiDeviceVfs0097 *self, guint8 **record, guint *record
   g_free (handshake);
 }
 
-static void
+static gboolean
 tls_prepare_certificate_kex_verify (FpiDeviceVfs0097 *self, guint8 **record, guint *record_length)
 {
   FpiByteWriter writer;
@@ -872,8 +1822,6 @@ tls_prepare_certificate_kex_verify (FpiDeviceVfs0097 *self, guint8 **record, gui
 
   guint8 *h_finished;
   guint h_finished_length;
-  guint8 *h_finished_enc;
-  guint h_finished_enc_length;
   guint8 *tls_finished;
   guint tls_finished_length;
 
@@ -944,9 +1892,17 @@ tls_prepare_certificate_kex_verify (FpiDeviceVfs0097 *self, guint8 **record, gui
               verify, 0xC);
   tls_create_handshake (HANDSHAKE_TYPE_FINISHED, verify, 0xC, &h_finished, &h_finished_length);
 
-  tls_sign_and_encrypt (CONTENT_TYPE_HANDSHAKE, self->sign_key, self->encryption_key, h_finished, h_finished_length,
-                        &h_finished_enc, &h_finished_enc_length);
-  tls_create_record (CONTENT_TYPE_HANDSHAKE, h_finished_enc, h_finished_enc_length, &tls_finished, &tls_finished_length);
+  tls_finished = g_malloc0 (TLS_RECORD_SIZE (h_finished_length));
+  if (!tls_encrypt_record (self, CONTENT_TYPE_HANDSHAKE, h_finished, h_finished_length,
+                           tls_finished, &tls_finished_length))
+    {
+      g_free (h_certificate);
+      g_free (h_client_key_exchange);
+      g_free (h_certificate_verify);
+      g_free (h_finished);
+      g_free (tls_finished);
+      return FALSE;
+    }
 
   fpi_byte_writer_init (&writer);
   fpi_byte_writer_put_data (&writer, h_certificate, h_certificate_length);
@@ -966,6 +1922,15 @@ tls_prepare_certificate_kex_verify (FpiDeviceVfs0097 *self, guint8 **record, gui
   fpi_byte_writer_put_data (&writer, tls_finished, tls_finished_length);
   *record_length = fpi_byte_writer_get_size (&writer);
   *record = fpi_byte_writer_reset_and_get_data (&writer);
+
+  g_free (h_certificate);
+  g_free (h_client_key_exchange);
+  g_free (h_certificate_verify);
+  g_free (h_finished);
+  g_free (tls_finished);
+  g_free (first_part);
+
+  return TRUE;
 }
 
 
@@ -1188,6 +2153,25 @@ handshake_command (guint8 *data, guint data_length, guint8 **buffer, guint *buff
   memcpy (*buffer + len, data, data_length);
 }
 
+/* Handshake steps that run on a worker thread */
+static gboolean
+tls_make_keys_job (FpiDeviceVfs0097 *self)
+{
+  /* Errors are logged, and the handshake fails later on */
+  tls_make_keys (self);
+
+  return TRUE;
+}
+
+static gboolean
+tls_prepare_client_finished_job (FpiDeviceVfs0097 *self)
+{
+  g_clear_pointer (&self->handshake_record, g_free);
+
+  return tls_prepare_certificate_kex_verify (self, &self->handshake_record,
+                                             &self->handshake_record_length);
+}
+
 /* SSM loop for TLS handshake */
 static void
 handshake_ssm (FpiSsm *ssm, FpDevice *dev)
@@ -1221,14 +2205,17 @@ handshake_ssm (FpiSsm *ssm, FpDevice *dev)
       break;
 
     case TLS_HANDSHAKE_SM_MAKE_KEYS:
-      tls_make_keys (self);
-      fpi_ssm_next_state (ssm);
+      run_crypto_in_thread (dev, ssm, tls_make_keys_job);
+      break;
+
+    case TLS_HANDSHAKE_SM_CLIENT_KEX_VERIFY:
+      run_crypto_in_thread (dev, ssm, tls_prepare_client_finished_job);
       break;
 
     case TLS_HANDSHAKE_SM_CLIENT_FINISHED:
-      tls_prepare_certificate_kex_verify (self, &record, &record_length);
-      handshake_command (record, record_length, &command, &command_length);
-      g_free (record);
+      handshake_command (self->handshake_record, self->handshake_record_length,
+                         &command, &command_length);
+      g_clear_pointer (&self->handshake_record, g_free);
 
       exec_command (dev, ssm, command, command_length);
       g_free (command);
@@ -1245,6 +2232,7 @@ handshake_ssm (FpiSsm *ssm, FpDevice *dev)
         {
           fp_info ("TLS connection established");
           self->tls = TRUE;
+          tls_cache_store_session (self);
           fpi_ssm_next_state (ssm);
         }
       break;
@@ -1264,6 +2252,57 @@ do_handshake (FpDevice *dev, FpiSsm *ssm)
   fpi_ssm_start_subsm (ssm, subsm);
 }
 
+/* SSM loop for resuming the cached TLS session of a device that was not
+ * reset since it was last opened */
+static void
+tls_resume_ssm (FpiSsm *ssm, FpDevice *dev)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+
+  switch (fpi_ssm_get_cur_state (ssm))
+    {
+    case TLS_RESUME_SM_PROBE:
+      if (!tls_cache_restore_session (self))
+        {
+          fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
+                                                              "No cached TLS session"));
+          break;
+        }
+
+      self->tls_record_valid = FALSE;
+      exec_command (dev, ssm, INIT_SEQUENCE_MSG1, G_N_ELEMENTS (INIT_SEQUENCE_MSG1));
+      break;
+
+    case TLS_RESUME_SM_CHECK:
+      if (!self->tls_record_valid)
+        {
+          fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                              "Cached TLS session was not accepted"));
+          break;
+        }
+
+      {
+        guint8 hash[SHA256_DIGEST_LENGTH];
+
+        SHA256 (self->buffer, self->buffer_length, hash);
+        if (memcmp (hash, self->msg1_hash, sizeof (hash)) != 0)
+          {
+            fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                                "Sensor does not match the cached TLS session"));
+            break;
+          }
+      }
+
+      fp_info ("TLS connection resumed");
+      fpi_ssm_mark_completed (ssm);
+      break;
+
+    default:
+      fp_err ("Unknown TLS_RESUME_SM state");
+      fpi_ssm_mark_failed (ssm, fpi_device_error_new (FP_DEVICE_ERROR_PROTO));
+    }
+}
+
 /* Device functions */
 
 /* SSM loop for device initialization */
@@ -1297,6 +2336,15 @@ init_ssm (FpiSsm *ssm, FpDevice *dev)
           break;
         }
 
+      /* The sensor answered without a reset */
+      self->probing = FALSE;
+      self->usb_timeout = VFS_USB_TIMEOUT;
+
+      g_clear_pointer (&self->flash_identity, g_checksum_free);
+      self->flash_identity = g_checksum_new (G_CHECKSUM_SHA256);
+      g_checksum_update (self->flash_identity, self->buffer, self->buffer_length);
+      SHA256 (self->buffer, self->buffer_length, self->msg1_hash);
+
     case SEND_INIT_2:
       exec_command (dev, ssm, INIT_SEQUENCE_MSG2, G_N_ELEMENTS (INIT_SEQUENCE_MSG2));
       break;
@@ -1314,11 +2362,44 @@ init_ssm (FpiSsm *ssm, FpDevice *dev)
       break;
 
     case READ_FLASH_TLS_DATA:
+      /* The flash info completes the identity of the cached data */
+      g_checksum_update (self->flash_identity, self->buffer, self->buffer_length);
+
+      /* A different sensor than the one cached for this device object */
+      if (g_strcmp0 (self->tls_identity, g_checksum_get_string (self->flash_identity)) != 0)
+        {
+          tls_cache_forget (self);
+          g_free (self->tls_identity);
+          self->tls_identity = g_strdup (g_checksum_get_string (self->flash_identity));
+        }
+
+      if (tls_cache_restore_flash (self))
+        {
+          fp_dbg ("Using cached TLS data, skipping flash read");
+          fpi_ssm_jump_to_state (ssm, HANDSHAKE);
+          break;
+        }
+
+      self->flash_from_disk = !self->flash_disk_cache_disabled && flash_cache_load (self);
+      if (self->flash_from_disk)
+        {
+          fp_dbg ("Using TLS data cached on disk, skipping flash read");
+          fpi_ssm_jump_to_state (ssm, INIT_KEYS);
+          break;
+        }
+
       exec_command (dev, ssm, INIT_SEQUENCE_MSG6, G_N_ELEMENTS (INIT_SEQUENCE_MSG6));
       break;
 
     case INIT_KEYS:
-      init_keys (dev, ssm);
+      run_crypto_in_thread (dev, ssm, init_keys);
+      break;
+
+    case STORE_KEYS:
+      tls_cache_store_flash (self);
+      if (!self->flash_from_disk)
+        flash_cache_store (self, self->buffer, self->buffer_length);
+      fpi_ssm_next_state (ssm);
       break;
 
     case HANDSHAKE:
@@ -1331,6 +2412,73 @@ init_ssm (FpiSsm *ssm, FpDevice *dev)
     }
 }
 
+/* Users DB snapshot */
+
+static void
+db_finger_clear (gpointer data)
+{
+  Vfs0097DbFinger *finger = data;
+
+  g_free (finger->username);
+}
+
+static GArray *
+users_db_new (void)
+{
+  GArray *db = g_array_new (FALSE, TRUE, sizeof (Vfs0097DbFinger));
+
+  g_array_set_clear_func (db, db_finger_clear);
+  return db;
+}
+
+/* Forget the snapshot, needs to be called whenever the DB changes */
+static void
+users_db_invalidate (FpiDeviceVfs0097 *self)
+{
+  g_clear_pointer (&self->users_db, g_array_unref);
+}
+
+static FpPrint *
+db_finger_to_print (FpDevice *dev, const Vfs0097DbFinger *finger)
+{
+  FpPrint *print = fp_print_new (dev);
+
+  fpi_print_set_device_stored (print, TRUE);
+  fpi_print_set_type (print, FPI_PRINT_RAW);
+
+  fp_print_set_username (print, finger->username);
+  fp_print_set_finger (print, subtype_to_finger (finger->subtype));
+  GDateTime *dt = g_date_time_new_now_local ();
+  GDate *date = g_date_new_dmy (
+    g_date_time_get_day_of_month (dt),
+    g_date_time_get_month (dt),
+    g_date_time_get_year (dt));
+  fp_print_set_enroll_date (print, date);
+
+  g_date_time_unref (dt);
+  g_date_free (date);
+
+  char buf[100];
+  sprintf (buf, "id = %d", finger->id);
+  fp_print_set_description (print, buf);
+
+  g_object_set (print, "fpi-data", g_variant_new ("q", finger->id), NULL);
+
+  return print;
+}
+
+static GPtrArray *
+users_db_to_prints (FpDevice *dev, GArray *db)
+{
+  GPtrArray *prints = g_ptr_array_new_full (db->len, g_object_unref);
+
+  for (guint i = 0; i < db->len; i++)
+    g_ptr_array_add (prints,
+                     g_object_ref_sink (db_finger_to_print (dev, &g_array_index (db, Vfs0097DbFinger, i))));
+
+  return prints;
+}
+
 static void
 get_users_db_ssm (FpiSsm *ssm, FpDevice *dev)
 {
@@ -1339,28 +2487,22 @@ get_users_db_ssm (FpiSsm *ssm, FpDevice *dev)
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case GET_USER_STORAGE:
-      {
-        FpiByteWriter writer;
-        fpi_byte_writer_init (&writer);
-        fpi_byte_writer_put_uint8 (&writer, 0x4b);
-        fpi_byte_writer_put_uint16_le (&writer, 0);
-        fpi_byte_writer_put_uint16_le (&writer, G_N_ELEMENTS (STORAGE));
-        fpi_byte_writer_put_data (&writer, STORAGE, G_N_ELEMENTS (STORAGE));
-
-        guint length = fpi_byte_writer_get_size (&writer);
-        guint8 *data = fpi_byte_writer_reset_and_get_data (&writer);
-
-        exec_command (dev, ssm, data, length);
-        break;
-      }
+      exec_get_user_storage (dev, ssm);
+      break;
 
     case PARSE_USER_STORAGE:
       {
         FpiByteReader reader;
         fpi_byte_reader_init (&reader, self->buffer, self->buffer_length);
 
-        guint16 status;
-        fpi_byte_reader_get_uint16_le (&reader, &status);
+        if (!fpi_byte_reader_ensure_remaining (&reader, 10))
+          {
+            fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                                "Storage info response too short"));
+            break;
+          }
+
+        guint16 status = fpi_byte_reader_get_uint16_le_unchecked (&reader);
 
         if (status == 0x04b3)
           fp_warn ("Weird status");
@@ -1368,29 +2510,34 @@ get_users_db_ssm (FpiSsm *ssm, FpDevice *dev)
         if (status != 0)
           fp_warn ("Bad status");
 
-        guint16 recid, usercnt, namesz, unknwn;
-        fpi_byte_reader_get_uint16_le (&reader, &recid);
-        fpi_byte_reader_get_uint16_le (&reader, &usercnt);
-        fpi_byte_reader_get_uint16_le (&reader, &namesz);
-        fpi_byte_reader_get_uint16_le (&reader, &unknwn);
+        guint16 recid = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+        guint16 usercnt = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+        guint16 namesz = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+        guint16 unknwn = fpi_byte_reader_get_uint16_le_unchecked (&reader);
 
         fp_dbg ("recid: %u, usercnt: %u, namesz: %u, unknwn: %u", recid, usercnt, namesz, unknwn);
 
+        /* Check the user records and the name at once, then read them unchecked */
+        if (!fpi_byte_reader_ensure_remaining (&reader, usercnt * 4 + namesz))
+          {
+            fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                                "Storage info response truncated"));
+            break;
+          }
+
         GSList *list = NULL;
 
         for (int i = 0; i < usercnt; i++)
           {
-            guint16 id, val;
-            fpi_byte_reader_get_uint16_le (&reader, &id);
-            fpi_byte_reader_get_uint16_le (&reader, &val);
+            guint16 id = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+            guint16 val = fpi_byte_reader_get_uint16_le_unchecked (&reader);
 
             list = g_slist_append (list, GUINT_TO_POINTER (id));
 
             fp_dbg ("DBID: %d, ValueSize: %d", id, val);
           }
 
-        const guint8 *name;
-        fpi_byte_reader_get_data (&reader, namesz, &name);
+        const guint8 *name = fpi_byte_reader_get_data_unchecked (&reader, namesz);
 
         fp_dbg ("Name: %s", name);
         if (fpi_byte_reader_get_remaining (&reader) > 0)
@@ -1398,7 +2545,10 @@ get_users_db_ssm (FpiSsm *ssm, FpDevice *dev)
 
         fpi_ssm_set_data (ssm, list, NULL); // TODO: ?
 
-        fpi_ssm_next_state (ssm);
+        if (list == NULL)
+          fpi_ssm_mark_completed (ssm);
+        else
+          fpi_ssm_next_state (ssm);
         break;
       }
 
@@ -1417,16 +2567,16 @@ get_users_db_ssm (FpiSsm *ssm, FpDevice *dev)
         fp_info ("Querying DB for user: %u", id);
 
         FpiByteWriter writer;
-        fpi_byte_writer_init (&writer);
-        fpi_byte_writer_put_uint8 (&writer, 0x4a);
-        fpi_byte_writer_put_uint16_le (&writer, id); // DBID
-        fpi_byte_writer_put_uint16_le (&writer, 0); // Lookup: DBID
-        fpi_byte_writer_put_uint16_le (&writer, 0); // Lookup: IDENTITY
+        command_writer_init (self, &writer);
+        if (!fpi_byte_writer_ensure_free_space (&writer, 7))
+          g_assert_not_reached ();
 
-        guint length = fpi_byte_writer_get_size (&writer);
-        guint8 *data = fpi_byte_writer_reset_and_get_data (&writer);
+        fpi_byte_writer_put_uint8_unchecked (&writer, 0x4a);
+        fpi_byte_writer_put_uint16_le_unchecked (&writer, id); // DBID
+        fpi_byte_writer_put_uint16_le_unchecked (&writer, 0); // Lookup: DBID
+        fpi_byte_writer_put_uint16_le_unchecked (&writer, 0); // Lookup: IDENTITY
 
-        exec_command (dev, ssm, data, length);
+        exec_written_command (dev, ssm, &writer);
         break;
       }
 
@@ -1435,8 +2585,16 @@ get_users_db_ssm (FpiSsm *ssm, FpDevice *dev)
         FpiByteReader reader;
         fpi_byte_reader_init (&reader, self->buffer, self->buffer_length);
 
-        guint16 status;
-        fpi_byte_reader_get_uint16_le (&reader, &status);
+        if (!fpi_byte_reader_ensure_remaining (&reader, 10))
+          {
+            fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                                "User info response too short"));
+            g_slist_free (fpi_ssm_get_data (ssm));
+            fpi_ssm_set_data (ssm, NULL, NULL);
+            break;
+          }
+
+        guint16 status = fpi_byte_reader_get_uint16_le_unchecked (&reader);
 
         if (status == 0x04b3)
           fp_warn ("Weird status");
@@ -1444,81 +2602,72 @@ get_users_db_ssm (FpiSsm *ssm, FpDevice *dev)
         if (status != 0)
           fp_warn ("Bad status");
 
-        guint16 recid, fingercnt, unknwn, identitysz;
-        fpi_byte_reader_get_uint16_le (&reader, &recid);
-        fpi_byte_reader_get_uint16_le (&reader, &fingercnt);
-        fpi_byte_reader_get_uint16_le (&reader, &unknwn);
-        fpi_byte_reader_get_uint16_le (&reader, &identitysz);
+        guint16 recid = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+        guint16 fingercnt = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+        guint16 unknwn = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+        guint16 identitysz = fpi_byte_reader_get_uint16_le_unchecked (&reader);
 
         fp_dbg ("recid: %u, fingercnt: %u, unknwn: %u, identitysz: %u", recid, fingercnt, unknwn, identitysz);
 
+        /* Check the finger records and the identity at once, then read them unchecked */
+        if (!fpi_byte_reader_ensure_remaining (&reader, fingercnt * 8 + identitysz))
+          {
+            fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                                "User info response truncated"));
+            g_slist_free (fpi_ssm_get_data (ssm));
+            fpi_ssm_set_data (ssm, NULL, NULL);
+            break;
+          }
+
+        gboolean stopped = FALSE;
         guint16 *ids = g_malloc0 (fingercnt * sizeof (guint16));
         guint16 *subtypes = g_malloc0 (fingercnt * sizeof (guint16));
 
         for (int i = 0; i < fingercnt; i++)
           {
-            guint16 stgid, valsz;
-            fpi_byte_reader_get_uint16_le (&reader, &ids[i]);
-            fpi_byte_reader_get_uint16_le (&reader, &subtypes[i]);
-            fpi_byte_reader_get_uint16_le (&reader, &stgid);
-            fpi_byte_reader_get_uint16_le (&reader, &valsz);
+            ids[i] = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+            subtypes[i] = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+            guint16 stgid = fpi_byte_reader_get_uint16_le_unchecked (&reader);
+            guint16 valsz = fpi_byte_reader_get_uint16_le_unchecked (&reader);
 
             fp_dbg ("FRID: %d, SUBTYPE: %d, STGID: %d, VALSZ: %d", ids[i], subtypes[i], stgid, valsz);
           }
 
-        const guint8 *identity;
-        fpi_byte_reader_get_data (&reader, identitysz, &identity);
+        const guint8 *identity = fpi_byte_reader_get_data_unchecked (&reader, identitysz);
 
         {
           FpiByteReader r;
-          guint type;
+          guint type = 0;
 
           fpi_byte_reader_init (&r, identity, identitysz);
           fpi_byte_reader_get_uint32_le (&r, &type);
 
-          if (type == 3)
+          /* type 3 identities carry a fixed 12 byte header before the name */
+          if (type == 3 && fpi_byte_reader_ensure_remaining (&r, 12))
             {
-              guint length;
-              fpi_byte_reader_get_uint32_le (&r, &length);
-
-              guint8 revision, subcnt;
-              fpi_byte_reader_get_uint8 (&r, &revision);
-              fpi_byte_reader_get_uint8 (&r, &subcnt);
-
-              guint8 auth[6];
-              for (int i = 0; i < 6; i++)
-                fpi_byte_reader_get_uint8 (&r, &auth[i]);
-
-              if (memcmp (auth, FPRINT_AUTHORITY, G_N_ELEMENTS (FPRINT_AUTHORITY)) == 0)
+              G_GNUC_UNUSED guint length = fpi_byte_reader_get_uint32_le_unchecked (&r);
+              G_GNUC_UNUSED guint8 revision = fpi_byte_reader_get_uint8_unchecked (&r);
+              guint8 subcnt = fpi_byte_reader_get_uint8_unchecked (&r);
+              const guint8 *auth = fpi_byte_reader_get_data_unchecked (&r, 6);
+              const guint8 *username;
+
+              if (memcmp (auth, FPRINT_AUTHORITY, G_N_ELEMENTS (FPRINT_AUTHORITY)) == 0 &&
+                  fpi_byte_reader_get_data (&r, subcnt * 4, &username))
                 {
-                  const guint8 *username;
-                  fpi_byte_reader_get_data (&r, subcnt * 4, &username);
                   fp_dbg ("Found FPrint user: %s", username);
 
                   for (int i = 0; i < fingercnt; i++)
                     {
-                      FpPrint *print = fp_print_new (dev);
-
-                      fpi_print_set_device_stored (print, TRUE);
-                      fpi_print_set_type (print, FPI_PRINT_RAW);
+                      Vfs0097DbFinger finger;
 
-                      fp_print_set_username (print, (gchar *) username);
-                      fp_print_set_finger (print, subtype_to_finger (subtypes[i]));
-                      GDateTime *dt = g_date_time_new_now_local ();
-                      GDate *date = g_date_new_dmy (
-                        g_date_time_get_day_of_month (dt),
-                        g_date_time_get_month (dt),
-                        g_date_time_get_year (dt));
-                      fp_print_set_enroll_date (print, date);
+                      finger.username = g_strndup ((const gchar *) username, subcnt * 4);
+                      finger.subtype = subtypes[i];
+                      finger.id = ids[i];
 
-                      g_date_time_unref (dt);
-                      g_date_free (date);
+                      g_array_append_val (self->users_db_pending, finger);
 
-                      char buf[100];
-                      sprintf (buf, "id = %d", ids[i]);
-                      fp_print_set_description (print, buf);
-
-                      g_ptr_array_add (self->list_result, g_object_ref_sink (print));
+                      if (!stopped && !fpi_device_list_report (dev, db_finger_to_print (dev, &finger)))
+                        stopped = TRUE;
                     }
                 }
             }
@@ -1535,10 +2684,23 @@ get_users_db_ssm (FpiSsm *ssm, FpDevice *dev)
           fp_warn ("Junk at the end of the user info response");
 
         GSList *list = fpi_ssm_get_data (ssm);
-        if (list != NULL)
-          fpi_ssm_jump_to_state (ssm, GET_USER);
+        if (stopped)
+          {
+            /* The caller has what it was looking for, skip the remaining
+             * users. The DB read so far is incomplete, so don't cache it. */
+            g_slist_free (list);
+            fpi_ssm_set_data (ssm, NULL, NULL);
+            g_clear_pointer (&self->users_db_pending, g_array_unref);
+            fpi_ssm_mark_completed (ssm);
+          }
+        else if (list != NULL)
+          {
+            fpi_ssm_jump_to_state (ssm, GET_USER);
+          }
         else
-          fpi_ssm_next_state (ssm);
+          {
+            fpi_ssm_next_state (ssm);
+          }
         break;
       }
 
@@ -1549,35 +2711,35 @@ get_users_db_ssm (FpiSsm *ssm, FpDevice *dev)
 }
 
 static void
-enroll_interrupt_cb (FpiUsbTransfer *transfer,
-                     FpDevice       *dev,
-                     gpointer        user_data,
-                     GError         *error)
+enroll_interrupt_cb (FpDevice               *dev,
+                     FpiSsm                 *ssm,
+                     const Vfs0097Interrupt *interrupt,
+                     GError                 *error)
 {
   if (error)
     {
       if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
         {
           g_error_free (error);
-          fpi_ssm_jump_to_state (transfer->ssm, ENROLL_FAILED);
+          fpi_ssm_jump_to_state (ssm, ENROLL_FAILED);
           return;
         }
 
-      fpi_ssm_mark_failed (transfer->ssm, error);
+      fpi_ssm_mark_failed (ssm, error);
       return;
     }
   g_clear_pointer (&error, g_error_free);
 
-  fpi_ssm_next_state (transfer->ssm);
+  fpi_ssm_next_state (ssm);
 }
 
 static void
-match_interrupt_cb (FpiUsbTransfer *transfer,
-                    FpDevice       *dev,
-                    gpointer        user_data,
-                    GError         *error)
+match_interrupt_cb (FpDevice               *dev,
+                    FpiSsm                 *ssm,
+                    const Vfs0097Interrupt *interrupt,
+                    GError                 *error)
 {
-  gint *data = fpi_ssm_get_data (transfer->ssm);
+  gint *data = fpi_ssm_get_data (ssm);
 
   *data = -1;
 
@@ -1586,89 +2748,92 @@ match_interrupt_cb (FpiUsbTransfer *transfer,
       if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
         {
           g_error_free (error);
-          fpi_ssm_jump_to_state (transfer->ssm, MATCH_USER_FINISH);
+          fpi_ssm_jump_to_state (ssm, MATCH_USER_FINISH);
           return;
         }
 
-      fpi_ssm_mark_failed (transfer->ssm, error);
+      fpi_ssm_mark_failed (ssm, error);
       return;
     }
   g_clear_pointer (&error, g_error_free);
 
   enum FINGERPRINT_VERIFY_SM next_state;
-  if (transfer->buffer[0] == 0x03 && transfer->buffer[4] == 0xdb)
+  if (interrupt->data[0] == 0x03 && interrupt->data[4] == 0xdb)
     {
-      *data = transfer->buffer[2];
+      *data = interrupt->data[2];
       next_state = MATCH_USER_FINISH;
     }
-  else if (INTERRUPT_CMP (transfer, INTERRUPT_USER_NOT_FOUND))
+  else if (INTERRUPT_CMP (interrupt, INTERRUPT_USER_NOT_FOUND))
     {
       next_state = MATCH_USER_FINISH;
     }
   else
     {
-      fp_warn ("Unknown interrupt: %02x %02x %02x %02x %02x", transfer->buffer[0], transfer->buffer[1], transfer->buffer[2],
-               transfer->buffer[3], transfer->buffer[4]);
+      fp_warn ("Unknown interrupt: %02x %02x %02x %02x %02x", interrupt->data[0], interrupt->data[1], interrupt->data[2],
+               interrupt->data[3], interrupt->data[4]);
       next_state = MATCH_USER_FINISH;
     }
-  fpi_ssm_jump_to_state (transfer->ssm, next_state);
+  fpi_ssm_jump_to_state (ssm, next_state);
 }
 
 static void
-capture_interrupt_cb (FpiUsbTransfer *transfer, FpDevice *dev, gpointer user_data, GError *error)
+capture_interrupt_cb (FpDevice               *dev,
+                      FpiSsm                 *ssm,
+                      const Vfs0097Interrupt *interrupt,
+                      GError                 *error)
 {
   if (error)
     {
       if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
           g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_TIMED_OUT))
         {
-          fpi_ssm_mark_failed (transfer->ssm, error);
+          fpi_ssm_mark_failed (ssm, error);
 //          g_error_free (error);
-//          fpi_ssm_jump_to_state (transfer->ssm, SCAN_FAILED);
+//          fpi_ssm_jump_to_state (ssm, SCAN_FAILED);
           return;
         }
 
-      fpi_ssm_mark_failed (transfer->ssm, error);
+      fpi_ssm_mark_failed (ssm, error);
       return;
     }
   g_clear_pointer (&error, g_error_free);
 
   enum CAPTURE_SM next_state;
-  if (INTERRUPT_CMP (transfer, INTERRUPT_WAITING_FINGER))
+  if (INTERRUPT_CMP (interrupt, INTERRUPT_WAITING_FINGER))
     {
       next_state = WAITING_FINGER;
     }
-  else if (INTERRUPT_CMP (transfer, INTERRUPT_FINGER_DOWN))
+  else if (INTERRUPT_CMP (interrupt, INTERRUPT_FINGER_DOWN))
     {
       next_state = FINGER_DOWN;
     }
-  else if (INTERRUPT_CMP (transfer, INTERRUPT_SCANNING_FINGERPRINT))
+  else if (INTERRUPT_CMP (interrupt, INTERRUPT_SCANNING_FINGERPRINT))
     {
       next_state = SCANNING_FINGERPRINT;
     }
-  else if (INTERRUPT_CMP (transfer, INTERRUPT_SCAN_FAILED_TOO_SHORT))
+  else if (INTERRUPT_CMP (interrupt, INTERRUPT_SCAN_FAILED_TOO_SHORT))
     {
       next_state = SCAN_FAILED_TOO_SHORT;
     }
-  else if (INTERRUPT_CMP (transfer, INTERRUPT_SCAN_FAILED_TOO_FAST))
+  else if (INTERRUPT_CMP (interrupt, INTERRUPT_SCAN_FAILED_TOO_FAST))
     {
       next_state = SCAN_FAILED_TOO_FAST;
     }
-  else if (INTERRUPT_CMP (transfer, INTERRUPT_SCAN_COMPLETED))
+  else if (INTERRUPT_CMP (interrupt, INTERRUPT_SCAN_COMPLETED))
     {
       next_state = SCAN_COMPLETED;
     }
-  else if (INTERRUPT_CMP (transfer, INTERRUPT_SCAN_SUCCESS))
+  else if (INTERRUPT_CMP (interrupt, INTERRUPT_SCAN_SUCCESS))
     {
       next_state = SCAN_SUCCESS;
     }
   else
     {
       fp_warn ("Unknown interrupt: %02x %02x %02x %02x %02x",
-               transfer->buffer[0], transfer->buffer[1], transfer->buffer[2], transfer->buffer[3], transfer->buffer[4]);
+               interrupt->data[0], interrupt->data[1], interrupt->data[2], interrupt->data[3], interrupt->data[4]);
       next_state = SCAN_FAILED;
     }
-  fpi_ssm_jump_to_state (transfer->ssm, next_state);
+  fpi_ssm_jump_to_state (ssm, next_state);
 }
 
 static void
@@ -1680,15 +2845,18 @@ capture_ssm (FpiSsm *ssm, FpDevice *dev)
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case VERIFY_START:
-      exec_command (dev, ssm, LED_GREEN_ON, G_N_ELEMENTS (LED_GREEN_ON));
+      /* On a retry the LED is usually still on from the last attempt */
+      exec_led_command (dev, ssm, LED_GREEN_ON, G_N_ELEMENTS (LED_GREEN_ON));
       break;
 
     case START_IDENTIFY_PROGRAM:
+      /* Only interrupts from this scan are of interest */
+      interrupt_queue_clear (self);
       exec_command (dev, ssm, CAPTURE_PROGRAM, G_N_ELEMENTS (CAPTURE_PROGRAM));
       break;
 
     case AWAIT_INTERRUPT:
-      await_interrupt (dev, ssm, capture_interrupt_cb);
+      await_interrupt (dev, ssm, 0, capture_interrupt_cb);
       break;
 
     case WAITING_FINGER:
@@ -1749,6 +2917,16 @@ do_capture (FpDevice *dev, FpiSsm *ssm, gpointer data)
   fpi_ssm_start_subsm (ssm, subsm);
 }
 
+/* Records of one enrollment are created in a chain: the first one looks up
+ * the storage and enables DB writes, the last one flushes the changes. */
+typedef enum {
+  CREATE_RECORD_FLAG_NONE     = 0,
+  /* The previous record already looked up the storage and enabled writes */
+  CREATE_RECORD_FLAG_CHAINED  = 1 << 0,
+  /* More records follow, do not flush the changes yet */
+  CREATE_RECORD_FLAG_NO_FLUSH = 1 << 1,
+} CreateRecordFlags;
+
 struct create_record_data_t
 {
   guint16 dbid;
@@ -1758,6 +2936,10 @@ struct create_record_data_t
   guint8 *data;
   guint   length;
   guint  *record_id;
+
+  CreateRecordFlags flags;
+  guint16          *storage_id;
+  FpiSsm           *parent;
 };
 
 static void
@@ -1768,20 +2950,16 @@ create_record_ssm (FpiSsm *ssm, FpDevice *dev)
 
   switch (fpi_ssm_get_cur_state (ssm))
     {
-    case CR_GET_USER_STORAGE: {
-        FpiByteWriter writer;
-        fpi_byte_writer_init (&writer);
-        fpi_byte_writer_put_uint8 (&writer, 0x4b);
-        fpi_byte_writer_put_uint16_le (&writer, 0);
-        fpi_byte_writer_put_uint16_le (&writer, G_N_ELEMENTS (STORAGE));
-        fpi_byte_writer_put_data (&writer, STORAGE, G_N_ELEMENTS (STORAGE));
-
-        guint length = fpi_byte_writer_get_size (&writer);
-        guint8 *data = fpi_byte_writer_reset_and_get_data (&writer);
+    case CR_GET_USER_STORAGE:
+      if (ssm_data->flags & CREATE_RECORD_FLAG_CHAINED)
+        {
+          ssm_data->dbid = *ssm_data->storage_id;
+          fpi_ssm_jump_to_state (ssm, CREATE_RECORD_COMMAND);
+          break;
+        }
 
-        exec_command (dev, ssm, data, length);
-        break;
-      }
+      exec_get_user_storage (dev, ssm);
+      break;
 
     case CR_PARSE_USER_STORAGE: {
         FpiByteReader reader;
@@ -1803,6 +2981,8 @@ create_record_ssm (FpiSsm *ssm, FpDevice *dev)
         fpi_byte_reader_get_uint16_le (&reader, &unknwn);
 
         ssm_data->dbid = recid;
+        if (ssm_data->storage_id)
+          *ssm_data->storage_id = recid;
         fpi_ssm_next_state (ssm);
         break;
       }
@@ -1820,27 +3000,46 @@ create_record_ssm (FpiSsm *ssm, FpDevice *dev)
     case CREATE_RECORD_COMMAND:
       {
         FpiByteWriter writer;
-        fpi_byte_writer_init (&writer);
+        command_writer_init (self, &writer);
 
-        fpi_byte_writer_put_uint8 (&writer, 0x47);
-        fpi_byte_writer_put_uint16_le (&writer, ssm_data->parent_id);
-        fpi_byte_writer_put_uint16_le (&writer, ssm_data->type);
-        fpi_byte_writer_put_uint16_le (&writer, ssm_data->dbid);
-        fpi_byte_writer_put_uint16_le (&writer, ssm_data->length);
-        fpi_byte_writer_put_data (&writer, ssm_data->data, ssm_data->length);
+        if (!fpi_byte_writer_ensure_free_space (&writer, 9 + ssm_data->length))
+          {
+            fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
+                                                                "Record of %u bytes is too long",
+                                                                ssm_data->length));
+            break;
+          }
 
-        guint length = fpi_byte_writer_get_size (&writer);
-        guint8 *command = fpi_byte_writer_reset_and_get_data (&writer);
+        fpi_byte_writer_put_uint8_unchecked (&writer, 0x47);
+        fpi_byte_writer_put_uint16_le_unchecked (&writer, ssm_data->parent_id);
+        fpi_byte_writer_put_uint16_le_unchecked (&writer, ssm_data->type);
+        fpi_byte_writer_put_uint16_le_unchecked (&writer, ssm_data->dbid);
+        fpi_byte_writer_put_uint16_le_unchecked (&writer, ssm_data->length);
+        fpi_byte_writer_put_data_unchecked (&writer, ssm_data->data, ssm_data->length);
 
-        exec_command (dev, ssm, command, length);
+        exec_written_command (dev, ssm, &writer);
         break;
       }
 
     case GET_RECORD_ID:
       {
+        guint16 status = self->buffer[0] + (self->buffer[1] << 8u);
         guint16 id = self->buffer[2] + (self->buffer[3] << 8u);
+
+        if ((ssm_data->flags & CREATE_RECORD_FLAG_CHAINED) && status != 0)
+          {
+            fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                                "Chained record creation failed with status 0x%04x",
+                                                                status));
+            break;
+          }
+
         *ssm_data->record_id = id;
-        fpi_ssm_next_state (ssm);
+
+        if (ssm_data->flags & CREATE_RECORD_FLAG_NO_FLUSH)
+          fpi_ssm_mark_completed (ssm);
+        else
+          fpi_ssm_next_state (ssm);
         break;
       }
 
@@ -1857,24 +3056,86 @@ create_record_ssm (FpiSsm *ssm, FpDevice *dev)
     }
 }
 
+/* Moves @ssm to its next state once the record is created. If the firmware
+ * rejects a chained record, the current state of @ssm is run again, which
+ * creates the record on its own now. */
 static void
-do_create_record (FpDevice *dev, FpiSsm *ssm, guint16 parent_id, guint8 type, guint8 *data, guint length, guint *record_id)
+create_record_callback (FpiSsm *ssm, FpDevice *dev, GError *error)
 {
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+  struct create_record_data_t *ssm_data = fpi_ssm_get_data (ssm);
+  FpiSsm *parent = ssm_data->parent;
+
+  if (error && (ssm_data->flags & CREATE_RECORD_FLAG_CHAINED) &&
+      g_error_matches (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_PROTO))
+    {
+      fp_info ("Firmware does not accept chained records (%s), creating them one by one",
+               error->message);
+      g_error_free (error);
+
+      self->db_chain_unsupported = TRUE;
+      fpi_ssm_jump_to_state (parent, fpi_ssm_get_cur_state (parent));
+      return;
+    }
+
+  if (error)
+    {
+      fpi_ssm_mark_failed (parent, error);
+      return;
+    }
+
+  fpi_ssm_next_state (parent);
+}
+
+static void
+do_create_record (FpDevice *dev, FpiSsm *ssm, guint16 parent_id, guint8 type, guint8 *data, guint length,
+                  guint *record_id, CreateRecordFlags flags, guint16 *storage_id)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+  struct create_record_data_t *ssm_data;
   FpiSsm *subsm;
 
-  struct create_record_data_t *ssm_data = g_new0 (struct create_record_data_t, 1);
+  if (self->db_chain_unsupported)
+    flags = CREATE_RECORD_FLAG_NONE;
 
+  subsm = fpi_ssm_new_with_data (dev, create_record_ssm, CREATE_RECORD_STATES,
+                                 sizeof (struct create_record_data_t));
+  ssm_data = fpi_ssm_get_data (subsm);
   ssm_data->parent_id = parent_id;
   ssm_data->type = type;
   ssm_data->data = data;
   ssm_data->length = length;
   ssm_data->record_id = record_id;
+  ssm_data->flags = flags;
+  ssm_data->storage_id = storage_id;
+  ssm_data->parent = ssm;
 
-  subsm = fpi_ssm_new (dev, create_record_ssm, CREATE_RECORD_STATES);
-  fpi_ssm_set_data (subsm, ssm_data, g_free);
-  fpi_ssm_start_subsm (ssm, subsm);
+  fpi_ssm_start (subsm, create_record_callback);
+}
+
+/* Finds the print stored on the device under the given DB id */
+static FpPrint *
+find_gallery_print (GPtrArray *prints, gint dbid)
+{
+  if (dbid < 0 || !prints)
+    return NULL;
+
+  for (guint i = 0; i < prints->len; i++)
+    {
+      FpPrint *print = g_ptr_array_index (prints, i);
+      g_autoptr(GVariant) fdata = NULL;
+
+      g_object_get (print, "fpi-data", &fdata, NULL);
+
+      if (fdata && g_variant_is_of_type (fdata, G_VARIANT_TYPE_UINT16) &&
+          g_variant_get_uint16 (fdata) == dbid)
+        return print;
+    }
+
+  return NULL;
 }
 
+/* Used for both verify and identify, the device matches against its whole DB */
 static void
 verify_ssm (FpiSsm *ssm, FpDevice *dev)
 {
@@ -1899,7 +3160,7 @@ verify_ssm (FpiSsm *ssm, FpDevice *dev)
       break;
 
     case MATCH_USER_WAIT:
-      await_interrupt (dev, ssm, match_interrupt_cb);
+      await_interrupt (dev, ssm, VFS_INT_TIMEOUT, match_interrupt_cb);
       break;
 
     case MATCH_USER_FINISH:
@@ -1907,33 +3168,46 @@ verify_ssm (FpiSsm *ssm, FpDevice *dev)
         fp_info ("Fingerprint UNKNOWN");
       else
         fp_info ("Fingerprint FOUND = %d", *data);
-      fpi_ssm_jump_to_state (ssm, RESET);
-      break;
-
-    case RESET:
-      exec_command (dev, ssm, RESET_SEQUENCE, G_N_ELEMENTS (RESET_SEQUENCE));
-      break;
 
-    case FINISH:
-      exec_command (dev, ssm, FINISH_SEQUENCE, G_N_ELEMENTS (FINISH_SEQUENCE));
-      break;
+      if (*data >= 0 && fpi_device_get_current_action (dev) == FPI_DEVICE_ACTION_IDENTIFY)
+        {
+          GPtrArray *prints;
 
-    case VERIFY_SUCCESS:
-      if (*data < 0)
-        fpi_ssm_jump_to_state (ssm, VERIFY_FAILED);
-      else
-        exec_command (dev, ssm, LED_GREEN_BLINK, G_N_ELEMENTS (LED_GREEN_BLINK));
-      break;
+          fpi_device_get_identify_data (dev, &prints);
+          if (!find_gallery_print (prints, *data))
+            {
+              fp_info ("Fingerprint %d is not in the gallery", *data);
+              *data = -1;
+            }
+        }
 
-    case VERIFY_SUCCESS_FINISH:
-      fpi_ssm_mark_completed (ssm);
+      fpi_ssm_jump_to_state (ssm, RESET);
       break;
 
-    case VERIFY_FAILED:
-      exec_command (dev, ssm, LED_RED_BLINK, G_N_ELEMENTS (LED_RED_BLINK));
-      break;
+    case RESET:
+      {
+        static const Vfs0097Command found[] = {
+          VFS0097_COMMAND (RESET_SEQUENCE),
+          VFS0097_COMMAND (FINISH_SEQUENCE),
+          VFS0097_COMMAND (LED_GREEN_BLINK),
+        };
+        static const Vfs0097Command not_found[] = {
+          VFS0097_COMMAND (RESET_SEQUENCE),
+          VFS0097_COMMAND (FINISH_SEQUENCE),
+          VFS0097_COMMAND (LED_RED_BLINK),
+        };
+
+        /* The blink replaces whatever LED script was running */
+        self->led_script = NULL;
+
+        if (*data < 0)
+          exec_commands (dev, ssm, not_found, G_N_ELEMENTS (not_found));
+        else
+          exec_commands (dev, ssm, found, G_N_ELEMENTS (found));
+        break;
+      }
 
-    case VERIFY_FAILED_FINISH:
+    case VERIFY_FINISH:
       fpi_ssm_mark_completed (ssm);
       break;
 
@@ -1950,7 +3224,12 @@ struct enroll_ssm_data_t
   guint8  *tinfo;
   guint    tinfo_len;
 
-  GArray  *template;
+  /* The template is kept in the reply that returned it, with the byte in
+   * front of it reused for the 0x6b command header. The buffer has the
+   * size of self->buffer, so the two are swapped instead of copied. */
+  guint8  *template_buffer;
+  guint    template_offset;
+  guint    template_len;
   guint    key;
   guint    progress;
 
@@ -1959,6 +3238,8 @@ struct enroll_ssm_data_t
   guint    user_id;
   guint    fingerprint_id;
   guint    fingerprint_data_id;
+  /* Storage the records are created in, shared along the chain */
+  guint16  storage_id;
 };
 
 static void
@@ -1966,10 +3247,20 @@ enroll_ssm_data_clear (gpointer pointer)
 {
   struct enroll_ssm_data_t *data = pointer;
 
-  g_array_unref (data->template);
+  g_free (data->template_buffer);
   g_free (data);
 }
 
+/* Sends the template that is being built, prefixed by its command */
+static void
+exec_append_template (FpDevice *dev, FpiSsm *ssm, struct enroll_ssm_data_t *data)
+{
+  guint8 *command = data->template_buffer + data->template_offset - 1;
+
+  command[0] = 0x6b;
+  exec_command (dev, ssm, command, data->template_len + 1);
+}
+
 static void
 enroll_ssm (FpiSsm *ssm, FpDevice *dev)
 {
@@ -2008,43 +3299,46 @@ enroll_ssm (FpiSsm *ssm, FpDevice *dev)
       }
 
     case APPEND_TEMPLATE_1_WAIT:
-      await_interrupt (dev, ssm, enroll_interrupt_cb);
+      await_interrupt (dev, ssm, VFS_INT_TIMEOUT, enroll_interrupt_cb);
       break;
 
     case APPEND_TEMPLATE_2:
-      {
-        guint8 *command = g_malloc0 (data->template->len + 1);
-        command[0] = 0x6b;
-        memcpy (command + 1, data->template->data, data->template->len);
-        exec_command (dev, ssm, command, data->template->len + 1);
-        g_free (command);
-        break;
-      }
+      exec_append_template (dev, ssm, data);
+      break;
 
     case APPEND_TEMPLATE_2_WAIT:
-      await_interrupt (dev, ssm, enroll_interrupt_cb);
+      await_interrupt (dev, ssm, VFS_INT_TIMEOUT, enroll_interrupt_cb);
       break;
 
     case APPEND_TEMPLATE_3:
-      {
-        guint8 *command = g_malloc0 (data->template->len + 1);
-        command[0] = 0x6b;
-        memcpy (command + 1, data->template->data, data->template->len);
-        exec_command (dev, ssm, command, data->template->len + 1);
-        g_free (command);
-        break;
-      }
+      exec_append_template (dev, ssm, data);
+      break;
 
     case APPEND_TEMPLATE_3_CALC:
       {
-        guint length = self->buffer[2] + (self->buffer[3] << 8);
+        guint8 *reply;
+        guint length;
+
+        if (self->buffer_length < 0x6c + 4)
+          {
+            fpi_ssm_mark_failed (ssm, fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                                "Template reply is too short"));
+            break;
+          }
+
+        length = self->buffer[2] + (self->buffer[3] << 8);
         if (length != self->buffer_length - 4)
           fp_warn ("Incorrect response length");
 
         data->progress = self->buffer[4 + 0x3c];
 
-        g_array_set_size (data->template, 0);
-        g_array_insert_vals (data->template, 0, self->buffer + 0x6c + 4, self->buffer_length - 0x6c - 4);
+        /* Keep the reply as the template, the next reply goes to the
+         * buffer of the previous template */
+        reply = self->buffer;
+        self->buffer = data->template_buffer;
+        data->template_buffer = reply;
+        data->template_offset = 0x6c + 4;
+        data->template_len = self->buffer_length - 0x6c - 4;
       }
 
     case APPEND_TEMPLATE_4:
@@ -2065,14 +3359,15 @@ enroll_ssm (FpiSsm *ssm, FpDevice *dev)
     case PARSE_TEMPLATE:
       {
         FpiByteWriter writer;
+        const guint8 *template = data->template_buffer + data->template_offset;
 
-        guint ciphertext_size = (guint8) data->template->data[2] + (((guint8) data->template->data[3]) << 8);
+        guint ciphertext_size = template[2] + (template[3] << 8);
         guint template_size = 8 + ciphertext_size + 0x30;
 
         fpi_byte_writer_init (&writer);
         fpi_byte_writer_put_uint16_le (&writer, 1);
         fpi_byte_writer_put_uint16_le (&writer, template_size);
-        fpi_byte_writer_put_data (&writer, (guint8 *) data->template->data, template_size);
+        fpi_byte_writer_put_data (&writer, template, template_size);
 
         guint16 part1_len = fpi_byte_writer_get_size (&writer);
         guint8 *part1 = fpi_byte_writer_reset_and_get_data (&writer);
@@ -2080,7 +3375,7 @@ enroll_ssm (FpiSsm *ssm, FpDevice *dev)
         fpi_byte_writer_init (&writer);
         fpi_byte_writer_put_uint16_le (&writer, 2);
         fpi_byte_writer_put_uint16_le (&writer, 0x20);
-        fpi_byte_writer_put_data (&writer, (guint8 *) data->template->data + data->template->len - 0x20, 0x20);
+        fpi_byte_writer_put_data (&writer, template + data->template_len - 0x20, 0x20);
 
         guint16 part2_len = fpi_byte_writer_get_size (&writer);
         guint8 *part2 = fpi_byte_writer_reset_and_get_data (&writer);
@@ -2113,7 +3408,8 @@ enroll_ssm (FpiSsm *ssm, FpDevice *dev)
       break;
 
     case ADD_FINGERPRINT:
-      do_create_record (dev, ssm, data->user_id, 0xb, data->tinfo, data->tinfo_len, &data->fingerprint_id);
+      do_create_record (dev, ssm, data->user_id, 0xb, data->tinfo, data->tinfo_len, &data->fingerprint_id,
+                        CREATE_RECORD_FLAG_NO_FLUSH, &data->storage_id);
       break;
 
     case ADD_FINGERPRINT_DATA:
@@ -2142,14 +3438,15 @@ enroll_ssm (FpiSsm *ssm, FpDevice *dev)
         guint buffer_length = fpi_byte_writer_get_size (&writer);
         guint8 *buffer = fpi_byte_writer_reset_and_get_data (&writer);
 
-        do_create_record (dev, ssm, data->fingerprint_id, 0x8, buffer, buffer_length, &data->fingerprint_data_id);
+        do_create_record (dev, ssm, data->fingerprint_id, 0x8, buffer, buffer_length, &data->fingerprint_data_id,
+                          CREATE_RECORD_FLAG_CHAINED, &data->storage_id);
         break;
       }
 
     case ENROLL_SUCCESS:
       {
         fp_dbg ("Added FINGERPRINT DATA with id: %d", data->fingerprint_data_id);
-        exec_command (dev, ssm, LED_GREEN_BLINK, G_N_ELEMENTS (LED_GREEN_BLINK));
+        exec_led_command (dev, ssm, LED_GREEN_BLINK, G_N_ELEMENTS (LED_GREEN_BLINK));
         break;
       }
 
@@ -2169,23 +3466,129 @@ enroll_ssm (FpiSsm *ssm, FpDevice *dev)
 static void
 clear_data (FpiDeviceVfs0097 *self)
 {
-  g_clear_pointer (&self->seed, g_free);
   g_clear_pointer (&self->buffer, g_free);
+  g_clear_pointer (&self->send_buffer, g_free);
+  g_clear_pointer (&self->next_send_buffer, g_free);
+  g_clear_pointer (&self->discard_buffer, g_free);
+  g_clear_pointer (&self->cipher_ctx, EVP_CIPHER_CTX_free);
+  g_clear_pointer (&self->hmac_ctx, HMAC_CTX_free);
   g_clear_pointer (&self->certificate, g_free);
+  g_clear_pointer (&self->handshake_record, g_free);
   g_clear_pointer (&self->session_id, g_free);
+  g_clear_pointer (&self->users_db, g_array_unref);
+  g_clear_pointer (&self->users_db_pending, g_array_unref);
   g_clear_pointer (&self->private_key, EC_KEY_free);
   g_clear_pointer (&self->ecdh_q, EC_KEY_free);
-  g_clear_object (&self->interrupt_cancellable);
+  g_clear_pointer (&self->interrupt_transfer, fpi_usb_transfer_unref);
+  interrupt_queue_clear (self);
+  g_clear_pointer (&self->flash_identity, g_checksum_free);
+}
+
+static void dev_open_callback (FpiSsm   *ssm,
+                               FpDevice *dev,
+                               GError   *error);
+
+/* Resets the device and runs the full initialization */
+static void
+dev_open_reset (FpDevice *dev)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+  GUsbDevice *usb_dev = fpi_device_get_usb_device (dev);
+  GError *error = NULL;
+
+  self->tls = FALSE;
+  self->led_script = NULL;
+  self->probing = FALSE;
+  self->usb_timeout = VFS_USB_TIMEOUT;
+
+  /* The interface cannot stay claimed while the device is reset */
+  if (!g_usb_device_release_interface (usb_dev, 0, 0, &error))
+    {
+      fpi_device_open_complete (dev, error);
+      return;
+    }
+
+  if (!g_usb_device_reset (usb_dev, &error))
+    {
+      /* The sensor re-enumerated and shows up as a new device */
+      if (g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_NO_DEVICE))
+        {
+          tls_cache_forget (self);
+          g_prefix_error (&error, "Device disappeared on reset: ");
+        }
+
+      fpi_device_open_complete (dev, error);
+      return;
+    }
+
+  if (!g_usb_device_claim_interface (usb_dev, 0, 0, &error))
+    {
+      fpi_device_open_complete (dev, error);
+      return;
+    }
+
+  FpiSsm *init = fpi_ssm_new (dev, init_ssm, INIT_SM_STATES);
+  fpi_ssm_start (init, dev_open_callback);
 }
 
 /* Callback for device initialization SSM */
 static void
 dev_open_callback (FpiSsm *ssm, FpDevice *dev, GError *error)
 {
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+
+  if (error && self->probing)
+    {
+      fp_dbg ("Sensor did not answer without a reset (%s), resetting it", error->message);
+      g_error_free (error);
+
+      dev_open_reset (dev);
+      return;
+    }
+
+  if (error && self->flash_from_disk)
+    {
+      /* The sensor may have been paired again, read the flash this time */
+      fp_info ("Initialization with cached TLS data failed (%s), reading it from flash",
+               error->message);
+      g_error_free (error);
+
+      flash_cache_remove (self);
+      tls_cache_drop_flash (self);
+      tls_cache_drop_session (self);
+      g_clear_pointer (&self->certificate, g_free);
+      g_clear_pointer (&self->private_key, EC_KEY_free);
+      g_clear_pointer (&self->ecdh_q, EC_KEY_free);
+      self->flash_from_disk = FALSE;
+      self->flash_disk_cache_disabled = TRUE;
+
+      dev_open_reset (dev);
+      return;
+    }
+
   /* Notify open complete */
   fpi_device_open_complete (dev, error);
 }
 
+/* Callback for TLS session resumption SSM, falls back to a full init */
+static void
+dev_open_resume_callback (FpiSsm *ssm, FpDevice *dev, GError *error)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+
+  if (!error)
+    {
+      fpi_device_open_complete (dev, NULL);
+      return;
+    }
+
+  fp_info ("Could not resume TLS session (%s), doing full initialization", error->message);
+  g_error_free (error);
+
+  tls_cache_drop_session (self);
+  dev_open_reset (dev);
+}
+
 /* Open device */
 static void
 dev_open (FpDevice *device)
@@ -2195,28 +3598,20 @@ dev_open (FpDevice *device)
 
   GUsbDevice *usb_dev;
   gint config;
+  gboolean resume;
 
   self->tls = FALSE;
-
-  self->seed_length = G_N_ELEMENTS (VIRTUAL_BOX_SEED);
-  self->seed = g_malloc0 (G_N_ELEMENTS (VIRTUAL_BOX_SEED));
-  memcpy (self->seed, VIRTUAL_BOX_SEED, G_N_ELEMENTS (VIRTUAL_BOX_SEED));
-
-  if (!self->seed)
-    {
-      error = fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
-                                        "Seed value is not initialized");
-      fpi_device_open_complete (FP_DEVICE (self), error);
-      return;
-    }
-
-  /* Claim usb interface */
+  self->led_script = NULL;
+  self->probing = FALSE;
+  self->usb_timeout = VFS_USB_TIMEOUT;
+  self->flash_from_disk = FALSE;
+  self->flash_disk_cache_disabled = FALSE;
+
+  /* Claim usb interface. The device is not reset up front, a cached TLS
+   * session is resumed, otherwise the initialization first checks whether
+   * the sensor answers as it is and only resets it if it does not. */
   usb_dev = fpi_device_get_usb_device (device);
-  if (!g_usb_device_reset (usb_dev, &error))
-    {
-      fpi_device_open_complete (FP_DEVICE (self), error);
-      return;
-    }
+  resume = tls_cache_has_session (self);
 
   config = g_usb_device_get_configuration (usb_dev, &error);
   if (config < 0)
@@ -2236,8 +3631,20 @@ dev_open (FpDevice *device)
     }
 
   self->buffer = g_malloc0 (VFS_USB_BUFFER_SIZE);
+  self->send_buffer = g_malloc0 (VFS_USB_BUFFER_SIZE);
+  self->next_send_buffer = g_malloc0 (VFS_USB_BUFFER_SIZE);
+  self->cipher_ctx = EVP_CIPHER_CTX_new ();
+  self->hmac_ctx = HMAC_CTX_new ();
+
+  if (resume)
+    {
+      FpiSsm *ssm = fpi_ssm_new (FP_DEVICE (self), tls_resume_ssm, TLS_RESUME_STATES);
+      fpi_ssm_start (ssm, dev_open_resume_callback);
+      return;
+    }
 
-  self->interrupt_cancellable = g_cancellable_new ();
+  self->probing = TRUE;
+  self->usb_timeout = VFS_USB_PROBE_TIMEOUT;
 
   FpiSsm *ssm = fpi_ssm_new (FP_DEVICE (self), init_ssm, INIT_SM_STATES);
   fpi_ssm_start (ssm, dev_open_callback);
@@ -2245,7 +3652,7 @@ dev_open (FpDevice *device)
 
 /* Close device */
 static void
-dev_close (FpDevice *device)
+dev_close_finish (FpDevice *device, gpointer user_data)
 {
   FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (device);
   GError *error = NULL;
@@ -2256,19 +3663,86 @@ dev_close (FpDevice *device)
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (self)),
                                   0, 0, &error);
 
+  /* The sensor may be gone or in an unknown state */
+  if (error)
+    tls_cache_forget (self);
+
   /* Notify close complete */
   fpi_device_close_complete (FP_DEVICE (self), error);
 }
 
+static void
+dev_close (FpDevice *device)
+{
+  /* Wait for the interrupt listener and any other transfer to return
+   * before releasing the interface */
+  fpi_usb_transfer_abort_all (device, dev_close_finish, NULL);
+}
+
+/* Suspend device, keeps the TLS session for a fast resume */
+static void
+dev_suspend (FpDevice *device)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (device);
+
+  if (self->tls)
+    tls_cache_store_session (self);
+
+  fpi_device_suspend_complete (device, NULL);
+}
+
+/* Callback for TLS session resumption after suspend. On failure the core
+ * closes and opens the device again, which then runs the full init. */
+static void
+dev_resume_callback (FpiSsm *ssm, FpDevice *dev, GError *error)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+
+  if (error)
+    {
+      fp_info ("Could not resume TLS session after suspend (%s)", error->message);
+      self->tls = FALSE;
+      tls_cache_drop_session (self);
+    }
+
+  fpi_device_resume_complete (dev, error);
+}
+
+/* Resume device */
+static void
+dev_resume (FpDevice *device)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (device);
+  FpiSsm *ssm;
+
+  self->usb_timeout = VFS_USB_TIMEOUT;
+
+  ssm = fpi_ssm_new (device, tls_resume_ssm, TLS_RESUME_STATES);
+  fpi_ssm_start (ssm, dev_resume_callback);
+}
+
 /* List prints */
 static void
 dev_list_callback (FpiSsm *ssm, FpDevice *dev, GError *error)
 {
   FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (dev);
+  g_autoptr(GArray) db = g_steal_pointer (&self->users_db_pending);
+
+  if (error)
+    {
+      fpi_device_list_complete (dev, NULL, error);
+      return;
+    }
 
-  fpi_device_list_complete (FP_DEVICE (self),
-                            g_steal_pointer (&self->list_result),
-                            error);
+  /* No DB is left if listing was stopped early */
+  if (db)
+    {
+      g_clear_pointer (&self->users_db, g_array_unref);
+      self->users_db = g_array_ref (db);
+    }
+
+  /* The prints were reported while reading the DB */
+  fpi_device_list_complete (dev, NULL, NULL);
 }
 
 static void
@@ -2276,7 +3750,15 @@ dev_list (FpDevice *device)
 {
   FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (device);
 
-  self->list_result = g_ptr_array_new_with_free_func (g_object_unref);
+  if (self->users_db)
+    {
+      fp_dbg ("Listing %u prints from users DB snapshot", self->users_db->len);
+      fpi_device_list_complete (device, users_db_to_prints (device, self->users_db), NULL);
+      return;
+    }
+
+  g_clear_pointer (&self->users_db_pending, g_array_unref);
+  self->users_db_pending = users_db_new ();
 
   FpiSsm *ssm = fpi_ssm_new (FP_DEVICE (self), get_users_db_ssm, GET_USERS_DB_STATES);
   fpi_ssm_start (ssm, dev_list_callback);
@@ -2293,6 +3775,9 @@ dev_enroll_callback (FpiSsm *ssm, FpDevice *dev, GError *error)
 //  fpi_device_get_enroll_data (device, &print);
 //  fpi_device_enroll_complete (device, g_object_ref (print), NULL);
 
+  /* Even a failed enroll may have left records behind */
+  users_db_invalidate (self);
+
   fpi_device_enroll_complete (FP_DEVICE (self), g_object_ref (ssm_data->print), NULL);
 }
 
@@ -2307,7 +3792,8 @@ dev_enroll (FpDevice *device)
   FpiSsm *ssm = fpi_ssm_new (FP_DEVICE (self), enroll_ssm, FINGERPRINT_ENROLL_STATES);
 
   struct enroll_ssm_data_t *data = g_new0 (struct enroll_ssm_data_t, 1);
-  data->template = g_array_new (FALSE, TRUE, sizeof (guint8));
+  data->template_buffer = g_malloc0 (VFS_USB_BUFFER_SIZE);
+  data->template_offset = 1;
   data->print = print;
 
   fpi_ssm_set_data (ssm, data, enroll_ssm_data_clear);
@@ -2322,6 +3808,8 @@ dev_delete (FpDevice *device)
 
   G_DEBUG_HERE ();
 
+  users_db_invalidate (self);
+
   fpi_device_delete_complete (FP_DEVICE (self), NULL);
 }
 
@@ -2351,91 +3839,98 @@ dev_verify (FpDevice *device)
   fpi_ssm_start (ssm, dev_verify_callback);
 }
 
-/* Cancel current action */
+/* Identify print */
 static void
-dev_cancel (FpDevice *device)
+dev_identify_callback (FpiSsm *ssm, FpDevice *dev, GError *error)
+{
+  gint *data = fpi_ssm_get_data (ssm);
+  GPtrArray *prints;
+
+  if (error)
+    {
+      fpi_device_identify_complete (dev, error);
+      return;
+    }
+
+  fpi_device_get_identify_data (dev, &prints);
+
+  fpi_device_identify_report (dev, find_gallery_print (prints, *data), NULL, NULL);
+  fpi_device_identify_complete (dev, NULL);
+}
+
+static void
+dev_identify (FpDevice *device)
 {
   FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (device);
 
-  // TODO: Send RESET and FINISH sequence?
+  gint *data = g_new0 (gint, 1);
 
-  /* Cancel any current interrupt transfer (resulting us to go into
-   * response reading mode again); then create a new cancellable
-   * for the next transfers. */
-  g_cancellable_cancel (self->interrupt_cancellable);
-  g_clear_object (&self->interrupt_cancellable);
-  self->interrupt_cancellable = g_cancellable_new ();
+  FpiSsm *ssm = fpi_ssm_new (FP_DEVICE (self), verify_ssm, FINGERPRINT_VERIFY_STATES);
+  fpi_ssm_set_data (ssm, data, g_free);
+  fpi_ssm_start (ssm, dev_identify_callback);
 }
 
-static gchar *
-read_dmi (const char *filename)
+/* Cancel current action */
+static void
+dev_cancel (FpDevice *device)
 {
-  FILE *file;
-  gsize length;
-  gchar buffer[1024];
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (device);
 
-  if (!(file = fopen (filename, "r")))
-    {
-      g_warning ("Could not open DMI node: %s", filename);
-      goto exit;
-    }
+  // TODO: Send RESET and FINISH sequence?
 
-  fgets (buffer, G_N_ELEMENTS (buffer), file);
-  if ((length = strlen (buffer)) == 0)
-    {
-      g_warning ("Could not read DMI node value: %s", filename);
-      goto exit;
-    }
-  buffer[length - 1] = 0; // Remove newline
+  /* The LED command may not have reached the device */
+  self->led_script = NULL;
 
-exit:
-  if (file)
-    fclose (file);
-  return g_strdup (buffer);
+  /* Stop waiting for an interrupt (resulting us to go into response
+   * reading mode again), the listener itself keeps running. */
+  if (self->interrupt_ssm)
+    interrupt_wait_complete (self, NULL,
+                             g_error_new (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                          "Waiting for an interrupt was cancelled"));
 }
 
 static void
 fpi_device_vfs0097_init (FpiDeviceVfs0097 *self)
 {
-//  g_assert (FALSE);
-  self->seed_length = G_N_ELEMENTS (VIRTUAL_BOX_SEED);
-  self->seed = g_malloc0 (G_N_ELEMENTS (VIRTUAL_BOX_SEED));
-  memcpy (self->seed, VIRTUAL_BOX_SEED, G_N_ELEMENTS (VIRTUAL_BOX_SEED));
+}
 
-// TODO: Device is initialized via VirtualBox, so real HW id is not useful for now
+static void
+fpi_device_vfs0097_finalize (GObject *object)
+{
+  FpiDeviceVfs0097 *self = FPI_DEVICE_VFS0097 (object);
 
-//  gchar *name, *serial;
-//  name = read_dmi (DMI_PRODUCT_NAME_NODE);
-//  serial = read_dmi (DMI_PRODUCT_SERIAL_NODE);
-//
-//  self->seed = g_malloc0 (strlen (name) + strlen (serial) + 2);
-//
-//  strcpy ((gchar *) self->seed, name);
-//  strcpy ((gchar *) self->seed + strlen (name) + 1, serial);
-//
-//  g_free (name);
-//  g_free (serial);
+  /* The device object is gone once the sensor was unplugged */
+  tls_cache_forget (self);
+  g_clear_pointer (&self->tls_identity, g_free);
 
-  g_debug ("Initialized seed value: %s", self->seed);
+  G_OBJECT_CLASS (fpi_device_vfs0097_parent_class)->finalize (object);
 }
 
 static void
 fpi_device_vfs0097_class_init (FpiDeviceVfs0097Class *klass)
 {
   FpDeviceClass *dev_class = FP_DEVICE_CLASS (klass);
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = fpi_device_vfs0097_finalize;
 
   dev_class->id = "vfs0097";
   dev_class->full_name = "Validity VFS0097";
   dev_class->type = FP_DEVICE_TYPE_USB;
   dev_class->scan_type = FP_SCAN_TYPE_PRESS;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_vfs0097_id_table;
   dev_class->nr_enroll_stages = 10;
 
   dev_class->open = dev_open;
   dev_class->close = dev_close;
+  dev_class->suspend = dev_suspend;
+  dev_class->resume = dev_resume;
   dev_class->enroll = dev_enroll;
   dev_class->delete = dev_delete;
+  /* Deleting only drops the cached user database, once is enough */
+  dev_class->delete_prints = dev_delete;
   dev_class->verify = dev_verify;
+  dev_class->identify = dev_identify;
   dev_class->cancel = dev_cancel;
   dev_class->list = dev_list;
 }
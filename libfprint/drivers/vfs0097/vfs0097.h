@@ -28,15 +28,56 @@
 
 /* Timeout for all send/recv operations, except interrupt waiting and abort */
 #define VFS_USB_TIMEOUT 500
+/* Lower bound of the send timeout once it adapts to the round-trip times
+ * of the sensor */
+#define VFS_USB_MIN_TIMEOUT 100
+/* Timeout for send/recv while checking whether the sensor answers without
+ * a reset */
+#define VFS_USB_PROBE_TIMEOUT 100
 /* Timeout for interrupt waiting and abort */
 #define VFS_INT_TIMEOUT 10000
 /* Timeout for usb abort */
 #define VFS_USB_ABORT_TIMEOUT 20
+/* Size of an interrupt transfer */
+#define USB_INTERRUPT_DATA_SIZE 10
+/* Number of interrupts kept while no SSM waits for one */
+#define VFS_INTERRUPT_QUEUE_SIZE 8
+/* An LED script is sent again if it ends within this many ms */
+#define VFS_LED_REFRESH_MARGIN 1000
 /* Default timeout for SSM timers */
 #define VFS_SSM_TIMEOUT 100
 /* Buffer size for abort and fprint receiving */
 #define VFS_USB_BUFFER_SIZE 65536
 
+/* An interrupt received from the sensor */
+typedef struct
+{
+  guint8 data[USB_INTERRUPT_DATA_SIZE];
+  gsize  length;
+} Vfs0097Interrupt;
+
+typedef void (*Vfs0097InterruptCallback) (FpDevice               *dev,
+                                          FpiSsm                 *ssm,
+                                          const Vfs0097Interrupt *interrupt,
+                                          GError                 *error);
+
+/* A finger stored in the on-chip users DB */
+typedef struct
+{
+  gchar  *username;
+  guint16 subtype;
+  guint16 id;
+} Vfs0097DbFinger;
+
+/* A command of a sequence sent with exec_commands () */
+typedef struct
+{
+  const guint8 *data;
+  guint         length;
+} Vfs0097Command;
+
+#define VFS0097_COMMAND(cmd) { (cmd), G_N_ELEMENTS (cmd) }
+
 /* The main driver structure */
 struct _FpiDeviceVfs0097
 {
@@ -45,6 +86,20 @@ struct _FpiDeviceVfs0097
   guint8       *buffer;
   guint         buffer_length;
 
+  /* Commands are assembled and encrypted in place in here */
+  guint8       *send_buffer;
+  guint         send_length;
+
+  /* The next command of a sequence is prepared in here during a read */
+  guint8       *next_send_buffer;
+  guint         next_send_length;
+
+  /* Target of reads whose data is discarded, allocated on first use */
+  guint8       *discard_buffer;
+
+  EVP_CIPHER_CTX *cipher_ctx;
+  HMAC_CTX     *hmac_ctx;
+
   EC_KEY       *private_key;
   EC_KEY       *ecdh_q;
   EC_KEY       *session_key;
@@ -52,6 +107,10 @@ struct _FpiDeviceVfs0097
   gsize         certificate_length;
 
   SHA256_CTX    handshake_hash;
+  /* The client's certificate, key exchange, verify and finished
+   * messages, prepared on a worker thread */
+  guint8       *handshake_record;
+  guint         handshake_record_length;
 
   guint8        client_random[0x20];
   guint8        server_random[0x20];
@@ -66,13 +125,46 @@ struct _FpiDeviceVfs0097
   guint8        decryption_key[0x20];
 
   gboolean      tls;
-
-  guint8       *seed;
-  gsize         seed_length;
-
-  GCancellable *interrupt_cancellable;
-
-  GPtrArray    *list_result;
+  /* The LED script last sent and when it ends (monotonic time) */
+  const guint8 *led_script;
+  gint64        led_script_end;
+  /* Whether the sensor was opened without a reset and has not answered yet */
+  gboolean      probing;
+  guint         usb_timeout;
+  /* Whether the last received TLS record passed validation */
+  gboolean      tls_record_valid;
+
+  /* Hash of the sensor replies that the TLS data cached on disk is stored
+   * under, and whether this open uses that data */
+  GChecksum    *flash_identity;
+  /* The same hash once it is complete, which the TLS data cache of this
+   * sensor is stored under, and the hash of the INIT_SEQUENCE_MSG1 reply
+   * that a resumed session is checked against. Both outlive a close. */
+  gchar        *tls_identity;
+  guint8        msg1_hash[SHA256_DIGEST_LENGTH];
+  gboolean      flash_from_disk;
+  gboolean      flash_disk_cache_disabled;
+
+  /* Once an SSM waited for an interrupt, the interrupt endpoint is listened
+   * to until the device is closed. Interrupts that arrive while nobody
+   * waits are queued for the next await_interrupt(). */
+  FpiUsbTransfer *interrupt_transfer;
+  gboolean      interrupt_listening;
+  Vfs0097Interrupt interrupt_queue[VFS_INTERRUPT_QUEUE_SIZE];
+  guint         interrupt_queue_head;
+  guint         interrupt_queue_length;
+  FpiSsm       *interrupt_ssm;
+  Vfs0097InterruptCallback interrupt_callback;
+  GSource      *interrupt_timeout;
+
+  /* Snapshot of the users DB (of Vfs0097DbFinger), NULL if it needs to be
+   * read from the device again. users_db_pending is filled while reading. */
+  GArray       *users_db;
+  GArray       *users_db_pending;
+
+  /* Whether the firmware rejected a record created without looking up the
+   * storage and enabling DB writes again */
+  gboolean      db_chain_unsupported;
 };
 
 G_DECLARE_FINAL_TYPE (FpiDeviceVfs0097, fpi_device_vfs0097, FPI, DEVICE_VFS0097, FpDevice)
@@ -87,6 +179,15 @@ enum EXEC_COMMAND_SM {
   EXEC_COMMAND_SM_STATES,
 };
 
+/* SSM states for exec_commands */
+enum EXEC_COMMANDS_SM {
+  EXEC_COMMANDS_SM_WRITE,
+  EXEC_COMMANDS_SM_READ,
+  EXEC_COMMANDS_SM_DECRYPT,
+
+  EXEC_COMMANDS_SM_STATES,
+};
+
 /* SSM states for open */
 enum INIT_SM {
   SEND_INIT_1,
@@ -98,17 +199,27 @@ enum INIT_SM {
   READ_FLASH_TLS_DATA,
 
   INIT_KEYS,
+  STORE_KEYS,
   HANDSHAKE,
 
   INIT_SM_STATES,
 };
 
+/* SSM states for resuming a cached TLS session on open */
+enum TLS_RESUME_SM {
+  TLS_RESUME_SM_PROBE,
+  TLS_RESUME_SM_CHECK,
+
+  TLS_RESUME_STATES
+};
+
 /* SSM states for TLS handshake */
 enum TLS_HANDSHAKE_SM {
   TLS_HANDSHAKE_SM_INIT,
   TLS_HANDSHAKE_SM_CLIENT_HELLO,
   TLS_HANDSHAKE_SM_SERVER_HELLO,
   TLS_HANDSHAKE_SM_MAKE_KEYS,
+  TLS_HANDSHAKE_SM_CLIENT_KEX_VERIFY,
   TLS_HANDSHAKE_SM_CLIENT_FINISHED,
   TLS_HANDSHAKE_SM_SERVER_FINISHED,
 
@@ -152,14 +263,8 @@ enum FINGERPRINT_VERIFY_SM {
   MATCH_USER_WAIT,
   MATCH_USER_FINISH,
 
-  RESET,
-  FINISH,
-
-  VERIFY_SUCCESS,            // LED_GREEN_BLINK
-  VERIFY_SUCCESS_FINISH,
-
-  VERIFY_FAILED,             // LED_RED_BLINK
-  VERIFY_FAILED_FINISH,
+  RESET,                     // RESET, FINISH and the result LED
+  VERIFY_FINISH,
 
   FINGERPRINT_VERIFY_STATES
 };
@@ -935,8 +1040,6 @@ static const unsigned char FINISH_SEQUENCE[] = { 0x62, 0x00, 0x00, 0x00, 0x00 };
 
 /* Known interrupts */
 
-#define USB_INTERRUPT_DATA_SIZE 10
-
 static const unsigned char INTERRUPT_WAITING_FINGER[] = { 0x00, 0x00, 0x00, 0x00, 0x00 };
 static const unsigned char INTERRUPT_FINGER_DOWN[] = { 0x02, 0x00, 0x40, 0x10, 0x00 };
 static const unsigned char INTERRUPT_SCANNING_FINGERPRINT[] = { 0x03, 0x40, 0x01, 0x00, 0x00 };
@@ -19,6 +19,9 @@
 
 #define FP_COMPONENT "vfs101"
 
+#include <errno.h>
+#include <glib/gstdio.h>
+
 #include "drivers_api.h"
 
 /* Input-Output usb endpoint */
@@ -58,6 +61,13 @@
 /* Best image contrast */
 #define VFS_IMG_BEST_CONTRAST 128
 
+/* Contrast the sweep starts from */
+#define VFS_IMG_START_CONTRAST 15
+
+/* Maximum change of the contrast level before the tuned contrast is
+ * swept again */
+#define VFS_IMG_CONTRAST_DRIFT 16
+
 /* Device parameters address */
 #define VFS_PAR_000E 0x000e
 #define VFS_PAR_0011 0x0011
@@ -117,6 +127,13 @@ struct _FpDeviceVfs101
   /* Best contrast level */
   int best_clevel;
 
+  /* Contrast and level found by the last sweep, 0 if unknown */
+  int tuned_contrast;
+  int tuned_clevel;
+
+  /* Checking the tuned contrast instead of sweeping */
+  gboolean check_tuned;
+
   /* Bottom line of image */
   int bottom;
 
@@ -538,7 +555,7 @@ vfs_img_load (FpiSsm        *ssm,
 static void
 img_screen (FpDeviceVfs101 *vdev)
 {
-  int y, x, count, top;
+  int y, count, top;
   long int level;
   int last_line = vdev->height - 1;
 
@@ -608,9 +625,8 @@ img_screen (FpDeviceVfs101 *vdev)
 
   /* Scan image and remove noise */
   for (y = vdev->bottom; y <= top; y++)
-    for (x = 6; x < VFS_IMG_WIDTH + 6; x++)
-      if (vdev->buffer[offset (x, y)] > VFS_IMG_MIN_IMAGE_LEVEL)
-        vdev->buffer[offset (x, y)] = 255;
+    fpi_saturate_above (&vdev->buffer[offset (6, y)], VFS_IMG_WIDTH,
+                        VFS_IMG_MIN_IMAGE_LEVEL);
 };
 
 /* Copy image from reader buffer and put it into image data */
@@ -730,6 +746,104 @@ vfs_check_contrast (FpDeviceVfs101 *vdev)
     }
 }
 
+/* Contrast cache on disk
+ *
+ * The best contrast only changes slowly with the sensor and its
+ * surroundings, but sweeping for it takes up to a dozen image loads. It is
+ * kept across activations and stored in the user's cache directory, named
+ * after a hash of the USB ID and port. The next activation only checks
+ * that the level at the stored contrast did not drift. */
+
+#define CONTRAST_CACHE_GROUP "contrast"
+
+static gchar *
+contrast_cache_get_path (FpDeviceVfs101 *self)
+{
+  GUsbDevice *usb_dev = fpi_device_get_usb_device (FP_DEVICE (self));
+  g_autofree gchar *key = NULL;
+  g_autofree gchar *name = NULL;
+
+  if (!g_usb_device_get_platform_id (usb_dev))
+    return NULL;
+
+  key = g_strdup_printf ("%04x:%04x:%s",
+                         g_usb_device_get_vid (usb_dev),
+                         g_usb_device_get_pid (usb_dev),
+                         g_usb_device_get_platform_id (usb_dev));
+  name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+
+  return g_build_filename (g_get_user_cache_dir (), "libfprint", "vfs101", name, NULL);
+}
+
+static void
+contrast_cache_load (FpDeviceVfs101 *self)
+{
+  g_autofree gchar *path = contrast_cache_get_path (self);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(GError) error = NULL;
+  gint contrast, level;
+
+  if (!path || !g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, &error))
+    {
+      if (error && !g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        fp_dbg ("Could not read cached contrast: %s", error->message);
+      return;
+    }
+
+  contrast = g_key_file_get_integer (keyfile, CONTRAST_CACHE_GROUP, "value", NULL);
+  level = g_key_file_get_integer (keyfile, CONTRAST_CACHE_GROUP, "level", NULL);
+  if (contrast < 1 || contrast > VFS_IMG_START_CONTRAST || level < 16)
+    {
+      fp_warn ("Ignoring invalid cached contrast in %s", path);
+      g_unlink (path);
+      return;
+    }
+
+  self->tuned_contrast = contrast;
+  self->tuned_clevel = level;
+}
+
+static void
+contrast_cache_store (FpDeviceVfs101 *self)
+{
+  g_autofree gchar *path = contrast_cache_get_path (self);
+  g_autofree gchar *dir = NULL;
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(GError) error = NULL;
+
+  if (!path)
+    return;
+
+  dir = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dir, 0700) < 0)
+    {
+      fp_dbg ("Could not create %s: %s", dir, g_strerror (errno));
+      return;
+    }
+
+  g_key_file_set_integer (keyfile, CONTRAST_CACHE_GROUP, "value", self->tuned_contrast);
+  g_key_file_set_integer (keyfile, CONTRAST_CACHE_GROUP, "level", self->tuned_clevel);
+
+  if (!g_key_file_save_to_file (keyfile, path, &error))
+    fp_dbg ("Could not cache contrast: %s", error->message);
+}
+
+/* Keeps the result of a finished sweep */
+static void
+vfs_tune_contrast (FpDeviceVfs101 *self)
+{
+  if (self->best_clevel < 0)
+    return;
+
+  if (self->best_contrast == self->tuned_contrast &&
+      self->best_clevel == self->tuned_clevel)
+    return;
+
+  self->tuned_contrast = self->best_contrast;
+  self->tuned_clevel = self->best_clevel;
+  contrast_cache_store (self);
+}
+
 /* Loop ssm states */
 enum {
   /* Step 0 - Scan finger */
@@ -784,8 +898,10 @@ m_loop_state (FpiSsm *ssm, FpDevice *_dev)
       break;
 
     case M_LOOP_0_SLEEP:
-      /* Wait fingerprint scanning */
-      fpi_ssm_next_state_delayed (ssm, 50, NULL);
+      /* Wait fingerprint scanning, less often while the sensor is idle */
+      fpi_ssm_next_state_delayed (ssm,
+                                  fpi_image_device_get_poll_delay (dev, 50, FALSE),
+                                  NULL);
       break;
 
     case M_LOOP_0_GET_STATE:
@@ -1196,9 +1312,32 @@ m_init_state (FpiSsm *ssm, FpDevice *_dev)
       /* Check contrast */
       vfs_check_contrast (self);
 
-      if (self->contrast <= 6 || self->counter >= 12)
+      if (self->check_tuned)
+        {
+          self->check_tuned = FALSE;
+
+          if (self->best_clevel >= 0 &&
+              abs (self->best_clevel - self->tuned_clevel) <= VFS_IMG_CONTRAST_DRIFT)
+            {
+              /* Tuned contrast still good, skip the scan */
+              self->contrast = self->best_contrast;
+              self->counter = 0;
+              fp_dbg ("use tuned contrast value = %d", self->contrast);
+              fpi_ssm_next_state (ssm);
+              break;
+            }
+
+          /* Level drifted, scan again from the start */
+          fp_dbg ("contrast level drifted from %d, scanning", self->tuned_clevel);
+          self->contrast = VFS_IMG_START_CONTRAST;
+          self->best_clevel = -1;
+          self->counter = 1;
+          fpi_ssm_jump_to_state (ssm, M_INIT_4_SET_CONTRAST);
+        }
+      else if (self->contrast <= 6 || self->counter >= 12)
         {
           /* End contrast scan, continue */
+          vfs_tune_contrast (self);
           self->contrast = self->best_contrast;
           self->counter = 0;
           fp_dbg ("use contrast value = %d", self->contrast);
@@ -1270,9 +1409,12 @@ dev_activate (FpImageDevice *dev)
   self->active = TRUE;
   self->deactivate = FALSE;
 
-  /* Set contrast */
-  self->contrast = 15;
+  /* Set contrast, only check the tuned one if known */
+  self->contrast = VFS_IMG_START_CONTRAST;
   self->best_clevel = -1;
+  self->check_tuned = self->tuned_contrast > 0;
+  if (self->check_tuned)
+    self->contrast = self->tuned_contrast;
 
   /* Reset loop counter */
   self->counter = 0;
@@ -1314,6 +1456,10 @@ dev_open (FpImageDevice *dev)
   self->seqnum = -1;
   self->buffer = g_malloc0 (VFS_BUFFER_SIZE);
 
+  /* Start from the contrast of an earlier session */
+  if (self->tuned_contrast == 0)
+    contrast_cache_load (self);
+
   /* Notify open complete */
   fpi_image_device_open_complete (dev, error);
 }
@@ -1336,7 +1482,7 @@ dev_close (FpImageDevice *dev)
 }
 
 /* Usb id table of device */
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_vfs101_id_table[] = {
   { .vid = 0x138a,  .pid = 0x0001, },
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
 };
@@ -1355,7 +1501,7 @@ fpi_device_vfs101_class_init (FpDeviceVfs101Class *klass)
   dev_class->id = "vfs101";
   dev_class->full_name = "Validity VFS101";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_vfs101_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->img_open = dev_open;
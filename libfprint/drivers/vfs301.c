@@ -71,10 +71,9 @@ enum {
   /* Step 0 - Scan finger */
   M_REQUEST_PRINT,
   M_WAIT_PRINT,
+  M_PEEK_EVENT,
   M_CHECK_PRINT,
-  M_READ_PRINT_START,
-  M_READ_PRINT_WAIT,
-  M_READ_PRINT_POLL,
+  M_READ_PRINT,
   M_SUBMIT_PRINT,
 
   /* Number of states */
@@ -91,8 +90,7 @@ m_loop_state (FpiSsm *ssm, FpDevice *_dev)
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case M_REQUEST_PRINT:
-      vfs301_proto_request_fingerprint (self);
-      fpi_ssm_next_state (ssm);
+      vfs301_proto_request_fingerprint (self, ssm);
       break;
 
     case M_WAIT_PRINT:
@@ -100,33 +98,20 @@ m_loop_state (FpiSsm *ssm, FpDevice *_dev)
       fpi_ssm_next_state_delayed (ssm, 200, NULL);
       break;
 
+    case M_PEEK_EVENT:
+      vfs301_proto_peek_event (self, ssm);
+      break;
+
     case M_CHECK_PRINT:
-      if (!vfs301_proto_peek_event (self))
+      if (!self->finger_event)
         fpi_ssm_jump_to_state (ssm, M_WAIT_PRINT);
       else
         fpi_ssm_next_state (ssm);
       break;
 
-    case M_READ_PRINT_START:
+    case M_READ_PRINT:
       fpi_image_device_report_finger_status (dev, TRUE);
-      vfs301_proto_process_event_start (self);
-      fpi_ssm_next_state (ssm);
-      break;
-
-    case M_READ_PRINT_WAIT:
-      /* Wait fingerprint scanning */
-      fpi_ssm_next_state_delayed (ssm, 200, NULL);
-      break;
-
-    case M_READ_PRINT_POLL:
-      {
-        int rv = vfs301_proto_process_event_poll (self);
-        g_assert (rv != VFS301_FAILURE);
-        if (rv == VFS301_ONGOING)
-          fpi_ssm_jump_to_state (ssm, M_READ_PRINT_WAIT);
-        else
-          fpi_ssm_next_state (ssm);
-      }
+      vfs301_proto_read_print (self, ssm);
       break;
 
     case M_SUBMIT_PRINT:
@@ -152,10 +137,7 @@ static void
 m_loop_complete (FpiSsm *ssm, FpDevice *_dev, GError *error)
 {
   if (error)
-    {
-      g_warning ("State machine completed with an error: %s", error->message);
-      g_error_free (error);
-    }
+    fpi_image_device_session_error (FP_IMAGE_DEVICE (_dev), error);
   /* Free sequential state machine */
 }
 
@@ -167,9 +149,7 @@ m_init_state (FpiSsm *ssm, FpDevice *_dev)
 
   g_assert (fpi_ssm_get_cur_state (ssm) == 0);
 
-  vfs301_proto_init (self);
-
-  fpi_ssm_mark_completed (ssm);
+  vfs301_proto_init (self, ssm);
 }
 
 /* Complete init sequential state machine */
@@ -237,6 +217,7 @@ dev_close (FpImageDevice *dev)
 
   /* Release private structure */
   g_clear_pointer (&self->scanline_buf, g_free);
+  g_clear_error (&self->recv_error);
 
   /* Release usb interface */
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)),
@@ -247,7 +228,7 @@ dev_close (FpImageDevice *dev)
 }
 
 /* Usb id table of device */
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_vfs301_id_table[] = {
   { /* vfs301 */ .vid = 0x138a,  .pid = 0x0005, },
   { /* vfs300 */ .vid = 0x138a,  .pid = 0x0008, },
   { .vid = 0,  .pid = 0,  .driver_data = 0 },
@@ -266,7 +247,7 @@ fpi_device_vfs301_class_init (FpDeviceVfs301Class *klass)
   dev_class->id = "vfs301";
   dev_class->full_name = "Validity VFS301";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_vfs301_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->img_open = dev_open;
@@ -48,7 +48,12 @@ struct _FpDeviceVfs301
     VFS301_ENDED = 1,
     VFS301_FAILURE = -1
   } recv_progress;
-  int recv_exp_amt;
+  guint         recv_submitted;
+  guint         recv_pending;
+  GCancellable *recv_cancellable;
+  GError       *recv_error;
+
+  gboolean finger_event;
 };
 
 G_DECLARE_FINAL_TYPE (FpDeviceVfs301, fpi_device_vfs301, FPI, DEVICE_VFS301, FpImageDevice)
@@ -127,15 +132,20 @@ typedef struct
   unsigned char sum3[3];
 } vfs301_line_t;
 
-void vfs301_proto_init (FpDeviceVfs301 *dev);
+/* The protocol steps run as child state machines of @ssm, which is moved
+ * to its next state once the step is done. */
+void vfs301_proto_init (FpDeviceVfs301 *dev,
+                        FpiSsm         *ssm);
 void vfs301_proto_deinit (FpDeviceVfs301 *dev);
 
-void vfs301_proto_request_fingerprint (FpDeviceVfs301 *dev);
+void vfs301_proto_request_fingerprint (FpDeviceVfs301 *dev,
+                                       FpiSsm         *ssm);
 
-/** returns 0 if no event is ready, or 1 if there is one... */
-int vfs301_proto_peek_event (FpDeviceVfs301 *dev);
-void vfs301_proto_process_event_start (FpDeviceVfs301 *dev);
-int vfs301_proto_process_event_poll (FpDeviceVfs301 *dev);
+/** sets finger_event if the device reported a finger... */
+void vfs301_proto_peek_event (FpDeviceVfs301 *dev,
+                              FpiSsm         *ssm);
+void vfs301_proto_read_print (FpDeviceVfs301 *dev,
+                              FpiSsm         *ssm);
 
 void vfs301_extract_image (FpDeviceVfs301 *vfs,
                            unsigned char  *output,
@@ -21,7 +21,6 @@
 
 /*
  * TODO:
- * - async communication everywhere :)
  * - protocol decyphering
  *   - what is needed and what is redundant
  *   - is some part of the initial data the firmware?
@@ -34,9 +33,12 @@
 #include <stdlib.h>
 #include <glib.h>
 
+#include "fpi-device.h"
+#include "fpi-image.h"
+#include "fpi-ssm.h"
 #include "fpi-usb-transfer.h"
 #include "vfs301.h"
-#include "vfs301_proto_fragments.h"
+#include "vfs301_proto_fragments_bin.h"
 
 /************************** USB STUFF *****************************************/
 
@@ -63,231 +65,157 @@ usb_print_packet (int dir, GError *error, const guint8 *data, int length)
 }
 #endif
 
-static void
-usb_recv (FpDeviceVfs301 *dev, guint8 endpoint, int max_bytes, FpiUsbTransfer **out, GError **error)
-{
-  GError *err = NULL;
-
-  g_autoptr(FpiUsbTransfer) transfer = NULL;
+/* The protocol is a fixed script of messages and replies, which is stored
+ * as a table of commands and run by a state machine with one state per
+ * command. */
+typedef enum {
+  VFS301_CMD_SEND,          /* static message */
+  VFS301_CMD_RECV,          /* reply on one endpoint */
+  VFS301_CMD_RECV_BOTH,     /* replies on two endpoints, in any order */
+} Vfs301CmdType;
 
-  /* XXX: This function swallows any transfer errors, that is obviously
-   *      quite bad (it used to assert on no-error)! */
-
-  transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
-  transfer->short_is_error = TRUE;
-  fpi_usb_transfer_fill_bulk (transfer, endpoint, max_bytes);
+typedef struct
+{
+  Vfs301CmdType cmd;
+  const guint8 *data;
+  guint8        endpoint;
+  gsize         length;
+  guint8        endpoint2;
+  gsize         length2;
+} Vfs301Cmd;
+
+/* Data of every protocol state machine */
+typedef struct
+{
+  const Vfs301Cmd *cmds;
+  guint            pending;
+} Vfs301CmdData;
 
-  fpi_usb_transfer_submit_sync (transfer, VFS301_DEFAULT_WAIT_TIMEOUT, &err);
+static void
+usb_transfer_cb (FpiUsbTransfer *transfer, FpDevice *device,
+                 gpointer user_data, GError *error)
+{
+  Vfs301CmdData *data = fpi_ssm_get_data (transfer->ssm);
 
 #ifdef DEBUG
-  usb_print_packet (0, err, transfer->buffer, transfer->actual_length);
+  usb_print_packet (!(transfer->endpoint & FPI_USB_ENDPOINT_IN), error,
+                    transfer->buffer, transfer->actual_length);
 #endif
-  if (err)
+
+  /* XXX: Transfer errors are only logged, the script is known to run into
+   *      the occasional timeout (e.g. data that does not always come). */
+  if (error)
     {
-      if (!error)
-        g_warning ("Unhandled receive error: %s", err->message);
-      g_propagate_error (error, err);
+      g_warning ("Error on endpoint 0x%02x, continuing anyway: %s",
+                 transfer->endpoint, error->message);
+      g_error_free (error);
     }
 
-  if (out)
-    *out = g_steal_pointer (&transfer);
+  if (--data->pending == 0)
+    fpi_ssm_next_state (transfer->ssm);
 }
 
 static void
-usb_send (FpDeviceVfs301 *dev, const guint8 *data, gssize length, GError **error)
+usb_recv (FpDevice *dev, FpiSsm *ssm, guint8 endpoint, gsize max_bytes)
 {
-  GError *err = NULL;
-
-  g_autoptr(FpiUsbTransfer) transfer = NULL;
-
-  /* XXX: This function swallows any transfer errors, that is obviously
-   *      quite bad (it used to assert on no-error)! */
+  Vfs301CmdData *data = fpi_ssm_get_data (ssm);
+  FpiUsbTransfer *transfer;
 
-  transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
+  transfer = fpi_usb_transfer_new (dev);
+  transfer->ssm = ssm;
   transfer->short_is_error = TRUE;
-  fpi_usb_transfer_fill_bulk_full (transfer, VFS301_SEND_ENDPOINT, (guint8 *) data, length, g_free);
-
-  fpi_usb_transfer_submit_sync (transfer, VFS301_DEFAULT_WAIT_TIMEOUT, &err);
-
-#ifdef DEBUG
-  usb_print_packet (1, err, data, length);
-#endif
+  fpi_usb_transfer_fill_bulk (transfer, endpoint, max_bytes);
 
-  if (err)
-    {
-      g_warning ("Error while sending data, continuing anyway: %s", err->message);
-      g_propagate_error (error, err);
-    }
+  data->pending++;
+  fpi_usb_transfer_submit (transfer, VFS301_DEFAULT_WAIT_TIMEOUT, NULL,
+                           usb_transfer_cb, NULL);
 }
 
-/************************** OUT MESSAGES GENERATION ***************************/
-
-static guint8 *
-vfs301_proto_generate_0B (int subtype, gssize *len)
+static void
+usb_send (FpDevice *dev, FpiSsm *ssm, const guint8 *buffer, gsize length)
 {
-  guint8 *res = g_malloc0 (39);
-  guint8 *data = res;
+  Vfs301CmdData *data = fpi_ssm_get_data (ssm);
+  FpiUsbTransfer *transfer;
 
-  *data = 0x0B;
-  *len = 1;
-  data++;
+  transfer = fpi_usb_transfer_new (dev);
+  transfer->ssm = ssm;
+  transfer->short_is_error = TRUE;
+  fpi_usb_transfer_fill_bulk_static (transfer, VFS301_SEND_ENDPOINT, buffer, length);
 
-  *len += 38;
+  data->pending++;
+  fpi_usb_transfer_submit (transfer, VFS301_DEFAULT_WAIT_TIMEOUT, NULL,
+                           usb_transfer_cb, NULL);
+}
 
-  data[20] = subtype;
+static void
+vfs301_cmd_run_state (FpiSsm *ssm, FpDevice *dev)
+{
+  Vfs301CmdData *data = fpi_ssm_get_data (ssm);
+  const Vfs301Cmd *cmd = &data->cmds[fpi_ssm_get_cur_state (ssm)];
 
-  switch (subtype)
+  switch (cmd->cmd)
     {
-    case 0x04:
-      data[34] = 0x9F;
+    case VFS301_CMD_SEND:
+      usb_send (dev, ssm, cmd->data, cmd->length);
+      break;
+
+    case VFS301_CMD_RECV:
+      usb_recv (dev, ssm, cmd->endpoint, cmd->length);
       break;
 
-    case 0x05:
-      data[34] = 0xAB;
-      /* NOTE: There was a len++ here, which could never do anything */
+    case VFS301_CMD_RECV_BOTH:
+      /* Both reads are queued at once, so that neither of them times out
+       * while the device waits for the other one to be read. */
+      usb_recv (dev, ssm, cmd->endpoint, cmd->length);
+      usb_recv (dev, ssm, cmd->endpoint2, cmd->length2);
       break;
 
     default:
       g_assert_not_reached ();
-      break;
     }
-
-  return res;
 }
 
-#define HEX_TO_INT(c) \
-  (((c) >= '0' && (c) <= '9') ? ((c) - '0') : ((c) - 'A' + 10))
-
-static guint8 *
-translate_str (const char **srcL, gssize *len)
+static void
+vfs301_cmd_run (FpDevice        *dev,
+                FpiSsm          *parent,
+                const Vfs301Cmd *cmds,
+                gint             n_cmds,
+                const char      *name)
 {
-  guint8 *res = NULL;
-  guint8 *dst;
-  const char **src_pos;
-  const char *src;
-  gssize src_len = 0;
-
-  for (src_pos = srcL; *src_pos; src_pos++)
-    {
-      gint tmp;
-
-      src = *src_pos;
-      tmp = strlen (src);
-      g_assert (tmp % 2 == 0);
-      src_len += tmp;
-    }
-
-  g_assert (src_len >= 2);
-  *len = src_len / 2;
-  res = g_malloc0 (*len);
-  dst = res;
+  Vfs301CmdData *data;
+  FpiSsm *ssm;
 
-  for (src_pos = srcL; *src_pos; src_pos++)
-    for (src = *src_pos; *src; src += 2, dst += 1)
-      *dst = (guint8) ((HEX_TO_INT (src[0]) << 4) | (HEX_TO_INT (src[1])));
+  ssm = fpi_ssm_new_with_data_full (dev, vfs301_cmd_run_state, n_cmds, name,
+                                    sizeof (Vfs301CmdData));
+  data = fpi_ssm_get_data (ssm);
+  data->cmds = cmds;
 
-  return res;
+  fpi_ssm_start_subsm (parent, ssm);
 }
 
-static guint8 *
-vfs301_proto_generate (int type, int subtype, gssize *len)
-{
-  switch (type)
-    {
-    case 0x01:
-    case 0x04:
-    /* After cmd 0x04 is sent, a data is received on VALIDITY_RECEIVE_ENDPOINT_CTRL.
-     * If it is 0x0000:
-     *     additional 64B and 224B are read from _DATA, then vfs301_next_scan_FA00 is
-     *     sent, 0000 received from _CTRL, and then continue with wait loop
-     * If it is 0x1204:
-     *     => reinit?
-     */
-    case 0x17:
-    case 0x19:
-    case 0x1A:
-      {
-        guint8 *data = g_malloc0 (1);
-        *data = type;
-        *len = 1;
-        return data;
-      }
-      break;
+#define VFS301_CMD_RUN(dev, parent, cmds) \
+  vfs301_cmd_run (dev, parent, cmds, G_N_ELEMENTS (cmds), #cmds)
 
-    case 0x0B:
-      return vfs301_proto_generate_0B (subtype, len);
-      break;
+/************************** OUT MESSAGES **************************************/
 
-    case 0x02D0:
-      {
-        const char **dataLs[] = {
-          vfs301_02D0_01,
-          vfs301_02D0_02,
-          vfs301_02D0_03,
-          vfs301_02D0_04,
-          vfs301_02D0_05,
-          vfs301_02D0_06,
-          vfs301_02D0_07,
-        };
-        g_assert ((int) subtype <= G_N_ELEMENTS (dataLs));
-        return translate_str (dataLs[subtype - 1], len);
-      }
-      break;
+/* The longer messages are generated from vfs301_proto_fragments.h when
+ * building, see vfs301_proto_gen.c. */
 
-    case 0x0220:
-      switch (subtype)
-        {
-        case 1:
-          return translate_str (vfs301_0220_01, len);
-          break;
-
-        case 2:
-          return translate_str (vfs301_0220_02, len);
-          break;
-
-        case 3:
-          return translate_str (vfs301_0220_03, len);
-          break;
-
-        case 0xFA00:
-        case 0x2C01:
-        case 0x5E01: {
-            guint8 *data;
-            guint8 *field;
-
-            data = translate_str (vfs301_next_scan_template, len);
-            field = data + *len - (sizeof (S4_TAIL) - 1) / 2 - 4;
-
-            g_assert (field >= data && field < data + *len);
-            g_assert (field[0] == 0xDE);
-            g_assert (field[1] == 0xAD);
-            g_assert (field[2] == 0xDE);
-            g_assert (field[3] == 0xAD);
-
-            field[0] = (guint8) ((subtype >> 8) & 0xFF);
-            field[1] = (guint8) (subtype & 0xFF);
-            field[2] = field[0];
-            field[3] = field[1];
-
-            return data;
-            break;
-          }
-
-        default:
-          g_assert_not_reached ();
-          break;
-        }
-      break;
-
-    case 0x06:
-    default:
-      break;
-    }
+static const guint8 vfs301_01[] = { 0x01 };
+/* After cmd 0x04 is sent, a data is received on VALIDITY_RECEIVE_ENDPOINT_CTRL.
+ * If it is 0x0000:
+ *     additional 64B and 224B are read from _DATA, then vfs301_next_scan_FA00 is
+ *     sent, 0000 received from _CTRL, and then continue with wait loop
+ * If it is 0x1204:
+ *     => reinit?
+ */
+static const guint8 vfs301_04[] = { 0x04 };
+static const guint8 vfs301_17[] = { 0x17 };
+static const guint8 vfs301_19[] = { 0x19 };
+static const guint8 vfs301_1A[] = { 0x1A };
 
-  g_assert_not_reached ();
-  *len = 0;
-  return NULL;
-}
+static const guint8 vfs301_0B_04[39] = { [0] = 0x0B, [21] = 0x04, [35] = 0x9F };
+static const guint8 vfs301_0B_05[39] = { [0] = 0x0B, [21] = 0x05, [35] = 0xAB };
 
 /************************** SCAN IMAGE PROCESSING *****************************/
 
@@ -316,7 +244,6 @@ scanline_diff (const guint8 *scanlines, int prev, int cur)
 {
   const guint8 *line1 = scanlines + prev * VFS301_FP_OUTPUT_WIDTH;
   const guint8 *line2 = scanlines + cur * VFS301_FP_OUTPUT_WIDTH;
-  int i;
   int diff;
 
 #ifdef OUTPUT_RAW
@@ -327,16 +254,7 @@ scanline_diff (const guint8 *scanlines, int prev, int cur)
 
   /* TODO: This doesn't work too well when there are parallel lines in the
    * fingerprint. */
-  for (diff = 0, i = 0; i < VFS301_FP_WIDTH; i++)
-    {
-      if (*line1 > *line2)
-        diff += *line1 - *line2;
-      else
-        diff += *line2 - *line1;
-
-      line1++;
-      line2++;
-    }
+  diff = fpi_sum_abs_diff (line1, line2, VFS301_FP_WIDTH);
 
   return (diff / VFS301_FP_WIDTH) > VFS301_FP_LINE_DIFF_THRESHOLD;
 }
@@ -428,20 +346,20 @@ img_process_data (int first_block, FpDeviceVfs301 *dev, const guint8 *buf, int l
 /************************** PROTOCOL STUFF ************************************/
 
 #define USB_RECV(from, len) \
-  usb_recv (dev, from, len, NULL, NULL)
+  { VFS301_CMD_RECV, .endpoint = (from), .length = (len) }
 
-#define USB_SEND(type, subtype) \
-  { \
-    const guint8 *data; \
-    gssize len; \
-    data = vfs301_proto_generate (type, subtype, &len); \
-    usb_send (dev, data, len, NULL); \
-  }
+#define USB_SEND(x) \
+  { VFS301_CMD_SEND, .data = (x), .length = sizeof (x) }
 
-#define RAW_DATA(x) x, sizeof (x)
+/* Some replies come on two endpoints at the same time */
+#define PARALLEL_RECEIVE(e1, l1, e2, l2) \
+  { VFS301_CMD_RECV_BOTH, .endpoint = (e1), .length = (l1), .endpoint2 = (e2), .length2 = (l2) }
 
 #define IS_VFS301_FP_SEQ_START(b) ((b[0] == 0x01) && (b[1] == 0xfe))
 
+/* Number of fingerprint data reads kept queued during a scan */
+#define VFS301_FP_RECV_QUEUE 2
+
 static int
 vfs301_proto_process_data (FpDeviceVfs301 *dev, int first_block, const guint8 *buf, gint len)
 {
@@ -460,237 +378,344 @@ vfs301_proto_process_data (FpDeviceVfs301 *dev, int first_block, const guint8 *b
   return img_process_data (first_block, dev, buf, len);
 }
 
+static const Vfs301Cmd request_fingerprint_cmds[] = {
+  USB_SEND (vfs301_next_scan_FA00),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 000000000000 */
+};
+
 void
-vfs301_proto_request_fingerprint (FpDeviceVfs301 *dev)
+vfs301_proto_request_fingerprint (FpDeviceVfs301 *dev, FpiSsm *ssm)
 {
-  USB_SEND (0x0220, 0xFA00);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 000000000000 */
+  VFS301_CMD_RUN (FP_DEVICE (dev), ssm, request_fingerprint_cmds);
 }
 
-int
-vfs301_proto_peek_event (FpDeviceVfs301 *dev)
+enum {
+  PEEK_SEND,
+  PEEK_RECV,
+  PEEK_NUM_STATES,
+};
+
+static void
+vfs301_proto_peek_event_cb (FpiUsbTransfer *transfer, FpDevice *device,
+                            gpointer user_data, GError *error)
 {
-  g_autoptr(GError) error = NULL;
-  FpiUsbTransfer *transfer;
+  FpDeviceVfs301 *dev = FPI_DEVICE_VFS301 (device);
 
   const char no_event[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
   const char got_event[] = {0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00};
 
-  USB_SEND (0x17, -1);
-  usb_recv (dev, VFS301_RECEIVE_ENDPOINT_CTRL, 7, &transfer, &error);
-
-  /* XXX: This is obviously not a sane error handling! */
-  g_assert (!error);
+  if (error)
+    {
+      fpi_ssm_mark_failed (transfer->ssm, error);
+      return;
+    }
 
   if (memcmp (transfer->buffer, no_event, sizeof (no_event)) == 0)
-    return 0;
-  else if (memcmp (transfer->buffer, got_event, sizeof (no_event)) == 0)
-    return 1;
+    {
+      dev->finger_event = FALSE;
+    }
+  else if (memcmp (transfer->buffer, got_event, sizeof (got_event)) == 0)
+    {
+      dev->finger_event = TRUE;
+    }
   else
-    g_assert_not_reached ();
+    {
+      fpi_ssm_mark_failed (transfer->ssm,
+                           fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                     "Unexpected event reply"));
+      return;
+    }
+
+  fpi_ssm_next_state (transfer->ssm);
 }
 
-/* XXX: We sometimes need to receive data on from two endpoints at the same
- *      time. However, as this driver is currently all synchronous (yikes),
- *      we will run into timeouts randomly and need to then try again.
- */
-#define PARALLEL_RECEIVE(e1, l1, e2, l2) \
-  { \
-    g_autoptr(GError) error = NULL; \
-    usb_recv (dev, e1, l1, NULL, &error); \
-    usb_recv (dev, e2, l2, NULL, NULL); \
-    if (g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_TIMED_OUT)) \
-    usb_recv (dev, e1, l1, NULL, NULL); \
-  }
+static void
+vfs301_proto_peek_event_state (FpiSsm *ssm, FpDevice *device)
+{
+  FpiUsbTransfer *transfer;
+
+  switch (fpi_ssm_get_cur_state (ssm))
+    {
+    case PEEK_SEND:
+      usb_send (device, ssm, vfs301_17, sizeof (vfs301_17));
+      break;
+
+    case PEEK_RECV:
+      transfer = fpi_usb_transfer_new (device);
+      transfer->ssm = ssm;
+      transfer->short_is_error = TRUE;
+      fpi_usb_transfer_fill_bulk (transfer, VFS301_RECEIVE_ENDPOINT_CTRL, 7);
+      fpi_usb_transfer_submit (transfer, VFS301_DEFAULT_WAIT_TIMEOUT, NULL,
+                               vfs301_proto_peek_event_cb, NULL);
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+void
+vfs301_proto_peek_event (FpDeviceVfs301 *dev, FpiSsm *ssm)
+{
+  fpi_ssm_start_subsm (ssm,
+                       fpi_ssm_new_with_data (FP_DEVICE (dev),
+                                              vfs301_proto_peek_event_state,
+                                              PEEK_NUM_STATES,
+                                              sizeof (Vfs301CmdData)));
+}
+
+static void vfs301_proto_read_chunk (FpDeviceVfs301 *dev,
+                                     FpiSsm         *ssm);
 
 static void
-vfs301_proto_process_event_cb (FpiUsbTransfer *transfer,
-                               FpDevice *device,
-                               gpointer user_data, GError *error)
+vfs301_proto_read_chunk_cb (FpiUsbTransfer *transfer,
+                            FpDevice       *device,
+                            gpointer        user_data,
+                            GError         *error)
 {
-  FpDeviceVfs301 *dev = user_data;
+  FpDeviceVfs301 *dev = FPI_DEVICE_VFS301 (device);
 
-  if (error)
+  dev->recv_pending--;
+
+  if (dev->recv_progress != VFS301_ONGOING)
+    {
+      /* A read that was queued behind the end of the scan */
+      g_clear_error (&error);
+    }
+  else if (error)
     {
       g_warning ("Error receiving data: %s", error->message);
-      g_error_free (error);
+      dev->recv_error = error;
       dev->recv_progress = VFS301_FAILURE;
-      return;
     }
   else if (transfer->actual_length < transfer->length)
     {
       /* TODO: process the data anyway? */
       dev->recv_progress = VFS301_ENDED;
-      return;
+    }
+  else if (!vfs301_proto_process_data (dev,
+                                       transfer->length == VFS301_FP_RECV_LEN_1,
+                                       transfer->buffer,
+                                       transfer->actual_length))
+    {
+      dev->recv_progress = VFS301_ENDED;
     }
   else
     {
-      FpiUsbTransfer *new;
-      if (!vfs301_proto_process_data (dev,
-                                      transfer->length == VFS301_FP_RECV_LEN_1,
-                                      transfer->buffer,
-                                      transfer->actual_length))
-        {
-          dev->recv_progress = VFS301_ENDED;
-          return;
-        }
-
-      new = fpi_usb_transfer_new (device);
+      /* Keep the queue full */
+      vfs301_proto_read_chunk (dev, transfer->ssm);
+      return;
+    }
 
-      fpi_usb_transfer_fill_bulk (new, VFS301_RECEIVE_ENDPOINT_DATA, VFS301_FP_RECV_LEN_2);
-      fpi_usb_transfer_submit (new, VFS301_FP_RECV_TIMEOUT, NULL,
-                               vfs301_proto_process_event_cb, NULL);
+  if (dev->recv_pending > 0)
+    {
+      /* Wait for the remaining queued reads to be cancelled */
+      g_cancellable_cancel (dev->recv_cancellable);
       return;
     }
+
+  g_clear_object (&dev->recv_cancellable);
+
+  if (dev->recv_progress == VFS301_FAILURE)
+    fpi_ssm_mark_failed (transfer->ssm, g_steal_pointer (&dev->recv_error));
+  else
+    fpi_ssm_next_state (transfer->ssm);
 }
 
-void
-vfs301_proto_process_event_start (FpDeviceVfs301 *dev)
+static void
+vfs301_proto_read_chunk (FpDeviceVfs301 *dev, FpiSsm *ssm)
 {
   FpiUsbTransfer *transfer;
 
-  /*
-   * Notes:
-   *
-   * seen next_scan order:
-   *    o FA00
-   *    o FA00
-   *    o 2C01
-   *    o FA00
-   *    o FA00
-   *    o 2C01
-   *    o FA00
-   *    o FA00
-   *    o 2C01
-   *    o 5E01 !?
-   *    o FA00
-   *    o FA00
-   *    o 2C01
-   *    o FA00
-   *    o FA00
-   *    o 2C01
-   */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 64);
-
-  /* now read the fingerprint data, while there are some */
   transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
-  dev->recv_progress = VFS301_ONGOING;
-
-  fpi_usb_transfer_fill_bulk (transfer, VFS301_RECEIVE_ENDPOINT_DATA, VFS301_FP_RECV_LEN_1);
-  fpi_usb_transfer_submit (transfer, VFS301_FP_RECV_TIMEOUT, NULL,
-                           vfs301_proto_process_event_cb, NULL);
+  transfer->ssm = ssm;
+  /* Only the first read contains the start sequence, and is shorter */
+  fpi_usb_transfer_fill_bulk (transfer, VFS301_RECEIVE_ENDPOINT_DATA,
+                              dev->recv_submitted == 0 ?
+                              VFS301_FP_RECV_LEN_1 : VFS301_FP_RECV_LEN_2);
+
+  dev->recv_submitted++;
+  dev->recv_pending++;
+  fpi_usb_transfer_submit (transfer, VFS301_FP_RECV_TIMEOUT, dev->recv_cancellable,
+                           vfs301_proto_read_chunk_cb, NULL);
 }
 
-int
-vfs301_proto_process_event_poll (FpDeviceVfs301 *dev)
-{
-  if (dev->recv_progress != VFS301_ENDED)
-    return dev->recv_progress;
-
-  /* Finish the scan process... */
-
-  USB_SEND (0x04, -1);
+/*
+ * Notes:
+ *
+ * seen next_scan order:
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ *    o 5E01 !?
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ */
+static const Vfs301Cmd read_print_finish_cmds[] = {
+  USB_SEND (vfs301_04),
   /* the following may come in random order, data may not come at all, don't
    * try for too long... */
   PARALLEL_RECEIVE (
     VFS301_RECEIVE_ENDPOINT_CTRL, 2,             /* 1204 */
     VFS301_RECEIVE_ENDPOINT_DATA, 16384
-                   );
+                   ),
 
-  USB_SEND (0x0220, 2);
+  USB_SEND (vfs301_0220_02),
   PARALLEL_RECEIVE (
     VFS301_RECEIVE_ENDPOINT_DATA, 5760,             /* seems to always come */
     VFS301_RECEIVE_ENDPOINT_CTRL, 2             /* 0000 */
-                   );
+                   ),
+};
+
+enum {
+  READ_PRINT_HEADER,
+  READ_PRINT_DATA,
+  READ_PRINT_FINISH,
+  READ_PRINT_NUM_STATES,
+};
 
-  return dev->recv_progress;
+static void
+vfs301_proto_read_print_state (FpiSsm *ssm, FpDevice *device)
+{
+  FpDeviceVfs301 *dev = FPI_DEVICE_VFS301 (device);
+  int i;
+
+  switch (fpi_ssm_get_cur_state (ssm))
+    {
+    case READ_PRINT_HEADER:
+      usb_recv (device, ssm, VFS301_RECEIVE_ENDPOINT_DATA, 64);
+      break;
+
+    case READ_PRINT_DATA:
+      /* now read the fingerprint data, while there are some; further
+       * reads are queued so that the device never waits for the host */
+      dev->recv_progress = VFS301_ONGOING;
+      dev->recv_submitted = 0;
+      dev->recv_cancellable = g_cancellable_new ();
+
+      for (i = 0; i < VFS301_FP_RECV_QUEUE; i++)
+        vfs301_proto_read_chunk (dev, ssm);
+      break;
+
+    case READ_PRINT_FINISH:
+      /* Finish the scan process... */
+      VFS301_CMD_RUN (device, ssm, read_print_finish_cmds);
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
 }
 
 void
-vfs301_proto_init (FpDeviceVfs301 *dev)
+vfs301_proto_read_print (FpDeviceVfs301 *dev, FpiSsm *ssm)
 {
-  USB_SEND (0x01, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-  USB_SEND (0x0B, 0x04);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 6);      /* 000000000000 */
-  USB_SEND (0x0B, 0x05);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 7);      /* 00000000000000 */
-  USB_SEND (0x19, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 64);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 4);      /* 6BB4D0BC */
-  usb_send (dev, RAW_DATA (vfs301_06_1), NULL);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-
-  USB_SEND (0x01, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-  USB_SEND (0x1A, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  usb_send (dev, RAW_DATA (vfs301_06_2), NULL);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_SEND (0x0220, 1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 256);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 32);
-
-  USB_SEND (0x1A, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  usb_send (dev, RAW_DATA (vfs301_06_3), NULL);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-
-  USB_SEND (0x01, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-  USB_SEND (0x02D0, 1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 11648);      /* 56 * vfs301_init_line_t[] */
-  USB_SEND (0x02D0, 2);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 53248);      /* 2 * 128 * vfs301_init_line_t[] */
-  USB_SEND (0x02D0, 3);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 19968);      /* 96 * vfs301_init_line_t[] */
-  USB_SEND (0x02D0, 4);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 5824);      /* 28 * vfs301_init_line_t[] */
-  USB_SEND (0x02D0, 5);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 6656);      /* 32 * vfs301_init_line_t[] */
-  USB_SEND (0x02D0, 6);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 6656);      /* 32 * vfs301_init_line_t[] */
-  USB_SEND (0x02D0, 7);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 832);
-  usb_send (dev, RAW_DATA (vfs301_12), NULL);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-
-  USB_SEND (0x1A, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  usb_send (dev, RAW_DATA (vfs301_06_2), NULL);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  USB_SEND (0x0220, 2);
+  fpi_ssm_start_subsm (ssm,
+                       fpi_ssm_new_with_data (FP_DEVICE (dev),
+                                              vfs301_proto_read_print_state,
+                                              READ_PRINT_NUM_STATES,
+                                              sizeof (Vfs301CmdData)));
+}
+
+static const Vfs301Cmd init_cmds[] = {
+  USB_SEND (vfs301_01),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 38),
+  USB_SEND (vfs301_0B_04),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 6),      /* 000000000000 */
+  USB_SEND (vfs301_0B_05),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 7),      /* 00000000000000 */
+  USB_SEND (vfs301_19),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 64),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 4),      /* 6BB4D0BC */
+  USB_SEND (vfs301_06_1),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+
+  USB_SEND (vfs301_01),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 38),
+  USB_SEND (vfs301_1A),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_SEND (vfs301_06_2),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_SEND (vfs301_0220_01),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 256),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 32),
+
+  USB_SEND (vfs301_1A),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_SEND (vfs301_06_3),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+
+  USB_SEND (vfs301_01),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 38),
+  USB_SEND (vfs301_02D0_01),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 11648),      /* 56 * vfs301_init_line_t[] */
+  USB_SEND (vfs301_02D0_02),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 53248),      /* 2 * 128 * vfs301_init_line_t[] */
+  USB_SEND (vfs301_02D0_03),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 19968),      /* 96 * vfs301_init_line_t[] */
+  USB_SEND (vfs301_02D0_04),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 5824),      /* 28 * vfs301_init_line_t[] */
+  USB_SEND (vfs301_02D0_05),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 6656),      /* 32 * vfs301_init_line_t[] */
+  USB_SEND (vfs301_02D0_06),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 6656),      /* 32 * vfs301_init_line_t[] */
+  USB_SEND (vfs301_02D0_07),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 832),
+  USB_SEND (vfs301_12),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+
+  USB_SEND (vfs301_1A),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_SEND (vfs301_06_2),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_SEND (vfs301_0220_02),
   PARALLEL_RECEIVE (
     VFS301_RECEIVE_ENDPOINT_CTRL, 2,             /* 0000 */
     VFS301_RECEIVE_ENDPOINT_DATA, 5760
-                   );
-
-  USB_SEND (0x1A, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  usb_send (dev, RAW_DATA (vfs301_06_1), NULL);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-
-  USB_SEND (0x1A, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  usb_send (dev, RAW_DATA (vfs301_06_4), NULL);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-  usb_send (dev, RAW_DATA (vfs301_24), NULL);     /* turns on white */
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2);      /* 0000 */
-
-  USB_SEND (0x01, -1);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-  USB_SEND (0x0220, 3);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2368);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 36);
-  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 5760);
+                   ),
+
+  USB_SEND (vfs301_1A),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_SEND (vfs301_06_1),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+
+  USB_SEND (vfs301_1A),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_SEND (vfs301_06_4),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+  USB_SEND (vfs301_24),     /* turns on white */
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2),      /* 0000 */
+
+  USB_SEND (vfs301_01),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 38),
+  USB_SEND (vfs301_0220_03),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 2368),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_CTRL, 36),
+  USB_RECV (VFS301_RECEIVE_ENDPOINT_DATA, 5760),
+};
+
+void
+vfs301_proto_init (FpDeviceVfs301 *dev, FpiSsm *ssm)
+{
+  VFS301_CMD_RUN (FP_DEVICE (dev), ssm, init_cmds);
 }
 
 void
@@ -0,0 +1,179 @@
+/*
+ * vfs301/vfs300 protocol fragment generator
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Run at build time to turn the hex string tables of
+ * vfs301_proto_fragments.h into byte arrays, so that the driver can send
+ * the messages as they are. This runs on the build machine, so it must
+ * not depend on GLib.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vfs301_proto_fragments.h"
+
+#define HEX_TO_INT(c) \
+  (((c) >= '0' && (c) <= '9') ? ((c) - '0') : ((c) - 'A' + 10))
+
+static void
+die (const char *name, const char *msg)
+{
+  fprintf (stderr, "vfs301_proto_gen: %s: %s\n", name, msg);
+  exit (1);
+}
+
+static unsigned char *
+translate_str (const char *name, const char **srcL, size_t *len)
+{
+  unsigned char *res;
+  unsigned char *dst;
+  const char **src_pos;
+  const char *src;
+  size_t src_len = 0;
+
+  for (src_pos = srcL; *src_pos; src_pos++)
+    {
+      size_t tmp = strlen (*src_pos);
+
+      if (tmp % 2 != 0)
+        die (name, "odd number of hex digits");
+      src_len += tmp;
+    }
+
+  if (src_len < 2)
+    die (name, "empty message");
+
+  *len = src_len / 2;
+  res = malloc (*len);
+  if (!res)
+    die (name, "out of memory");
+  dst = res;
+
+  for (src_pos = srcL; *src_pos; src_pos++)
+    for (src = *src_pos; *src; src += 2, dst += 1)
+      *dst = (unsigned char) ((HEX_TO_INT (src[0]) << 4) | (HEX_TO_INT (src[1])));
+
+  return res;
+}
+
+static void
+write_bytes (FILE *out, const char *name, const unsigned char *data, size_t len)
+{
+  size_t i;
+
+  fprintf (out, "static const guint8 %s[] = { /* %zu B */", name, len);
+  for (i = 0; i < len; i++)
+    fprintf (out, "%s0x%02X,", i % 12 == 0 ? "\n  " : " ", data[i]);
+  fprintf (out, "\n};\n\n");
+}
+
+static void
+write_str (FILE *out, const char *name, const char **srcL)
+{
+  unsigned char *data;
+  size_t len;
+
+  data = translate_str (name, srcL, &len);
+  write_bytes (out, name, data, len);
+  free (data);
+}
+
+/* The request for the next part of the scan carries the number of lines
+ * to send twice, in the S4 ("DEAD") packet at the end of the template. */
+static void
+write_next_scan (FILE *out, const char *name, unsigned int lines)
+{
+  unsigned char *data;
+  unsigned char *field;
+  size_t len;
+
+  data = translate_str (name, vfs301_next_scan_template, &len);
+  field = data + len - (sizeof (S4_TAIL) - 1) / 2 - 4;
+
+  if (field < data ||
+      field[0] != 0xDE || field[1] != 0xAD ||
+      field[2] != 0xDE || field[3] != 0xAD)
+    die (name, "line count field not found in the template");
+
+  field[0] = (unsigned char) ((lines >> 8) & 0xFF);
+  field[1] = (unsigned char) (lines & 0xFF);
+  field[2] = field[0];
+  field[3] = field[1];
+
+  write_bytes (out, name, data, len);
+  free (data);
+}
+
+#define WRITE_BYTES(out, x) write_bytes (out, #x, x, sizeof (x))
+#define WRITE_STR(out, x) write_str (out, #x, x)
+
+int
+main (int argc, char **argv)
+{
+  FILE *out;
+
+  if (argc != 2)
+    {
+      fprintf (stderr, "Usage: %s OUTPUT\n", argv[0]);
+      return 1;
+    }
+
+  out = fopen (argv[1], "w");
+  if (!out)
+    {
+      perror (argv[1]);
+      return 1;
+    }
+
+  fprintf (out, "/* Generated by vfs301_proto_gen from vfs301_proto_fragments.h, do not edit */\n\n");
+  fprintf (out, "#pragma once\n\n");
+
+  WRITE_BYTES (out, vfs301_06_1);
+  WRITE_BYTES (out, vfs301_06_2);
+  WRITE_BYTES (out, vfs301_06_3);
+  WRITE_BYTES (out, vfs301_06_4);
+  WRITE_BYTES (out, vfs301_12);
+  WRITE_BYTES (out, vfs301_24);
+
+  WRITE_STR (out, vfs301_0220_01);
+  WRITE_STR (out, vfs301_0220_02);
+  WRITE_STR (out, vfs301_0220_03);
+
+  write_next_scan (out, "vfs301_next_scan_FA00", 0xFA00);
+  write_next_scan (out, "vfs301_next_scan_2C01", 0x2C01);
+  write_next_scan (out, "vfs301_next_scan_5E01", 0x5E01);
+
+  WRITE_STR (out, vfs301_02D0_01);
+  WRITE_STR (out, vfs301_02D0_02);
+  WRITE_STR (out, vfs301_02D0_03);
+  WRITE_STR (out, vfs301_02D0_04);
+  WRITE_STR (out, vfs301_02D0_05);
+  WRITE_STR (out, vfs301_02D0_06);
+  WRITE_STR (out, vfs301_02D0_07);
+
+  if (fclose (out) != 0)
+    {
+      perror (argv[1]);
+      return 1;
+    }
+
+  return 0;
+}
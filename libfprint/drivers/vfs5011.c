@@ -32,12 +32,12 @@ enum {
 
 struct usb_action
 {
-  int            type;
-  const char    *name;
-  int            endpoint;
-  int            size;
-  unsigned char *data;
-  int            correct_reply_size;
+  int                  type;
+  const char          *name;
+  int                  endpoint;
+  int                  size;
+  const unsigned char *data;
+  int                  correct_reply_size;
 };
 
 #define SEND(ENDPOINT, COMMAND) \
@@ -73,6 +73,11 @@ struct usbexchange_data
   struct usb_action *actions;
   void              *receive_buf;
   int                timeout;
+
+  /* Consecutive sends are queued at once, see usbexchange_loop() */
+  int                pending_sends;
+  int                sends_end;
+  GError            *send_error;
 };
 
 static void start_scan (FpImageDevice *dev);
@@ -89,15 +94,27 @@ async_send_cb (FpiUsbTransfer *transfer, FpDevice *device,
   action = &data->actions[fpi_ssm_get_cur_state (transfer->ssm)];
   g_assert (!(action->type != ACTION_SEND));
 
-  if (error)
+  /* Only the first error is reported */
+  if (error && data->send_error)
+    g_error_free (error);
+  else if (error)
+    data->send_error = error;
+
+  if (--data->pending_sends > 0)
+    return;
+
+  if (data->send_error)
     {
       /* Transfer not completed, return IO error */
-      fpi_ssm_mark_failed (transfer->ssm, error);
+      fpi_ssm_mark_failed (transfer->ssm, g_steal_pointer (&data->send_error));
       return;
     }
 
   /* success */
-  fpi_ssm_next_state (transfer->ssm);
+  if (data->sends_end < data->stepcount)
+    fpi_ssm_jump_to_state (transfer->ssm, data->sends_end);
+  else
+    fpi_ssm_mark_completed (transfer->ssm);
 }
 
 static void
@@ -153,21 +170,35 @@ usbexchange_loop (FpiSsm *ssm, FpDevice *_dev)
   struct usbexchange_data *data = fpi_ssm_get_data (ssm);
   struct usb_action *action = &data->actions[fpi_ssm_get_cur_state (ssm)];
   FpiUsbTransfer *transfer;
+  int i;
 
   g_assert (fpi_ssm_get_cur_state (ssm) < data->stepcount);
 
   switch (action->type)
     {
     case ACTION_SEND:
-      fp_dbg ("Sending %s", action->name);
-      transfer = fpi_usb_transfer_new (_dev);
-      fpi_usb_transfer_fill_bulk_full (transfer, action->endpoint,
-                                       action->data, action->size,
-                                       NULL);
-      transfer->ssm = ssm;
-      transfer->short_is_error = TRUE;
-      fpi_usb_transfer_submit (transfer, data->timeout, NULL,
-                               async_send_cb, NULL);
+      /* Transfers to the same endpoint complete in order, so the sends up
+       * to the next receive are all submitted at once and the state
+       * machine only moves on when the last of them is done. */
+      data->sends_end = fpi_ssm_get_cur_state (ssm);
+      while (data->sends_end < data->stepcount &&
+             data->actions[data->sends_end].type == ACTION_SEND &&
+             data->actions[data->sends_end].endpoint == action->endpoint)
+        data->sends_end++;
+
+      data->pending_sends = data->sends_end - fpi_ssm_get_cur_state (ssm);
+      for (i = fpi_ssm_get_cur_state (ssm); i < data->sends_end; i++)
+        {
+          fp_dbg ("Sending %s", data->actions[i].name);
+          transfer = fpi_usb_transfer_new (_dev);
+          fpi_usb_transfer_fill_bulk_static (transfer, data->actions[i].endpoint,
+                                             data->actions[i].data,
+                                             data->actions[i].size);
+          transfer->ssm = ssm;
+          transfer->short_is_error = TRUE;
+          fpi_usb_transfer_submit (transfer, data->timeout, NULL,
+                                   async_send_cb, NULL);
+        }
       break;
 
     case ACTION_RECEIVE:
@@ -239,10 +270,19 @@ vfs5011_get_pixel (struct fpi_line_asmbl_ctx *ctx,
   return data[x];
 }
 
+static const unsigned char *
+vfs5011_get_line (struct fpi_line_asmbl_ctx *ctx,
+                  GSList                    *row)
+{
+  return (unsigned char *) row->data + 8;
+}
+
 /* ====================== main stuff ======================= */
 
 enum {
   CAPTURE_LINES = 256,
+  /* Chunks in flight, one is processed while the others are filled */
+  CAPTURE_TRANSFERS = 2,
   MAXLINES = 2000,
   MAX_CAPTURE_LINES = 100000,
 };
@@ -255,6 +295,7 @@ static struct fpi_line_asmbl_ctx assembling_ctx = {
   .max_search_offset = 30,
   .get_deviation = vfs5011_get_deviation2,
   .get_pixel = vfs5011_get_pixel,
+  .get_line = vfs5011_get_line,
 };
 
 struct _FpDeviceVfs5011
@@ -262,7 +303,8 @@ struct _FpDeviceVfs5011
   FpImageDevice           parent;
 
   unsigned char          *total_buffer;
-  unsigned char          *capture_buffer;
+  FpiUsbTransferStream   *capture_stream;
+  gboolean                capture_finished;
   unsigned char          *row_buffer;
   unsigned char          *lastline;
   GSList                 *rows;
@@ -309,7 +351,8 @@ capture_init (FpDeviceVfs5011 *self, int max_captured,
 }
 
 static int
-process_chunk (FpDeviceVfs5011 *self, int transferred)
+process_chunk (FpDeviceVfs5011 *self, const unsigned char *buffer,
+               int transferred)
 {
   enum {
     DEVIATION_THRESHOLD = 15 * 15,
@@ -323,8 +366,7 @@ process_chunk (FpDeviceVfs5011 *self, int transferred)
 
   for (i = 0; i < lines_captured; i++)
     {
-      unsigned char *linebuf = self->capture_buffer
-                               + i * VFS5011_LINE_SIZE;
+      const unsigned char *linebuf = buffer + i * VFS5011_LINE_SIZE;
 
       if (fpi_std_sq_dev (linebuf + 8, VFS5011_IMAGE_WIDTH)
           < DEVIATION_THRESHOLD)
@@ -402,69 +444,102 @@ submit_image (FpiSsm          *ssm,
   fpi_image_device_image_captured (dev, img);
 }
 
+/* Stacks the most recently recorded lines without correcting for the
+ * swipe speed, that is only done once the whole image is assembled. */
+static void
+report_preview_frame (FpDeviceVfs5011 *self,
+                      FpImageDevice   *dev)
+{
+  g_autoptr(FpImage) frame = NULL;
+  GSList *row;
+  int height, y;
+
+  height = MIN (self->lines_recorded, VFS5011_IMAGE_WIDTH);
+  if (height == 0)
+    return;
+
+  frame = fp_image_new (VFS5011_IMAGE_WIDTH, height);
+  frame->ppmm = assembling_ctx.resolution;
+
+  /* The rows are stored newest first */
+  for (row = self->rows, y = height - 1; row && y >= 0; row = row->next, y--)
+    memcpy (frame->data + y * VFS5011_IMAGE_WIDTH,
+            (unsigned char *) row->data + 8, VFS5011_IMAGE_WIDTH);
+
+  fpi_image_device_report_frame (dev, frame);
+}
+
 static void
-chunk_capture_callback (FpiUsbTransfer *transfer, FpDevice *device,
-                        gpointer user_data, GError *error)
+chunk_capture_callback (FpiUsbTransferStream *stream, FpiUsbTransfer *transfer,
+                        FpDevice *device, gpointer user_data)
 {
   FpImageDevice *dev = FP_IMAGE_DEVICE (device);
   FpDeviceVfs5011 *self;
 
   self = FPI_DEVICE_VFS5011 (dev);
 
+  if (transfer->actual_length > 0)
+    fpi_image_device_report_finger_status (dev, TRUE);
+
+  if (process_chunk (self, transfer->buffer, transfer->actual_length))
+    {
+      self->capture_finished = TRUE;
+      fpi_usb_transfer_stream_stop (stream);
+    }
+  else if (self->deactivating)
+    {
+      fpi_usb_transfer_stream_stop (stream);
+    }
+  else if (fpi_image_device_wants_frame (dev))
+    {
+      report_preview_frame (self, dev);
+    }
+}
+
+static void
+chunk_capture_done (FpiUsbTransferStream *stream, FpDevice *device,
+                    gpointer user_data, GError *error)
+{
+  FpDeviceVfs5011 *self = FPI_DEVICE_VFS5011 (device);
+  FpiSsm *ssm = user_data;
+
   if (!error ||
       g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_TIMED_OUT))
     {
       if (error)
         g_error_free (error);
 
-      if (transfer->actual_length > 0)
-        fpi_image_device_report_finger_status (dev, TRUE);
-
-      if (process_chunk (self, transfer->actual_length))
-        fpi_ssm_jump_to_state (transfer->ssm,
-                               DEV_ACTIVATE_DATA_COMPLETE);
+      if (self->capture_finished)
+        fpi_ssm_jump_to_state (ssm, DEV_ACTIVATE_DATA_COMPLETE);
       else
-        fpi_ssm_jump_to_state (transfer->ssm,
-                               DEV_ACTIVATE_READ_DATA);
+        fpi_ssm_jump_to_state (ssm, DEV_ACTIVATE_READ_DATA);
     }
   else
     {
       if (!self->deactivating)
         {
           fp_err ("Failed to capture data");
-          fpi_ssm_mark_failed (transfer->ssm, error);
+          fpi_ssm_mark_failed (ssm, error);
         }
       else
         {
           g_error_free (error);
-          fpi_ssm_mark_completed (transfer->ssm);
+          fpi_ssm_mark_completed (ssm);
         }
     }
 }
 
 static void
-capture_chunk_async (FpDeviceVfs5011 *self,
-                     GUsbDevice *handle, int nline,
-                     int timeout, FpiSsm *ssm)
+capture_chunk_async (FpDeviceVfs5011 *self, int timeout, FpiSsm *ssm)
 {
-  FpiUsbTransfer *transfer;
-
   fp_dbg ("capture_chunk_async: capture %d lines, already have %d",
-          nline, self->lines_recorded);
-  enum {
-    DEVIATION_THRESHOLD = 15 * 15,
-    DIFFERENCE_THRESHOLD = 600,
-    STOP_CHECK_LINES = 50
-  };
+          CAPTURE_LINES, self->lines_recorded);
 
-  transfer = fpi_usb_transfer_new (FP_DEVICE (self));
-  fpi_usb_transfer_fill_bulk_full (transfer,
-                                   VFS5011_IN_ENDPOINT_DATA,
-                                   self->capture_buffer,
-                                   nline * VFS5011_LINE_SIZE, NULL);
-  transfer->ssm = ssm;
-  fpi_usb_transfer_submit (transfer, timeout, fpi_device_get_cancellable (FP_DEVICE (self)),
-                           chunk_capture_callback, NULL);
+  /* The next chunks are already being received while one is processed */
+  self->capture_finished = FALSE;
+  fpi_usb_transfer_stream_start (self->capture_stream, timeout,
+                                 fpi_device_get_cancellable (FP_DEVICE (self)),
+                                 chunk_capture_callback, chunk_capture_done, ssm);
 }
 
 /*
@@ -698,10 +773,7 @@ activate_loop (FpiSsm *ssm, FpDevice *_dev)
       break;
 
     case DEV_ACTIVATE_READ_DATA:
-      capture_chunk_async (self,
-                           fpi_device_get_usb_device (FP_DEVICE (dev)),
-                           CAPTURE_LINES,
-                           READ_TIMEOUT, ssm);
+      capture_chunk_async (self, READ_TIMEOUT, ssm);
       break;
 
     case DEV_ACTIVATE_DATA_COMPLETE:
@@ -797,7 +869,10 @@ dev_open (FpImageDevice *dev)
   FpDeviceVfs5011 *self;
 
   self = FPI_DEVICE_VFS5011 (dev);
-  self->capture_buffer = g_new0 (unsigned char, CAPTURE_LINES * VFS5011_LINE_SIZE);
+  self->capture_stream = fpi_usb_transfer_stream_new (FP_DEVICE (dev), FP_TRANSFER_BULK,
+                                                      VFS5011_IN_ENDPOINT_DATA,
+                                                      CAPTURE_LINES * VFS5011_LINE_SIZE,
+                                                      CAPTURE_TRANSFERS);
 
   if (!g_usb_device_claim_interface (fpi_device_get_usb_device (FP_DEVICE (dev)), 0, 0, &error))
     {
@@ -820,7 +895,7 @@ dev_close (FpImageDevice *dev)
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)),
                                   0, 0, &error);
 
-  g_free (self->capture_buffer);
+  g_clear_pointer (&self->capture_stream, fpi_usb_transfer_stream_free);
   g_slist_free_full (self->rows, g_free);
 
   fpi_image_device_close_complete (dev, error);
@@ -865,7 +940,7 @@ dev_deactivate (FpImageDevice *dev)
     fpi_image_device_deactivate_complete (dev, NULL);
 }
 
-static const FpIdEntry id_table[] = {
+const FpIdEntry fpi_device_vfs5011_id_table[] = {
   { /* Validity device from some Toshiba laptops */ .vid = 0x138a,  .pid = 0x0010, },
   { /* vfs5011 */ .vid = 0x138a,  .pid = 0x0011, },
   { /* Validity device from Lenovo Preferred Pro USB Fingerprint Keyboard KUF1256 */ .vid = 0x138a,  .pid = 0x0015, },
@@ -887,7 +962,7 @@ fpi_device_vfs5011_class_init (FpDeviceVfs5011Class *klass)
   dev_class->id = "vfs5011";
   dev_class->full_name = "Validity VFS5011";
   dev_class->type = FP_DEVICE_TYPE_USB;
-  dev_class->id_table = id_table;
+  dev_class->id_table = fpi_device_vfs5011_id_table;
   dev_class->scan_type = FP_SCAN_TYPE_SWIPE;
 
   img_class->img_open = dev_open;
@@ -16,17 +16,17 @@ enum {
   VFS5011_RECEIVE_BUF_SIZE = 102400
 };
 
-static unsigned char VFS5011_NORMAL_CONTROL_REPLY[] = {0x00, 0x00};
+static const unsigned char VFS5011_NORMAL_CONTROL_REPLY[] = {0x00, 0x00};
 
-static unsigned char vfs5011_cmd_01[] = { /* 1 B */
+static const unsigned char vfs5011_cmd_01[] = { /* 1 B */
   0x01,
 };
 
-static unsigned char vfs5011_cmd_19[] = { /* 1 B */
+static const unsigned char vfs5011_cmd_19[] = { /* 1 B */
   0x19,
 };
 
-static unsigned char vfs5011_init_00[] = { /* 39 B */
+static const unsigned char vfs5011_init_00[] = { /* 39 B */
   0x0B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00,
@@ -34,7 +34,7 @@ static unsigned char vfs5011_init_00[] = { /* 39 B */
   0x00, 0x00, 0x00, 0x9F, 0x00, 0x00, 0x00,
 };
 
-static unsigned char vfs5011_init_01[] = { /* 40 B */
+static const unsigned char vfs5011_init_01[] = { /* 40 B */
   0x0B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00,
@@ -43,7 +43,7 @@ static unsigned char vfs5011_init_01[] = { /* 40 B */
 
 };
 
-static unsigned char vfs5011_init_02[] = { /* 578 B */
+static const unsigned char vfs5011_init_02[] = { /* 578 B */
   0x06, 0x9C, 0xF1, 0x9D, 0x71, 0xC3, 0x13, 0xDF,
   0x5F, 0xE4, 0x7A, 0x1F, 0xC7, 0x17, 0x53, 0x9A,
   0x1A, 0xA1, 0xD7, 0xB6, 0x6E, 0xBE, 0xDF, 0x1F,
@@ -119,11 +119,11 @@ static unsigned char vfs5011_init_02[] = { /* 578 B */
   0xF3, 0x48,
 };
 
-static unsigned char vfs5011_cmd_1A[] = { /* 1 B */
+static const unsigned char vfs5011_cmd_1A[] = { /* 1 B */
   0x1A,
 };
 
-static unsigned char vfs5011_init_03[] = { /* 2354 B */
+static const unsigned char vfs5011_init_03[] = { /* 2354 B */
   0x06, 0xFE, 0x93, 0xFF, 0x03, 0xBA, 0x6A, 0xA6,
   0x26, 0x9D, 0x03, 0x66, 0xBE, 0x6E, 0x2A, 0xE3,
   0x63, 0xD8, 0xFE, 0x9B, 0x43, 0x93, 0xD7, 0x03,
@@ -421,7 +421,7 @@ static unsigned char vfs5011_init_03[] = { /* 2354 B */
   0xC8, 0x73,
 };
 
-static unsigned char vfs5011_init_04[] = { /* 2221 B */
+static const unsigned char vfs5011_init_04[] = { /* 2221 B */
   0x02, 0x20, 0x01, 0x01, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -702,7 +702,7 @@ static unsigned char vfs5011_init_04[] = { /* 2221 B */
   0x00, 0x20, 0x28, 0x00, 0x00,
 };
 
-static unsigned char vfs5011_init_05[] = { /* 2770 B */
+static const unsigned char vfs5011_init_05[] = { /* 2770 B */
   0x06, 0x6B, 0x06, 0x6A, 0x76, 0xCC, 0x1C, 0xD0,
   0x50, 0xEB, 0x75, 0x10, 0xC8, 0x18, 0x5C, 0x95,
   0x15, 0xAE, 0xA8, 0xC8, 0x10, 0xC0, 0xB0, 0x7A,
@@ -1052,7 +1052,7 @@ static unsigned char vfs5011_init_05[] = { /* 2770 B */
   0x22, 0x99,
 };
 
-static unsigned char vfs5011_init_06[] = { /* 2855 B */
+static const unsigned char vfs5011_init_06[] = { /* 2855 B */
   0x02, 0xB0, 0x00, 0x62, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -1412,7 +1412,7 @@ static unsigned char vfs5011_init_06[] = { /* 2855 B */
   0x00, 0x00, 0x00, 0x20, 0x28, 0x00, 0x00,
 };
 
-static unsigned char vfs5011_init_07[] = { /* 2503 B */
+static const unsigned char vfs5011_init_07[] = { /* 2503 B */
   0x02, 0xB0, 0x00, 0x00, 0x01, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -1728,7 +1728,7 @@ static unsigned char vfs5011_init_07[] = { /* 2503 B */
   0x00, 0x00, 0x00, 0x20, 0x28, 0x00, 0x00,
 };
 
-static unsigned char vfs5011_init_08[] = { /* 2516 B */
+static const unsigned char vfs5011_init_08[] = { /* 2516 B */
   0x02, 0xB0, 0x00, 0x60, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -2046,7 +2046,7 @@ static unsigned char vfs5011_init_08[] = { /* 2516 B */
   0x20, 0x28, 0x00, 0x00,
 };
 
-static unsigned char vfs5011_init_09[] = { /* 2742 B */
+static const unsigned char vfs5011_init_09[] = { /* 2742 B */
   0x02, 0xB0, 0x00, 0x1C, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -2392,7 +2392,7 @@ static unsigned char vfs5011_init_09[] = { /* 2742 B */
   0x00, 0x00, 0x20, 0x28, 0x00, 0x00,
 };
 
-static unsigned char vfs5011_init_10[] = { /* 2612 B */
+static const unsigned char vfs5011_init_10[] = { /* 2612 B */
   0x02, 0xB0, 0x00, 0x20, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -2722,7 +2722,7 @@ static unsigned char vfs5011_init_10[] = { /* 2612 B */
   0x20, 0x28, 0x00, 0x00,
 };
 
-static unsigned char vfs5011_init_11[] = { /* 2625 B */
+static const unsigned char vfs5011_init_11[] = { /* 2625 B */
   0x02, 0xB0, 0x00, 0x20, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -3054,7 +3054,7 @@ static unsigned char vfs5011_init_11[] = { /* 2625 B */
   0x00,
 };
 
-static unsigned char vfs5011_init_12[] = { /* 2666 B */
+static const unsigned char vfs5011_init_12[] = { /* 2666 B */
   0x02, 0xF0, 0x00, 0x0E, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -3391,7 +3391,7 @@ static unsigned char vfs5011_init_12[] = { /* 2666 B */
   0x00, 0x00,
 };
 
-static unsigned char vfs5011_init_13[] = { /* 57 B */
+static const unsigned char vfs5011_init_13[] = { /* 57 B */
   0x12, 0x90, 0x02, 0x00, 0x00, 0xFE, 0x03, 0x00,
   0x00, 0xFF, 0x1F, 0xFF, 0x1F, 0x00, 0x00, 0x00,
   0x00, 0x18, 0xA2, 0x55, 0x03, 0xD3, 0xA2, 0x5D,
@@ -3402,7 +3402,7 @@ static unsigned char vfs5011_init_13[] = { /* 57 B */
   0x00,
 };
 
-static unsigned char vfs5011_init_14[] = { /* 2561 B */
+static const unsigned char vfs5011_init_14[] = { /* 2561 B */
   0x02, 0xF0, 0x00, 0x14, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -3726,11 +3726,11 @@ static unsigned char vfs5011_init_14[] = { /* 2561 B */
   0x00,
 };
 
-static unsigned char vfs5011_cmd_27[] = { /* 1 B */
+static const unsigned char vfs5011_cmd_27[] = { /* 1 B */
   0x27,
 };
 
-static unsigned char vfs5011_init_15[] = { /* 3794 B */
+static const unsigned char vfs5011_init_15[] = { /* 3794 B */
   0x06, 0x6B, 0x06, 0x6A, 0x76, 0xC8, 0x18, 0xD4,
   0x54, 0xEF, 0x71, 0x14, 0xCC, 0x1C, 0x58, 0x91,
   0x11, 0xAA, 0x80, 0xF4, 0x2C, 0xFC, 0x9F, 0x5F,
@@ -4208,7 +4208,7 @@ static unsigned char vfs5011_init_15[] = { /* 3794 B */
   0xD3, 0x68,
 };
 
-static unsigned char vfs5011_init_16[] = { /* 2565 B */
+static const unsigned char vfs5011_init_16[] = { /* 2565 B */
   0x02, 0xF0, 0x00, 0x14, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -4532,7 +4532,7 @@ static unsigned char vfs5011_init_16[] = { /* 2565 B */
   0x00, 0x20, 0x28, 0x00, 0x00,
 };
 
-static unsigned char vfs5011_init_17[] = { /* 117 B */
+static const unsigned char vfs5011_init_17[] = { /* 117 B */
   0x2A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x01, 0xFF, 0x00, 0x00, 0xFF, 0xF4, 0x01, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
@@ -4550,7 +4550,7 @@ static unsigned char vfs5011_init_17[] = { /* 117 B */
   0x00, 0x20, 0xBF, 0x02, 0x00,
 };
 
-static unsigned char vfs5011_init_18[] = { /* 2903 B */
+static const unsigned char vfs5011_init_18[] = { /* 2903 B */
   0x02, 0xF0, 0x00, 0x00, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -4916,11 +4916,11 @@ static unsigned char vfs5011_init_18[] = { /* 2903 B */
   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
 };
 
-static unsigned char vfs5011_cmd_04[] = { /* 1 B */
+static const unsigned char vfs5011_cmd_04[] = { /* 1 B */
   0x04,
 };
 
-static unsigned char vfs5011_prepare_00[] = { /* 578 B */
+static const unsigned char vfs5011_prepare_00[] = { /* 578 B */
   0x06, 0x9C, 0xF1, 0x9D, 0x71, 0xC3, 0x13, 0xDF,
   0x5F, 0xE4, 0x7A, 0x1F, 0xC7, 0x17, 0x53, 0x9A,
   0x1A, 0xA1, 0xD7, 0xB6, 0x6E, 0xBE, 0xDF, 0x1F,
@@ -4996,7 +4996,7 @@ static unsigned char vfs5011_prepare_00[] = { /* 578 B */
   0xF3, 0x48,
 };
 
-static unsigned char vfs5011_prepare_01[] = { /* 3794 B */
+static const unsigned char vfs5011_prepare_01[] = { /* 3794 B */
   0x06, 0x6B, 0x06, 0x6A, 0x76, 0xC8, 0x18, 0xD4,
   0x54, 0xEF, 0x71, 0x14, 0xCC, 0x1C, 0x58, 0x91,
   0x11, 0xAA, 0x80, 0xF4, 0x2C, 0xFC, 0x9F, 0x5F,
@@ -5474,7 +5474,7 @@ static unsigned char vfs5011_prepare_01[] = { /* 3794 B */
   0xD3, 0x68,
 };
 
-static unsigned char vfs5011_prepare_02[] = { /* 2565 B */
+static const unsigned char vfs5011_prepare_02[] = { /* 2565 B */
   0x02, 0xF0, 0x00, 0x14, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
@@ -5798,7 +5798,7 @@ static unsigned char vfs5011_prepare_02[] = { /* 2565 B */
   0x00, 0x20, 0x28, 0x00, 0x00,
 };
 
-static unsigned char vfs5011_prepare_03[] = { /* 117 B */
+static const unsigned char vfs5011_prepare_03[] = { /* 117 B */
   0x2A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x01, 0xFF, 0x00, 0x00, 0xFF, 0xF4, 0x01, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
@@ -5816,7 +5816,7 @@ static unsigned char vfs5011_prepare_03[] = { /* 117 B */
   0x00, 0x20, 0xBF, 0x02, 0x00,
 };
 
-static unsigned char vfs5011_prepare_04[] = { /* 2903 B */
+static const unsigned char vfs5011_prepare_04[] = { /* 2903 B */
   0x02, 0xF0, 0x00, 0x00, 0x00, 0x03, 0x00, 0x09,
   0x00, 0x04, 0x20, 0x04, 0x30, 0x00, 0x00, 0x00,
   0x00, 0x04, 0x03, 0x00, 0x09, 0x00, 0x18, 0x20,
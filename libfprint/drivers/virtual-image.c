@@ -23,6 +23,16 @@
  * python script is provided to connect to it via a socket, allowing
  * prints to be sent to this device programmatically.
  * Using this it is possible to test libfprint and fprintd.
+ *
+ * For load testing, the client can switch to a throughput mode. Images
+ * are then queued as they arrive and one is fed into every capture as soon
+ * as the device waits for a finger, with the finger status reported
+ * automatically. A client can simply stream a batch of images and run
+ * capture, enroll, verify or identify back to back against it.
+ *
+ * If FP_VIRTUAL_IMAGE points to a capture archive rather than a socket,
+ * the images recorded in it (see FP_CAPTURE_RECORD) are replayed in the
+ * same way, together with the frames that were recorded for each image.
  */
 
 #define FP_COMPONENT "virtual_image"
@@ -31,11 +41,16 @@
 
 #include "../fpi-image.h"
 #include "../fpi-image-device.h"
+#include "../fpi-capture-recorder.h"
 
 #include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <gio/gunixsocketaddress.h>
 
+/* Images received ahead of time in throughput mode; reading from the
+ * socket pauses while the queue is full. */
+#define THROUGHPUT_MAX_QUEUED 64
+
 struct _FpDeviceVirtualImage
 {
   FpImageDevice      parent;
@@ -50,6 +65,14 @@ struct _FpDeviceVirtualImage
   gboolean           automatic_finger;
   FpImage           *recv_img;
   gint               recv_img_hdr[2];
+
+  gboolean           throughput;
+  GQueue             queued_imgs;
+  gboolean           recv_paused;
+  GSource           *deliver_source;
+
+  FpiCaptureReader  *replay;
+  GPtrArray         *replay_frames;
 };
 
 G_DECLARE_FINAL_TYPE (FpDeviceVirtualImage, fpi_device_virtual_image, FPI, DEVICE_VIRTUAL_IMAGE, FpImageDevice)
@@ -59,6 +82,110 @@ static void start_listen (FpDeviceVirtualImage *dev);
 static void recv_image (FpDeviceVirtualImage *dev,
                         GInputStream         *stream);
 
+static void
+throughput_clear (FpDeviceVirtualImage *self)
+{
+  FpImage *img;
+
+  while ((img = g_queue_pop_head (&self->queued_imgs)))
+    g_object_unref (img);
+  g_clear_pointer (&self->deliver_source, g_source_destroy);
+  if (self->replay_frames)
+    g_ptr_array_set_size (self->replay_frames, 0);
+}
+
+/* Queues the next image of the archive, and the frames leading up to it */
+static void
+replay_queue_next (FpDeviceVirtualImage *self)
+{
+  g_autoptr(GError) error = NULL;
+  FpiCaptureRecord record;
+
+  if (!self->replay || !g_queue_is_empty (&self->queued_imgs))
+    return;
+
+  g_ptr_array_set_size (self->replay_frames, 0);
+
+  while (fpi_capture_reader_next (self->replay, &record, &error))
+    {
+      if (record.type == FPI_CAPTURE_RECORD_FRAME)
+        {
+          g_ptr_array_add (self->replay_frames, g_object_ref (record.image));
+        }
+      else if (record.type == FPI_CAPTURE_RECORD_IMAGE)
+        {
+          g_queue_push_tail (&self->queued_imgs, g_object_ref (record.image));
+          return;
+        }
+    }
+
+  if (error)
+    g_warning ("Stopping the replay: %s", error->message);
+  else
+    fp_dbg ("Replayed all images of the archive");
+
+  g_ptr_array_set_size (self->replay_frames, 0);
+  g_clear_pointer (&self->replay, fpi_capture_reader_free);
+}
+
+static gboolean
+throughput_deliver_cb (gpointer user_data)
+{
+  FpDeviceVirtualImage *self = FPI_DEVICE_VIRTUAL_IMAGE (user_data);
+  FpImageDevice *device = FP_IMAGE_DEVICE (self);
+  FpiImageDeviceState state;
+
+  self->deliver_source = NULL;
+
+  g_object_get (self, "fpi-image-device-state", &state, NULL);
+  if (state != FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON ||
+      g_queue_is_empty (&self->queued_imgs))
+    return G_SOURCE_REMOVE;
+
+  fpi_image_device_report_finger_status (device, TRUE);
+  if (self->replay_frames && self->replay_frames->len > 0)
+    {
+      guint i;
+
+      for (i = 0; i < self->replay_frames->len; i++)
+        fpi_image_device_report_frame (device, g_ptr_array_index (self->replay_frames, i));
+    }
+  else
+    {
+      fpi_image_device_report_frame (device, g_queue_peek_head (&self->queued_imgs));
+    }
+  fpi_image_device_image_captured (device, g_queue_pop_head (&self->queued_imgs));
+  fpi_image_device_report_finger_status (device, FALSE);
+
+  if (self->replay)
+    {
+      replay_queue_next (self);
+      throughput_schedule_deliver (self);
+    }
+
+  if (self->recv_paused && self->connection)
+    {
+      self->recv_paused = FALSE;
+      recv_image (self, g_io_stream_get_input_stream (G_IO_STREAM (self->connection)));
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Deferred, as this may be called from within a state change */
+static void
+throughput_schedule_deliver (FpDeviceVirtualImage *self)
+{
+  if (self->deliver_source || g_queue_is_empty (&self->queued_imgs))
+    return;
+
+  self->deliver_source = g_idle_source_new ();
+  g_source_set_callback (self->deliver_source, throughput_deliver_cb, self, NULL);
+  g_source_attach (self->deliver_source,
+                   fpi_device_get_main_context (FP_DEVICE (self)));
+  g_source_unref (self->deliver_source);
+}
+
 static void
 recv_image_img_recv_cb (GObject      *source_object,
                         GAsyncResult *res,
@@ -90,8 +217,22 @@ recv_image_img_recv_cb (GObject      *source_object,
   self = FPI_DEVICE_VIRTUAL_IMAGE (user_data);
   device = FP_IMAGE_DEVICE (self);
 
+  if (self->throughput)
+    {
+      g_queue_push_tail (&self->queued_imgs, g_steal_pointer (&self->recv_img));
+      throughput_schedule_deliver (self);
+
+      if (g_queue_get_length (&self->queued_imgs) >= THROUGHPUT_MAX_QUEUED)
+        self->recv_paused = TRUE;
+      else
+        recv_image (self, G_INPUT_STREAM (source_object));
+      return;
+    }
+
   if (self->automatic_finger)
     fpi_image_device_report_finger_status (device, TRUE);
+  /* The whole image is the only frame there is */
+  fpi_image_device_report_frame (device, self->recv_img);
   fpi_image_device_image_captured (device, g_steal_pointer (&self->recv_img));
   if (self->automatic_finger)
     fpi_image_device_report_finger_status (device, FALSE);
@@ -162,6 +303,19 @@ recv_image_hdr_recv_cb (GObject      *source_object,
                                                  !!self->recv_img_hdr[1]);
           break;
 
+        case -5:
+          /* -5 enables/disables the throughput mode, dropping queued images */
+          self->throughput = !!self->recv_img_hdr[1];
+          throughput_clear (self);
+          break;
+
+        case -6:
+          /* -6 sets how long (in ms) the device is kept active after an
+           * operation completed */
+          fpi_image_device_set_keep_active (FP_IMAGE_DEVICE (self),
+                                            MAX (self->recv_img_hdr[1], 0));
+          break;
+
         default:
           /* disconnect client, it didn't play fair */
           g_io_stream_close (G_IO_STREAM (self->connection), NULL, NULL);
@@ -229,6 +383,10 @@ new_connection_cb (GObject *source_object, GAsyncResult *res, gpointer user_data
 
   dev->connection = connection;
   dev->automatic_finger = TRUE;
+  dev->throughput = FALSE;
+  dev->recv_paused = FALSE;
+  throughput_clear (dev);
+  fpi_image_device_set_keep_active (FP_IMAGE_DEVICE (dev), 0);
   stream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
 
   recv_image (dev, stream);
@@ -259,6 +417,23 @@ dev_init (FpImageDevice *dev)
 
   env = fpi_device_get_virtual_env (FP_DEVICE (self));
 
+  if (g_file_test (env, G_FILE_TEST_IS_REGULAR))
+    {
+      self->replay = fpi_capture_reader_new (env, &error);
+      if (!self->replay)
+        {
+          fpi_image_device_open_complete (dev, g_steal_pointer (&error));
+          return;
+        }
+
+      self->replay_frames = g_ptr_array_new_with_free_func (g_object_unref);
+      self->throughput = TRUE;
+      replay_queue_next (self);
+
+      fpi_image_device_open_complete (dev, NULL);
+      return;
+    }
+
   listener = g_socket_listener_new ();
   g_socket_listener_set_backlog (listener, 1);
 
@@ -301,16 +476,30 @@ dev_deinit (FpImageDevice *dev)
   g_clear_object (&self->cancellable);
   g_clear_object (&self->listener);
   g_clear_object (&self->connection);
+  throughput_clear (self);
+  g_clear_pointer (&self->replay, fpi_capture_reader_free);
+  g_clear_pointer (&self->replay_frames, g_ptr_array_unref);
+  self->throughput = FALSE;
 
   fpi_image_device_close_complete (dev, NULL);
 }
 
+static void
+dev_change_state (FpImageDevice *dev, FpiImageDeviceState state)
+{
+  FpDeviceVirtualImage *self = FPI_DEVICE_VIRTUAL_IMAGE (dev);
+
+  if (self->throughput && state == FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON)
+    throughput_schedule_deliver (self);
+}
+
 static void
 fpi_device_virtual_image_init (FpDeviceVirtualImage *self)
 {
+  g_queue_init (&self->queued_imgs);
 }
 
-static const FpIdEntry driver_ids[] = {
+const FpIdEntry fpi_device_virtual_image_id_table[] = {
   { .virtual_envvar = "FP_VIRTUAL_IMAGE" },
   { .virtual_envvar = NULL }
 };
@@ -324,8 +513,9 @@ fpi_device_virtual_image_class_init (FpDeviceVirtualImageClass *klass)
   dev_class->id = FP_COMPONENT;
   dev_class->full_name = "Virtual image device for debugging";
   dev_class->type = FP_DEVICE_TYPE_VIRTUAL;
-  dev_class->id_table = driver_ids;
+  dev_class->id_table = fpi_device_virtual_image_id_table;
 
   img_class->img_open = dev_init;
   img_class->img_close = dev_deinit;
+  img_class->change_state = dev_change_state;
 }
@@ -0,0 +1,642 @@
+/*
+ * Virtual driver for devices that match on the sensor and store prints
+ *
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This is a virtual driver for the flows of devices that keep the prints
+ * in their own storage, like synaptics and vfs0097: enrolling into the
+ * storage, verify and identify against it, listing and deleting. The
+ * storage is a database in memory, so these flows can be tested and
+ * benchmarked without the hardware.
+ *
+ * The device is configured through the FP_VIRTUAL_STORAGE environment
+ * variable, a comma separated list of options:
+ *
+ *   capacity=N         prints the storage holds (default 100)
+ *   prints=N           prints that are stored when the device is created
+ *   enroll-stages=N    number of enroll stages (default 5)
+ *   latency=MS         latency of every command
+ *   CMD-latency=MS     latency of one command, overriding latency
+ *   list-item-latency=MS  additional latency per listed print
+ *   fail-CMD=N         every Nth CMD command fails
+ *   retry=N            every Nth scan has to be retried
+ *   miss=N             every Nth scan does not match any stored print
+ *
+ * where CMD is one of open, close, enroll, verify, identify, list, delete
+ * or clear. Any other value, e.g. "1", uses the defaults.
+ *
+ * Verify scans the finger that is verified. Identify scans the stored
+ * prints in turn, so that every identification matches a different one.
+ * Everything is deterministic, the same options and operations always
+ * give the same results.
+ */
+
+#define FP_COMPONENT "virtual_storage"
+
+#include "fpi-log.h"
+#include "fpi-device.h"
+#include "fpi-print.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+  CMD_OPEN,
+  CMD_CLOSE,
+  CMD_ENROLL,
+  CMD_VERIFY,
+  CMD_IDENTIFY,
+  CMD_LIST,
+  CMD_DELETE,
+  CMD_CLEAR,
+  N_CMDS
+} VirtualStorageCmd;
+
+static const gchar *cmd_names[N_CMDS] = {
+  "open", "close", "enroll", "verify", "identify", "list", "delete", "clear",
+};
+
+struct _FpDeviceVirtualStorage
+{
+  FpDevice   parent;
+
+  guint      capacity;
+  guint      initial_prints;
+  guint      enroll_stages;
+  guint      latency[N_CMDS];
+  guint      list_item_latency;
+  guint      fail_every[N_CMDS];
+  guint      retry_every;
+  guint      miss_every;
+
+  /* The IDs of the stored prints */
+  GPtrArray *storage;
+
+  guint      n_cmds[N_CMDS];
+  guint      n_scans;
+  guint      n_identified;
+
+  GSource   *pending;
+  gint       enroll_stage;
+  guint      list_pos;
+};
+
+G_DECLARE_FINAL_TYPE (FpDeviceVirtualStorage, fpi_device_virtual_storage, FPI, DEVICE_VIRTUAL_STORAGE, FpDevice)
+G_DEFINE_TYPE (FpDeviceVirtualStorage, fpi_device_virtual_storage, FP_TYPE_DEVICE)
+
+static void
+parse_config (FpDeviceVirtualStorage *self, const gchar *config)
+{
+  g_auto(GStrv) options = g_strsplit (config, ",", -1);
+  guint latency = 0;
+  gint latencies[N_CMDS];
+  guint i, j;
+
+  self->capacity = 100;
+  self->enroll_stages = 5;
+
+  for (j = 0; j < N_CMDS; j++)
+    latencies[j] = -1;
+
+  for (i = 0; options[i]; i++)
+    {
+      g_autofree gchar *key = NULL;
+      const gchar *value = strchr (options[i], '=');
+      guint n;
+
+      if (!value)
+        continue;
+
+      key = g_strndup (options[i], value - options[i]);
+      n = MIN (strtoul (value + 1, NULL, 10), G_MAXINT);
+
+      if (g_str_equal (key, "capacity"))
+        self->capacity = n;
+      else if (g_str_equal (key, "prints"))
+        self->initial_prints = n;
+      else if (g_str_equal (key, "enroll-stages"))
+        self->enroll_stages = MAX (n, 1);
+      else if (g_str_equal (key, "latency"))
+        latency = n;
+      else if (g_str_equal (key, "list-item-latency"))
+        self->list_item_latency = n;
+      else if (g_str_equal (key, "retry"))
+        self->retry_every = n;
+      else if (g_str_equal (key, "miss"))
+        self->miss_every = n;
+      else
+        for (j = 0; j < N_CMDS; j++)
+          {
+            g_autofree gchar *latency_key = g_strconcat (cmd_names[j], "-latency", NULL);
+            g_autofree gchar *fail_key = g_strconcat ("fail-", cmd_names[j], NULL);
+
+            if (g_str_equal (key, latency_key))
+              latencies[j] = n;
+            else if (g_str_equal (key, fail_key))
+              self->fail_every[j] = n;
+          }
+    }
+
+  for (j = 0; j < N_CMDS; j++)
+    self->latency[j] = latencies[j] >= 0 ? (guint) latencies[j] : latency;
+}
+
+static FpPrint *
+storage_print_new (FpDeviceVirtualStorage *self, const gchar *id)
+{
+  FpPrint *print = fp_print_new (FP_DEVICE (self));
+
+  fpi_print_set_type (print, FPI_PRINT_RAW);
+  fpi_print_set_device_stored (print, TRUE);
+  g_object_set (print, "fpi-data", g_variant_new_string (id), NULL);
+  fpi_print_fill_from_user_id (print, id);
+
+  return print;
+}
+
+static const gchar *
+print_get_id (FpPrint *print)
+{
+  g_autoptr(GVariant) data = NULL;
+
+  g_object_get (print, "fpi-data", &data, NULL);
+  if (!data || !g_variant_is_of_type (data, G_VARIANT_TYPE_STRING))
+    return NULL;
+
+  /* The print keeps the variant alive */
+  return g_variant_get_string (data, NULL);
+}
+
+static gint
+storage_find (FpDeviceVirtualStorage *self, const gchar *id)
+{
+  guint i;
+
+  for (i = 0; id && i < self->storage->len; i++)
+    if (g_str_equal (g_ptr_array_index (self->storage, i), id))
+      return i;
+
+  return -1;
+}
+
+static void
+storage_add (FpDeviceVirtualStorage *self, FpPrint *print)
+{
+  g_autofree gchar *base_id = fpi_print_generate_user_id (print);
+  g_autofree gchar *id = g_strdup (base_id);
+  guint n = 1;
+
+  /* The random part of the ID is fixed when emulating */
+  while (storage_find (self, id) >= 0)
+    {
+      g_free (id);
+      id = g_strdup_printf ("%s-%u", base_id, n++);
+    }
+
+  g_ptr_array_add (self->storage, g_strdup (id));
+  g_object_set (print, "fpi-data", g_variant_new_string (id), NULL);
+}
+
+/* Every command completes after its latency, or fails if a failure was
+ * injected for it */
+static void
+fail_cb (FpDevice *device, gpointer user_data)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+
+  self->pending = NULL;
+  fpi_device_action_error (device,
+                           fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
+                                                     "Injected %s failure",
+                                                     (const gchar *) user_data));
+}
+
+static void
+run_cmd (FpDeviceVirtualStorage *self,
+         VirtualStorageCmd       cmd,
+         guint                   extra_latency,
+         FpTimeoutFunc           func)
+{
+  FpDevice *device = FP_DEVICE (self);
+  guint latency = self->latency[cmd] + extra_latency;
+
+  g_assert (self->pending == NULL);
+
+  self->n_cmds[cmd]++;
+  if (self->fail_every[cmd] > 0 && self->n_cmds[cmd] % self->fail_every[cmd] == 0)
+    self->pending = fpi_device_add_timeout (device, latency, fail_cb,
+                                            (gpointer) cmd_names[cmd], NULL);
+  else
+    self->pending = fpi_device_add_timeout (device, latency, func, NULL, NULL);
+}
+
+typedef enum {
+  SCAN_MATCH,
+  SCAN_MISS,
+  SCAN_RETRY,
+} ScanResult;
+
+static ScanResult
+next_scan (FpDeviceVirtualStorage *self)
+{
+  self->n_scans++;
+
+  if (self->retry_every > 0 && self->n_scans % self->retry_every == 0)
+    return SCAN_RETRY;
+  if (self->miss_every > 0 && self->n_scans % self->miss_every == 0)
+    return SCAN_MISS;
+  return SCAN_MATCH;
+}
+
+static void
+dev_open_cb (FpDevice *device, gpointer user_data)
+{
+  FPI_DEVICE_VIRTUAL_STORAGE (device)->pending = NULL;
+  fpi_device_open_complete (device, NULL);
+}
+
+static void
+dev_open (FpDevice *device)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+
+  fpi_device_set_nr_enroll_stages (device, self->enroll_stages);
+  run_cmd (self, CMD_OPEN, 0, dev_open_cb);
+}
+
+static void
+dev_close_cb (FpDevice *device, gpointer user_data)
+{
+  FPI_DEVICE_VIRTUAL_STORAGE (device)->pending = NULL;
+  fpi_device_close_complete (device, NULL);
+}
+
+static void
+dev_close (FpDevice *device)
+{
+  run_cmd (FPI_DEVICE_VIRTUAL_STORAGE (device), CMD_CLOSE, 0, dev_close_cb);
+}
+
+static void
+dev_enroll_cb (FpDevice *device, gpointer user_data)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+  FpPrint *print = NULL;
+
+  self->pending = NULL;
+  fpi_device_get_enroll_data (device, &print);
+
+  if (next_scan (self) == SCAN_RETRY)
+    {
+      fpi_device_enroll_progress (device, self->enroll_stage, NULL,
+                                  fpi_device_retry_new (FP_DEVICE_RETRY_GENERAL));
+      run_cmd (self, CMD_ENROLL, 0, dev_enroll_cb);
+      return;
+    }
+
+  self->enroll_stage++;
+  fpi_device_enroll_progress (device, self->enroll_stage, NULL, NULL);
+
+  if (self->enroll_stage < self->enroll_stages)
+    {
+      run_cmd (self, CMD_ENROLL, 0, dev_enroll_cb);
+      return;
+    }
+
+  if (self->storage->len >= self->capacity)
+    {
+      fpi_device_enroll_complete (device, NULL,
+                                  fpi_device_error_new (FP_DEVICE_ERROR_DATA_FULL));
+      return;
+    }
+
+  fpi_print_set_type (print, FPI_PRINT_RAW);
+  fpi_print_set_device_stored (print, TRUE);
+  storage_add (self, print);
+
+  fpi_device_enroll_complete (device, g_object_ref (print), NULL);
+}
+
+static void
+dev_enroll (FpDevice *device)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+
+  self->enroll_stage = 0;
+  run_cmd (self, CMD_ENROLL, 0, dev_enroll_cb);
+}
+
+static void
+dev_verify_cb (FpDevice *device, gpointer user_data)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+  FpPrint *print = NULL;
+  const gchar *id;
+
+  self->pending = NULL;
+  fpi_device_get_verify_data (device, &print);
+  id = print_get_id (print);
+
+  switch (next_scan (self))
+    {
+    case SCAN_RETRY:
+      fpi_device_verify_report (device, FPI_MATCH_ERROR, NULL,
+                                fpi_device_retry_new (FP_DEVICE_RETRY_GENERAL));
+      break;
+
+    case SCAN_MATCH:
+      if (storage_find (self, id) >= 0)
+        {
+          fpi_device_verify_report (device, FPI_MATCH_SUCCESS,
+                                    storage_print_new (self, id), NULL);
+          break;
+        }
+    /* fall through */
+
+    case SCAN_MISS:
+      fpi_device_verify_report (device, FPI_MATCH_FAIL, NULL, NULL);
+      break;
+    }
+
+  fpi_device_verify_complete (device, NULL);
+}
+
+static void
+dev_verify (FpDevice *device)
+{
+  run_cmd (FPI_DEVICE_VIRTUAL_STORAGE (device), CMD_VERIFY, 0, dev_verify_cb);
+}
+
+static void
+dev_identify_cb (FpDevice *device, gpointer user_data)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+  GPtrArray *prints = NULL;
+  const gchar *id;
+  guint i;
+
+  self->pending = NULL;
+  fpi_device_get_identify_data (device, &prints);
+
+  switch (next_scan (self))
+    {
+    case SCAN_RETRY:
+      fpi_device_identify_report (device, NULL, NULL,
+                                  fpi_device_retry_new (FP_DEVICE_RETRY_GENERAL));
+      break;
+
+    case SCAN_MATCH:
+      if (self->storage->len > 0)
+        {
+          id = g_ptr_array_index (self->storage, self->n_identified++ % self->storage->len);
+
+          for (i = 0; i < prints->len; i++)
+            {
+              FpPrint *template = g_ptr_array_index (prints, i);
+
+              if (g_strcmp0 (print_get_id (template), id) == 0)
+                {
+                  fpi_device_identify_report (device, template,
+                                              storage_print_new (self, id), NULL);
+                  break;
+                }
+            }
+
+          if (i < prints->len)
+            break;
+
+          /* A stored print that is not in the gallery */
+          fpi_device_identify_report (device, NULL, storage_print_new (self, id), NULL);
+          break;
+        }
+    /* fall through */
+
+    case SCAN_MISS:
+      fpi_device_identify_report (device, NULL, NULL, NULL);
+      break;
+    }
+
+  fpi_device_identify_complete (device, NULL);
+}
+
+static void
+dev_identify (FpDevice *device)
+{
+  run_cmd (FPI_DEVICE_VIRTUAL_STORAGE (device), CMD_IDENTIFY, 0, dev_identify_cb);
+}
+
+static void
+dev_list_cb (FpDevice *device, gpointer user_data)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+  const gchar *id;
+
+  self->pending = NULL;
+
+  if (self->list_pos >= self->storage->len)
+    {
+      fpi_device_list_complete (device, NULL, NULL);
+      return;
+    }
+
+  /* Reported one by one, like devices that read one record at a time */
+  id = g_ptr_array_index (self->storage, self->list_pos++);
+  if (!fpi_device_list_report (device, storage_print_new (self, id)))
+    {
+      fpi_device_list_complete (device, NULL, NULL);
+      return;
+    }
+
+  self->pending = fpi_device_add_timeout (device, self->list_item_latency,
+                                          dev_list_cb, NULL, NULL);
+}
+
+static void
+dev_list (FpDevice *device)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+
+  self->list_pos = 0;
+  run_cmd (self, CMD_LIST, self->list_item_latency, dev_list_cb);
+}
+
+static void
+dev_delete_cb (FpDevice *device, gpointer user_data)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+  FpPrint *print = NULL;
+  gint pos;
+
+  self->pending = NULL;
+  fpi_device_get_delete_data (device, &print);
+
+  pos = storage_find (self, print_get_id (print));
+  if (pos < 0)
+    {
+      fpi_device_delete_complete (device,
+                                  fpi_device_error_new (FP_DEVICE_ERROR_DATA_NOT_FOUND));
+      return;
+    }
+
+  g_ptr_array_remove_index (self->storage, pos);
+  fpi_device_delete_complete (device, NULL);
+}
+
+static void
+dev_delete (FpDevice *device)
+{
+  run_cmd (FPI_DEVICE_VIRTUAL_STORAGE (device), CMD_DELETE, 0, dev_delete_cb);
+}
+
+/* A batch costs as much as a single delete, as on devices that take a
+ * list of IDs */
+static void
+dev_delete_prints_cb (FpDevice *device, gpointer user_data)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+  GPtrArray *prints = NULL;
+  guint i;
+
+  self->pending = NULL;
+  fpi_device_get_delete_prints_data (device, &prints);
+
+  for (i = 0; i < prints->len; i++)
+    {
+      gint pos = storage_find (self, print_get_id (g_ptr_array_index (prints, i)));
+
+      if (pos >= 0)
+        g_ptr_array_remove_index (self->storage, pos);
+    }
+
+  fpi_device_delete_complete (device, NULL);
+}
+
+static void
+dev_delete_prints (FpDevice *device)
+{
+  run_cmd (FPI_DEVICE_VIRTUAL_STORAGE (device), CMD_DELETE, 0, dev_delete_prints_cb);
+}
+
+static void
+dev_clear_storage_cb (FpDevice *device, gpointer user_data)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+
+  self->pending = NULL;
+  g_ptr_array_set_size (self->storage, 0);
+  fpi_device_clear_storage_complete (device, NULL);
+}
+
+static void
+dev_clear_storage (FpDevice *device)
+{
+  run_cmd (FPI_DEVICE_VIRTUAL_STORAGE (device), CMD_CLEAR, 0, dev_clear_storage_cb);
+}
+
+static void
+dev_cancel (FpDevice *device)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+  FpiDeviceAction action = fpi_device_get_current_action (device);
+
+  /* Only the operations that wait for a finger can be cancelled */
+  if (!self->pending ||
+      (action != FPI_DEVICE_ACTION_ENROLL &&
+       action != FPI_DEVICE_ACTION_VERIFY &&
+       action != FPI_DEVICE_ACTION_IDENTIFY))
+    return;
+
+  g_clear_pointer (&self->pending, g_source_destroy);
+  fpi_device_action_error (device,
+                           g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                                "Cancelled"));
+}
+
+static void
+dev_probe (FpDevice *device)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (device);
+  guint n_prints, i;
+
+  parse_config (self, fpi_device_get_virtual_env (device));
+
+  /* Fill the storage with prints of made up users */
+  n_prints = MIN (self->initial_prints, self->capacity);
+  for (i = 0; i < n_prints; i++)
+    {
+      g_autoptr(FpPrint) print = fp_print_new (device);
+      g_autofree gchar *username = g_strdup_printf ("user%u", i + 1);
+
+      g_object_ref_sink (print);
+      fp_print_set_finger (print, FP_FINGER_FIRST + i % (FP_FINGER_LAST - FP_FINGER_FIRST + 1));
+      fp_print_set_username (print, username);
+      storage_add (self, print);
+    }
+
+  fpi_device_probe_complete (device, NULL, NULL, NULL);
+}
+
+static void
+fpi_device_virtual_storage_finalize (GObject *object)
+{
+  FpDeviceVirtualStorage *self = FPI_DEVICE_VIRTUAL_STORAGE (object);
+
+  g_clear_pointer (&self->storage, g_ptr_array_unref);
+
+  G_OBJECT_CLASS (fpi_device_virtual_storage_parent_class)->finalize (object);
+}
+
+static void
+fpi_device_virtual_storage_init (FpDeviceVirtualStorage *self)
+{
+  self->storage = g_ptr_array_new_with_free_func (g_free);
+}
+
+const FpIdEntry fpi_device_virtual_storage_id_table[] = {
+  { .virtual_envvar = "FP_VIRTUAL_STORAGE" },
+  { .virtual_envvar = NULL }
+};
+
+static void
+fpi_device_virtual_storage_class_init (FpDeviceVirtualStorageClass *klass)
+{
+  FpDeviceClass *dev_class = FP_DEVICE_CLASS (klass);
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = fpi_device_virtual_storage_finalize;
+
+  dev_class->id = FP_COMPONENT;
+  dev_class->full_name = "Virtual device with print storage for debugging";
+  dev_class->type = FP_DEVICE_TYPE_VIRTUAL;
+  dev_class->id_table = fpi_device_virtual_storage_id_table;
+  dev_class->scan_type = FP_SCAN_TYPE_PRESS;
+  dev_class->nr_enroll_stages = 5;
+
+  dev_class->probe = dev_probe;
+  dev_class->open = dev_open;
+  dev_class->close = dev_close;
+  dev_class->enroll = dev_enroll;
+  dev_class->verify = dev_verify;
+  dev_class->identify = dev_identify;
+  dev_class->list = dev_list;
+  dev_class->delete = dev_delete;
+  dev_class->delete_prints = dev_delete_prints;
+  dev_class->clear_storage = dev_clear_storage;
+  dev_class->cancel = dev_cancel;
+}
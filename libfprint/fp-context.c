@@ -22,6 +22,7 @@
 
 #include "fpi-context.h"
 #include "fpi-device.h"
+#include "fpi-worker.h"
 #include <gusb.h>
 
 /**
@@ -34,18 +35,107 @@
  *
  * The <link linkend="device-added">device-added</link> and device-removed signals allow you to handle devices
  * that may be hotplugged at runtime.
+ *
+ * Devices are probed concurrently, up to a small limit, and a device that
+ * does not finish probing within the timeout of its driver is ignored.
+ * Devices that are hotplugged after enumeration are probed in the
+ * background once the main loop is idle.
+ *
+ * A context belongs to the thread-default #GMainContext of the thread that
+ * created it. Probing, hotplug handling and the device-added and
+ * device-removed signals are all dispatched in that main context, even if
+ * USB hotplug events arrive elsewhere, so handlers never run concurrently.
+ * fp_context_enumerate() and fp_context_dup_devices() may be called from
+ * any thread, but while another thread iterates the main context of the
+ * context they only return once that thread dispatched the enumeration.
+ * fp_context_get_devices() returns the array that the context modifies,
+ * so it must only be used from the thread that iterates the main context.
+ *
+ * The found devices dispatch their operations in the main context of the
+ * caller that started the operation, see #FpDevice, so different threads
+ * can drive different devices at the same time.
  */
 
+/* Number of devices that are probed at the same time */
+#define FP_CONTEXT_MAX_PROBES 4
+
+/* Probe timeout for drivers that do not set one */
+#define FP_CONTEXT_PROBE_TIMEOUT 10000
+
+/* How long a removed USB device is remembered, in microseconds */
+#define FP_CONTEXT_REMOVED_TIMEOUT (30 * G_USEC_PER_SEC)
+
+typedef struct
+{
+  FpContext    *context;
+  GType         driver;
+  GUsbDevice   *usb_device;
+  gchar        *virtual_env;
+  guint64       driver_data;
+
+  GCancellable *cancellable;
+  GCancellable *context_cancellable;
+  gulong        cancellable_id;
+  GSource      *timeout_source;
+  gint64        start_time;
+  gboolean      done;
+} FpContextProbe;
+
+/* A driver that binds to a USB ID, see usb_id_index */
+typedef struct
+{
+  const FpiDriverInfo *driver;
+  const FpIdEntry     *entry;
+} FpContextUsbCandidate;
+
+#define USB_ID_KEY(vid, pid) GUINT_TO_POINTER (((guint) (vid) << 16) | (pid))
+
+/* A recently removed USB device, see removed_devices */
+typedef struct
+{
+  GType   driver;
+  guint64 driver_data;
+  gint64  removed_time;
+} FpContextRemovedDevice;
+
+/* A USB hotplug event, forwarded to the main context of the context */
+typedef struct
+{
+  FpContext  *context;
+  GUsbDevice *device;
+  gboolean    added;
+} FpContextHotplug;
+
 typedef struct
 {
   GUsbContext  *usb_ctx;
   GCancellable *cancellable;
+  GMainContext *main_context;
+
+  /* Protects @devices and the enumeration state, which other threads
+   * read. Everything else is only used in @main_context. */
+  GMutex        lock;
+  GCond         cond;
 
   gint          pending_devices;
   gboolean      enumerated;
+  gboolean      enumerating;
+  gboolean      enumeration_done;
+
+  GQueue        queued_probes;
+  GPtrArray    *running_probes;
+  GSource      *probe_idle_source;
+
+  /* Built once in fp_context_init() and then only read */
+  GPtrArray    *virtual_drivers;
+  GHashTable   *usb_id_index;
 
-  GArray       *drivers;
   GPtrArray    *devices;
+
+  /* Devices that were removed shortly before, keyed by USB ID and port. If
+   * one comes back, e.g. from a flaky dock, it skips the driver discovery
+   * and is probed first. The drivers keep their own state per USB port. */
+  GHashTable   *removed_devices;
 } FpContextPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (FpContext, fp_context, G_TYPE_OBJECT)
@@ -57,6 +147,16 @@ enum {
 };
 static guint signals[LAST_SIGNAL] = { 0 };
 
+enum {
+  PROP_0,
+  PROP_MAX_WORKER_THREADS,
+  PROP_WORKER_NICE,
+  PROP_EFFICIENCY_MODE,
+  N_PROPS
+};
+
+static GParamSpec *properties[N_PROPS];
+
 static const char *
 get_drivers_whitelist_env (void)
 {
@@ -86,22 +186,124 @@ is_driver_allowed (const gchar *driver)
   return FALSE;
 }
 
+static void fp_context_start_probes (FpContext *context);
+
+/* Attaches @source to the main context of @context. Unlike g_timeout_add()
+ * and g_idle_add(), this works for contexts that live in another thread. */
+static GSource *
+fp_context_attach_source (FpContext  *context,
+                          GSource    *source,
+                          gint        priority,
+                          GSourceFunc func,
+                          gpointer    user_data)
+{
+  FpContextPrivate *priv = fp_context_get_instance_private (context);
+
+  g_source_set_priority (source, priority);
+  g_source_set_callback (source, func, user_data, NULL);
+  g_source_attach (source, priv->main_context);
+
+  return source;
+}
+
+static void
+fp_context_clear_source (GSource **source)
+{
+  if (!*source)
+    return;
+
+  g_source_destroy (*source);
+  g_clear_pointer (source, g_source_unref);
+}
+
+static void
+fp_context_probe_free (FpContextProbe *probe)
+{
+  fp_context_clear_source (&probe->timeout_source);
+  if (probe->cancellable_id)
+    g_cancellable_disconnect (probe->context_cancellable, probe->cancellable_id);
+  g_clear_object (&probe->context_cancellable);
+  g_clear_object (&probe->cancellable);
+  g_clear_object (&probe->usb_device);
+  g_free (probe->virtual_env);
+  g_free (probe);
+}
+
+/* Releases the slot of a probe, the probe itself is freed once the
+ * initialization returns. */
+static void
+fp_context_probe_finish (FpContextProbe *probe)
+{
+  FpContext *context = probe->context;
+  FpContextPrivate *priv;
+
+  probe->done = TRUE;
+  fp_context_clear_source (&probe->timeout_source);
+
+  if (!context)
+    return;
+
+  priv = fp_context_get_instance_private (context);
+  g_ptr_array_remove_fast (priv->running_probes, probe);
+  priv->pending_devices--;
+  probe->context = NULL;
+
+  fp_context_start_probes (context);
+}
+
+static gboolean
+fp_context_probe_timeout_cb (gpointer user_data)
+{
+  FpContextProbe *probe = user_data;
+
+  g_clear_pointer (&probe->timeout_source, g_source_unref);
+
+  g_message ("Ignoring %s device, probing did not finish in time",
+             g_type_name (probe->driver));
+
+  /* The driver may not react to the cancellation, so give up right away */
+  g_cancellable_cancel (probe->cancellable);
+  fp_context_probe_finish (probe);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 async_device_init_done_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
   g_autoptr(GError) error = NULL;
-  FpDevice *device;
-  FpContext *context;
+  FpContextProbe *probe = user_data;
+  FpContext *context = probe->context;
   FpContextPrivate *priv;
+  FpDevice *device;
 
   device = FP_DEVICE (g_async_initable_new_finish (G_ASYNC_INITABLE (source_object),
                                                    res, &error));
-  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-    return;
 
-  context = FP_CONTEXT (user_data);
+  /* Timed out, or the context is gone */
+  if (probe->done || !context)
+    {
+      g_clear_object (&device);
+      fp_context_probe_free (probe);
+      return;
+    }
+
+  g_debug ("Probing %s device took %" G_GINT64_FORMAT " ms",
+           g_type_name (probe->driver),
+           (g_get_monotonic_time () - probe->start_time) / 1000);
+
+  /* Add the device before the probe is done, so that threads waiting for
+   * the enumeration see it */
   priv = fp_context_get_instance_private (context);
-  priv->pending_devices--;
+  if (!error)
+    {
+      g_mutex_lock (&priv->lock);
+      g_ptr_array_add (priv->devices, g_object_ref (device));
+      g_mutex_unlock (&priv->lock);
+    }
+
+  fp_context_probe_finish (probe);
+  fp_context_probe_free (probe);
 
   if (error)
     {
@@ -109,51 +311,244 @@ async_device_init_done_cb (GObject *source_object, GAsyncResult *res, gpointer u
       return;
     }
 
-  g_ptr_array_add (priv->devices, device);
   g_signal_emit (context, signals[DEVICE_ADDED_SIGNAL], 0, device);
+  g_object_unref (device);
 }
 
 static void
-usb_device_added_cb (FpContext *self, GUsbDevice *device, GUsbContext *usb_ctx)
+on_context_cancelled (GCancellable *cancellable,
+                      GCancellable *probe_cancellable)
+{
+  g_cancellable_cancel (probe_cancellable);
+}
+
+static void
+fp_context_run_probe (FpContext *context, FpContextProbe *probe)
+{
+  FpContextPrivate *priv = fp_context_get_instance_private (context);
+  g_autoptr(FpDeviceClass) cls = g_type_class_ref (probe->driver);
+  guint timeout = cls->probe_timeout ? cls->probe_timeout : FP_CONTEXT_PROBE_TIMEOUT;
+
+  g_ptr_array_add (priv->running_probes, probe);
+
+  probe->cancellable = g_cancellable_new ();
+  probe->context_cancellable = g_object_ref (priv->cancellable);
+  probe->cancellable_id = g_cancellable_connect (priv->cancellable,
+                                                 G_CALLBACK (on_context_cancelled),
+                                                 probe->cancellable, NULL);
+  probe->timeout_source = fp_context_attach_source (context,
+                                                    g_timeout_source_new (timeout),
+                                                    G_PRIORITY_DEFAULT,
+                                                    fp_context_probe_timeout_cb,
+                                                    probe);
+  probe->start_time = g_get_monotonic_time ();
+
+  /* The initialization and the device are bound to the thread-default
+   * context, which may not be the one of this context when enumerating
+   * from another thread */
+  g_main_context_push_thread_default (priv->main_context);
+  g_async_initable_new_async (probe->driver,
+                              G_PRIORITY_LOW,
+                              probe->cancellable,
+                              async_device_init_done_cb,
+                              probe,
+                              "fpi-usb-device", probe->usb_device,
+                              "fpi-environ", probe->virtual_env,
+                              "fpi-driver-data", probe->driver_data,
+                              NULL);
+  g_main_context_pop_thread_default (priv->main_context);
+}
+
+static void
+fp_context_start_probes (FpContext *context)
+{
+  FpContextPrivate *priv = fp_context_get_instance_private (context);
+
+  while (priv->running_probes->len < FP_CONTEXT_MAX_PROBES &&
+         !g_queue_is_empty (&priv->queued_probes))
+    fp_context_run_probe (context, g_queue_pop_head (&priv->queued_probes));
+}
+
+static gboolean
+fp_context_start_probes_idle_cb (gpointer user_data)
+{
+  FpContext *context = user_data;
+  FpContextPrivate *priv = fp_context_get_instance_private (context);
+
+  g_clear_pointer (&priv->probe_idle_source, g_source_unref);
+  fp_context_start_probes (context);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Queues a device for probing. Devices found during enumeration are started
+ * by fp_context_enumerate(), hotplugged ones in the background once idle.
+ * With @first the device is probed before all others that are queued. */
+static void
+fp_context_queue_probe (FpContext  *context,
+                        GType       driver,
+                        GUsbDevice *usb_device,
+                        const char *virtual_env,
+                        guint64     driver_data,
+                        gboolean    first)
+{
+  FpContextPrivate *priv = fp_context_get_instance_private (context);
+  FpContextProbe *probe = g_new0 (FpContextProbe, 1);
+
+  probe->context = context;
+  probe->driver = driver;
+  probe->usb_device = usb_device ? g_object_ref (usb_device) : NULL;
+  probe->virtual_env = g_strdup (virtual_env);
+  probe->driver_data = driver_data;
+
+  priv->pending_devices++;
+  if (first)
+    g_queue_push_head (&priv->queued_probes, probe);
+  else
+    g_queue_push_tail (&priv->queued_probes, probe);
+
+  if (!priv->enumerating && !priv->probe_idle_source)
+    priv->probe_idle_source = fp_context_attach_source (context,
+                                                        g_idle_source_new (),
+                                                        G_PRIORITY_LOW,
+                                                        fp_context_start_probes_idle_cb,
+                                                        context);
+}
+
+static gchar *
+usb_device_get_removed_key (GUsbDevice *device)
+{
+  const gchar *platform_id = g_usb_device_get_platform_id (device);
+
+  if (!platform_id)
+    return NULL;
+
+  return g_strdup_printf ("%04x:%04x:%s",
+                          g_usb_device_get_vid (device),
+                          g_usb_device_get_pid (device),
+                          platform_id);
+}
+
+static gboolean
+removed_device_expired (gpointer key, gpointer value, gpointer user_data)
+{
+  FpContextRemovedDevice *removed = value;
+  gint64 now = *(gint64 *) user_data;
+
+  return now - removed->removed_time > FP_CONTEXT_REMOVED_TIMEOUT;
+}
+
+static void
+fp_context_remember_removed (FpContext  *self,
+                             GUsbDevice *device,
+                             GType       driver,
+                             guint64     driver_data)
+{
+  FpContextPrivate *priv = fp_context_get_instance_private (self);
+  FpContextRemovedDevice *removed;
+  gchar *key = usb_device_get_removed_key (device);
+  gint64 now = g_get_monotonic_time ();
+
+  g_hash_table_foreach_remove (priv->removed_devices, removed_device_expired, &now);
+
+  if (!key)
+    return;
+
+  removed = g_new0 (FpContextRemovedDevice, 1);
+  removed->driver = driver;
+  removed->driver_data = driver_data;
+  removed->removed_time = now;
+  g_hash_table_replace (priv->removed_devices, key, removed);
+}
+
+/* Drops the probes of a USB device that went away */
+static void
+fp_context_cancel_probes (FpContext *self, GUsbDevice *device)
+{
+  FpContextPrivate *priv = fp_context_get_instance_private (self);
+  GList *l, *next;
+  gint i;
+
+  for (l = priv->queued_probes.head; l; l = next)
+    {
+      FpContextProbe *probe = l->data;
+
+      next = l->next;
+      if (probe->usb_device != device)
+        continue;
+
+      fp_context_remember_removed (self, device, probe->driver, probe->driver_data);
+      g_queue_delete_link (&priv->queued_probes, l);
+      priv->pending_devices--;
+      fp_context_probe_free (probe);
+    }
+
+  /* Running probes are freed once the initialization returns */
+  for (i = priv->running_probes->len - 1; i >= 0; i--)
+    {
+      FpContextProbe *probe = g_ptr_array_index (priv->running_probes, i);
+
+      if (probe->usb_device != device)
+        continue;
+
+      fp_context_remember_removed (self, device, probe->driver, probe->driver_data);
+      g_cancellable_cancel (probe->cancellable);
+      fp_context_probe_finish (probe);
+    }
+}
+
+static void
+usb_device_added (FpContext *self, GUsbDevice *device)
 {
   FpContextPrivate *priv = fp_context_get_instance_private (self);
   GType found_driver = G_TYPE_NONE;
   const FpIdEntry *found_entry = NULL;
   gint found_score = 0;
-  gint i;
+  g_autofree gchar *removed_key = NULL;
+  FpContextRemovedDevice *removed = NULL;
+  GArray *candidates;
+  guint i;
   guint16 pid, vid;
 
   pid = g_usb_device_get_pid (device);
   vid = g_usb_device_get_vid (device);
 
-  /* Find the best driver to handle this USB device. */
-  for (i = 0; i < priv->drivers->len; i++)
+  removed_key = usb_device_get_removed_key (device);
+  if (removed_key)
+    removed = g_hash_table_lookup (priv->removed_devices, removed_key);
+  if (removed &&
+      g_get_monotonic_time () - removed->removed_time <= FP_CONTEXT_REMOVED_TIMEOUT)
     {
-      GType driver = g_array_index (priv->drivers, GType, i);
-      g_autoptr(FpDeviceClass) cls = g_type_class_ref (driver);
-      const FpIdEntry *entry;
-
-      if (cls->type != FP_DEVICE_TYPE_USB)
-        continue;
+      g_debug ("USB device %04X:%04X at %s was removed recently, probing it first",
+               vid, pid, g_usb_device_get_platform_id (device));
+      fp_context_queue_probe (self, removed->driver, device, NULL,
+                              removed->driver_data, TRUE);
+      g_hash_table_remove (priv->removed_devices, removed_key);
+      return;
+    }
+  if (removed)
+    g_hash_table_remove (priv->removed_devices, removed_key);
 
-      for (entry = cls->id_table; entry->pid; entry++)
-        {
-          gint driver_score = 50;
+  candidates = g_hash_table_lookup (priv->usb_id_index, USB_ID_KEY (vid, pid));
 
-          if (entry->pid != pid || entry->vid != vid)
-            continue;
+  /* Find the best driver to handle this USB device. */
+  for (i = 0; candidates && i < candidates->len; i++)
+    {
+      FpContextUsbCandidate *candidate = &g_array_index (candidates, FpContextUsbCandidate, i);
+      GType driver = candidate->driver->get_type ();
+      g_autoptr(FpDeviceClass) cls = g_type_class_ref (driver);
+      gint driver_score = 50;
 
-          if (cls->usb_discover)
-            driver_score = cls->usb_discover (device);
+      if (cls->usb_discover)
+        driver_score = cls->usb_discover (device);
 
-          /* Is this driver better than the one we had? */
-          if (driver_score <= found_score)
-            continue;
+      /* Is this driver better than the one we had? */
+      if (driver_score <= found_score)
+        continue;
 
-          found_score = driver_score;
-          found_driver = driver;
-          found_entry = entry;
-        }
+      found_score = driver_score;
+      found_driver = driver;
+      found_entry = candidate->entry;
     }
 
   if (found_driver == G_TYPE_NONE)
@@ -162,40 +557,95 @@ usb_device_added_cb (FpContext *self, GUsbDevice *device, GUsbContext *usb_ctx)
       return;
     }
 
-  priv->pending_devices++;
-  g_async_initable_new_async (found_driver,
-                              G_PRIORITY_LOW,
-                              priv->cancellable,
-                              async_device_init_done_cb,
-                              self,
-                              "fpi-usb-device", device,
-                              "fpi-driver-data", found_entry->driver_data,
-                              NULL);
+  fp_context_queue_probe (self, found_driver, device, NULL,
+                          found_entry->driver_data, FALSE);
 }
 
 static void
-usb_device_removed_cb (FpContext *self, GUsbDevice *device, GUsbContext *usb_ctx)
+usb_device_removed (FpContext *self, GUsbDevice *device)
 {
   FpContextPrivate *priv = fp_context_get_instance_private (self);
+  g_autoptr(FpDevice) dev = NULL;
   gint i;
 
+  fp_context_cancel_probes (self, device);
+
   /* Do the lazy way and just look at each device. */
   for (i = 0; i < priv->devices->len; i++)
     {
-      FpDevice *dev = g_ptr_array_index (priv->devices, i);
-      FpDeviceClass *cls = FP_DEVICE_GET_CLASS (dev);
+      FpDevice *d = g_ptr_array_index (priv->devices, i);
+      FpDeviceClass *cls = FP_DEVICE_GET_CLASS (d);
 
       if (cls->type != FP_DEVICE_TYPE_USB)
         continue;
 
-      if (fpi_device_get_usb_device (dev) == device)
+      if (fpi_device_get_usb_device (d) == device)
         {
-          g_signal_emit (self, signals[DEVICE_REMOVED_SIGNAL], 0, dev);
-          g_ptr_array_remove_index_fast (priv->devices, i);
-
-          return;
+          dev = g_object_ref (d);
+          break;
         }
     }
+
+  if (!dev)
+    return;
+
+  fp_context_remember_removed (self, device, G_OBJECT_TYPE (dev),
+                               fpi_device_get_driver_data (dev));
+  g_signal_emit (self, signals[DEVICE_REMOVED_SIGNAL], 0, dev);
+
+  g_mutex_lock (&priv->lock);
+  g_ptr_array_remove_fast (priv->devices, dev);
+  g_mutex_unlock (&priv->lock);
+}
+
+static gboolean
+fp_context_hotplug_cb (gpointer user_data)
+{
+  FpContextHotplug *hotplug = user_data;
+
+  if (hotplug->added)
+    usb_device_added (hotplug->context, hotplug->device);
+  else
+    usb_device_removed (hotplug->context, hotplug->device);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+fp_context_hotplug_free (FpContextHotplug *hotplug)
+{
+  g_object_unref (hotplug->context);
+  g_object_unref (hotplug->device);
+  g_free (hotplug);
+}
+
+/* GUsb reports hotplug events in its own main context. They are handled
+ * right away if that is also the one of @self, e.g. while enumerating. */
+static void
+fp_context_forward_hotplug (FpContext *self, GUsbDevice *device, gboolean added)
+{
+  FpContextPrivate *priv = fp_context_get_instance_private (self);
+  FpContextHotplug *hotplug = g_new0 (FpContextHotplug, 1);
+
+  hotplug->context = g_object_ref (self);
+  hotplug->device = g_object_ref (device);
+  hotplug->added = added;
+
+  g_main_context_invoke_full (priv->main_context, G_PRIORITY_DEFAULT,
+                              fp_context_hotplug_cb, hotplug,
+                              (GDestroyNotify) fp_context_hotplug_free);
+}
+
+static void
+usb_device_added_cb (FpContext *self, GUsbDevice *device, GUsbContext *usb_ctx)
+{
+  fp_context_forward_hotplug (self, device, TRUE);
+}
+
+static void
+usb_device_removed_cb (FpContext *self, GUsbDevice *device, GUsbContext *usb_ctx)
+{
+  fp_context_forward_hotplug (self, device, FALSE);
 }
 
 static void
@@ -205,30 +655,156 @@ fp_context_finalize (GObject *object)
   FpContextPrivate *priv = fp_context_get_instance_private (self);
 
   g_clear_pointer (&priv->devices, g_ptr_array_unref);
+  g_clear_pointer (&priv->removed_devices, g_hash_table_unref);
+
+  /* Running probes free themselves once cancelled */
+  for (guint i = 0; i < priv->running_probes->len; i++)
+    {
+      FpContextProbe *probe = g_ptr_array_index (priv->running_probes, i);
+
+      probe->context = NULL;
+      fp_context_clear_source (&probe->timeout_source);
+    }
+  g_clear_pointer (&priv->running_probes, g_ptr_array_unref);
+  while (!g_queue_is_empty (&priv->queued_probes))
+    fp_context_probe_free (g_queue_pop_head (&priv->queued_probes));
+  fp_context_clear_source (&priv->probe_idle_source);
 
   g_cancellable_cancel (priv->cancellable);
   g_clear_object (&priv->cancellable);
-  g_clear_pointer (&priv->drivers, g_array_unref);
+  g_clear_pointer (&priv->virtual_drivers, g_ptr_array_unref);
+  g_clear_pointer (&priv->usb_id_index, g_hash_table_unref);
 
   g_object_run_dispose (G_OBJECT (priv->usb_ctx));
   g_clear_object (&priv->usb_ctx);
 
+  g_clear_pointer (&priv->main_context, g_main_context_unref);
+  g_mutex_clear (&priv->lock);
+  g_cond_clear (&priv->cond);
+
   G_OBJECT_CLASS (fp_context_parent_class)->finalize (object);
 }
 
+static void
+fp_context_get_property (GObject    *object,
+                         guint       prop_id,
+                         GValue     *value,
+                         GParamSpec *pspec)
+{
+  switch (prop_id)
+    {
+    case PROP_MAX_WORKER_THREADS:
+      g_value_set_uint (value, fpi_worker_get_max_threads ());
+      break;
+
+    case PROP_WORKER_NICE:
+      g_value_set_int (value, fpi_worker_get_nice ());
+      break;
+
+    case PROP_EFFICIENCY_MODE:
+      g_value_set_boolean (value, fpi_worker_get_efficiency_mode ());
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+fp_context_set_property (GObject      *object,
+                         guint         prop_id,
+                         const GValue *value,
+                         GParamSpec   *pspec)
+{
+  switch (prop_id)
+    {
+    case PROP_MAX_WORKER_THREADS:
+      fpi_worker_set_max_threads (g_value_get_uint (value));
+      break;
+
+    case PROP_WORKER_NICE:
+      fpi_worker_set_nice (g_value_get_int (value));
+      break;
+
+    case PROP_EFFICIENCY_MODE:
+      fpi_worker_set_efficiency_mode (g_value_get_boolean (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
 static void
 fp_context_class_init (FpContextClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->finalize = fp_context_finalize;
+  object_class->get_property = fp_context_get_property;
+  object_class->set_property = fp_context_set_property;
+
+  /**
+   * FpContext:max-worker-threads:
+   *
+   * The maximum number of threads that libfprint runs minutiae detection,
+   * frame assembling and identification on, per kind of work. Setting
+   * 0 selects the number of processors, which is also the default unless
+   * the FP_WORKER_THREADS environment variable is set. Reading returns the
+   * number in effect.
+   *
+   * The worker threads are shared by all contexts, so this affects the
+   * whole process.
+   */
+  properties[PROP_MAX_WORKER_THREADS] =
+    g_param_spec_uint ("max-worker-threads",
+                       "MaxWorkerThreads",
+                       "Maximum number of worker threads, 0 for the number of processors",
+                       0, 1024,
+                       0,
+                       G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+
+  /**
+   * FpContext:worker-nice:
+   *
+   * The nice value of the worker threads, higher values leave more CPU time
+   * to the rest of the system. The default is 0 unless the FP_WORKER_NICE
+   * environment variable is set. Only supported on Linux, and like
+   * #FpContext:max-worker-threads it affects the whole process.
+   */
+  properties[PROP_WORKER_NICE] =
+    g_param_spec_int ("worker-nice",
+                      "WorkerNice",
+                      "Nice value of the worker threads",
+                      0, 19,
+                      0,
+                      G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+
+  /**
+   * FpContext:efficiency-mode:
+   *
+   * Whether to prefer cheaper variants of the algorithms, at a small cost
+   * in accuracy. Frames are then assembled with a coarse-to-fine search,
+   * and high resolution images are scanned for minutiae at a reduced size
+   * more often. Enabled by setting the FP_EFFICIENCY_MODE environment
+   * variable to anything but 0. This affects the whole process.
+   */
+  properties[PROP_EFFICIENCY_MODE] =
+    g_param_spec_boolean ("efficiency-mode",
+                          "EfficiencyMode",
+                          "Whether to prefer cheaper variants of the algorithms",
+                          FALSE,
+                          G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+
+  g_object_class_install_properties (object_class, N_PROPS, properties);
 
   /**
    * FpContext::device-added:
    * @context: the #FpContext instance that emitted the signal
    * @device: A #FpDevice
    *
-   * This signal is emitted when a fingerprint reader is added.
+   * This signal is emitted when a fingerprint reader is added. It is
+   * emitted in the main context that the context was created in.
    **/
   signals[DEVICE_ADDED_SIGNAL] = g_signal_new ("device-added",
                                                G_TYPE_FROM_CLASS (klass),
@@ -246,7 +822,8 @@ fp_context_class_init (FpContextClass *klass)
    * @context: the #FpContext instance that emitted the signal
    * @device: A #FpDevice
    *
-   * This signal is emitted when a fingerprint reader is removed.
+   * This signal is emitted when a fingerprint reader is removed. It is
+   * emitted in the main context that the context was created in.
    **/
   signals[DEVICE_REMOVED_SIGNAL] = g_signal_new ("device-removed",
                                                  G_TYPE_FROM_CLASS (klass),
@@ -265,25 +842,51 @@ fp_context_init (FpContext *self)
 {
   g_autoptr(GError) error = NULL;
   FpContextPrivate *priv = fp_context_get_instance_private (self);
-  guint i;
+  const FpiDriverInfo *driver;
+
+  priv->main_context = g_main_context_ref_thread_default ();
+  g_mutex_init (&priv->lock);
+  g_cond_init (&priv->cond);
+
+  /* Index the USB drivers by the IDs they bind to, in driver order. Driver
+   * types are only registered once a matching device shows up. */
+  priv->virtual_drivers = g_ptr_array_new ();
+  priv->usb_id_index = g_hash_table_new_full (NULL, NULL, NULL,
+                                              (GDestroyNotify) g_array_unref);
+  for (driver = fpi_get_driver_registry (); driver->id; driver++)
+    {
+      const FpIdEntry *entry;
 
-  priv->drivers = fpi_get_driver_types ();
+      if (!is_driver_allowed (driver->id))
+        continue;
 
-  if (get_drivers_whitelist_env ())
-    {
-      for (i = 0; i < priv->drivers->len;)
+      if (driver->type == FP_DEVICE_TYPE_VIRTUAL)
+        {
+          g_ptr_array_add (priv->virtual_drivers, (gpointer) driver);
+          continue;
+        }
+
+      for (entry = driver->id_table; entry->pid; entry++)
         {
-          GType driver = g_array_index (priv->drivers, GType, i);
-          g_autoptr(FpDeviceClass) cls = g_type_class_ref (driver);
+          FpContextUsbCandidate candidate = { driver, entry };
+          gpointer key = USB_ID_KEY (entry->vid, entry->pid);
+          GArray *candidates = g_hash_table_lookup (priv->usb_id_index, key);
 
-          if (!is_driver_allowed (cls->id))
-            g_array_remove_index (priv->drivers, i);
-          else
-            ++i;
+          if (!candidates)
+            {
+              candidates = g_array_new (FALSE, FALSE, sizeof (FpContextUsbCandidate));
+              g_hash_table_insert (priv->usb_id_index, key, candidates);
+            }
+
+          g_array_append_val (candidates, candidate);
         }
     }
 
   priv->devices = g_ptr_array_new_with_free_func (g_object_unref);
+  priv->removed_devices = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+  priv->running_probes = g_ptr_array_new ();
+  g_queue_init (&priv->queued_probes);
 
   priv->cancellable = g_cancellable_new ();
   priv->usb_ctx = g_usb_context_new (&error);
@@ -320,41 +923,33 @@ fp_context_new (void)
   return g_object_new (FP_TYPE_CONTEXT, NULL);
 }
 
-/**
- * fp_context_enumerate:
- * @context: a #FpContext
- *
- * Enumerate all devices. You should call this function exactly once
- * at startup. Please note that it iterates the mainloop until all
- * devices are enumerated.
- */
-void
-fp_context_enumerate (FpContext *context)
+/* Runs the enumeration, the main context of @context must be acquired */
+static void
+fp_context_enumerate_in_context (FpContext *context)
 {
   FpContextPrivate *priv = fp_context_get_instance_private (context);
   gint i;
 
-  g_return_if_fail (FP_IS_CONTEXT (context));
-
+  g_mutex_lock (&priv->lock);
   if (priv->enumerated)
-    return;
-
+    {
+      g_mutex_unlock (&priv->lock);
+      return;
+    }
   priv->enumerated = TRUE;
+  priv->enumerating = TRUE;
+  g_mutex_unlock (&priv->lock);
 
   /* USB devices are handled from callbacks */
   g_usb_context_enumerate (priv->usb_ctx);
 
   /* Handle Virtual devices based on environment variables */
-  for (i = 0; i < priv->drivers->len; i++)
+  for (i = 0; i < priv->virtual_drivers->len; i++)
     {
-      GType driver = g_array_index (priv->drivers, GType, i);
-      g_autoptr(FpDeviceClass) cls = g_type_class_ref (driver);
+      const FpiDriverInfo *driver = g_ptr_array_index (priv->virtual_drivers, i);
       const FpIdEntry *entry;
 
-      if (cls->type != FP_DEVICE_TYPE_VIRTUAL)
-        continue;
-
-      for (entry = cls->id_table; entry->pid; entry++)
+      for (entry = driver->id_table; entry->pid; entry++)
         {
           const gchar *val;
 
@@ -363,21 +958,77 @@ fp_context_enumerate (FpContext *context)
             continue;
 
           g_debug ("Found virtual environment device: %s, %s", entry->virtual_envvar, val);
-          priv->pending_devices++;
-          g_async_initable_new_async (driver,
-                                      G_PRIORITY_LOW,
-                                      priv->cancellable,
-                                      async_device_init_done_cb,
-                                      context,
-                                      "fpi-environ", val,
-                                      "fpi-driver-data", entry->driver_data,
-                                      NULL);
-          g_debug ("created");
+          fp_context_queue_probe (context, driver->get_type (), NULL, val,
+                                  entry->driver_data, FALSE);
         }
     }
 
+  /* Everything found from now on is hotplugged */
+  priv->enumerating = FALSE;
+
+  fp_context_start_probes (context);
   while (priv->pending_devices)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (priv->main_context, TRUE);
+
+  g_mutex_lock (&priv->lock);
+  priv->enumeration_done = TRUE;
+  g_cond_broadcast (&priv->cond);
+  g_mutex_unlock (&priv->lock);
+}
+
+static gboolean
+fp_context_enumerate_cb (gpointer user_data)
+{
+  fp_context_enumerate_in_context (user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * fp_context_enumerate:
+ * @context: a #FpContext
+ *
+ * Enumerate all devices. You should call this function exactly once
+ * at startup. Please note that it iterates the mainloop until all
+ * devices are enumerated.
+ *
+ * This may be called from any thread. If another thread is iterating the
+ * main context of @context, the enumeration is dispatched there and this
+ * waits until it is done. Calls while the enumeration is running wait for
+ * it to finish, except from within its own signal handlers.
+ */
+void
+fp_context_enumerate (FpContext *context)
+{
+  FpContextPrivate *priv = fp_context_get_instance_private (context);
+
+  g_return_if_fail (FP_IS_CONTEXT (context));
+
+  g_mutex_lock (&priv->lock);
+  if (priv->enumeration_done)
+    {
+      g_mutex_unlock (&priv->lock);
+      return;
+    }
+  g_mutex_unlock (&priv->lock);
+
+  if (g_main_context_acquire (priv->main_context))
+    {
+      g_main_context_push_thread_default (priv->main_context);
+      fp_context_enumerate_in_context (context);
+      g_main_context_pop_thread_default (priv->main_context);
+      g_main_context_release (priv->main_context);
+      return;
+    }
+
+  g_main_context_invoke_full (priv->main_context, G_PRIORITY_DEFAULT,
+                              fp_context_enumerate_cb, g_object_ref (context),
+                              g_object_unref);
+
+  g_mutex_lock (&priv->lock);
+  while (!priv->enumeration_done)
+    g_cond_wait (&priv->cond, &priv->lock);
+  g_mutex_unlock (&priv->lock);
 }
 
 /**
@@ -386,6 +1037,10 @@ fp_context_enumerate (FpContext *context)
  *
  * Get all devices. fp_context_enumerate() will be called as needed.
  *
+ * The returned array is modified when devices are hotplugged, so it must
+ * only be used in the thread that iterates the main context of @context.
+ * Use fp_context_dup_devices() from other threads.
+ *
  * Returns: (transfer none) (element-type FpDevice): a new #GPtrArray of #GUsbDevice's.
  */
 GPtrArray *
@@ -399,3 +1054,34 @@ fp_context_get_devices (FpContext *context)
 
   return priv->devices;
 }
+
+/**
+ * fp_context_dup_devices:
+ * @context: a #FpContext
+ *
+ * Like fp_context_get_devices(), but returns a snapshot of the devices
+ * that is not modified by hotplug events. This may be called from any
+ * thread.
+ *
+ * Returns: (transfer full) (element-type FpDevice): a new #GPtrArray of
+ *   the #FpDevice's
+ */
+GPtrArray *
+fp_context_dup_devices (FpContext *context)
+{
+  FpContextPrivate *priv = fp_context_get_instance_private (context);
+  GPtrArray *devices;
+  guint i;
+
+  g_return_val_if_fail (FP_IS_CONTEXT (context), NULL);
+
+  fp_context_enumerate (context);
+
+  g_mutex_lock (&priv->lock);
+  devices = g_ptr_array_new_full (priv->devices->len, g_object_unref);
+  for (i = 0; i < priv->devices->len; i++)
+    g_ptr_array_add (devices, g_object_ref (g_ptr_array_index (priv->devices, i)));
+  g_mutex_unlock (&priv->lock);
+
+  return devices;
+}
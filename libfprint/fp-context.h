@@ -49,4 +49,6 @@ void fp_context_enumerate (FpContext *context);
 
 GPtrArray *fp_context_get_devices (FpContext *context);
 
+GPtrArray *fp_context_dup_devices (FpContext *context);
+
 G_END_DECLS
@@ -21,17 +21,29 @@
 #pragma once
 
 #include "fpi-device.h"
+#include "fpi-usb-transfer.h"
+
+typedef struct _FpiUsbBufferPool FpiUsbBufferPool;
+typedef struct _FpiImageBufferPool FpiImageBufferPool;
+typedef struct _FpiUsbTransferTracker FpiUsbTransferTracker;
 
 typedef struct
 {
   FpDeviceType type;
 
-  GUsbDevice  *usb_device;
-  const gchar *virtual_env;
+  GUsbDevice          *usb_device;
+  FpiUsbBufferPool    *usb_buffer_pool;
+  FpiImageBufferPool  *image_buffer_pool;
+  FpiUsbTransferStats *usb_transfer_stats;
+  FpiUsbTransferTracker *usb_transfer_tracker;
+  const gchar         *virtual_env;
 
   gboolean     is_open;
+  gboolean     is_suspended;
+  gboolean     reopen_pending;
 
   gchar       *device_id;
+  gchar       *calibration_key;
   gchar       *device_name;
   FpScanType   scan_type;
 
@@ -40,6 +52,13 @@ typedef struct
   gint         nr_enroll_stages;
   GSList      *sources;
 
+  /* Running FpiDeviceTimers, all dispatched by timer_source */
+  GQueue       timers;
+  GSource     *timer_source;
+
+  /* SSM state timings, only used with FP_DEBUG_SSM_PROFILE */
+  GHashTable  *ssm_profile;
+
   /* We always make sure that only one task is run at a time. */
   FpiDeviceAction     current_action;
   GTask              *current_task;
@@ -50,6 +69,23 @@ typedef struct
 
   /* State for tasks */
   gboolean wait_for_finger;
+  guint    identify_max_results;
+  FpGallery *enroll_duplicate_gallery;
+
+  /* Statistics of the running and of the last completed operation */
+  FpOperationStats current_stats;
+  FpOperationStats last_stats;
+  gint64           stats_start_time;
+  guint64          stats_start_usb_bytes;
+  guint            stats_start_usb_transfers;
+  gboolean         has_last_stats;
+
+  /* Runtime power management, see fpi_device_power_hold() */
+  gint             autosuspend_delay;
+  gchar           *power_control_path;
+  gboolean         power_control_checked;
+  gboolean         power_held;
+  GSource         *power_release_source;
 } FpDevicePrivate;
 
 
@@ -68,15 +104,71 @@ typedef struct
 {
   FpPrint       *enrolled_print;   /* verify */
   GPtrArray     *gallery;   /* identify */
+  gboolean       continuous; /* identify until cancelled */
 
   gboolean       result_reported;
   FpPrint       *match;
   FpPrint       *print;
   GError        *error;
 
+  /* Best scoring templates, if requested for identify */
+  GPtrArray     *candidates;
+  GArray        *scores;
+
   FpMatchCb      match_cb;
   gpointer       match_data;
   GDestroyNotify match_destroy;
 } FpMatchData;
 
 void match_data_free (FpMatchData *match_data);
+
+typedef struct
+{
+  FpPrint   *print;  /* the print that is being deleted */
+  GPtrArray *prints; /* all prints of fp_device_delete_prints() */
+  guint      next;   /* next print for drivers without delete_prints */
+} FpDeleteData;
+
+void delete_data_free (FpDeleteData *delete_data);
+
+typedef struct
+{
+  GPtrArray     *prints; /* reported so far, unless streamed */
+  gboolean       streamed;
+  gboolean       stopped;
+
+  FpListCb       list_cb;
+  gpointer       list_data;
+  GDestroyNotify list_destroy;
+} FpListData;
+
+void list_data_free (FpListData *list_data);
+
+FpiUsbBufferPool    *fpi_device_get_usb_buffer_pool (FpDevice *device);
+FpiImageBufferPool  *fpi_device_get_image_buffer_pool (FpDevice *device);
+FpiUsbTransferStats *fpi_device_get_usb_transfer_stats (FpDevice *device);
+FpiUsbTransferTracker *fpi_device_get_usb_transfer_tracker (FpDevice *device);
+GHashTable          *fpi_device_get_ssm_profile (FpDevice *device);
+
+void                 fpi_device_stats_start (FpDevice *device);
+FpOperationStats    *fpi_device_get_current_stats (FpDevice *device);
+gint64               fpi_device_get_stats_elapsed (FpDevice *device);
+
+FpiUsbBufferPool *fpi_usb_buffer_pool_new (void);
+void              fpi_usb_buffer_pool_close (FpiUsbBufferPool *pool);
+
+FpiImageBufferPool *fpi_image_buffer_pool_new (void);
+void                fpi_image_buffer_pool_close (FpiImageBufferPool *pool);
+
+void              fpi_usb_transfer_stats_dump (FpDevice *device);
+
+FpiUsbTransferTracker *fpi_usb_transfer_tracker_new (void);
+void                   fpi_usb_transfer_tracker_free (FpiUsbTransferTracker *tracker);
+
+void              fpi_device_timers_clear (FpDevice *device);
+
+void              fpi_device_power_hold (FpDevice *device);
+void              fpi_device_power_release (FpDevice *device);
+void              fpi_device_power_release_now (FpDevice *device);
+
+void              fpi_ssm_profile_dump (FpDevice *device);
@@ -29,10 +29,19 @@
  * @short_description: Fingerpint device routines
  *
  * These are the public #FpDevice routines.
+ *
+ * An operation, including all of the driver's I/O, timeouts and the final
+ * callback, is dispatched in the thread-default #GMainContext of the
+ * caller at the time the operation is started. To run several devices in
+ * parallel, push a separate context with g_main_context_push_thread_default()
+ * in one thread per device and start the operations from there. The
+ * synchronous variants iterate the thread-default context.
  */
 
 static void fp_device_async_initable_iface_init (GAsyncInitableIface *iface);
 
+#define FP_DEVICE_DEFAULT_AUTOSUSPEND_DELAY -1
+
 G_DEFINE_TYPE_EXTENDED (FpDevice, fp_device, G_TYPE_OBJECT, G_TYPE_FLAG_ABSTRACT,
                         G_IMPLEMENT_INTERFACE (G_TYPE_ASYNC_INITABLE,
                                                fp_device_async_initable_iface_init)
@@ -100,7 +109,8 @@ fp_device_cancelled_cb (GCancellable *cancellable, FpDevice *self)
                          fp_device_cancel_in_idle_cb,
                          self,
                          NULL);
-  g_source_attach (priv->current_idle_cancel_source, NULL);
+  g_source_attach (priv->current_idle_cancel_source,
+                   fpi_device_get_main_context (self));
   g_source_unref (priv->current_idle_cancel_source);
 }
 
@@ -149,14 +159,24 @@ fp_device_finalize (GObject *object)
     g_warning ("User destroyed open device! Not cleaning up properly!");
 
   g_slist_free_full (priv->sources, (GDestroyNotify) g_source_destroy);
+  fpi_device_timers_clear (self);
+  fpi_device_power_release_now (self);
+  g_clear_pointer (&priv->power_control_path, g_free);
 
   g_clear_pointer (&priv->current_idle_cancel_source, g_source_destroy);
   g_clear_pointer (&priv->current_task_idle_return_source, g_source_destroy);
 
   g_clear_pointer (&priv->device_id, g_free);
+  g_clear_pointer (&priv->calibration_key, g_free);
   g_clear_pointer (&priv->device_name, g_free);
 
   g_clear_object (&priv->usb_device);
+  g_clear_pointer (&priv->usb_buffer_pool, fpi_usb_buffer_pool_close);
+  g_clear_pointer (&priv->image_buffer_pool, fpi_image_buffer_pool_close);
+  g_clear_object (&priv->enroll_duplicate_gallery);
+  g_clear_pointer (&priv->usb_transfer_stats, g_free);
+  g_clear_pointer (&priv->usb_transfer_tracker, fpi_usb_transfer_tracker_free);
+  g_clear_pointer (&priv->ssm_profile, g_hash_table_unref);
   g_clear_pointer (&priv->virtual_env, g_free);
 
   G_OBJECT_CLASS (fp_device_parent_class)->finalize (object);
@@ -264,6 +284,8 @@ fp_device_async_initable_init_async (GAsyncInitable     *initable,
     }
 
   priv->current_action = FPI_DEVICE_ACTION_PROBE;
+  fpi_device_stats_start (self);
+  fpi_device_power_hold (self);
   priv->current_task = g_steal_pointer (&task);
   maybe_cancel_on_cancelled (self, cancellable);
 
@@ -387,6 +409,9 @@ fp_device_class_init (FpDeviceClass *klass)
 static void
 fp_device_init (FpDevice *self)
 {
+  FpDevicePrivate *priv = fp_device_get_instance_private (self);
+
+  priv->autosuspend_delay = FP_DEVICE_DEFAULT_AUTOSUSPEND_DELAY;
 }
 
 /**
@@ -487,6 +512,172 @@ fp_device_get_nr_enroll_stages (FpDevice *device)
   return priv->nr_enroll_stages;
 }
 
+/**
+ * fp_device_get_last_operation_stats:
+ * @device: A #FpDevice
+ * @stats: (out caller-allocates): Return location for the statistics
+ *
+ * Retrieves timing and transfer statistics of the last operation that
+ * completed on the device, e.g. to track latency per device model. The
+ * statistics are always collected, this only copies them.
+ *
+ * Returns: %FALSE if no operation has completed yet, %TRUE otherwise
+ */
+gboolean
+fp_device_get_last_operation_stats (FpDevice         *device,
+                                    FpOperationStats *stats)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), FALSE);
+  g_return_val_if_fail (stats != NULL, FALSE);
+
+  if (!priv->has_last_stats)
+    return FALSE;
+
+  *stats = priv->last_stats;
+
+  return TRUE;
+}
+
+/**
+ * fp_device_set_identify_max_results:
+ * @device: A #FpDevice
+ * @max_results: The number of templates to return scores for, or 0
+ *
+ * Requests the scores of the @max_results best matching templates of the
+ * following identify operations, so that they can be ranked or combined
+ * with other scores without further verify operations. Use
+ * fp_device_identify_get_scores() to retrieve them.
+ *
+ * Only devices that match on the host report scores. Computing them
+ * means that every template has to be fully matched, rather than
+ * stopping at the first one that matches.
+ */
+void
+fp_device_set_identify_max_results (FpDevice *device,
+                                    guint     max_results)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+
+  priv->identify_max_results = max_results;
+}
+
+/**
+ * fp_device_get_identify_max_results:
+ * @device: A #FpDevice
+ *
+ * See fp_device_set_identify_max_results().
+ *
+ * Returns: The number of templates scores are reported for, or 0
+ */
+guint
+fp_device_get_identify_max_results (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), 0);
+
+  return priv->identify_max_results;
+}
+
+/**
+ * fp_device_set_autosuspend_delay:
+ * @device: A #FpDevice
+ * @delay_ms: The delay in milliseconds, 0 or -1
+ *
+ * USB devices are kept from autosuspending while an operation runs, and
+ * for @delay_ms after the last one completed, so that operations in quick
+ * succession do not each have to wait for the device to resume. Use 0 to
+ * allow autosuspend as soon as an operation completed, or -1 to leave the
+ * runtime power management of the device alone.
+ *
+ * This only has an effect if libfprint may write the power control of
+ * the device in sysfs and the system enabled autosuspend for it. The
+ * default is -1, as the runtime power management policy belongs to the
+ * system, e.g. udev rules, or to the service using libfprint. A few
+ * seconds are a good value for services that opt in.
+ */
+void
+fp_device_set_autosuspend_delay (FpDevice *device,
+                                 gint      delay_ms)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (delay_ms >= -1);
+
+  priv->autosuspend_delay = delay_ms;
+
+  /* Applies from the next operation on */
+  if (delay_ms < 0)
+    fpi_device_power_release_now (device);
+}
+
+/**
+ * fp_device_get_autosuspend_delay:
+ * @device: A #FpDevice
+ *
+ * See fp_device_set_autosuspend_delay().
+ *
+ * Returns: The delay in milliseconds, or -1 if disabled
+ */
+gint
+fp_device_get_autosuspend_delay (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), -1);
+
+  return priv->autosuspend_delay;
+}
+
+/**
+ * fp_device_set_enroll_duplicate_gallery:
+ * @device: A #FpDevice
+ * @gallery: (nullable): The #FpGallery of already enrolled prints, or %NULL
+ *
+ * Makes the following enroll operations check whether the enrolled finger
+ * is already part of @gallery. If it is, the enroll operation fails with
+ * #FP_DEVICE_ERROR_DATA_DUPLICATE.
+ *
+ * Devices that match on the host compare each enroll stage in the
+ * background while the next one is captured, so the check is usually
+ * finished by the time the last stage is. Other devices ignore @gallery.
+ */
+void
+fp_device_set_enroll_duplicate_gallery (FpDevice  *device,
+                                        FpGallery *gallery)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (gallery == NULL || FP_IS_GALLERY (gallery));
+
+  g_set_object (&priv->enroll_duplicate_gallery, gallery);
+}
+
+/**
+ * fp_device_get_enroll_duplicate_gallery:
+ * @device: A #FpDevice
+ *
+ * See fp_device_set_enroll_duplicate_gallery().
+ *
+ * Returns: (transfer none) (nullable): The #FpGallery enrolled fingers are
+ *   checked against, or %NULL
+ */
+FpGallery *
+fp_device_get_enroll_duplicate_gallery (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+
+  return priv->enroll_duplicate_gallery;
+}
+
 /**
  * fp_device_supports_identify:
  * @device: A #FpDevice
@@ -601,6 +792,8 @@ fp_device_open (FpDevice           *device,
     }
 
   priv->current_action = FPI_DEVICE_ACTION_OPEN;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
   priv->current_task = g_steal_pointer (&task);
   maybe_cancel_on_cancelled (device, cancellable);
 
@@ -665,6 +858,8 @@ fp_device_close (FpDevice           *device,
     }
 
   priv->current_action = FPI_DEVICE_ACTION_CLOSE;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
   priv->current_task = g_steal_pointer (&task);
   maybe_cancel_on_cancelled (device, cancellable);
 
@@ -690,6 +885,166 @@ fp_device_close_finish (FpDevice     *device,
   return g_task_propagate_boolean (G_TASK (result), error);
 }
 
+/**
+ * fp_device_suspend:
+ * @device: a #FpDevice
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Prepare an open device for system suspend. Any running operation needs
+ * to be cancelled first. Afterwards only fp_device_resume() and
+ * fp_device_close() may be called until the device was resumed.
+ *
+ * Drivers can save their session state at this point, so that resuming
+ * does not need to go through the full open sequence again.
+ * Retrieve the result with fp_device_suspend_finish().
+ */
+void
+fp_device_suspend (FpDevice           *device,
+                   GCancellable       *cancellable,
+                   GAsyncReadyCallback callback,
+                   gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeviceClass *cls = FP_DEVICE_GET_CLASS (device);
+
+  task = g_task_new (device, cancellable, callback, user_data);
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  if (!priv->is_open)
+    {
+      g_task_return_error (task,
+                           fpi_device_error_new (FP_DEVICE_ERROR_NOT_OPEN));
+      return;
+    }
+
+  if (priv->current_task)
+    {
+      g_task_return_error (task,
+                           fpi_device_error_new (FP_DEVICE_ERROR_BUSY));
+      return;
+    }
+
+  /* Without driver support, resuming opens the device again */
+  if (priv->is_suspended || !cls->suspend)
+    {
+      priv->is_suspended = TRUE;
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  priv->current_action = FPI_DEVICE_ACTION_SUSPEND;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
+  priv->current_task = g_steal_pointer (&task);
+  maybe_cancel_on_cancelled (device, cancellable);
+
+  cls->suspend (device);
+}
+
+/**
+ * fp_device_suspend_finish:
+ * @device: A #FpDevice
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an asynchronous operation to prepare the device for suspend.
+ * See fp_device_suspend().
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_suspend_finish (FpDevice     *device,
+                          GAsyncResult *result,
+                          GError      **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * fp_device_resume:
+ * @device: a #FpDevice
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Make a device usable again after system resume. The driver first checks
+ * whether the session saved by fp_device_suspend() is still valid. If it
+ * is not, or if the driver cannot resume sessions, the device is closed
+ * and opened again. Calling this on a device that is not suspended does
+ * nothing.
+ *
+ * Retrieve the result with fp_device_resume_finish().
+ */
+void
+fp_device_resume (FpDevice           *device,
+                  GCancellable       *cancellable,
+                  GAsyncReadyCallback callback,
+                  gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeviceClass *cls = FP_DEVICE_GET_CLASS (device);
+
+  task = g_task_new (device, cancellable, callback, user_data);
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  if (!priv->is_open)
+    {
+      g_task_return_error (task,
+                           fpi_device_error_new (FP_DEVICE_ERROR_NOT_OPEN));
+      return;
+    }
+
+  if (priv->current_task)
+    {
+      g_task_return_error (task,
+                           fpi_device_error_new (FP_DEVICE_ERROR_BUSY));
+      return;
+    }
+
+  if (!priv->is_suspended)
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  priv->current_action = FPI_DEVICE_ACTION_RESUME;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
+  priv->current_task = g_steal_pointer (&task);
+  maybe_cancel_on_cancelled (device, cancellable);
+
+  if (cls->resume)
+    cls->resume (device);
+  else
+    fpi_device_resume_complete (device,
+                                fpi_device_error_new (FP_DEVICE_ERROR_NOT_SUPPORTED));
+}
+
+/**
+ * fp_device_resume_finish:
+ * @device: A #FpDevice
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an asynchronous operation to resume the device.
+ * See fp_device_resume().
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_resume_finish (FpDevice     *device,
+                         GAsyncResult *result,
+                         GError      **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 
 /**
  * fp_device_enroll:
@@ -763,6 +1118,8 @@ fp_device_enroll (FpDevice           *device,
     }
 
   priv->current_action = FPI_DEVICE_ACTION_ENROLL;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
   priv->current_task = g_steal_pointer (&task);
   maybe_cancel_on_cancelled (device, cancellable);
 
@@ -847,6 +1204,8 @@ fp_device_verify (FpDevice           *device,
     }
 
   priv->current_action = FPI_DEVICE_ACTION_VERIFY;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
   priv->current_task = g_steal_pointer (&task);
   maybe_cancel_on_cancelled (device, cancellable);
 
@@ -908,30 +1267,16 @@ fp_device_verify_finish (FpDevice     *device,
   return res != FPI_MATCH_ERROR;
 }
 
-/**
- * fp_device_identify:
- * @device: a #FpDevice
- * @prints: (element-type FpPrint) (transfer none): #GPtrArray of #FpPrint
- * @cancellable: (nullable): a #GCancellable, or %NULL
- * @match_cb: (nullable) (scope notified): match reporting callback
- * @match_data: (closure match_cb): user data for @match_cb
- * @match_destroy: (destroy match_data): Destroy notify for @match_data
- * @callback: the function to call on completion
- * @user_data: the data to pass to @callback
- *
- * Start an asynchronous operation to identify prints. The callback will
- * be called once the operation has finished. Retrieve the result with
- * fp_device_identify_finish().
- */
-void
-fp_device_identify (FpDevice           *device,
-                    GPtrArray          *prints,
-                    GCancellable       *cancellable,
-                    FpMatchCb           match_cb,
-                    gpointer            match_data,
-                    GDestroyNotify      match_destroy,
-                    GAsyncReadyCallback callback,
-                    gpointer            user_data)
+static void
+fp_device_identify_start (FpDevice           *device,
+                          GPtrArray          *prints,
+                          gboolean            continuous,
+                          GCancellable       *cancellable,
+                          FpMatchCb           match_cb,
+                          gpointer            match_data,
+                          GDestroyNotify      match_destroy,
+                          GAsyncReadyCallback callback,
+                          gpointer            user_data)
 {
   g_autoptr(GTask) task = NULL;
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
@@ -939,28 +1284,31 @@ fp_device_identify (FpDevice           *device,
 
   task = g_task_new (device, cancellable, callback, user_data);
   if (g_task_return_error_if_cancelled (task))
-    return;
+    goto error;
 
   if (!priv->is_open)
     {
       g_task_return_error (task,
                            fpi_device_error_new (FP_DEVICE_ERROR_NOT_OPEN));
-      return;
+      goto error;
     }
 
   if (priv->current_task)
     {
       g_task_return_error (task,
                            fpi_device_error_new (FP_DEVICE_ERROR_BUSY));
-      return;
+      goto error;
     }
 
   priv->current_action = FPI_DEVICE_ACTION_IDENTIFY;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
   priv->current_task = g_steal_pointer (&task);
   maybe_cancel_on_cancelled (device, cancellable);
 
   data = g_new0 (FpMatchData, 1);
   data->gallery = g_ptr_array_ref (prints);
+  data->continuous = continuous;
   data->match_cb = match_cb;
   data->match_data = match_data;
   data->match_destroy = match_destroy;
@@ -969,18 +1317,202 @@ fp_device_identify (FpDevice           *device,
   g_task_set_task_data (priv->current_task, data, (GDestroyNotify) match_data_free);
 
   FP_DEVICE_GET_CLASS (device)->identify (device);
+  return;
+
+error:
+  /* The match callback will not be called */
+  if (match_destroy)
+    match_destroy (match_data);
 }
 
 /**
- * fp_device_identify_finish:
- * @device: A #FpDevice
- * @result: A #GAsyncResult
- * @match: (out) (transfer full) (nullable): Location for the matched #FpPrint, or %NULL
- * @print: (out) (transfer full) (nullable): Location for the new #FpPrint, or %NULL
- * @error: Return location for errors, or %NULL to ignore
+ * fp_device_identify:
+ * @device: a #FpDevice
+ * @prints: (element-type FpPrint) (transfer none): #GPtrArray of #FpPrint
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @match_cb: (nullable) (scope notified): match reporting callback
+ * @match_data: (closure match_cb): user data for @match_cb
+ * @match_destroy: (destroy match_data): Destroy notify for @match_data
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
  *
- * Finish an asynchronous operation to identify a print. You should check
- * for an error of type %FP_DEVICE_RETRY to prompt the user again if there
+ * Start an asynchronous operation to identify prints. The callback will
+ * be called once the operation has finished. Retrieve the result with
+ * fp_device_identify_finish().
+ */
+void
+fp_device_identify (FpDevice           *device,
+                    GPtrArray          *prints,
+                    GCancellable       *cancellable,
+                    FpMatchCb           match_cb,
+                    gpointer            match_data,
+                    GDestroyNotify      match_destroy,
+                    GAsyncReadyCallback callback,
+                    gpointer            user_data)
+{
+  fp_device_identify_start (device, prints, FALSE, cancellable,
+                            match_cb, match_data, match_destroy,
+                            callback, user_data);
+}
+
+/**
+ * fp_device_identify_continuous:
+ * @device: a #FpDevice
+ * @prints: (element-type FpPrint) (transfer none): #GPtrArray of #FpPrint
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @match_cb: (scope notified): match reporting callback
+ * @match_data: (closure match_cb): user data for @match_cb
+ * @match_destroy: (destroy match_data): Destroy notify for @match_data
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Like fp_device_identify(), but the operation keeps running after a
+ * result, and @match_cb is called for every touch, including retries.
+ * Between touches the device stays armed where the driver supports it,
+ * rather than having to be started again for the next one.
+ *
+ * The operation only finishes when @cancellable is cancelled, or on an
+ * error that is not in the %FP_DEVICE_RETRY domain. Retrieve that error
+ * with fp_device_identify_continuous_finish().
+ */
+void
+fp_device_identify_continuous (FpDevice           *device,
+                               GPtrArray          *prints,
+                               GCancellable       *cancellable,
+                               FpMatchCb           match_cb,
+                               gpointer            match_data,
+                               GDestroyNotify      match_destroy,
+                               GAsyncReadyCallback callback,
+                               gpointer            user_data)
+{
+  g_return_if_fail (match_cb != NULL);
+
+  fp_device_identify_start (device, prints, TRUE, cancellable,
+                            match_cb, match_data, match_destroy,
+                            callback, user_data);
+}
+
+/**
+ * fp_device_identify_continuous_finish:
+ * @device: A #FpDevice
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish a continuous identify operation started with
+ * fp_device_identify_continuous(). As it only stops when cancelled or on
+ * a fatal error, this always fails, with %G_IO_ERROR_CANCELLED in the
+ * first case.
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_identify_continuous_finish (FpDevice     *device,
+                                      GAsyncResult *result,
+                                      GError      **error)
+{
+  return g_task_propagate_int (G_TASK (result), error) != FPI_MATCH_ERROR;
+}
+
+/* Reports the matches of fp_device_identify_gallery() to the gallery,
+ * before passing them on. */
+typedef struct
+{
+  FpGallery     *gallery;
+  FpMatchCb      match_cb;
+  gpointer       match_data;
+  GDestroyNotify match_destroy;
+} GalleryMatchData;
+
+static void
+gallery_match_data_free (GalleryMatchData *data)
+{
+  if (data->match_destroy)
+    data->match_destroy (data->match_data);
+  g_object_unref (data->gallery);
+  g_free (data);
+}
+
+static void
+gallery_match_cb (FpDevice *device,
+                  FpPrint  *match,
+                  FpPrint  *print,
+                  gpointer  user_data,
+                  GError   *error)
+{
+  GalleryMatchData *data = user_data;
+
+  if (match)
+    fp_gallery_report_match (data->gallery, match);
+
+  if (data->match_cb)
+    data->match_cb (device, match, print, data->match_data, error);
+}
+
+/**
+ * fp_device_identify_gallery:
+ * @device: a #FpDevice
+ * @gallery: (transfer none): The #FpGallery to identify against
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @match_cb: (nullable) (scope notified): match reporting callback
+ * @match_data: (closure match_cb): user data for @match_cb
+ * @match_destroy: (destroy match_data): Destroy notify for @match_data
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Like fp_device_identify(), but identifies against the prints of
+ * @gallery, which already holds the data needed to match them. Only the
+ * prints that are compatible with @device are used, see
+ * fp_gallery_get_compatible_prints(). Changes to @gallery after this call
+ * do not affect the running operation. Retrieve the result with
+ * fp_device_identify_finish().
+ */
+void
+fp_device_identify_gallery (FpDevice           *device,
+                            FpGallery          *gallery,
+                            GCancellable       *cancellable,
+                            FpMatchCb           match_cb,
+                            gpointer            match_data,
+                            GDestroyNotify      match_destroy,
+                            GAsyncReadyCallback callback,
+                            gpointer            user_data)
+{
+  g_autoptr(GPtrArray) prints = NULL;
+
+  g_return_if_fail (FP_IS_GALLERY (gallery));
+
+  prints = fp_gallery_get_compatible_prints (gallery, device);
+
+  if (fp_gallery_get_adaptive_order (gallery))
+    {
+      GalleryMatchData *data = g_new0 (GalleryMatchData, 1);
+
+      data->gallery = g_object_ref (gallery);
+      data->match_cb = match_cb;
+      data->match_data = match_data;
+      data->match_destroy = match_destroy;
+
+      fp_device_identify (device, prints, cancellable,
+                          gallery_match_cb, data,
+                          (GDestroyNotify) gallery_match_data_free,
+                          callback, user_data);
+      return;
+    }
+
+  fp_device_identify (device, prints, cancellable,
+                      match_cb, match_data, match_destroy,
+                      callback, user_data);
+}
+
+/**
+ * fp_device_identify_finish:
+ * @device: A #FpDevice
+ * @result: A #GAsyncResult
+ * @match: (out) (transfer full) (nullable): Location for the matched #FpPrint, or %NULL
+ * @print: (out) (transfer full) (nullable): Location for the new #FpPrint, or %NULL
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an asynchronous operation to identify a print. You should check
+ * for an error of type %FP_DEVICE_RETRY to prompt the user again if there
  * was an interaction issue.
  *
  * Use @match to find the print that matched. With @print you can fetch the
@@ -1001,15 +1533,16 @@ fp_device_identify_finish (FpDevice     *device,
 
   data = g_task_get_task_data (G_TASK (result));
 
+  /* There is no match data if the operation failed before starting */
   if (print)
     {
-      *print = data->print;
+      *print = data ? data->print : NULL;
       if (*print)
         g_object_ref (*print);
     }
   if (match)
     {
-      *match = data->match;
+      *match = data ? data->match : NULL;
       if (*match)
         g_object_ref (*match);
     }
@@ -1017,6 +1550,251 @@ fp_device_identify_finish (FpDevice     *device,
   return g_task_propagate_boolean (G_TASK (result), error);
 }
 
+/**
+ * fp_device_identify_get_scores:
+ * @device: A #FpDevice
+ * @result: A #GAsyncResult of fp_device_identify()
+ * @scores: (out) (transfer full) (element-type gint) (optional): Return
+ *   location for the score of each template
+ *
+ * Retrieves the best scoring templates of an identify operation, if they
+ * were requested with fp_device_set_identify_max_results(). The best one
+ * is first, templates with equal scores are in gallery order. The
+ * templates are returned whether or not one of them matched.
+ *
+ * This may be called before or after fp_device_identify_finish().
+ *
+ * Returns: (transfer container) (element-type FpPrint) (nullable): The
+ *   templates, or %NULL if the device did not report scores
+ */
+GPtrArray *
+fp_device_identify_get_scores (FpDevice     *device,
+                               GAsyncResult *result,
+                               GArray      **scores)
+{
+  FpMatchData *data;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+
+  if (scores)
+    *scores = NULL;
+
+  data = g_task_get_task_data (G_TASK (result));
+  if (!data || !data->candidates)
+    return NULL;
+
+  if (scores)
+    *scores = g_array_ref (data->scores);
+
+  return g_ptr_array_ref (data->candidates);
+}
+
+typedef struct
+{
+  GPtrArray    *prints;
+  GCancellable *cancellable;
+  GCancellable *external_cancellable;
+  gulong        external_cancellable_id;
+  guint         pending;
+
+  FpDevice     *device;
+  FpPrint      *match;
+  FpPrint      *print;
+  GError       *error;
+} FpIdentifyAnyData;
+
+static void
+identify_any_data_free (FpIdentifyAnyData *data)
+{
+  g_cancellable_disconnect (data->external_cancellable,
+                            data->external_cancellable_id);
+  g_clear_object (&data->external_cancellable);
+  g_clear_object (&data->cancellable);
+  g_clear_pointer (&data->prints, g_ptr_array_unref);
+  g_clear_object (&data->device);
+  g_clear_object (&data->match);
+  g_clear_object (&data->print);
+  g_clear_error (&data->error);
+  g_free (data);
+}
+
+static void identify_any_cb (GObject      *source_object,
+                             GAsyncResult *res,
+                             gpointer      user_data);
+
+static void
+identify_any_maybe_return (GTask *task)
+{
+  FpIdentifyAnyData *data = g_task_get_task_data (task);
+
+  data->pending -= 1;
+  if (data->pending > 0)
+    return;
+
+  if (data->device)
+    g_task_return_boolean (task, TRUE);
+  else if (data->external_cancellable &&
+           g_cancellable_is_cancelled (data->external_cancellable))
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                             "Operation was cancelled");
+  else
+    g_task_return_error (task, g_steal_pointer (&data->error));
+}
+
+static void
+identify_any_start (FpDevice *device, GTask *task)
+{
+  FpIdentifyAnyData *data = g_task_get_task_data (task);
+
+  data->pending += 1;
+  fp_device_identify (device, data->prints, data->cancellable,
+                      NULL, NULL, NULL,
+                      identify_any_cb, g_object_ref (task));
+}
+
+static void
+identify_any_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(FpPrint) match = NULL;
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(GError) error = NULL;
+  FpIdentifyAnyData *data = g_task_get_task_data (task);
+  FpDevice *device = FP_DEVICE (source_object);
+
+  if (fp_device_identify_finish (device, res, &match, &print, &error))
+    {
+      if (!data->device)
+        {
+          /* The first reader to complete wins, stop all the others */
+          data->device = g_object_ref (device);
+          data->match = g_steal_pointer (&match);
+          data->print = g_steal_pointer (&print);
+          g_cancellable_cancel (data->cancellable);
+        }
+    }
+  else if (!g_cancellable_is_cancelled (data->cancellable))
+    {
+      /* Someone else may still present a finger on this reader */
+      if (error->domain == FP_DEVICE_RETRY)
+        {
+          identify_any_start (device, task);
+          identify_any_maybe_return (task);
+          return;
+        }
+
+      fp_warn ("Identification on device %s failed: %s",
+               fp_device_get_name (device), error->message);
+      if (!data->error)
+        data->error = g_steal_pointer (&error);
+    }
+
+  identify_any_maybe_return (task);
+}
+
+static void
+identify_any_cancelled_cb (GCancellable *cancellable, GCancellable *internal)
+{
+  g_cancellable_cancel (internal);
+}
+
+/**
+ * fp_device_identify_any:
+ * @devices: (element-type FpDevice) (transfer none): The opened devices to use
+ * @prints: (element-type FpPrint) (transfer none): #GPtrArray of #FpPrint
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Start identifying @prints on all @devices at the same time. The first
+ * device to complete the identification wins and the operation is cancelled
+ * on all of the others. Retry errors restart the identification on the
+ * device that reported them, so a badly placed finger on one reader does
+ * not stop the others. Devices that fail are ignored unless all of them
+ * fail.
+ *
+ * The callback is only called once all devices have finished, so they can
+ * be used again right away. Retrieve the result with
+ * fp_device_identify_any_finish().
+ */
+void
+fp_device_identify_any (GPtrArray          *devices,
+                        GPtrArray          *prints,
+                        GCancellable       *cancellable,
+                        GAsyncReadyCallback callback,
+                        gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  FpIdentifyAnyData *data;
+  guint i;
+
+  g_return_if_fail (devices != NULL && devices->len > 0);
+  g_return_if_fail (prints != NULL);
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, fp_device_identify_any);
+  /* The devices may match after the cancellable was triggered */
+  g_task_set_check_cancellable (task, FALSE);
+
+  data = g_new0 (FpIdentifyAnyData, 1);
+  data->prints = g_ptr_array_ref (prints);
+  data->cancellable = g_cancellable_new ();
+  g_task_set_task_data (task, data, (GDestroyNotify) identify_any_data_free);
+
+  if (cancellable)
+    {
+      data->external_cancellable = g_object_ref (cancellable);
+      data->external_cancellable_id =
+        g_cancellable_connect (cancellable,
+                               G_CALLBACK (identify_any_cancelled_cb),
+                               data->cancellable, NULL);
+    }
+
+  /* Hold a reference until all devices were started */
+  data->pending = 1;
+  for (i = 0; i < devices->len; i++)
+    identify_any_start (g_ptr_array_index (devices, i), task);
+  identify_any_maybe_return (task);
+}
+
+/**
+ * fp_device_identify_any_finish:
+ * @result: A #GAsyncResult
+ * @device: (out) (transfer full) (nullable): Location for the #FpDevice that identified the finger, or %NULL
+ * @match: (out) (transfer full) (nullable): Location for the matched #FpPrint, or %NULL
+ * @print: (out) (transfer full) (nullable): Location for the new #FpPrint, or %NULL
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an operation started with fp_device_identify_any(). On success
+ * @device is the device on which the finger was scanned, and @match is
+ * %NULL if the finger did not match any of the prints.
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_identify_any_finish (GAsyncResult *result,
+                               FpDevice    **device,
+                               FpPrint     **match,
+                               FpPrint     **print,
+                               GError      **error)
+{
+  FpIdentifyAnyData *data;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+  data = g_task_get_task_data (G_TASK (result));
+
+  if (device)
+    *device = data->device ? g_object_ref (data->device) : NULL;
+  if (match)
+    *match = data->match ? g_object_ref (data->match) : NULL;
+  if (print)
+    *print = data->print ? g_object_ref (data->print) : NULL;
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 /**
  * fp_device_capture:
  * @device: a #FpDevice
@@ -1058,6 +1836,8 @@ fp_device_capture (FpDevice           *device,
     }
 
   priv->current_action = FPI_DEVICE_ACTION_CAPTURE;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
   priv->current_task = g_steal_pointer (&task);
   maybe_cancel_on_cancelled (device, cancellable);
 
@@ -1112,6 +1892,7 @@ fp_device_delete_print (FpDevice           *device,
 {
   g_autoptr(GTask) task = NULL;
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeleteData *data;
 
   task = g_task_new (device, cancellable, callback, user_data);
   if (g_task_return_error_if_cancelled (task))
@@ -1139,12 +1920,14 @@ fp_device_delete_print (FpDevice           *device,
     }
 
   priv->current_action = FPI_DEVICE_ACTION_DELETE;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
   priv->current_task = g_steal_pointer (&task);
   maybe_cancel_on_cancelled (device, cancellable);
 
-  g_task_set_task_data (priv->current_task,
-                        g_object_ref (enrolled_print),
-                        g_object_unref);
+  data = g_new0 (FpDeleteData, 1);
+  data->print = g_object_ref (enrolled_print);
+  g_task_set_task_data (priv->current_task, data, (GDestroyNotify) delete_data_free);
 
   FP_DEVICE_GET_CLASS (device)->delete (device);
 }
@@ -1170,22 +1953,163 @@ fp_device_delete_print_finish (FpDevice     *device,
 }
 
 /**
- * fp_device_list_prints:
+ * fp_device_delete_prints:
  * @device: a #FpDevice
+ * @prints: (element-type FpPrint) (transfer none): the #FpPrint objects to delete
  * @cancellable: (nullable): a #GCancellable, or %NULL
  * @callback: the function to call on completion
  * @user_data: the data to pass to @callback
  *
- * Start an asynchronous operation to list all prints stored on the device.
- * This only makes sense on devices that store prints on-chip.
+ * Start an asynchronous operation to delete several prints from the
+ * device. This is a single operation, drivers may delete all prints with
+ * one command, otherwise they are deleted one after the other without
+ * returning to the caller in between. Retrieve the result with
+ * fp_device_delete_prints_finish().
  *
- * Retrieve the result with fp_device_list_prints_finish().
+ * The first error ends the operation, prints that were deleted before
+ * stay deleted.
+ *
+ * This only makes sense on devices that store prints on-chip, but is safe
+ * to always call.
  */
 void
-fp_device_list_prints (FpDevice           *device,
-                       GCancellable       *cancellable,
-                       GAsyncReadyCallback callback,
-                       gpointer            user_data)
+fp_device_delete_prints (FpDevice           *device,
+                         GPtrArray          *prints,
+                         GCancellable       *cancellable,
+                         GAsyncReadyCallback callback,
+                         gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeviceClass *cls = FP_DEVICE_GET_CLASS (device);
+  FpDeleteData *data;
+  guint i;
+
+  task = g_task_new (device, cancellable, callback, user_data);
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  if (!priv->is_open)
+    {
+      g_task_return_error (task,
+                           fpi_device_error_new (FP_DEVICE_ERROR_NOT_OPEN));
+      return;
+    }
+
+  if (priv->current_task)
+    {
+      g_task_return_error (task,
+                           fpi_device_error_new (FP_DEVICE_ERROR_BUSY));
+      return;
+    }
+
+  /* Succeed immediately if delete is not implemented. */
+  if ((!cls->delete && !cls->delete_prints) || prints->len == 0)
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  priv->current_action = FPI_DEVICE_ACTION_DELETE;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
+  priv->current_task = g_steal_pointer (&task);
+  maybe_cancel_on_cancelled (device, cancellable);
+
+  /* The caller may change the array while the prints are deleted */
+  data = g_new0 (FpDeleteData, 1);
+  data->prints = g_ptr_array_new_full (prints->len, g_object_unref);
+  for (i = 0; i < prints->len; i++)
+    g_ptr_array_add (data->prints, g_object_ref (g_ptr_array_index (prints, i)));
+  data->print = g_object_ref (g_ptr_array_index (data->prints, 0));
+  g_task_set_task_data (priv->current_task, data, (GDestroyNotify) delete_data_free);
+
+  if (cls->delete_prints)
+    {
+      data->next = data->prints->len;
+      cls->delete_prints (device);
+    }
+  else
+    {
+      data->next = 1;
+      cls->delete (device);
+    }
+}
+
+/**
+ * fp_device_delete_prints_finish:
+ * @device: A #FpDevice
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an asynchronous operation to delete several enrolled prints.
+ *
+ * See fp_device_delete_prints().
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_delete_prints_finish (FpDevice     *device,
+                                GAsyncResult *result,
+                                GError      **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+clear_storage_delete_cb (GObject      *source_object,
+                         GAsyncResult *res,
+                         gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GError *error = NULL;
+
+  if (!fp_device_delete_prints_finish (FP_DEVICE (source_object), res, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+clear_storage_list_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(GPtrArray) prints = NULL;
+  GError *error = NULL;
+
+  prints = fp_device_list_prints_finish (FP_DEVICE (source_object), res, &error);
+  if (!prints)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  fp_device_delete_prints (FP_DEVICE (source_object), prints,
+                           g_task_get_cancellable (task),
+                           clear_storage_delete_cb,
+                           g_steal_pointer (&task));
+}
+
+/**
+ * fp_device_clear_storage:
+ * @device: a #FpDevice
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Start an asynchronous operation to delete all prints stored on the
+ * device. Drivers that cannot wipe the storage with one command list the
+ * stored prints and delete them, see fp_device_delete_prints().
+ *
+ * Retrieve the result with fp_device_clear_storage_finish().
+ */
+void
+fp_device_clear_storage (FpDevice           *device,
+                         GCancellable       *cancellable,
+                         GAsyncReadyCallback callback,
+                         gpointer            user_data)
 {
   g_autoptr(GTask) task = NULL;
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
@@ -1216,11 +2140,177 @@ fp_device_list_prints (FpDevice           *device,
       return;
     }
 
+  if (!FP_DEVICE_GET_CLASS (device)->clear_storage)
+    {
+      fp_device_list_prints (device, cancellable, clear_storage_list_cb,
+                             g_steal_pointer (&task));
+      return;
+    }
+
+  priv->current_action = FPI_DEVICE_ACTION_CLEAR_STORAGE;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
+  priv->current_task = g_steal_pointer (&task);
+  maybe_cancel_on_cancelled (device, cancellable);
+
+  FP_DEVICE_GET_CLASS (device)->clear_storage (device);
+}
+
+/**
+ * fp_device_clear_storage_finish:
+ * @device: A #FpDevice
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an asynchronous operation to delete all stored prints.
+ *
+ * See fp_device_clear_storage().
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_clear_storage_finish (FpDevice     *device,
+                                GAsyncResult *result,
+                                GError      **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+fp_device_list_start (FpDevice           *device,
+                      GCancellable       *cancellable,
+                      FpListCb            list_cb,
+                      gpointer            list_data,
+                      GDestroyNotify      list_destroy,
+                      GAsyncReadyCallback callback,
+                      gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpListData *data;
+
+  task = g_task_new (device, cancellable, callback, user_data);
+  if (g_task_return_error_if_cancelled (task))
+    goto error;
+
+  if (!priv->is_open)
+    {
+      g_task_return_error (task,
+                           fpi_device_error_new (FP_DEVICE_ERROR_NOT_OPEN));
+      goto error;
+    }
+
+  if (priv->current_task)
+    {
+      g_task_return_error (task,
+                           fpi_device_error_new (FP_DEVICE_ERROR_BUSY));
+      goto error;
+    }
+
+  if (!fp_device_has_storage (device))
+    {
+      g_task_return_error (task,
+                           fpi_device_error_new_msg (FP_DEVICE_ERROR_NOT_SUPPORTED,
+                                                     "Device has no storage"));
+      goto error;
+    }
+
   priv->current_action = FPI_DEVICE_ACTION_LIST;
+  fpi_device_stats_start (device);
+  fpi_device_power_hold (device);
   priv->current_task = g_steal_pointer (&task);
   maybe_cancel_on_cancelled (device, cancellable);
 
+  data = g_new0 (FpListData, 1);
+  data->streamed = list_cb != NULL;
+  data->list_cb = list_cb;
+  data->list_data = list_data;
+  data->list_destroy = list_destroy;
+  g_task_set_task_data (priv->current_task, data, (GDestroyNotify) list_data_free);
+
   FP_DEVICE_GET_CLASS (device)->list (device);
+  return;
+
+error:
+  if (list_destroy)
+    list_destroy (list_data);
+}
+
+/**
+ * fp_device_list_prints:
+ * @device: a #FpDevice
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Start an asynchronous operation to list all prints stored on the device.
+ * This only makes sense on devices that store prints on-chip.
+ *
+ * Retrieve the result with fp_device_list_prints_finish().
+ */
+void
+fp_device_list_prints (FpDevice           *device,
+                       GCancellable       *cancellable,
+                       GAsyncReadyCallback callback,
+                       gpointer            user_data)
+{
+  fp_device_list_start (device, cancellable, NULL, NULL, NULL,
+                        callback, user_data);
+}
+
+/**
+ * fp_device_list_prints_streamed:
+ * @device: a #FpDevice
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @list_cb: (scope notified): the function to call for each stored print
+ * @list_data: (closure list_cb): the data to pass to @list_cb
+ * @list_destroy: (destroy list_cb): the #GDestroyNotify for @list_data
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Start an asynchronous operation to list the prints stored on the device
+ * one by one. @list_cb is called for each print, as soon as the driver
+ * finds it where the driver supports that, and may return %FALSE to stop
+ * listing, e.g. once a print that is looked for was found. The prints are
+ * not collected, so this needs little memory however many prints are
+ * stored.
+ *
+ * Retrieve the result with fp_device_list_prints_streamed_finish().
+ */
+void
+fp_device_list_prints_streamed (FpDevice           *device,
+                                GCancellable       *cancellable,
+                                FpListCb            list_cb,
+                                gpointer            list_data,
+                                GDestroyNotify      list_destroy,
+                                GAsyncReadyCallback callback,
+                                gpointer            user_data)
+{
+  g_return_if_fail (list_cb != NULL);
+
+  fp_device_list_start (device, cancellable, list_cb, list_data, list_destroy,
+                        callback, user_data);
+}
+
+/**
+ * fp_device_list_prints_streamed_finish:
+ * @device: A #FpDevice
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an asynchronous operation to list the device stored prints,
+ * stopping early by returning %FALSE from the #FpListCb is not an error.
+ *
+ * See fp_device_list_prints_streamed().
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_list_prints_streamed_finish (FpDevice     *device,
+                                       GAsyncResult *result,
+                                       GError      **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 /**
@@ -1272,7 +2362,7 @@ fp_device_open_sync (FpDevice     *device,
 
   fp_device_open (device, cancellable, async_result_ready, &task);
   while (!task)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
 
   return fp_device_open_finish (device, task, error);
 }
@@ -1298,11 +2388,63 @@ fp_device_close_sync (FpDevice     *device,
 
   fp_device_close (device, cancellable, async_result_ready, &task);
   while (!task)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
 
   return fp_device_close_finish (device, task, error);
 }
 
+/**
+ * fp_device_suspend_sync:
+ * @device: a #FpDevice
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Prepare the device for system suspend synchronously.
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_suspend_sync (FpDevice     *device,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  g_autoptr(GAsyncResult) task = NULL;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), FALSE);
+
+  fp_device_suspend (device, cancellable, async_result_ready, &task);
+  while (!task)
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
+
+  return fp_device_suspend_finish (device, task, error);
+}
+
+/**
+ * fp_device_resume_sync:
+ * @device: a #FpDevice
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Resume the device synchronously.
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_resume_sync (FpDevice     *device,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GAsyncResult) task = NULL;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), FALSE);
+
+  fp_device_resume (device, cancellable, async_result_ready, &task);
+  while (!task)
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
+
+  return fp_device_resume_finish (device, task, error);
+}
+
 /**
  * fp_device_enroll_sync:
  * @device: a #FpDevice
@@ -1334,7 +2476,7 @@ fp_device_enroll_sync (FpDevice        *device,
                     progress_cb, progress_data, NULL,
                     async_result_ready, &task);
   while (!task)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
 
   return fp_device_enroll_finish (device, task, error);
 }
@@ -1374,7 +2516,7 @@ fp_device_verify_sync (FpDevice     *device,
                     match_cb, match_data, NULL,
                     async_result_ready, &task);
   while (!task)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
 
   return fp_device_verify_finish (device, task, match, print, error);
 }
@@ -1414,7 +2556,7 @@ fp_device_identify_sync (FpDevice     *device,
                       match_cb, match_data, NULL,
                       async_result_ready, &task);
   while (!task)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
 
   return fp_device_identify_finish (device, task, match, print, error);
 }
@@ -1446,7 +2588,7 @@ fp_device_capture_sync (FpDevice     *device,
                      cancellable,
                      async_result_ready, &task);
   while (!task)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
 
   return fp_device_capture_finish (device, task, error);
 }
@@ -1477,11 +2619,70 @@ fp_device_delete_print_sync (FpDevice     *device,
                           cancellable,
                           async_result_ready, &task);
   while (!task)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
 
   return fp_device_delete_print_finish (device, task, error);
 }
 
+/**
+ * fp_device_delete_prints_sync:
+ * @device: a #FpDevice
+ * @prints: (element-type FpPrint) (transfer none): the #FpPrint objects to delete
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Delete the given prints from the device, see fp_device_delete_prints().
+ *
+ * Returns: %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_delete_prints_sync (FpDevice     *device,
+                              GPtrArray    *prints,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autoptr(GAsyncResult) task = NULL;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), FALSE);
+
+  fp_device_delete_prints (device,
+                           prints,
+                           cancellable,
+                           async_result_ready, &task);
+  while (!task)
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
+
+  return fp_device_delete_prints_finish (device, task, error);
+}
+
+/**
+ * fp_device_clear_storage_sync:
+ * @device: a #FpDevice
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Delete all prints stored on the device, see fp_device_clear_storage().
+ *
+ * Returns: %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_device_clear_storage_sync (FpDevice     *device,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autoptr(GAsyncResult) task = NULL;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), FALSE);
+
+  fp_device_clear_storage (device,
+                           cancellable,
+                           async_result_ready, &task);
+  while (!task)
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
+
+  return fp_device_clear_storage_finish (device, task, error);
+}
+
 /**
  * fp_device_list_prints_sync:
  * @device: a #FpDevice
@@ -1505,7 +2706,7 @@ fp_device_list_prints_sync (FpDevice     *device,
                          NULL,
                          async_result_ready, &task);
   while (!task)
-    g_main_context_iteration (NULL, TRUE);
+    g_main_context_iteration (g_main_context_get_thread_default (), TRUE);
 
   return fp_device_list_prints_finish (device, task, error);
 }
@@ -32,6 +32,7 @@ G_BEGIN_DECLS
 G_DECLARE_DERIVABLE_TYPE (FpDevice, fp_device, FP, DEVICE, GObject)
 
 #include "fp-print.h"
+#include "fp-gallery.h"
 
 /* NOTE: We keep the class struct private! */
 
@@ -90,6 +91,7 @@ typedef enum {
  * @FP_DEVICE_ERROR_DATA_INVALID: The passed data is invalid
  * @FP_DEVICE_ERROR_DATA_NOT_FOUND: Requested print was not found on device
  * @FP_DEVICE_ERROR_DATA_FULL: No space on device available for operation
+ * @FP_DEVICE_ERROR_DATA_DUPLICATE: The finger is already enrolled
  *
  * Error codes for device operations. More specific errors from other domains
  * such as #G_IO_ERROR or #G_USB_DEVICE_ERROR may also be reported.
@@ -104,6 +106,7 @@ typedef enum {
   FP_DEVICE_ERROR_DATA_INVALID,
   FP_DEVICE_ERROR_DATA_NOT_FOUND,
   FP_DEVICE_ERROR_DATA_FULL,
+  FP_DEVICE_ERROR_DATA_DUPLICATE,
 } FpDeviceError;
 
 GQuark fp_device_retry_quark (void);
@@ -163,6 +166,57 @@ typedef void (*FpMatchCb) (FpDevice *device,
                            gpointer  user_data,
                            GError   *error);
 
+/**
+ * FpListCb:
+ * @device: a #FpDevice
+ * @print: (transfer none): A print stored on the device
+ * @user_data: (nullable) (transfer none): User provided data
+ *
+ * Reports a print stored on the device while it is being listed, see
+ * fp_device_list_prints_streamed(). Take a reference to keep @print.
+ *
+ * Returns: %FALSE to stop listing, %TRUE to continue
+ */
+typedef gboolean (*FpListCb) (FpDevice *device,
+                              FpPrint  *print,
+                              gpointer  user_data);
+
+/**
+ * FpOperationStats:
+ * @duration: Time from starting the operation until it completed, in
+ *   microseconds
+ * @time_to_finger: Time until a finger was detected, in microseconds, or -1
+ * @capture_time: Time from detecting the finger until the last image was
+ *   captured, in microseconds, or -1
+ * @minutiae_time: Time spent detecting the minutiae of the last image, in
+ *   microseconds, or -1
+ * @n_minutiae: Number of minutiae found in the last image, or -1
+ * @match_time: Time spent matching, in microseconds, or -1
+ * @n_candidates: Number of enrolled prints the scan was matched against
+ * @usb_bytes: Number of bytes transferred over USB in either direction
+ * @usb_transfers: Number of completed USB transfers
+ * @retries: Number of scans that had to be retried
+ *
+ * Statistics of a completed device operation, see
+ * fp_device_get_last_operation_stats(). Values that do not apply to the
+ * operation or are not known for the device are set to -1 (or 0 for the
+ * counters). Drivers that match on the device do not report the minutiae
+ * and match fields.
+ */
+typedef struct
+{
+  gint64  duration;
+  gint64  time_to_finger;
+  gint64  capture_time;
+  gint64  minutiae_time;
+  gint    n_minutiae;
+  gint64  match_time;
+  guint   n_candidates;
+  guint64 usb_bytes;
+  guint   usb_transfers;
+  guint   retries;
+} FpOperationStats;
+
 const gchar *fp_device_get_driver (FpDevice *device);
 const gchar *fp_device_get_device_id (FpDevice *device);
 const gchar *fp_device_get_name (FpDevice *device);
@@ -174,6 +228,19 @@ gboolean     fp_device_supports_identify (FpDevice *device);
 gboolean     fp_device_supports_capture (FpDevice *device);
 gboolean     fp_device_has_storage (FpDevice *device);
 
+gboolean     fp_device_get_last_operation_stats (FpDevice         *device,
+                                                 FpOperationStats *stats);
+
+void         fp_device_set_identify_max_results (FpDevice *device,
+                                                 guint     max_results);
+guint        fp_device_get_identify_max_results (FpDevice *device);
+void         fp_device_set_autosuspend_delay (FpDevice *device,
+                                              gint      delay_ms);
+gint         fp_device_get_autosuspend_delay (FpDevice *device);
+void         fp_device_set_enroll_duplicate_gallery (FpDevice  *device,
+                                                     FpGallery *gallery);
+FpGallery   *fp_device_get_enroll_duplicate_gallery (FpDevice *device);
+
 /* Opening the device */
 void fp_device_open (FpDevice           *device,
                      GCancellable       *cancellable,
@@ -185,6 +252,16 @@ void fp_device_close (FpDevice           *device,
                       GAsyncReadyCallback callback,
                       gpointer            user_data);
 
+void fp_device_suspend (FpDevice           *device,
+                        GCancellable       *cancellable,
+                        GAsyncReadyCallback callback,
+                        gpointer            user_data);
+
+void fp_device_resume (FpDevice           *device,
+                       GCancellable       *cancellable,
+                       GAsyncReadyCallback callback,
+                       gpointer            user_data);
+
 void fp_device_enroll (FpDevice           *device,
                        FpPrint            *template_print,
                        GCancellable       *cancellable,
@@ -212,6 +289,30 @@ void fp_device_identify (FpDevice           *device,
                          GAsyncReadyCallback callback,
                          gpointer            user_data);
 
+void fp_device_identify_gallery (FpDevice           *device,
+                                 FpGallery          *gallery,
+                                 GCancellable       *cancellable,
+                                 FpMatchCb           match_cb,
+                                 gpointer            match_data,
+                                 GDestroyNotify      match_destroy,
+                                 GAsyncReadyCallback callback,
+                                 gpointer            user_data);
+
+void fp_device_identify_continuous (FpDevice           *device,
+                                    GPtrArray          *prints,
+                                    GCancellable       *cancellable,
+                                    FpMatchCb           match_cb,
+                                    gpointer            match_data,
+                                    GDestroyNotify      match_destroy,
+                                    GAsyncReadyCallback callback,
+                                    gpointer            user_data);
+
+void fp_device_identify_any (GPtrArray          *devices,
+                             GPtrArray          *prints,
+                             GCancellable       *cancellable,
+                             GAsyncReadyCallback callback,
+                             gpointer            user_data);
+
 void fp_device_capture (FpDevice           *device,
                         gboolean            wait_for_finger,
                         GCancellable       *cancellable,
@@ -224,17 +325,42 @@ void fp_device_delete_print (FpDevice           *device,
                              GAsyncReadyCallback callback,
                              gpointer            user_data);
 
+void fp_device_delete_prints (FpDevice           *device,
+                              GPtrArray          *prints,
+                              GCancellable       *cancellable,
+                              GAsyncReadyCallback callback,
+                              gpointer            user_data);
+
+void fp_device_clear_storage (FpDevice           *device,
+                              GCancellable       *cancellable,
+                              GAsyncReadyCallback callback,
+                              gpointer            user_data);
+
 void fp_device_list_prints (FpDevice           *device,
                             GCancellable       *cancellable,
                             GAsyncReadyCallback callback,
                             gpointer            user_data);
 
+void fp_device_list_prints_streamed (FpDevice           *device,
+                                     GCancellable       *cancellable,
+                                     FpListCb            list_cb,
+                                     gpointer            list_data,
+                                     GDestroyNotify      list_destroy,
+                                     GAsyncReadyCallback callback,
+                                     gpointer            user_data);
+
 gboolean fp_device_open_finish (FpDevice     *device,
                                 GAsyncResult *result,
                                 GError      **error);
 gboolean fp_device_close_finish (FpDevice     *device,
                                  GAsyncResult *result,
                                  GError      **error);
+gboolean fp_device_suspend_finish (FpDevice     *device,
+                                   GAsyncResult *result,
+                                   GError      **error);
+gboolean fp_device_resume_finish (FpDevice     *device,
+                                  GAsyncResult *result,
+                                  GError      **error);
 FpPrint *fp_device_enroll_finish (FpDevice     *device,
                                   GAsyncResult *result,
                                   GError      **error);
@@ -248,15 +374,35 @@ gboolean fp_device_identify_finish (FpDevice     *device,
                                     FpPrint     **match,
                                     FpPrint     **print,
                                     GError      **error);
+gboolean fp_device_identify_continuous_finish (FpDevice     *device,
+                                               GAsyncResult *result,
+                                               GError      **error);
+GPtrArray *fp_device_identify_get_scores (FpDevice     *device,
+                                          GAsyncResult *result,
+                                          GArray      **scores);
+gboolean fp_device_identify_any_finish (GAsyncResult *result,
+                                        FpDevice    **device,
+                                        FpPrint     **match,
+                                        FpPrint     **print,
+                                        GError      **error);
 FpImage * fp_device_capture_finish (FpDevice     *device,
                                     GAsyncResult *result,
                                     GError      **error);
 gboolean fp_device_delete_print_finish (FpDevice     *device,
                                         GAsyncResult *result,
                                         GError      **error);
+gboolean fp_device_delete_prints_finish (FpDevice     *device,
+                                         GAsyncResult *result,
+                                         GError      **error);
+gboolean fp_device_clear_storage_finish (FpDevice     *device,
+                                         GAsyncResult *result,
+                                         GError      **error);
 GPtrArray * fp_device_list_prints_finish (FpDevice     *device,
                                           GAsyncResult *result,
                                           GError      **error);
+gboolean fp_device_list_prints_streamed_finish (FpDevice     *device,
+                                                GAsyncResult *result,
+                                                GError      **error);
 
 
 gboolean fp_device_open_sync (FpDevice     *device,
@@ -265,6 +411,12 @@ gboolean fp_device_open_sync (FpDevice     *device,
 gboolean fp_device_close_sync (FpDevice     *device,
                                GCancellable *cancellable,
                                GError      **error);
+gboolean fp_device_suspend_sync (FpDevice     *device,
+                                 GCancellable *cancellable,
+                                 GError      **error);
+gboolean fp_device_resume_sync (FpDevice     *device,
+                                GCancellable *cancellable,
+                                GError      **error);
 FpPrint * fp_device_enroll_sync (FpDevice        *device,
                                  FpPrint         *template_print,
                                  GCancellable    *cancellable,
@@ -295,6 +447,13 @@ gboolean fp_device_delete_print_sync (FpDevice     *device,
                                       FpPrint      *enrolled_print,
                                       GCancellable *cancellable,
                                       GError      **error);
+gboolean fp_device_delete_prints_sync (FpDevice     *device,
+                                       GPtrArray    *prints,
+                                       GCancellable *cancellable,
+                                       GError      **error);
+gboolean fp_device_clear_storage_sync (FpDevice     *device,
+                                       GCancellable *cancellable,
+                                       GError      **error);
 GPtrArray * fp_device_list_prints_sync (FpDevice     *device,
                                         GCancellable *cancellable,
                                         GError      **error);
@@ -0,0 +1,471 @@
+/*
+ * FpGallery - A set of prints to identify against
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "gallery"
+
+#include "fp-gallery.h"
+#include "fp-image-device.h"
+#include "fp-print-private.h"
+#include "fpi-log.h"
+
+#include <string.h>
+
+/**
+ * SECTION: fp-gallery
+ * @title: FpGallery
+ * @short_description: A set of prints to identify against
+ *
+ * An #FpGallery holds the enrolled prints that are passed to
+ * fp_device_identify_gallery(). Unlike the plain #GPtrArray accepted by
+ * fp_device_identify(), a gallery is meant to be kept around: the data
+ * used to match against each print and to rank the prints is built once
+ * when the print is added, instead of during the first identify.
+ *
+ * The gallery may be modified while an identify operation is running,
+ * the operation continues to use the prints it was started with.
+ *
+ * Identification stops at the first print that matches well enough, so
+ * the order of the prints matters. With fp_gallery_set_adaptive_order(),
+ * prints that matched move towards the front, so that the users who
+ * touch the most are tried first.
+ *
+ * A gallery may hold prints of several devices. It keeps them grouped by
+ * the device they are compatible with, so that
+ * fp_device_identify_gallery() only passes on the prints of the device it
+ * identifies with.
+ */
+
+/* The prints of one driver, device ID and print type, in the same order
+ * as in the gallery */
+typedef struct
+{
+  gchar       *driver;
+  gchar       *device_id;
+  FpiPrintType type;
+
+  GPtrArray   *prints;
+  gboolean     prints_shared;
+} FpGalleryPartition;
+
+struct _FpGallery
+{
+  GObject    parent_instance;
+
+  GPtrArray *prints;
+  /* Whether @prints is also referenced by a running operation, in which
+   * case it is copied before it is modified. */
+  gboolean   prints_shared;
+  gboolean   adaptive_order;
+
+  /* The prints by their digest, to find duplicates */
+  GHashTable *digests;
+
+  GPtrArray  *partitions;
+  /* The partition of each print */
+  GHashTable *print_partitions;
+};
+
+static void
+fp_gallery_partition_free (FpGalleryPartition *partition)
+{
+  g_free (partition->driver);
+  g_free (partition->device_id);
+  g_ptr_array_unref (partition->prints);
+  g_free (partition);
+}
+
+G_DEFINE_TYPE (FpGallery, fp_gallery, G_TYPE_OBJECT)
+
+static void
+fp_gallery_finalize (GObject *object)
+{
+  FpGallery *self = FP_GALLERY (object);
+
+  g_clear_pointer (&self->prints, g_ptr_array_unref);
+  g_clear_pointer (&self->digests, g_hash_table_unref);
+  g_clear_pointer (&self->print_partitions, g_hash_table_unref);
+  g_clear_pointer (&self->partitions, g_ptr_array_unref);
+
+  G_OBJECT_CLASS (fp_gallery_parent_class)->finalize (object);
+}
+
+static void
+fp_gallery_class_init (FpGalleryClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = fp_gallery_finalize;
+}
+
+static void
+fp_gallery_init (FpGallery *self)
+{
+  self->prints = g_ptr_array_new_with_free_func (g_object_unref);
+  self->digests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->partitions = g_ptr_array_new_with_free_func ((GDestroyNotify) fp_gallery_partition_free);
+  self->print_partitions = g_hash_table_new (NULL, NULL);
+}
+
+/**
+ * fp_gallery_new:
+ *
+ * Creates a new, empty gallery.
+ *
+ * Returns: (transfer full): A new #FpGallery
+ */
+FpGallery *
+fp_gallery_new (void)
+{
+  return g_object_new (FP_TYPE_GALLERY, NULL);
+}
+
+/**
+ * fp_gallery_new_from_prints:
+ * @prints: (element-type FpPrint) (transfer none): The prints to add
+ *
+ * Creates a new gallery containing @prints, e.g. as returned by
+ * fp_print_load_gallery().
+ *
+ * Returns: (transfer full): A new #FpGallery
+ */
+FpGallery *
+fp_gallery_new_from_prints (GPtrArray *prints)
+{
+  FpGallery *self;
+  guint i;
+
+  g_return_val_if_fail (prints != NULL, NULL);
+
+  self = fp_gallery_new ();
+  for (i = 0; i < prints->len; i++)
+    fp_gallery_add_print (self, g_ptr_array_index (prints, i));
+
+  return self;
+}
+
+static void
+unshare_prints (GPtrArray **prints,
+                gboolean   *shared)
+{
+  GPtrArray *copy;
+  guint i;
+
+  if (!*shared)
+    return;
+
+  copy = g_ptr_array_new_full ((*prints)->len, g_object_unref);
+  for (i = 0; i < (*prints)->len; i++)
+    g_ptr_array_add (copy, g_object_ref (g_ptr_array_index (*prints, i)));
+
+  g_ptr_array_unref (*prints);
+  *prints = copy;
+  *shared = FALSE;
+}
+
+static void
+fp_gallery_unshare (FpGallery *self)
+{
+  unshare_prints (&self->prints, &self->prints_shared);
+}
+
+static FpGalleryPartition *
+fp_gallery_get_partition (FpGallery   *self,
+                          const gchar *driver,
+                          const gchar *device_id,
+                          FpiPrintType type,
+                          gboolean     create)
+{
+  FpGalleryPartition *partition;
+  guint i;
+
+  /* There are only a few devices, a list is fine */
+  for (i = 0; i < self->partitions->len; i++)
+    {
+      partition = g_ptr_array_index (self->partitions, i);
+
+      if (partition->type == type &&
+          g_str_equal (partition->driver, driver) &&
+          g_str_equal (partition->device_id, device_id))
+        return partition;
+    }
+
+  if (!create)
+    return NULL;
+
+  partition = g_new0 (FpGalleryPartition, 1);
+  partition->driver = g_strdup (driver);
+  partition->device_id = g_strdup (device_id);
+  partition->type = type;
+  partition->prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (self->partitions, partition);
+
+  return partition;
+}
+
+/**
+ * fp_gallery_add_print:
+ * @gallery: A #FpGallery
+ * @print: (transfer none): The #FpPrint to add
+ *
+ * Adds @print to @gallery, unless it or an equal print (see
+ * fp_print_equal()) is already part of it. This builds the data needed to
+ * match against @print, which is the expensive part of adding it.
+ */
+void
+fp_gallery_add_print (FpGallery *gallery,
+                      FpPrint   *print)
+{
+  FpGalleryPartition *partition;
+  const gchar *digest;
+
+  g_return_if_fail (FP_IS_GALLERY (gallery));
+  g_return_if_fail (FP_IS_PRINT (print));
+
+  digest = fp_print_get_digest (print);
+  g_return_if_fail (digest != NULL);
+
+  if (g_hash_table_contains (gallery->digests, digest))
+    return;
+
+  fpi_print_bz3_prepare (print);
+
+  fp_gallery_unshare (gallery);
+  g_ptr_array_add (gallery->prints, g_object_ref_sink (print));
+  g_hash_table_insert (gallery->digests, g_strdup (digest), print);
+
+  partition = fp_gallery_get_partition (gallery, print->driver, print->device_id,
+                                        print->type, TRUE);
+  unshare_prints (&partition->prints, &partition->prints_shared);
+  g_ptr_array_add (partition->prints, g_object_ref (print));
+  g_hash_table_insert (gallery->print_partitions, print, partition);
+}
+
+static gboolean
+digest_is_print (gpointer key, gpointer value, gpointer user_data)
+{
+  return value == user_data;
+}
+
+/**
+ * fp_gallery_remove_print:
+ * @gallery: A #FpGallery
+ * @print: The #FpPrint to remove
+ *
+ * Removes @print from @gallery.
+ *
+ * Returns: %TRUE if @print was part of @gallery
+ */
+gboolean
+fp_gallery_remove_print (FpGallery *gallery,
+                         FpPrint   *print)
+{
+  FpGalleryPartition *partition;
+  guint idx;
+
+  g_return_val_if_fail (FP_IS_GALLERY (gallery), FALSE);
+  g_return_val_if_fail (FP_IS_PRINT (print), FALSE);
+
+  if (!g_ptr_array_find (gallery->prints, print, &idx))
+    return FALSE;
+
+  partition = g_hash_table_lookup (gallery->print_partitions, print);
+  g_hash_table_remove (gallery->print_partitions, print);
+  if (partition->prints->len == 1)
+    {
+      g_ptr_array_remove_fast (gallery->partitions, partition);
+    }
+  else
+    {
+      unshare_prints (&partition->prints, &partition->prints_shared);
+      g_ptr_array_remove (partition->prints, print);
+    }
+
+  /* The print data may have changed since it was added */
+  if (g_hash_table_lookup (gallery->digests, fp_print_get_digest (print)) == print)
+    g_hash_table_remove (gallery->digests, fp_print_get_digest (print));
+  else
+    g_hash_table_foreach_remove (gallery->digests, digest_is_print, print);
+
+  fp_gallery_unshare (gallery);
+  g_ptr_array_remove_index (gallery->prints, idx);
+
+  return TRUE;
+}
+
+/**
+ * fp_gallery_set_adaptive_order:
+ * @gallery: A #FpGallery
+ * @adaptive: Whether to reorder the prints as they match
+ *
+ * Enables or disables adaptive ordering. When enabled, every match
+ * reported by fp_device_identify_gallery() or fp_gallery_report_match()
+ * moves the print halfway towards the front of the gallery. Prints that
+ * match often end up at the front, while a single match of a rarely used
+ * print does not push the regular ones back by much.
+ *
+ * Large galleries are first ranked by the similarity to the scanned
+ * print, where the order only breaks ties.
+ */
+void
+fp_gallery_set_adaptive_order (FpGallery *gallery,
+                               gboolean   adaptive)
+{
+  g_return_if_fail (FP_IS_GALLERY (gallery));
+
+  gallery->adaptive_order = adaptive;
+}
+
+/**
+ * fp_gallery_get_adaptive_order:
+ * @gallery: A #FpGallery
+ *
+ * Returns: Whether @gallery reorders its prints as they match
+ */
+gboolean
+fp_gallery_get_adaptive_order (FpGallery *gallery)
+{
+  g_return_val_if_fail (FP_IS_GALLERY (gallery), FALSE);
+
+  return gallery->adaptive_order;
+}
+
+/**
+ * fp_gallery_report_match:
+ * @gallery: A #FpGallery
+ * @print: The #FpPrint that matched
+ *
+ * Reports that @print was identified, for adaptive ordering. This is done
+ * by fp_device_identify_gallery() already, and only needs to be called
+ * when identifying with the prints returned by fp_gallery_get_prints().
+ * Nothing happens unless adaptive ordering is enabled.
+ */
+void
+fp_gallery_report_match (FpGallery *gallery,
+                         FpPrint   *print)
+{
+  FpGalleryPartition *partition;
+  guint idx, new_idx, part_idx, skipped, i;
+
+  g_return_if_fail (FP_IS_GALLERY (gallery));
+  g_return_if_fail (FP_IS_PRINT (print));
+
+  if (!gallery->adaptive_order)
+    return;
+
+  if (!g_ptr_array_find (gallery->prints, print, &idx))
+    return;
+
+  new_idx = idx / 2;
+  if (new_idx == idx)
+    return;
+
+  /* Keep the partition in the same order, the print moves in front of
+   * the prints of its partition that it overtakes in the gallery. */
+  partition = g_hash_table_lookup (gallery->print_partitions, print);
+  for (i = new_idx, skipped = 0; i < idx; i++)
+    if (g_hash_table_lookup (gallery->print_partitions,
+                             g_ptr_array_index (gallery->prints, i)) == partition)
+      skipped++;
+
+  if (skipped > 0 && g_ptr_array_find (partition->prints, print, &part_idx))
+    {
+      unshare_prints (&partition->prints, &partition->prints_shared);
+      memmove (&partition->prints->pdata[part_idx - skipped + 1],
+               &partition->prints->pdata[part_idx - skipped],
+               skipped * sizeof (gpointer));
+      partition->prints->pdata[part_idx - skipped] = print;
+    }
+
+  fp_gallery_unshare (gallery);
+  memmove (&gallery->prints->pdata[new_idx + 1], &gallery->prints->pdata[new_idx],
+           (idx - new_idx) * sizeof (gpointer));
+  gallery->prints->pdata[new_idx] = print;
+}
+
+/**
+ * fp_gallery_get_n_prints:
+ * @gallery: A #FpGallery
+ *
+ * Returns: The number of prints in @gallery
+ */
+guint
+fp_gallery_get_n_prints (FpGallery *gallery)
+{
+  g_return_val_if_fail (FP_IS_GALLERY (gallery), 0);
+
+  return gallery->prints->len;
+}
+
+/**
+ * fp_gallery_get_prints:
+ * @gallery: A #FpGallery
+ *
+ * Gets the prints of @gallery in the order they were added, or in the
+ * adaptive order, see fp_gallery_set_adaptive_order(). The returned
+ * array is not modified when @gallery changes later on, and must not
+ * be modified by the caller.
+ *
+ * Returns: (transfer container) (element-type FpPrint): The prints
+ */
+GPtrArray *
+fp_gallery_get_prints (FpGallery *gallery)
+{
+  g_return_val_if_fail (FP_IS_GALLERY (gallery), NULL);
+
+  gallery->prints_shared = TRUE;
+
+  return g_ptr_array_ref (gallery->prints);
+}
+
+/**
+ * fp_gallery_get_compatible_prints:
+ * @gallery: A #FpGallery
+ * @device: A #FpDevice
+ *
+ * Like fp_gallery_get_prints(), but only gets the prints that @device can
+ * identify against. These are the prints that are compatible with @device
+ * (see fp_print_compatible()) and of the kind that its driver creates.
+ * The prints are grouped by device as they are added, so this does not
+ * need to look at every print.
+ *
+ * Returns: (transfer container) (element-type FpPrint): The prints
+ */
+GPtrArray *
+fp_gallery_get_compatible_prints (FpGallery *gallery,
+                                  FpDevice  *device)
+{
+  FpGalleryPartition *partition;
+  FpiPrintType type;
+
+  g_return_val_if_fail (FP_IS_GALLERY (gallery), NULL);
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+
+  /* Image devices match NBIS prints, all other drivers store raw data */
+  type = FP_IS_IMAGE_DEVICE (device) ? FPI_PRINT_NBIS : FPI_PRINT_RAW;
+  partition = fp_gallery_get_partition (gallery,
+                                        fp_device_get_driver (device),
+                                        fp_device_get_device_id (device),
+                                        type, FALSE);
+  if (!partition)
+    return g_ptr_array_new_with_free_func (g_object_unref);
+
+  partition->prints_shared = TRUE;
+
+  return g_ptr_array_ref (partition->prints);
+}
@@ -0,0 +1,50 @@
+/*
+ * FpGallery - A set of prints to identify against
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define FP_TYPE_GALLERY (fp_gallery_get_type ())
+
+G_DECLARE_FINAL_TYPE (FpGallery, fp_gallery, FP, GALLERY, GObject)
+
+#include "fp-print.h"
+
+FpGallery *fp_gallery_new (void);
+FpGallery *fp_gallery_new_from_prints (GPtrArray *prints);
+
+void       fp_gallery_add_print (FpGallery *gallery,
+                                 FpPrint   *print);
+gboolean   fp_gallery_remove_print (FpGallery *gallery,
+                                    FpPrint   *print);
+guint      fp_gallery_get_n_prints (FpGallery *gallery);
+GPtrArray *fp_gallery_get_prints (FpGallery *gallery);
+GPtrArray *fp_gallery_get_compatible_prints (FpGallery *gallery,
+                                             FpDevice  *device);
+
+void       fp_gallery_set_adaptive_order (FpGallery *gallery,
+                                          gboolean   adaptive);
+gboolean   fp_gallery_get_adaptive_order (FpGallery *gallery);
+void       fp_gallery_report_match (FpGallery *gallery,
+                                    FpPrint   *print);
+
+G_END_DECLS
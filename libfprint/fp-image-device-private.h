@@ -20,6 +20,7 @@
 #pragma once
 
 #include "fpi-image-device.h"
+#include "fpi-capture-recorder.h"
 
 #define IMG_ENROLL_STAGES 5
 
@@ -31,13 +32,60 @@ typedef struct
 
   gboolean            enroll_await_on_pending;
   gint                enroll_stage;
+  gint                enroll_stages;
+  GQueue              enroll_detections;
 
-  guint               pending_activation_timeout_id;
+  /* Enroll stages that are being compared to the duplicate gallery */
+  GCancellable       *duplicate_cancellable;
+  guint               duplicate_checks_pending;
+  gboolean            enroll_complete_pending;
+
+  /* Continuous identify or a retry, waiting for the next touch */
+  gboolean            identify_await_on_pending;
+
+  /* Retries within a verify or identify operation */
+  guint               max_scan_retries;
+  guint               scan_retries;
+
+  GSource            *pending_activation_timeout;
   gboolean            pending_activation_timeout_waiting_finger_off;
 
   gint                bz3_threshold;
+  FpiMatcher          matcher;
+  gint                max_minutiae;
+  gboolean            enroll_consolidation;
+
+  /* Finishing enroll early once the stages agree */
+  gint                early_stop_min_stages;
+  gint                early_stop_min_score;
+  gint                early_stop_min_minutiae;
+  GPtrArray          *enroll_stage_prints;
+  gboolean            enroll_stages_agree;
+
+  /* Keeping the device active between operations */
+  guint               keep_active_ms;
+  GSource            *keep_active_timeout;
+  gboolean            standby;
+  gboolean            finger_present;
+
+  /* Adaptive finger detection polling */
+  guint               poll_delay_ms;
+  gint64              poll_fast_until;
+
+  /* Preview frames */
+  guint               frame_max_rate;
+  guint               frame_downsample;
+  gint64              last_frame_time;
+
+  /* Recording of what the driver reports, see FP_CAPTURE_RECORD */
+  FpiCaptureRecorder *recorder;
+
+  /* For the operation statistics */
+  gint64              capture_start_time;
+  gint64              detect_start_time;
 } FpImageDevicePrivate;
 
 
 void fpi_image_device_activate (FpImageDevice *image_device);
 void fpi_image_device_deactivate (FpImageDevice *image_device);
+gboolean fpi_image_device_resume (FpImageDevice *image_device);
@@ -37,6 +37,9 @@ G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE (FpImageDevice, fp_image_device, FP_TYPE_DEV
 enum {
   PROP_0,
   PROP_FPI_STATE,
+  PROP_FRAME_MAX_RATE,
+  PROP_FRAME_DOWNSAMPLE,
+  PROP_MAX_SCAN_RETRIES,
   N_PROPS
 };
 
@@ -44,6 +47,7 @@ static GParamSpec *properties[N_PROPS];
 
 enum {
   FPI_STATE_CHANGED,
+  FRAME,
 
   LAST_SIGNAL
 };
@@ -64,7 +68,7 @@ pending_activation_timeout (gpointer user_data)
   FpImageDevice *self = FP_IMAGE_DEVICE (user_data);
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
 
-  priv->pending_activation_timeout_id = 0;
+  priv->pending_activation_timeout = NULL;
 
   if (priv->pending_activation_timeout_waiting_finger_off)
     fpi_device_action_error (FP_DEVICE (self),
@@ -82,8 +86,12 @@ static void
 fp_image_device_open (FpDevice *device)
 {
   FpImageDeviceClass *cls = FP_IMAGE_DEVICE_GET_CLASS (device);
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (FP_IMAGE_DEVICE (device));
 
-  /* Nothing special about opening an image device, just
+  fpi_capture_recorder_free (priv->recorder);
+  priv->recorder = fpi_capture_recorder_new_for_device (device);
+
+  /* Nothing else special about opening an image device, just
    * forward the request. */
   cls->img_open (FP_IMAGE_DEVICE (device));
 }
@@ -171,7 +179,17 @@ fp_image_device_start_capture_action (FpDevice *device)
     }
 
   priv->enroll_stage = 0;
+  priv->enroll_stages = IMG_ENROLL_STAGES;
+  priv->enroll_stages_agree = TRUE;
+  g_clear_pointer (&priv->enroll_stage_prints, g_ptr_array_unref);
   priv->enroll_await_on_pending = FALSE;
+  priv->identify_await_on_pending = FALSE;
+  priv->scan_retries = 0;
+  priv->enroll_complete_pending = FALSE;
+
+  /* Re-use the device if it was kept active after the last operation. */
+  if (fpi_image_device_resume (self))
+    return;
 
   /* The device might still be deactivating from a previous call.
    * In that situation, try to wait for a bit before reporting back an
@@ -181,9 +199,13 @@ fp_image_device_start_capture_action (FpDevice *device)
   if (priv->state != FPI_IMAGE_DEVICE_STATE_INACTIVE || priv->active)
     {
       g_debug ("Got a new request while the device was still active");
-      g_assert (priv->pending_activation_timeout_id == 0);
-      priv->pending_activation_timeout_id =
-        g_timeout_add (100, pending_activation_timeout, device);
+      g_assert (priv->pending_activation_timeout == NULL);
+      priv->pending_activation_timeout = g_timeout_source_new (100);
+      g_source_set_callback (priv->pending_activation_timeout,
+                             pending_activation_timeout, device, NULL);
+      g_source_attach (priv->pending_activation_timeout,
+                       fpi_device_get_main_context (device));
+      g_source_unref (priv->pending_activation_timeout);
 
       if (priv->state == FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF)
         priv->pending_activation_timeout_waiting_finger_off = TRUE;
@@ -208,7 +230,11 @@ fp_image_device_finalize (GObject *object)
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
 
   g_assert (priv->active == FALSE);
-  g_clear_handle_id (&priv->pending_activation_timeout_id, g_source_remove);
+  g_clear_pointer (&priv->pending_activation_timeout, g_source_destroy);
+  g_clear_pointer (&priv->keep_active_timeout, g_source_destroy);
+  g_clear_object (&priv->duplicate_cancellable);
+  g_clear_pointer (&priv->enroll_stage_prints, g_ptr_array_unref);
+  g_clear_pointer (&priv->recorder, fpi_capture_recorder_free);
 
   G_OBJECT_CLASS (fp_image_device_parent_class)->finalize (object);
 }
@@ -240,6 +266,46 @@ fp_image_device_get_property (GObject    *object,
       g_value_set_enum (value, priv->state);
       break;
 
+    case PROP_FRAME_MAX_RATE:
+      g_value_set_uint (value, priv->frame_max_rate);
+      break;
+
+    case PROP_FRAME_DOWNSAMPLE:
+      g_value_set_uint (value, priv->frame_downsample);
+      break;
+
+    case PROP_MAX_SCAN_RETRIES:
+      g_value_set_uint (value, priv->max_scan_retries);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+fp_image_device_set_property (GObject      *object,
+                              guint         prop_id,
+                              const GValue *value,
+                              GParamSpec   *pspec)
+{
+  FpImageDevice *self = FP_IMAGE_DEVICE (object);
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_FRAME_MAX_RATE:
+      priv->frame_max_rate = g_value_get_uint (value);
+      break;
+
+    case PROP_FRAME_DOWNSAMPLE:
+      priv->frame_downsample = g_value_get_uint (value);
+      break;
+
+    case PROP_MAX_SCAN_RETRIES:
+      priv->max_scan_retries = g_value_get_uint (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -259,6 +325,11 @@ fp_image_device_constructed (GObject *obj)
   if (cls->bz3_threshold > 0)
     priv->bz3_threshold = cls->bz3_threshold;
 
+  /* The environment overrides the matcher of the driver */
+  priv->matcher = cls->matcher;
+  if (g_getenv ("FP_MATCHER"))
+    priv->matcher = FPI_MATCHER_DEFAULT;
+
   G_OBJECT_CLASS (fp_image_device_parent_class)->constructed (obj);
 }
 
@@ -270,6 +341,7 @@ fp_image_device_class_init (FpImageDeviceClass *klass)
 
   object_class->finalize = fp_image_device_finalize;
   object_class->get_property = fp_image_device_get_property;
+  object_class->set_property = fp_image_device_set_property;
   object_class->constructed = fp_image_device_constructed;
 
   fp_device_class->open = fp_image_device_open;
@@ -300,6 +372,49 @@ fp_image_device_class_init (FpImageDeviceClass *klass)
                        FPI_IMAGE_DEVICE_STATE_INACTIVE,
                        G_PARAM_STATIC_STRINGS | G_PARAM_READABLE);
 
+  /**
+   * FpImageDevice:frame-max-rate:
+   *
+   * The maximum number of #FpImageDevice::frame signals per second, or 0
+   * to emit one for every frame the driver reports.
+   */
+  properties[PROP_FRAME_MAX_RATE] =
+    g_param_spec_uint ("frame-max-rate",
+                       "Frame Rate Limit",
+                       "Maximum number of preview frames per second",
+                       0, G_MAXUINT, 0,
+                       G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+
+  /**
+   * FpImageDevice:frame-downsample:
+   *
+   * The factor by which preview frames are shrunk in both directions
+   * before they are passed to #FpImageDevice::frame.
+   */
+  properties[PROP_FRAME_DOWNSAMPLE] =
+    g_param_spec_uint ("frame-downsample",
+                       "Frame Downsampling",
+                       "Factor to shrink preview frames by",
+                       1, G_MAXUINT16, 1,
+                       G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+
+  /**
+   * FpImageDevice:max-scan-retries:
+   *
+   * The number of bad scans that a verify or identify operation retries
+   * before it fails with the retry error. The device then stays active
+   * and waits for the finger to be placed again. Each retry is passed to
+   * the #FpMatchCb with the retry error, so it may be called several times
+   * during one operation. With the default of 0, the first bad scan
+   * completes the operation.
+   */
+  properties[PROP_MAX_SCAN_RETRIES] =
+    g_param_spec_uint ("max-scan-retries",
+                       "Maximum Scan Retries",
+                       "Number of bad scans to retry within an operation",
+                       0, G_MAXUINT, 0,
+                       G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+
   /**
    * FpImageDevice::fpi-image-device-state-changed: (skip)
    * @image_device: A #FpImageDevice
@@ -317,10 +432,35 @@ fp_image_device_class_init (FpImageDeviceClass *klass)
                   NULL, NULL, NULL,
                   G_TYPE_NONE, 1, FPI_TYPE_IMAGE_DEVICE_STATE);
 
+  /**
+   * FpImageDevice::frame:
+   * @image_device: A #FpImageDevice
+   * @frame: The #FpImage of the frame
+   *
+   * Emitted with what the sensor currently sees while the finger is on
+   * it, during any operation that captures an image. This can be used
+   * for placement feedback. Depending on the driver, @frame is a single
+   * sensor frame or a preview of the image assembled so far, it is not
+   * normalized and has no minutiae. Not all drivers report frames.
+   *
+   * The driver only prepares frames while a handler is connected, see
+   * #FpImageDevice:frame-max-rate and #FpImageDevice:frame-downsample.
+   */
+  signals[FRAME] =
+    g_signal_new ("frame",
+                  G_TYPE_FROM_CLASS (object_class),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL, NULL,
+                  G_TYPE_NONE, 1, FP_TYPE_IMAGE);
+
   g_object_class_install_properties (object_class, N_PROPS, properties);
 }
 
 static void
 fp_image_device_init (FpImageDevice *self)
 {
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  priv->frame_downsample = 1;
 }
@@ -22,8 +22,14 @@
 
 #include "fpi-image.h"
 #include "fpi-log.h"
+#include "fp-device-private.h"
+
+#include "fpi-simd.h"
+#include "fpi-trace.h"
+#include "fpi-worker.h"
 
 #include <nbis.h>
+#include <string.h>
 
 /**
  * SECTION: fp-image
@@ -40,6 +46,7 @@ enum {
   PROP_0,
   PROP_WIDTH,
   PROP_HEIGHT,
+  PROP_FPI_DATA,
   N_PROPS
 };
 
@@ -54,12 +61,245 @@ fp_image_new (gint width, gint height)
                        NULL);
 }
 
+/**
+ * fpi_image_new_for_data:
+ * @width: Width of the image
+ * @height: Height of the image
+ * @data: (transfer full): At least @width * @height bytes of image data
+ * @destroy: (nullable): Function to free @data with
+ *
+ * Creates an #FpImage that uses @data directly instead of copying it. @data
+ * is released using @destroy once the image does not need it anymore.
+ *
+ * Returns: (transfer full): A new #FpImage
+ */
+FpImage *
+fpi_image_new_for_data (gint           width,
+                        gint           height,
+                        guint8        *data,
+                        GDestroyNotify destroy)
+{
+  FpImage *self;
+
+  g_return_val_if_fail (data != NULL, NULL);
+
+  self = g_object_new (FP_TYPE_IMAGE,
+                       "width", width,
+                       "height", height,
+                       "fpi-data", data,
+                       NULL);
+  self->data_destroy = destroy;
+
+  return self;
+}
+
+/* Number of released image buffers a device keeps around for reuse */
+#define IMAGE_BUFFER_POOL_SIZE 4
+
+/*
+ * Image buffers are taken from a per-device pool and given back to it when
+ * the image is finalized. Drivers produce images of the same size over and
+ * over, so a steady capture loop keeps reusing the same few buffers. Like
+ * the USB buffer pool, it is reference counted by every buffer in use.
+ * Images may be released from a detection thread, so it is locked.
+ */
+struct _FpiImageBufferPool
+{
+  GMutex   mutex;
+  guint    ref_count;
+  gboolean closed;
+  GQueue   free;
+};
+
+typedef struct
+{
+  FpiImageBufferPool *pool;
+  gsize               size;
+} FpiImageBuffer;
+
+/* Keep the data behind the header suitably aligned */
+#define IMAGE_BUFFER_HEADER_SIZE (((sizeof (FpiImageBuffer) + 15) / 16) * 16)
+#define IMAGE_BUFFER_DATA(b) ((guint8 *) (b) + IMAGE_BUFFER_HEADER_SIZE)
+#define IMAGE_BUFFER_FROM_DATA(d) ((FpiImageBuffer *) ((guint8 *) (d) - IMAGE_BUFFER_HEADER_SIZE))
+
+FpiImageBufferPool *
+fpi_image_buffer_pool_new (void)
+{
+  FpiImageBufferPool *pool = g_new0 (FpiImageBufferPool, 1);
+
+  g_mutex_init (&pool->mutex);
+  pool->ref_count = 1;
+  g_queue_init (&pool->free);
+
+  return pool;
+}
+
+/* Called with the pool locked, which it unlocks */
+static void
+fpi_image_buffer_pool_unref_unlock (FpiImageBufferPool *pool)
+{
+  if (--pool->ref_count > 0)
+    {
+      g_mutex_unlock (&pool->mutex);
+      return;
+    }
+
+  g_assert (g_queue_is_empty (&pool->free));
+  g_mutex_unlock (&pool->mutex);
+  g_mutex_clear (&pool->mutex);
+  g_free (pool);
+}
+
+/* Called when the device goes away, buffers in use are freed on release */
+void
+fpi_image_buffer_pool_close (FpiImageBufferPool *pool)
+{
+  FpiImageBuffer *buf;
+
+  g_mutex_lock (&pool->mutex);
+  pool->closed = TRUE;
+  while ((buf = g_queue_pop_head (&pool->free)))
+    {
+      g_free (buf);
+      pool->ref_count--;
+    }
+
+  fpi_image_buffer_pool_unref_unlock (pool);
+}
+
+static void
+image_buffer_release (gpointer data)
+{
+  FpiImageBuffer *buf = IMAGE_BUFFER_FROM_DATA (data);
+  FpiImageBufferPool *pool = buf->pool;
+
+  g_mutex_lock (&pool->mutex);
+
+  if (pool->closed)
+    {
+      g_free (buf);
+      fpi_image_buffer_pool_unref_unlock (pool);
+      return;
+    }
+
+  /* Most recently used buffers are reused first, drop the oldest one */
+  g_queue_push_head (&pool->free, buf);
+  if (g_queue_get_length (&pool->free) > IMAGE_BUFFER_POOL_SIZE)
+    {
+      g_free (g_queue_pop_tail (&pool->free));
+      pool->ref_count--;
+    }
+
+  g_mutex_unlock (&pool->mutex);
+}
+
+/* Returns an uninitialized buffer of @size bytes from the device pool,
+ * free it again using image_buffer_release(). */
+static guint8 *
+image_buffer_acquire (FpDevice *device, gsize size)
+{
+  FpiImageBufferPool *pool = fpi_device_get_image_buffer_pool (device);
+  FpiImageBuffer *buf;
+  GList *l;
+
+  g_mutex_lock (&pool->mutex);
+
+  for (l = pool->free.head; l; l = l->next)
+    {
+      buf = l->data;
+      if (buf->size == size)
+        {
+          g_queue_delete_link (&pool->free, l);
+          g_mutex_unlock (&pool->mutex);
+          return IMAGE_BUFFER_DATA (buf);
+        }
+    }
+
+  pool->ref_count++;
+  g_mutex_unlock (&pool->mutex);
+
+  g_assert (size <= G_MAXSIZE - IMAGE_BUFFER_HEADER_SIZE);
+  buf = g_malloc (IMAGE_BUFFER_HEADER_SIZE + size);
+  buf->pool = pool;
+  buf->size = size;
+
+  return IMAGE_BUFFER_DATA (buf);
+}
+
+/**
+ * fpi_image_new_pooled:
+ * @device: The #FpDevice the image is captured with
+ * @width: Width of the image
+ * @height: Height of the image
+ * @clear: Whether to clear the image data
+ *
+ * Creates an #FpImage like fp_image_new(), but takes the data from a pool
+ * of @device that the data is returned to once the image is finalized.
+ * Drivers that fully overwrite the image data should pass %FALSE for
+ * @clear, in which case the data is not initialized.
+ *
+ * Returns: (transfer full): A new #FpImage
+ */
+FpImage *
+fpi_image_new_pooled (FpDevice *device,
+                      gint      width,
+                      gint      height,
+                      gboolean  clear)
+{
+  gsize size = (gsize) width * height;
+  guint8 *data;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+
+  data = image_buffer_acquire (device, size);
+  if (clear)
+    memset (data, 0, size);
+
+  return fpi_image_new_for_data (width, height, data, image_buffer_release);
+}
+
+/**
+ * fpi_image_new_from_bytes:
+ * @width: Width of the image
+ * @height: Height of the image
+ * @bytes: (transfer full): At least @width * @height bytes of image data
+ *
+ * Creates an #FpImage from @bytes. The data is only copied if @bytes is
+ * still referenced elsewhere.
+ *
+ * Returns: (transfer full): A new #FpImage
+ */
+FpImage *
+fpi_image_new_from_bytes (gint    width,
+                          gint    height,
+                          GBytes *bytes)
+{
+  gsize size;
+  guint8 *data;
+
+  g_return_val_if_fail (bytes != NULL, NULL);
+  g_return_val_if_fail (g_bytes_get_size (bytes) >= (gsize) width * height, NULL);
+
+  data = g_bytes_unref_to_data (bytes, &size);
+
+  return fpi_image_new_for_data (width, height, data, g_free);
+}
+
+static void
+fp_image_clear_data (FpImage *self)
+{
+  if (self->data && self->data_destroy)
+    self->data_destroy (self->data);
+  self->data = NULL;
+  self->data_destroy = g_free;
+}
+
 static void
 fp_image_finalize (GObject *object)
 {
   FpImage *self = (FpImage *) object;
 
-  g_clear_pointer (&self->data, g_free);
+  fp_image_clear_data (self);
   g_clear_pointer (&self->binarized, g_free);
   g_clear_pointer (&self->minutiae, g_ptr_array_unref);
 
@@ -71,7 +311,8 @@ fp_image_constructed (GObject *object)
 {
   FpImage *self = (FpImage *) object;
 
-  self->data = g_malloc0 (self->width * self->height);
+  if (!self->data)
+    self->data = g_malloc0 (self->width * self->height);
 }
 
 static void
@@ -115,6 +356,10 @@ fp_image_set_property (GObject      *object,
       self->height = g_value_get_uint (value);
       break;
 
+    case PROP_FPI_DATA:
+      self->data = g_value_get_pointer (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -148,12 +393,19 @@ fp_image_class_init (FpImageClass *klass)
                        0,
                        G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
 
+  properties[PROP_FPI_DATA] =
+    g_param_spec_pointer ("fpi-data",
+                          "Data",
+                          "Private: Image data to adopt instead of allocating it",
+                          G_PARAM_STATIC_STRINGS | G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
+
   g_object_class_install_properties (object_class, N_PROPS, properties);
 }
 
 static void
 fp_image_init (FpImage *self)
 {
+  self->data_destroy = g_free;
 }
 
 typedef struct
@@ -163,8 +415,12 @@ typedef struct
   gint                width, height;
   gdouble             ppmm;
   FpiImageFlags       flags;
+  FpImageDetectFlags  detect_flags;
+  const guchar       *source;
   guchar             *image;
+  guchar             *in_place;
   guchar             *binarized;
+  LFSPARMS            lfsparms;
 } DetectMinutiaeData;
 
 static void
@@ -185,15 +441,26 @@ fp_image_detect_minutiae_cb (GObject      *source_object,
   FpImage *image;
   DetectMinutiaeData *data = g_task_get_task_data (task);
 
+  image = FP_IMAGE (source_object);
+  image->detecting--;
+
+  /* The data was normalized in place even if the detection failed later */
+  if (data->in_place)
+    image->flags = data->flags;
+
   if (!g_task_had_error (task))
     {
       gint i;
-      image = FP_IMAGE (source_object);
 
-      image->flags = data->flags;
-
-      g_clear_pointer (&image->data, g_free);
-      image->data = g_steal_pointer (&data->image);
+      /* Only replace the data if it had to be normalized, and keep it
+       * while other detections may still read it */
+      if (data->image && image->detecting == 0)
+        {
+          fp_image_clear_data (image);
+          image->data = g_steal_pointer (&data->image);
+          image->data_exposed = FALSE;
+          image->flags = data->flags;
+        }
 
       g_clear_pointer (&image->binarized, g_free);
       image->binarized = g_steal_pointer (&data->binarized);
@@ -214,53 +481,326 @@ fp_image_detect_minutiae_cb (GObject      *source_object,
     data->user_cb (source_object, res, user_data);
 }
 
+/* Flip and invert the image as given by the flags in a single pass */
+static void
+normalize_image (guint8        *dst,
+                 const guint8  *src,
+                 gint           width,
+                 gint           height,
+                 FpiImageFlags  flags)
+{
+  gboolean mirror = (flags & FPI_IMAGE_H_FLIPPED) != 0;
+  guint8 xor = (flags & FPI_IMAGE_COLORS_INVERTED) ? 0xff : 0x00;
+  const FpiSimdKernels *kernels = fpi_simd_get_kernels ();
+  gint y;
+
+  /* Inverting the colors is an XOR with 0xff, as 0xff - v == v ^ 0xff */
+  for (y = 0; y < height; y++)
+    {
+      gint src_y = (flags & FPI_IMAGE_V_FLIPPED) ? height - y - 1 : y;
+
+      kernels->normalize_row_u8 (dst + y * width, src + src_y * width, width, mirror, xor);
+    }
+}
+
+/* As normalize_image(), but in place. Rows that are swapped are
+ * normalized into each other, with one of them saved first. */
 static void
-vflip (guint8 *data, gint width, gint height)
+normalize_image_in_place (guint8       *data,
+                          gint          width,
+                          gint          height,
+                          FpiImageFlags flags)
 {
-  int data_len = width * height;
-  unsigned char rowbuf[width];
-  int i;
+  gboolean mirror = (flags & FPI_IMAGE_H_FLIPPED) != 0;
+  guint8 xor = (flags & FPI_IMAGE_COLORS_INVERTED) ? 0xff : 0x00;
+  const FpiSimdKernels *kernels = fpi_simd_get_kernels ();
+  g_autofree guint8 *row = g_malloc (width);
+  gint y;
 
-  for (i = 0; i < height / 2; i++)
+  for (y = 0; y < height; y++)
     {
-      int offset = i * width;
-      int swap_offset = data_len - (width * (i + 1));
+      gint other_y = (flags & FPI_IMAGE_V_FLIPPED) ? height - y - 1 : y;
+      guint8 *dst = data + y * width;
+
+      if (other_y < y)
+        break;
+
+      memcpy (row, dst, width);
+      if (other_y != y)
+        {
+          guint8 *other = data + other_y * width;
+
+          kernels->normalize_row_u8 (dst, other, width, mirror, xor);
+          kernels->normalize_row_u8 (other, row, width, mirror, xor);
+        }
+      else
+        {
+          kernels->normalize_row_u8 (dst, row, width, mirror, xor);
+        }
+    }
+}
+
+/* The mindtct lookup tables only depend on the image size (the parameters
+ * are always g_lfsparms_V2), so keep one detector per size around. Each
+ * sensor only produces a handful of image sizes, plus the sizes of the
+ * regions cut out of them; anything past the limit falls back to building
+ * the tables for that image only.
+ */
+#define DETECTOR_CACHE_MAX 32
+
+static GMutex detector_cache_mutex;
+static GHashTable *detector_cache = NULL;
+
+static const LFSDETECTOR *
+get_cached_detector (gint width, gint height)
+{
+  gint64 key = ((gint64) width << 32) | (guint32) height;
+  LFSDETECTOR *detector;
 
-      /* copy top row into buffer */
-      memcpy (rowbuf, data + offset, width);
+  g_mutex_lock (&detector_cache_mutex);
 
-      /* copy lower row over upper row */
-      memcpy (data + offset, data + swap_offset, width);
+  if (!detector_cache)
+    detector_cache = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                            g_free, NULL);
 
-      /* copy buffer over lower row */
-      memcpy (data + swap_offset, rowbuf, width);
+  detector = g_hash_table_lookup (detector_cache, &key);
+  if (!detector && g_hash_table_size (detector_cache) < DETECTOR_CACHE_MAX)
+    {
+      if (init_lfsdetector (&detector, width, height, &g_lfsparms_V2) == 0)
+        g_hash_table_insert (detector_cache,
+                             g_memdup (&key, sizeof (key)), detector);
+      else
+        detector = NULL;
     }
+
+  g_mutex_unlock (&detector_cache_mutex);
+
+  return detector;
+}
+
+/* The mindtct block sizes are tuned for 500 ppi. Images of at least twice
+ * that resolution are scanned at a reduced size instead, which finds the
+ * same ridge features for a fraction of the cost. In the efficiency mode
+ * the factor is rounded rather than truncated, so e.g. 800 ppi images are
+ * scanned at half size as well. */
+#define DETECT_PPMM (500 / 25.4)
+#define DETECT_MAX_SCALE 4
+#define DETECT_MIN_SCALED_SIZE 64
+
+static guint
+detect_scale_factor (gint width, gint height, gdouble ppmm)
+{
+  gdouble rounding = fpi_worker_get_efficiency_mode () ? 0.5 : 0.01;
+  guint factor;
+
+  factor = CLAMP ((guint) (ppmm / DETECT_PPMM + rounding), 1, DETECT_MAX_SCALE);
+  while (factor > 1 &&
+         (width / (gint) factor < DETECT_MIN_SCALED_SIZE ||
+          height / (gint) factor < DETECT_MIN_SCALED_SIZE))
+    factor--;
+
+  return factor;
 }
 
+/* Maps the results of a scan at reduced size back to the full image */
 static void
-hflip (guint8 *data, gint width, gint height)
+detect_scale_results (struct fp_minutiae *minutiae,
+                      guchar            **bdata,
+                      gint                scaled_width,
+                      gint                scaled_height,
+                      gint                width,
+                      gint                height,
+                      guint               factor)
 {
-  unsigned char rowbuf[width];
-  int i, j;
+  g_autofree guchar *scaled = g_steal_pointer (bdata);
+  gint i, x, y;
 
-  for (i = 0; i < height; i++)
+  for (i = 0; i < minutiae->num; i++)
     {
-      int offset = i * width;
+      struct fp_minutia *min = minutiae->list[i];
 
-      memcpy (rowbuf, data + offset, width);
-      for (j = 0; j < width; j++)
-        data[offset + j] = rowbuf[width - j - 1];
+      min->x = min->x * factor + factor / 2;
+      min->y = min->y * factor + factor / 2;
+      min->ex = min->ex * factor + factor / 2;
+      min->ey = min->ey * factor + factor / 2;
+    }
+
+  if (!scaled)
+    return;
+
+  *bdata = g_malloc (width * height);
+  for (y = 0; y < height; y++)
+    {
+      const guchar *src = scaled + MIN (y / (gint) factor, scaled_height - 1) * scaled_width;
+      guchar *dst = *bdata + y * width;
+
+      for (x = 0; x < width; x++)
+        dst[x] = src[MIN (x / (gint) factor, scaled_width - 1)];
     }
 }
 
-static void
-invert_colors (guint8 *data, gint width, gint height)
+static gint
+fp_image_run_mindtct_scaled (const guchar        *source,
+                             gint                 width,
+                             gint                 height,
+                             gdouble              ppmm,
+                             LFSPARMS            *lfsparms,
+                             struct fp_minutiae **minutiae,
+                             guchar             **bdata)
 {
-  int data_len = width * height;
-  int i;
+  g_autofree gint *direction_map = NULL;
+  g_autofree gint *low_contrast_map = NULL;
+  g_autofree gint *low_flow_map = NULL;
+  g_autofree gint *high_curve_map = NULL;
+  g_autofree gint *quality_map = NULL;
+  g_autoptr(FpImage) scaled = NULL;
+  gint map_w, map_h;
+  gint bw, bh, bd;
+  guint factor;
+  gint r;
+
+  factor = detect_scale_factor (width, height, ppmm);
+  if (factor > 1)
+    {
+      g_autoptr(FpImage) full = NULL;
 
-  for (i = 0; i < data_len; i++)
-    data[i] = 0xff - data[i];
+      full = fpi_image_new_for_data (width, height, (guint8 *) source, NULL);
+      scaled = fpi_image_downsample (full, factor);
+      fp_dbg ("Scanning %dx%d image at 1/%u of its size", width, height, factor);
+    }
+
+  r = get_minutiae_ctx (minutiae, &quality_map, &direction_map,
+                        &low_contrast_map, &low_flow_map, &high_curve_map,
+                        &map_w, &map_h, bdata, &bw, &bh, &bd,
+                        scaled ? scaled->data : (guchar *) source,
+                        scaled ? (gint) scaled->width : width,
+                        scaled ? (gint) scaled->height : height, 8,
+                        ppmm / factor, lfsparms,
+                        scaled ? get_cached_detector (scaled->width, scaled->height) :
+                        get_cached_detector (width, height));
+
+  if (r == 0 && scaled)
+    detect_scale_results (*minutiae, bdata, scaled->width, scaled->height,
+                          width, height, factor);
+
+  return r;
+}
+
+/* Press sensors return the whole sensor area, of which the finger often
+ * covers only a part. The covered blocks are found with the same test as
+ * the quality gate of the image device, and the box around them is cut out
+ * with a margin for the windows that mindtct reads around each block. The
+ * box is aligned to the block grid of mindtct, so that the blocks inside it
+ * are the same as in the full image and the number of sizes that need a
+ * detector stays small.
+ */
+#define ROI_BLOCK_SIZE 16
+#define ROI_MIN_SQ_DEV 64
+#define ROI_MARGIN_MM 1.5
+#define ROI_ALIGN 32
+#define ROI_MIN_SAVING 0.25
+
+static gboolean
+detect_find_roi (const guchar *source,
+                 gint          width,
+                 gint          height,
+                 gdouble       ppmm,
+                 gint         *roi_x,
+                 gint         *roi_y,
+                 gint         *roi_width,
+                 gint         *roi_height)
+{
+  g_autoptr(FpImage) image = NULL;
+  gint x0, y0, x1, y1;
+  gint margin;
+
+  image = fpi_image_new_for_data (width, height, (guint8 *) source, NULL);
+
+  /* Leave images without any ridges to the detection */
+  if (!fpi_image_get_covered_area (image, ROI_BLOCK_SIZE, ROI_MIN_SQ_DEV,
+                                   &x0, &y0, &x1, &y1))
+    return FALSE;
+  x1 += x0;
+  y1 += y0;
+
+  margin = (gint) (ROI_MARGIN_MM * ppmm + 0.5);
+  x0 = MAX (x0 - margin, 0) / ROI_ALIGN * ROI_ALIGN;
+  y0 = MAX (y0 - margin, 0) / ROI_ALIGN * ROI_ALIGN;
+  x1 = MIN ((x1 + margin + ROI_ALIGN - 1) / ROI_ALIGN * ROI_ALIGN, width);
+  y1 = MIN ((y1 + margin + ROI_ALIGN - 1) / ROI_ALIGN * ROI_ALIGN, height);
+
+  /* Not worth the copy */
+  if ((gdouble) (x1 - x0) * (y1 - y0) > (1.0 - ROI_MIN_SAVING) * width * height)
+    return FALSE;
+
+  *roi_x = x0;
+  *roi_y = y0;
+  *roi_width = x1 - x0;
+  *roi_height = y1 - y0;
+
+  return TRUE;
+}
+
+/* Runs mindtct on the normalized @source, the maps it computes along the
+ * way are freed right away. The minutiae and the binarized image are in
+ * the coordinates of the full image. */
+static gint
+fp_image_run_mindtct (const guchar        *source,
+                      gint                 width,
+                      gint                 height,
+                      gdouble              ppmm,
+                      LFSPARMS            *lfsparms,
+                      struct fp_minutiae **minutiae,
+                      guchar             **bdata)
+{
+  g_autofree guchar *roi = NULL;
+  g_autofree guchar *roi_bdata = NULL;
+  gint roi_x, roi_y, roi_width, roi_height;
+  gint i, y, r;
+
+  if (!detect_find_roi (source, width, height, ppmm,
+                        &roi_x, &roi_y, &roi_width, &roi_height))
+    return fp_image_run_mindtct_scaled (source, width, height, ppmm,
+                                        lfsparms, minutiae, bdata);
+
+  fp_dbg ("Scanning %dx%d region at %d,%d of %dx%d image",
+          roi_width, roi_height, roi_x, roi_y, width, height);
+
+  roi = g_malloc (roi_width * roi_height);
+  for (y = 0; y < roi_height; y++)
+    memcpy (roi + y * roi_width, source + (roi_y + y) * width + roi_x, roi_width);
+
+  r = fp_image_run_mindtct_scaled (roi, roi_width, roi_height, ppmm,
+                                   lfsparms, minutiae, &roi_bdata);
+  if (r != 0)
+    return r;
+
+  for (i = 0; i < (*minutiae)->num; i++)
+    {
+      struct fp_minutia *min = (*minutiae)->list[i];
+
+      min->x += roi_x;
+      min->y += roi_y;
+      min->ex += roi_x;
+      min->ey += roi_y;
+    }
+
+  if (roi_bdata)
+    {
+      *bdata = g_malloc (width * height);
+      memset (*bdata, WHITE_PIXEL, width * height);
+      for (y = 0; y < roi_height; y++)
+        memcpy (*bdata + (roi_y + y) * width + roi_x,
+                roi_bdata + y * roi_width, roi_width);
+    }
+
+  return 0;
+}
+
+static int
+fp_image_detect_cancelled (void *cancellable)
+{
+  return g_cancellable_is_cancelled (cancellable);
 }
 
 static void
@@ -272,40 +812,59 @@ fp_image_detect_minutiae_thread_func (GTask        *task,
   g_autoptr(GTimer) timer = NULL;
   DetectMinutiaeData *data = task_data;
   struct fp_minutiae *minutiae = NULL;
-  g_autofree gint *direction_map = NULL;
-  g_autofree gint *low_contrast_map = NULL;
-  g_autofree gint *low_flow_map = NULL;
-  g_autofree gint *high_curve_map = NULL;
-  g_autofree gint *quality_map = NULL;
   g_autofree guchar *bdata = NULL;
-  gint map_w, map_h;
-  gint bw, bh, bd;
+  const FpiImageFlags normalize_flags = FPI_IMAGE_H_FLIPPED |
+                                        FPI_IMAGE_V_FLIPPED |
+                                        FPI_IMAGE_COLORS_INVERTED;
   gint r;
 
-  /* Normalize the image first */
-  if (data->flags & FPI_IMAGE_H_FLIPPED)
-    hflip (data->image, data->width, data->height);
-
-  if (data->flags & FPI_IMAGE_V_FLIPPED)
-    vflip (data->image, data->width, data->height);
-
-  if (data->flags & FPI_IMAGE_COLORS_INVERTED)
-    invert_colors (data->image, data->width, data->height);
+  /* Cancelled while it was queued */
+  if (g_task_return_error_if_cancelled (task))
+    {
+      g_object_unref (task);
+      return;
+    }
 
-  data->flags &= ~(FPI_IMAGE_H_FLIPPED | FPI_IMAGE_V_FLIPPED | FPI_IMAGE_COLORS_INVERTED);
+  /* Normalize the image first, mindtct does not modify its input so the
+   * data of the image is used directly if there is nothing to do. If
+   * nobody else can see the data, it is normalized in place. */
+  if ((data->flags & normalize_flags) && data->in_place)
+    {
+      normalize_image_in_place (data->in_place, data->width, data->height,
+                                data->flags);
+      data->flags &= ~normalize_flags;
+    }
+  else if (data->flags & normalize_flags)
+    {
+      data->image = g_malloc (data->width * data->height);
+      normalize_image (data->image, data->source, data->width, data->height,
+                       data->flags);
+      data->source = data->image;
+      data->flags &= ~normalize_flags;
+    }
 
   timer = g_timer_new ();
-  r = get_minutiae (&minutiae, &quality_map, &direction_map,
-                    &low_contrast_map, &low_flow_map, &high_curve_map,
-                    &map_w, &map_h, &bdata, &bw, &bh, &bd,
-                    data->image, data->width, data->height, 8,
-                    data->ppmm, &g_lfsparms_V2);
+  FPI_TRACE2 (minutiae_start, data->width, data->height);
+  r = fp_image_run_mindtct (data->source, data->width, data->height, data->ppmm,
+                            &data->lfsparms, &minutiae, &bdata);
+  FPI_TRACE2 (minutiae_end, r, minutiae ? minutiae->num : 0);
   g_timer_stop (timer);
   fp_dbg ("Minutiae scan completed in %f secs", g_timer_elapsed (timer, NULL));
 
-  data->binarized = g_steal_pointer (&bdata);
+  /* The binarized image is as large as the image itself */
+  if (data->detect_flags & FP_IMAGE_DETECT_KEEP_BINARIZED)
+    data->binarized = g_steal_pointer (&bdata);
   data->minutiae = minutiae;
 
+  if (r == LFS_CANCELLED)
+    {
+      fp_dbg ("Minutiae scan cancelled");
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                               "Minutiae scan was cancelled");
+      g_object_unref (task);
+      return;
+    }
+
   if (r)
     {
       fp_err ("get minutiae failed, code %d", r);
@@ -326,6 +885,108 @@ fp_image_detect_minutiae_thread_func (GTask        *task,
   g_object_unref (task);
 }
 
+/* Detection runs on a few threads owned by libfprint, which are started
+ * once and then stay around, rather than on the GLib pool that is shared
+ * with whatever else the application runs in threads. Jobs of higher
+ * priority, e.g. detections over the warming up of a detector, are picked
+ * first, jobs of equal priority in the order they were queued. */
+#define DETECT_MAX_THREADS 2
+
+typedef struct
+{
+  GTask          *task;
+  GTaskThreadFunc func;
+} DetectJob;
+
+static void
+fp_image_detect_worker (gpointer job_data, gpointer user_data)
+{
+  g_autofree DetectJob *job = job_data;
+  GTask *task = job->task;
+
+  /* The function returns the task and drops the reference of the job */
+  job->func (task, g_task_get_source_object (task),
+             g_task_get_task_data (task), g_task_get_cancellable (task));
+}
+
+static gint
+fp_image_detect_job_compare (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const DetectJob *job_a = a;
+  const DetectJob *job_b = b;
+
+  return g_task_get_priority (job_a->task) - g_task_get_priority (job_b->task);
+}
+
+static GThreadPool *
+fp_image_get_detect_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    {
+      GThreadPool *p;
+
+      p = fpi_worker_pool_new (fp_image_detect_worker, DETECT_MAX_THREADS, TRUE);
+      g_thread_pool_set_sort_function (p, fp_image_detect_job_compare, NULL);
+      g_once_init_leave (&pool, (gsize) p);
+    }
+
+  return (GThreadPool *) pool;
+}
+
+static void
+fp_image_detect_push (GTask *task, GTaskThreadFunc func)
+{
+  DetectJob *job = g_new0 (DetectJob, 1);
+
+  job->task = task;
+  job->func = func;
+  g_thread_pool_push (fp_image_get_detect_pool (), job, NULL);
+}
+
+static void
+fpi_image_prepare_detection_thread_func (GTask        *task,
+                                         gpointer      source_object,
+                                         gpointer      task_data,
+                                         GCancellable *cancellable)
+{
+  gint *size = task_data;
+
+  get_cached_detector (size[0], size[1]);
+
+  g_task_return_boolean (task, TRUE);
+  g_object_unref (task);
+}
+
+/**
+ * fpi_image_prepare_detection:
+ * @width: Width of the images that will be scanned
+ * @height: Height of the images that will be scanned
+ *
+ * Starts the minutiae detection threads and builds the detector tables
+ * for images of the given size in the background, so that the first
+ * detection does not have to. Image devices do this when they are
+ * opened if their image size is constant.
+ */
+void
+fpi_image_prepare_detection (gint width, gint height)
+{
+  GTask *task;
+  gint *size;
+
+  g_return_if_fail (width > 0 && height > 0);
+
+  size = g_new (gint, 2);
+  size[0] = width;
+  size[1] = height;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_priority (task, G_PRIORITY_LOW);
+  g_task_set_task_data (task, size, g_free);
+  fp_image_detect_push (task, fpi_image_prepare_detection_thread_func);
+}
+
 /**
  * fp_image_get_height:
  * @self: A #FpImage
@@ -385,6 +1046,9 @@ fp_image_get_data (FpImage *self, gsize *len)
   if (len)
     *len = self->width * self->height;
 
+  /* Later detections may not modify it in place anymore */
+  self->data_exposed = TRUE;
+
   return self->data;
 }
 
@@ -397,7 +1061,10 @@ fp_image_get_data (FpImage *self, gsize *len)
  * freed. You need to first detect the minutiae using
  * fp_image_detect_minutiae().
  *
- * Returns: (transfer none) (array length=len): The binarized image data
+ * This is %NULL if the detection was run by fp_image_detect_minutiae_full()
+ * without #FP_IMAGE_DETECT_KEEP_BINARIZED.
+ *
+ * Returns: (transfer none) (array length=len) (nullable): The binarized image data
  */
 const guchar *
 fp_image_get_binarized (FpImage *self, gsize *len)
@@ -424,6 +1091,50 @@ fp_image_get_minutiae (FpImage *self)
   return self->minutiae;
 }
 
+static void
+fp_image_detect_minutiae_start (FpImage            *self,
+                                FpImageDetectFlags  flags,
+                                gboolean            owned,
+                                GCancellable       *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer            user_data)
+{
+  GTask *task;
+  DetectMinutiaeData *data = g_new0 (DetectMinutiaeData, 1);
+
+  task = g_task_new (self, cancellable, fp_image_detect_minutiae_cb, user_data);
+
+  /* The task keeps a reference to the image, and the image data is not
+   * modified while the detection is running. Unless the caller owns the
+   * image, holds the only reference besides the task and its data was
+   * never handed out, which is the case for images that were just
+   * captured; then nobody can look at the data before the detection is
+   * done and it is normalized without a copy. */
+  data->source = self->data;
+  if (owned && self->data_destroy && !self->data_exposed && self->detecting == 0 &&
+      g_atomic_int_get (&G_OBJECT (self)->ref_count) == 2)
+    data->in_place = self->data;
+  self->detecting++;
+  data->flags = self->flags;
+  data->detect_flags = flags;
+  data->width = self->width;
+  data->height = self->height;
+  data->ppmm = self->ppmm;
+  data->user_cb = callback;
+  /* Each detection gets its own parameters, mindtct keeps no other state */
+  data->lfsparms = g_lfsparms_V2;
+  data->lfsparms.max_threads = fpi_worker_get_max_threads ();
+  if (cancellable)
+    {
+      /* The task keeps the cancellable alive */
+      data->lfsparms.cancelled = fp_image_detect_cancelled;
+      data->lfsparms.cancel_data = cancellable;
+    }
+
+  g_task_set_task_data (task, data, (GDestroyNotify) fp_image_detect_minutiae_free);
+  fp_image_detect_push (task, fp_image_detect_minutiae_thread_func);
+}
+
 /**
  * fp_image_detect_minutiae:
  * @self: A #FpImage
@@ -431,7 +1142,8 @@ fp_image_get_minutiae (FpImage *self)
  * @callback: the function to call on completion
  * @user_data: the data to pass to @callback
  *
- * Detects the minutiae found in an image.
+ * Detects the minutiae found in an image, and keeps the binarized image
+ * as well. See fp_image_detect_minutiae_full().
  */
 void
 fp_image_detect_minutiae (FpImage            *self,
@@ -439,21 +1151,55 @@ fp_image_detect_minutiae (FpImage            *self,
                           GAsyncReadyCallback callback,
                           gpointer            user_data)
 {
-  GTask *task;
-  DetectMinutiaeData *data = g_new0 (DetectMinutiaeData, 1);
-
-  task = g_task_new (self, cancellable, fp_image_detect_minutiae_cb, user_data);
+  fp_image_detect_minutiae_full (self, FP_IMAGE_DETECT_KEEP_BINARIZED,
+                                 cancellable, callback, user_data);
+}
 
-  data->image = g_malloc (self->width * self->height);
-  memcpy (data->image, self->data, self->width * self->height);
-  data->flags = self->flags;
-  data->width = self->width;
-  data->height = self->height;
-  data->ppmm = self->ppmm;
-  data->user_cb = callback;
+/**
+ * fp_image_detect_minutiae_full:
+ * @self: A #FpImage
+ * @flags: #FpImageDetectFlags selecting the results to keep
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Detects the minutiae found in an image. Results that are not selected
+ * by @flags are freed as soon as the detection is done, which saves
+ * memory on large sensors if the image is kept around, e.g. with a
+ * print.
+ */
+void
+fp_image_detect_minutiae_full (FpImage            *self,
+                               FpImageDetectFlags  flags,
+                               GCancellable       *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer            user_data)
+{
+  fp_image_detect_minutiae_start (self, flags, FALSE, cancellable,
+                                  callback, user_data);
+}
 
-  g_task_set_task_data (task, data, (GDestroyNotify) fp_image_detect_minutiae_free);
-  g_task_run_in_thread (task, fp_image_detect_minutiae_thread_func);
+/**
+ * fpi_image_detect_minutiae_owned:
+ * @self: A #FpImage
+ * @flags: #FpImageDetectFlags selecting the results to keep
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Like fp_image_detect_minutiae_full(), but for images that nobody else
+ * looks at until the detection is done, e.g. a capture that the core has
+ * not reported yet. The data may then be normalized without a copy.
+ */
+void
+fpi_image_detect_minutiae_owned (FpImage            *self,
+                                 FpImageDetectFlags  flags,
+                                 GCancellable       *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer            user_data)
+{
+  fp_image_detect_minutiae_start (self, flags, TRUE, cancellable,
+                                  callback, user_data);
 }
 
 /**
@@ -28,6 +28,19 @@ G_BEGIN_DECLS
 
 typedef struct fp_minutia FpMinutia;
 
+/**
+ * FpImageDetectFlags:
+ * @FP_IMAGE_DETECT_NONE: Only keep the minutiae
+ * @FP_IMAGE_DETECT_KEEP_BINARIZED: Also keep the binarized image
+ *
+ * Selects which results of fp_image_detect_minutiae_full() are kept
+ * with the image, in addition to the minutiae.
+ */
+typedef enum {
+  FP_IMAGE_DETECT_NONE           = 0,
+  FP_IMAGE_DETECT_KEEP_BINARIZED = 1 << 0,
+} FpImageDetectFlags;
+
 G_DECLARE_FINAL_TYPE (FpImage, fp_image, FP, IMAGE, GObject)
 
 FpImage     *fp_image_new (gint width,
@@ -43,6 +56,11 @@ void          fp_image_detect_minutiae (FpImage            *self,
                                         GCancellable       *cancellable,
                                         GAsyncReadyCallback callback,
                                         gpointer            user_data);
+void          fp_image_detect_minutiae_full (FpImage            *self,
+                                             FpImageDetectFlags  flags,
+                                             GCancellable       *cancellable,
+                                             GAsyncReadyCallback callback,
+                                             gpointer            user_data);
 gboolean      fp_image_detect_minutiae_finish (FpImage      *self,
                                                GAsyncResult *result,
                                                GError      **error);
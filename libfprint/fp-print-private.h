@@ -23,6 +23,12 @@
 
 #include <nbis.h>
 
+/* How the minutiae columns of a packed record are stored */
+typedef enum {
+  FPI_PRINT_XYT_INT16,
+  FPI_PRINT_XYT_DELTA,
+} FpiPrintXytEncoding;
+
 struct _FpPrint
 {
   GInitiallyUnowned parent_instance;
@@ -43,4 +49,55 @@ struct _FpPrint
 
   GVariant  *data;
   GPtrArray *prints;
+
+  /* Lazily built bozorth3 gallery Web for each of @prints */
+  GPtrArray *bz3_webs;
+  /* Lazily built flat match data of @prints and @bz3_webs, including the
+   * edge histograms for ranking */
+  gpointer   bz3_template;
+  /* Lazily built #FpiCylinderSet for each of @prints */
+  GPtrArray *cylinders;
+
+  /* Packed record backing a print view (e.g. from fp_print_load_gallery()).
+   * If set, the NBIS data is decoded from it and @prints stays empty. */
+  GBytes    *packed;
+  guint      packed_n_xyt;
+  gsize      packed_xyt_offset;
+  FpiPrintXytEncoding packed_encoding;
+
+  /* Packed Web record from a gallery file, used in place of building the
+   * entries of @bz3_webs */
+  GBytes    *packed_webs;
+
+  /* Lazily computed digest, see fp_print_get_digest() */
+  gchar     *digest;
 };
+
+guint              fpi_print_get_n_xyt (FpPrint *print);
+struct xyt_struct *fpi_print_get_xyt (FpPrint           *print,
+                                      guint              idx,
+                                      struct xyt_struct *scratch);
+void               fpi_print_unpack (FpPrint *print);
+void               fpi_print_invalidate (FpPrint *print);
+const guchar *     fpi_print_get_packed_xyt (FpPrint *print,
+                                             guint    idx);
+void               fpi_print_packed_decode (const guchar       *p,
+                                            FpiPrintXytEncoding encoding,
+                                            struct xyt_struct  *xyt);
+void               fpi_print_checksum_xyt (FpPrint   *print,
+                                           GChecksum *checksum);
+
+/* Magic of the packed Web records, see fpi_print_pack_webs() */
+#define FPI_PRINT_WEBS_MAGIC "FPW"
+/* Key of the packed Web record in the expansion dict of "FP3" prints */
+#define FPI_PRINT_WEBS_KEY "bz3-webs"
+
+void               fpi_print_pack_webs (FpPrint    *print,
+                                        GByteArray *buf);
+gchar *            fpi_print_webs_checksum (FpPrint      *print,
+                                            const guchar *record,
+                                            gsize         length);
+gboolean           fpi_print_load_packed_webs (FpPrint *print,
+                                               GBytes  *bytes,
+                                               gsize    offset,
+                                               gsize   *size);
@@ -24,6 +24,9 @@
 #include "fpi-compat.h"
 #include "fpi-log.h"
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 /**
  * SECTION: fp-print
  * @title: FpPrint
@@ -79,6 +82,12 @@ fp_print_finalize (GObject *object)
   g_clear_pointer (&self->enroll_date, g_date_free);
   g_clear_pointer (&self->data, g_variant_unref);
   g_clear_pointer (&self->prints, g_ptr_array_unref);
+  g_clear_pointer (&self->bz3_webs, g_ptr_array_unref);
+  g_clear_pointer (&self->bz3_template, g_free);
+  g_clear_pointer (&self->cylinders, g_ptr_array_unref);
+  g_clear_pointer (&self->packed, g_bytes_unref);
+  g_clear_pointer (&self->packed_webs, g_bytes_unref);
+  g_clear_pointer (&self->digest, g_free);
 
   G_OBJECT_CLASS (fp_print_parent_class)->finalize (object);
 }
@@ -186,6 +195,7 @@ fp_print_set_property (GObject      *object,
     case PROP_FPI_DATA:
       g_clear_pointer (&self->data, g_variant_unref);
       self->data = g_value_dup_variant (value);
+      g_clear_pointer (&self->digest, g_free);
       break;
 
     default:
@@ -568,6 +578,8 @@ fp_print_compatible (FpPrint *self, FpDevice *device)
 gboolean
 fp_print_equal (FpPrint *self, FpPrint *other)
 {
+  const gchar *a_digest, *b_digest;
+
   g_return_val_if_fail (FP_IS_PRINT (self), FALSE);
   g_return_val_if_fail (FP_IS_PRINT (other), FALSE);
   g_return_val_if_fail (self->type != FPI_PRINT_UNDEFINED, FALSE);
@@ -576,6 +588,12 @@ fp_print_equal (FpPrint *self, FpPrint *other)
   if (self->type != other->type)
     return FALSE;
 
+  /* The digests cover the same information, use them if already known */
+  a_digest = g_atomic_pointer_get (&self->digest);
+  b_digest = g_atomic_pointer_get (&other->digest);
+  if (a_digest && b_digest)
+    return g_str_equal (a_digest, b_digest);
+
   if (g_strcmp0 (self->driver, other->driver))
     return FALSE;
 
@@ -588,15 +606,16 @@ fp_print_equal (FpPrint *self, FpPrint *other)
     }
   else if (self->type == FPI_PRINT_NBIS)
     {
+      struct xyt_struct a_scratch, b_scratch;
       guint i;
 
-      if (self->prints->len != other->prints->len)
+      if (fpi_print_get_n_xyt (self) != fpi_print_get_n_xyt (other))
         return FALSE;
 
-      for (i = 0; i < self->prints->len; i++)
+      for (i = 0; i < fpi_print_get_n_xyt (self); i++)
         {
-          struct xyt_struct *a = g_ptr_array_index (self->prints, i);
-          struct xyt_struct *b = g_ptr_array_index (other->prints, i);
+          struct xyt_struct *a = fpi_print_get_xyt (self, i, &a_scratch);
+          struct xyt_struct *b = fpi_print_get_xyt (other, i, &b_scratch);
 
           if (memcmp (a, b, sizeof (struct xyt_struct)) != 0)
             return FALSE;
@@ -610,7 +629,87 @@ fp_print_equal (FpPrint *self, FpPrint *other)
     }
 }
 
+static void
+checksum_update_string (GChecksum *checksum, const gchar *str)
+{
+  /* Include the terminator so that fields cannot run into each other */
+  if (str)
+    g_checksum_update (checksum, (const guchar *) str, strlen (str) + 1);
+  else
+    g_checksum_update (checksum, (const guchar *) "", 0);
+}
+
+/**
+ * fp_print_get_digest:
+ * @print: A #FpPrint
+ *
+ * Returns a digest of the information compared by fp_print_equal(), i.e.
+ * the driver, the device ID and the print data, but not the metadata.
+ * Equal prints have the same digest, so it can be used to find duplicates
+ * or as a cache key without comparing the prints against each other.
+ * The digest does not depend on the machine and can be stored.
+ *
+ * It is computed on first use and recomputed when the print data changes.
+ *
+ * Returns: (transfer none): The SHA-256 digest as a hex string
+ */
+const gchar *
+fp_print_get_digest (FpPrint *print)
+{
+  g_autoptr(GChecksum) checksum = NULL;
+  gchar *digest;
+  guint32 type;
+
+  g_return_val_if_fail (FP_IS_PRINT (print), NULL);
+  g_return_val_if_fail (print->type != FPI_PRINT_UNDEFINED, NULL);
+
+  digest = g_atomic_pointer_get (&print->digest);
+  if (digest)
+    return digest;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  type = GUINT32_TO_LE (print->type);
+  g_checksum_update (checksum, (const guchar *) &type, sizeof (type));
+  checksum_update_string (checksum, print->driver);
+  checksum_update_string (checksum, print->device_id);
+
+  if (print->type == FPI_PRINT_RAW)
+    {
+      g_autoptr(GVariant) normal = NULL;
+
+      if (print->data)
+        {
+          normal = g_variant_get_normal_form (print->data);
+          if (G_BYTE_ORDER != G_LITTLE_ENDIAN)
+            {
+              GVariant *swapped = g_variant_byteswap (normal);
+
+              g_variant_unref (normal);
+              normal = swapped;
+            }
+
+          checksum_update_string (checksum, g_variant_get_type_string (normal));
+          g_checksum_update (checksum, g_variant_get_data (normal), g_variant_get_size (normal));
+        }
+    }
+  else
+    {
+      fpi_print_checksum_xyt (print, checksum);
+    }
+
+  digest = g_strdup (g_checksum_get_string (checksum));
+  if (!g_atomic_pointer_compare_and_exchange (&print->digest, NULL, digest))
+    {
+      /* Computed concurrently by another thread */
+      g_free (digest);
+      digest = g_atomic_pointer_get (&print->digest);
+    }
+
+  return digest;
+}
+
 #define FPI_PRINT_VARIANT_TYPE G_VARIANT_TYPE ("(issbymsmsia{sv}v)")
+#define FPI_PRINT_PACKED_MAGIC "FPK"
 
 G_STATIC_ASSERT (sizeof (((struct xyt_struct *) NULL)->xcol[0]) == 4);
 
@@ -631,6 +730,41 @@ fp_print_serialize (FpPrint *print,
                     guchar **data,
                     gsize   *length,
                     GError **error)
+{
+  return fp_print_serialize_full (print, FP_PRINT_SERIALIZE_NONE, data, length, error);
+}
+
+static gboolean serialize_packed (FpPrint            *print,
+                                  FpiPrintXytEncoding encoding,
+                                  guchar            **data,
+                                  gsize              *length,
+                                  GError            **error);
+
+/**
+ * fp_print_serialize_full:
+ * @print: A #FpPrint
+ * @flags: #FpPrintSerializeFlags
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
+ * @error: Return location for error
+ *
+ * Like fp_print_serialize(), but with #FP_PRINT_SERIALIZE_WEBS the
+ * precomputed matching data of NBIS prints is stored as well. A print
+ * deserialized from such data matches as fast the first time as later
+ * on. Older versions of libfprint ignore the extra data.
+ *
+ * With #FP_PRINT_SERIALIZE_COMPRESSED NBIS prints are stored in the packed
+ * format with delta encoded minutiae instead, see
+ * fp_print_serialize_packed().
+ *
+ * Returns: (type void): %TRUE on success
+ */
+gboolean
+fp_print_serialize_full (FpPrint               *print,
+                         FpPrintSerializeFlags  flags,
+                         guchar               **data,
+                         gsize                 *length,
+                         GError               **error)
 {
   g_autoptr(GVariant) result = NULL;
   GVariantBuilder builder = G_VARIANT_BUILDER_INIT (FPI_PRINT_VARIANT_TYPE);
@@ -639,6 +773,9 @@ fp_print_serialize (FpPrint *print,
   g_assert (data);
   g_assert (length);
 
+  if (print->type == FPI_PRINT_NBIS && (flags & FP_PRINT_SERIALIZE_COMPRESSED))
+    return serialize_packed (print, FPI_PRINT_XYT_DELTA, data, length, error);
+
   g_variant_builder_add (&builder, "i", print->type);
   g_variant_builder_add (&builder, "s", print->driver);
   g_variant_builder_add (&builder, "s", print->device_id);
@@ -653,20 +790,35 @@ fp_print_serialize (FpPrint *print,
   else
     g_variant_builder_add (&builder, "i", G_MININT32);
 
-  /* Unused a{sv} for expansion */
+  /* a{sv} for expansion, older readers ignore unknown keys */
   g_variant_builder_open (&builder, G_VARIANT_TYPE_VARDICT);
+  if (print->type == FPI_PRINT_NBIS && (flags & FP_PRINT_SERIALIZE_WEBS))
+    {
+      g_autoptr(GByteArray) webs = g_byte_array_new ();
+      g_autofree gchar *checksum = NULL;
+
+      fpi_print_pack_webs (print, webs);
+      checksum = fpi_print_webs_checksum (print, webs->data, webs->len);
+      g_variant_builder_add (&builder, "{sv}", FPI_PRINT_WEBS_KEY,
+                             g_variant_new ("(s@ay)", checksum,
+                                            g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                       webs->data,
+                                                                       webs->len,
+                                                                       1)));
+    }
   g_variant_builder_close (&builder);
 
   /* Insert NBIS print data for type NBIS, otherwise the GVariant directly */
   if (print->type == FPI_PRINT_NBIS)
     {
       GVariantBuilder nested = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("(a(aiaiai))"));
+      struct xyt_struct scratch;
       guint i;
 
       g_variant_builder_open (&nested, G_VARIANT_TYPE ("a(aiaiai)"));
-      for (i = 0; i < print->prints->len; i++)
+      for (i = 0; i < fpi_print_get_n_xyt (print); i++)
         {
-          struct xyt_struct *xyt = g_ptr_array_index (print->prints, i);
+          struct xyt_struct *xyt = fpi_print_get_xyt (print, i, &scratch);
           gint j;
           gint32 *col = g_new (gint32, xyt->nrows);
 
@@ -734,6 +886,166 @@ fp_print_serialize (FpPrint *print,
   return TRUE;
 }
 
+/*
+ * Direct parser for the serialised "a(aiaiai)" minutiae of an NBIS print.
+ *
+ * Going through GVariant needs several allocations per print and column,
+ * so instead this follows the GVariant serialisation format: Containers of
+ * variable sized children store the end offset of each child (except the
+ * last one in a tuple) at their end. These framing offsets are little
+ * endian, and 1, 2, 4 or 8 bytes wide depending on the container size.
+ * Each "ai" is a plain array of native endian integers and is copied in
+ * one go.
+ *
+ * Anything unexpected (e.g. data that is not in normal form) makes the
+ * parser fail, the caller then falls back to the GVariant accessors.
+ */
+#define ALIGN_INT32(offset) (((offset) + 3) & ~(gsize) 3)
+
+static guint
+gvariant_offset_size (gsize size)
+{
+  if (size == 0)
+    return 0;
+  else if (size <= G_MAXUINT8)
+    return 1;
+  else if (size <= G_MAXUINT16)
+    return 2;
+  else if (size <= G_MAXUINT32)
+    return 4;
+  else
+    return 8;
+}
+
+static gsize
+gvariant_read_offset (const guchar *p, guint offset_size)
+{
+  gsize res = 0;
+  guint i;
+
+  for (i = 0; i < offset_size; i++)
+    res |= ((gsize) p[i]) << (8 * i);
+
+  return res;
+}
+
+static gboolean
+parse_xyt_column (const guchar *data,
+                  gsize         start,
+                  gsize         end,
+                  gint32       *col,
+                  gsize        *len)
+{
+  if (start > end || (end - start) % sizeof (gint32) != 0)
+    return FALSE;
+
+  *len = (end - start) / sizeof (gint32);
+  if (*len > MAX_BOZORTH_MINUTIAE)
+    return FALSE;
+
+  memcpy (col, data + start, end - start);
+  return TRUE;
+}
+
+static gboolean
+parse_xyt_array (const guchar *data,
+                 gsize         size,
+                 GPtrArray    *prints)
+{
+  guint offset_size = gvariant_offset_size (size);
+  gsize table_start, n, i;
+  gsize start = 0;
+
+  if (size == 0)
+    return TRUE;
+
+  table_start = gvariant_read_offset (data + size - offset_size, offset_size);
+  if (table_start > size || (size - table_start) % offset_size != 0)
+    return FALSE;
+
+  n = (size - table_start) / offset_size;
+  for (i = 0; i < n; i++)
+    {
+      g_autofree struct xyt_struct *xyt = NULL;
+      const guchar *elem;
+      gsize end, elem_size, elem_offset_size;
+      gsize x_end, y_start, y_end, theta_start;
+      gsize xlen, ylen, thetalen;
+
+      end = gvariant_read_offset (data + table_start + i * offset_size, offset_size);
+      if (start > end || end > table_start)
+        return FALSE;
+
+      elem = data + start;
+      elem_size = end - start;
+      elem_offset_size = gvariant_offset_size (elem_size);
+      if (elem_size < 2 * elem_offset_size)
+        return FALSE;
+
+      /* Framing offsets of the first two columns, in reverse order */
+      x_end = gvariant_read_offset (elem + elem_size - elem_offset_size, elem_offset_size);
+      y_end = gvariant_read_offset (elem + elem_size - 2 * elem_offset_size, elem_offset_size);
+      y_start = ALIGN_INT32 (x_end);
+      theta_start = ALIGN_INT32 (y_end);
+      if (theta_start > elem_size - 2 * elem_offset_size)
+        return FALSE;
+
+      xyt = g_new0 (struct xyt_struct, 1);
+      if (!parse_xyt_column (elem, 0, x_end, xyt->xcol, &xlen) ||
+          !parse_xyt_column (elem, y_start, y_end, xyt->ycol, &ylen) ||
+          !parse_xyt_column (elem, theta_start, elem_size - 2 * elem_offset_size,
+                             xyt->thetacol, &thetalen))
+        return FALSE;
+
+      if (xlen != ylen || xlen != thetalen)
+        return FALSE;
+
+      xyt->nrows = xlen;
+      g_ptr_array_add (prints, g_steal_pointer (&xyt));
+
+      /* The next element is aligned to the tuple alignment */
+      start = ALIGN_INT32 (end);
+    }
+
+  return TRUE;
+}
+
+/* Attaches the stored Webs from the expansion dict of a "FP3" print, if
+ * they are present and still belong to its minutiae. They are copied, so
+ * that the serialised data is not kept around. */
+static void
+fp_print_load_webs (FpPrint *print, GVariant *expansion)
+{
+  g_autoptr(GVariant) webs = NULL;
+  g_autoptr(GVariant) record = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autofree gchar *expected = NULL;
+  const gchar *checksum;
+  const guchar *data;
+  gsize length, size;
+
+  webs = g_variant_lookup_value (expansion, FPI_PRINT_WEBS_KEY, G_VARIANT_TYPE ("(say)"));
+  if (!webs)
+    return;
+
+  g_variant_get (webs, "(&s@ay)", &checksum, &record);
+  data = g_variant_get_fixed_array (record, &length, 1);
+
+  expected = fpi_print_webs_checksum (print, data, length);
+  if (g_strcmp0 (checksum, expected) != 0)
+    {
+      fp_dbg ("Ignoring stored matching data with a wrong checksum");
+      return;
+    }
+
+  bytes = g_bytes_new (data, length);
+  if (!fpi_print_load_packed_webs (print, bytes, 0, &size) || size != length)
+    {
+      fp_dbg ("Ignoring stored matching data that could not be parsed");
+      g_clear_pointer (&print->packed_webs, g_bytes_unref);
+    }
+}
+
 /**
  * fp_print_deserialize:
  * @data: (array length=length): The binary data
@@ -759,6 +1071,7 @@ fp_print_deserialize (const guchar *data,
   FpFinger finger;
   g_autofree gchar *username = NULL;
   g_autofree gchar *description = NULL;
+  g_autoptr(GVariant) expansion = NULL;
   gint julian_date;
   FpiPrintType type;
   const gchar *driver;
@@ -768,6 +1081,9 @@ fp_print_deserialize (const guchar *data,
   g_assert (data);
   g_assert (length > 3);
 
+  if (memcmp (data, FPI_PRINT_PACKED_MAGIC, 3) == 0)
+    return fp_print_deserialize_packed (data, length, error);
+
   if (memcmp (data, "FP3", 3) != 0)
     goto invalid_format;
 
@@ -788,10 +1104,12 @@ fp_print_deserialize (const guchar *data,
   if (!raw_value)
     goto invalid_format;
 
+  /* The accessors are safe on data that is not in normal form, so there is
+   * no need to normalise (and copy) it first. */
   if (G_BYTE_ORDER == G_BIG_ENDIAN)
     value = g_variant_byteswap (raw_value);
   else
-    value = g_variant_get_normal_form (raw_value);
+    value = g_variant_ref (raw_value);
 
   g_variant_get (value,
                  "(i&s&sbymsmsi@a{sv}v)",
@@ -803,7 +1121,7 @@ fp_print_deserialize (const guchar *data,
                  &username,
                  &description,
                  &julian_date,
-                 NULL,
+                 &expansion,
                  &print_data);
 
   finger = finger_int8;
@@ -820,42 +1138,52 @@ fp_print_deserialize (const guchar *data,
                              "device-stored", device_stored,
                              NULL);
       fpi_print_set_type (result, FPI_PRINT_NBIS);
-      for (i = 0; i < g_variant_n_children (prints); i++)
-        {
-          g_autofree struct xyt_struct *xyt = NULL;
-          const gint32 *xcol, *ycol, *thetacol;
-          gsize xlen, ylen, thetalen;
-          g_autoptr(GVariant) xyt_data = NULL;
-          GVariant *child;
-
-          xyt_data = g_variant_get_child_value (prints, i);
-
-          child = g_variant_get_child_value (xyt_data, 0);
-          xcol = g_variant_get_fixed_array (child, &xlen, sizeof (gint32));
-          g_variant_unref (child);
 
-          child = g_variant_get_child_value (xyt_data, 1);
-          ycol = g_variant_get_fixed_array (child, &ylen, sizeof (gint32));
-          g_variant_unref (child);
-
-          child = g_variant_get_child_value (xyt_data, 2);
-          thetacol = g_variant_get_fixed_array (child, &thetalen, sizeof (gint32));
-          g_variant_unref (child);
-
-          if (xlen != ylen || xlen != thetalen)
-            goto invalid_format;
-
-          if (xlen > G_N_ELEMENTS (xyt->xcol))
-            goto invalid_format;
-
-          xyt = g_new0 (struct xyt_struct, 1);
-          xyt->nrows = xlen;
-          memcpy (xyt->xcol, xcol, sizeof (xcol[0]) * xlen);
-          memcpy (xyt->ycol, ycol, sizeof (xcol[0]) * xlen);
-          memcpy (xyt->thetacol, thetacol, sizeof (xcol[0]) * xlen);
-
-          g_ptr_array_add (result->prints, g_steal_pointer (&xyt));
+      /* Fall back to GVariant for anything the direct parser rejects */
+      if (!parse_xyt_array (g_variant_get_data (prints),
+                            g_variant_get_size (prints),
+                            result->prints))
+        {
+          g_ptr_array_set_size (result->prints, 0);
+          for (i = 0; i < g_variant_n_children (prints); i++)
+            {
+              g_autofree struct xyt_struct *xyt = NULL;
+              const gint32 *xcol, *ycol, *thetacol;
+              gsize xlen, ylen, thetalen;
+              g_autoptr(GVariant) xyt_data = NULL;
+              GVariant *child;
+
+              xyt_data = g_variant_get_child_value (prints, i);
+
+              child = g_variant_get_child_value (xyt_data, 0);
+              xcol = g_variant_get_fixed_array (child, &xlen, sizeof (gint32));
+              g_variant_unref (child);
+
+              child = g_variant_get_child_value (xyt_data, 1);
+              ycol = g_variant_get_fixed_array (child, &ylen, sizeof (gint32));
+              g_variant_unref (child);
+
+              child = g_variant_get_child_value (xyt_data, 2);
+              thetacol = g_variant_get_fixed_array (child, &thetalen, sizeof (gint32));
+              g_variant_unref (child);
+
+              if (xlen != ylen || xlen != thetalen)
+                goto invalid_format;
+
+              if (xlen > G_N_ELEMENTS (xyt->xcol))
+                goto invalid_format;
+
+              xyt = g_new0 (struct xyt_struct, 1);
+              xyt->nrows = xlen;
+              memcpy (xyt->xcol, xcol, sizeof (xcol[0]) * xlen);
+              memcpy (xyt->ycol, ycol, sizeof (xcol[0]) * xlen);
+              memcpy (xyt->thetacol, thetacol, sizeof (xcol[0]) * xlen);
+
+              g_ptr_array_add (result->prints, g_steal_pointer (&xyt));
+            }
         }
+
+      fp_print_load_webs (result, expansion);
     }
   else if (type == FPI_PRINT_RAW)
     {
@@ -891,3 +1219,1781 @@ invalid_format:
                                 "Data could not be parsed");
   return FALSE;
 }
+
+/*
+ * Packed print format
+ *
+ * A compact alternative to the "FP3" GVariant format, which only supports
+ * NBIS prints. All values are little endian and the record size is padded
+ * to a multiple of 4 so records can be concatenated:
+ *
+ *  0  "FPK"
+ *  3  guint8  version
+ *  4  guint32 size of the record in bytes
+ *  8  guint8  finger
+ *  9  guint8  flags (FPI_PRINT_PACKED_DEVICE_STORED)
+ * 10  guint16 number of prints
+ * 12  gint32  enroll date as julian day, G_MININT32 if unset
+ * 16  guint16 string lengths of driver, device-id, username, description
+ *             (G_MAXUINT16 for %NULL)
+ * 24  the strings, each NUL terminated, padded to 2 bytes
+ *     for each print: guint16 nrows, then nrows gint16 values for each of
+ *     the x, y and theta columns
+ *
+ * Version 2 records store the minutiae of each print delta encoded instead:
+ * guint16 nrows, guint16 size of the encoded columns in bytes, then the x,
+ * y and theta columns one after another. Each value is stored as the
+ * difference to the previous one of its column (the first one to 0),
+ * zigzag mapped to an unsigned value and written as a LEB128 varint, i.e.
+ * 7 bits per byte with the high bit set on all but the last byte. As the
+ * minutiae are sorted by their x position, most x values then fit into one
+ * byte, and none of the values of typical images need more than two.
+ *
+ * A gallery file is "FPG", a guint8 version and a guint32 record count,
+ * followed by that many records. From version 2 on, each record may be
+ * followed by a packed Web record, see fpi_print_pack_webs().
+ */
+#define FPI_PRINT_PACKED_VERSION 1
+#define FPI_PRINT_PACKED_VERSION_DELTA 2
+#define FPI_PRINT_PACKED_HEADER_SIZE 24
+#define FPI_PRINT_PACKED_NULL_STRING G_MAXUINT16
+#define FPI_PRINT_PACKED_DEVICE_STORED (1 << 0)
+#define FPI_PRINT_PACKED_N_STRINGS 4
+
+#define FPI_GALLERY_MAGIC "FPG"
+#define FPI_GALLERY_VERSION 1
+#define FPI_GALLERY_VERSION_WEBS 2
+#define FPI_GALLERY_HEADER_SIZE 8
+
+static inline guint16
+read_le16 (const guchar *p)
+{
+  guint16 v;
+
+  memcpy (&v, p, sizeof (v));
+  return GUINT16_FROM_LE (v);
+}
+
+static inline guint32
+read_le32 (const guchar *p)
+{
+  guint32 v;
+
+  memcpy (&v, p, sizeof (v));
+  return GUINT32_FROM_LE (v);
+}
+
+static inline void
+write_le16 (guchar *p, guint16 v)
+{
+  v = GUINT16_TO_LE (v);
+  memcpy (p, &v, sizeof (v));
+}
+
+static inline void
+write_le32 (guchar *p, guint32 v)
+{
+  v = GUINT32_TO_LE (v);
+  memcpy (p, &v, sizeof (v));
+}
+
+/* Size of a varint, which is enough for any zigzag mapped gint32 */
+#define VARINT_MAX_SIZE 5
+
+static inline guint32
+zigzag_encode (gint32 v)
+{
+  return ((guint32) v << 1) ^ (guint32) (v >> 31);
+}
+
+static inline gint32
+zigzag_decode (guint32 v)
+{
+  return (gint32) (v >> 1) ^ -(gint32) (v & 1);
+}
+
+static void
+pack_delta_column (GByteArray *buf, const gint32 *col, gint nrows)
+{
+  gint32 prev = 0;
+  gint i;
+
+  for (i = 0; i < nrows; i++)
+    {
+      guint32 v = zigzag_encode ((gint32) ((guint32) col[i] - (guint32) prev));
+      guint8 bytes[VARINT_MAX_SIZE];
+      guint n = 0;
+
+      while (v >= 0x80)
+        {
+          bytes[n++] = (v & 0x7f) | 0x80;
+          v >>= 7;
+        }
+      bytes[n++] = v;
+
+      g_byte_array_append (buf, bytes, n);
+      prev = col[i];
+    }
+}
+
+/* Decodes a column that was validated by check_delta_column() */
+static const guchar *
+unpack_delta_column (const guchar *p, gint32 *col, guint nrows)
+{
+  guint32 prev = 0;
+  guint i;
+
+  for (i = 0; i < nrows; i++)
+    {
+      guint32 v = 0;
+      guint shift = 0;
+
+      do
+        {
+          v |= (guint32) (*p & 0x7f) << shift;
+          shift += 7;
+        }
+      while (*p++ & 0x80);
+
+      prev += (guint32) zigzag_decode (v);
+      col[i] = (gint32) prev;
+    }
+
+  return p;
+}
+
+/* Checks that @end - @p bytes hold exactly @n_values varints */
+static gboolean
+check_delta_columns (const guchar *p, const guchar *end, guint n_values)
+{
+  guint i;
+
+  for (i = 0; i < n_values; i++)
+    {
+      guint n = 0;
+
+      do
+        {
+          if (p == end || n == VARINT_MAX_SIZE)
+            return FALSE;
+          n++;
+        }
+      while (*p++ & 0x80);
+
+      /* The last byte of a 5 byte varint holds the top 4 bits */
+      if (n == VARINT_MAX_SIZE && p[-1] > 0x0f)
+        return FALSE;
+    }
+
+  return p == end;
+}
+
+/* Size of the packed minutiae at @p, including the header */
+static inline gsize
+packed_xyt_size (const guchar *p, FpiPrintXytEncoding encoding)
+{
+  if (encoding == FPI_PRINT_XYT_DELTA)
+    return 4 + read_le16 (p + 2);
+
+  return 2 + 3 * 2 * read_le16 (p);
+}
+
+/**
+ * fpi_print_packed_decode:
+ * @p: A packed minutiae record, see fpi_print_get_packed_xyt()
+ * @encoding: The #FpiPrintXytEncoding of the record
+ * @xyt: Return location for the minutiae
+ *
+ * Decodes a packed minutiae record.
+ */
+void
+fpi_print_packed_decode (const guchar       *p,
+                         FpiPrintXytEncoding encoding,
+                         struct xyt_struct  *xyt)
+{
+  guint nrows = read_le16 (p);
+  guint i;
+
+  memset (xyt, 0, sizeof (*xyt));
+  xyt->nrows = nrows;
+
+  if (encoding == FPI_PRINT_XYT_DELTA)
+    {
+      p += 4;
+      p = unpack_delta_column (p, xyt->xcol, nrows);
+      p = unpack_delta_column (p, xyt->ycol, nrows);
+      unpack_delta_column (p, xyt->thetacol, nrows);
+      return;
+    }
+
+  p += 2;
+  for (i = 0; i < nrows; i++)
+    xyt->xcol[i] = (gint16) read_le16 (p + 2 * i);
+  p += 2 * nrows;
+  for (i = 0; i < nrows; i++)
+    xyt->ycol[i] = (gint16) read_le16 (p + 2 * i);
+  p += 2 * nrows;
+  for (i = 0; i < nrows; i++)
+    xyt->thetacol[i] = (gint16) read_le16 (p + 2 * i);
+}
+
+/**
+ * fpi_print_get_n_xyt:
+ * @print: A #FpPrint of type #FPI_PRINT_NBIS
+ *
+ * Returns: The number of minutiae sets stored in @print
+ */
+guint
+fpi_print_get_n_xyt (FpPrint *print)
+{
+  if (print->packed)
+    return print->packed_n_xyt;
+
+  return print->prints->len;
+}
+
+/**
+ * fpi_print_get_xyt:
+ * @print: A #FpPrint of type #FPI_PRINT_NBIS
+ * @idx: Index of the minutiae set
+ * @scratch: Storage used if @print is a view onto packed data
+ *
+ * Gets the minutiae of @print, without unpacking it. The result must not
+ * be modified and is only valid as long as @scratch and @print are.
+ *
+ * Returns: (transfer none): The minutiae set at @idx
+ */
+struct xyt_struct *
+fpi_print_get_xyt (FpPrint *print, guint idx, struct xyt_struct *scratch)
+{
+  if (!print->packed)
+    return g_ptr_array_index (print->prints, idx);
+
+  fpi_print_packed_decode (fpi_print_get_packed_xyt (print, idx),
+                           print->packed_encoding, scratch);
+
+  return scratch;
+}
+
+/**
+ * fpi_print_get_packed_xyt:
+ * @print: A #FpPrint that is a view onto packed data
+ * @idx: Index of the minutiae set
+ *
+ * Returns: (transfer none): The packed record of the minutiae set at @idx,
+ *   to decode with fpi_print_packed_decode()
+ */
+const guchar *
+fpi_print_get_packed_xyt (FpPrint *print, guint idx)
+{
+  const guchar *p;
+  guint i;
+
+  g_assert (print->packed);
+  g_assert (idx < print->packed_n_xyt);
+
+  /* All records were validated when the view was created */
+  p = (const guchar *) g_bytes_get_data (print->packed, NULL) + print->packed_xyt_offset;
+  for (i = 0; i < idx; i++)
+    p += packed_xyt_size (p, print->packed_encoding);
+
+  return p;
+}
+
+/**
+ * fpi_print_unpack:
+ * @print: A #FpPrint
+ *
+ * Converts a view onto packed data into a regular print. This needs to
+ * be done before modifying the NBIS data of @print.
+ */
+void
+fpi_print_unpack (FpPrint *print)
+{
+  guint i;
+
+  if (!print->packed)
+    return;
+
+  for (i = 0; i < print->packed_n_xyt; i++)
+    {
+      struct xyt_struct *xyt = g_new0 (struct xyt_struct, 1);
+
+      fpi_print_get_xyt (print, i, xyt);
+      g_ptr_array_add (print->prints, xyt);
+    }
+
+  /* The match data refers to the packed records */
+  g_clear_pointer (&print->bz3_template, g_free);
+  g_clear_pointer (&print->cylinders, g_ptr_array_unref);
+  g_clear_pointer (&print->packed, g_bytes_unref);
+  print->packed_n_xyt = 0;
+  print->packed_xyt_offset = 0;
+}
+
+/**
+ * fpi_print_invalidate:
+ * @print: A #FpPrint
+ *
+ * Drops all data derived from the NBIS prints of @print. This needs to
+ * be done whenever the set of prints changes.
+ */
+void
+fpi_print_invalidate (FpPrint *print)
+{
+  g_clear_pointer (&print->bz3_webs, g_ptr_array_unref);
+  g_clear_pointer (&print->bz3_template, g_free);
+  g_clear_pointer (&print->cylinders, g_ptr_array_unref);
+  g_clear_pointer (&print->packed_webs, g_bytes_unref);
+  g_clear_pointer (&print->digest, g_free);
+}
+
+/* Appends the minutiae blocks of @print, fails if they do not fit */
+static gboolean
+fp_print_pack_xyt (FpPrint            *print,
+                   FpiPrintXytEncoding encoding,
+                   GByteArray         *buf)
+{
+  struct xyt_struct scratch;
+  guint i;
+
+  for (i = 0; i < fpi_print_get_n_xyt (print); i++)
+    {
+      struct xyt_struct *xyt = fpi_print_get_xyt (print, i, &scratch);
+      guint offset = buf->len;
+      gint j;
+
+      if (encoding == FPI_PRINT_XYT_DELTA)
+        {
+          g_byte_array_set_size (buf, offset + 4);
+          pack_delta_column (buf, xyt->xcol, xyt->nrows);
+          pack_delta_column (buf, xyt->ycol, xyt->nrows);
+          pack_delta_column (buf, xyt->thetacol, xyt->nrows);
+
+          if (buf->len - offset - 4 > G_MAXUINT16)
+            return FALSE;
+
+          write_le16 (buf->data + offset, xyt->nrows);
+          write_le16 (buf->data + offset + 2, buf->len - offset - 4);
+          continue;
+        }
+
+      g_byte_array_set_size (buf, offset + 2 + 3 * 2 * xyt->nrows);
+      write_le16 (buf->data + offset, xyt->nrows);
+      offset += 2;
+
+      for (j = 0; j < xyt->nrows; j++)
+        {
+          if (xyt->xcol[j] < G_MININT16 || xyt->xcol[j] > G_MAXINT16 ||
+              xyt->ycol[j] < G_MININT16 || xyt->ycol[j] > G_MAXINT16 ||
+              xyt->thetacol[j] < G_MININT16 || xyt->thetacol[j] > G_MAXINT16)
+            return FALSE;
+
+          write_le16 (buf->data + offset + 2 * j, xyt->xcol[j]);
+          write_le16 (buf->data + offset + 2 * (xyt->nrows + j), xyt->ycol[j]);
+          write_le16 (buf->data + offset + 2 * (2 * xyt->nrows + j), xyt->thetacol[j]);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Validates @n_xyt minutiae blocks starting at @pos and moves @pos past them */
+static gboolean
+fp_print_check_xyt (const guchar       *record,
+                    gsize               size,
+                    guint               n_xyt,
+                    FpiPrintXytEncoding encoding,
+                    gsize              *pos)
+{
+  guint i;
+
+  for (i = 0; i < n_xyt; i++)
+    {
+      guint nrows;
+
+      if (encoding == FPI_PRINT_XYT_DELTA)
+        {
+          guint encoded_size;
+
+          if (size - *pos < 4)
+            return FALSE;
+
+          nrows = read_le16 (record + *pos);
+          encoded_size = read_le16 (record + *pos + 2);
+          if (nrows > MAX_BOZORTH_MINUTIAE || size - *pos - 4 < encoded_size ||
+              !check_delta_columns (record + *pos + 4,
+                                    record + *pos + 4 + encoded_size,
+                                    3 * nrows))
+            return FALSE;
+
+          *pos += 4 + encoded_size;
+          continue;
+        }
+
+      if (size - *pos < 2)
+        return FALSE;
+
+      nrows = read_le16 (record + *pos);
+      if (nrows > MAX_BOZORTH_MINUTIAE || size - *pos - 2 < 3 * 2 * nrows)
+        return FALSE;
+
+      *pos += 2 + 3 * 2 * nrows;
+    }
+
+  return TRUE;
+}
+
+/* Appends a NUL terminated string and stores its length at @len_offset */
+static gboolean
+fp_print_pack_string (GByteArray  *buf,
+                      guint        len_offset,
+                      const gchar *str)
+{
+  gsize len;
+
+  if (!str)
+    {
+      write_le16 (buf->data + len_offset, FPI_PRINT_PACKED_NULL_STRING);
+      return TRUE;
+    }
+
+  len = strlen (str);
+  if (len >= FPI_PRINT_PACKED_NULL_STRING)
+    return FALSE;
+
+  write_le16 (buf->data + len_offset, len);
+  g_byte_array_append (buf, (const guint8 *) str, len + 1);
+
+  return TRUE;
+}
+
+/* Reads a string written by fp_print_pack_string() and moves @pos past it */
+static gboolean
+fp_print_check_string (const guchar *record,
+                       gsize         size,
+                       guint         len,
+                       gsize        *pos,
+                       const gchar **str)
+{
+  *str = NULL;
+  if (len == FPI_PRINT_PACKED_NULL_STRING)
+    return TRUE;
+
+  if (size - *pos < len + 1 || record[*pos + len] != '\0' ||
+      memchr (record + *pos, '\0', len) != NULL)
+    return FALSE;
+
+  *str = (const gchar *) record + *pos;
+  *pos += len + 1;
+
+  return TRUE;
+}
+
+static inline void
+pad_byte_array (GByteArray *buf, guint alignment)
+{
+  while (buf->len % alignment)
+    g_byte_array_append (buf, (const guint8 *) "", 1);
+}
+
+static gboolean
+fp_print_pack (FpPrint            *print,
+               FpiPrintXytEncoding encoding,
+               GByteArray         *buf,
+               GError            **error)
+{
+  const gchar *strings[FPI_PRINT_PACKED_N_STRINGS] = {
+    print->driver, print->device_id, print->username, print->description
+  };
+  guint start = buf->len;
+  guint n_xyt;
+  guchar *header;
+  guint8 flags = 0;
+  gint32 date = G_MININT32;
+  guint i;
+
+  if (print->type != FPI_PRINT_NBIS)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "Only NBIS prints can be stored in the packed format");
+      return FALSE;
+    }
+
+  n_xyt = fpi_print_get_n_xyt (print);
+  if (n_xyt > G_MAXUINT16)
+    goto too_large;
+
+  g_byte_array_set_size (buf, start + FPI_PRINT_PACKED_HEADER_SIZE);
+
+  for (i = 0; i < FPI_PRINT_PACKED_N_STRINGS; i++)
+    if (!fp_print_pack_string (buf, start + 16 + 2 * i, strings[i]))
+      goto too_large;
+
+  pad_byte_array (buf, 2);
+
+  if (!fp_print_pack_xyt (print, encoding, buf))
+    goto too_large;
+
+  pad_byte_array (buf, 4);
+
+  if (print->device_stored)
+    flags |= FPI_PRINT_PACKED_DEVICE_STORED;
+
+  if (print->enroll_date && g_date_valid (print->enroll_date))
+    date = g_date_get_julian (print->enroll_date);
+
+  header = buf->data + start;
+  memcpy (header, FPI_PRINT_PACKED_MAGIC, 3);
+  header[3] = encoding == FPI_PRINT_XYT_DELTA ?
+              FPI_PRINT_PACKED_VERSION_DELTA : FPI_PRINT_PACKED_VERSION;
+  write_le32 (header + 4, buf->len - start);
+  header[8] = print->finger;
+  header[9] = flags;
+  write_le16 (header + 10, n_xyt);
+  write_le32 (header + 12, date);
+
+  return TRUE;
+
+too_large:
+  g_byte_array_set_size (buf, start);
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Print data does not fit into the packed format");
+  return FALSE;
+}
+
+/* Creates a view onto the packed record at @offset of @bytes, only the
+ * metadata is copied. */
+static FpPrint *
+fp_print_new_from_packed (GBytes  *bytes,
+                          gsize    offset,
+                          gsize   *record_size,
+                          GError **error)
+{
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GDate) date = NULL;
+  const gchar *strings[FPI_PRINT_PACKED_N_STRINGS] = { NULL, };
+  const guchar *data;
+  const guchar *record;
+  gsize length;
+  gsize size;
+  gsize pos;
+  gsize xyt_offset;
+  guint n_xyt;
+  FpiPrintXytEncoding encoding;
+  gint32 julian_date;
+  guint i;
+
+  data = g_bytes_get_data (bytes, &length);
+  if (offset > length || length - offset < FPI_PRINT_PACKED_HEADER_SIZE)
+    goto invalid_format;
+
+  record = data + offset;
+  if (memcmp (record, FPI_PRINT_PACKED_MAGIC, 3) != 0)
+    goto invalid_format;
+
+  if (record[3] == FPI_PRINT_PACKED_VERSION)
+    encoding = FPI_PRINT_XYT_INT16;
+  else if (record[3] == FPI_PRINT_PACKED_VERSION_DELTA)
+    encoding = FPI_PRINT_XYT_DELTA;
+  else
+    goto invalid_format;
+
+  size = read_le32 (record + 4);
+  if (size < FPI_PRINT_PACKED_HEADER_SIZE || size % 4 != 0 || size > length - offset)
+    goto invalid_format;
+
+  pos = FPI_PRINT_PACKED_HEADER_SIZE;
+  for (i = 0; i < FPI_PRINT_PACKED_N_STRINGS; i++)
+    if (!fp_print_check_string (record, size, read_le16 (record + 16 + 2 * i),
+                                &pos, &strings[i]))
+      goto invalid_format;
+  pos += pos % 2;
+
+  xyt_offset = pos;
+  n_xyt = read_le16 (record + 10);
+  if (!fp_print_check_xyt (record, size, n_xyt, encoding, &pos))
+    goto invalid_format;
+
+  result = g_object_new (FP_TYPE_PRINT,
+                         "driver", strings[0],
+                         "device-id", strings[1],
+                         "device-stored", (record[9] & FPI_PRINT_PACKED_DEVICE_STORED) != 0,
+                         NULL);
+  fpi_print_set_type (result, FPI_PRINT_NBIS);
+
+  result->packed = g_bytes_new_from_bytes (bytes, offset, size);
+  result->packed_n_xyt = n_xyt;
+  result->packed_xyt_offset = xyt_offset;
+  result->packed_encoding = encoding;
+
+  julian_date = (gint32) read_le32 (record + 12);
+  if (julian_date != G_MININT32)
+    date = g_date_new_julian (julian_date);
+
+  g_object_set (result,
+                "finger", record[8],
+                "username", strings[2],
+                "description", strings[3],
+                "enroll_date", date,
+                NULL);
+
+  if (record_size)
+    *record_size = size;
+
+  return g_steal_pointer (&result);
+
+invalid_format:
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Data could not be parsed");
+  return NULL;
+}
+
+/**
+ * fp_print_serialize_packed:
+ * @print: A #FpPrint
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
+ * @error: Return location for error
+ *
+ * Serialize a print into a compact, versioned binary format. Only prints
+ * that are matched on the host (i.e. not device stored ones with raw data)
+ * can be stored this way. The result can be loaded again using
+ * fp_print_deserialize().
+ *
+ * Returns: (type void): %TRUE on success
+ */
+gboolean
+fp_print_serialize_packed (FpPrint *print,
+                           guchar **data,
+                           gsize   *length,
+                           GError **error)
+{
+  g_return_val_if_fail (FP_IS_PRINT (print), FALSE);
+
+  return serialize_packed (print, FPI_PRINT_XYT_INT16, data, length, error);
+}
+
+static gboolean
+serialize_packed (FpPrint            *print,
+                  FpiPrintXytEncoding encoding,
+                  guchar            **data,
+                  gsize              *length,
+                  GError            **error)
+{
+  g_autoptr(GByteArray) buf = NULL;
+
+  g_assert (data);
+  g_assert (length);
+
+  buf = g_byte_array_new ();
+  if (!fp_print_pack (print, encoding, buf, error))
+    return FALSE;
+
+  *length = buf->len;
+  *data = g_byte_array_free (g_steal_pointer (&buf), FALSE);
+
+  return TRUE;
+}
+
+/**
+ * fp_print_deserialize_packed:
+ * @data: (array length=length): The binary data
+ * @length: Length of the data
+ * @error: Return location for error
+ *
+ * Deserialize a print stored with fp_print_serialize_packed(). Usually
+ * fp_print_deserialize() should be used, which handles both formats.
+ *
+ * Returns: (transfer full): A newly created #FpPrint on success
+ */
+FpPrint *
+fp_print_deserialize_packed (const guchar *data,
+                             gsize         length,
+                             GError      **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  FpPrint *result;
+  gsize size;
+
+  g_assert (data);
+
+  bytes = g_bytes_new (data, length);
+  result = fp_print_new_from_packed (bytes, 0, &size, error);
+  if (result && size != length)
+    {
+      g_clear_object (&result);
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "Data could not be parsed");
+    }
+
+  return result;
+}
+
+/**
+ * fp_print_save_gallery:
+ * @prints: (element-type FpPrint): The prints to store
+ * @path: The file to write
+ * @error: Return location for error
+ *
+ * Stores all @prints into a single gallery file using the format of
+ * fp_print_serialize_packed(). Use fp_print_load_gallery() to load it.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_save_gallery (GPtrArray   *prints,
+                       const gchar *path,
+                       GError     **error)
+{
+  return fp_print_save_gallery_full (prints, path, FP_GALLERY_SAVE_NONE, error);
+}
+
+/**
+ * fp_print_save_gallery_full:
+ * @prints: (element-type FpPrint): The prints to store
+ * @path: The file to write
+ * @flags: #FpGallerySaveFlags
+ * @error: Return location for error
+ *
+ * Like fp_print_save_gallery(), but with #FP_GALLERY_SAVE_WEBS the
+ * precomputed matching data is stored as well. Processes that load such
+ * a gallery match against it without computing or copying that data, and
+ * share its memory as they all map the same file. With
+ * #FP_GALLERY_SAVE_COMPRESSED the minutiae are stored delta encoded,
+ * which makes the file smaller.
+ *
+ * The file is replaced atomically, so a single writer can update a
+ * gallery that other processes use. Those keep matching against the
+ * previous contents until they load the file again.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_save_gallery_full (GPtrArray         *prints,
+                            const gchar       *path,
+                            FpGallerySaveFlags flags,
+                            GError           **error)
+{
+  g_autoptr(GByteArray) buf = NULL;
+  gboolean webs = (flags & FP_GALLERY_SAVE_WEBS) != 0;
+  FpiPrintXytEncoding encoding = FPI_PRINT_XYT_INT16;
+  guint i;
+
+  g_return_val_if_fail (prints != NULL, FALSE);
+  g_return_val_if_fail (path != NULL, FALSE);
+
+  if (flags & FP_GALLERY_SAVE_COMPRESSED)
+    encoding = FPI_PRINT_XYT_DELTA;
+
+  buf = g_byte_array_sized_new (FPI_GALLERY_HEADER_SIZE);
+  g_byte_array_set_size (buf, FPI_GALLERY_HEADER_SIZE);
+  memcpy (buf->data, FPI_GALLERY_MAGIC, 3);
+  buf->data[3] = webs ? FPI_GALLERY_VERSION_WEBS : FPI_GALLERY_VERSION;
+  write_le32 (buf->data + 4, prints->len);
+
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *print = g_ptr_array_index (prints, i);
+
+      if (!fp_print_pack (print, encoding, buf, error))
+        return FALSE;
+
+      if (webs)
+        fpi_print_pack_webs (print, buf);
+    }
+
+  return g_file_set_contents (path, (const gchar *) buf->data, buf->len, error);
+}
+
+/* Number of prints loaded between progress reports and cancellation checks */
+#define FPI_GALLERY_LOAD_CHUNK 256
+
+typedef void (*GalleryChunkFunc) (guint    n_loaded,
+                                  guint    n_total,
+                                  gpointer user_data);
+
+/* Maps a gallery file and checks its header */
+static GBytes *
+gallery_map (const gchar *path,
+             guint       *n_prints,
+             GError     **error)
+{
+  g_autoptr(GMappedFile) file = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  const guchar *data;
+  gsize length;
+
+  file = g_mapped_file_new (path, FALSE, error);
+  if (!file)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (file);
+  data = g_bytes_get_data (bytes, &length);
+
+  if (length < FPI_GALLERY_HEADER_SIZE ||
+      memcmp (data, FPI_GALLERY_MAGIC, 3) != 0 ||
+      (data[3] != FPI_GALLERY_VERSION && data[3] != FPI_GALLERY_VERSION_WEBS))
+    goto invalid_format;
+
+  *n_prints = read_le32 (data + 4);
+  /* Each record is at least one header large */
+  if (*n_prints > (length - FPI_GALLERY_HEADER_SIZE) / FPI_PRINT_PACKED_HEADER_SIZE)
+    goto invalid_format;
+
+  return g_steal_pointer (&bytes);
+
+invalid_format:
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Data could not be parsed");
+  return NULL;
+}
+
+/* Creates a view of the gallery record at @offset, including its Web
+ * record, and moves @offset to the next record */
+static FpPrint *
+gallery_read_print (GBytes  *bytes,
+                    gsize   *offset,
+                    GError **error)
+{
+  g_autoptr(FpPrint) print = NULL;
+  const guchar *data;
+  gsize length;
+  gsize size;
+
+  data = g_bytes_get_data (bytes, &length);
+
+  print = fp_print_new_from_packed (bytes, *offset, &size, error);
+  if (!print)
+    return NULL;
+
+  g_object_ref_sink (print);
+  *offset += size;
+
+  if (data[3] == FPI_GALLERY_VERSION_WEBS &&
+      length - *offset >= 3 &&
+      memcmp (data + *offset, FPI_PRINT_WEBS_MAGIC, 3) == 0)
+    {
+      if (!fpi_print_load_packed_webs (print, bytes, *offset, &size))
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                               "Data could not be parsed");
+          return NULL;
+        }
+      *offset += size;
+    }
+
+  return g_steal_pointer (&print);
+}
+
+static GPtrArray *
+load_gallery (const gchar     *path,
+              GCancellable    *cancellable,
+              GalleryChunkFunc chunk_func,
+              gpointer         chunk_data,
+              GError         **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GPtrArray) result = NULL;
+  gsize offset;
+  guint n_prints;
+  guint i;
+
+  bytes = gallery_map (path, &n_prints, error);
+  if (!bytes)
+    return NULL;
+
+  result = g_ptr_array_new_full (n_prints, g_object_unref);
+  offset = FPI_GALLERY_HEADER_SIZE;
+  for (i = 0; i < n_prints; i++)
+    {
+      FpPrint *print;
+
+      if (i % FPI_GALLERY_LOAD_CHUNK == 0 && i > 0)
+        {
+          if (g_cancellable_set_error_if_cancelled (cancellable, error))
+            return NULL;
+
+          if (chunk_func)
+            chunk_func (i, n_prints, chunk_data);
+        }
+
+      print = gallery_read_print (bytes, &offset, error);
+      if (!print)
+        return NULL;
+
+      g_ptr_array_add (result, print);
+    }
+
+  if (chunk_func)
+    chunk_func (n_prints, n_prints, chunk_data);
+
+  return g_steal_pointer (&result);
+}
+
+/**
+ * fp_print_load_gallery:
+ * @path: The gallery file to load
+ * @error: Return location for error
+ *
+ * Loads a gallery file written by fp_print_save_gallery(). The file is
+ * mapped into memory and the returned prints only hold a reference to it
+ * rather than a copy of their minutiae data, so even large galleries load
+ * quickly. The file must not be modified while it is loaded.
+ *
+ * Returns: (element-type FpPrint) (transfer container): The prints stored in the gallery
+ */
+GPtrArray *
+fp_print_load_gallery (const gchar *path,
+                       GError     **error)
+{
+  g_return_val_if_fail (path != NULL, NULL);
+
+  return load_gallery (path, NULL, NULL, NULL, error);
+}
+
+typedef struct
+{
+  gchar                *path;
+  FpGalleryLoadProgress progress_cb;
+  gpointer              progress_data;
+  GDestroyNotify        progress_destroy;
+} FpGalleryLoadData;
+
+static void
+gallery_load_data_free (FpGalleryLoadData *data)
+{
+  if (data->progress_destroy)
+    data->progress_destroy (data->progress_data);
+  g_free (data->path);
+  g_free (data);
+}
+
+typedef struct
+{
+  GTask *task;
+  guint  n_loaded;
+  guint  n_total;
+} FpGalleryLoadProgressReport;
+
+static gboolean
+gallery_load_progress_cb (gpointer user_data)
+{
+  FpGalleryLoadProgressReport *report = user_data;
+  FpGalleryLoadData *data = g_task_get_task_data (report->task);
+
+  if (!g_task_get_completed (report->task))
+    data->progress_cb (report->n_loaded, report->n_total, data->progress_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+gallery_load_progress_report_free (FpGalleryLoadProgressReport *report)
+{
+  g_object_unref (report->task);
+  g_free (report);
+}
+
+static void
+gallery_load_chunk_cb (guint n_loaded, guint n_total, gpointer user_data)
+{
+  GTask *task = user_data;
+  FpGalleryLoadProgressReport *report;
+
+  report = g_new0 (FpGalleryLoadProgressReport, 1);
+  report->task = g_object_ref (task);
+  report->n_loaded = n_loaded;
+  report->n_total = n_total;
+
+  /* A higher priority than the task result, so progress is reported first */
+  g_main_context_invoke_full (g_task_get_context (task),
+                              G_PRIORITY_HIGH,
+                              gallery_load_progress_cb,
+                              report,
+                              (GDestroyNotify) gallery_load_progress_report_free);
+}
+
+static void
+gallery_load_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  FpGalleryLoadData *data = task_data;
+  GError *error = NULL;
+  GPtrArray *result;
+
+  result = load_gallery (data->path, cancellable,
+                         data->progress_cb ? gallery_load_chunk_cb : NULL,
+                         task, &error);
+  if (!result)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, result, (GDestroyNotify) g_ptr_array_unref);
+}
+
+/**
+ * fp_print_load_gallery_async:
+ * @path: The gallery file to load
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @progress_cb: (nullable) (scope notified): Called while the gallery is loading
+ * @progress_data: (closure progress_cb): user data for @progress_cb
+ * @progress_destroy: (destroy progress_data): Destroy notify for @progress_data
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Loads a gallery file like fp_print_load_gallery(), but parses it in a
+ * worker thread so that the main loop keeps running. Large galleries are
+ * loaded in chunks; @progress_cb is called in the thread-default main
+ * context after each of them, and cancellation is checked in between.
+ */
+void
+fp_print_load_gallery_async (const gchar          *path,
+                             GCancellable         *cancellable,
+                             FpGalleryLoadProgress progress_cb,
+                             gpointer              progress_data,
+                             GDestroyNotify        progress_destroy,
+                             GAsyncReadyCallback   callback,
+                             gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  FpGalleryLoadData *data;
+
+  g_return_if_fail (path != NULL);
+
+  data = g_new0 (FpGalleryLoadData, 1);
+  data->path = g_strdup (path);
+  data->progress_cb = progress_cb;
+  data->progress_data = progress_data;
+  data->progress_destroy = progress_destroy;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, fp_print_load_gallery_async);
+  g_task_set_task_data (task, data, (GDestroyNotify) gallery_load_data_free);
+  g_task_run_in_thread (task, gallery_load_thread);
+}
+
+/**
+ * fp_print_load_gallery_finish:
+ * @result: A #GAsyncResult
+ * @error: Return location for error
+ *
+ * Finish an asynchronous gallery load started with
+ * fp_print_load_gallery_async().
+ *
+ * Returns: (element-type FpPrint) (transfer container): The prints stored in the gallery
+ */
+GPtrArray *
+fp_print_load_gallery_finish (GAsyncResult *result,
+                              GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/* Bytes of gallery records that fp_print_identify_gallery_file() keeps
+ * resident at once */
+#define FPI_GALLERY_STREAM_BLOCK_SIZE (1024 * 1024)
+
+typedef struct
+{
+  gsize offset;
+  guint index;
+  gint  score;
+} GalleryStreamResult;
+
+static gint
+gallery_stream_result_compare (gconstpointer a, gconstpointer b)
+{
+  const GalleryStreamResult *ra = a;
+  const GalleryStreamResult *rb = b;
+
+  if (ra->score != rb->score)
+    return rb->score - ra->score;
+
+  return (ra->index > rb->index) - (ra->index < rb->index);
+}
+
+/* Gives the kernel a hint about the pages from @start to @end of the
+ * mapped gallery @data. Pages that are released are only those entirely
+ * within the range, prefetching covers all pages it touches. */
+static void
+gallery_advise (const guchar *data,
+                gsize         start,
+                gsize         end,
+                gint          advice)
+{
+#ifdef MADV_SEQUENTIAL
+  gsize page_size = sysconf (_SC_PAGESIZE);
+
+  if (advice == MADV_DONTNEED)
+    {
+      start = (start + page_size - 1) / page_size * page_size;
+      end = end / page_size * page_size;
+    }
+  else
+    {
+      start = start / page_size * page_size;
+      end = (end + page_size - 1) / page_size * page_size;
+    }
+
+  if (end > start)
+    madvise ((gpointer) (data + start), end - start, advice);
+#endif
+}
+
+/**
+ * fp_print_identify_prints:
+ * @print: A newly scanned #FpPrint, e.g. as reported by fp_device_identify()
+ * @templates: (element-type FpPrint): The prints to search
+ * @max_results: The number of best scoring prints to return, at least 1
+ * @scores: (out) (transfer full) (element-type gint) (optional): Return
+ *   location for the score of each returned print
+ * @error: Return location for error
+ *
+ * Matches @print against all @templates and returns the @max_results best
+ * scoring ones, best first and in the order of @templates for equal scores.
+ * The scores do not depend on the other templates, so the results for
+ * parts of a gallery, e.g. searched on different hosts, can be merged by
+ * score.
+ *
+ * This blocks until all templates were matched, the matching itself is
+ * spread over the worker threads.
+ *
+ * Returns: (transfer container) (element-type FpPrint) (nullable): The
+ *   best scoring prints, or %NULL on error
+ */
+GPtrArray *
+fp_print_identify_prints (FpPrint   *print,
+                          GPtrArray *templates,
+                          guint      max_results,
+                          GArray   **scores,
+                          GError   **error)
+{
+  g_autoptr(GArray) best = NULL;
+  g_autoptr(GPtrArray) result = NULL;
+  guint i;
+
+  g_return_val_if_fail (FP_IS_PRINT (print), NULL);
+  g_return_val_if_fail (templates != NULL, NULL);
+  g_return_val_if_fail (max_results > 0, NULL);
+
+  best = fpi_print_bz3_identify_scores (templates, print, max_results, error);
+  if (!best)
+    return NULL;
+
+  result = g_ptr_array_new_full (best->len, g_object_unref);
+  if (scores)
+    *scores = g_array_sized_new (FALSE, FALSE, sizeof (gint), best->len);
+
+  for (i = 0; i < best->len; i++)
+    {
+      FpiBz3Score *score = &g_array_index (best, FpiBz3Score, i);
+
+      g_ptr_array_add (result, g_object_ref (score->template));
+      if (scores)
+        g_array_append_val (*scores, score->score);
+    }
+
+  return g_steal_pointer (&result);
+}
+
+/**
+ * fp_print_identify_gallery_file:
+ * @print: A newly scanned #FpPrint, e.g. as reported by fp_device_identify()
+ * @path: A gallery file written by fp_print_save_gallery()
+ * @max_results: The number of best scoring prints to return, at least 1
+ * @scores: (out) (transfer full) (element-type gint) (optional): Return
+ *   location for the score of each returned print
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @error: Return location for error
+ *
+ * Matches @print against every print in the gallery file at @path and
+ * returns the @max_results best scoring ones, best first and in gallery
+ * order for equal scores. Unlike fp_print_load_gallery(), the gallery is
+ * not loaded as a whole: it is streamed in blocks of about 1 MiB, which
+ * are matched on the worker threads while the next block is read ahead.
+ * Blocks that were matched are dropped from memory again, so the memory
+ * used stays the same no matter how large the gallery is.
+ *
+ * This blocks until the whole gallery was searched, call it from a thread
+ * for large galleries. Galleries saved with #FP_GALLERY_SAVE_WEBS are
+ * searched a lot faster.
+ *
+ * Returns: (transfer container) (element-type FpPrint) (nullable): The
+ *   best scoring prints, or %NULL on error
+ */
+GPtrArray *
+fp_print_identify_gallery_file (FpPrint      *print,
+                                const gchar  *path,
+                                guint         max_results,
+                                GArray      **scores,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(FpiBz3Probe) probe = NULL;
+  g_autoptr(GArray) best = NULL;
+  g_autoptr(GArray) offsets = NULL;
+  g_autoptr(GPtrArray) block = NULL;
+  g_autoptr(GPtrArray) result = NULL;
+  const guchar *data;
+  gsize block_start;
+  gsize offset;
+  gsize released;
+  guint n_prints;
+  guint i;
+
+  g_return_val_if_fail (FP_IS_PRINT (print), NULL);
+  g_return_val_if_fail (path != NULL, NULL);
+  g_return_val_if_fail (max_results > 0, NULL);
+
+  probe = fpi_print_bz3_probe_new (print, error);
+  if (!probe)
+    return NULL;
+
+  bytes = gallery_map (path, &n_prints, error);
+  if (!bytes)
+    return NULL;
+
+  data = g_bytes_get_data (bytes, NULL);
+#ifdef MADV_SEQUENTIAL
+  gallery_advise (data, 0, g_bytes_get_size (bytes), MADV_SEQUENTIAL);
+#endif
+
+  best = g_array_sized_new (FALSE, FALSE, sizeof (GalleryStreamResult), max_results * 2);
+  offsets = g_array_new (FALSE, FALSE, sizeof (gsize));
+  block = g_ptr_array_new_with_free_func (g_object_unref);
+
+  offset = FPI_GALLERY_HEADER_SIZE;
+  released = 0;
+  i = 0;
+  while (i < n_prints)
+    {
+      g_autoptr(GArray) block_scores = NULL;
+      guint block_index = i;
+      guint j;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return NULL;
+
+      block_start = offset;
+      g_ptr_array_set_size (block, 0);
+      g_array_set_size (offsets, 0);
+      while (i < n_prints && offset - block_start < FPI_GALLERY_STREAM_BLOCK_SIZE)
+        {
+          FpPrint *template;
+
+          g_array_append_val (offsets, offset);
+          template = gallery_read_print (bytes, &offset, error);
+          if (!template)
+            return NULL;
+
+          g_ptr_array_add (block, template);
+          i++;
+        }
+
+#ifdef MADV_WILLNEED
+      /* Read the next block while this one is matched */
+      gallery_advise (data, offset, offset + FPI_GALLERY_STREAM_BLOCK_SIZE, MADV_WILLNEED);
+#endif
+
+      block_scores = fpi_print_bz3_probe_identify_scores (probe, block, max_results, error);
+      if (!block_scores)
+        return NULL;
+
+      for (j = 0; j < block_scores->len; j++)
+        {
+          FpiBz3Score *score = &g_array_index (block_scores, FpiBz3Score, j);
+          GalleryStreamResult entry;
+          gboolean found;
+          guint idx;
+
+          found = g_ptr_array_find (block, score->template, &idx);
+          g_assert (found);
+          entry.offset = g_array_index (offsets, gsize, idx);
+          entry.index = block_index + idx;
+          entry.score = score->score;
+          g_array_append_val (best, entry);
+        }
+
+      /* Only the running top results are kept */
+      g_array_sort (best, gallery_stream_result_compare);
+      if (best->len > max_results)
+        g_array_set_size (best, max_results);
+
+      g_ptr_array_set_size (block, 0);
+#ifdef MADV_DONTNEED
+      gallery_advise (data, released, offset, MADV_DONTNEED);
+#endif
+      released = offset;
+    }
+
+  fp_dbg ("Streamed %u prints from %s, best score %d", n_prints, path,
+          best->len > 0 ? g_array_index (best, GalleryStreamResult, 0).score : -1);
+
+  result = g_ptr_array_new_full (best->len, g_object_unref);
+  if (scores)
+    *scores = g_array_sized_new (FALSE, FALSE, sizeof (gint), best->len);
+
+  for (i = 0; i < best->len; i++)
+    {
+      GalleryStreamResult *entry = &g_array_index (best, GalleryStreamResult, i);
+      FpPrint *template;
+
+      offset = entry->offset;
+      template = gallery_read_print (bytes, &offset, error);
+      if (!template)
+        {
+          if (scores)
+            g_clear_pointer (scores, g_array_unref);
+          return NULL;
+        }
+
+      g_ptr_array_add (result, template);
+      if (scores)
+        g_array_append_val (*scores, entry->score);
+    }
+
+  return g_steal_pointer (&result);
+}
+
+/*
+ * Print container format
+ *
+ * Stores N prints of any type with one header. Driver and device-id are
+ * kept in a shared string table, as they are usually the same for all
+ * prints. All values are little endian:
+ *
+ *  0  "FPM"
+ *  3  guint8  version
+ *  4  guint32 number of prints
+ *  8  guint32 number of strings in the table
+ * 12  guint32 size of the string table, padded to 4 bytes
+ * 16  string table, NUL terminated strings
+ *
+ * Followed by one record per print:
+ *
+ *  0  guint32 size of the record, padded to 4 bytes
+ *  4  guint8  type (FpiPrintType)
+ *  5  guint8  finger
+ *  6  guint8  flags (FPI_PRINT_PACKED_DEVICE_STORED)
+ *  7  guint8  reserved
+ *  8  guint32 string table index of driver and device-id (G_MAXUINT32 for %NULL)
+ * 16  gint32  enroll date as julian day, G_MININT32 if unset
+ * 20  guint16 string lengths of username and description (G_MAXUINT16 for %NULL)
+ * 24  the strings, each NUL terminated, padded to 2 bytes
+ *     NBIS: guint16 number of prints, followed by the packed minutiae
+ *     RAW:  padding to 4 bytes, guint32 length and the "v" GVariant data
+ */
+#define FPI_PRINT_MANY_MAGIC "FPM"
+#define FPI_PRINT_MANY_VERSION 1
+#define FPI_PRINT_MANY_HEADER_SIZE 16
+#define FPI_PRINT_MANY_RECORD_HEADER_SIZE 24
+#define FPI_PRINT_MANY_NO_STRING G_MAXUINT32
+
+static guint32
+string_table_add (GHashTable *table,
+                  GPtrArray  *strings,
+                  const char *str)
+{
+  gpointer idx;
+
+  if (!str)
+    return FPI_PRINT_MANY_NO_STRING;
+
+  if (g_hash_table_lookup_extended (table, str, NULL, &idx))
+    return GPOINTER_TO_UINT (idx);
+
+  g_ptr_array_add (strings, (gpointer) str);
+  g_hash_table_insert (table, (gpointer) str, GUINT_TO_POINTER (strings->len - 1));
+
+  return strings->len - 1;
+}
+
+static gboolean
+fp_print_pack_many_record (FpPrint    *print,
+                           GByteArray *buf,
+                           guint32     driver_idx,
+                           guint32     device_id_idx,
+                           GError    **error)
+{
+  guint start = buf->len;
+  guchar *header;
+  guint8 flags = 0;
+  gint32 date = G_MININT32;
+
+  g_byte_array_set_size (buf, start + FPI_PRINT_MANY_RECORD_HEADER_SIZE);
+
+  if (!fp_print_pack_string (buf, start + 20, print->username) ||
+      !fp_print_pack_string (buf, start + 22, print->description))
+    goto too_large;
+
+  pad_byte_array (buf, 2);
+
+  if (print->type == FPI_PRINT_NBIS)
+    {
+      guint n_xyt = fpi_print_get_n_xyt (print);
+      guint offset = buf->len;
+
+      if (n_xyt > G_MAXUINT16)
+        goto too_large;
+
+      g_byte_array_set_size (buf, offset + 2);
+      write_le16 (buf->data + offset, n_xyt);
+
+      if (!fp_print_pack_xyt (print, FPI_PRINT_XYT_INT16, buf))
+        goto too_large;
+    }
+  else if (print->type == FPI_PRINT_RAW)
+    {
+      g_autoptr(GVariant) value = NULL;
+      guint offset;
+      gsize len;
+
+      value = g_variant_ref_sink (g_variant_new_variant (print->data));
+      if (G_BYTE_ORDER == G_BIG_ENDIAN)
+        {
+          GVariant *tmp = g_variant_byteswap (value);
+          g_variant_unref (value);
+          value = tmp;
+        }
+
+      len = g_variant_get_size (value);
+      if (len > G_MAXUINT32)
+        goto too_large;
+
+      pad_byte_array (buf, 4);
+      offset = buf->len;
+      g_byte_array_set_size (buf, offset + 4 + len);
+      write_le32 (buf->data + offset, len);
+      g_variant_store (value, buf->data + offset + 4);
+    }
+  else
+    {
+      g_byte_array_set_size (buf, start);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Cannot serialize print of type %d", print->type);
+      return FALSE;
+    }
+
+  pad_byte_array (buf, 4);
+
+  if (print->device_stored)
+    flags |= FPI_PRINT_PACKED_DEVICE_STORED;
+
+  if (print->enroll_date && g_date_valid (print->enroll_date))
+    date = g_date_get_julian (print->enroll_date);
+
+  header = buf->data + start;
+  write_le32 (header, buf->len - start);
+  header[4] = print->type;
+  header[5] = print->finger;
+  header[6] = flags;
+  header[7] = 0;
+  write_le32 (header + 8, driver_idx);
+  write_le32 (header + 12, device_id_idx);
+  write_le32 (header + 16, date);
+
+  return TRUE;
+
+too_large:
+  g_byte_array_set_size (buf, start);
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Print data does not fit into the container format");
+  return FALSE;
+}
+
+/**
+ * fp_print_serialize_many:
+ * @prints: (element-type FpPrint): The prints to serialize
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
+ * @error: Return location for error
+ *
+ * Serialize multiple prints into one container. This is considerably
+ * smaller and faster to load than serializing each print on its own,
+ * if many prints need to be stored. Use fp_print_deserialize_many() to
+ * load the data again.
+ *
+ * Returns: (type void): %TRUE on success
+ */
+gboolean
+fp_print_serialize_many (GPtrArray *prints,
+                         guchar   **data,
+                         gsize     *length,
+                         GError   **error)
+{
+  g_autoptr(GHashTable) table = NULL;
+  g_autoptr(GPtrArray) strings = NULL;
+  g_autoptr(GByteArray) buf = NULL;
+  g_autofree guint32 *indices = NULL;
+  guint i;
+
+  g_return_val_if_fail (prints != NULL, FALSE);
+  g_assert (data);
+  g_assert (length);
+
+  /* Build the string table first, so that it can be put in front */
+  table = g_hash_table_new (g_str_hash, g_str_equal);
+  strings = g_ptr_array_new ();
+  indices = g_new (guint32, 2 * prints->len);
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *print = g_ptr_array_index (prints, i);
+
+      indices[2 * i] = string_table_add (table, strings, print->driver);
+      indices[2 * i + 1] = string_table_add (table, strings, print->device_id);
+    }
+
+  buf = g_byte_array_new ();
+  g_byte_array_set_size (buf, FPI_PRINT_MANY_HEADER_SIZE);
+  for (i = 0; i < strings->len; i++)
+    {
+      const gchar *str = g_ptr_array_index (strings, i);
+
+      g_byte_array_append (buf, (const guint8 *) str, strlen (str) + 1);
+    }
+  pad_byte_array (buf, 4);
+
+  memcpy (buf->data, FPI_PRINT_MANY_MAGIC, 3);
+  buf->data[3] = FPI_PRINT_MANY_VERSION;
+  write_le32 (buf->data + 4, prints->len);
+  write_le32 (buf->data + 8, strings->len);
+  write_le32 (buf->data + 12, buf->len - FPI_PRINT_MANY_HEADER_SIZE);
+
+  for (i = 0; i < prints->len; i++)
+    if (!fp_print_pack_many_record (g_ptr_array_index (prints, i), buf,
+                                    indices[2 * i], indices[2 * i + 1], error))
+      return FALSE;
+
+  *length = buf->len;
+  *data = g_byte_array_free (g_steal_pointer (&buf), FALSE);
+
+  return TRUE;
+}
+
+static FpPrint *
+fp_print_new_from_many_record (GBytes       *bytes,
+                               gsize         offset,
+                               const gchar **strings,
+                               guint         n_strings,
+                               gsize        *record_size)
+{
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GDate) date = NULL;
+  const gchar *username, *description;
+  const gchar *driver = NULL, *device_id = NULL;
+  const guchar *data;
+  const guchar *record;
+  gsize length;
+  gsize size;
+  gsize pos;
+  guint32 driver_idx, device_id_idx;
+  gint32 julian_date;
+  FpiPrintType type;
+  gboolean device_stored;
+
+  data = g_bytes_get_data (bytes, &length);
+  if (length - offset < FPI_PRINT_MANY_RECORD_HEADER_SIZE)
+    return NULL;
+
+  record = data + offset;
+  size = read_le32 (record);
+  if (size < FPI_PRINT_MANY_RECORD_HEADER_SIZE || size % 4 != 0 || size > length - offset)
+    return NULL;
+
+  type = record[4];
+  device_stored = (record[6] & FPI_PRINT_PACKED_DEVICE_STORED) != 0;
+  driver_idx = read_le32 (record + 8);
+  device_id_idx = read_le32 (record + 12);
+  if (driver_idx != FPI_PRINT_MANY_NO_STRING)
+    {
+      if (driver_idx >= n_strings)
+        return NULL;
+      driver = strings[driver_idx];
+    }
+  if (device_id_idx != FPI_PRINT_MANY_NO_STRING)
+    {
+      if (device_id_idx >= n_strings)
+        return NULL;
+      device_id = strings[device_id_idx];
+    }
+
+  pos = FPI_PRINT_MANY_RECORD_HEADER_SIZE;
+  if (!fp_print_check_string (record, size, read_le16 (record + 20), &pos, &username) ||
+      !fp_print_check_string (record, size, read_le16 (record + 22), &pos, &description))
+    return NULL;
+  pos += pos % 2;
+
+  if (type == FPI_PRINT_NBIS)
+    {
+      gsize xyt_offset;
+      guint n_xyt;
+
+      if (size - pos < 2)
+        return NULL;
+
+      n_xyt = read_le16 (record + pos);
+      pos += 2;
+      xyt_offset = pos;
+      if (!fp_print_check_xyt (record, size, n_xyt, FPI_PRINT_XYT_INT16, &pos))
+        return NULL;
+
+      result = g_object_new (FP_TYPE_PRINT,
+                             "driver", driver,
+                             "device-id", device_id,
+                             "device-stored", device_stored,
+                             NULL);
+      fpi_print_set_type (result, FPI_PRINT_NBIS);
+
+      result->packed = g_bytes_new_from_bytes (bytes, offset, size);
+      result->packed_n_xyt = n_xyt;
+      result->packed_xyt_offset = xyt_offset;
+    }
+  else if (type == FPI_PRINT_RAW)
+    {
+      g_autoptr(GVariant) raw_value = NULL;
+      g_autoptr(GVariant) value = NULL;
+      g_autoptr(GVariant) fp_data = NULL;
+      guchar *aligned_data;
+      gsize len;
+
+      pos += (4 - pos % 4) % 4;
+      if (size - pos < 4)
+        return NULL;
+
+      len = read_le32 (record + pos);
+      pos += 4;
+      if (size - pos < len)
+        return NULL;
+
+      /* Copy for alignment, RAW prints are not expected to be common */
+      aligned_data = g_memdup (record + pos, len);
+      raw_value = g_variant_new_from_data (G_VARIANT_TYPE_VARIANT,
+                                           aligned_data, len,
+                                           FALSE, g_free, aligned_data);
+
+      if (G_BYTE_ORDER == G_BIG_ENDIAN)
+        value = g_variant_byteswap (raw_value);
+      else
+        value = g_variant_get_normal_form (raw_value);
+
+      fp_data = g_variant_get_variant (value);
+
+      result = g_object_new (FP_TYPE_PRINT,
+                             "fpi-type", type,
+                             "driver", driver,
+                             "device-id", device_id,
+                             "device-stored", device_stored,
+                             "fpi-data", fp_data,
+                             NULL);
+    }
+  else
+    {
+      g_warning ("Invalid print type: 0x%X", type);
+      return NULL;
+    }
+
+  julian_date = (gint32) read_le32 (record + 16);
+  if (julian_date != G_MININT32)
+    date = g_date_new_julian (julian_date);
+
+  g_object_set (result,
+                "finger", record[5],
+                "username", username,
+                "description", description,
+                "enroll_date", date,
+                NULL);
+
+  *record_size = size;
+
+  return g_steal_pointer (&result);
+}
+
+/**
+ * fp_print_deserialize_many:
+ * @data: (array length=length): The binary data
+ * @length: Length of the data
+ * @error: Return location for error
+ *
+ * Deserialize a container written by fp_print_serialize_many(). The data
+ * is copied once and shared by all returned prints.
+ *
+ * Returns: (element-type FpPrint) (transfer container): The deserialized prints
+ */
+GPtrArray *
+fp_print_deserialize_many (const guchar *data,
+                           gsize         length,
+                           GError      **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GPtrArray) result = NULL;
+  g_autofree const gchar **strings = NULL;
+  const guchar *table;
+  const guchar *table_end;
+  guint n_prints;
+  guint n_strings;
+  gsize table_size;
+  gsize offset;
+  guint i;
+
+  g_assert (data);
+
+  if (length < FPI_PRINT_MANY_HEADER_SIZE ||
+      memcmp (data, FPI_PRINT_MANY_MAGIC, 3) != 0 ||
+      data[3] != FPI_PRINT_MANY_VERSION)
+    goto invalid_format;
+
+  bytes = g_bytes_new (data, length);
+  data = g_bytes_get_data (bytes, NULL);
+
+  n_prints = read_le32 (data + 4);
+  n_strings = read_le32 (data + 8);
+  table_size = read_le32 (data + 12);
+  if (table_size % 4 != 0 || table_size > length - FPI_PRINT_MANY_HEADER_SIZE ||
+      n_strings > table_size)
+    goto invalid_format;
+
+  /* Each record is at least one record header large */
+  offset = FPI_PRINT_MANY_HEADER_SIZE + table_size;
+  if (n_prints > (length - offset) / FPI_PRINT_MANY_RECORD_HEADER_SIZE)
+    goto invalid_format;
+
+  table = data + FPI_PRINT_MANY_HEADER_SIZE;
+  table_end = table + table_size;
+  strings = g_new (const gchar *, n_strings);
+  for (i = 0; i < n_strings; i++)
+    {
+      const guchar *end = memchr (table, '\0', table_end - table);
+
+      if (!end)
+        goto invalid_format;
+
+      strings[i] = (const gchar *) table;
+      table = end + 1;
+    }
+
+  result = g_ptr_array_new_full (n_prints, g_object_unref);
+  for (i = 0; i < n_prints; i++)
+    {
+      FpPrint *print;
+      gsize size;
+
+      print = fp_print_new_from_many_record (bytes, offset, strings, n_strings, &size);
+      if (!print)
+        goto invalid_format;
+
+      g_ptr_array_add (result, g_object_ref_sink (print));
+      offset += size;
+    }
+
+  return g_steal_pointer (&result);
+
+invalid_format:
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Data could not be parsed");
+  return NULL;
+}
@@ -66,6 +66,54 @@ typedef enum {
   FP_FINGER_LAST = FP_FINGER_RIGHT_LITTLE,
 } FpFinger;
 
+/**
+ * FpGallerySaveFlags:
+ * @FP_GALLERY_SAVE_NONE: Only store the prints
+ * @FP_GALLERY_SAVE_WEBS: Also store the precomputed matching data, which
+ *   makes the file several times larger
+ * @FP_GALLERY_SAVE_COMPRESSED: Store the minutiae delta encoded, which
+ *   makes the file smaller. Older versions of libfprint cannot load such
+ *   galleries.
+ *
+ * Flags for fp_print_save_gallery_full().
+ */
+typedef enum {
+  FP_GALLERY_SAVE_NONE = 0,
+  FP_GALLERY_SAVE_WEBS = 1 << 0,
+  FP_GALLERY_SAVE_COMPRESSED = 1 << 1,
+} FpGallerySaveFlags;
+
+/**
+ * FpPrintSerializeFlags:
+ * @FP_PRINT_SERIALIZE_NONE: Only store the print
+ * @FP_PRINT_SERIALIZE_WEBS: Also store the precomputed matching data,
+ *   which makes the data several times larger
+ * @FP_PRINT_SERIALIZE_COMPRESSED: Store NBIS prints in the packed format
+ *   of fp_print_serialize_packed() with delta encoded minutiae, which is
+ *   several times smaller. The matching data of #FP_PRINT_SERIALIZE_WEBS
+ *   is not stored then. Older versions of libfprint cannot load such data,
+ *   and prints of other types are serialized as without this flag.
+ *
+ * Flags for fp_print_serialize_full().
+ */
+typedef enum {
+  FP_PRINT_SERIALIZE_NONE = 0,
+  FP_PRINT_SERIALIZE_WEBS = 1 << 0,
+  FP_PRINT_SERIALIZE_COMPRESSED = 1 << 1,
+} FpPrintSerializeFlags;
+
+/**
+ * FpGalleryLoadProgress:
+ * @n_loaded: Number of prints loaded so far
+ * @n_total: Number of prints in the gallery
+ * @user_data: (nullable) (transfer none): User provided data
+ *
+ * Reports the progress of fp_print_load_gallery_async().
+ */
+typedef void (*FpGalleryLoadProgress) (guint    n_loaded,
+                                       guint    n_total,
+                                       gpointer user_data);
+
 FpPrint *fp_print_new (FpDevice *device);
 
 FpPrint *fp_print_new_from_data (guchar *data,
@@ -97,13 +145,75 @@ gboolean fp_print_compatible (FpPrint  *self,
 gboolean fp_print_equal (FpPrint *self,
                          FpPrint *other);
 
+const gchar *fp_print_get_digest (FpPrint *print);
+
 gboolean fp_print_serialize (FpPrint *print,
                              guchar **data,
                              gsize   *length,
                              GError **error);
 
+gboolean fp_print_serialize_full (FpPrint               *print,
+                                  FpPrintSerializeFlags  flags,
+                                  guchar               **data,
+                                  gsize                 *length,
+                                  GError               **error);
+
 FpPrint *fp_print_deserialize (const guchar *data,
                                gsize         length,
                                GError      **error);
 
+gboolean fp_print_serialize_packed (FpPrint *print,
+                                    guchar **data,
+                                    gsize   *length,
+                                    GError **error);
+
+FpPrint *fp_print_deserialize_packed (const guchar *data,
+                                      gsize         length,
+                                      GError      **error);
+
+gboolean fp_print_save_gallery (GPtrArray   *prints,
+                                const gchar *path,
+                                GError     **error);
+
+gboolean fp_print_save_gallery_full (GPtrArray         *prints,
+                                     const gchar       *path,
+                                     FpGallerySaveFlags flags,
+                                     GError           **error);
+
+GPtrArray *fp_print_load_gallery (const gchar *path,
+                                  GError     **error);
+
+void fp_print_load_gallery_async (const gchar          *path,
+                                  GCancellable         *cancellable,
+                                  FpGalleryLoadProgress progress_cb,
+                                  gpointer              progress_data,
+                                  GDestroyNotify        progress_destroy,
+                                  GAsyncReadyCallback   callback,
+                                  gpointer              user_data);
+
+GPtrArray *fp_print_load_gallery_finish (GAsyncResult *result,
+                                         GError      **error);
+
+GPtrArray *fp_print_identify_prints (FpPrint   *print,
+                                     GPtrArray *templates,
+                                     guint      max_results,
+                                     GArray   **scores,
+                                     GError   **error);
+
+GPtrArray *fp_print_identify_gallery_file (FpPrint      *print,
+                                           const gchar  *path,
+                                           guint         max_results,
+                                           GArray      **scores,
+                                           GCancellable *cancellable,
+                                           GError      **error);
+
+gboolean fp_print_serialize_many (GPtrArray *prints,
+                                  guchar   **data,
+                                  gsize     *length,
+                                  GError   **error);
+
+GPtrArray *fp_print_deserialize_many (const guchar *data,
+                                      gsize         length,
+                                      GError      **error);
+
 G_END_DECLS
@@ -44,6 +44,11 @@ struct fpi_frame
  * @frame_height: height of the frame
  * @image_width: resulting image width
  * @get_pixel: pixel accessor, returns pixel brightness at x,y of frame
+ * @get_row: optional row accessor, returns a pointer to the @frame_width
+ *           8-bit pixels of row y of frame
+ * @hierarchical_search: search the overlap of frames coarse-to-fine
+ * @duplicate_threshold: mean squared pixel difference below which a frame
+ *   is taken to be a duplicate of the previous one, 0 to keep all frames
  *
  * #fpi_frame_asmbl_ctx is a structure holding the context for frame
  * assembling routines.
@@ -51,6 +56,26 @@ struct fpi_frame
  * Drivers should define their own #fpi_frame_asmbl_ctx depending on
  * hardware parameters of scanner. @image_width is usually 25% wider than
  * @frame_width to take horizontal movement into account.
+ *
+ * Drivers whose frames are stored as rows of 8-bit pixels should also set
+ * @get_row. Movement estimation then compares whole rows at once, and
+ * assembling copies them, which is considerably faster than going through
+ * @get_pixel for every pixel.
+ *
+ * If @hierarchical_search is set, movement estimation doesn't try every
+ * possible offset between two frames. Instead it looks for the best offset
+ * on subsampled frames, and refines it and the offset found for the previous
+ * pair of frames at full resolution. This is much faster, but may pick a
+ * worse offset for frames with very little structure.
+ *
+ * Sensors keep sending the same frame while the finger rests during a
+ * swipe. With @duplicate_threshold set, such frames are compared to the
+ * previous one on a subsampled grid first and are not part of the
+ * movement estimation; they are assembled at the position of the
+ * previous frame.
+ *
+ * Movement estimation runs on multiple threads, so @get_pixel and @get_row
+ * must not modify any shared state.
  */
 struct fpi_frame_asmbl_ctx
 {
@@ -61,6 +86,11 @@ struct fpi_frame_asmbl_ctx
                              struct fpi_frame           *frame,
                              unsigned int                x,
                              unsigned int                y);
+  const unsigned char * (*get_row)(struct fpi_frame_asmbl_ctx *ctx,
+                                   struct fpi_frame           *frame,
+                                   unsigned int                y);
+  gboolean      hierarchical_search;
+  unsigned int  duplicate_threshold;
 };
 
 void fpi_do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
@@ -69,6 +99,52 @@ void fpi_do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
 FpImage *fpi_assemble_frames (struct fpi_frame_asmbl_ctx *ctx,
                               GSList                     *stripes);
 
+/**
+ * fpi_frame_ring:
+ *
+ * #fpi_frame_ring is an opaque container of frames of
+ * @frame_width * @frame_height bytes, stored back to back in a single
+ * allocation. See fpi_frame_ring_new().
+ */
+struct fpi_frame_ring;
+
+struct fpi_frame_ring *fpi_frame_ring_new (struct fpi_frame_asmbl_ctx *ctx,
+                                           guint                       max_frames);
+
+struct fpi_frame *fpi_frame_ring_push (struct fpi_frame_ring *ring);
+
+guint fpi_frame_ring_get_length (struct fpi_frame_ring *ring);
+
+struct fpi_frame *fpi_frame_ring_get_frame (struct fpi_frame_ring *ring,
+                                            guint                  index);
+
+void fpi_frame_ring_clear (struct fpi_frame_ring *ring);
+
+void fpi_frame_ring_free (struct fpi_frame_ring *ring);
+
+void fpi_do_movement_estimation_ring (struct fpi_frame_asmbl_ctx *ctx,
+                                      struct fpi_frame_ring      *ring);
+
+FpImage *fpi_assemble_frames_ring (struct fpi_frame_asmbl_ctx *ctx,
+                                   struct fpi_frame_ring      *ring);
+
+/**
+ * fpi_frame_asmbl_stream:
+ *
+ * #fpi_frame_asmbl_stream is an opaque structure used to assemble frames
+ * while they are being captured, see fpi_frame_asmbl_stream_new().
+ */
+struct fpi_frame_asmbl_stream;
+
+struct fpi_frame_asmbl_stream *fpi_frame_asmbl_stream_new (struct fpi_frame_asmbl_ctx *ctx);
+
+void fpi_frame_asmbl_stream_push_frame (struct fpi_frame_asmbl_stream *stream,
+                                        struct fpi_frame              *frame);
+
+FpImage *fpi_frame_asmbl_stream_finish (struct fpi_frame_asmbl_stream *stream);
+
+void fpi_frame_asmbl_stream_free (struct fpi_frame_asmbl_stream *stream);
+
 /**
  * fpi_line_asmbl_ctx:
  * @line_width: width of line
@@ -79,6 +155,9 @@ FpImage *fpi_assemble_frames (struct fpi_frame_asmbl_ctx *ctx,
  * @get_deviation: pointer to a function that returns the numerical difference
  *                 between two lines
  * @get_pixel: pixel accessor, returns pixel brightness at x of line
+ * @get_line: optional line accessor, returns a pointer to @line_width
+ *            contiguous 8-bit pixels of a line. If set it is used instead
+ *            of @get_pixel during interpolation.
  *
  * #fpi_line_asmbl_ctx is a structure holding the context for line assembling
  * routines.
@@ -110,6 +189,8 @@ struct fpi_line_asmbl_ctx
   unsigned char (*get_pixel)(struct fpi_line_asmbl_ctx *ctx,
                              GSList                    *line,
                              unsigned int               x);
+  const unsigned char *(*get_line)(struct fpi_line_asmbl_ctx *ctx,
+                                   GSList                    *line);
 };
 
 FpImage *fpi_assemble_lines (struct fpi_line_asmbl_ctx *ctx,
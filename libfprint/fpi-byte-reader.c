@@ -233,6 +233,23 @@ fpi_byte_reader_skip (FpiByteReader * reader, guint nbytes)
   return fpi_byte_reader_skip_inline (reader, nbytes);
 }
 
+/**
+ * fpi_byte_reader_ensure_remaining:
+ * @reader: a #FpiByteReader instance
+ * @nbytes: the number of bytes that are going to be read
+ *
+ * Checks once that at least @nbytes bytes are left to read, so that a
+ * fixed-layout record of up to @nbytes bytes can then be read with the
+ * `_unchecked` getters, which do no bounds checking of their own.
+ *
+ * Returns: %TRUE if at least @nbytes bytes are remaining, %FALSE otherwise.
+ */
+gboolean
+fpi_byte_reader_ensure_remaining (const FpiByteReader * reader, guint nbytes)
+{
+  return fpi_byte_reader_ensure_remaining_inline (reader, nbytes);
+}
+
 /**
  * fpi_byte_reader_get_uint8:
  * @reader: a #FpiByteReader instance
@@ -820,6 +837,127 @@ fpi_byte_reader_dup_data (FpiByteReader * reader, guint size, guint8 ** val)
   return fpi_byte_reader_dup_data_inline (reader, size, val);
 }
 
+/* Copies @n 16 bit values, swapping them if @swap is set. The loop is kept
+ * trivial so that the compiler can vectorize it. */
+static inline void
+_copy_uint16_array (guint16 * dest, const guint8 * src, guint n,
+    gboolean swap)
+{
+  guint i;
+
+  memcpy (dest, src, n * sizeof (guint16));
+  if (swap) {
+    for (i = 0; i < n; i++)
+      dest[i] = GUINT16_SWAP_LE_BE (dest[i]);
+  }
+}
+
+static inline gboolean
+_peek_uint16_array (const FpiByteReader * reader, guint n, guint16 * val,
+    gboolean swap)
+{
+  g_return_val_if_fail (reader != NULL, FALSE);
+  g_return_val_if_fail (val != NULL || n == 0, FALSE);
+
+  if (G_UNLIKELY (n > G_MAXUINT / sizeof (guint16)))
+    return FALSE;
+
+  if (fpi_byte_reader_get_remaining_inline (reader) < n * sizeof (guint16))
+    return FALSE;
+
+  _copy_uint16_array (val, reader->data + reader->byte, n, swap);
+  return TRUE;
+}
+
+/**
+ * fpi_byte_reader_peek_uint16_le_array:
+ * @reader: a #FpiByteReader instance
+ * @n: Number of values
+ * @val: (out caller-allocates) (array length=n): array of at least @n
+ *     #guint16 values in which to store the result
+ *
+ * Reads @n unsigned little endian 16 bit integers into @val
+ * but keeps the current position. This is a lot faster than
+ * reading the values one by one.
+ *
+ * Returns: %TRUE if successful, %FALSE otherwise.
+ */
+gboolean
+fpi_byte_reader_peek_uint16_le_array (const FpiByteReader * reader, guint n,
+    guint16 * val)
+{
+  return _peek_uint16_array (reader, n, val,
+      G_BYTE_ORDER != G_LITTLE_ENDIAN);
+}
+
+/**
+ * fpi_byte_reader_peek_uint16_be_array:
+ * @reader: a #FpiByteReader instance
+ * @n: Number of values
+ * @val: (out caller-allocates) (array length=n): array of at least @n
+ *     #guint16 values in which to store the result
+ *
+ * Reads @n unsigned big endian 16 bit integers into @val
+ * but keeps the current position. This is a lot faster than
+ * reading the values one by one.
+ *
+ * Returns: %TRUE if successful, %FALSE otherwise.
+ */
+gboolean
+fpi_byte_reader_peek_uint16_be_array (const FpiByteReader * reader, guint n,
+    guint16 * val)
+{
+  return _peek_uint16_array (reader, n, val, G_BYTE_ORDER != G_BIG_ENDIAN);
+}
+
+/**
+ * fpi_byte_reader_get_uint16_le_array:
+ * @reader: a #FpiByteReader instance
+ * @n: Number of values
+ * @val: (out caller-allocates) (array length=n): array of at least @n
+ *     #guint16 values in which to store the result
+ *
+ * Reads @n unsigned little endian 16 bit integers into @val
+ * and updates the current position. This is a lot faster than
+ * reading the values one by one.
+ *
+ * Returns: %TRUE if successful, %FALSE otherwise.
+ */
+gboolean
+fpi_byte_reader_get_uint16_le_array (FpiByteReader * reader, guint n,
+    guint16 * val)
+{
+  if (!fpi_byte_reader_peek_uint16_le_array (reader, n, val))
+    return FALSE;
+
+  reader->byte += n * sizeof (guint16);
+  return TRUE;
+}
+
+/**
+ * fpi_byte_reader_get_uint16_be_array:
+ * @reader: a #FpiByteReader instance
+ * @n: Number of values
+ * @val: (out caller-allocates) (array length=n): array of at least @n
+ *     #guint16 values in which to store the result
+ *
+ * Reads @n unsigned big endian 16 bit integers into @val
+ * and updates the current position. This is a lot faster than
+ * reading the values one by one.
+ *
+ * Returns: %TRUE if successful, %FALSE otherwise.
+ */
+gboolean
+fpi_byte_reader_get_uint16_be_array (FpiByteReader * reader, guint n,
+    guint16 * val)
+{
+  if (!fpi_byte_reader_peek_uint16_be_array (reader, n, val))
+    return FALSE;
+
+  reader->byte += n * sizeof (guint16);
+  return TRUE;
+}
+
 /* Special optimized scan for mask 0xffffff00 and pattern 0x00000100 */
 static inline gint
 _scan_for_start_code (const guint8 * data, guint size)
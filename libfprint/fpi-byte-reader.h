@@ -79,6 +79,9 @@ guint           fpi_byte_reader_get_size        (const FpiByteReader *reader);
 gboolean        fpi_byte_reader_skip            (FpiByteReader *reader, guint nbytes);
 
 
+gboolean        fpi_byte_reader_ensure_remaining (const FpiByteReader *reader, guint nbytes);
+
+
 gboolean        fpi_byte_reader_get_uint8       (FpiByteReader *reader, guint8 *val);
 
 
@@ -219,6 +222,18 @@ gboolean        fpi_byte_reader_get_data        (FpiByteReader * reader, guint s
 
 gboolean        fpi_byte_reader_peek_data       (const FpiByteReader * reader, guint size, const guint8 ** val);
 
+
+gboolean        fpi_byte_reader_get_uint16_le_array  (FpiByteReader * reader, guint n, guint16 * val);
+
+
+gboolean        fpi_byte_reader_get_uint16_be_array  (FpiByteReader * reader, guint n, guint16 * val);
+
+
+gboolean        fpi_byte_reader_peek_uint16_le_array (const FpiByteReader * reader, guint n, guint16 * val);
+
+
+gboolean        fpi_byte_reader_peek_uint16_be_array (const FpiByteReader * reader, guint n, guint16 * val);
+
 #define fpi_byte_reader_dup_string(reader,str) \
     fpi_byte_reader_dup_string_utf8(reader,str)
 
@@ -661,6 +676,14 @@ fpi_byte_reader_skip_inline (FpiByteReader * reader, guint nbytes)
   return TRUE;
 }
 
+static inline gboolean
+fpi_byte_reader_ensure_remaining_inline (const FpiByteReader * reader, guint nbytes)
+{
+  g_return_val_if_fail (reader != NULL, FALSE);
+
+  return fpi_byte_reader_get_remaining_unchecked (reader) >= nbytes;
+}
+
 #ifndef FPI_BYTE_READER_DISABLE_INLINES
 
 #define fpi_byte_reader_dup_data(reader,size,val) \
@@ -671,6 +694,8 @@ fpi_byte_reader_skip_inline (FpiByteReader * reader, guint nbytes)
     G_LIKELY(fpi_byte_reader_peek_data_inline(reader,size,val))
 #define fpi_byte_reader_skip(reader,nbytes) \
     G_LIKELY(fpi_byte_reader_skip_inline(reader,nbytes))
+#define fpi_byte_reader_ensure_remaining(reader,nbytes) \
+    G_LIKELY(fpi_byte_reader_ensure_remaining_inline(reader,nbytes))
 
 #endif /* FPI_BYTE_READER_DISABLE_INLINES */
 
@@ -0,0 +1,573 @@
+/*
+ * Recording and replaying of captured images
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "capture_recorder"
+
+#include "fpi-log.h"
+#include "fpi-capture-recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#if FPI_LZ4
+#include <lz4.h>
+#endif
+
+/**
+ * SECTION: fpi-capture-recorder
+ * @title: Capture recording
+ * @short_description: Recording captured images for offline replay
+ *
+ * Setting the FP_CAPTURE_RECORD environment variable to a file name makes
+ * every image device append what its driver reports to that file: the
+ * finger status, the intermediate frames and the final images, each with
+ * a timestamp. Setting FP_CAPTURE_RECORD_LZ4 as well compresses the
+ * images if libfprint was built with LZ4 support.
+ *
+ * Passing such an archive instead of a socket path in FP_VIRTUAL_IMAGE
+ * makes the virtual image device replay the captured images, one per
+ * capture and as fast as they are requested. This allows reproducing and
+ * benchmarking issues from the field without the hardware.
+ *
+ * The archive is a 16 byte file header followed by records. Each record
+ * is a 48 byte header and its payload, padded to 8 bytes. All values are
+ * little endian and every header is 8 byte aligned, so a mapped archive
+ * can be read in place. Records are only ever appended, with one write
+ * per record, so an archive stays readable up to the last complete record
+ * if the process is killed, and several devices may share one archive.
+ */
+
+#define ARCHIVE_MAGIC "FPCAPREC"
+#define ARCHIVE_VERSION 1
+
+/* Failing to decompress a record this large means the archive is broken */
+#define RECORD_MAX_SIZE (64 * 1024 * 1024)
+
+#define RECORD_FLAG_LZ4 (1 << 0)
+
+typedef struct
+{
+  gchar   magic[8];
+  guint32 version;
+  guint32 reserved;
+} ArchiveHeader;
+
+typedef struct
+{
+  guint32 type;
+  guint32 flags;
+  gint64  timestamp;
+  guint64 ppmm;        /* bits of the gdouble */
+  guint32 width;
+  guint32 height;
+  guint32 value;       /* image flags or finger status */
+  guint32 size;        /* size of the payload */
+  guint32 stored_size; /* size of the payload as stored, before padding */
+  guint32 reserved;
+} RecordHeader;
+
+G_STATIC_ASSERT (sizeof (ArchiveHeader) == 16);
+G_STATIC_ASSERT (sizeof (RecordHeader) == 48);
+
+struct _FpiCaptureRecorder
+{
+  gint     fd;
+  gboolean compress;
+  gint64   start_time;
+};
+
+struct _FpiCaptureReader
+{
+  GMappedFile *file;
+  gsize        offset;
+  FpImage     *image;
+};
+
+static gboolean
+write_all (gint fd, const guint8 *data, gsize size, GError **error)
+{
+  while (size > 0)
+    {
+      gssize written = write (fd, data, size);
+
+      if (written < 0)
+        {
+          gint saved_errno = errno;
+
+          if (saved_errno == EINTR)
+            continue;
+
+          g_set_error (error, G_IO_ERROR,
+                       g_io_error_from_errno (saved_errno),
+                       "Could not write capture record: %s",
+                       g_strerror (saved_errno));
+          return FALSE;
+        }
+
+      data += written;
+      size -= written;
+    }
+
+  return TRUE;
+}
+
+/**
+ * fpi_capture_recorder_new:
+ * @path: The file to append the records to
+ * @compress: Whether to compress images, ignored without LZ4 support
+ * @error: Return location for errors
+ *
+ * Opens a capture archive for appending, creating it if needed.
+ *
+ * Returns: (transfer full): A new #FpiCaptureRecorder, or %NULL on error
+ */
+FpiCaptureRecorder *
+fpi_capture_recorder_new (const gchar *path,
+                          gboolean     compress,
+                          GError     **error)
+{
+  g_autofree FpiCaptureRecorder *recorder = g_new0 (FpiCaptureRecorder, 1);
+  struct stat st;
+
+  recorder->fd = g_open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (recorder->fd < 0 || fstat (recorder->fd, &st) < 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Could not open capture archive %s: %s",
+                   path, g_strerror (saved_errno));
+      if (recorder->fd >= 0)
+        close (recorder->fd);
+      return NULL;
+    }
+
+  if (st.st_size == 0)
+    {
+      ArchiveHeader header = { ARCHIVE_MAGIC, GUINT32_TO_LE (ARCHIVE_VERSION), 0 };
+
+      if (!write_all (recorder->fd, (const guint8 *) &header, sizeof (header), error))
+        {
+          close (recorder->fd);
+          return NULL;
+        }
+    }
+  else if (st.st_size % 8 != 0)
+    {
+      /* Appending would misalign every record that follows */
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is not a capture archive or it is truncated", path);
+      close (recorder->fd);
+      return NULL;
+    }
+
+#if FPI_LZ4
+  recorder->compress = compress;
+#else
+  if (compress)
+    g_warning ("LZ4 support is not available, recording uncompressed images");
+#endif
+  recorder->start_time = g_get_monotonic_time ();
+
+  return g_steal_pointer (&recorder);
+}
+
+/**
+ * fpi_capture_recorder_new_for_device:
+ * @device: The #FpDevice to record
+ *
+ * Creates a recorder for @device if the FP_CAPTURE_RECORD environment
+ * variable is set, and adds the session record. Failures are logged.
+ *
+ * Returns: (transfer full) (nullable): A new #FpiCaptureRecorder, or %NULL
+ */
+FpiCaptureRecorder *
+fpi_capture_recorder_new_for_device (FpDevice *device)
+{
+  g_autoptr(GError) error = NULL;
+  FpiCaptureRecorder *recorder;
+  const gchar *path;
+
+  path = g_getenv ("FP_CAPTURE_RECORD");
+  if (!path || !*path)
+    return NULL;
+
+  recorder = fpi_capture_recorder_new (path,
+                                       g_getenv ("FP_CAPTURE_RECORD_LZ4") != NULL,
+                                       &error);
+  if (!recorder)
+    {
+      g_warning ("Not recording captures: %s", error->message);
+      return NULL;
+    }
+
+  fpi_capture_recorder_add_session (recorder,
+                                    fp_device_get_driver (device),
+                                    fp_device_get_device_id (device));
+
+  return recorder;
+}
+
+/**
+ * fpi_capture_recorder_free:
+ * @recorder: A #FpiCaptureRecorder
+ *
+ * Closes the archive and frees @recorder.
+ */
+void
+fpi_capture_recorder_free (FpiCaptureRecorder *recorder)
+{
+  if (!recorder)
+    return;
+
+  close (recorder->fd);
+  g_free (recorder);
+}
+
+static void
+recorder_append (FpiCaptureRecorder *recorder,
+                 RecordHeader       *header,
+                 const guint8       *payload,
+                 gsize               size)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree guint8 *record = NULL;
+  gsize stored_size = size;
+  gsize record_size;
+
+  /* Assemble the record so that it goes out in a single write */
+  record = g_malloc0 (sizeof (RecordHeader) + size + 8);
+
+#if FPI_LZ4
+  if (recorder->compress && header->type != FPI_CAPTURE_RECORD_SESSION && size > 0)
+    {
+      gint bound = LZ4_compressBound (size);
+      gint compressed;
+
+      if ((gsize) bound > size)
+        record = g_realloc (record, sizeof (RecordHeader) + bound + 8);
+
+      compressed = LZ4_compress_default ((const char *) payload,
+                                         (char *) record + sizeof (RecordHeader),
+                                         size, bound);
+      if (compressed > 0 && (gsize) compressed < size)
+        {
+          header->flags |= RECORD_FLAG_LZ4;
+          stored_size = compressed;
+          payload = NULL;
+        }
+    }
+#endif
+
+  if (payload)
+    memcpy (record + sizeof (RecordHeader), payload, size);
+  record_size = sizeof (RecordHeader) + ((stored_size + 7) & ~7);
+  memset (record + sizeof (RecordHeader) + stored_size, 0,
+          record_size - sizeof (RecordHeader) - stored_size);
+
+  header->type = GUINT32_TO_LE (header->type);
+  header->flags = GUINT32_TO_LE (header->flags);
+  header->timestamp = GINT64_TO_LE (header->timestamp);
+  header->ppmm = GUINT64_TO_LE (header->ppmm);
+  header->width = GUINT32_TO_LE (header->width);
+  header->height = GUINT32_TO_LE (header->height);
+  header->value = GUINT32_TO_LE (header->value);
+  header->size = GUINT32_TO_LE (size);
+  header->stored_size = GUINT32_TO_LE (stored_size);
+  memcpy (record, header, sizeof (RecordHeader));
+
+  if (!write_all (recorder->fd, record, record_size, &error))
+    g_warning ("%s", error->message);
+}
+
+/**
+ * fpi_capture_recorder_add_session:
+ * @recorder: A #FpiCaptureRecorder
+ * @driver: The driver ID
+ * @device_id: The device ID
+ *
+ * Adds a record that starts a new session, the timestamps of the
+ * following records are relative to it.
+ */
+void
+fpi_capture_recorder_add_session (FpiCaptureRecorder *recorder,
+                                  const gchar        *driver,
+                                  const gchar        *device_id)
+{
+  g_autoptr(GString) payload = g_string_new (driver ? driver : "");
+  RecordHeader header = { 0, };
+
+  g_string_append_c (payload, '\0');
+  g_string_append (payload, device_id ? device_id : "");
+  g_string_append_c (payload, '\0');
+
+  recorder->start_time = g_get_monotonic_time ();
+
+  header.type = FPI_CAPTURE_RECORD_SESSION;
+  header.timestamp = g_get_real_time ();
+  recorder_append (recorder, &header, (const guint8 *) payload->str, payload->len);
+}
+
+/**
+ * fpi_capture_recorder_add_finger_status:
+ * @recorder: A #FpiCaptureRecorder
+ * @present: Whether the finger is present
+ *
+ * Adds a finger status report.
+ */
+void
+fpi_capture_recorder_add_finger_status (FpiCaptureRecorder *recorder,
+                                        gboolean            present)
+{
+  RecordHeader header = { 0, };
+
+  header.type = FPI_CAPTURE_RECORD_FINGER;
+  header.timestamp = g_get_monotonic_time () - recorder->start_time;
+  header.value = !!present;
+  recorder_append (recorder, &header, NULL, 0);
+}
+
+/**
+ * fpi_capture_recorder_add_image:
+ * @recorder: A #FpiCaptureRecorder
+ * @type: %FPI_CAPTURE_RECORD_FRAME or %FPI_CAPTURE_RECORD_IMAGE
+ * @image: The #FpImage to record
+ *
+ * Adds a frame or an image, including its resolution and flags.
+ */
+void
+fpi_capture_recorder_add_image (FpiCaptureRecorder  *recorder,
+                                FpiCaptureRecordType type,
+                                FpImage             *image)
+{
+  RecordHeader header = { 0, };
+  union
+  {
+    gdouble d;
+    guint64 u;
+  } ppmm;
+
+  g_return_if_fail (type == FPI_CAPTURE_RECORD_FRAME ||
+                    type == FPI_CAPTURE_RECORD_IMAGE);
+
+  ppmm.d = image->ppmm;
+
+  header.type = type;
+  header.timestamp = g_get_monotonic_time () - recorder->start_time;
+  header.ppmm = ppmm.u;
+  header.width = image->width;
+  header.height = image->height;
+  header.value = image->flags;
+  recorder_append (recorder, &header, image->data,
+                   (gsize) image->width * image->height);
+}
+
+/**
+ * fpi_capture_reader_new:
+ * @path: The capture archive
+ * @error: Return location for errors
+ *
+ * Maps a capture archive for reading.
+ *
+ * Returns: (transfer full): A new #FpiCaptureReader, or %NULL on error
+ */
+FpiCaptureReader *
+fpi_capture_reader_new (const gchar *path, GError **error)
+{
+  g_autoptr(GMappedFile) file = NULL;
+  const ArchiveHeader *header;
+  FpiCaptureReader *reader;
+
+  file = g_mapped_file_new (path, FALSE, error);
+  if (!file)
+    return NULL;
+
+  header = (const ArchiveHeader *) g_mapped_file_get_contents (file);
+  if (g_mapped_file_get_length (file) < sizeof (ArchiveHeader) ||
+      memcmp (header->magic, ARCHIVE_MAGIC, sizeof (header->magic)) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is not a capture archive", path);
+      return NULL;
+    }
+
+  if (GUINT32_FROM_LE (header->version) != ARCHIVE_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Capture archive version %u is not supported",
+                   GUINT32_FROM_LE (header->version));
+      return NULL;
+    }
+
+  reader = g_new0 (FpiCaptureReader, 1);
+  reader->file = g_steal_pointer (&file);
+  reader->offset = sizeof (ArchiveHeader);
+
+  return reader;
+}
+
+/**
+ * fpi_capture_reader_free:
+ * @reader: A #FpiCaptureReader
+ *
+ * Unmaps the archive and frees @reader.
+ */
+void
+fpi_capture_reader_free (FpiCaptureReader *reader)
+{
+  if (!reader)
+    return;
+
+  g_clear_object (&reader->image);
+  g_mapped_file_unref (reader->file);
+  g_free (reader);
+}
+
+/**
+ * fpi_capture_reader_next:
+ * @reader: A #FpiCaptureReader
+ * @record: (out caller-allocates): The record that was read
+ * @error: Return location for errors
+ *
+ * Reads the next record of the archive. A partial record at the end,
+ * as left behind by a recording process that was killed, is treated as
+ * the end of the archive.
+ *
+ * Returns: %TRUE if a record was read, %FALSE at the end of the archive
+ *   or on error
+ */
+gboolean
+fpi_capture_reader_next (FpiCaptureReader *reader,
+                         FpiCaptureRecord *record,
+                         GError          **error)
+{
+  const guint8 *data = (const guint8 *) g_mapped_file_get_contents (reader->file);
+  gsize length = g_mapped_file_get_length (reader->file);
+  const guint8 *payload;
+  RecordHeader header;
+  gsize stored_size;
+
+  g_clear_object (&reader->image);
+  memset (record, 0, sizeof (*record));
+
+  if (length - reader->offset < sizeof (RecordHeader))
+    return FALSE;
+
+  memcpy (&header, data + reader->offset, sizeof (RecordHeader));
+  header.type = GUINT32_FROM_LE (header.type);
+  header.flags = GUINT32_FROM_LE (header.flags);
+  header.timestamp = GINT64_FROM_LE (header.timestamp);
+  header.ppmm = GUINT64_FROM_LE (header.ppmm);
+  header.width = GUINT32_FROM_LE (header.width);
+  header.height = GUINT32_FROM_LE (header.height);
+  header.value = GUINT32_FROM_LE (header.value);
+  header.size = GUINT32_FROM_LE (header.size);
+  header.stored_size = GUINT32_FROM_LE (header.stored_size);
+
+  stored_size = ((gsize) header.stored_size + 7) & ~7;
+  if (length - reader->offset - sizeof (RecordHeader) < stored_size)
+    return FALSE;
+
+  payload = data + reader->offset + sizeof (RecordHeader);
+  reader->offset += sizeof (RecordHeader) + stored_size;
+
+  record->type = header.type;
+  record->timestamp = header.timestamp;
+
+  switch (header.type)
+    {
+    case FPI_CAPTURE_RECORD_SESSION:
+      if (header.size == 0 || payload[header.size - 1] != '\0')
+        goto invalid;
+      record->driver = (const gchar *) payload;
+      record->device_id = memchr (payload, '\0', header.size);
+      if (record->device_id == record->driver + header.size - 1)
+        goto invalid;
+      record->device_id++;
+      break;
+
+    case FPI_CAPTURE_RECORD_FINGER:
+      record->finger_present = !!header.value;
+      break;
+
+    case FPI_CAPTURE_RECORD_FRAME:
+    case FPI_CAPTURE_RECORD_IMAGE:
+      {
+        union
+        {
+          gdouble d;
+          guint64 u;
+        } ppmm;
+
+        if (header.size > RECORD_MAX_SIZE ||
+            (guint64) header.width * header.height != header.size)
+          goto invalid;
+
+        reader->image = fp_image_new (header.width, header.height);
+        ppmm.u = header.ppmm;
+        reader->image->ppmm = ppmm.d;
+        reader->image->flags = header.value;
+
+        if (header.flags & RECORD_FLAG_LZ4)
+          {
+#if FPI_LZ4
+            if (LZ4_decompress_safe ((const char *) payload,
+                                     (char *) reader->image->data,
+                                     header.stored_size,
+                                     header.size) != (gint) header.size)
+              goto invalid;
+#else
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                         "The capture archive is compressed, but LZ4 support is not available");
+            g_clear_object (&reader->image);
+            return FALSE;
+#endif
+          }
+        else if (header.stored_size == header.size)
+          {
+            memcpy (reader->image->data, payload, header.size);
+          }
+        else
+          {
+            goto invalid;
+          }
+
+        record->image = reader->image;
+        break;
+      }
+
+    default:
+      /* Skip record types added by later versions */
+      return fpi_capture_reader_next (reader, record, error);
+    }
+
+  return TRUE;
+
+invalid:
+  g_clear_object (&reader->image);
+  memset (record, 0, sizeof (*record));
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Invalid record in the capture archive at offset %" G_GSIZE_FORMAT,
+               reader->offset - sizeof (RecordHeader) - stored_size);
+  return FALSE;
+}
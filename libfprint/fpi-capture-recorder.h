@@ -0,0 +1,92 @@
+/*
+ * Recording and replaying of captured images
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include "fpi-image.h"
+
+/**
+ * FpiCaptureRecordType:
+ * @FPI_CAPTURE_RECORD_SESSION: A device was opened, starts a new session
+ * @FPI_CAPTURE_RECORD_FINGER: The driver reported the finger status
+ * @FPI_CAPTURE_RECORD_FRAME: An intermediate frame reported by the driver
+ * @FPI_CAPTURE_RECORD_IMAGE: The final image of a capture
+ *
+ * The type of a record in a capture archive.
+ */
+typedef enum {
+  FPI_CAPTURE_RECORD_SESSION = 1,
+  FPI_CAPTURE_RECORD_FINGER  = 2,
+  FPI_CAPTURE_RECORD_FRAME   = 3,
+  FPI_CAPTURE_RECORD_IMAGE   = 4,
+} FpiCaptureRecordType;
+
+/**
+ * FpiCaptureRecord:
+ * @type: The #FpiCaptureRecordType
+ * @timestamp: Microseconds since the session started, the wall clock
+ *   time in microseconds for %FPI_CAPTURE_RECORD_SESSION
+ * @finger_present: Whether the finger is present, for
+ *   %FPI_CAPTURE_RECORD_FINGER
+ * @image: The frame or image, for %FPI_CAPTURE_RECORD_FRAME and
+ *   %FPI_CAPTURE_RECORD_IMAGE
+ * @driver: The driver of the session, for %FPI_CAPTURE_RECORD_SESSION
+ * @device_id: The device ID of the session, for
+ *   %FPI_CAPTURE_RECORD_SESSION
+ *
+ * A record read from a capture archive. It remains owned by the
+ * #FpiCaptureReader and is only valid until the next record is read.
+ */
+typedef struct
+{
+  FpiCaptureRecordType type;
+  gint64               timestamp;
+  gboolean             finger_present;
+  FpImage             *image;
+  const gchar         *driver;
+  const gchar         *device_id;
+} FpiCaptureRecord;
+
+typedef struct _FpiCaptureRecorder FpiCaptureRecorder;
+typedef struct _FpiCaptureReader FpiCaptureReader;
+
+FpiCaptureRecorder *fpi_capture_recorder_new (const gchar *path,
+                                              gboolean     compress,
+                                              GError     **error);
+FpiCaptureRecorder *fpi_capture_recorder_new_for_device (FpDevice *device);
+void                fpi_capture_recorder_free (FpiCaptureRecorder *recorder);
+
+void                fpi_capture_recorder_add_session (FpiCaptureRecorder *recorder,
+                                                      const gchar        *driver,
+                                                      const gchar        *device_id);
+void                fpi_capture_recorder_add_finger_status (FpiCaptureRecorder *recorder,
+                                                            gboolean            present);
+void                fpi_capture_recorder_add_image (FpiCaptureRecorder  *recorder,
+                                                    FpiCaptureRecordType type,
+                                                    FpImage             *image);
+
+FpiCaptureReader   *fpi_capture_reader_new (const gchar *path,
+                                            GError     **error);
+void                fpi_capture_reader_free (FpiCaptureReader *reader);
+gboolean            fpi_capture_reader_next (FpiCaptureReader *reader,
+                                             FpiCaptureRecord *record,
+                                             GError          **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiCaptureRecorder, fpi_capture_recorder_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiCaptureReader, fpi_capture_reader_free)
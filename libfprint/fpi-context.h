@@ -21,6 +21,7 @@
 #include <gusb.h>
 #include "fp-context.h"
 #include "fpi-compat.h"
+#include "fpi-device.h"
 
 /**
  * fpi_get_driver_types:
@@ -33,3 +34,34 @@
  *   all driver types
  */
 GArray *fpi_get_driver_types (void);
+
+/**
+ * FpiDriverInfo:
+ * @id: The driver ID, same as #FpDeviceClass.id
+ * @type: The type of the driver
+ * @id_table: The table of IDs the driver binds to
+ * @get_type: Registers and returns the driver type
+ *
+ * Static information about a compiled in driver that is available without
+ * registering its type.
+ */
+typedef struct
+{
+  const gchar     *id;
+  FpDeviceType     type;
+  const FpIdEntry *id_table;
+  GType            (*get_type) (void);
+} FpiDriverInfo;
+
+/**
+ * fpi_get_driver_registry:
+ *
+ * Returns information about all compiled in drivers. This allows matching
+ * devices without registering and initializing every driver class, which
+ * only happens once @get_type is called.
+ *
+ * Stability: private
+ * Returns: (transfer none): an array of #FpiDriverInfo terminated by an
+ *   entry with a %NULL @id
+ */
+const FpiDriverInfo *fpi_get_driver_registry (void);
@@ -0,0 +1,289 @@
+/*
+ * Binary minutiae cylinder codes
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "cylinder"
+
+#include "fpi-log.h"
+#include "fpi-cylinder.h"
+
+#include <nbis.h>
+#include <math.h>
+#include <string.h>
+
+/**
+ * SECTION: fpi-cylinder
+ * @title: Cylinder codes
+ * @short_description: Fixed length binary descriptors of minutiae
+ *
+ * A cylinder code describes the neighbourhood of one minutia. The minutiae
+ * within a radius around it are rotated into its frame, and a bit is set
+ * for each cell of a grid and each range of relative directions that one
+ * of them falls into. Codes of the same minutia in two captures therefore
+ * only differ where the neighbourhood was distorted or partially captured,
+ * independent of how the finger was placed.
+ *
+ * Comparing two codes takes a few XOR and popcount instructions on fixed
+ * size data, which makes comparing two sets of codes with
+ * fpi_cylinder_set_score() a lot cheaper than bozorth3 matching. The
+ * scores are less reliable though, so they are used to rank a gallery
+ * before the final decision is made with bozorth3, see #FpiMatcher.
+ */
+
+/* The cylinder covers a square of twice the radius with a grid of cells,
+ * each of which is split into sections of the relative direction. This
+ * gives 256 bits per minutia. */
+#define CYLINDER_RADIUS 70
+#define CYLINDER_CELLS 8
+#define CYLINDER_CELL_SIZE (2.0 * CYLINDER_RADIUS / CYLINDER_CELLS)
+#define CYLINDER_SECTIONS 4
+#define CYLINDER_WORDS (CYLINDER_CELLS * CYLINDER_CELLS * CYLINDER_SECTIONS / 64)
+
+/* Cylinders with fewer neighbours carry too little information */
+#define CYLINDER_MIN_NEIGHBOURS 2
+
+/* Cylinders of minutiae whose directions differ by more than this are
+ * never compared, as sensors don't allow rotating the finger that far */
+#define CYLINDER_MAX_ROTATION 90
+
+/* The number of best pairs that make up the score of two sets, which
+ * grows from MIN to MIN + RANGE with the size of the smaller set,
+ * following a sigmoid around MU with steepness TAU */
+#define CYLINDER_PAIRS_MIN 4
+#define CYLINDER_PAIRS_RANGE 8
+#define CYLINDER_PAIRS_MU 20
+#define CYLINDER_PAIRS_TAU 0.4
+
+typedef struct
+{
+  guint64 bits[CYLINDER_WORDS];
+  gint    theta;
+  guint   n_bits;
+} Cylinder;
+
+struct _FpiCylinderSet
+{
+  guint    n_cylinders;
+  Cylinder cylinders[];
+};
+
+static inline guint
+cylinder_popcount (guint64 v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll (v);
+#else
+  v = v - ((v >> 1) & G_GUINT64_CONSTANT (0x5555555555555555));
+  v = (v & G_GUINT64_CONSTANT (0x3333333333333333)) +
+      ((v >> 2) & G_GUINT64_CONSTANT (0x3333333333333333));
+  v = (v + (v >> 4)) & G_GUINT64_CONSTANT (0x0f0f0f0f0f0f0f0f);
+
+  return (v * G_GUINT64_CONSTANT (0x0101010101010101)) >> 56;
+#endif
+}
+
+/* The direction of @a relative to @b, in 0 to 359 degrees */
+static inline gint
+cylinder_angle_diff (gint a, gint b)
+{
+  gint d = (a - b) % 360;
+
+  return d < 0 ? d + 360 : d;
+}
+
+static void
+cylinder_add_neighbour (Cylinder *cyl, gdouble u, gdouble v, gint dtheta)
+{
+  gdouble s = dtheta * CYLINDER_SECTIONS / 360.0 - 0.5;
+  gint u0, v0, s0;
+  gint du, dv, ds;
+
+  /* Set the cells and sections nearest to the neighbour, so that small
+   * displacements still leave bits in common */
+  u0 = floor (u / CYLINDER_CELL_SIZE - 0.5);
+  v0 = floor (v / CYLINDER_CELL_SIZE - 0.5);
+  s0 = floor (s);
+
+  for (ds = 0; ds < 2; ds++)
+    for (dv = 0; dv < 2; dv++)
+      for (du = 0; du < 2; du++)
+        {
+          gint col = u0 + du;
+          gint row = v0 + dv;
+          gint sec = (s0 + ds + CYLINDER_SECTIONS) % CYLINDER_SECTIONS;
+          guint bit;
+
+          if (col < 0 || col >= CYLINDER_CELLS || row < 0 || row >= CYLINDER_CELLS)
+            continue;
+
+          bit = (sec * CYLINDER_CELLS + row) * CYLINDER_CELLS + col;
+          cyl->bits[bit / 64] |= G_GUINT64_CONSTANT (1) << (bit % 64);
+        }
+}
+
+/**
+ * fpi_cylinder_set_new:
+ * @xyt: The minutiae of a print
+ *
+ * Computes the cylinder codes of all minutiae in @xyt. Minutiae with too
+ * few neighbours are left out.
+ *
+ * Returns: (transfer full): A new #FpiCylinderSet, free it with
+ *   fpi_cylinder_set_free()
+ */
+FpiCylinderSet *
+fpi_cylinder_set_new (const struct xyt_struct *xyt)
+{
+  FpiCylinderSet *set;
+  gint i, j;
+  guint k;
+
+  set = g_malloc0 (sizeof (FpiCylinderSet) + xyt->nrows * sizeof (Cylinder));
+
+  for (i = 0; i < xyt->nrows; i++)
+    {
+      Cylinder *cyl = &set->cylinders[set->n_cylinders];
+      gdouble angle = xyt->thetacol[i] * G_PI / 180.0;
+      gdouble cos_t = cos (angle);
+      gdouble sin_t = sin (angle);
+      guint n_neighbours = 0;
+
+      memset (cyl, 0, sizeof (Cylinder));
+
+      for (j = 0; j < xyt->nrows; j++)
+        {
+          gint dx = xyt->xcol[j] - xyt->xcol[i];
+          gint dy = xyt->ycol[j] - xyt->ycol[i];
+
+          if (j == i || dx * dx + dy * dy > CYLINDER_RADIUS * CYLINDER_RADIUS)
+            continue;
+
+          /* Rotate into the frame of the minutia, from the cylinder corner */
+          cylinder_add_neighbour (cyl,
+                                  dx * cos_t + dy * sin_t + CYLINDER_RADIUS,
+                                  -dx * sin_t + dy * cos_t + CYLINDER_RADIUS,
+                                  cylinder_angle_diff (xyt->thetacol[j], xyt->thetacol[i]));
+          n_neighbours++;
+        }
+
+      if (n_neighbours < CYLINDER_MIN_NEIGHBOURS)
+        continue;
+
+      cyl->theta = xyt->thetacol[i];
+      for (k = 0; k < CYLINDER_WORDS; k++)
+        cyl->n_bits += cylinder_popcount (cyl->bits[k]);
+
+      set->n_cylinders++;
+    }
+
+  return set;
+}
+
+/**
+ * fpi_cylinder_set_free:
+ * @set: (transfer full): A #FpiCylinderSet
+ *
+ * Frees a set created by fpi_cylinder_set_new().
+ */
+void
+fpi_cylinder_set_free (FpiCylinderSet *set)
+{
+  g_free (set);
+}
+
+/**
+ * fpi_cylinder_set_get_n_valid:
+ * @set: A #FpiCylinderSet
+ *
+ * Returns: The number of minutiae that have a cylinder code
+ */
+guint
+fpi_cylinder_set_get_n_valid (const FpiCylinderSet *set)
+{
+  return set->n_cylinders;
+}
+
+static guint
+cylinder_n_pairs (guint n)
+{
+  gdouble sigmoid = 1.0 / (1.0 + exp (-CYLINDER_PAIRS_TAU * ((gdouble) n - CYLINDER_PAIRS_MU)));
+
+  return CYLINDER_PAIRS_MIN + (guint) round (CYLINDER_PAIRS_RANGE * sigmoid);
+}
+
+/**
+ * fpi_cylinder_set_score:
+ * @a: A #FpiCylinderSet
+ * @b: Another #FpiCylinderSet
+ *
+ * Compares every cylinder code of @a to every code of @b, and averages
+ * the similarity of the best pairs. The number of pairs grows with the
+ * number of minutiae, so that a few similar neighbourhoods that sets of
+ * unrelated fingers share by chance do not dominate the score.
+ *
+ * Returns: The similarity of the two sets, from 0 to 1000
+ */
+gint
+fpi_cylinder_set_score (const FpiCylinderSet *a, const FpiCylinderSet *b)
+{
+  gint top[CYLINDER_PAIRS_MIN + CYLINDER_PAIRS_RANGE];
+  guint n_pairs;
+  guint n_top = 0;
+  gint sum = 0;
+  guint i, j, k;
+
+  if (a->n_cylinders == 0 || b->n_cylinders == 0)
+    return 0;
+
+  n_pairs = cylinder_n_pairs (MIN (a->n_cylinders, b->n_cylinders));
+
+  for (i = 0; i < a->n_cylinders; i++)
+    {
+      const Cylinder *ca = &a->cylinders[i];
+
+      for (j = 0; j < b->n_cylinders; j++)
+        {
+          const Cylinder *cb = &b->cylinders[j];
+          gint rotation = cylinder_angle_diff (ca->theta, cb->theta);
+          guint diff = 0;
+          gint similarity;
+
+          if (rotation > CYLINDER_MAX_ROTATION && rotation < 360 - CYLINDER_MAX_ROTATION)
+            continue;
+
+          for (k = 0; k < CYLINDER_WORDS; k++)
+            diff += cylinder_popcount (ca->bits[k] ^ cb->bits[k]);
+
+          similarity = 1000 - (gint) (diff * 1000 / (ca->n_bits + cb->n_bits));
+          if (n_top == n_pairs && similarity <= top[n_top - 1])
+            continue;
+
+          /* Insert into the best pairs, which are sorted */
+          k = n_top < n_pairs ? n_top++ : n_pairs - 1;
+          for (; k > 0 && top[k - 1] < similarity; k--)
+            top[k] = top[k - 1];
+          top[k] = similarity;
+        }
+    }
+
+  /* Missing pairs count as dissimilar */
+  for (k = 0; k < n_top; k++)
+    sum += top[k];
+
+  return sum / (gint) n_pairs;
+}
@@ -0,0 +1,40 @@
+/*
+ * Binary minutiae cylinder codes
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <config.h>
+#include <glib.h>
+
+struct xyt_struct;
+
+/**
+ * FpiCylinderSet:
+ *
+ * The binary cylinder codes of all minutiae of one print.
+ */
+typedef struct _FpiCylinderSet FpiCylinderSet;
+
+FpiCylinderSet *fpi_cylinder_set_new (const struct xyt_struct *xyt);
+void            fpi_cylinder_set_free (FpiCylinderSet *set);
+guint           fpi_cylinder_set_get_n_valid (const FpiCylinderSet *set);
+gint            fpi_cylinder_set_score (const FpiCylinderSet *a,
+                                        const FpiCylinderSet *b);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiCylinderSet, fpi_cylinder_set_free)
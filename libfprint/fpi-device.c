@@ -23,6 +23,10 @@
 
 #include "fp-device-private.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
 /**
  * SECTION: fpi-device
  * @title: Internal FpDevice
@@ -46,6 +50,321 @@ fp_device_get_instance_private (FpDevice *self)
                             g_type_class_get_instance_private_offset (dev_class));
 }
 
+/* Returns the pool that recycles the buffers of USB IN transfers,
+ * it is created on first use and lives as long as the device. */
+FpiUsbBufferPool *
+fpi_device_get_usb_buffer_pool (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  if (!priv->usb_buffer_pool)
+    priv->usb_buffer_pool = fpi_usb_buffer_pool_new ();
+
+  return priv->usb_buffer_pool;
+}
+
+/* Returns the pool that recycles image buffers, it is created on first
+ * use and lives as long as the device. */
+FpiImageBufferPool *
+fpi_device_get_image_buffer_pool (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  if (!priv->image_buffer_pool)
+    priv->image_buffer_pool = fpi_image_buffer_pool_new ();
+
+  return priv->image_buffer_pool;
+}
+
+/* Returns the USB transfer statistics, they are allocated on first use. */
+FpiUsbTransferStats *
+fpi_device_get_usb_transfer_stats (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  if (!priv->usb_transfer_stats)
+    priv->usb_transfer_stats = g_new0 (FpiUsbTransferStats, 1);
+
+  return priv->usb_transfer_stats;
+}
+
+/* Returns the list of in flight USB transfers, it is created on first use. */
+FpiUsbTransferTracker *
+fpi_device_get_usb_transfer_tracker (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  if (!priv->usb_transfer_tracker)
+    priv->usb_transfer_tracker = fpi_usb_transfer_tracker_new ();
+
+  return priv->usb_transfer_tracker;
+}
+
+static void
+get_usb_totals (FpDevice *device, guint64 *bytes, guint *transfers)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  guint i;
+
+  *bytes = 0;
+  *transfers = 0;
+
+  if (!priv->usb_transfer_stats)
+    return;
+
+  for (i = 0; i < FPI_USB_TRANSFER_STATS_ENDPOINTS; i++)
+    {
+      *bytes += priv->usb_transfer_stats->endpoints[i].bytes;
+      *transfers += priv->usb_transfer_stats->endpoints[i].completed;
+    }
+}
+
+/*
+ * While an operation runs, the runtime power control of USB devices is set
+ * to "on" in sysfs so that the device does not autosuspend in between, and
+ * only set back to "auto" once the device has been idle for the
+ * autosuspend delay, see fp_device_set_autosuspend_delay(). Back to back
+ * operations, including closing and opening the device again, then do not
+ * have to wait for the device to resume each time.
+ *
+ * This is off unless the API user sets a delay. The power control is only
+ * touched if it is "auto" to begin with, and failing to write it (e.g.
+ * missing permissions) is not an error.
+ */
+#define USB_SYSFS_DEVICES "/sys/bus/usb/devices"
+
+static gboolean
+read_sysfs_uint (const gchar *dir, const gchar *name, guint *value)
+{
+  g_autofree gchar *path = g_build_filename (dir, name, NULL);
+  g_autofree gchar *contents = NULL;
+  gchar *end;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return FALSE;
+
+  *value = g_ascii_strtoull (contents, &end, 10);
+
+  return end != contents;
+}
+
+/* Looks up the power/control file of the USB device by its bus and
+ * device number. */
+static gchar *
+find_power_control_path (GUsbDevice *usb_device)
+{
+  g_autoptr(GDir) dir = NULL;
+  guint bus = g_usb_device_get_bus (usb_device);
+  guint address = g_usb_device_get_address (usb_device);
+  const gchar *name;
+
+  dir = g_dir_open (USB_SYSFS_DEVICES, 0, NULL);
+  if (!dir)
+    return NULL;
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      g_autofree gchar *device_dir = NULL;
+      guint busnum, devnum;
+
+      /* Interfaces, not devices */
+      if (strchr (name, ':'))
+        continue;
+
+      device_dir = g_build_filename (USB_SYSFS_DEVICES, name, NULL);
+      if (!read_sysfs_uint (device_dir, "busnum", &busnum) ||
+          !read_sysfs_uint (device_dir, "devnum", &devnum))
+        continue;
+
+      if (busnum == bus && devnum == address)
+        return g_build_filename (device_dir, "power", "control", NULL);
+    }
+
+  return NULL;
+}
+
+static gboolean
+write_power_control (FpDevice *device, const gchar *value)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FILE *file;
+  gboolean res;
+
+  /* Not g_file_set_contents(), sysfs attributes cannot be replaced */
+  file = fopen (priv->power_control_path, "w");
+  res = file && fputs (value, file) >= 0;
+  if (file && fclose (file) != 0)
+    res = FALSE;
+
+  if (!res)
+    {
+      fp_dbg ("Not managing runtime power of %s: %s",
+              fp_device_get_name (device), g_strerror (errno));
+      /* Do not try again */
+      g_clear_pointer (&priv->power_control_path, g_free);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Keeps the device awake, called whenever an operation is started */
+void
+fpi_device_power_hold (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  g_autofree gchar *control = NULL;
+
+  if (priv->power_release_source)
+    {
+      g_source_destroy (priv->power_release_source);
+      g_clear_pointer (&priv->power_release_source, g_source_unref);
+    }
+
+  if (priv->power_held || priv->autosuspend_delay < 0 ||
+      priv->type != FP_DEVICE_TYPE_USB || !priv->usb_device)
+    return;
+
+  if (!priv->power_control_checked)
+    {
+      priv->power_control_checked = TRUE;
+      priv->power_control_path = find_power_control_path (priv->usb_device);
+    }
+
+  if (!priv->power_control_path ||
+      !g_file_get_contents (priv->power_control_path, &control, NULL, NULL))
+    return;
+
+  /* Someone else decided the device should stay on */
+  if (!g_str_has_prefix (control, "auto"))
+    return;
+
+  priv->power_held = write_power_control (device, "on");
+}
+
+/* Lets the device autosuspend again right away */
+void
+fpi_device_power_release_now (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  if (priv->power_release_source)
+    {
+      g_source_destroy (priv->power_release_source);
+      g_clear_pointer (&priv->power_release_source, g_source_unref);
+    }
+
+  if (!priv->power_held)
+    return;
+
+  priv->power_held = FALSE;
+  write_power_control (device, "auto");
+}
+
+static gboolean
+power_release_cb (gpointer user_data)
+{
+  FpDevice *device = user_data;
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_clear_pointer (&priv->power_release_source, g_source_unref);
+  fpi_device_power_release_now (device);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Lets the device autosuspend again once it has been idle for the
+ * autosuspend delay, called whenever an operation completed. */
+void
+fpi_device_power_release (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  if (!priv->power_held || priv->power_release_source)
+    return;
+
+  if (priv->autosuspend_delay <= 0)
+    {
+      fpi_device_power_release_now (device);
+      return;
+    }
+
+  priv->power_release_source = g_timeout_source_new (priv->autosuspend_delay);
+  g_source_set_callback (priv->power_release_source, power_release_cb, device, NULL);
+  g_source_set_name (priv->power_release_source, "[libfprint] autosuspend delay");
+  g_source_attach (priv->power_release_source, fpi_device_get_main_context (device));
+}
+
+/* Resets the statistics of the current operation, called whenever an
+ * operation is started. */
+void
+fpi_device_stats_start (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  priv->current_stats = (FpOperationStats) {
+    .time_to_finger = -1,
+    .capture_time = -1,
+    .minutiae_time = -1,
+    .n_minutiae = -1,
+    .match_time = -1,
+  };
+
+  priv->stats_start_time = g_get_monotonic_time ();
+  get_usb_totals (device, &priv->stats_start_usb_bytes,
+                  &priv->stats_start_usb_transfers);
+}
+
+/* Returns the statistics of the running operation, for the image device
+ * code to fill in the capture, minutiae and match timings. */
+FpOperationStats *
+fpi_device_get_current_stats (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  return &priv->current_stats;
+}
+
+/* Returns the time since the running operation was started */
+gint64
+fpi_device_get_stats_elapsed (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  return g_get_monotonic_time () - priv->stats_start_time;
+}
+
+static void
+fpi_device_stats_finish (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  guint64 usb_bytes;
+  guint usb_transfers;
+
+  get_usb_totals (device, &usb_bytes, &usb_transfers);
+
+  priv->current_stats.duration = g_get_monotonic_time () - priv->stats_start_time;
+  priv->current_stats.usb_bytes = usb_bytes - priv->stats_start_usb_bytes;
+  priv->current_stats.usb_transfers = usb_transfers - priv->stats_start_usb_transfers;
+
+  priv->last_stats = priv->current_stats;
+  priv->has_last_stats = TRUE;
+}
+
+/* Returns the table of SSM state timings keyed by the folded state
+ * stack, it is allocated on first use. */
+GHashTable *
+fpi_device_get_ssm_profile (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  if (!priv->ssm_profile)
+    priv->ssm_profile = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
+
+  return priv->ssm_profile;
+}
+
 /**
  * fpi_device_retry_new:
  * @error: The #FpDeviceRetry error value describing the issue
@@ -135,6 +454,10 @@ fpi_device_error_new (FpDeviceError error)
       msg = "Print was not found on the devices storage.";
       break;
 
+    case FP_DEVICE_ERROR_DATA_DUPLICATE:
+      msg = "This finger has already been enrolled.";
+      break;
+
     default:
       g_warning ("Unsupported error, returning general error instead!");
       error = FP_DEVICE_ERROR_GENERAL;
@@ -269,6 +592,30 @@ static GSourceFuncs timeout_funcs = {
   NULL, NULL
 };
 
+/**
+ * fpi_device_get_main_context:
+ * @device: The #FpDevice
+ *
+ * Returns the main context that the device dispatches its operation in.
+ * This is the thread-default main context of the caller that started the
+ * current action, or the current thread-default main context if there is
+ * no action. Drivers that create their own #GSource must attach it to this
+ * context.
+ *
+ * Returns: (transfer none) (nullable): The #GMainContext, %NULL for the
+ *   global default context
+ */
+GMainContext *
+fpi_device_get_main_context (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  if (priv->current_task)
+    return g_task_get_context (priv->current_task);
+
+  return g_main_context_get_thread_default ();
+}
+
 /**
  * fpi_device_add_timeout:
  * @device: The #FpDevice
@@ -296,7 +643,7 @@ fpi_device_add_timeout (FpDevice      *device,
                                                    sizeof (FpDeviceTimeoutSource));
   source->device = device;
 
-  g_source_attach (&source->source, NULL);
+  g_source_attach (&source->source, fpi_device_get_main_context (device));
   g_source_set_callback (&source->source, (GSourceFunc) func, user_data, destroy_notify);
   g_source_set_ready_time (&source->source,
                            g_source_get_time (&source->source) + interval * (guint64) 1000);
@@ -306,6 +653,179 @@ fpi_device_add_timeout (FpDevice      *device,
   return &source->source;
 }
 
+static void
+fpi_device_timers_update (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  gint64 deadline = -1;
+  GList *l;
+
+  for (l = priv->timers.head; l; l = l->next)
+    {
+      FpiDeviceTimer *timer = l->data;
+
+      if (deadline < 0 || timer->deadline < deadline)
+        deadline = timer->deadline;
+    }
+
+  g_source_set_ready_time (priv->timer_source, deadline);
+}
+
+static gboolean
+timer_dispatch (GSource *source, GSourceFunc gsource_func, gpointer user_data)
+{
+  FpDeviceTimeoutSource *timer_source = (FpDeviceTimeoutSource *) source;
+  FpDevice *device = timer_source->device;
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  gint64 now = g_source_get_time (source);
+  GList *l;
+
+  /* Callbacks may start and stop timers, so look for the next expired
+   * one from the start each time. */
+  do
+    {
+      for (l = priv->timers.head; l; l = l->next)
+        {
+          FpiDeviceTimer *timer = l->data;
+
+          if (timer->deadline <= now)
+            {
+              fpi_device_timer_stop (device, timer);
+              timer->func (device, timer->user_data);
+              break;
+            }
+        }
+    }
+  while (l);
+
+  /* The source might have been replaced by a callback */
+  if (priv->timer_source == source)
+    fpi_device_timers_update (device);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs timer_funcs = {
+  NULL, /* prepare */
+  NULL, /* check */
+  timer_dispatch,
+  NULL, /* finalize */
+  NULL, NULL
+};
+
+/* Stops all timers and drops the shared source, when the device goes away */
+void
+fpi_device_timers_clear (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  while (priv->timers.head)
+    fpi_device_timer_stop (device, priv->timers.head->data);
+
+  if (priv->timer_source)
+    {
+      g_source_destroy (priv->timer_source);
+      g_clear_pointer (&priv->timer_source, g_source_unref);
+    }
+}
+
+/**
+ * fpi_device_timer_start:
+ * @device: The #FpDevice
+ * @timer: The #FpiDeviceTimer, which must not be running
+ * @interval: The interval in milliseconds
+ * @func: The #FpTimeoutFunc to call on timeout
+ * @user_data: (nullable): User data to pass to the callback
+ *
+ * Start @timer, so that @func is called once after @interval. This is a
+ * cheaper alternative to fpi_device_add_timeout() for timeouts that are
+ * started and stopped frequently, as all timers of a device are
+ * dispatched from one #GSource. The callback runs in the main context of
+ * the device, and the timer is stopped when it is called.
+ */
+void
+fpi_device_timer_start (FpDevice       *device,
+                        FpiDeviceTimer *timer,
+                        gint            interval,
+                        FpTimeoutFunc   func,
+                        gpointer        user_data)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  GMainContext *context;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (!fpi_device_timer_is_active (timer));
+
+  context = fpi_device_get_main_context (device);
+  if (!context)
+    context = g_main_context_default ();
+
+  /* Follow the device to the context of the current action */
+  if (priv->timer_source && g_source_get_context (priv->timer_source) != context)
+    {
+      g_source_destroy (priv->timer_source);
+      g_clear_pointer (&priv->timer_source, g_source_unref);
+    }
+
+  if (!priv->timer_source)
+    {
+      FpDeviceTimeoutSource *source;
+
+      source = (FpDeviceTimeoutSource *) g_source_new (&timer_funcs,
+                                                       sizeof (FpDeviceTimeoutSource));
+      source->device = device;
+      priv->timer_source = &source->source;
+      g_source_set_name (priv->timer_source, "[libfprint] device timers");
+      g_source_attach (priv->timer_source, context);
+    }
+
+  timer->deadline = g_source_get_time (priv->timer_source) + interval * (gint64) 1000;
+  timer->func = func;
+  timer->user_data = user_data;
+  timer->link.data = timer;
+  g_queue_push_tail_link (&priv->timers, &timer->link);
+
+  if (g_source_get_ready_time (priv->timer_source) < 0 ||
+      timer->deadline < g_source_get_ready_time (priv->timer_source))
+    g_source_set_ready_time (priv->timer_source, timer->deadline);
+}
+
+/**
+ * fpi_device_timer_stop:
+ * @device: The #FpDevice
+ * @timer: The #FpiDeviceTimer
+ *
+ * Stop @timer if it is running. This does not reschedule the shared
+ * source, which may still wake up once at the deadline of @timer.
+ */
+void
+fpi_device_timer_stop (FpDevice       *device,
+                       FpiDeviceTimer *timer)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  if (!fpi_device_timer_is_active (timer))
+    return;
+
+  g_queue_unlink (&priv->timers, &timer->link);
+  timer->link.data = NULL;
+
+  if (g_queue_is_empty (&priv->timers) && priv->timer_source)
+    g_source_set_ready_time (priv->timer_source, -1);
+}
+
+/**
+ * fpi_device_timer_is_active:
+ * @timer: The #FpiDeviceTimer
+ *
+ * Returns: Whether @timer is running
+ */
+gboolean
+fpi_device_timer_is_active (FpiDeviceTimer *timer)
+{
+  return timer->link.data != NULL;
+}
+
 /**
  * fpi_device_get_usb_device:
  * @device: The #FpDevice
@@ -410,6 +930,165 @@ fpi_device_get_driver_data (FpDevice *device)
   return priv->driver_data;
 }
 
+/* Calibration data outlives the device objects, so that a device which is
+ * re-enumerated (e.g. after resume) does not need to be calibrated again.
+ * It is keyed by the identity of the sensor rather than by its USB port, as
+ * a different unit may be plugged into the same port later on. */
+typedef struct
+{
+  GBytes *data;
+  gint64  timestamp;
+} FpiCalibrationEntry;
+
+static GHashTable *calibration_cache = NULL;
+G_LOCK_DEFINE_STATIC (calibration_cache);
+
+static void
+fpi_calibration_entry_free (FpiCalibrationEntry *entry)
+{
+  g_bytes_unref (entry->data);
+  g_free (entry);
+}
+
+static gchar *
+fpi_device_get_calibration_key (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  g_autofree gchar *serial = NULL;
+  guint8 serial_index;
+
+  if (priv->calibration_key)
+    return g_strdup (priv->calibration_key);
+
+  if (priv->type != FP_DEVICE_TYPE_USB)
+    return NULL;
+
+  /* Prefer the serial number of the USB device, and fall back to the
+   * device ID in case the driver read one from the sensor. Recordings do
+   * not contain the string descriptor, so do not query it when emulating. */
+  serial_index = g_usb_device_get_serial_number_index (priv->usb_device);
+  if (g_strcmp0 (g_getenv ("FP_DEVICE_EMULATION"), "1") == 0)
+    serial = g_strdup ("emulated-device");
+  else if (serial_index != 0)
+    serial = g_usb_device_get_string_descriptor (priv->usb_device,
+                                                 serial_index, NULL);
+  if (!serial && g_strcmp0 (priv->device_id, "0") != 0)
+    serial = g_strdup (priv->device_id);
+  if (!serial || *serial == '\0')
+    return NULL;
+
+  priv->calibration_key = g_strdup_printf ("%s:%04x:%04x:%04x:%s",
+                                           fp_device_get_driver (device),
+                                           g_usb_device_get_vid (priv->usb_device),
+                                           g_usb_device_get_pid (priv->usb_device),
+                                           g_usb_device_get_release (priv->usb_device),
+                                           serial);
+
+  return g_strdup (priv->calibration_key);
+}
+
+/**
+ * fpi_device_store_calibration:
+ * @device: The #FpDevice
+ * @data: (transfer none): The calibration data
+ *
+ * Stores calibration data of @device, replacing any earlier data. It is
+ * kept for the lifetime of the process and keyed by the driver and the
+ * identity of the sensor (its USB IDs and its serial number or device ID),
+ * so it also applies to later #FpDevice instances of the same sensor.
+ * The device must be open. Nothing is stored for devices that are not
+ * connected via USB or that cannot be told apart from other units.
+ */
+void
+fpi_device_store_calibration (FpDevice *device,
+                              GBytes   *data)
+{
+  g_autofree gchar *key = NULL;
+  FpiCalibrationEntry *entry;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (data != NULL);
+
+  key = fpi_device_get_calibration_key (device);
+  if (!key)
+    return;
+
+  entry = g_new0 (FpiCalibrationEntry, 1);
+  entry->data = g_bytes_ref (data);
+  entry->timestamp = g_get_monotonic_time ();
+
+  G_LOCK (calibration_cache);
+  if (!calibration_cache)
+    calibration_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify) fpi_calibration_entry_free);
+  g_hash_table_replace (calibration_cache, g_steal_pointer (&key), entry);
+  G_UNLOCK (calibration_cache);
+}
+
+/**
+ * fpi_device_lookup_calibration:
+ * @device: The #FpDevice
+ * @max_age: Maximum age of the data in microseconds
+ *
+ * Looks up calibration data stored with fpi_device_store_calibration().
+ * Data that is older than @max_age is dropped, so that drivers calibrate
+ * again once the sensor may have drifted.
+ *
+ * Returns: (transfer full) (nullable): The calibration data or %NULL
+ */
+GBytes *
+fpi_device_lookup_calibration (FpDevice *device,
+                               gint64    max_age)
+{
+  g_autofree gchar *key = NULL;
+  FpiCalibrationEntry *entry;
+  GBytes *data = NULL;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+
+  key = fpi_device_get_calibration_key (device);
+  if (!key)
+    return NULL;
+
+  G_LOCK (calibration_cache);
+  entry = calibration_cache ? g_hash_table_lookup (calibration_cache, key) : NULL;
+  if (entry && g_get_monotonic_time () - entry->timestamp > max_age)
+    {
+      fp_dbg ("Dropping expired calibration data of %s", key);
+      g_hash_table_remove (calibration_cache, key);
+      entry = NULL;
+    }
+  if (entry)
+    data = g_bytes_ref (entry->data);
+  G_UNLOCK (calibration_cache);
+
+  return data;
+}
+
+/**
+ * fpi_device_clear_calibration:
+ * @device: The #FpDevice
+ *
+ * Drops the calibration data of @device, drivers should call this if
+ * the stored data turns out not to work anymore.
+ */
+void
+fpi_device_clear_calibration (FpDevice *device)
+{
+  g_autofree gchar *key = NULL;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+
+  key = fpi_device_get_calibration_key (device);
+  if (!key)
+    return;
+
+  G_LOCK (calibration_cache);
+  if (calibration_cache)
+    g_hash_table_remove (calibration_cache, key);
+  G_UNLOCK (calibration_cache);
+}
+
 void
 enroll_data_free (FpEnrollData *data)
 {
@@ -420,6 +1099,24 @@ enroll_data_free (FpEnrollData *data)
   g_free (data);
 }
 
+void
+delete_data_free (FpDeleteData *data)
+{
+  g_clear_object (&data->print);
+  g_clear_pointer (&data->prints, g_ptr_array_unref);
+  g_free (data);
+}
+
+void
+list_data_free (FpListData *data)
+{
+  if (data->list_destroy)
+    data->list_destroy (data->list_data);
+  data->list_data = NULL;
+  g_clear_pointer (&data->prints, g_ptr_array_unref);
+  g_free (data);
+}
+
 void
 match_data_free (FpMatchData *data)
 {
@@ -433,6 +1130,8 @@ match_data_free (FpMatchData *data)
 
   g_clear_object (&data->enrolled_print);
   g_clear_pointer (&data->gallery, g_ptr_array_unref);
+  g_clear_pointer (&data->candidates, g_ptr_array_unref);
+  g_clear_pointer (&data->scores, g_array_unref);
 
   g_free (data);
 }
@@ -529,6 +1228,49 @@ fpi_device_get_identify_data (FpDevice   *device,
     *prints = data->gallery;
 }
 
+/**
+ * fpi_device_get_identify_max_results:
+ * @device: The #FpDevice
+ *
+ * Get the number of best scoring templates that the API user wants to
+ * retrieve for identify, see fp_device_set_identify_max_results(). Drivers
+ * that match on the host should then report them using
+ * fpi_device_identify_report_scores().
+ *
+ * Returns: The number of templates, or 0 if no scores were requested
+ */
+guint
+fpi_device_get_identify_max_results (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), 0);
+
+  return priv->identify_max_results;
+}
+
+/**
+ * fpi_device_get_enroll_duplicate_gallery:
+ * @device: The #FpDevice
+ *
+ * Get the gallery that enrolled fingers should be checked against, see
+ * fp_device_set_enroll_duplicate_gallery(). If the finger is found in it,
+ * drivers should fail the enroll operation with
+ * #FP_DEVICE_ERROR_DATA_DUPLICATE.
+ *
+ * Returns: (transfer none) (nullable): The #FpGallery, or %NULL if no
+ *   check was requested
+ */
+FpGallery *
+fpi_device_get_enroll_duplicate_gallery (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+
+  return priv->enroll_duplicate_gallery;
+}
+
 /**
  * fpi_device_get_delete_data:
  * @device: The #FpDevice
@@ -542,11 +1284,39 @@ fpi_device_get_delete_data (FpDevice *device,
 {
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
 
+  FpDeleteData *data;
+
   g_return_if_fail (FP_IS_DEVICE (device));
   g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_DELETE);
 
+  data = g_task_get_task_data (priv->current_task);
+
   if (print)
-    *print = g_task_get_task_data (priv->current_task);
+    *print = data->print;
+}
+
+/**
+ * fpi_device_get_delete_prints_data:
+ * @device: The #FpDevice
+ * @prints: (out) (transfer none) (element-type FpPrint): The prints to delete
+ *
+ * Get data for the delete_prints vfunc. The delete is finished with
+ * fpi_device_delete_complete() once all of @prints are deleted.
+ */
+void
+fpi_device_get_delete_prints_data (FpDevice   *device,
+                                   GPtrArray **prints)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeleteData *data;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_DELETE);
+
+  data = g_task_get_task_data (priv->current_task);
+
+  if (prints)
+    *prints = data->prints;
 }
 
 /**
@@ -616,6 +1386,14 @@ fpi_device_action_error (FpDevice *device,
       fpi_device_close_complete (device, error);
       break;
 
+    case FPI_DEVICE_ACTION_SUSPEND:
+      fpi_device_suspend_complete (device, error);
+      break;
+
+    case FPI_DEVICE_ACTION_RESUME:
+      fpi_device_resume_complete (device, error);
+      break;
+
     case FPI_DEVICE_ACTION_ENROLL:
       fpi_device_enroll_complete (device, NULL, error);
       break;
@@ -640,6 +1418,10 @@ fpi_device_action_error (FpDevice *device,
       fpi_device_list_complete (device, NULL, error);
       break;
 
+    case FPI_DEVICE_ACTION_CLEAR_STORAGE:
+      fpi_device_clear_storage_complete (device, error);
+      break;
+
     default:
     case FPI_DEVICE_ACTION_NONE:
       g_return_if_reached ();
@@ -687,6 +1469,10 @@ fp_device_task_return_in_idle_cb (gpointer user_data)
 
   g_debug ("Completing action %d in idle!", priv->current_action);
 
+  fpi_ssm_profile_dump (data->device);
+  fpi_device_stats_finish (data->device);
+  fpi_device_power_release (data->device);
+
   task = g_steal_pointer (&priv->current_task);
   priv->current_action = FPI_DEVICE_ACTION_NONE;
   priv->current_task_idle_return_source = NULL;
@@ -749,7 +1535,8 @@ fpi_device_return_task_in_idle (FpDevice              *device,
                          data,
                          (GDestroyNotify) fpi_device_task_return_data_free);
 
-  g_source_attach (priv->current_task_idle_return_source, NULL);
+  g_source_attach (priv->current_task_idle_return_source,
+                   g_task_get_context (priv->current_task));
   g_source_unref (priv->current_task_idle_return_source);
 }
 
@@ -819,17 +1606,51 @@ fpi_device_open_complete (FpDevice *device, GError *error)
 
   clear_device_cancel_action (device);
 
-  if (!error)
+  if (!error)
+    {
+      priv->is_open = TRUE;
+      g_object_notify (G_OBJECT (device), "open");
+    }
+  else if (priv->is_open)
+    {
+      /* Reopening the device after resume failed */
+      priv->is_open = FALSE;
+      g_object_notify (G_OBJECT (device), "open");
+    }
+
+  if (!error)
+    fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_BOOL,
+                                    GUINT_TO_POINTER (TRUE));
+  else
+    fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_ERROR, error);
+}
+
+/* Falls back to a full close and open when resuming failed. Both run from
+ * an idle callback so that the driver is not re-entered from its own
+ * completion call. */
+static void
+fpi_device_reopen_cb (FpDevice *device, gpointer user_data)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeviceClass *cls = FP_DEVICE_GET_CLASS (device);
+  GError *error = NULL;
+
+  if (priv->current_action == FPI_DEVICE_ACTION_CLOSE)
+    {
+      cls->close (device);
+      return;
+    }
+
+  g_assert (priv->current_action == FPI_DEVICE_ACTION_OPEN);
+
+  if (priv->type == FP_DEVICE_TYPE_USB &&
+      !g_usb_device_open (priv->usb_device, &error))
     {
-      priv->is_open = TRUE;
-      g_object_notify (G_OBJECT (device), "open");
+      fpi_device_open_complete (device, error);
+      return;
     }
 
-  if (!error)
-    fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_BOOL,
-                                    GUINT_TO_POINTER (TRUE));
-  else
-    fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_ERROR, error);
+  cls->open (device);
 }
 
 /**
@@ -844,6 +1665,7 @@ fpi_device_close_complete (FpDevice *device, GError *error)
 {
   GError *nested_error = NULL;
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  gboolean reopen;
 
   g_return_if_fail (FP_IS_DEVICE (device));
   g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_CLOSE);
@@ -852,9 +1674,13 @@ fpi_device_close_complete (FpDevice *device, GError *error)
 
   clear_device_cancel_action (device);
 
+  reopen = priv->reopen_pending;
+  priv->reopen_pending = FALSE;
+
   switch (priv->type)
     {
     case FP_DEVICE_TYPE_USB:
+      fpi_usb_transfer_stats_dump (device);
       if (!g_usb_device_close (priv->usb_device, &nested_error))
         {
           if (error == NULL)
@@ -874,9 +1700,17 @@ fpi_device_close_complete (FpDevice *device, GError *error)
       return;
     }
 
-  if (!error)
+  if (!error && reopen)
+    {
+      /* Still considered open, the resume task is returned once opening
+       * it again completes. */
+      priv->current_action = FPI_DEVICE_ACTION_OPEN;
+      fpi_device_add_timeout (device, 0, fpi_device_reopen_cb, NULL, NULL);
+    }
+  else if (!error)
     {
       priv->is_open = FALSE;
+      priv->is_suspended = FALSE;
       g_object_notify (G_OBJECT (device), "open");
       fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_BOOL,
                                       GUINT_TO_POINTER (TRUE));
@@ -887,6 +1721,82 @@ fpi_device_close_complete (FpDevice *device, GError *error)
     }
 }
 
+/**
+ * fpi_device_suspend_complete:
+ * @device: The #FpDevice
+ * @error: The #GError or %NULL on success
+ *
+ * Finish an ongoing suspend operation. If error is %NULL success is assumed.
+ */
+void
+fpi_device_suspend_complete (FpDevice *device, GError *error)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_SUSPEND);
+
+  g_debug ("Device reported suspend completion");
+
+  clear_device_cancel_action (device);
+
+  if (!error)
+    {
+      priv->is_suspended = TRUE;
+      fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_BOOL,
+                                      GUINT_TO_POINTER (TRUE));
+    }
+  else
+    {
+      fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_ERROR, error);
+    }
+}
+
+/**
+ * fpi_device_resume_complete:
+ * @device: The #FpDevice
+ * @error: The #GError or %NULL on success
+ *
+ * Finish an ongoing resume operation. If error is %NULL success is assumed.
+ * Otherwise the saved session is considered lost, and the device is closed
+ * and opened again before the operation completes.
+ */
+void
+fpi_device_resume_complete (FpDevice *device, GError *error)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_RESUME);
+
+  g_debug ("Device reported resume completion");
+
+  clear_device_cancel_action (device);
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_ERROR, error);
+      return;
+    }
+
+  priv->is_suspended = FALSE;
+
+  if (!error)
+    {
+      fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_BOOL,
+                                      GUINT_TO_POINTER (TRUE));
+      return;
+    }
+
+  g_debug ("Could not resume the session, opening device again: %s",
+           error->message);
+  g_error_free (error);
+
+  priv->reopen_pending = TRUE;
+  priv->current_action = FPI_DEVICE_ACTION_CLOSE;
+  fpi_device_add_timeout (device, 0, fpi_device_reopen_cb, NULL, NULL);
+}
+
 /**
  * fpi_device_enroll_complete:
  * @device: The #FpDevice
@@ -995,6 +1905,26 @@ fpi_device_verify_complete (FpDevice *device,
     }
 }
 
+static void
+fpi_device_identify_restart_cb (FpDevice *device, gpointer user_data)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  /* The operation may have ended in the meantime, e.g. when cancelled */
+  if (priv->current_task != user_data)
+    return;
+
+  if (g_cancellable_is_cancelled (g_task_get_cancellable (priv->current_task)))
+    {
+      fpi_device_identify_complete (device,
+                                    g_error_new (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                                 "Device operation was cancelled"));
+      return;
+    }
+
+  FP_DEVICE_GET_CLASS (device)->identify (device);
+}
+
 /**
  * fpi_device_identify_complete:
  * @device: The #FpDevice
@@ -1018,6 +1948,17 @@ fpi_device_identify_complete (FpDevice *device,
 
   data = g_task_get_task_data (priv->current_task);
 
+  /* A continuous identify is started again, for drivers that do not
+   * continue it themselves. Errors other than retries still end it. */
+  if (data->continuous && !error && data->result_reported &&
+      (!data->error || data->error->domain == FP_DEVICE_RETRY))
+    {
+      fpi_device_identify_continue (device);
+      fpi_device_add_timeout (device, 0, fpi_device_identify_restart_cb,
+                              g_object_ref (priv->current_task), g_object_unref);
+      return;
+    }
+
   clear_device_cancel_action (device);
 
   if (!error)
@@ -1101,6 +2042,26 @@ fpi_device_capture_complete (FpDevice *device,
     }
 }
 
+static void
+fpi_device_delete_next_cb (FpDevice *device, gpointer user_data)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  /* The operation may have ended in the meantime, e.g. when cancelled */
+  if (priv->current_task != user_data)
+    return;
+
+  if (g_cancellable_is_cancelled (g_task_get_cancellable (priv->current_task)))
+    {
+      fpi_device_delete_complete (device,
+                                  g_error_new (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                               "Device operation was cancelled"));
+      return;
+    }
+
+  FP_DEVICE_GET_CLASS (device)->delete (device);
+}
+
 /**
  * fpi_device_delete_complete:
  * @device: The #FpDevice
@@ -1113,12 +2074,53 @@ fpi_device_delete_complete (FpDevice *device,
                             GError   *error)
 {
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeleteData *data;
 
   g_return_if_fail (FP_IS_DEVICE (device));
   g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_DELETE);
 
   g_debug ("Device reported deletion completion");
 
+  data = g_task_get_task_data (priv->current_task);
+
+  /* Delete the remaining prints of the batch within the same operation,
+   * the first error ends it. */
+  if (!error && data->prints && data->next < data->prints->len)
+    {
+      g_set_object (&data->print, g_ptr_array_index (data->prints, data->next));
+      data->next++;
+      fpi_device_add_timeout (device, 0, fpi_device_delete_next_cb,
+                              g_object_ref (priv->current_task), g_object_unref);
+      return;
+    }
+
+  clear_device_cancel_action (device);
+
+  if (!error)
+    fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_BOOL,
+                                    GUINT_TO_POINTER (TRUE));
+  else
+    fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_ERROR, error);
+}
+
+/**
+ * fpi_device_clear_storage_complete:
+ * @device: The #FpDevice
+ * @error: The #GError or %NULL on success
+ *
+ * Finish an ongoing clear storage operation.
+ */
+void
+fpi_device_clear_storage_complete (FpDevice *device,
+                                   GError   *error)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_CLEAR_STORAGE);
+
+  g_debug ("Device reported clear storage completion");
+
   clear_device_cancel_action (device);
 
   if (!error)
@@ -1128,13 +2130,69 @@ fpi_device_delete_complete (FpDevice *device,
     fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_ERROR, error);
 }
 
+/* Passes one print on to the caller, returns FALSE once no more prints
+ * are wanted */
+static gboolean
+fpi_device_list_add (FpDevice *device, FpListData *data, FpPrint *print)
+{
+  if (data->stopped)
+    return FALSE;
+
+  if (!data->streamed)
+    {
+      if (!data->prints)
+        data->prints = g_ptr_array_new_with_free_func (g_object_unref);
+      g_ptr_array_add (data->prints, g_object_ref (print));
+      return TRUE;
+    }
+
+  if (!data->list_cb (device, print, data->list_data))
+    {
+      g_debug ("Listing was stopped by the caller");
+      data->stopped = TRUE;
+    }
+
+  return !data->stopped;
+}
+
+/**
+ * fpi_device_list_report:
+ * @device: The #FpDevice
+ * @print: (transfer floating): A #FpPrint that is stored on the device
+ *
+ * Report a print as soon as it is found while listing, instead of
+ * collecting all of them for fpi_device_list_complete(). This lets the
+ * caller of fp_device_list_prints_streamed() handle prints right away.
+ *
+ * Returns: %FALSE if the caller does not want any more prints, the driver
+ *   should then stop listing and call fpi_device_list_complete()
+ */
+gboolean
+fpi_device_list_report (FpDevice *device,
+                        FpPrint  *print)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  g_autoptr(FpPrint) sunk = NULL;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), FALSE);
+  g_return_val_if_fail (FP_IS_PRINT (print), FALSE);
+  g_return_val_if_fail (priv->current_action == FPI_DEVICE_ACTION_LIST, FALSE);
+
+  sunk = g_object_ref_sink (print);
+
+  return fpi_device_list_add (device, g_task_get_task_data (priv->current_task), sunk);
+}
+
 /**
  * fpi_device_list_complete:
  * @device: The #FpDevice
- * @prints: (element-type FpPrint) (transfer container): Possibly empty array of prints or %NULL on error
+ * @prints: (element-type FpPrint) (transfer container) (nullable): Possibly
+ *   empty array of prints, or %NULL on error or if all prints were reported
+ *   with fpi_device_list_report()
  * @error: The #GError or %NULL on success
  *
- * Finish an ongoing list operation.
+ * Finish an ongoing list operation. The prints in @prints are added after
+ * those that were reported already.
  *
  * Please note that the @prints array will be free'ed using
  * g_ptr_array_unref() and the elements are destroyed automatically.
@@ -1147,6 +2205,9 @@ fpi_device_list_complete (FpDevice  *device,
                           GError    *error)
 {
   FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  g_autoptr(GPtrArray) result = prints;
+  FpListData *data;
+  guint i;
 
   g_return_if_fail (FP_IS_DEVICE (device));
   g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_LIST);
@@ -1155,22 +2216,44 @@ fpi_device_list_complete (FpDevice  *device,
 
   clear_device_cancel_action (device);
 
-  if (prints && error)
+  if (result && error)
     {
       g_warning ("Driver reported back prints and error, ignoring prints");
-      g_clear_pointer (&prints, g_ptr_array_unref);
+      g_clear_pointer (&result, g_ptr_array_unref);
     }
-  else if (!prints && !error)
+
+  if (error)
     {
-      g_warning ("Driver did not pass array but failed to provide an error");
-      error = fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
-                                        "Driver failed to provide a list of prints");
+      fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_ERROR, error);
+      return;
     }
 
-  if (!error)
-    fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_PTR_ARRAY, prints);
-  else
-    fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_ERROR, error);
+  data = g_task_get_task_data (priv->current_task);
+
+  /* Nothing was reported before, pass the array on as it is */
+  if (!data->streamed && !data->prints && result)
+    {
+      fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_PTR_ARRAY,
+                                      g_steal_pointer (&result));
+      return;
+    }
+
+  for (i = 0; result && i < result->len; i++)
+    if (!fpi_device_list_add (device, data, g_ptr_array_index (result, i)))
+      break;
+
+  if (data->streamed)
+    {
+      fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_BOOL,
+                                      GUINT_TO_POINTER (TRUE));
+      return;
+    }
+
+  if (!data->prints)
+    data->prints = g_ptr_array_new_with_free_func (g_object_unref);
+
+  fpi_device_return_task_in_idle (device, FP_DEVICE_TASK_RETURN_PTR_ARRAY,
+                                  g_steal_pointer (&data->prints));
 }
 
 /**
@@ -1198,6 +2281,9 @@ fpi_device_enroll_progress (FpDevice *device,
 
   g_debug ("Device reported enroll progress, reported %i of %i have been completed", completed_stages, priv->nr_enroll_stages);
 
+  if (error)
+    priv->current_stats.retries++;
+
   if (print)
     g_object_ref_sink (print);
 
@@ -1273,7 +2359,11 @@ fpi_device_verify_report (FpDevice      *device,
 
       data->error = error;
 
-      if (error->domain != FP_DEVICE_RETRY)
+      if (error->domain == FP_DEVICE_RETRY)
+        {
+          priv->current_stats.retries++;
+        }
+      else
         {
           g_warning ("Driver reported a verify error that was not in the retry domain, delaying report!");
           call_cb = FALSE;
@@ -1351,7 +2441,11 @@ fpi_device_identify_report (FpDevice *device,
 
       data->error = error;
 
-      if (error->domain != FP_DEVICE_RETRY)
+      if (error->domain == FP_DEVICE_RETRY)
+        {
+          priv->current_stats.retries++;
+        }
+      else
         {
           g_warning ("Driver reported a verify error that was not in the retry domain, delaying report!");
           call_cb = FALSE;
@@ -1369,3 +2463,145 @@ fpi_device_identify_report (FpDevice *device,
   if (call_cb && data->match_cb)
     data->match_cb (device, data->match, data->print, data->match_data, data->error);
 }
+
+/**
+ * fpi_device_identify_is_continuous:
+ * @device: The #FpDevice
+ *
+ * Whether the running identify operation was started with
+ * fp_device_identify_continuous(). Drivers that can stay armed between
+ * touches should then call fpi_device_identify_continue() after
+ * reporting each result with fpi_device_identify_report(), instead of
+ * completing the operation. Otherwise the operation is started again
+ * once it completes.
+ *
+ * Returns: %TRUE if the identify operation continues after a result
+ */
+gboolean
+fpi_device_identify_is_continuous (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpMatchData *data;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), FALSE);
+
+  if (priv->current_action != FPI_DEVICE_ACTION_IDENTIFY)
+    return FALSE;
+
+  data = g_task_get_task_data (priv->current_task);
+
+  return data->continuous;
+}
+
+/**
+ * fpi_device_identify_continue:
+ * @device: The #FpDevice
+ *
+ * Prepare a continuous identify operation for the next touch, once the
+ * result of the previous one was reported with fpi_device_identify_report().
+ * The operation keeps running, and the driver reports the next result as
+ * usual.
+ */
+void
+fpi_device_identify_continue (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpMatchData *data;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_IDENTIFY);
+
+  data = g_task_get_task_data (priv->current_task);
+
+  g_return_if_fail (data->continuous);
+  g_return_if_fail (data->result_reported);
+
+  g_debug ("Continuing identify with the next touch");
+
+  data->result_reported = FALSE;
+  g_clear_object (&data->match);
+  g_clear_object (&data->print);
+  g_clear_error (&data->error);
+  g_clear_pointer (&data->candidates, g_ptr_array_unref);
+  g_clear_pointer (&data->scores, g_array_unref);
+
+  /* Every touch gets its own statistics */
+  fpi_device_stats_finish (device);
+  fpi_device_stats_start (device);
+}
+
+/**
+ * fpi_device_retry_continue:
+ * @device: The #FpDevice
+ *
+ * Keep a verify or identify operation running after a retry error was
+ * reported with fpi_device_verify_report() or fpi_device_identify_report(),
+ * instead of completing it with that error. The match callback was already
+ * called with the retry error, the driver then reports the result of the
+ * next scan as usual.
+ */
+void
+fpi_device_retry_continue (FpDevice *device)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpMatchData *data;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_VERIFY ||
+                    priv->current_action == FPI_DEVICE_ACTION_IDENTIFY);
+
+  data = g_task_get_task_data (priv->current_task);
+
+  g_return_if_fail (data->result_reported);
+  g_return_if_fail (data->error && data->error->domain == FP_DEVICE_RETRY);
+
+  g_debug ("Continuing operation after a retry");
+
+  data->result_reported = FALSE;
+  g_clear_error (&data->error);
+}
+
+/**
+ * fpi_device_identify_report_scores:
+ * @device: The #FpDevice
+ * @candidates: (transfer full) (element-type FpPrint): The best scoring
+ *   prints from the gallery, best first
+ * @scores: (transfer full) (element-type gint): The score of each of
+ *   @candidates
+ *
+ * Report the best scoring templates of an identify operation, if
+ * fpi_device_get_identify_max_results() is not 0. This must be called
+ * before fpi_device_identify_complete().
+ */
+void
+fpi_device_identify_report_scores (FpDevice  *device,
+                                   GPtrArray *candidates,
+                                   GArray    *scores)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpMatchData *data;
+  guint i;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_IDENTIFY);
+  g_return_if_fail (candidates != NULL && scores != NULL);
+  g_return_if_fail (candidates->len == scores->len);
+
+  data = g_task_get_task_data (priv->current_task);
+
+  for (i = 0; i < candidates->len; i++)
+    {
+      if (!g_ptr_array_find (data->gallery, g_ptr_array_index (candidates, i), NULL))
+        {
+          g_warning ("Driver reported a score for a print that was not in the gallery, ignoring scores.");
+          g_ptr_array_unref (candidates);
+          g_array_unref (scores);
+          return;
+        }
+    }
+
+  g_clear_pointer (&data->candidates, g_ptr_array_unref);
+  g_clear_pointer (&data->scores, g_array_unref);
+  data->candidates = candidates;
+  data->scores = scores;
+}
@@ -58,6 +58,8 @@ struct _FpIdEntry
  *   fpi_device_set_nr_enroll_stages() from @probe if this is dynamic.
  * @scan_type: The scan type of supported devices; use
  *   fpi_device_set_scan_type() from @probe if this is dynamic.
+ * @probe_timeout: Milliseconds after which #FpContext gives up on a device
+ *   that has not finished probing, 0 means the default of 10 seconds.
  * @usb_discover: Class method to check whether a USB device is supported by
  *  the driver. Should return 0 if the device is unsupported and a positive
  *  score otherwise. The default score is 50 and the driver with the highest
@@ -71,12 +73,23 @@ struct _FpIdEntry
  * @open: Open the device for further operations. Any of the normal actions are
  *   guaranteed to only happen when the device is open (this includes delete).
  * @close: Close the device again
+ * @suspend: Called before the system suspends. Drivers can save the session
+ *   state that @resume needs. Optional, a driver without it is reopened on
+ *   resume.
+ * @resume: Called after the system resumed. Drivers should quickly check that
+ *   the device and the saved session are still valid. If an error is
+ *   returned, the device is closed and opened again.
  * @enroll: Start an enroll operation
  * @verify: Start a verify operation
  * @identify: Start an identify operation
  * @capture: Start a capture operation
  * @list: List prints stored on the device
  * @delete: Delete a print from the device
+ * @delete_prints: Delete several prints from the device at once, see
+ *   fpi_device_get_delete_prints_data(). Optional, without it @delete is
+ *   called for each print.
+ * @clear_storage: Delete all prints from the device. Optional, without it
+ *   the prints are listed and then deleted.
  * @cancel: Called on cancellation, this is a convenience to not need to handle
  *   the #GCancellable directly by using fpi_device_get_cancellable().
  *
@@ -116,17 +129,23 @@ struct _FpDeviceClass
   gint       nr_enroll_stages;
   FpScanType scan_type;
 
+  guint      probe_timeout;
+
   /* Callbacks */
   gint (*usb_discover) (GUsbDevice *usb_device);
   void (*probe)    (FpDevice *device);
   void (*open)     (FpDevice *device);
   void (*close)    (FpDevice *device);
+  void (*suspend)  (FpDevice *device);
+  void (*resume)   (FpDevice *device);
   void (*enroll)   (FpDevice *device);
   void (*verify)   (FpDevice *device);
   void (*identify) (FpDevice *device);
   void (*capture)  (FpDevice *device);
   void (*list)     (FpDevice *device);
   void (*delete)   (FpDevice * device);
+  void (*delete_prints) (FpDevice *device);
+  void (*clear_storage) (FpDevice *device);
 
   void (*cancel)   (FpDevice *device);
 };
@@ -141,6 +160,25 @@ struct _FpDeviceClass
 typedef void (*FpTimeoutFunc) (FpDevice *device,
                                gpointer  user_data);
 
+/**
+ * FpiDeviceTimer:
+ *
+ * A timer that is embedded into the structure it belongs to and started
+ * with fpi_device_timer_start(). All timers of a device share a single
+ * #GSource, so starting and stopping them neither allocates nor changes
+ * the main context. Zero initialized, it is stopped.
+ *
+ * The fields are private.
+ */
+typedef struct _FpiDeviceTimer
+{
+  /*< private >*/
+  GList         link;
+  gint64        deadline;
+  FpTimeoutFunc func;
+  gpointer      user_data;
+} FpiDeviceTimer;
+
 /**
  * FpiDeviceAction:
  * @FPI_DEVICE_ACTION_NONE: No action is active.
@@ -153,6 +191,9 @@ typedef void (*FpTimeoutFunc) (FpDevice *device,
  * @FPI_DEVICE_ACTION_CAPTURE: Device is currently capturing an image.
  * @FPI_DEVICE_ACTION_LIST: Device stored prints are being queried.
  * @FPI_DEVICE_ACTION_DELETE: Device stored print is being deleted.
+ * @FPI_DEVICE_ACTION_SUSPEND: Device is being prepared for system suspend.
+ * @FPI_DEVICE_ACTION_RESUME: Device is being validated after system resume.
+ * @FPI_DEVICE_ACTION_CLEAR_STORAGE: Device stored prints are being deleted.
  *
  * Current active action of the device. A driver can retrieve the action.
  */
@@ -167,6 +208,9 @@ typedef enum {
   FPI_DEVICE_ACTION_CAPTURE,
   FPI_DEVICE_ACTION_LIST,
   FPI_DEVICE_ACTION_DELETE,
+  FPI_DEVICE_ACTION_SUSPEND,
+  FPI_DEVICE_ACTION_RESUME,
+  FPI_DEVICE_ACTION_CLEAR_STORAGE,
 } FpiDeviceAction;
 
 GUsbDevice  *fpi_device_get_usb_device (FpDevice *device);
@@ -189,6 +233,12 @@ GError * fpi_device_error_new_msg (FpDeviceError error,
 
 guint64 fpi_device_get_driver_data (FpDevice *device);
 
+void     fpi_device_store_calibration (FpDevice *device,
+                                       GBytes   *data);
+GBytes * fpi_device_lookup_calibration (FpDevice *device,
+                                        gint64    max_age);
+void     fpi_device_clear_calibration (FpDevice *device);
+
 void fpi_device_get_enroll_data (FpDevice *device,
                                  FpPrint **print);
 
@@ -198,17 +248,32 @@ void fpi_device_get_verify_data (FpDevice *device,
                                  FpPrint **print);
 void fpi_device_get_identify_data (FpDevice   *device,
                                    GPtrArray **prints);
+guint fpi_device_get_identify_max_results (FpDevice *device);
+FpGallery *fpi_device_get_enroll_duplicate_gallery (FpDevice *device);
 void fpi_device_get_delete_data (FpDevice *device,
                                  FpPrint **print);
+void fpi_device_get_delete_prints_data (FpDevice   *device,
+                                        GPtrArray **prints);
 GCancellable *fpi_device_get_cancellable (FpDevice *device);
 
 
+GMainContext *fpi_device_get_main_context (FpDevice *device);
+
 GSource * fpi_device_add_timeout (FpDevice      *device,
                                   gint           interval,
                                   FpTimeoutFunc  func,
                                   gpointer       user_data,
                                   GDestroyNotify destroy_notify);
 
+void fpi_device_timer_start (FpDevice       *device,
+                             FpiDeviceTimer *timer,
+                             gint            interval,
+                             FpTimeoutFunc   func,
+                             gpointer        user_data);
+void fpi_device_timer_stop (FpDevice       *device,
+                            FpiDeviceTimer *timer);
+gboolean fpi_device_timer_is_active (FpiDeviceTimer *timer);
+
 void fpi_device_set_nr_enroll_stages (FpDevice *device,
                                       gint      enroll_stages);
 
@@ -226,6 +291,10 @@ void fpi_device_open_complete (FpDevice *device,
                                GError   *error);
 void fpi_device_close_complete (FpDevice *device,
                                 GError   *error);
+void fpi_device_suspend_complete (FpDevice *device,
+                                  GError   *error);
+void fpi_device_resume_complete (FpDevice *device,
+                                 GError   *error);
 void fpi_device_enroll_complete (FpDevice *device,
                                  FpPrint  *print,
                                  GError   *error);
@@ -241,6 +310,10 @@ void fpi_device_delete_complete (FpDevice *device,
 void fpi_device_list_complete (FpDevice  *device,
                                GPtrArray *prints,
                                GError    *error);
+void fpi_device_clear_storage_complete (FpDevice *device,
+                                        GError   *error);
+gboolean fpi_device_list_report (FpDevice *device,
+                                 FpPrint  *print);
 
 void fpi_device_enroll_progress (FpDevice *device,
                                  gint      completed_stages,
@@ -254,5 +327,12 @@ void fpi_device_identify_report (FpDevice *device,
                                  FpPrint  *match,
                                  FpPrint  *print,
                                  GError   *error);
+void fpi_device_identify_report_scores (FpDevice  *device,
+                                        GPtrArray *candidates,
+                                        GArray    *scores);
+
+gboolean fpi_device_identify_is_continuous (FpDevice *device);
+void fpi_device_identify_continue (FpDevice *device);
+void fpi_device_retry_continue (FpDevice *device);
 
 G_END_DECLS
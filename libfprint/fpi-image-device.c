@@ -20,8 +20,11 @@
 #define FP_COMPONENT "image_device"
 #include "fpi-log.h"
 
+#include "fpi-image.h"
+#include "fp-device-private.h"
 #include "fp-image-device-private.h"
 #include "fp-image-device.h"
+#include "fpi-trace.h"
 
 /**
  * SECTION: fpi-image-device
@@ -41,6 +44,19 @@ fp_image_device_get_instance_private (FpImageDevice *self)
                             g_type_class_get_instance_private_offset (img_class));
 }
 
+#define POLL_FAST_WINDOW_US (2 * G_USEC_PER_SEC)
+#define POLL_MIN_BACKOFF_MS 5
+#define POLL_MAX_DELAY_MS 160
+
+static void
+fp_image_device_reset_poll_delay (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  priv->poll_delay_ms = 0;
+  priv->poll_fast_until = g_get_monotonic_time () + POLL_FAST_WINDOW_US;
+}
+
 /* Private shared functions */
 
 void
@@ -51,6 +67,9 @@ fpi_image_device_activate (FpImageDevice *self)
 
   g_assert (!priv->active);
 
+  priv->finger_present = FALSE;
+  fp_image_device_reset_poll_delay (self);
+
   /* We don't have a neutral ACTIVE state, but we always will
    * go into WAIT_FINGER_ON afterwards. */
   priv->state = FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON;
@@ -58,12 +77,78 @@ fpi_image_device_activate (FpImageDevice *self)
 
   /* We might have been waiting for deactivation to finish before
    * starting the next operation. */
-  g_clear_handle_id (&priv->pending_activation_timeout_id, g_source_remove);
+  g_clear_pointer (&priv->pending_activation_timeout, g_source_destroy);
 
   fp_dbg ("Activating image device\n");
   cls->activate (self);
 }
 
+/* Minutiae detection of an enroll capture. Detections run in the
+ * background while the next image is captured, their results are
+ * reported strictly in capture order. */
+typedef struct
+{
+  FpImageDevice *self;
+  FpImage       *image;
+  GError        *error;
+  gboolean       done;
+  /* Whether the next capture has to wait for this result */
+  gboolean       holds_rearm;
+  gint64         start_time;
+} FpImageDeviceDetection;
+
+static void
+fp_image_device_detection_free (FpImageDeviceDetection *detection)
+{
+  g_clear_object (&detection->image);
+  g_clear_error (&detection->error);
+  g_free (detection);
+}
+
+static void
+fp_image_device_stats_minutiae_detected (FpImageDevice *self,
+                                         FpImage       *image,
+                                         gint64         start_time)
+{
+  FpOperationStats *stats = fpi_device_get_current_stats (FP_DEVICE (self));
+  GPtrArray *minutiae = fp_image_get_minutiae (image);
+
+  stats->minutiae_time = g_get_monotonic_time () - start_time;
+  stats->n_minutiae = minutiae ? minutiae->len : -1;
+}
+
+static void
+fp_image_device_enroll_abandon_detections (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  FpImageDeviceDetection *detection;
+
+  while ((detection = g_queue_pop_head (&priv->enroll_detections)))
+    {
+      /* Running detections are freed once they return */
+      if (detection->done)
+        fp_image_device_detection_free (detection);
+      else
+        detection->self = NULL;
+    }
+}
+
+static void
+fp_image_device_enroll_abandon_duplicate_checks (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  /* Cancelled checks are ignored once they return */
+  if (priv->duplicate_cancellable)
+    {
+      g_cancellable_cancel (priv->duplicate_cancellable);
+      g_clear_object (&priv->duplicate_cancellable);
+    }
+
+  priv->duplicate_checks_pending = 0;
+  priv->enroll_complete_pending = FALSE;
+}
+
 void
 fpi_image_device_deactivate (FpImageDevice *self)
 {
@@ -71,6 +156,14 @@ fpi_image_device_deactivate (FpImageDevice *self)
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
   FpImageDeviceClass *cls = FP_IMAGE_DEVICE_GET_CLASS (device);
 
+  /* Results of enroll captures that are still being processed are of
+   * no interest anymore. */
+  fp_image_device_enroll_abandon_detections (self);
+  fp_image_device_enroll_abandon_duplicate_checks (self);
+
+  g_clear_pointer (&priv->keep_active_timeout, g_source_destroy);
+  priv->standby = FALSE;
+
   if (!priv->active)
     {
       /* XXX: We currently deactivate both from minutiae scan result
@@ -88,6 +181,55 @@ fpi_image_device_deactivate (FpImageDevice *self)
   cls->deactivate (self);
 }
 
+static gboolean
+keep_active_timeout (gpointer user_data)
+{
+  FpImageDevice *self = FP_IMAGE_DEVICE (user_data);
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  priv->keep_active_timeout = NULL;
+
+  fp_dbg ("No new operation while keeping the device active");
+  fpi_image_device_deactivate (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Called once an operation has completed. Unless it failed, the device may
+ * be kept active for a while, it then stays waiting for the finger to be
+ * removed until the next operation resumes it. */
+static void
+fp_image_device_operation_done (FpImageDevice *self, gboolean success)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  if (!success || priv->keep_active_ms == 0 || !priv->active ||
+      priv->state != FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF)
+    {
+      fpi_image_device_deactivate (self);
+      return;
+    }
+
+  fp_dbg ("Keeping image device active for %u ms", priv->keep_active_ms);
+
+  g_assert (priv->keep_active_timeout == NULL);
+  priv->standby = TRUE;
+  priv->keep_active_timeout = g_timeout_source_new (priv->keep_active_ms);
+  g_source_set_callback (priv->keep_active_timeout,
+                         keep_active_timeout, self, NULL);
+  g_source_attach (priv->keep_active_timeout,
+                   fpi_device_get_main_context (FP_DEVICE (self)));
+  g_source_unref (priv->keep_active_timeout);
+}
+
+/* Cheap check whether the finger covered enough of the sensor, to avoid
+ * running minutiae detection on images that will be rejected anyway.
+ * Blocks of 16x16 pixels with a standard deviation below 8 grey levels
+ * are considered empty. */
+#define QUALITY_GATE_BLOCK_SIZE 16
+#define QUALITY_GATE_MIN_SQ_DEV 64
+#define QUALITY_GATE_MIN_COVERAGE 0.1
+
 /* Static helper functions */
 
 static void
@@ -100,20 +242,63 @@ fp_image_device_change_state (FpImageDevice *self, FpiImageDeviceState state)
 
   /* We might have been waiting for the finger to go OFF to start the
    * next operation. */
-  g_clear_handle_id (&priv->pending_activation_timeout_id, g_source_remove);
+  g_clear_pointer (&priv->pending_activation_timeout, g_source_destroy);
 
   fp_dbg ("Image device internal state change from %d to %d\n", priv->state, state);
 
+  if (state == FPI_IMAGE_DEVICE_STATE_CAPTURE)
+    {
+      FpOperationStats *stats = fpi_device_get_current_stats (FP_DEVICE (self));
+
+      if (stats->time_to_finger < 0)
+        stats->time_to_finger = fpi_device_get_stats_elapsed (FP_DEVICE (self));
+      priv->capture_start_time = g_get_monotonic_time ();
+    }
+
+  if (state == FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON)
+    fp_image_device_reset_poll_delay (self);
+
   priv->state = state;
   g_object_notify (G_OBJECT (self), "fpi-image-device-state");
   g_signal_emit_by_name (self, "fpi-image-device-state-changed", priv->state);
 }
 
+/* Starts the current operation on a device that was kept active after the
+ * previous one. Returns FALSE if the device was not kept active, or if it
+ * is being deactivated because the finger was not removed yet. */
+gboolean
+fpi_image_device_resume (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  if (!priv->standby)
+    return FALSE;
+
+  g_clear_pointer (&priv->keep_active_timeout, g_source_destroy);
+  priv->standby = FALSE;
+
+  /* Same as after a deactivation, the finger needs to be lifted first. */
+  if (priv->finger_present)
+    {
+      fpi_image_device_deactivate (self);
+      return FALSE;
+    }
+
+  fp_dbg ("Resuming image device that was kept active");
+  fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON);
+
+  return TRUE;
+}
+
 static void
 fp_image_device_enroll_maybe_await_finger_on (FpImageDevice *self)
 {
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
 
+  /* All stages are done, only the duplicate checks are still running */
+  if (priv->enroll_stage == priv->enroll_stages)
+    return;
+
   if (priv->enroll_await_on_pending)
     {
       priv->enroll_await_on_pending = FALSE;
@@ -125,6 +310,390 @@ fp_image_device_enroll_maybe_await_finger_on (FpImageDevice *self)
     }
 }
 
+/* Like for enroll, a continuous identify waits for the next touch once
+ * both the result was reported and the finger was removed. So does a
+ * verify or identify that retries a bad scan. */
+static void
+fp_image_device_identify_maybe_await_finger_on (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  if (priv->identify_await_on_pending)
+    {
+      priv->identify_await_on_pending = FALSE;
+      fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON);
+    }
+  else
+    {
+      priv->identify_await_on_pending = TRUE;
+    }
+}
+
+/* Whether a bad scan keeps the verify or identify operation running */
+static gboolean
+fp_image_device_can_retry (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  FpiDeviceAction action = fpi_device_get_current_action (FP_DEVICE (self));
+
+  if (action != FPI_DEVICE_ACTION_VERIFY && action != FPI_DEVICE_ACTION_IDENTIFY)
+    return FALSE;
+
+  return priv->scan_retries < priv->max_scan_retries;
+}
+
+static void
+fp_image_device_retry_continue (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  priv->scan_retries++;
+  g_debug ("Retrying scan %u of %u within the operation",
+           priv->scan_retries, priv->max_scan_retries);
+
+  fpi_device_retry_continue (FP_DEVICE (self));
+}
+
+static void
+fp_image_device_enroll_finish (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  FpDevice *device = FP_DEVICE (self);
+  FpPrint *enroll_print;
+
+  fpi_device_get_enroll_data (device, &enroll_print);
+
+  if (priv->enroll_consolidation)
+    fpi_print_consolidate (enroll_print, priv->bz3_threshold);
+
+  fpi_device_enroll_complete (device, g_object_ref (enroll_print), NULL);
+  fp_image_device_operation_done (self, TRUE);
+}
+
+/* Compares an enroll stage to the duplicate gallery in the background,
+ * while the next stage is captured. */
+typedef struct
+{
+  GPtrArray *templates;
+  FpPrint   *print;
+  gint       bz3_threshold;
+} FpImageDeviceDuplicateCheck;
+
+static void
+fp_image_device_duplicate_check_free (FpImageDeviceDuplicateCheck *check)
+{
+  g_ptr_array_unref (check->templates);
+  g_object_unref (check->print);
+  g_free (check);
+}
+
+static void
+fp_image_device_duplicate_check_thread (GTask        *task,
+                                        gpointer      source_object,
+                                        gpointer      task_data,
+                                        GCancellable *cancellable)
+{
+  FpImageDeviceDuplicateCheck *check = task_data;
+  GError *error = NULL;
+  FpPrint *match;
+
+  match = fpi_print_bz3_identify (check->templates, check->print,
+                                  check->bz3_threshold, NULL, &error);
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, match != NULL);
+}
+
+static void
+fp_image_device_duplicate_checked (GObject      *source_object,
+                                   GAsyncResult *res,
+                                   gpointer      user_data)
+{
+  FpImageDevice *self = FP_IMAGE_DEVICE (source_object);
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  g_autoptr(GError) error = NULL;
+  gboolean duplicate;
+
+  /* The enroll operation ended while the check was running */
+  if (g_cancellable_is_cancelled (g_task_get_cancellable (G_TASK (res))))
+    return;
+
+  duplicate = g_task_propagate_boolean (G_TASK (res), &error);
+  priv->duplicate_checks_pending -= 1;
+
+  if (duplicate || error)
+    {
+      if (!error)
+        error = fpi_device_error_new (FP_DEVICE_ERROR_DATA_DUPLICATE);
+
+      g_debug ("Aborting enroll: %s", error->message);
+      fpi_device_action_error (FP_DEVICE (self), g_steal_pointer (&error));
+      fpi_image_device_deactivate (self);
+      return;
+    }
+
+  if (priv->duplicate_checks_pending == 0 && priv->enroll_complete_pending)
+    {
+      priv->enroll_complete_pending = FALSE;
+      fp_image_device_enroll_finish (self);
+    }
+}
+
+static void
+fp_image_device_enroll_check_duplicate (FpImageDevice *self,
+                                        FpPrint       *print)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  FpGallery *gallery = fpi_device_get_enroll_duplicate_gallery (FP_DEVICE (self));
+  FpImageDeviceDuplicateCheck *check;
+  g_autoptr(GPtrArray) templates = NULL;
+  g_autoptr(GTask) task = NULL;
+
+  if (!gallery)
+    return;
+
+  templates = fp_gallery_get_compatible_prints (gallery, FP_DEVICE (self));
+  if (templates->len == 0)
+    return;
+
+  if (!priv->duplicate_cancellable)
+    priv->duplicate_cancellable = g_cancellable_new ();
+
+  check = g_new0 (FpImageDeviceDuplicateCheck, 1);
+  check->templates = g_steal_pointer (&templates);
+  check->print = g_object_ref (print);
+  check->bz3_threshold = priv->bz3_threshold;
+
+  task = g_task_new (self, priv->duplicate_cancellable,
+                     fp_image_device_duplicate_checked, NULL);
+  g_task_set_task_data (task, check,
+                        (GDestroyNotify) fp_image_device_duplicate_check_free);
+
+  priv->duplicate_checks_pending += 1;
+  g_task_run_in_thread (task, fp_image_device_duplicate_check_thread);
+}
+
+/* Whether enough stages were collected that all match each other, in
+ * which case the enrollment does not need the remaining ones. A single
+ * stage that disagrees turns this off for the rest of the enrollment. */
+static gboolean
+fp_image_device_enroll_can_stop (FpImageDevice *self,
+                                 FpPrint       *print,
+                                 FpImage       *image)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  g_autoptr(FpiBz3Probe) probe = NULL;
+  GPtrArray *minutiae = fp_image_get_minutiae (image);
+  gint min_score = priv->early_stop_min_score;
+  guint i;
+
+  if (min_score == 0)
+    min_score = priv->bz3_threshold;
+
+  if (priv->early_stop_min_stages == 0 || !priv->enroll_stages_agree)
+    return FALSE;
+
+  if (!minutiae || (gint) minutiae->len < priv->early_stop_min_minutiae)
+    {
+      g_debug ("Enroll stage has too few minutiae to stop early");
+      priv->enroll_stages_agree = FALSE;
+      return FALSE;
+    }
+
+  if (!priv->enroll_stage_prints)
+    priv->enroll_stage_prints = g_ptr_array_new_with_free_func (g_object_unref);
+
+  if (priv->enroll_stage_prints->len > 0)
+    {
+      probe = fpi_print_bz3_probe_new (print, NULL);
+      if (!probe)
+        {
+          priv->enroll_stages_agree = FALSE;
+          return FALSE;
+        }
+    }
+
+  for (i = 0; i < priv->enroll_stage_prints->len; i++)
+    {
+      FpPrint *stage = g_ptr_array_index (priv->enroll_stage_prints, i);
+
+      if (fpi_print_bz3_probe_match (probe, stage, min_score, NULL) != FPI_MATCH_SUCCESS)
+        {
+          g_debug ("Enroll stage does not agree with stage %u", i + 1);
+          priv->enroll_stages_agree = FALSE;
+          g_clear_pointer (&priv->enroll_stage_prints, g_ptr_array_unref);
+          return FALSE;
+        }
+    }
+
+  g_ptr_array_add (priv->enroll_stage_prints, g_object_ref (print));
+
+  return priv->enroll_stage_prints->len >= priv->early_stop_min_stages;
+}
+
+/* Returns FALSE if the enroll operation was finished, or only waits for
+ * the duplicate checks to finish */
+static gboolean
+fp_image_device_enroll_report (FpImageDevice          *self,
+                               FpImageDeviceDetection *detection)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  FpDevice *device = FP_DEVICE (self);
+  g_autoptr(FpPrint) print = NULL;
+  GError *error = g_steal_pointer (&detection->error);
+  FpPrint *enroll_print;
+
+  if (error)
+    {
+      /* Cancel operation . */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          fpi_device_action_error (device, error);
+          fpi_image_device_deactivate (self);
+          return FALSE;
+        }
+
+      /* Replace error with a retry condition. */
+      g_warning ("Failed to detect minutiae: %s", error->message);
+      g_clear_pointer (&error, g_error_free);
+
+      error = fpi_device_retry_new_msg (FP_DEVICE_RETRY_GENERAL, "Minutiae detection failed, please retry");
+    }
+  else
+    {
+      print = fp_print_new (device);
+      fpi_print_set_type (print, FPI_PRINT_NBIS);
+      if (!fpi_print_add_from_image_full (print, detection->image,
+                                          priv->max_minutiae, &error))
+        {
+          g_clear_object (&print);
+
+          if (error->domain != FP_DEVICE_RETRY)
+            {
+              fpi_device_action_error (device, error);
+              fpi_image_device_deactivate (self);
+              return FALSE;
+            }
+        }
+    }
+
+  fpi_device_get_enroll_data (device, &enroll_print);
+
+  if (print)
+    {
+      fpi_print_add_print (enroll_print, print);
+      priv->enroll_stage += 1;
+      fp_image_device_enroll_check_duplicate (self, print);
+
+      if (priv->enroll_stage < priv->enroll_stages &&
+          fp_image_device_enroll_can_stop (self, print, detection->image))
+        {
+          g_debug ("Enroll stages agree, completing after %d of %d stages",
+                   priv->enroll_stage, priv->enroll_stages);
+          priv->enroll_stages = priv->enroll_stage;
+        }
+    }
+
+  fpi_device_enroll_progress (device, priv->enroll_stage,
+                              g_steal_pointer (&print), error);
+
+  /* Start another scan or deactivate. */
+  if (priv->enroll_stage == priv->enroll_stages)
+    {
+      if (priv->duplicate_checks_pending > 0)
+        {
+          g_debug ("Waiting for %u duplicate checks before completing enroll",
+                   priv->duplicate_checks_pending);
+          priv->enroll_complete_pending = TRUE;
+          return FALSE;
+        }
+
+      fp_image_device_enroll_finish (self);
+      return FALSE;
+    }
+
+  if (detection->holds_rearm)
+    fp_image_device_enroll_maybe_await_finger_on (self);
+
+  return TRUE;
+}
+
+static void
+fpi_image_device_enroll_minutiae_detected (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  FpImageDeviceDetection *detection = user_data;
+  FpImageDevice *self = detection->self;
+  FpImageDevicePrivate *priv;
+
+  detection->done = TRUE;
+  fp_image_detect_minutiae_finish (detection->image, res, &detection->error);
+
+  /* The enroll operation ended while detection was running */
+  if (!self)
+    {
+      fp_image_device_detection_free (detection);
+      return;
+    }
+
+  priv = fp_image_device_get_instance_private (self);
+
+  fp_image_device_stats_minutiae_detected (self, detection->image,
+                                           detection->start_time);
+
+  /* Report everything that is in order, this may end the operation
+   * which also abandons all remaining detections. */
+  while ((detection = g_queue_peek_head (&priv->enroll_detections)) && detection->done)
+    {
+      g_queue_pop_head (&priv->enroll_detections);
+
+      if (!fp_image_device_enroll_report (self, detection))
+        {
+          fp_image_device_detection_free (detection);
+          break;
+        }
+
+      fp_image_device_detection_free (detection);
+    }
+}
+
+/* Scores the whole gallery and reports the best templates, returns the
+ * best one if it matches. */
+static FpPrint *
+fp_image_device_identify_scores (FpImageDevice *self,
+                                 GPtrArray     *templates,
+                                 FpPrint       *print,
+                                 guint          max_results,
+                                 GError       **error)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  g_autoptr(GArray) results = NULL;
+  GPtrArray *candidates;
+  GArray *scores;
+  guint i;
+
+  results = fpi_print_bz3_identify_scores (templates, print, max_results, error);
+  if (!results)
+    return NULL;
+
+  candidates = g_ptr_array_new_full (results->len, g_object_unref);
+  scores = g_array_sized_new (FALSE, FALSE, sizeof (gint), results->len);
+  for (i = 0; i < results->len; i++)
+    {
+      FpiBz3Score *result = &g_array_index (results, FpiBz3Score, i);
+
+      g_ptr_array_add (candidates, g_object_ref (result->template));
+      g_array_append_val (scores, result->score);
+    }
+  fpi_device_identify_report_scores (FP_DEVICE (self), candidates, scores);
+
+  if (results->len == 0 ||
+      g_array_index (results, FpiBz3Score, 0).score < priv->bz3_threshold)
+    return NULL;
+
+  return g_array_index (results, FpiBz3Score, 0).template;
+}
+
 static void
 fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
@@ -135,6 +704,8 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
   FpDevice *device = FP_DEVICE (self);
   FpImageDevicePrivate *priv;
   FpiDeviceAction action;
+  gboolean success;
+  gboolean retry;
 
   /* Note: We rely on the device to not disappear during an operation. */
 
@@ -158,10 +729,13 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
   priv = fp_image_device_get_instance_private (FP_IMAGE_DEVICE (device));
   action = fpi_device_get_current_action (device);
 
+  fp_image_device_stats_minutiae_detected (self, image, priv->detect_start_time);
+
   if (action == FPI_DEVICE_ACTION_CAPTURE)
     {
+      success = error == NULL;
       fpi_device_capture_complete (device, g_steal_pointer (&image), error);
-      fpi_image_device_deactivate (self);
+      fp_image_device_operation_done (self, success);
       return;
     }
 
@@ -169,7 +743,7 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
     {
       print = fp_print_new (device);
       fpi_print_set_type (print, FPI_PRINT_NBIS);
-      if (!fpi_print_add_from_image (print, image, &error))
+      if (!fpi_print_add_from_image_full (print, image, priv->max_minutiae, &error))
         {
           g_clear_object (&print);
 
@@ -182,78 +756,91 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
         }
     }
 
-  if (action == FPI_DEVICE_ACTION_ENROLL)
+  if (action == FPI_DEVICE_ACTION_VERIFY)
     {
-      FpPrint *enroll_print;
-      fpi_device_get_enroll_data (device, &enroll_print);
+      FpPrint *template;
+      FpiMatchResult result;
 
+      fpi_device_get_verify_data (device, &template);
       if (print)
         {
-          fpi_print_add_print (enroll_print, print);
-          priv->enroll_stage += 1;
-        }
+          FpOperationStats *stats = fpi_device_get_current_stats (device);
+          gint64 start_time = g_get_monotonic_time ();
 
-      fpi_device_enroll_progress (device, priv->enroll_stage,
-                                  g_steal_pointer (&print), error);
+          result = fpi_print_bz3_match (template, print, priv->bz3_threshold, &error);
 
-      /* Start another scan or deactivate. */
-      if (priv->enroll_stage == IMG_ENROLL_STAGES)
-        {
-          fpi_device_enroll_complete (device, g_object_ref (enroll_print), NULL);
-          fpi_image_device_deactivate (self);
+          stats->match_time = g_get_monotonic_time () - start_time;
+          stats->n_candidates = 1;
         }
       else
         {
-          fp_image_device_enroll_maybe_await_finger_on (FP_IMAGE_DEVICE (device));
+          result = FPI_MATCH_ERROR;
         }
-    }
-  else if (action == FPI_DEVICE_ACTION_VERIFY)
-    {
-      FpPrint *template;
-      FpiMatchResult result;
-
-      fpi_device_get_verify_data (device, &template);
-      if (print)
-        result = fpi_print_bz3_match (template, print, priv->bz3_threshold, &error);
-      else
-        result = FPI_MATCH_ERROR;
 
-      if (!error || error->domain == FP_DEVICE_RETRY)
+      retry = error && error->domain == FP_DEVICE_RETRY;
+      if (!error || retry)
         fpi_device_verify_report (device, result, g_steal_pointer (&print), g_steal_pointer (&error));
+
+      if (retry && fp_image_device_can_retry (self))
+        {
+          fp_image_device_retry_continue (self);
+          fp_image_device_identify_maybe_await_finger_on (self);
+          return;
+        }
+
+      success = error == NULL;
       fpi_device_verify_complete (device, error);
-      fpi_image_device_deactivate (self);
+      fp_image_device_operation_done (self, success);
     }
   else if (action == FPI_DEVICE_ACTION_IDENTIFY)
     {
-      gint i;
       GPtrArray *templates;
       FpPrint *result = NULL;
+      guint max_results = fpi_device_get_identify_max_results (device);
 
       fpi_device_get_identify_data (device, &templates);
-      for (i = 0; !error && i < templates->len; i++)
+      if (!error)
         {
-          FpPrint *template = g_ptr_array_index (templates, i);
-
-          if (fpi_print_bz3_match (template, print, priv->bz3_threshold, &error) == FPI_MATCH_SUCCESS)
-            {
-              result = template;
-              break;
-            }
+          FpOperationStats *stats = fpi_device_get_current_stats (device);
+          gint64 start_time = g_get_monotonic_time ();
+
+          if (max_results > 0)
+            result = fp_image_device_identify_scores (self, templates, print,
+                                                      max_results, &error);
+          else
+            result = fpi_print_identify (templates, print, priv->matcher,
+                                         priv->bz3_threshold, NULL, &error);
+
+          stats->match_time = g_get_monotonic_time () - start_time;
+          stats->n_candidates = templates->len;
         }
 
-      if (!error || error->domain == FP_DEVICE_RETRY)
+      retry = error && error->domain == FP_DEVICE_RETRY;
+      if (!error || retry)
         fpi_device_identify_report (device, result, g_steal_pointer (&print), g_steal_pointer (&error));
+
+      if (retry && fp_image_device_can_retry (self))
+        {
+          fp_image_device_retry_continue (self);
+          fp_image_device_identify_maybe_await_finger_on (self);
+          return;
+        }
+
+      /* Stay armed for the next touch */
+      if (!error && fpi_device_identify_is_continuous (device))
+        {
+          fpi_device_identify_continue (device);
+          fp_image_device_identify_maybe_await_finger_on (self);
+          return;
+        }
+
+      success = error == NULL;
       fpi_device_identify_complete (device, error);
-      fpi_image_device_deactivate (self);
+      fp_image_device_operation_done (self, success);
     }
   else
     {
-      /* XXX: This can be hit currently due to a race condition in the enroll code!
-       *      In that case we scan a further image even though the minutiae for the previous
-       *      one have not yet been detected.
-       *      We need to keep track on the pending minutiae detection and the fact that
-       *      it will finish eventually (or we may need to retry on error and activate the
-       *      device again). */
+      /* Enroll captures are handled by fpi_image_device_enroll_minutiae_detected */
       g_assert_not_reached ();
     }
 }
@@ -283,6 +870,108 @@ fpi_image_device_set_bz3_threshold (FpImageDevice *self,
   priv->bz3_threshold = bz3_threshold;
 }
 
+/**
+ * fpi_image_device_set_max_minutiae:
+ * @self: a #FpImageDevice imaging fingerprint device
+ * @max_minutiae: maximum number of minutiae per print, or 0 for the default
+ *
+ * Limit the number of minutiae that are stored in prints for each image
+ * to the ones with the highest reliability. Large or noisy sensors can
+ * produce a lot of minutiae, which makes every match slower. It should
+ * generally be called from the probe or open callback.
+ */
+void
+fpi_image_device_set_max_minutiae (FpImageDevice *self,
+                                   gint           max_minutiae)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  g_return_if_fail (FP_IS_IMAGE_DEVICE (self));
+  g_return_if_fail (max_minutiae >= 0);
+
+  priv->max_minutiae = max_minutiae;
+}
+
+/**
+ * fpi_image_device_set_enroll_consolidation:
+ * @self: a #FpImageDevice imaging fingerprint device
+ * @consolidate: whether to consolidate enrolled prints
+ *
+ * Merge the prints of the enroll stages into a single print where they
+ * can be registered against each other, see fpi_print_consolidate().
+ * This reduces the number of comparisons for every later match. It
+ * should generally be called from the probe or open callback.
+ */
+void
+fpi_image_device_set_enroll_consolidation (FpImageDevice *self,
+                                           gboolean       consolidate)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  g_return_if_fail (FP_IS_IMAGE_DEVICE (self));
+
+  priv->enroll_consolidation = consolidate;
+}
+
+/**
+ * fpi_image_device_set_enroll_early_stop:
+ * @self: a #FpImageDevice imaging fingerprint device
+ * @min_stages: number of stages after which enroll may finish, or 0 to
+ *   always require all stages
+ * @min_score: BZ3 score that every pair of stages needs to reach, or 0
+ *   for the match threshold of the device
+ * @min_minutiae: number of minutiae that every stage needs to have
+ *
+ * Finish enrollment before all stages are captured once the first
+ * @min_stages stages form a consistent template: each one has at least
+ * @min_minutiae minutiae and all of them match each other with a score of
+ * at least @min_score. If a stage does not pass, all stages are captured as
+ * usual. Each stage is only compared to the earlier ones, so this is cheap.
+ * It should generally be called from the probe or open callback.
+ */
+void
+fpi_image_device_set_enroll_early_stop (FpImageDevice *self,
+                                        gint           min_stages,
+                                        gint           min_score,
+                                        gint           min_minutiae)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  g_return_if_fail (FP_IS_IMAGE_DEVICE (self));
+  g_return_if_fail (min_stages >= 0 && min_stages <= IMG_ENROLL_STAGES);
+  g_return_if_fail (min_score >= 0);
+  g_return_if_fail (min_minutiae >= 0);
+
+  priv->early_stop_min_stages = min_stages;
+  priv->early_stop_min_score = min_score;
+  priv->early_stop_min_minutiae = min_minutiae;
+}
+
+/**
+ * fpi_image_device_set_keep_active:
+ * @self: a #FpImageDevice imaging fingerprint device
+ * @timeout_ms: time in milliseconds to keep the device active, or 0
+ *
+ * Keep the device active for up to @timeout_ms after a capture, verify,
+ * identify or enroll completed, instead of deactivating it right away.
+ * An operation that starts within that time skips the deactivate and
+ * activate sequence of the driver, once the finger has been removed.
+ * While kept active, the device stays in the
+ * %FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF state, so only drivers that idle
+ * in that state should enable this. It should generally be called from the
+ * probe or open callback.
+ */
+void
+fpi_image_device_set_keep_active (FpImageDevice *self,
+                                  guint          timeout_ms)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  g_return_if_fail (FP_IS_IMAGE_DEVICE (self));
+
+  priv->keep_active_ms = timeout_ms;
+}
+
 /**
  * fpi_image_device_report_finger_status:
  * @self: a #FpImageDevice imaging fingerprint device
@@ -317,6 +1006,11 @@ fpi_image_device_report_finger_status (FpImageDevice *self,
 
   g_debug ("Image device reported finger status: %s", present ? "on" : "off");
 
+  if (priv->recorder)
+    fpi_capture_recorder_add_finger_status (priv->recorder, present);
+
+  priv->finger_present = present;
+
   if (present && priv->state == FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON)
     {
       fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_CAPTURE);
@@ -336,13 +1030,127 @@ fpi_image_device_report_finger_status (FpImageDevice *self,
        * minutiae detection to prevent deactivation (without cancellation)
        * from the AWAIT_FINGER_ON state.
        */
-      if (action != FPI_DEVICE_ACTION_ENROLL)
-        fpi_image_device_deactivate (self);
-      else
+      if (action == FPI_DEVICE_ACTION_ENROLL)
         fp_image_device_enroll_maybe_await_finger_on (self);
+      else if ((action == FPI_DEVICE_ACTION_IDENTIFY &&
+                fpi_device_identify_is_continuous (device)) ||
+               priv->identify_await_on_pending ||
+               fp_image_device_can_retry (self))
+        /* A retry was reported, or minutiae detection may still turn the
+         * scan into one. The operation deactivates the device otherwise. */
+        fp_image_device_identify_maybe_await_finger_on (self);
+      else if (priv->keep_active_ms == 0 || priv->pending_activation_timeout)
+        fpi_image_device_deactivate (self);
+      /* Otherwise the device is either kept active already, or it is
+       * decided once minutiae detection completes the operation. */
     }
 }
 
+/**
+ * fpi_image_device_get_poll_delay:
+ * @self: a #FpImageDevice imaging fingerprint device
+ * @min_delay_ms: the delay the driver polls with when the finger is expected
+ * @activity: whether the last poll showed any sign of contact
+ *
+ * Returns the delay before the next finger detection poll, for drivers
+ * that have no finger interrupt. The device is polled every @min_delay_ms
+ * for a short while after it started waiting for the finger and after
+ * any @activity. Afterwards the delay doubles with every idle poll, up to
+ * a limit, to save USB bandwidth and CPU time.
+ *
+ * Returns: the delay in milliseconds, which may be 0
+ */
+guint
+fpi_image_device_get_poll_delay (FpImageDevice *self,
+                                 guint          min_delay_ms,
+                                 gboolean       activity)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  gint64 now = g_get_monotonic_time ();
+
+  if (activity)
+    priv->poll_fast_until = now + POLL_FAST_WINDOW_US;
+
+  if (now < priv->poll_fast_until)
+    priv->poll_delay_ms = min_delay_ms;
+  else
+    priv->poll_delay_ms = CLAMP (priv->poll_delay_ms * 2,
+                                 MAX (min_delay_ms, POLL_MIN_BACKOFF_MS),
+                                 MAX (min_delay_ms, POLL_MAX_DELAY_MS));
+
+  return priv->poll_delay_ms;
+}
+
+/**
+ * fpi_image_device_wants_frame:
+ * @self: a #FpImageDevice imaging fingerprint device
+ *
+ * Checks whether a frame passed to fpi_image_device_report_frame() now
+ * would be delivered. Drivers that need to do extra work to build a
+ * preview frame should check this first, so the work is skipped when no
+ * one is listening or the frame rate limit has been reached.
+ *
+ * Returns: %TRUE if a frame should be reported
+ */
+gboolean
+fpi_image_device_wants_frame (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  guint signal_id;
+
+  g_return_val_if_fail (FP_IS_IMAGE_DEVICE (self), FALSE);
+
+  if (priv->state != FPI_IMAGE_DEVICE_STATE_CAPTURE)
+    return FALSE;
+
+  signal_id = g_signal_lookup ("frame", FP_TYPE_IMAGE_DEVICE);
+  if (!g_signal_has_handler_pending (self, signal_id, 0, TRUE))
+    return FALSE;
+
+  if (priv->frame_max_rate > 0 && priv->last_frame_time > 0 &&
+      g_get_monotonic_time () - priv->last_frame_time < G_USEC_PER_SEC / priv->frame_max_rate)
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * fpi_image_device_report_frame:
+ * @self: a #FpImageDevice imaging fingerprint device
+ * @frame: (transfer none): the #FpImage the sensor currently sees
+ *
+ * Reports an intermediate frame while an image is being captured. The
+ * frame is downsampled as requested by #FpImageDevice:frame-downsample
+ * and passed to the #FpImageDevice::frame signal. Frames that
+ * fpi_image_device_wants_frame() would reject are dropped.
+ *
+ * This does not affect the capture itself, the final image still needs
+ * to be reported using fpi_image_device_image_captured().
+ */
+void
+fpi_image_device_report_frame (FpImageDevice *self,
+                               FpImage       *frame)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  g_autoptr(FpImage) preview = NULL;
+
+  g_return_if_fail (frame != NULL);
+
+  if (priv->recorder && priv->state == FPI_IMAGE_DEVICE_STATE_CAPTURE)
+    fpi_capture_recorder_add_image (priv->recorder, FPI_CAPTURE_RECORD_FRAME, frame);
+
+  if (!fpi_image_device_wants_frame (self))
+    return;
+
+  if (priv->frame_downsample > 1)
+    preview = fpi_image_downsample (frame, priv->frame_downsample);
+  else
+    preview = g_object_ref (frame);
+
+  priv->last_frame_time = g_get_monotonic_time ();
+  g_signal_emit_by_name (self, "frame", preview);
+}
+
 /**
  * fpi_image_device_image_captured:
  * @self: a #FpImageDevice imaging fingerprint device
@@ -373,15 +1181,72 @@ fpi_image_device_image_captured (FpImageDevice *self, FpImage *image)
                     action == FPI_DEVICE_ACTION_CAPTURE);
 
   fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF);
+  priv->last_frame_time = 0;
 
   g_debug ("Image device captured an image");
+  FPI_TRACE3 (image_captured, self, image->width, image->height);
+
+  if (priv->recorder)
+    fpi_capture_recorder_add_image (priv->recorder, FPI_CAPTURE_RECORD_IMAGE, image);
+
+  priv->detect_start_time = g_get_monotonic_time ();
+  fpi_device_get_current_stats (FP_DEVICE (self))->capture_time =
+    priv->detect_start_time - priv->capture_start_time;
+
+  /* A plain capture returns whatever the sensor saw */
+  if (action != FPI_DEVICE_ACTION_CAPTURE)
+    {
+      gdouble coverage = fpi_image_get_coverage (image,
+                                                 QUALITY_GATE_BLOCK_SIZE,
+                                                 QUALITY_GATE_MIN_SQ_DEV);
+
+      if (coverage < QUALITY_GATE_MIN_COVERAGE)
+        {
+          g_debug ("Image only covers %.0f%% of the sensor, rejecting", coverage * 100);
+          g_object_unref (image);
+
+          if (fp_device_get_scan_type (FP_DEVICE (self)) == FP_SCAN_TYPE_SWIPE)
+            fpi_image_device_retry_scan (self, FP_DEVICE_RETRY_TOO_SHORT);
+          else
+            fpi_image_device_retry_scan (self, FP_DEVICE_RETRY_CENTER_FINGER);
+          return;
+        }
+    }
+
+  if (action == FPI_DEVICE_ACTION_ENROLL)
+    {
+      FpImageDeviceDetection *detection = g_new0 (FpImageDeviceDetection, 1);
+
+      detection->self = self;
+      detection->image = image;
+      detection->start_time = priv->detect_start_time;
+
+      /* Only wait for the result before the next capture if it may be
+       * the one that completes the enrollment. Otherwise the device is
+       * re-armed right away once the finger is removed. */
+      detection->holds_rearm = priv->enroll_stage +
+                               g_queue_get_length (&priv->enroll_detections) + 1 >= priv->enroll_stages;
+      if (!detection->holds_rearm)
+        priv->enroll_await_on_pending = TRUE;
+
+      g_queue_push_tail (&priv->enroll_detections, detection);
+      fpi_image_detect_minutiae_owned (image, FP_IMAGE_DETECT_NONE,
+                                       fpi_device_get_cancellable (FP_DEVICE (self)),
+                                       fpi_image_device_enroll_minutiae_detected,
+                                       detection);
+      return;
+    }
 
   /* XXX: We also detect minutiae in capture mode, we solely do this
-   *      to normalize the image which will happen as a by-product. */
-  fp_image_detect_minutiae (image,
-                            fpi_device_get_cancellable (FP_DEVICE (self)),
-                            fpi_image_device_minutiae_detected,
-                            self);
+   *      to normalize the image which will happen as a by-product.
+   *      Only a captured image is likely to be shown binarized, so it
+   *      is not kept for prints. */
+  fpi_image_detect_minutiae_owned (image,
+                                   action == FPI_DEVICE_ACTION_CAPTURE ?
+                                   FP_IMAGE_DETECT_KEEP_BINARIZED : FP_IMAGE_DETECT_NONE,
+                                   fpi_device_get_cancellable (FP_DEVICE (self)),
+                                   fpi_image_device_minutiae_detected,
+                                   self);
 }
 
 /**
@@ -392,6 +1257,10 @@ fpi_image_device_image_captured (FpImageDevice *self, FpImage *image)
  * Reports a scan failure to the user. This may or may not abort the
  * current session. It is the equivalent of fpi_image_device_image_captured()
  * in the case of a retryable error condition (e.g. short swipe).
+ *
+ * Enroll and continuous identify always wait for the next touch. Verify
+ * and identify do so as long as #FpImageDevice:max-scan-retries allows,
+ * and complete with the retry error otherwise.
  */
 void
 fpi_image_device_retry_scan (FpImageDevice *self, FpDeviceRetry retry)
@@ -422,6 +1291,19 @@ fpi_image_device_retry_scan (FpImageDevice *self, FpDeviceRetry retry)
       priv->enroll_await_on_pending = TRUE;
       fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF);
     }
+  else if (fp_image_device_can_retry (self))
+    {
+      g_debug ("Reporting retry within the operation");
+      if (action == FPI_DEVICE_ACTION_VERIFY)
+        fpi_device_verify_report (FP_DEVICE (self), FPI_MATCH_ERROR, NULL, error);
+      else
+        fpi_device_identify_report (FP_DEVICE (self), NULL, NULL, error);
+      fp_image_device_retry_continue (self);
+
+      /* Wait for finger removal and re-touch, as for enroll */
+      priv->identify_await_on_pending = TRUE;
+      fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF);
+    }
   else if (action == FPI_DEVICE_ACTION_VERIFY)
     {
       fpi_device_verify_report (FP_DEVICE (self), FPI_MATCH_ERROR, NULL, error);
@@ -430,6 +1312,16 @@ fpi_image_device_retry_scan (FpImageDevice *self, FpDeviceRetry retry)
       priv->cancelling = FALSE;
       fpi_device_verify_complete (FP_DEVICE (self), NULL);
     }
+  else if (action == FPI_DEVICE_ACTION_IDENTIFY &&
+           fpi_device_identify_is_continuous (FP_DEVICE (self)))
+    {
+      fpi_device_identify_report (FP_DEVICE (self), NULL, NULL, error);
+      fpi_device_identify_continue (FP_DEVICE (self));
+
+      /* Wait for finger removal and re-touch, as for enroll */
+      priv->identify_await_on_pending = TRUE;
+      fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_OFF);
+    }
   else if (action == FPI_DEVICE_ACTION_IDENTIFY)
     {
       fpi_device_identify_report (FP_DEVICE (self), NULL, NULL, error);
@@ -485,6 +1377,14 @@ fpi_image_device_session_error (FpImageDevice *self, GError *error)
           return;
         }
     }
+  else if (priv->standby)
+    {
+      /* There is no operation to report the error to. */
+      g_debug ("Driver reported session error while kept active: %s", error->message);
+      g_clear_error (&error);
+      fpi_image_device_deactivate (self);
+      return;
+    }
   else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
            fpi_device_action_is_cancelled (FP_DEVICE (self)))
     {
@@ -583,11 +1483,15 @@ fpi_image_device_deactivate_complete (FpImageDevice *self, GError *error)
     }
 
   /* We might be waiting to be able to activate again. */
-  if (priv->pending_activation_timeout_id)
+  if (priv->pending_activation_timeout)
     {
-      g_clear_handle_id (&priv->pending_activation_timeout_id, g_source_remove);
-      priv->pending_activation_timeout_id =
-        g_idle_add ((GSourceFunc) fpi_image_device_activate, self);
+      g_clear_pointer (&priv->pending_activation_timeout, g_source_destroy);
+      priv->pending_activation_timeout = g_idle_source_new ();
+      g_source_set_callback (priv->pending_activation_timeout,
+                             (GSourceFunc) fpi_image_device_activate, self, NULL);
+      g_source_attach (priv->pending_activation_timeout,
+                       fpi_device_get_main_context (FP_DEVICE (self)));
+      g_source_unref (priv->pending_activation_timeout);
     }
 }
 
@@ -611,6 +1515,14 @@ fpi_image_device_open_complete (FpImageDevice *self, GError *error)
 
   g_debug ("Image device open completed");
 
+  if (!error)
+    {
+      FpImageDeviceClass *cls = FP_IMAGE_DEVICE_GET_CLASS (self);
+
+      if (cls->img_width > 0 && cls->img_height > 0)
+        fpi_image_prepare_detection (cls->img_width, cls->img_height);
+    }
+
   priv->state = FPI_IMAGE_DEVICE_STATE_INACTIVE;
   g_object_notify (G_OBJECT (self), "fpi-image-device-state");
 
@@ -639,6 +1551,7 @@ fpi_image_device_close_complete (FpImageDevice *self, GError *error)
 
   priv->state = FPI_IMAGE_DEVICE_STATE_INACTIVE;
   g_object_notify (G_OBJECT (self), "fpi-image-device-state");
+  g_clear_pointer (&priv->recorder, fpi_capture_recorder_free);
 
   fpi_device_close_complete (FP_DEVICE (self), error);
 }
@@ -46,6 +46,8 @@ typedef enum {
 /**
  * FpImageDeviceClass:
  * @bz3_threshold: Threshold to consider bozorth3 score a match, default: 40
+ * @matcher: The #FpiMatcher used to identify, which the FP_MATCHER
+ *   environment variable overrides, default: %FPI_MATCHER_BOZORTH3
  * @img_width: Width of the image, only provide if constant
  * @img_height: Height of the image, only provide if constant
  * @img_open: Open the device and do basic initialization
@@ -84,6 +86,7 @@ struct _FpImageDeviceClass
   FpDeviceClass parent_class;
 
   gint          bz3_threshold;
+  FpiMatcher    matcher;
   gint          img_width;
   gint          img_height;
 
@@ -97,6 +100,16 @@ struct _FpImageDeviceClass
 
 void fpi_image_device_set_bz3_threshold (FpImageDevice *self,
                                          gint           bz3_threshold);
+void fpi_image_device_set_max_minutiae (FpImageDevice *self,
+                                        gint           max_minutiae);
+void fpi_image_device_set_enroll_consolidation (FpImageDevice *self,
+                                                gboolean       consolidate);
+void fpi_image_device_set_enroll_early_stop (FpImageDevice *self,
+                                             gint           min_stages,
+                                             gint           min_score,
+                                             gint           min_minutiae);
+void fpi_image_device_set_keep_active (FpImageDevice *self,
+                                       guint          timeout_ms);
 
 void fpi_image_device_session_error (FpImageDevice *self,
                                      GError        *error);
@@ -114,5 +127,11 @@ void fpi_image_device_report_finger_status (FpImageDevice *self,
                                             gboolean       present);
 void fpi_image_device_image_captured (FpImageDevice *self,
                                       FpImage       *image);
+guint fpi_image_device_get_poll_delay (FpImageDevice *self,
+                                       guint          min_delay_ms,
+                                       gboolean       activity);
+gboolean fpi_image_device_wants_frame (FpImageDevice *self);
+void fpi_image_device_report_frame (FpImageDevice *self,
+                                    FpImage       *frame);
 void fpi_image_device_retry_scan (FpImageDevice *self,
                                   FpDeviceRetry  retry);
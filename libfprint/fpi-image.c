@@ -23,11 +23,10 @@
 #include "fpi-image.h"
 #include "fpi-log.h"
 
-#include <nbis.h>
+#include "fpi-simd.h"
 
-#if HAVE_PIXMAN
-#include <pixman.h>
-#endif
+#include <nbis.h>
+#include <string.h>
 
 /**
  * SECTION: fpi-image
@@ -57,21 +56,12 @@ gint
 fpi_std_sq_dev (const guint8 *buf,
                 gint          size)
 {
-  guint64 res = 0, mean = 0;
-  gint i;
+  const FpiSimdKernels *kernels = fpi_simd_get_kernels ();
+  guint64 mean;
 
-  for (i = 0; i < size; i++)
-    mean += buf[i];
+  mean = kernels->sum_u8 (buf, size) / size;
 
-  mean /= size;
-
-  for (i = 0; i < size; i++)
-    {
-      int dev = (int) buf[i] - mean;
-      res += dev * dev;
-    }
-
-  return res / size;
+  return kernels->sum_sq_diff_u8 (buf, NULL, mean, size) / size;
 }
 
 /**
@@ -96,54 +86,327 @@ fpi_mean_sq_diff_norm (const guint8 *buf1,
                        const guint8 *buf2,
                        gint          size)
 {
-  int res = 0, i;
+  return fpi_simd_get_kernels ()->sum_sq_diff_u8 (buf1, buf2, 0, size) / size;
+}
 
-  for (i = 0; i < size; i++)
+/**
+ * fpi_sum_abs_diff:
+ * @buf1: buffer (usually bitmap, one byte per pixel)
+ * @buf2: buffer (usually bitmap, one byte per pixel)
+ * @size: buffer size of smallest buffer
+ *
+ * Calculates the sum of the absolute differences of two buffers,
+ * usually two lines:
+ * |[<!-- -->
+ *    abs_diff = sum (|buf1[0..size] - buf2[0..size]|)
+ * ]|
+ *
+ * This is cheaper than fpi_mean_sq_diff_norm() and is usually used by
+ * swipe sensors to detect repeated lines.
+ *
+ * Returns: the sum of absolute differences between @buf1 and @buf2
+ */
+guint
+fpi_sum_abs_diff (const guint8 *buf1,
+                  const guint8 *buf2,
+                  gint          size)
+{
+  return fpi_simd_get_kernels ()->sum_abs_diff_u8 (buf1, buf2, size);
+}
+
+/**
+ * fpi_saturate_above:
+ * @buf: buffer (usually bitmap, one byte per pixel)
+ * @size: size of @buf
+ * @level: the highest value that is kept
+ *
+ * Sets all pixels brighter than @level to white. This is usually used
+ * to remove noise from the background of an image.
+ */
+void
+fpi_saturate_above (guint8 *buf,
+                    gint    size,
+                    guint8  level)
+{
+  if (level == 0xff)
+    return;
+
+  fpi_simd_get_kernels ()->saturate_above_u8 (buf, size, level);
+}
+
+/* Whether the block at @bx, @by has a squared standard deviation of at
+ * least @min_sq_dev */
+static gboolean
+block_is_covered (FpImage *image,
+                  gint     bx,
+                  gint     by,
+                  gint     block_size,
+                  gint     min_sq_dev)
+{
+  const guint8 *block = image->data + by * block_size * image->width + bx * block_size;
+  guint64 sum = 0, sum_sq = 0;
+  gint n = block_size * block_size;
+  gint x, y;
+
+  for (y = 0; y < block_size; y++)
     {
-      int dev = (int) buf1[i] - (int) buf2[i];
-      res += dev * dev;
+      const guint8 *row = block + y * image->width;
+
+      for (x = 0; x < block_size; x++)
+        {
+          sum += row[x];
+          sum_sq += row[x] * row[x];
+        }
     }
 
-  return res / size;
+  /* n * sq_dev = sum_sq - sum^2 / n */
+  return sum_sq * n - sum * sum >= (guint64) min_sq_dev * n * n;
+}
+
+/**
+ * fpi_image_get_coverage:
+ * @image: a #FpImage
+ * @block_size: width and height of the blocks to test
+ * @min_sq_dev: minimum squared standard deviation of a covered block
+ *
+ * Splits the image into square blocks and tests how many of them have a
+ * squared standard deviation (see fpi_std_sq_dev()) of at least
+ * @min_sq_dev. Blocks without a ridge pattern are flat, so this is a
+ * cheap estimate of how much of the image is covered by the finger.
+ *
+ * Returns: the fraction of the blocks that are covered, between 0 and 1
+ */
+gdouble
+fpi_image_get_coverage (FpImage *image,
+                        gint     block_size,
+                        gint     min_sq_dev)
+{
+  gint bw, bh;
+  gint covered = 0;
+  gint bx, by;
+
+  g_return_val_if_fail (block_size > 0, 0.0);
+
+  bw = image->width / block_size;
+  bh = image->height / block_size;
+  if (bw == 0 || bh == 0)
+    return 0.0;
+
+  for (by = 0; by < bh; by++)
+    for (bx = 0; bx < bw; bx++)
+      if (block_is_covered (image, bx, by, block_size, min_sq_dev))
+        covered++;
+
+  return (gdouble) covered / (bw * bh);
 }
 
-#if HAVE_PIXMAN
+/**
+ * fpi_image_get_covered_area:
+ * @image: a #FpImage
+ * @block_size: width and height of the blocks to test
+ * @min_sq_dev: minimum squared standard deviation of a covered block
+ * @x: (out): Return location for the left edge
+ * @y: (out): Return location for the top edge
+ * @width: (out): Return location for the width
+ * @height: (out): Return location for the height
+ *
+ * Finds the bounding box of the blocks that are covered by the finger,
+ * using the same test as fpi_image_get_coverage().
+ *
+ * Returns: %FALSE if no block is covered
+ */
+gboolean
+fpi_image_get_covered_area (FpImage *image,
+                            gint     block_size,
+                            gint     min_sq_dev,
+                            gint    *x,
+                            gint    *y,
+                            gint    *width,
+                            gint    *height)
+{
+  gint bw, bh;
+  gint x0, y0, x1 = 0, y1 = 0;
+  gint bx, by;
+
+  g_return_val_if_fail (block_size > 0, FALSE);
+
+  bw = image->width / block_size;
+  bh = image->height / block_size;
+  x0 = bw;
+  y0 = bh;
+
+  for (by = 0; by < bh; by++)
+    for (bx = 0; bx < bw; bx++)
+      {
+        /* Blocks inside the box found so far do not change it */
+        if (bx >= x0 && bx < x1 && by >= y0 && by < y1)
+          continue;
+
+        if (!block_is_covered (image, bx, by, block_size, min_sq_dev))
+          continue;
+
+        x0 = MIN (x0, bx);
+        y0 = MIN (y0, by);
+        x1 = MAX (x1, bx + 1);
+        y1 = MAX (y1, by + 1);
+      }
+
+  if (x1 <= x0 || y1 <= y0)
+    return FALSE;
+
+  *x = x0 * block_size;
+  *y = y0 * block_size;
+  *width = (x1 - x0) * block_size;
+  *height = (y1 - y0) * block_size;
+
+  return TRUE;
+}
+
+/* Source position and weight of the next source pixel for an output
+ * pixel when upscaling by an integer factor. Output pixel centers are
+ * mapped onto the source and pixels outside the source are clamped. The
+ * weight is in 1/256th. */
+static inline void
+resize_sample (gint x, guint factor, gint size, gint *i0, gint *i1, guint *weight)
+{
+  /* Position relative to the first source pixel in 1/(2 * factor) */
+  gint pos = 2 * x + 1 - (gint) factor;
+  gint den = 2 * factor;
+  gint i = pos >= 0 ? pos / den : -((-pos + den - 1) / den);
+  gint frac = pos - i * den;
+
+  *weight = (frac * 256 + (gint) factor) / den;
+  *i0 = CLAMP (i, 0, size - 1);
+  *i1 = CLAMP (i + 1, 0, size - 1);
+}
+
+/* dst = (a * (256 - weight) + b * weight) / 256 for a whole row */
+static void
+resize_blend_rows (guint8       *dst,
+                   const guint8 *a,
+                   const guint8 *b,
+                   guint         weight,
+                   gint          width)
+{
+  if (weight == 0 || a == b)
+    {
+      memcpy (dst, a, width);
+      return;
+    }
+
+  fpi_simd_get_kernels ()->blend_u8 (dst, a, b, weight, width);
+}
+
+/**
+ * fpi_image_resize:
+ * @orig: a #FpImage
+ * @w_factor: horizontal scaling factor
+ * @h_factor: vertical scaling factor
+ *
+ * Enlarges the image by the given integer factors using bilinear
+ * interpolation.
+ *
+ * Returns: (transfer full): the enlarged #FpImage
+ */
 FpImage *
-fpi_image_resize (FpImage *orig_img,
+fpi_image_resize (FpImage *orig,
                   guint    w_factor,
                   guint    h_factor)
 {
-  int new_width = orig_img->width * w_factor;
-  int new_height = orig_img->height * h_factor;
-  pixman_image_t *orig, *resized;
-  pixman_transform_t transform;
+  gint new_width = orig->width * w_factor;
+  gint new_height = orig->height * h_factor;
+  g_autofree guint8 *row = NULL;
+  g_autofree gint *x0 = NULL;
+  g_autofree gint *x1 = NULL;
+  g_autofree guint *xw = NULL;
+  FpImage *newimg;
+  gint x, y;
+
+  g_return_val_if_fail (w_factor > 0 && h_factor > 0, NULL);
+
+  newimg = fp_image_new (new_width, new_height);
+  newimg->flags = orig->flags;
+
+  /* The horizontal sampling is the same for every row */
+  x0 = g_new (gint, new_width);
+  x1 = g_new (gint, new_width);
+  xw = g_new (guint, new_width);
+  for (x = 0; x < new_width; x++)
+    resize_sample (x, w_factor, orig->width, &x0[x], &x1[x], &xw[x]);
+
+  row = g_malloc (orig->width);
+
+  for (y = 0; y < new_height; y++)
+    {
+      guint8 *dst = newimg->data + y * new_width;
+      gint y0, y1;
+      guint yw;
+
+      /* Interpolate between the two source rows first, then widen it */
+      resize_sample (y, h_factor, orig->height, &y0, &y1, &yw);
+      resize_blend_rows (row,
+                         orig->data + y0 * orig->width,
+                         orig->data + y1 * orig->width,
+                         yw, orig->width);
+
+      for (x = 0; x < new_width; x++)
+        dst[x] = (row[x0[x]] * (256 - xw[x]) + row[x1[x]] * xw[x] + 128) >> 8;
+    }
+
+  return newimg;
+}
+
+/**
+ * fpi_image_downsample:
+ * @orig: a #FpImage
+ * @factor: the downsampling factor
+ *
+ * Shrinks the image by @factor in both directions, by averaging each
+ * block of @factor x @factor pixels. Pixels at the right and bottom edge
+ * that do not fill a whole block are dropped. @factor is limited to the
+ * size of the image.
+ *
+ * Returns: (transfer full): the shrunk #FpImage
+ */
+FpImage *
+fpi_image_downsample (FpImage *orig,
+                      guint    factor)
+{
+  gint new_width, new_height;
+  g_autofree guint *sums = NULL;
   FpImage *newimg;
+  guint area;
+  gint x, y;
+
+  g_return_val_if_fail (factor > 0, NULL);
 
-  orig = pixman_image_create_bits (PIXMAN_a8, orig_img->width, orig_img->height, (uint32_t *) orig_img->data, orig_img->width);
-  resized = pixman_image_create_bits (PIXMAN_a8, new_width, new_height, NULL, new_width);
-
-  pixman_transform_init_identity (&transform);
-  pixman_transform_scale (NULL, &transform, pixman_int_to_fixed (w_factor), pixman_int_to_fixed (h_factor));
-  pixman_image_set_transform (orig, &transform);
-  pixman_image_set_filter (orig, PIXMAN_FILTER_BILINEAR, NULL, 0);
-  pixman_image_composite32 (PIXMAN_OP_SRC,
-                            orig, /* src */
-                            NULL, /* mask */
-                            resized, /* dst */
-                            0, 0, /* src x y */
-                            0, 0, /* mask x y */
-                            0, 0, /* dst x y */
-                            new_width, new_height /* width height */
-                           );
+  factor = MAX (MIN (factor, MIN (orig->width, orig->height)), 1);
+  new_width = orig->width / factor;
+  new_height = orig->height / factor;
+  area = factor * factor;
 
   newimg = fp_image_new (new_width, new_height);
-  newimg->flags = orig_img->flags;
+  newimg->flags = orig->flags;
+  newimg->ppmm = orig->ppmm / factor;
+
+  sums = g_new (guint, new_width);
+  for (y = 0; y < new_height; y++)
+    {
+      guint8 *dst = newimg->data + y * new_width;
+      guint r;
+
+      memset (sums, 0, new_width * sizeof (guint));
+      for (r = 0; r < factor; r++)
+        {
+          const guint8 *src = orig->data + (y * factor + r) * orig->width;
 
-  memcpy (newimg->data, pixman_image_get_data (resized), new_width * new_height);
+          for (x = 0; x < new_width * (gint) factor; x++)
+            sums[x / factor] += src[x];
+        }
 
-  pixman_image_unref (orig);
-  pixman_image_unref (resized);
+      for (x = 0; x < new_width; x++)
+        dst[x] = (sums[x] + area / 2) / area;
+    }
 
   return newimg;
 }
-#endif
@@ -22,6 +22,7 @@
 
 #include <config.h>
 #include "fp-image.h"
+#include "fp-device.h"
 
 /**
  * FpiImageFlags:
@@ -63,21 +64,62 @@ struct _FpImage
   FpiImageFlags flags;
 
   /*< private >*/
-  guint8    *data;
-  guint8    *binarized;
+  guint8        *data;
+  GDestroyNotify data_destroy;
+  gboolean       data_exposed;
+  guint8        *binarized;
+  /* Number of detections that may still read @data */
+  guint          detecting;
 
   GPtrArray *minutiae;
   guint      ref_count;
 };
 
+FpImage *fpi_image_new_for_data (gint           width,
+                                 gint           height,
+                                 guint8        *data,
+                                 GDestroyNotify destroy);
+FpImage *fpi_image_new_from_bytes (gint    width,
+                                   gint    height,
+                                   GBytes *bytes);
+FpImage *fpi_image_new_pooled (FpDevice *device,
+                               gint      width,
+                               gint      height,
+                               gboolean  clear);
+
 gint fpi_std_sq_dev (const guint8 *buf,
                      gint          size);
 gint fpi_mean_sq_diff_norm (const guint8 *buf1,
                             const guint8 *buf2,
                             gint          size);
+guint fpi_sum_abs_diff (const guint8 *buf1,
+                        const guint8 *buf2,
+                        gint          size);
+void fpi_saturate_above (guint8 *buf,
+                         gint    size,
+                         guint8  level);
+gdouble fpi_image_get_coverage (FpImage *image,
+                                gint     block_size,
+                                gint     min_sq_dev);
+gboolean fpi_image_get_covered_area (FpImage *image,
+                                     gint     block_size,
+                                     gint     min_sq_dev,
+                                     gint    *x,
+                                     gint    *y,
+                                     gint    *width,
+                                     gint    *height);
 
-#if HAVE_PIXMAN
 FpImage *fpi_image_resize (FpImage *orig,
                            guint    w_factor,
                            guint    h_factor);
-#endif
+FpImage *fpi_image_downsample (FpImage *orig,
+                               guint    factor);
+
+void fpi_image_detect_minutiae_owned (FpImage            *self,
+                                      FpImageDetectFlags  flags,
+                                      GCancellable       *cancellable,
+                                      GAsyncReadyCallback callback,
+                                      gpointer            user_data);
+
+void fpi_image_prepare_detection (gint width,
+                                  gint height);
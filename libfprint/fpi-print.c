@@ -24,6 +24,12 @@
 #include "fp-print-private.h"
 #include "fpi-device.h"
 #include "fpi-compat.h"
+#include "fpi-trace.h"
+#include "fpi-byte-utils.h"
+#include "fpi-cylinder.h"
+#include "fpi-worker.h"
+
+#include <math.h>
 
 /**
  * SECTION: fpi-print
@@ -46,11 +52,17 @@
 void
 fpi_print_add_print (FpPrint *print, FpPrint *add)
 {
+  struct xyt_struct scratch;
+
   g_return_if_fail (print->type == FPI_PRINT_NBIS);
   g_return_if_fail (add->type == FPI_PRINT_NBIS);
 
-  g_assert (add->prints->len == 1);
-  g_ptr_array_add (print->prints, g_memdup (add->prints->pdata[0], sizeof (struct xyt_struct)));
+  g_assert (fpi_print_get_n_xyt (add) == 1);
+
+  fpi_print_unpack (print);
+  g_ptr_array_add (print->prints, g_memdup (fpi_print_get_xyt (add, 0, &scratch),
+                                            sizeof (struct xyt_struct)));
+  fpi_print_invalidate (print);
 }
 
 /**
@@ -71,6 +83,7 @@ fpi_print_set_type (FpPrint     *print,
   g_return_if_fail (print->type == FPI_PRINT_UNDEFINED);
 
   print->type = type;
+  fpi_print_invalidate (print);
   if (print->type == FPI_PRINT_NBIS)
     {
       g_assert_null (print->prints);
@@ -97,42 +110,132 @@ fpi_print_set_device_stored (FpPrint *print,
   g_object_notify (G_OBJECT (print), "device-stored");
 }
 
-/* XXX: This is the old version, but wouldn't it be smarter to instead
- * use the highest quality mintutiae? Possibly just using bz_prune from
- * upstream? */
+/* The minutiae are sorted as packed integer keys instead of with qsort().
+ * From the most significant bit, a key holds 7 bits of the inverted
+ * reliability, 24 bits each for x and y, and 9 bits for the direction in
+ * degrees. Sorting the keys in increasing order sorts the minutiae by
+ * decreasing reliability and then by position. */
+#define XYT_KEY_T_BITS 9
+#define XYT_KEY_Y_SHIFT XYT_KEY_T_BITS
+#define XYT_KEY_X_SHIFT (XYT_KEY_Y_SHIFT + 24)
+#define XYT_KEY_REL_SHIFT (XYT_KEY_X_SHIFT + 24)
+#define XYT_KEY_REL_MAX 127
+#define XYT_KEY_POS_MASK ((G_GUINT64_CONSTANT (1) << XYT_KEY_REL_SHIFT) - 1)
+#define XYT_KEY_COORD_MAX ((1 << 24) - 1)
+
+/* LSD radix sort of @n keys, one byte at a time. Bytes that are the same
+ * in all keys are skipped, which are most of them. @tmp must hold @n keys,
+ * and the result ends up back in @keys. */
+static void
+radix_sort_keys (guint64 *keys,
+                 guint64 *tmp,
+                 guint    n)
+{
+  guint64 *src = keys, *dst = tmp;
+  guint shift, i;
+
+  for (shift = 0; shift < 64; shift += 8)
+    {
+      guint counts[256] = { 0, };
+      guint offset = 0;
+
+      for (i = 0; i < n; i++)
+        counts[(src[i] >> shift) & 0xff]++;
+
+      if (n == 0 || counts[(src[0] >> shift) & 0xff] == n)
+        continue;
+
+      for (i = 0; i < 256; i++)
+        {
+          guint count = counts[i];
+
+          counts[i] = offset;
+          offset += count;
+        }
+
+      for (i = 0; i < n; i++)
+        dst[counts[(src[i] >> shift) & 0xff]++] = src[i];
+
+      tmp = src;
+      src = dst;
+      dst = tmp;
+    }
+
+  if (src != keys)
+    memcpy (keys, src, n * sizeof (guint64));
+}
+
+/* The minutia direction in degrees, like lfs2nist_minutia_XYT() computes it
+ * with floating point: the direction is rotated and rounded half away from
+ * zero, with 180 / NUM_DIRECTIONS degrees per unit. */
+static inline int
+minutia_nist_theta (int direction)
+{
+  int degrees;
+
+  if (direction >= 0)
+    degrees = (direction * 360 + NUM_DIRECTIONS) / (2 * NUM_DIRECTIONS);
+  else
+    degrees = -((-direction * 360 + NUM_DIRECTIONS) / (2 * NUM_DIRECTIONS));
+
+  degrees = (270 - degrees) % 360;
+  if (degrees < 0)
+    degrees += 360;
+
+  return degrees;
+}
+
+/* The cost of a bozorth3 match grows quickly with the number of minutiae,
+ * so only the max_nmin most reliable ones are kept. */
 static void
 minutiae_to_xyt (struct fp_minutiae *minutiae,
                  int                 bwidth,
                  int                 bheight,
+                 int                 max_nmin,
                  struct xyt_struct  *xyt)
 {
+  g_autofree guint64 *keys = NULL;
+  int nmin = min (minutiae->num, MAX_FILE_MINUTIAE);
   int i;
-  struct fp_minutia *minutia;
-  struct minutiae_struct c[MAX_FILE_MINUTIAE];
 
   /* struct xyt_struct uses arrays of MAX_BOZORTH_MINUTIAE (200) */
-  int nmin = min (minutiae->num, MAX_BOZORTH_MINUTIAE);
+  if (max_nmin <= 0 || max_nmin > MAX_BOZORTH_MINUTIAE)
+    max_nmin = MAX_BOZORTH_MINUTIAE;
+
+  /* The keys, followed by the scratch space of the sort */
+  keys = g_new (guint64, 2 * nmin);
 
   for (i = 0; i < nmin; i++)
     {
-      minutia = minutiae->list[i];
+      struct fp_minutia *minutia = minutiae->list[i];
+      int x = CLAMP (minutia->x, 0, XYT_KEY_COORD_MAX);
+      int y = CLAMP (bheight - minutia->y, 0, XYT_KEY_COORD_MAX);
+      int rel = CLAMP (sround (minutia->reliability * 100.0), 0, XYT_KEY_REL_MAX);
 
-      lfs2nist_minutia_XYT (&c[i].col[0], &c[i].col[1], &c[i].col[2],
-                            minutia, bwidth, bheight);
-      c[i].col[3] = sround (minutia->reliability * 100.0);
+      keys[i] = ((guint64) (XYT_KEY_REL_MAX - rel) << XYT_KEY_REL_SHIFT) |
+                ((guint64) x << XYT_KEY_X_SHIFT) |
+                ((guint64) y << XYT_KEY_Y_SHIFT) |
+                (guint64) minutia_nist_theta (minutia->direction);
+    }
 
-      if (c[i].col[2] > 180)
-        c[i].col[2] -= 360;
+  if (nmin > max_nmin)
+    {
+      radix_sort_keys (keys, keys + nmin, nmin);
+      nmin = max_nmin;
     }
 
-  qsort ((void *) &c, (size_t) nmin, sizeof (struct minutiae_struct),
-         sort_x_y);
+  /* Only keep the position for the final order */
+  for (i = 0; i < nmin; i++)
+    keys[i] &= XYT_KEY_POS_MASK;
+  radix_sort_keys (keys, keys + nmin, nmin);
 
   for (i = 0; i < nmin; i++)
     {
-      xyt->xcol[i]     = c[i].col[0];
-      xyt->ycol[i]     = c[i].col[1];
-      xyt->thetacol[i] = c[i].col[2];
+      int theta = keys[i] & ((1 << XYT_KEY_T_BITS) - 1);
+
+      xyt->xcol[i]     = (keys[i] >> XYT_KEY_X_SHIFT) & XYT_KEY_COORD_MAX;
+      xyt->ycol[i]     = (keys[i] >> XYT_KEY_Y_SHIFT) & XYT_KEY_COORD_MAX;
+      xyt->thetacol[i] = theta > 180 ? theta - 360 : theta;
     }
   xyt->nrows = nmin;
 }
@@ -155,6 +258,29 @@ gboolean
 fpi_print_add_from_image (FpPrint *print,
                           FpImage *image,
                           GError **error)
+{
+  return fpi_print_add_from_image_full (print, image, 0, error);
+}
+
+/**
+ * fpi_print_add_from_image_full:
+ * @print: A #FpPrint
+ * @image: A #FpImage
+ * @max_minutiae: Maximum number of minutiae to keep, or 0 for the default
+ * @error: Return location for error
+ *
+ * Like fpi_print_add_from_image(), but only keeps the @max_minutiae
+ * minutiae with the highest reliability. Matching time grows quickly
+ * with the number of minutiae, so this is useful for sensors that
+ * produce many spurious minutiae.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fpi_print_add_from_image_full (FpPrint *print,
+                               FpImage *image,
+                               gint     max_minutiae,
+                               GError **error)
 {
   GPtrArray *minutiae;
   struct fp_minutiae _minutiae;
@@ -183,9 +309,12 @@ fpi_print_add_from_image (FpPrint *print,
   _minutiae.list = (struct fp_minutia **) minutiae->pdata;
   _minutiae.alloc = minutiae->len;
 
+  fpi_print_unpack (print);
+
   xyt = g_new0 (struct xyt_struct, 1);
-  minutiae_to_xyt (&_minutiae, image->width, image->height, xyt);
+  minutiae_to_xyt (&_minutiae, image->width, image->height, max_minutiae, xyt);
   g_ptr_array_add (print->prints, xyt);
+  fpi_print_invalidate (print);
 
   g_clear_object (&print->image);
   print->image = g_object_ref (image);
@@ -194,6 +323,583 @@ fpi_print_add_from_image (FpPrint *print,
   return TRUE;
 }
 
+/* The bozorth3 work buffers are too large to live on the stack, so every
+ * thread that runs a match gets its own context which is freed again when
+ * the thread exits. This allows matching on several threads at once. */
+static GPrivate bz3_match_context = G_PRIVATE_INIT ((GDestroyNotify) bz_match_context_free);
+
+static BzMatchContext *
+fpi_print_get_bz3_match_context (void)
+{
+  BzMatchContext *ctx = g_private_get (&bz3_match_context);
+
+  if (!ctx)
+    {
+      ctx = bz_match_context_new ();
+      g_private_set (&bz3_match_context, ctx);
+    }
+
+  return ctx;
+}
+
+/*
+ * Packed Web format
+ *
+ * Gallery files may store the gallery Webs of a print in a record that
+ * directly follows the print record. All values are little endian:
+ *
+ *  0  "FPW"
+ *  3  guint8  version
+ *  4  guint32 size of the record in bytes, a multiple of 4
+ *  8  guint16 number of Webs, the same as the prints of the record before
+ * 10  guint16 number of columns per row (COLS_SIZE_2)
+ * 12  for each Web (padded to 4 bytes): guint32 number of rows, the rows
+ *     as gint32 values, then the distance, beta1 and beta2 keys as gint16
+ *
+ * On little endian machines the rows and keys are used in place, so
+ * several processes that map the same file share the memory. A Web is
+ * only checked against its minutiae set once it is used for matching.
+ */
+#define FPI_PRINT_WEBS_VERSION 1
+#define FPI_PRINT_WEBS_HEADER_SIZE 12
+
+G_STATIC_ASSERT (sizeof (int) == 4 && sizeof (short) == 2);
+
+static gsize
+packed_web_size (guint len)
+{
+  return 4 + ((gsize) len * (COLS_SIZE_2 * 4 + 3 * 2) + 3) / 4 * 4;
+}
+
+/**
+ * fpi_print_checksum_xyt:
+ * @print: A #FpPrint of type #FPI_PRINT_NBIS
+ * @checksum: The #GChecksum to update
+ *
+ * Adds the minutiae of @print to @checksum, in little endian so that the
+ * result is the same on every machine.
+ */
+void
+fpi_print_checksum_xyt (FpPrint   *print,
+                        GChecksum *checksum)
+{
+  struct xyt_struct scratch;
+  guint i;
+  gint j;
+
+  for (i = 0; i < fpi_print_get_n_xyt (print); i++)
+    {
+      struct xyt_struct *xyt = fpi_print_get_xyt (print, i, &scratch);
+      guchar value[4];
+
+      FP_WRITE_UINT32_LE (value, xyt->nrows);
+      g_checksum_update (checksum, value, sizeof (value));
+      for (j = 0; j < xyt->nrows; j++)
+        {
+          FP_WRITE_UINT32_LE (value, xyt->xcol[j]);
+          g_checksum_update (checksum, value, sizeof (value));
+          FP_WRITE_UINT32_LE (value, xyt->ycol[j]);
+          g_checksum_update (checksum, value, sizeof (value));
+          FP_WRITE_UINT32_LE (value, xyt->thetacol[j]);
+          g_checksum_update (checksum, value, sizeof (value));
+        }
+    }
+}
+
+/**
+ * fpi_print_webs_checksum:
+ * @print: A #FpPrint of type #FPI_PRINT_NBIS
+ * @record: A packed Web record
+ * @length: Length of @record
+ *
+ * Computes a checksum of @record together with the minutiae of @print, so
+ * that a stored record is only used for the minutiae it was built from.
+ *
+ * Returns: (transfer full): The checksum as a hex string
+ */
+gchar *
+fpi_print_webs_checksum (FpPrint      *print,
+                         const guchar *record,
+                         gsize         length)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  fpi_print_checksum_xyt (print, checksum);
+  g_checksum_update (checksum, record, length);
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/**
+ * fpi_print_load_packed_webs:
+ * @print: A #FpPrint of type #FPI_PRINT_NBIS
+ * @bytes: The data containing the record
+ * @offset: Offset of the record in @bytes
+ * @size: (out): Return location for the size of the record
+ *
+ * Attaches the packed Web record at @offset to @print, which keeps a
+ * reference to @bytes. Nothing is copied.
+ *
+ * Returns: %FALSE if there is no valid record for @print at @offset
+ */
+gboolean
+fpi_print_load_packed_webs (FpPrint *print,
+                            GBytes  *bytes,
+                            gsize    offset,
+                            gsize   *size)
+{
+  const guchar *data;
+  gsize length;
+  guint32 record_size;
+
+  data = g_bytes_get_data (bytes, &length);
+  if (offset > length || length - offset < FPI_PRINT_WEBS_HEADER_SIZE)
+    return FALSE;
+
+  data += offset;
+  record_size = FP_READ_UINT32_LE (data + 4);
+  if (memcmp (data, FPI_PRINT_WEBS_MAGIC, 3) != 0 ||
+      data[3] != FPI_PRINT_WEBS_VERSION ||
+      record_size < FPI_PRINT_WEBS_HEADER_SIZE ||
+      record_size % 4 != 0 ||
+      record_size > length - offset ||
+      FP_READ_UINT16_LE (data + 8) != fpi_print_get_n_xyt (print) ||
+      FP_READ_UINT16_LE (data + 10) != COLS_SIZE_2)
+    return FALSE;
+
+  g_clear_pointer (&print->packed_webs, g_bytes_unref);
+  print->packed_webs = g_bytes_new_from_bytes (bytes, offset, record_size);
+  *size = record_size;
+
+  return TRUE;
+}
+
+/* Returns a view onto the packed Web of minutiae set @idx, or %NULL if it
+ * cannot be used as is, in which case the Web is built as usual. */
+static BzGalleryWeb *
+fpi_print_get_packed_web (FpPrint           *template,
+                          guint              idx,
+                          struct xyt_struct *gstruct)
+{
+  const guchar *data, *p;
+  const gint32 *cols;
+  const gint16 *keys;
+  gsize length, pos;
+  guint32 len = 0;
+  guint i, j;
+
+  if (G_BYTE_ORDER != G_LITTLE_ENDIAN || !template->packed_webs)
+    return NULL;
+
+  data = g_bytes_get_data (template->packed_webs, &length);
+  if ((guintptr) data % 4 != 0)
+    return NULL;
+
+  pos = FPI_PRINT_WEBS_HEADER_SIZE;
+  for (i = 0; i <= idx; i++)
+    {
+      if (length - pos < 4)
+        return NULL;
+
+      len = FP_READ_UINT32_LE (data + pos);
+      if (len > FCOLS_SIZE_1 || packed_web_size (len) > length - pos)
+        return NULL;
+
+      if (i < idx)
+        pos += packed_web_size (len);
+    }
+
+  /* The rows are used as indices and angles, so they must be what
+   * bz_comp() could have produced for the minutiae set */
+  p = data + pos + 4;
+  cols = (const gint32 *) p;
+  keys = (const gint16 *) (p + (gsize) len * COLS_SIZE_2 * 4);
+  for (i = 0; i < len; i++)
+    {
+      const gint32 *row = cols + (gsize) i * COLS_SIZE_2;
+
+      if (row[0] < 0 || row[0] > G_MAXINT16 ||
+          row[1] < -180 || row[1] > 180 ||
+          row[2] < -180 || row[2] > 180 ||
+          row[3] < 1 || row[3] >= row[4] || row[4] > gstruct->nrows ||
+          row[5] < -180 || row[5] > 580)
+        return NULL;
+
+      for (j = 0; j < 3; j++)
+        if (keys[j * len + i] != row[j])
+          return NULL;
+    }
+
+  return bz_gallery_web_new_view (len, (const int (*)[COLS_SIZE_2]) cols,
+                                  keys, keys + len, keys + 2 * len);
+}
+
+/* Building the gallery Web of a template print is a large part of the cost
+ * of a match, but only depends on the template itself. Keep it around so
+ * that repeated verify/identify only needs to run bz_match(). Slots are
+ * filled atomically as the same template may be matched concurrently. */
+static BzGalleryWeb *
+fpi_print_get_bz3_web (FpPrint           *template,
+                       BzMatchContext    *ctx,
+                       guint              idx,
+                       struct xyt_struct *gstruct)
+{
+  GPtrArray *webs = g_atomic_pointer_get (&template->bz3_webs);
+  BzGalleryWeb *web;
+
+  if (!webs)
+    {
+      GPtrArray *new_webs;
+
+      new_webs = g_ptr_array_new_full (fpi_print_get_n_xyt (template),
+                                       (GDestroyNotify) bz_gallery_web_free);
+      g_ptr_array_set_size (new_webs, fpi_print_get_n_xyt (template));
+
+      if (g_atomic_pointer_compare_and_exchange (&template->bz3_webs, NULL, new_webs))
+        webs = new_webs;
+      else
+        {
+          g_ptr_array_unref (new_webs);
+          webs = g_atomic_pointer_get (&template->bz3_webs);
+        }
+    }
+
+  /* The prints must not change while they are being matched */
+  g_assert (idx < webs->len);
+
+  web = g_atomic_pointer_get (&webs->pdata[idx]);
+  if (!web)
+    {
+      BzGalleryWeb *new_web;
+
+      new_web = fpi_print_get_packed_web (template, idx, gstruct);
+      if (!new_web)
+        new_web = bozorth_gallery_web_new_ctx (ctx, gstruct);
+
+      if (g_atomic_pointer_compare_and_exchange (&webs->pdata[idx], NULL, new_web))
+        web = new_web;
+      else
+        {
+          bz_gallery_web_free (new_web);
+          web = g_atomic_pointer_get (&webs->pdata[idx]);
+        }
+    }
+
+  return web;
+}
+
+/**
+ * fpi_print_pack_webs:
+ * @print: A #FpPrint of type #FPI_PRINT_NBIS
+ * @buf: Buffer to append the record to
+ *
+ * Appends a packed Web record for @print to @buf, building the Webs that
+ * are not cached yet.
+ */
+void
+fpi_print_pack_webs (FpPrint *print, GByteArray *buf)
+{
+  BzMatchContext *ctx = fpi_print_get_bz3_match_context ();
+  struct xyt_struct scratch;
+  gsize start = buf->len;
+  guint i;
+
+  g_byte_array_set_size (buf, start + FPI_PRINT_WEBS_HEADER_SIZE);
+  memcpy (buf->data + start, FPI_PRINT_WEBS_MAGIC, 3);
+  buf->data[start + 3] = FPI_PRINT_WEBS_VERSION;
+  FP_WRITE_UINT16_LE (buf->data + start + 8, fpi_print_get_n_xyt (print));
+  FP_WRITE_UINT16_LE (buf->data + start + 10, COLS_SIZE_2);
+
+  for (i = 0; i < fpi_print_get_n_xyt (print); i++)
+    {
+      struct xyt_struct *gstruct = fpi_print_get_xyt (print, i, &scratch);
+      BzGalleryWeb *web = fpi_print_get_bz3_web (print, ctx, i, gstruct);
+      gsize pos = buf->len;
+      guchar *p;
+      gint j, k;
+
+      g_byte_array_set_size (buf, pos + packed_web_size (web->len));
+      p = buf->data + pos;
+      memset (p, 0, packed_web_size (web->len));
+
+      FP_WRITE_UINT32_LE (p, web->len);
+      p += 4;
+      for (j = 0; j < web->len; j++)
+        for (k = 0; k < COLS_SIZE_2; k++, p += 4)
+          FP_WRITE_UINT32_LE (p, (guint32) web->cols[j][k]);
+      for (j = 0; j < web->len; j++, p += 2)
+        FP_WRITE_UINT16_LE (p, (guint16) web->dist[j]);
+      for (j = 0; j < web->len; j++, p += 2)
+        FP_WRITE_UINT16_LE (p, (guint16) web->beta1[j]);
+      for (j = 0; j < web->len; j++, p += 2)
+        FP_WRITE_UINT16_LE (p, (guint16) web->beta2[j]);
+    }
+
+  FP_WRITE_UINT32_LE (buf->data + start + 4, buf->len - start);
+}
+
+/* Histogram of the edges of the bozorth3 Web over the edge length and the
+ * two angles of the edge relative to its minutiae. As these are invariant
+ * to rotation and translation, prints of the same finger have similar
+ * histograms. */
+#define BZ3_INDEX_DIST_BINS 8
+#define BZ3_INDEX_ANGLE_BINS 8
+#define BZ3_INDEX_BINS (BZ3_INDEX_DIST_BINS * BZ3_INDEX_ANGLE_BINS * BZ3_INDEX_ANGLE_BINS)
+/* bz_find() trims the Web to edges up to this length */
+#define BZ3_INDEX_MAX_DIST 75
+
+typedef struct
+{
+  guint   n_edges;
+  guint16 bins[BZ3_INDEX_BINS];
+} Bz3EdgeHistogram;
+
+static guint
+bz3_angle_bin (gint beta)
+{
+  return MIN ((guint) (beta + 180) * BZ3_INDEX_ANGLE_BINS / 360, BZ3_INDEX_ANGLE_BINS - 1);
+}
+
+static void
+bz3_edge_histogram_add (Bz3EdgeHistogram *hist, const gint *row)
+{
+  guint dist = MIN ((guint) sqrt (row[0]) * BZ3_INDEX_DIST_BINS / BZ3_INDEX_MAX_DIST,
+                    BZ3_INDEX_DIST_BINS - 1);
+  guint bin;
+
+  bin = (dist * BZ3_INDEX_ANGLE_BINS + bz3_angle_bin (row[1])) * BZ3_INDEX_ANGLE_BINS +
+        bz3_angle_bin (row[2]);
+  if (hist->bins[bin] < G_MAXUINT16)
+    hist->bins[bin]++;
+  hist->n_edges++;
+}
+
+/* Everything needed to match against and to rank a template, built once
+ * and kept with the FpPrint in a single allocation. Matching only reads
+ * this, rather than following the prints and Webs of the FpPrint. */
+typedef struct
+{
+  /* The xyt data, or its packed record for print views */
+  const struct xyt_struct *xyt;
+  const guchar            *packed;
+  BzGalleryWeb            *web;
+  Bz3EdgeHistogram         hist;
+} Bz3TemplateEntry;
+
+typedef struct
+{
+  guint               n_xyt;
+  FpiPrintXytEncoding encoding;
+  Bz3TemplateEntry    entries[];
+} Bz3Template;
+
+/* Returns the match data of @template, building it and the Webs if needed.
+ * Like the Webs, it is kept with the print. */
+static const Bz3Template *
+fpi_print_get_bz3_template (FpPrint *template, BzMatchContext *ctx)
+{
+  Bz3Template *tmpl = g_atomic_pointer_get (&template->bz3_template);
+  guint n_xyt = fpi_print_get_n_xyt (template);
+  guint k;
+  gint j;
+
+  if (tmpl)
+    return tmpl;
+
+  tmpl = g_malloc0 (sizeof (Bz3Template) + n_xyt * sizeof (Bz3TemplateEntry));
+  tmpl->n_xyt = n_xyt;
+  tmpl->encoding = template->packed_encoding;
+  for (k = 0; k < n_xyt; k++)
+    {
+      Bz3TemplateEntry *entry = &tmpl->entries[k];
+      struct xyt_struct scratch;
+      struct xyt_struct *gstruct = fpi_print_get_xyt (template, k, &scratch);
+
+      if (template->packed)
+        entry->packed = fpi_print_get_packed_xyt (template, k);
+      else
+        entry->xyt = gstruct;
+
+      entry->web = fpi_print_get_bz3_web (template, ctx, k, gstruct);
+      for (j = 0; j < entry->web->len; j++)
+        bz3_edge_histogram_add (&entry->hist, entry->web->cols[j]);
+    }
+
+  if (!g_atomic_pointer_compare_and_exchange (&template->bz3_template, NULL, tmpl))
+    {
+      g_free (tmpl);
+      tmpl = g_atomic_pointer_get (&template->bz3_template);
+    }
+
+  return tmpl;
+}
+
+/* Returns the best score of @pstruct against the prints in @tmpl. Stops
+ * as soon as one of them reaches @bz3_threshold, in which case the score
+ * is only known to be at least @bz3_threshold. */
+static gint
+fpi_print_bz3_template_score (BzMatchContext    *ctx,
+                              gint               probe_len,
+                              struct xyt_struct *pstruct,
+                              const Bz3Template *tmpl,
+                              gint               bz3_threshold)
+{
+  struct xyt_struct scratch;
+  gint best = 0;
+  guint i;
+
+  for (i = 0; i < tmpl->n_xyt; i++)
+    {
+      const Bz3TemplateEntry *entry = &tmpl->entries[i];
+      const struct xyt_struct *gstruct = entry->xyt;
+      gint score;
+
+      if (!gstruct)
+        {
+          fpi_print_packed_decode (entry->packed, tmpl->encoding, &scratch);
+          gstruct = &scratch;
+        }
+
+      score = bozorth_to_gallery_web_threshold_ctx (ctx, probe_len, pstruct,
+                                                    (struct xyt_struct *) gstruct,
+                                                    entry->web, bz3_threshold);
+      fp_dbg ("score %d", score);
+
+      best = MAX (best, score);
+      if (score >= bz3_threshold)
+        break;
+    }
+
+  return best;
+}
+
+struct _FpiBz3Probe
+{
+  struct xyt_struct xyt;
+  BzGalleryWeb     *web;
+};
+
+/**
+ * fpi_print_bz3_probe_new:
+ * @print: A newly scanned #FpPrint
+ * @error: Return location for error
+ *
+ * Prepares the newly scanned @print (containing exactly one print) for
+ * matching. The comparison table of the probe is computed only once, so
+ * this is cheaper than calling fpi_print_bz3_match() repeatedly when the
+ * same print is matched against several templates.
+ *
+ * The probe does not reference @print and may be used from multiple threads
+ * at the same time.
+ *
+ * Returns: (transfer full) (nullable): A new #FpiBz3Probe, free it with
+ *   fpi_print_bz3_probe_free()
+ */
+FpiBz3Probe *
+fpi_print_bz3_probe_new (FpPrint *print, GError **error)
+{
+  FpiBz3Probe *probe;
+  struct xyt_struct scratch;
+
+  g_return_val_if_fail (FP_IS_PRINT (print), NULL);
+
+  /* XXX: Use a different error type? */
+  if (print->type != FPI_PRINT_NBIS)
+    {
+      g_propagate_error (error,
+                         fpi_device_error_new_msg (FP_DEVICE_ERROR_NOT_SUPPORTED,
+                                                   "It is only possible to match NBIS type print data"));
+      return NULL;
+    }
+
+  if (fpi_print_get_n_xyt (print) != 1)
+    {
+      g_propagate_error (error,
+                         fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
+                                                   "New print contains more than one print!"));
+      return NULL;
+    }
+
+  probe = g_new (FpiBz3Probe, 1);
+  probe->xyt = *fpi_print_get_xyt (print, 0, &scratch);
+  probe->web = bozorth_probe_web_new_ctx (fpi_print_get_bz3_match_context (), &probe->xyt);
+
+  return probe;
+}
+
+/**
+ * fpi_print_bz3_probe_free:
+ * @probe: (transfer full): A #FpiBz3Probe
+ *
+ * Frees a probe created by fpi_print_bz3_probe_new().
+ */
+void
+fpi_print_bz3_probe_free (FpiBz3Probe *probe)
+{
+  if (!probe)
+    return;
+
+  bz_gallery_web_free (probe->web);
+  g_free (probe);
+}
+
+static gint
+fpi_print_bz3_probe_score (FpiBz3Probe       *probe,
+                           FpPrint           *template,
+                           const Bz3Template *tmpl,
+                           gint               bz3_threshold)
+{
+  BzMatchContext *ctx = fpi_print_get_bz3_match_context ();
+  gint probe_len;
+  gint score;
+
+  if (!tmpl)
+    tmpl = fpi_print_get_bz3_template (template, ctx);
+
+  FPI_TRACE2 (match_start, template, tmpl->n_xyt);
+  probe_len = bozorth_probe_web_load_ctx (ctx, probe->web);
+
+  score = fpi_print_bz3_template_score (ctx, probe_len, &probe->xyt,
+                                        tmpl, bz3_threshold);
+  FPI_TRACE2 (match_end, template, score);
+
+  return score;
+}
+
+/**
+ * fpi_print_bz3_probe_match:
+ * @probe: A #FpiBz3Probe
+ * @template: A #FpPrint containing one or more prints
+ * @bz3_threshold: The BZ3 match threshold
+ * @error: Return location for error
+ *
+ * Match the prepared @probe against the prints contained in @template,
+ * see fpi_print_bz3_match().
+ *
+ * Returns: Whether the prints match, @error will be set if #FPI_MATCH_ERROR is returned
+ */
+FpiMatchResult
+fpi_print_bz3_probe_match (FpiBz3Probe *probe,
+                           FpPrint     *template,
+                           gint         bz3_threshold,
+                           GError     **error)
+{
+  g_return_val_if_fail (probe != NULL, FPI_MATCH_ERROR);
+
+  if (template->type != FPI_PRINT_NBIS)
+    {
+      g_propagate_error (error,
+                         fpi_device_error_new_msg (FP_DEVICE_ERROR_NOT_SUPPORTED,
+                                                   "It is only possible to match NBIS type print data"));
+      return FPI_MATCH_ERROR;
+    }
+
+  if (fpi_print_bz3_probe_score (probe, template, NULL, bz3_threshold) >= bz3_threshold)
+    return FPI_MATCH_SUCCESS;
+
+  return FPI_MATCH_FAIL;
+}
+
 /**
  * fpi_print_bz3_match:
  * @template: A #FpPrint containing one or more prints
@@ -207,14 +913,14 @@ fpi_print_add_from_image (FpPrint *print,
  * Both @template and @print need to be of type #FPI_PRINT_NBIS for this to
  * work.
  *
+ * This function may be called from multiple threads at the same time.
+ *
  * Returns: Whether the prints match, @error will be set if #FPI_MATCH_ERROR is returned
  */
 FpiMatchResult
 fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint bz3_threshold, GError **error)
 {
-  struct xyt_struct *pstruct;
-  gint probe_len;
-  gint i;
+  g_autoptr(FpiBz3Probe) probe = NULL;
 
   /* XXX: Use a different error type? */
   if (template->type != FPI_PRINT_NBIS || print->type != FPI_PRINT_NBIS)
@@ -224,29 +930,1013 @@ fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint bz3_threshold, GErr
       return FPI_MATCH_ERROR;
     }
 
-  if (print->prints->len != 1)
-    {
-      *error = fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
-                                         "New print contains more than one print!");
-      return FPI_MATCH_ERROR;
-    }
+  probe = fpi_print_bz3_probe_new (print, error);
+  if (!probe)
+    return FPI_MATCH_ERROR;
 
-  pstruct = g_ptr_array_index (print->prints, 0);
-  probe_len = bozorth_probe_init (pstruct);
+  return fpi_print_bz3_probe_match (probe, template, bz3_threshold, error);
+}
 
-  for (i = 0; i < template->prints->len; i++)
-    {
-      struct xyt_struct *gstruct;
-      gint score;
-      gstruct = g_ptr_array_index (template->prints, i);
-      score = bozorth_to_gallery (probe_len, pstruct, gstruct);
-      fp_dbg ("score %d", score);
+/* Compatible edge pairs found by bz_match() only support a registration
+ * if their rotation is within this many degrees of the dominant one. */
+#define CONSOLIDATE_ROTATION_TOLERANCE 10
+/* Maximum distance in pixels of a registered minutia to its partner */
+#define CONSOLIDATE_MAX_RESIDUAL 15
+/* Registered minutiae this close to an existing one, and with a similar
+ * direction, are considered to be the same minutia. */
+#define CONSOLIDATE_MERGE_DISTANCE 12
+#define CONSOLIDATE_MERGE_ANGLE 30
+/* Minimum number of corresponding minutiae for a registration */
+#define CONSOLIDATE_MIN_PAIRS 6
 
-      if (score >= bz3_threshold)
-        return FPI_MATCH_SUCCESS;
-    }
+typedef struct
+{
+  gdouble cos_a, sin_a;
+  gdouble tx, ty;
+  gint    dtheta;
+} Bz3Registration;
 
-  return FPI_MATCH_FAIL;
+typedef struct
+{
+  gint x, y, theta;
+  gint support;
+} Bz3MergedMinutia;
+
+static gint
+angle_diff (gint a, gint b)
+{
+  gint d = (a - b) % 360;
+
+  if (d > 180)
+    d -= 360;
+  else if (d <= -180)
+    d += 360;
+
+  return d;
+}
+
+static void
+bz3_registration_apply (const Bz3Registration *reg,
+                        gint                   x,
+                        gint                   y,
+                        gint                   theta,
+                        Bz3MergedMinutia      *out)
+{
+  out->x = (gint) round (reg->cos_a * x - reg->sin_a * y + reg->tx);
+  out->y = (gint) round (reg->sin_a * x + reg->cos_a * y + reg->ty);
+  out->theta = angle_diff (theta + reg->dtheta, 0);
+}
+
+/* Least squares rigid transformation of the probe minutiae onto their
+ * gallery partners */
+static void
+bz3_registration_fit (Bz3Registration         *reg,
+                      const struct xyt_struct *probe,
+                      const struct xyt_struct *gallery,
+                      const gint              *pairs,
+                      gint                     n_pairs)
+{
+  gdouble pcx = 0, pcy = 0, gcx = 0, gcy = 0;
+  gdouble dot = 0, cross = 0, tcos = 0, tsin = 0;
+  gdouble angle;
+  gint i;
+
+  for (i = 0; i < n_pairs; i++)
+    {
+      pcx += probe->xcol[pairs[2 * i]];
+      pcy += probe->ycol[pairs[2 * i]];
+      gcx += gallery->xcol[pairs[2 * i + 1]];
+      gcy += gallery->ycol[pairs[2 * i + 1]];
+    }
+  pcx /= n_pairs;
+  pcy /= n_pairs;
+  gcx /= n_pairs;
+  gcy /= n_pairs;
+
+  for (i = 0; i < n_pairs; i++)
+    {
+      gint p = pairs[2 * i];
+      gint g = pairs[2 * i + 1];
+      gdouble px = probe->xcol[p] - pcx;
+      gdouble py = probe->ycol[p] - pcy;
+      gdouble gx = gallery->xcol[g] - gcx;
+      gdouble gy = gallery->ycol[g] - gcy;
+      gdouble dt = angle_diff (gallery->thetacol[g], probe->thetacol[p]) * G_PI / 180;
+
+      dot += px * gx + py * gy;
+      cross += px * gy - py * gx;
+      tcos += cos (dt);
+      tsin += sin (dt);
+    }
+
+  angle = atan2 (cross, dot);
+  reg->cos_a = cos (angle);
+  reg->sin_a = sin (angle);
+  reg->tx = gcx - (reg->cos_a * pcx - reg->sin_a * pcy);
+  reg->ty = gcy - (reg->sin_a * pcx + reg->cos_a * pcy);
+  reg->dtheta = (gint) round (atan2 (tsin, tcos) * 180 / G_PI);
+}
+
+/* Registers the probe onto the gallery using the minutiae pairing of the
+ * compatible edge pairs found by the bozorth3 matcher, and returns the
+ * match score, or -1 if no registration could be found. */
+static gint
+bz3_register (BzMatchContext    *ctx,
+              struct xyt_struct *probe,
+              struct xyt_struct *gallery,
+              Bz3Registration   *reg)
+{
+  g_autofree gint *votes = NULL;
+  g_autofree gint *pairs = NULL;
+  gint rotations[360] = { 0 };
+  gint best_sum = -1, rotation = 0;
+  gint np, i, j, p, g, n_pairs, n_inliers;
+  gint pn = probe->nrows, gn = gallery->nrows;
+
+  np = bz_match (ctx,
+                 bozorth_probe_init_ctx (ctx, probe),
+                 bozorth_gallery_init_ctx (ctx, gallery));
+
+  /* The dominant rotation between the edges */
+  for (i = 0; i < np; i++)
+    rotations[angle_diff (ctx->colp[i][0], 0) + 179]++;
+
+  for (i = 0; i < 360; i++)
+    {
+      gint sum = 0;
+
+      for (j = -CONSOLIDATE_ROTATION_TOLERANCE; j <= CONSOLIDATE_ROTATION_TOLERANCE; j++)
+        sum += rotations[(i + j + 360) % 360];
+
+      if (sum > best_sum ||
+          (sum == best_sum && rotations[i] > rotations[rotation + 179]))
+        {
+          best_sum = sum;
+          rotation = i - 179;
+        }
+    }
+
+  /* Each edge pair pairs up its two probe minutiae with the gallery ones */
+  votes = g_new0 (gint, pn * gn);
+  for (i = 0; i < np; i++)
+    {
+      if (ABS (angle_diff (ctx->colp[i][0], rotation)) > CONSOLIDATE_ROTATION_TOLERANCE)
+        continue;
+
+      for (j = 0; j < 2; j++)
+        {
+          p = ctx->colp[i][1 + j] - 1;
+          g = ctx->colp[i][3 + j] - 1;
+
+          if (p >= 0 && p < pn && g >= 0 && g < gn)
+            votes[p * gn + g]++;
+        }
+    }
+
+  /* Only keep unambiguous pairs */
+  pairs = g_new (gint, 2 * pn);
+  n_pairs = 0;
+  for (p = 0; p < pn; p++)
+    {
+      gint best = 0;
+
+      for (g = 1; g < gn; g++)
+        if (votes[p * gn + g] > votes[p * gn + best])
+          best = g;
+
+      if (votes[p * gn + best] < 2)
+        continue;
+
+      for (i = 0; i < pn; i++)
+        if (i != p && votes[i * gn + best] >= votes[p * gn + best])
+          break;
+
+      if (i < pn)
+        continue;
+
+      pairs[2 * n_pairs] = p;
+      pairs[2 * n_pairs + 1] = best;
+      n_pairs++;
+    }
+
+  if (n_pairs < CONSOLIDATE_MIN_PAIRS)
+    return -1;
+
+  /* Fit, then refit on the pairs that agree with the transformation */
+  bz3_registration_fit (reg, probe, gallery, pairs, n_pairs);
+
+  n_inliers = 0;
+  for (i = 0; i < n_pairs; i++)
+    {
+      Bz3MergedMinutia m;
+
+      p = pairs[2 * i];
+      g = pairs[2 * i + 1];
+      bz3_registration_apply (reg, probe->xcol[p], probe->ycol[p], probe->thetacol[p], &m);
+
+      if (SQUARED (m.x - gallery->xcol[g]) + SQUARED (m.y - gallery->ycol[g]) >
+          SQUARED (CONSOLIDATE_MAX_RESIDUAL))
+        continue;
+
+      pairs[2 * n_inliers] = p;
+      pairs[2 * n_inliers + 1] = g;
+      n_inliers++;
+    }
+
+  if (n_inliers < CONSOLIDATE_MIN_PAIRS)
+    return -1;
+
+  bz3_registration_fit (reg, probe, gallery, pairs, n_inliers);
+
+  return bz_match_score (ctx, np, probe, gallery);
+}
+
+static int
+sort_merged_support (const void *a, const void *b)
+{
+  const Bz3MergedMinutia *ma = a;
+  const Bz3MergedMinutia *mb = b;
+
+  if (ma->support != mb->support)
+    return mb->support - ma->support;
+  if (ma->x != mb->x)
+    return ma->x - mb->x;
+
+  return ma->y - mb->y;
+}
+
+static void
+bz3_merge (GArray *merged, const Bz3MergedMinutia *m)
+{
+  guint i;
+
+  for (i = 0; i < merged->len; i++)
+    {
+      Bz3MergedMinutia *e = &g_array_index (merged, Bz3MergedMinutia, i);
+
+      if (SQUARED (e->x - m->x) + SQUARED (e->y - m->y) <= SQUARED (CONSOLIDATE_MERGE_DISTANCE) &&
+          ABS (angle_diff (e->theta, m->theta)) <= CONSOLIDATE_MERGE_ANGLE)
+        {
+          e->support++;
+          return;
+        }
+    }
+
+  g_array_append_val (merged, *m);
+}
+
+/**
+ * fpi_print_consolidate:
+ * @print: A #FpPrint of type #FPI_PRINT_NBIS
+ * @bz3_threshold: The BZ3 match threshold
+ *
+ * Registers the prints contained in @print (e.g. the enroll stages)
+ * against the one with the most minutiae and merges all prints that
+ * match it into a single print. Minutiae that are found in several of
+ * the prints are only stored once, and the ones found most often are
+ * kept if there are more than bozorth3 supports. Prints that cannot be
+ * registered are kept as they are.
+ *
+ * Matching against @print afterwards needs fewer comparisons.
+ *
+ * Returns: %TRUE if any prints were merged
+ */
+gboolean
+fpi_print_consolidate (FpPrint *print, gint bz3_threshold)
+{
+  g_autoptr(GArray) merged = NULL;
+  g_autoptr(GPtrArray) prints = NULL;
+  struct minutiae_struct c[MAX_BOZORTH_MINUTIAE];
+  struct xyt_struct *base, *consolidated;
+  BzMatchContext *ctx;
+  guint n, i, base_idx = 0;
+  gint j, n_merged = 0;
+
+  g_return_val_if_fail (print->type == FPI_PRINT_NBIS, FALSE);
+
+  n = fpi_print_get_n_xyt (print);
+  if (n < 2)
+    return FALSE;
+
+  fpi_print_unpack (print);
+
+  for (i = 1; i < n; i++)
+    {
+      struct xyt_struct *xyt = g_ptr_array_index (print->prints, i);
+
+      if (xyt->nrows > ((struct xyt_struct *) g_ptr_array_index (print->prints, base_idx))->nrows)
+        base_idx = i;
+    }
+  base = g_ptr_array_index (print->prints, base_idx);
+
+  merged = g_array_sized_new (FALSE, FALSE, sizeof (Bz3MergedMinutia), base->nrows * n);
+  for (j = 0; j < base->nrows; j++)
+    {
+      Bz3MergedMinutia m = { base->xcol[j], base->ycol[j], base->thetacol[j], 1 };
+
+      g_array_append_val (merged, m);
+    }
+
+  ctx = fpi_print_get_bz3_match_context ();
+  prints = g_ptr_array_new_with_free_func (g_free);
+  /* Placeholder for the consolidated print */
+  g_ptr_array_add (prints, NULL);
+
+  for (i = 0; i < n; i++)
+    {
+      struct xyt_struct *xyt = g_ptr_array_index (print->prints, i);
+      Bz3Registration reg;
+
+      if (i == base_idx)
+        continue;
+
+      if (bz3_register (ctx, xyt, base, &reg) < bz3_threshold)
+        {
+          g_ptr_array_add (prints, g_memdup (xyt, sizeof (struct xyt_struct)));
+          continue;
+        }
+
+      for (j = 0; j < xyt->nrows; j++)
+        {
+          Bz3MergedMinutia m;
+
+          bz3_registration_apply (&reg, xyt->xcol[j], xyt->ycol[j], xyt->thetacol[j], &m);
+          m.support = 1;
+          bz3_merge (merged, &m);
+        }
+      n_merged++;
+    }
+
+  fp_dbg ("Consolidated %d of %u prints into %u minutiae", n_merged + 1, n, merged->len);
+
+  if (n_merged == 0)
+    return FALSE;
+
+  /* Keep the minutiae seen most often and store them in bozorth3 order */
+  g_array_sort (merged, sort_merged_support);
+  g_array_set_size (merged, MIN (merged->len, MAX_BOZORTH_MINUTIAE));
+
+  for (i = 0; i < merged->len; i++)
+    {
+      Bz3MergedMinutia *m = &g_array_index (merged, Bz3MergedMinutia, i);
+
+      c[i].col[0] = m->x;
+      c[i].col[1] = m->y;
+      c[i].col[2] = m->theta;
+      c[i].col[3] = m->support;
+    }
+  qsort (c, merged->len, sizeof (struct minutiae_struct), sort_x_y);
+
+  consolidated = g_new0 (struct xyt_struct, 1);
+  for (i = 0; i < merged->len; i++)
+    {
+      consolidated->xcol[i] = c[i].col[0];
+      consolidated->ycol[i] = c[i].col[1];
+      consolidated->thetacol[i] = c[i].col[2];
+    }
+  consolidated->nrows = merged->len;
+
+  g_ptr_array_index (prints, 0) = consolidated;
+
+  g_ptr_array_unref (print->prints);
+  print->prints = g_steal_pointer (&prints);
+  fpi_print_invalidate (print);
+
+  return TRUE;
+}
+
+/* Galleries smaller than this are matched on the calling thread, the
+ * overhead of dispatching them is larger than the matching itself. */
+#define BZ3_IDENTIFY_MIN_PARALLEL 4
+/* Number of chunks to queue per worker, so that a slow chunk does not
+ * leave the other workers idle. */
+#define BZ3_IDENTIFY_CHUNKS_PER_THREAD 4
+/* Galleries of at least this size are ranked by their edge histograms
+ * first, and the best candidates are matched before all others. */
+#define BZ3_IDENTIFY_MIN_INDEXED 32
+#define BZ3_IDENTIFY_CANDIDATES 8
+
+/* Overlap of the two histograms in 1/1000th of the smaller one */
+static gint
+bz3_edge_histogram_similarity (const Bz3EdgeHistogram *a,
+                               const Bz3EdgeHistogram *b)
+{
+  guint common = 0;
+  guint i;
+
+  if (a->n_edges == 0 || b->n_edges == 0)
+    return 0;
+
+  for (i = 0; i < BZ3_INDEX_BINS; i++)
+    common += MIN (a->bins[i], b->bins[i]);
+
+  return common * 1000 / MIN (a->n_edges, b->n_edges);
+}
+
+typedef struct
+{
+  guint index;
+  gint  similarity;
+} Bz3IdentifyCandidate;
+
+static int
+bz3_identify_candidate_compare (gconstpointer a, gconstpointer b)
+{
+  const Bz3IdentifyCandidate *ca = a;
+  const Bz3IdentifyCandidate *cb = b;
+
+  if (ca->similarity != cb->similarity)
+    return cb->similarity - ca->similarity;
+
+  return (gint) ca->index - (gint) cb->index;
+}
+
+/**
+ * fpi_print_bz3_prepare:
+ * @print: A template #FpPrint
+ *
+ * Builds the data needed to match against @print and to rank it in a
+ * gallery, which would otherwise be built on the first match. This data
+ * is kept with @print. Prints that are not of type %FPI_PRINT_NBIS are
+ * ignored.
+ */
+void
+fpi_print_bz3_prepare (FpPrint *print)
+{
+  g_return_if_fail (FP_IS_PRINT (print));
+
+  if (print->type != FPI_PRINT_NBIS)
+    return;
+
+  fpi_print_get_bz3_template (print, fpi_print_get_bz3_match_context ());
+}
+
+/* Orders the gallery by the similarity of the edge histograms of the Webs
+ * to the one of the probe, most similar first. The match data of the
+ * templates is stored in @tmpls on the way. */
+static guint *
+fpi_print_bz3_identify_rank (GPtrArray          *templates,
+                             const Bz3Template **tmpls,
+                             FpiBz3Probe        *probe)
+{
+  g_autofree Bz3IdentifyCandidate *candidates = NULL;
+  g_autofree Bz3EdgeHistogram *probe_hist = NULL;
+  BzMatchContext *ctx = fpi_print_get_bz3_match_context ();
+  guint *order;
+  guint i;
+  gint j;
+
+  probe_hist = g_new0 (Bz3EdgeHistogram, 1);
+  for (j = 0; j < probe->web->len; j++)
+    bz3_edge_histogram_add (probe_hist, probe->web->cols[j]);
+
+  candidates = g_new0 (Bz3IdentifyCandidate, templates->len);
+  for (i = 0; i < templates->len; i++)
+    {
+      FpPrint *template = g_ptr_array_index (templates, i);
+      const Bz3Template *tmpl;
+      guint k;
+
+      candidates[i].index = i;
+      candidates[i].similarity = -1;
+
+      /* Errors are reported when matching */
+      if (template->type != FPI_PRINT_NBIS)
+        continue;
+
+      tmpl = tmpls[i] = fpi_print_get_bz3_template (template, ctx);
+      for (k = 0; k < tmpl->n_xyt; k++)
+        candidates[i].similarity = MAX (candidates[i].similarity,
+                                        bz3_edge_histogram_similarity (probe_hist,
+                                                                       &tmpl->entries[k].hist));
+    }
+
+  qsort (candidates, templates->len, sizeof (Bz3IdentifyCandidate),
+         bz3_identify_candidate_compare);
+
+  order = g_new (guint, templates->len);
+  for (i = 0; i < templates->len; i++)
+    order[i] = candidates[i].index;
+
+  return order;
+}
+
+/* The number of best cylinder code candidates that are matched first, and
+ * the only ones that are matched with %FPI_MATCHER_CYLINDER */
+#define CYLINDER_IDENTIFY_CANDIDATES 16
+
+/* Returns the cylinder codes of every print in @template, building them if
+ * needed. Like the match data, they are kept with the print. */
+static GPtrArray *
+fpi_print_get_cylinders (FpPrint *template)
+{
+  GPtrArray *sets = g_atomic_pointer_get (&template->cylinders);
+  guint n_xyt = fpi_print_get_n_xyt (template);
+  guint k;
+
+  if (sets)
+    return sets;
+
+  sets = g_ptr_array_new_full (n_xyt, (GDestroyNotify) fpi_cylinder_set_free);
+  for (k = 0; k < n_xyt; k++)
+    {
+      struct xyt_struct scratch;
+
+      g_ptr_array_add (sets, fpi_cylinder_set_new (fpi_print_get_xyt (template, k, &scratch)));
+    }
+
+  if (!g_atomic_pointer_compare_and_exchange (&template->cylinders, NULL, sets))
+    {
+      g_ptr_array_unref (sets);
+      sets = g_atomic_pointer_get (&template->cylinders);
+    }
+
+  return sets;
+}
+
+/* Orders the gallery by the cylinder code similarity of the templates to
+ * the probe, most similar first. Unlike the edge histograms, the codes
+ * don't need the bozorth3 Webs of the templates, so these are only built
+ * for the templates that are actually matched. */
+static guint *
+fpi_print_cylinder_identify_rank (GPtrArray   *templates,
+                                  FpiBz3Probe *probe,
+                                  GError     **error)
+{
+  g_autofree Bz3IdentifyCandidate *candidates = NULL;
+  g_autoptr(FpiCylinderSet) probe_set = NULL;
+  guint *order;
+  guint i;
+
+  probe_set = fpi_cylinder_set_new (&probe->xyt);
+
+  candidates = g_new0 (Bz3IdentifyCandidate, templates->len);
+  for (i = 0; i < templates->len; i++)
+    {
+      FpPrint *template = g_ptr_array_index (templates, i);
+      GPtrArray *sets;
+      guint k;
+
+      /* Templates ranked too low would never report the error */
+      if (template->type != FPI_PRINT_NBIS)
+        {
+          g_propagate_error (error,
+                             fpi_device_error_new_msg (FP_DEVICE_ERROR_NOT_SUPPORTED,
+                                                       "It is only possible to match NBIS type print data"));
+          return NULL;
+        }
+
+      sets = fpi_print_get_cylinders (template);
+
+      candidates[i].index = i;
+      for (k = 0; k < sets->len; k++)
+        candidates[i].similarity = MAX (candidates[i].similarity,
+                                        fpi_cylinder_set_score (probe_set,
+                                                                g_ptr_array_index (sets, k)));
+    }
+
+  qsort (candidates, templates->len, sizeof (Bz3IdentifyCandidate),
+         bz3_identify_candidate_compare);
+
+  order = g_new (guint, templates->len);
+  for (i = 0; i < templates->len; i++)
+    order[i] = candidates[i].index;
+
+  return order;
+}
+
+static FpiMatcher
+fpi_print_resolve_matcher (FpiMatcher matcher)
+{
+  const gchar *env;
+
+  if (matcher != FPI_MATCHER_DEFAULT)
+    return matcher;
+
+  env = g_getenv ("FP_MATCHER");
+  if (!env || g_strcmp0 (env, "bozorth3") == 0)
+    return FPI_MATCHER_BOZORTH3;
+  if (g_strcmp0 (env, "cylinder-rank") == 0)
+    return FPI_MATCHER_CYLINDER_RANK;
+  if (g_strcmp0 (env, "cylinder") == 0)
+    return FPI_MATCHER_CYLINDER;
+
+  fp_warn ("Unknown matcher \"%s\" in FP_MATCHER, using bozorth3", env);
+  return FPI_MATCHER_BOZORTH3;
+}
+
+typedef struct
+{
+  GMutex       mutex;
+  GCond        cond;
+
+  GPtrArray   *templates;
+  /* The match data of the templates, where already known */
+  const Bz3Template **tmpls;
+  /* Order in which to match the templates, or NULL */
+  guint       *order;
+  FpiBz3Probe *probe;
+  gint         bz3_threshold;
+
+  gint         found;
+  guint        pending;
+  gint         best_score;
+  gint         best_index;
+  /* Score of every template, or NULL */
+  gint        *scores;
+  GError      *error;
+} Bz3IdentifyData;
+
+typedef struct
+{
+  Bz3IdentifyData *data;
+  guint            start;
+  guint            end;
+} Bz3IdentifyChunk;
+
+static void
+fpi_print_bz3_identify_chunk (Bz3IdentifyChunk *chunk)
+{
+  Bz3IdentifyData *data = chunk->data;
+  guint i;
+
+  for (i = chunk->start; i < chunk->end && !g_atomic_int_get (&data->found); i++)
+    {
+      guint idx = data->order ? data->order[i] : i;
+      FpPrint *template = g_ptr_array_index (data->templates, idx);
+      gint score;
+
+      if (!data->tmpls[idx] && template->type != FPI_PRINT_NBIS)
+        {
+          g_mutex_lock (&data->mutex);
+          if (!data->error)
+            data->error = fpi_device_error_new_msg (FP_DEVICE_ERROR_NOT_SUPPORTED,
+                                                    "It is only possible to match NBIS type print data");
+          g_mutex_unlock (&data->mutex);
+          g_atomic_int_set (&data->found, TRUE);
+          break;
+        }
+
+      score = fpi_print_bz3_probe_score (data->probe, template, data->tmpls[idx],
+                                         data->bz3_threshold);
+      if (data->scores)
+        data->scores[idx] = score;
+
+      g_mutex_lock (&data->mutex);
+      /* Prefer the lower index on ties to keep the result deterministic */
+      if (score > data->best_score ||
+          (score == data->best_score && idx < data->best_index))
+        {
+          data->best_score = score;
+          data->best_index = idx;
+        }
+      g_mutex_unlock (&data->mutex);
+
+      if (score >= data->bz3_threshold)
+        g_atomic_int_set (&data->found, TRUE);
+    }
+}
+
+static void
+fpi_print_bz3_identify_worker (gpointer task, gpointer user_data)
+{
+  Bz3IdentifyChunk *chunk = task;
+  Bz3IdentifyData *data = chunk->data;
+
+  fpi_print_bz3_identify_chunk (chunk);
+  g_free (chunk);
+
+  g_mutex_lock (&data->mutex);
+  data->pending -= 1;
+  if (data->pending == 0)
+    g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->mutex);
+}
+
+static GThreadPool *
+fpi_print_get_bz3_identify_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    {
+      GThreadPool *p;
+
+      p = fpi_worker_pool_new (fpi_print_bz3_identify_worker, G_MAXUINT, FALSE);
+      g_once_init_leave (&pool, (gsize) p);
+    }
+
+  return (GThreadPool *) pool;
+}
+
+/* Matches the templates at positions @start to @end of the search order,
+ * in parallel if there are enough of them. */
+static void
+fpi_print_bz3_identify_run (Bz3IdentifyData *data, guint start, guint end)
+{
+  guint n_threads = fpi_worker_get_max_threads ();
+  GThreadPool *pool;
+  guint n_chunks;
+  guint chunk_len;
+  guint i;
+
+  if (n_threads == 1 || end - start < BZ3_IDENTIFY_MIN_PARALLEL)
+    {
+      Bz3IdentifyChunk chunk = { data, start, end };
+
+      fpi_print_bz3_identify_chunk (&chunk);
+      return;
+    }
+
+  pool = fpi_print_get_bz3_identify_pool ();
+  n_chunks = MIN (end - start, n_threads * BZ3_IDENTIFY_CHUNKS_PER_THREAD);
+  chunk_len = (end - start + n_chunks - 1) / n_chunks;
+
+  g_mutex_lock (&data->mutex);
+  for (i = start; i < end; i += chunk_len)
+    {
+      Bz3IdentifyChunk *chunk = g_new0 (Bz3IdentifyChunk, 1);
+
+      chunk->data = data;
+      chunk->start = i;
+      chunk->end = MIN (i + chunk_len, end);
+
+      data->pending += 1;
+      g_thread_pool_push (pool, chunk, NULL);
+    }
+
+  while (data->pending > 0)
+    g_cond_wait (&data->cond, &data->mutex);
+  g_mutex_unlock (&data->mutex);
+}
+
+/**
+ * fpi_print_bz3_identify:
+ * @templates: (element-type FpPrint): The #FpPrint gallery to search
+ * @print: A newly scanned #FpPrint to test
+ * @bz3_threshold: The BZ3 match threshold
+ * @score: (out) (optional): Return location for the score of the result
+ * @error: Return location for error
+ *
+ * Match the newly scanned @print (containing exactly one print) against
+ * every template in @templates. The bozorth3 Web of @print is built only
+ * once and shared by all templates, so this is a lot cheaper than calling
+ * fpi_print_bz3_match() for each of them. Larger galleries are split into
+ * chunks which are matched in parallel on a thread pool sized to the
+ * number of processors.
+ *
+ * Larger galleries are first ranked by how similar the edge histograms
+ * of their templates are to the one of @print, and the most similar
+ * templates are matched before all others. The whole gallery is still
+ * searched if none of them matches.
+ *
+ * All workers stop as soon as one template reaches @bz3_threshold. If
+ * several templates reached it by then, the one with the highest score
+ * is returned.
+ *
+ * This is fpi_print_identify() with %FPI_MATCHER_BOZORTH3.
+ *
+ * Returns: (transfer none) (nullable): The matching template, or %NULL
+ */
+FpPrint *
+fpi_print_bz3_identify (GPtrArray *templates,
+                        FpPrint   *print,
+                        gint       bz3_threshold,
+                        gint      *score,
+                        GError   **error)
+{
+  return fpi_print_identify (templates, print, FPI_MATCHER_BOZORTH3,
+                             bz3_threshold, score, error);
+}
+
+/**
+ * fpi_print_identify:
+ * @templates: (element-type FpPrint): The #FpPrint gallery to search
+ * @print: A newly scanned #FpPrint to test
+ * @matcher: The #FpiMatcher to search the gallery with
+ * @bz3_threshold: The BZ3 match threshold
+ * @score: (out) (optional): Return location for the score of the result
+ * @error: Return location for error
+ *
+ * Like fpi_print_bz3_identify(), but the order in which the gallery is
+ * searched and the templates that are considered at all depend on
+ * @matcher.
+ *
+ * With the cylinder code matchers, the whole gallery is ranked by
+ * comparing fixed length binary descriptors of the minutiae, which only
+ * costs a few popcounts per pair of minutiae. The best
+ * candidates are then matched with bozorth3, which still decides whether
+ * @print matches and computes @score.
+ *
+ * Returns: (transfer none) (nullable): The matching template, or %NULL
+ */
+FpPrint *
+fpi_print_identify (GPtrArray *templates,
+                    FpPrint   *print,
+                    FpiMatcher matcher,
+                    gint       bz3_threshold,
+                    gint      *score,
+                    GError   **error)
+{
+  g_autoptr(FpiBz3Probe) probe = NULL;
+  Bz3IdentifyData data = { 0, };
+
+  g_return_val_if_fail (templates != NULL, NULL);
+  g_return_val_if_fail (FP_IS_PRINT (print), NULL);
+
+  if (score)
+    *score = 0;
+
+  if (templates->len == 0)
+    return NULL;
+
+  probe = fpi_print_bz3_probe_new (print, error);
+  if (!probe)
+    return NULL;
+
+  matcher = fpi_print_resolve_matcher (matcher);
+  if (matcher != FPI_MATCHER_BOZORTH3)
+    {
+      data.order = fpi_print_cylinder_identify_rank (templates, probe, error);
+      if (!data.order)
+        return NULL;
+    }
+
+  data.templates = templates;
+  data.tmpls = g_new0 (const Bz3Template *, templates->len);
+  data.probe = probe;
+  data.bz3_threshold = bz3_threshold;
+  data.best_score = -1;
+  data.best_index = templates->len;
+
+  g_mutex_init (&data.mutex);
+  g_cond_init (&data.cond);
+
+  if (data.order)
+    {
+      guint n_candidates = MIN (CYLINDER_IDENTIFY_CANDIDATES, templates->len);
+
+      fpi_print_bz3_identify_run (&data, 0, n_candidates);
+      if (!g_atomic_int_get (&data.found) && matcher == FPI_MATCHER_CYLINDER_RANK)
+        fpi_print_bz3_identify_run (&data, n_candidates, templates->len);
+    }
+  else if (templates->len >= BZ3_IDENTIFY_MIN_INDEXED)
+    {
+      guint n_candidates = MIN (BZ3_IDENTIFY_CANDIDATES, templates->len);
+
+      data.order = fpi_print_bz3_identify_rank (templates, data.tmpls, probe);
+
+      fpi_print_bz3_identify_run (&data, 0, n_candidates);
+      if (!g_atomic_int_get (&data.found))
+        fpi_print_bz3_identify_run (&data, n_candidates, templates->len);
+    }
+  else
+    {
+      fpi_print_bz3_identify_run (&data, 0, templates->len);
+    }
+
+  g_mutex_clear (&data.mutex);
+  g_cond_clear (&data.cond);
+  g_free (data.order);
+  g_free (data.tmpls);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      return NULL;
+    }
+
+  fp_dbg ("Best identify score %d for template %d", data.best_score, data.best_index);
+
+  if (score)
+    *score = MAX (data.best_score, 0);
+
+  if (data.best_score < bz3_threshold)
+    return NULL;
+
+  return g_ptr_array_index (templates, data.best_index);
+}
+
+static gint
+bz3_score_compare (gconstpointer a, gconstpointer b)
+{
+  const FpiBz3Score *sa = a;
+  const FpiBz3Score *sb = b;
+
+  return sb->score - sa->score;
+}
+
+/**
+ * fpi_print_bz3_identify_scores:
+ * @templates: (element-type FpPrint): The #FpPrint gallery to search
+ * @print: A newly scanned #FpPrint to test
+ * @max_results: The maximum number of results, or 0 for all templates
+ * @error: Return location for error
+ *
+ * Like fpi_print_bz3_identify(), but computes the full score of every
+ * template in @templates instead of stopping at the first one that
+ * matches. This allows ranking the candidates with a single matching
+ * pass, which is still spread over the thread pool.
+ *
+ * Returns: (transfer full) (element-type FpiBz3Score) (nullable): The
+ *   scores of the @max_results best templates, best first and in gallery
+ *   order for equal scores, or %NULL on error
+ */
+GArray *
+fpi_print_bz3_identify_scores (GPtrArray *templates,
+                               FpPrint   *print,
+                               guint      max_results,
+                               GError   **error)
+{
+  g_autoptr(FpiBz3Probe) probe = NULL;
+
+  g_return_val_if_fail (templates != NULL, NULL);
+  g_return_val_if_fail (FP_IS_PRINT (print), NULL);
+
+  if (templates->len == 0)
+    return g_array_new (FALSE, FALSE, sizeof (FpiBz3Score));
+
+  probe = fpi_print_bz3_probe_new (print, error);
+  if (!probe)
+    return NULL;
+
+  return fpi_print_bz3_probe_identify_scores (probe, templates, max_results, error);
+}
+
+/**
+ * fpi_print_bz3_probe_identify_scores:
+ * @probe: A #FpiBz3Probe
+ * @templates: (element-type FpPrint): The #FpPrint gallery to search
+ * @max_results: The maximum number of results, or 0 for all templates
+ * @error: Return location for error
+ *
+ * Like fpi_print_bz3_identify_scores(), but with a prepared @probe, for
+ * callers that match the same print against several galleries.
+ *
+ * Returns: (transfer full) (element-type FpiBz3Score) (nullable): The
+ *   scores of the @max_results best templates, or %NULL on error
+ */
+GArray *
+fpi_print_bz3_probe_identify_scores (FpiBz3Probe *probe,
+                                     GPtrArray   *templates,
+                                     guint        max_results,
+                                     GError     **error)
+{
+  g_autofree gint *scores = NULL;
+  Bz3IdentifyData data = { 0, };
+  GArray *results;
+  guint i;
+
+  g_return_val_if_fail (probe != NULL, NULL);
+  g_return_val_if_fail (templates != NULL, NULL);
+
+  results = g_array_sized_new (FALSE, FALSE, sizeof (FpiBz3Score), templates->len);
+  if (templates->len == 0)
+    return results;
+
+  scores = g_new0 (gint, templates->len);
+
+  data.templates = templates;
+  data.tmpls = g_new0 (const Bz3Template *, templates->len);
+  data.probe = probe;
+  /* Never accept early, so that all scores are complete */
+  data.bz3_threshold = G_MAXINT;
+  data.best_score = -1;
+  data.best_index = templates->len;
+  data.scores = scores;
+
+  g_mutex_init (&data.mutex);
+  g_cond_init (&data.cond);
+
+  fpi_print_bz3_identify_run (&data, 0, templates->len);
+
+  g_mutex_clear (&data.mutex);
+  g_cond_clear (&data.cond);
+  g_free (data.tmpls);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      g_array_unref (results);
+      return NULL;
+    }
+
+  for (i = 0; i < templates->len; i++)
+    {
+      FpiBz3Score result = { g_ptr_array_index (templates, i), scores[i] };
+
+      g_array_append_val (results, result);
+    }
+
+  /* The sort is stable, keeping the gallery order for equal scores */
+  g_array_sort (results, bz3_score_compare);
+  if (max_results > 0 && results->len > max_results)
+    g_array_set_size (results, max_results);
+
+  fp_dbg ("Best identify score %d of %u templates",
+          g_array_index (results, FpiBz3Score, 0).score, templates->len);
+
+  return results;
 }
 
 /**
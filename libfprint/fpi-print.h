@@ -30,6 +30,30 @@ typedef enum {
   FPI_MATCH_SUCCESS,
 } FpiMatchResult;
 
+/**
+ * FpiMatcher:
+ * @FPI_MATCHER_DEFAULT: The matcher selected with the FP_MATCHER
+ *   environment variable ("bozorth3", "cylinder-rank" or "cylinder"),
+ *   %FPI_MATCHER_BOZORTH3 if it is unset
+ * @FPI_MATCHER_BOZORTH3: Only use bozorth3, ranking large galleries by
+ *   the edge histograms of their Webs
+ * @FPI_MATCHER_CYLINDER_RANK: Rank the gallery by comparing cylinder
+ *   codes and search it with bozorth3 in that order. This finds the same
+ *   templates as %FPI_MATCHER_BOZORTH3, usually sooner.
+ * @FPI_MATCHER_CYLINDER: Only match the best candidates of the cylinder
+ *   code ranking with bozorth3. This is the fastest for large galleries,
+ *   but misses templates that are ranked too low.
+ *
+ * The engine used to search a gallery. Bozorth3 always makes the final
+ * decision, so the scores and the threshold are the same for all of them.
+ */
+typedef enum {
+  FPI_MATCHER_DEFAULT = 0,
+  FPI_MATCHER_BOZORTH3,
+  FPI_MATCHER_CYLINDER_RANK,
+  FPI_MATCHER_CYLINDER,
+} FpiMatcher;
+
 void     fpi_print_add_print (FpPrint *print,
                               FpPrint *add);
 
@@ -41,12 +65,72 @@ void     fpi_print_set_device_stored (FpPrint *print,
 gboolean fpi_print_add_from_image (FpPrint *print,
                                    FpImage *image,
                                    GError **error);
+gboolean fpi_print_add_from_image_full (FpPrint *print,
+                                        FpImage *image,
+                                        gint     max_minutiae,
+                                        GError **error);
+
+gboolean fpi_print_consolidate (FpPrint *print,
+                                gint     bz3_threshold);
+
+void     fpi_print_bz3_prepare (FpPrint *print);
+
+/**
+ * FpiBz3Probe:
+ *
+ * A newly scanned print prepared for matching against several templates.
+ */
+typedef struct _FpiBz3Probe FpiBz3Probe;
+
+FpiBz3Probe *  fpi_print_bz3_probe_new (FpPrint *print,
+                                        GError **error);
+FpiMatchResult fpi_print_bz3_probe_match (FpiBz3Probe *probe,
+                                          FpPrint     *template,
+                                          gint         bz3_threshold,
+                                          GError     **error);
+void           fpi_print_bz3_probe_free (FpiBz3Probe *probe);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiBz3Probe, fpi_print_bz3_probe_free)
 
 FpiMatchResult fpi_print_bz3_match (FpPrint * template,
                                     FpPrint * print,
                                     gint bz3_threshold,
                                     GError **error);
 
+FpPrint * fpi_print_bz3_identify (GPtrArray *templates,
+                                  FpPrint   *print,
+                                  gint       bz3_threshold,
+                                  gint      *score,
+                                  GError   **error);
+FpPrint * fpi_print_identify (GPtrArray *templates,
+                              FpPrint   *print,
+                              FpiMatcher matcher,
+                              gint       bz3_threshold,
+                              gint      *score,
+                              GError   **error);
+
+/**
+ * FpiBz3Score:
+ * @template: (transfer none): The template print from the gallery
+ * @score: The BZ3 score of the template
+ *
+ * A template together with its score, see fpi_print_bz3_identify_scores().
+ */
+typedef struct
+{
+  FpPrint *template;
+  gint     score;
+} FpiBz3Score;
+
+GArray * fpi_print_bz3_identify_scores (GPtrArray *templates,
+                                        FpPrint   *print,
+                                        guint      max_results,
+                                        GError   **error);
+GArray * fpi_print_bz3_probe_identify_scores (FpiBz3Probe *probe,
+                                              GPtrArray   *templates,
+                                              guint        max_results,
+                                              GError     **error);
+
 /* Helpers to encode metadata into user ID strings. */
 gchar *  fpi_print_generate_user_id (FpPrint *print);
 gboolean fpi_print_fill_from_user_id (FpPrint    *print,
@@ -0,0 +1,766 @@
+/*
+ * Runtime selected SIMD kernels
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "simd"
+
+#include "fpi-simd.h"
+#include "fpi-log.h"
+
+#if FPI_SIMD
+
+#if defined(__SSE2__)
+#define HAVE_SSE2_KERNELS
+#include <emmintrin.h>
+#endif
+
+/* AVX2 is not part of any baseline, so these kernels are built for it
+ * one by one and only used if the CPU turns out to support it. */
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNELS
+#define AVX2_FUNC __attribute__ ((target ("avx2")))
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#define HAVE_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+#endif /* FPI_SIMD */
+
+/**
+ * SECTION: fpi-simd
+ * @title: SIMD kernels
+ * @short_description: Pixel kernels for the instruction set of the CPU
+ *
+ * The pixel kernels that image processing spends most time in are
+ * available optimized for SSE2, AVX2 and NEON. fpi_simd_get_kernels()
+ * returns the table of the fastest kernels the CPU supports, the CPU
+ * is only checked once. Building with the simd option disabled forces
+ * the scalar code, e.g. to rule it out when debugging.
+ *
+ * New kernels need a scalar version that defines the result, the
+ * optimized versions have to return the very same result.
+ */
+
+/* Scalar kernels, also used for the tail of the optimized ones */
+
+static guint64
+sum_u8_scalar (const guint8 *buf,
+               gsize         size)
+{
+  guint64 res = 0;
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    res += buf[i];
+
+  return res;
+}
+
+static guint64
+sum_abs_diff_u8_scalar (const guint8 *buf1,
+                        const guint8 *buf2,
+                        gsize         size)
+{
+  guint64 res = 0;
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    res += buf1[i] > buf2[i] ? buf1[i] - buf2[i] : buf2[i] - buf1[i];
+
+  return res;
+}
+
+static guint64
+sum_sq_diff_u8_scalar (const guint8 *buf1,
+                       const guint8 *buf2,
+                       guint8        value,
+                       gsize         size)
+{
+  guint64 res = 0;
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    {
+      int dev = (int) buf1[i] - (buf2 ? (int) buf2[i] : (int) value);
+      res += dev * dev;
+    }
+
+  return res;
+}
+
+static void
+saturate_above_u8_scalar (guint8 *buf,
+                          gsize   size,
+                          guint8  level)
+{
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    if (buf[i] > level)
+      buf[i] = 0xff;
+}
+
+static void
+blend_u8_scalar (guint8       *dst,
+                 const guint8 *a,
+                 const guint8 *b,
+                 guint         weight,
+                 gsize         size)
+{
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    dst[i] = (a[i] * (256 - weight) + b[i] * weight + 128) >> 8;
+}
+
+static void
+normalize_row_u8_scalar (guint8       *dst,
+                         const guint8 *src,
+                         gsize         size,
+                         gboolean      mirror,
+                         guint8        xor)
+{
+  gsize i;
+
+  if (mirror)
+    for (i = 0; i < size; i++)
+      dst[i] = src[size - i - 1] ^ xor;
+  else
+    for (i = 0; i < size; i++)
+      dst[i] = src[i] ^ xor;
+}
+
+static const FpiSimdKernels kernels_scalar = {
+  .name = "scalar",
+  .features = FPI_SIMD_NONE,
+  .sum_u8 = sum_u8_scalar,
+  .sum_abs_diff_u8 = sum_abs_diff_u8_scalar,
+  .sum_sq_diff_u8 = sum_sq_diff_u8_scalar,
+  .saturate_above_u8 = saturate_above_u8_scalar,
+  .blend_u8 = blend_u8_scalar,
+  .normalize_row_u8 = normalize_row_u8_scalar,
+};
+
+#ifdef HAVE_SSE2_KERNELS
+static inline guint64
+hsum_epi64 (__m128i v)
+{
+  guint64 lanes[2];
+
+  _mm_storeu_si128 ((__m128i *) lanes, v);
+
+  return lanes[0] + lanes[1];
+}
+
+static guint64
+sum_u8_sse2 (const guint8 *buf,
+             gsize         size)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i acc = zero;
+  gsize i = 0;
+
+  for (; i + 16 <= size; i += 16)
+    acc = _mm_add_epi64 (acc, _mm_sad_epu8 (_mm_loadu_si128 ((const __m128i *) (buf + i)), zero));
+
+  return hsum_epi64 (acc) + sum_u8_scalar (buf + i, size - i);
+}
+
+static guint64
+sum_abs_diff_u8_sse2 (const guint8 *buf1,
+                      const guint8 *buf2,
+                      gsize         size)
+{
+  __m128i acc = _mm_setzero_si128 ();
+  gsize i = 0;
+
+  for (; i + 16 <= size; i += 16)
+    acc = _mm_add_epi64 (acc,
+                         _mm_sad_epu8 (_mm_loadu_si128 ((const __m128i *) (buf1 + i)),
+                                       _mm_loadu_si128 ((const __m128i *) (buf2 + i))));
+
+  return hsum_epi64 (acc) + sum_abs_diff_u8_scalar (buf1 + i, buf2 + i, size - i);
+}
+
+static guint64
+sum_sq_diff_u8_sse2 (const guint8 *buf1,
+                     const guint8 *buf2,
+                     guint8        value,
+                     gsize         size)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i vvalue = _mm_set1_epi8 (value);
+  __m128i acc = zero;
+  gsize i = 0;
+
+  for (; i + 16 <= size; i += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (buf1 + i));
+      __m128i b = buf2 ? _mm_loadu_si128 ((const __m128i *) (buf2 + i)) : vvalue;
+      __m128i lo = _mm_sub_epi16 (_mm_unpacklo_epi8 (a, zero), _mm_unpacklo_epi8 (b, zero));
+      __m128i hi = _mm_sub_epi16 (_mm_unpackhi_epi8 (a, zero), _mm_unpackhi_epi8 (b, zero));
+      __m128i sq = _mm_add_epi32 (_mm_madd_epi16 (lo, lo), _mm_madd_epi16 (hi, hi));
+
+      /* Widen every time, so that the sum cannot overflow */
+      acc = _mm_add_epi64 (acc, _mm_unpacklo_epi32 (sq, zero));
+      acc = _mm_add_epi64 (acc, _mm_unpackhi_epi32 (sq, zero));
+    }
+
+  return hsum_epi64 (acc) +
+         sum_sq_diff_u8_scalar (buf1 + i, buf2 ? buf2 + i : NULL, value, size - i);
+}
+
+static void
+saturate_above_u8_sse2 (guint8 *buf,
+                        gsize   size,
+                        guint8  level)
+{
+  const __m128i above = _mm_set1_epi8 (level + 1);
+  gsize i = 0;
+
+  /* x > level is the same as max (x, level + 1) == x, which does not
+   * hold for level 0xff as level + 1 wraps around. */
+  if (level == 0xff)
+    return;
+
+  for (; i + 16 <= size; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (buf + i));
+      __m128i mask = _mm_cmpeq_epi8 (_mm_max_epu8 (v, above), v);
+
+      _mm_storeu_si128 ((__m128i *) (buf + i), _mm_or_si128 (v, mask));
+    }
+
+  saturate_above_u8_scalar (buf + i, size - i, level);
+}
+
+static void
+blend_u8_sse2 (guint8       *dst,
+               const guint8 *a,
+               const guint8 *b,
+               guint         weight,
+               gsize         size)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i wa = _mm_set1_epi16 (256 - weight);
+  const __m128i wb = _mm_set1_epi16 (weight);
+  const __m128i round = _mm_set1_epi16 (128);
+  gsize i = 0;
+
+  for (; i + 16 <= size; i += 16)
+    {
+      __m128i va = _mm_loadu_si128 ((const __m128i *) (a + i));
+      __m128i vb = _mm_loadu_si128 ((const __m128i *) (b + i));
+      __m128i lo, hi;
+
+      lo = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpacklo_epi8 (va, zero), wa),
+                          _mm_mullo_epi16 (_mm_unpacklo_epi8 (vb, zero), wb));
+      hi = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpackhi_epi8 (va, zero), wa),
+                          _mm_mullo_epi16 (_mm_unpackhi_epi8 (vb, zero), wb));
+      lo = _mm_srli_epi16 (_mm_add_epi16 (lo, round), 8);
+      hi = _mm_srli_epi16 (_mm_add_epi16 (hi, round), 8);
+
+      _mm_storeu_si128 ((__m128i *) (dst + i), _mm_packus_epi16 (lo, hi));
+    }
+
+  blend_u8_scalar (dst + i, a + i, b + i, weight, size - i);
+}
+
+static inline __m128i
+reverse_bytes_sse2 (__m128i v)
+{
+  v = _mm_shuffle_epi32 (v, _MM_SHUFFLE (0, 1, 2, 3));
+  v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+  v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+
+  return _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+}
+
+static void
+normalize_row_u8_sse2 (guint8       *dst,
+                       const guint8 *src,
+                       gsize         size,
+                       gboolean      mirror,
+                       guint8        xor)
+{
+  const __m128i mask = _mm_set1_epi8 ((char) xor);
+  gsize i = 0;
+
+  if (mirror)
+    {
+      for (; i + 16 <= size; i += 16)
+        {
+          __m128i v = _mm_loadu_si128 ((const __m128i *) (src + size - i - 16));
+
+          _mm_storeu_si128 ((__m128i *) (dst + i),
+                            _mm_xor_si128 (reverse_bytes_sse2 (v), mask));
+        }
+
+      /* The remaining pixels are the first ones of @src */
+      normalize_row_u8_scalar (dst + i, src, size - i, TRUE, xor);
+    }
+  else
+    {
+      for (; i + 16 <= size; i += 16)
+        {
+          __m128i v = _mm_loadu_si128 ((const __m128i *) (src + i));
+
+          _mm_storeu_si128 ((__m128i *) (dst + i), _mm_xor_si128 (v, mask));
+        }
+
+      normalize_row_u8_scalar (dst + i, src + i, size - i, FALSE, xor);
+    }
+}
+
+static const FpiSimdKernels kernels_sse2 = {
+  .name = "sse2",
+  .features = FPI_SIMD_SSE2,
+  .sum_u8 = sum_u8_sse2,
+  .sum_abs_diff_u8 = sum_abs_diff_u8_sse2,
+  .sum_sq_diff_u8 = sum_sq_diff_u8_sse2,
+  .saturate_above_u8 = saturate_above_u8_sse2,
+  .blend_u8 = blend_u8_sse2,
+  .normalize_row_u8 = normalize_row_u8_sse2,
+};
+#endif /* HAVE_SSE2_KERNELS */
+
+#ifdef HAVE_AVX2_KERNELS
+AVX2_FUNC static inline guint64
+hsum_epi64_avx2 (__m256i v)
+{
+  guint64 lanes[4];
+
+  _mm256_storeu_si256 ((__m256i *) lanes, v);
+
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+AVX2_FUNC static guint64
+sum_u8_avx2 (const guint8 *buf,
+             gsize         size)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i acc = zero;
+  gsize i = 0;
+
+  for (; i + 32 <= size; i += 32)
+    acc = _mm256_add_epi64 (acc, _mm256_sad_epu8 (_mm256_loadu_si256 ((const __m256i *) (buf + i)), zero));
+
+  return hsum_epi64_avx2 (acc) + sum_u8_scalar (buf + i, size - i);
+}
+
+AVX2_FUNC static guint64
+sum_abs_diff_u8_avx2 (const guint8 *buf1,
+                      const guint8 *buf2,
+                      gsize         size)
+{
+  __m256i acc = _mm256_setzero_si256 ();
+  gsize i = 0;
+
+  for (; i + 32 <= size; i += 32)
+    acc = _mm256_add_epi64 (acc,
+                            _mm256_sad_epu8 (_mm256_loadu_si256 ((const __m256i *) (buf1 + i)),
+                                             _mm256_loadu_si256 ((const __m256i *) (buf2 + i))));
+
+  return hsum_epi64_avx2 (acc) + sum_abs_diff_u8_scalar (buf1 + i, buf2 + i, size - i);
+}
+
+/* The unpacking works within each 128 bit lane, which doesn't matter
+ * for sums and is undone by the packing in the blend kernel. */
+AVX2_FUNC static guint64
+sum_sq_diff_u8_avx2 (const guint8 *buf1,
+                     const guint8 *buf2,
+                     guint8        value,
+                     gsize         size)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i vvalue = _mm256_set1_epi8 (value);
+  __m256i acc = zero;
+  gsize i = 0;
+
+  for (; i + 32 <= size; i += 32)
+    {
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) (buf1 + i));
+      __m256i b = buf2 ? _mm256_loadu_si256 ((const __m256i *) (buf2 + i)) : vvalue;
+      __m256i lo = _mm256_sub_epi16 (_mm256_unpacklo_epi8 (a, zero), _mm256_unpacklo_epi8 (b, zero));
+      __m256i hi = _mm256_sub_epi16 (_mm256_unpackhi_epi8 (a, zero), _mm256_unpackhi_epi8 (b, zero));
+      __m256i sq = _mm256_add_epi32 (_mm256_madd_epi16 (lo, lo), _mm256_madd_epi16 (hi, hi));
+
+      acc = _mm256_add_epi64 (acc, _mm256_unpacklo_epi32 (sq, zero));
+      acc = _mm256_add_epi64 (acc, _mm256_unpackhi_epi32 (sq, zero));
+    }
+
+  return hsum_epi64_avx2 (acc) +
+         sum_sq_diff_u8_scalar (buf1 + i, buf2 ? buf2 + i : NULL, value, size - i);
+}
+
+AVX2_FUNC static void
+saturate_above_u8_avx2 (guint8 *buf,
+                        gsize   size,
+                        guint8  level)
+{
+  const __m256i above = _mm256_set1_epi8 (level + 1);
+  gsize i = 0;
+
+  if (level == 0xff)
+    return;
+
+  for (; i + 32 <= size; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (buf + i));
+      __m256i mask = _mm256_cmpeq_epi8 (_mm256_max_epu8 (v, above), v);
+
+      _mm256_storeu_si256 ((__m256i *) (buf + i), _mm256_or_si256 (v, mask));
+    }
+
+  saturate_above_u8_scalar (buf + i, size - i, level);
+}
+
+AVX2_FUNC static void
+blend_u8_avx2 (guint8       *dst,
+               const guint8 *a,
+               const guint8 *b,
+               guint         weight,
+               gsize         size)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i wa = _mm256_set1_epi16 (256 - weight);
+  const __m256i wb = _mm256_set1_epi16 (weight);
+  const __m256i round = _mm256_set1_epi16 (128);
+  gsize i = 0;
+
+  for (; i + 32 <= size; i += 32)
+    {
+      __m256i va = _mm256_loadu_si256 ((const __m256i *) (a + i));
+      __m256i vb = _mm256_loadu_si256 ((const __m256i *) (b + i));
+      __m256i lo, hi;
+
+      lo = _mm256_add_epi16 (_mm256_mullo_epi16 (_mm256_unpacklo_epi8 (va, zero), wa),
+                             _mm256_mullo_epi16 (_mm256_unpacklo_epi8 (vb, zero), wb));
+      hi = _mm256_add_epi16 (_mm256_mullo_epi16 (_mm256_unpackhi_epi8 (va, zero), wa),
+                             _mm256_mullo_epi16 (_mm256_unpackhi_epi8 (vb, zero), wb));
+      lo = _mm256_srli_epi16 (_mm256_add_epi16 (lo, round), 8);
+      hi = _mm256_srli_epi16 (_mm256_add_epi16 (hi, round), 8);
+
+      _mm256_storeu_si256 ((__m256i *) (dst + i), _mm256_packus_epi16 (lo, hi));
+    }
+
+  blend_u8_scalar (dst + i, a + i, b + i, weight, size - i);
+}
+
+AVX2_FUNC static void
+normalize_row_u8_avx2 (guint8       *dst,
+                       const guint8 *src,
+                       gsize         size,
+                       gboolean      mirror,
+                       guint8        xor)
+{
+  const __m256i mask = _mm256_set1_epi8 ((char) xor);
+  const __m256i reverse = _mm256_setr_epi8 (15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  gsize i = 0;
+
+  if (mirror)
+    {
+      for (; i + 32 <= size; i += 32)
+        {
+          __m256i v = _mm256_loadu_si256 ((const __m256i *) (src + size - i - 32));
+
+          /* Reverse within the lanes, then swap the lanes */
+          v = _mm256_shuffle_epi8 (v, reverse);
+          v = _mm256_permute2x128_si256 (v, v, 0x01);
+          _mm256_storeu_si256 ((__m256i *) (dst + i), _mm256_xor_si256 (v, mask));
+        }
+
+      normalize_row_u8_scalar (dst + i, src, size - i, TRUE, xor);
+    }
+  else
+    {
+      for (; i + 32 <= size; i += 32)
+        {
+          __m256i v = _mm256_loadu_si256 ((const __m256i *) (src + i));
+
+          _mm256_storeu_si256 ((__m256i *) (dst + i), _mm256_xor_si256 (v, mask));
+        }
+
+      normalize_row_u8_scalar (dst + i, src + i, size - i, FALSE, xor);
+    }
+}
+
+static const FpiSimdKernels kernels_avx2 = {
+  .name = "avx2",
+  .features = FPI_SIMD_SSE2 | FPI_SIMD_AVX2,
+  .sum_u8 = sum_u8_avx2,
+  .sum_abs_diff_u8 = sum_abs_diff_u8_avx2,
+  .sum_sq_diff_u8 = sum_sq_diff_u8_avx2,
+  .saturate_above_u8 = saturate_above_u8_avx2,
+  .blend_u8 = blend_u8_avx2,
+  .normalize_row_u8 = normalize_row_u8_avx2,
+};
+#endif /* HAVE_AVX2_KERNELS */
+
+#ifdef HAVE_NEON_KERNELS
+static guint64
+sum_u8_neon (const guint8 *buf,
+             gsize         size)
+{
+  uint64x2_t acc = vdupq_n_u64 (0);
+  gsize i = 0;
+
+  for (; i + 16 <= size; i += 16)
+    acc = vpadalq_u32 (acc, vpaddlq_u16 (vpaddlq_u8 (vld1q_u8 (buf + i))));
+
+  return vgetq_lane_u64 (acc, 0) + vgetq_lane_u64 (acc, 1) +
+         sum_u8_scalar (buf + i, size - i);
+}
+
+static guint64
+sum_abs_diff_u8_neon (const guint8 *buf1,
+                      const guint8 *buf2,
+                      gsize         size)
+{
+  uint64x2_t acc = vdupq_n_u64 (0);
+  gsize i = 0;
+
+  for (; i + 16 <= size; i += 16)
+    acc = vpadalq_u32 (acc, vpaddlq_u16 (vpaddlq_u8 (vabdq_u8 (vld1q_u8 (buf1 + i),
+                                                                vld1q_u8 (buf2 + i)))));
+
+  return vgetq_lane_u64 (acc, 0) + vgetq_lane_u64 (acc, 1) +
+         sum_abs_diff_u8_scalar (buf1 + i, buf2 + i, size - i);
+}
+
+static guint64
+sum_sq_diff_u8_neon (const guint8 *buf1,
+                     const guint8 *buf2,
+                     guint8        value,
+                     gsize         size)
+{
+  const uint8x16_t vvalue = vdupq_n_u8 (value);
+  uint64x2_t acc = vdupq_n_u64 (0);
+  gsize i = 0;
+
+  for (; i + 16 <= size; i += 16)
+    {
+      uint8x16_t a = vld1q_u8 (buf1 + i);
+      uint8x16_t d = vabdq_u8 (a, buf2 ? vld1q_u8 (buf2 + i) : vvalue);
+      uint32x4_t sq;
+
+      sq = vpaddlq_u16 (vmull_u8 (vget_low_u8 (d), vget_low_u8 (d)));
+      sq = vpadalq_u16 (sq, vmull_u8 (vget_high_u8 (d), vget_high_u8 (d)));
+      acc = vpadalq_u32 (acc, sq);
+    }
+
+  return vgetq_lane_u64 (acc, 0) + vgetq_lane_u64 (acc, 1) +
+         sum_sq_diff_u8_scalar (buf1 + i, buf2 ? buf2 + i : NULL, value, size - i);
+}
+
+static void
+saturate_above_u8_neon (guint8 *buf,
+                        gsize   size,
+                        guint8  level)
+{
+  const uint8x16_t vlevel = vdupq_n_u8 (level);
+  gsize i = 0;
+
+  for (; i + 16 <= size; i += 16)
+    {
+      uint8x16_t v = vld1q_u8 (buf + i);
+
+      vst1q_u8 (buf + i, vorrq_u8 (v, vcgtq_u8 (v, vlevel)));
+    }
+
+  saturate_above_u8_scalar (buf + i, size - i, level);
+}
+
+static void
+blend_u8_neon (guint8       *dst,
+               const guint8 *a,
+               const guint8 *b,
+               guint         weight,
+               gsize         size)
+{
+  gsize i = 0;
+
+  for (; i + 8 <= size; i += 8)
+    {
+      uint16x8_t v;
+
+      v = vmulq_n_u16 (vmovl_u8 (vld1_u8 (a + i)), 256 - weight);
+      v = vmlaq_n_u16 (v, vmovl_u8 (vld1_u8 (b + i)), weight);
+
+      /* Rounding narrowing shift, the same as (v + 128) >> 8 */
+      vst1_u8 (dst + i, vrshrn_n_u16 (v, 8));
+    }
+
+  blend_u8_scalar (dst + i, a + i, b + i, weight, size - i);
+}
+
+static void
+normalize_row_u8_neon (guint8       *dst,
+                       const guint8 *src,
+                       gsize         size,
+                       gboolean      mirror,
+                       guint8        xor)
+{
+  const uint8x16_t mask = vdupq_n_u8 (xor);
+  gsize i = 0;
+
+  if (mirror)
+    {
+      for (; i + 16 <= size; i += 16)
+        {
+          uint8x16_t v = vrev64q_u8 (vld1q_u8 (src + size - i - 16));
+
+          v = vcombine_u8 (vget_high_u8 (v), vget_low_u8 (v));
+          vst1q_u8 (dst + i, veorq_u8 (v, mask));
+        }
+
+      normalize_row_u8_scalar (dst + i, src, size - i, TRUE, xor);
+    }
+  else
+    {
+      for (; i + 16 <= size; i += 16)
+        vst1q_u8 (dst + i, veorq_u8 (vld1q_u8 (src + i), mask));
+
+      normalize_row_u8_scalar (dst + i, src + i, size - i, FALSE, xor);
+    }
+}
+
+static const FpiSimdKernels kernels_neon = {
+  .name = "neon",
+  .features = FPI_SIMD_NEON,
+  .sum_u8 = sum_u8_neon,
+  .sum_abs_diff_u8 = sum_abs_diff_u8_neon,
+  .sum_sq_diff_u8 = sum_sq_diff_u8_neon,
+  .saturate_above_u8 = saturate_above_u8_neon,
+  .blend_u8 = blend_u8_neon,
+  .normalize_row_u8 = normalize_row_u8_neon,
+};
+#endif /* HAVE_NEON_KERNELS */
+
+/* Fastest first, the scalar kernels always work */
+static const FpiSimdKernels *all_kernels[] = {
+#ifdef HAVE_AVX2_KERNELS
+  &kernels_avx2,
+#endif
+#ifdef HAVE_SSE2_KERNELS
+  &kernels_sse2,
+#endif
+#ifdef HAVE_NEON_KERNELS
+  &kernels_neon,
+#endif
+  &kernels_scalar,
+};
+
+/* Set once detection ran, so that no features is distinguishable */
+#define FEATURES_DETECTED (1 << 16)
+
+static FpiSimdFeatures
+detect_features (void)
+{
+  FpiSimdFeatures features = FPI_SIMD_NONE;
+
+  /* SSE2 and NEON are part of the baseline we build for */
+#ifdef HAVE_SSE2_KERNELS
+  features |= FPI_SIMD_SSE2;
+#endif
+#ifdef HAVE_NEON_KERNELS
+  features |= FPI_SIMD_NEON;
+#endif
+
+#ifdef HAVE_AVX2_KERNELS
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    features |= FPI_SIMD_AVX2;
+#endif
+
+  return features;
+}
+
+/**
+ * fpi_simd_get_features:
+ *
+ * Gets the instruction set extensions of the CPU that kernels are
+ * available for. The CPU is only checked on the first call.
+ *
+ * Returns: The #FpiSimdFeatures, %FPI_SIMD_NONE if libfprint was built
+ *   with SIMD disabled
+ */
+FpiSimdFeatures
+fpi_simd_get_features (void)
+{
+  static gsize features = 0;
+
+  if (g_once_init_enter (&features))
+    g_once_init_leave (&features, detect_features () | FEATURES_DETECTED);
+
+  return features & ~FEATURES_DETECTED;
+}
+
+/**
+ * fpi_simd_list_kernels:
+ *
+ * Lists all kernel tables that can be used on this CPU, fastest first.
+ * The last one is always the scalar table. This is mostly useful to
+ * check that all tables return the same results.
+ *
+ * Returns: (transfer container) (element-type FpiSimdKernels): The tables
+ */
+GPtrArray *
+fpi_simd_list_kernels (void)
+{
+  FpiSimdFeatures features = fpi_simd_get_features ();
+  GPtrArray *res = g_ptr_array_new ();
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (all_kernels); i++)
+    if ((all_kernels[i]->features & ~features) == 0)
+      g_ptr_array_add (res, (gpointer) all_kernels[i]);
+
+  return res;
+}
+
+/**
+ * fpi_simd_get_kernels:
+ *
+ * Gets the fastest kernels that can be used on this CPU. They are
+ * only selected on the first call, so this is cheap enough to be
+ * called for every row.
+ *
+ * Returns: (transfer none): The #FpiSimdKernels to use
+ */
+const FpiSimdKernels *
+fpi_simd_get_kernels (void)
+{
+  static gsize kernels = 0;
+
+  if (g_once_init_enter (&kernels))
+    {
+      g_autoptr(GPtrArray) usable = fpi_simd_list_kernels ();
+      const FpiSimdKernels *best = g_ptr_array_index (usable, 0);
+
+      fp_dbg ("Using %s kernels", best->name);
+      g_once_init_leave (&kernels, (gsize) best);
+    }
+
+  return (const FpiSimdKernels *) kernels;
+}
@@ -0,0 +1,92 @@
+/*
+ * Runtime selected SIMD kernels
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <config.h>
+#include <glib.h>
+
+/**
+ * FpiSimdFeatures:
+ * @FPI_SIMD_NONE: No SIMD instructions, the portable scalar code
+ * @FPI_SIMD_SSE2: x86 SSE2
+ * @FPI_SIMD_AVX2: x86 AVX2
+ * @FPI_SIMD_NEON: ARM NEON
+ *
+ * The instruction set extensions that kernels may be optimized for.
+ */
+typedef enum {
+  FPI_SIMD_NONE = 0,
+  FPI_SIMD_SSE2 = 1 << 0,
+  FPI_SIMD_AVX2 = 1 << 1,
+  FPI_SIMD_NEON = 1 << 2,
+} FpiSimdFeatures;
+
+/**
+ * FpiSimdKernels:
+ * @name: The name of the instruction set the kernels are written for
+ * @features: The #FpiSimdFeatures the kernels need
+ * @sum_u8: Returns the sum of @size pixels
+ * @sum_abs_diff_u8: Returns the sum of the absolute differences of the
+ *   pixels of two buffers
+ * @sum_sq_diff_u8: Returns the sum of the squared differences of the pixels
+ *   of @buf1 to those of @buf2, or to @value if @buf2 is %NULL
+ * @saturate_above_u8: Sets all pixels brighter than @level to white
+ * @blend_u8: Sets @dst to `(a * (256 - weight) + b * weight + 128) / 256`
+ *   for each pixel, @weight must be at most 256
+ * @normalize_row_u8: Copies @size pixels from @src to @dst, XORed with
+ *   @xor and in reverse order if @mirror is set
+ *
+ * A table of the kernels for one instruction set. All tables return
+ * exactly the same results, only the speed differs.
+ */
+typedef struct _FpiSimdKernels
+{
+  const gchar    *name;
+  FpiSimdFeatures features;
+
+  guint64         (*sum_u8)            (const guint8 *buf,
+                                        gsize         size);
+  guint64         (*sum_abs_diff_u8)   (const guint8 *buf1,
+                                        const guint8 *buf2,
+                                        gsize         size);
+  guint64         (*sum_sq_diff_u8)    (const guint8 *buf1,
+                                        const guint8 *buf2,
+                                        guint8        value,
+                                        gsize         size);
+  void            (*saturate_above_u8) (guint8 *buf,
+                                        gsize   size,
+                                        guint8  level);
+  void            (*blend_u8)          (guint8       *dst,
+                                        const guint8 *a,
+                                        const guint8 *b,
+                                        guint         weight,
+                                        gsize         size);
+  void            (*normalize_row_u8)  (guint8       *dst,
+                                        const guint8 *src,
+                                        gsize         size,
+                                        gboolean      mirror,
+                                        guint8        xor);
+} FpiSimdKernels;
+
+FpiSimdFeatures        fpi_simd_get_features (void);
+
+const FpiSimdKernels * fpi_simd_get_kernels (void);
+
+GPtrArray *            fpi_simd_list_kernels (void);
@@ -23,6 +23,8 @@
 
 #include "drivers_api.h"
 #include "fpi-ssm.h"
+#include "fp-device-private.h"
+#include "fpi-trace.h"
 
 
 /**
@@ -76,6 +78,19 @@
  * Your completion callback should examine the return value of
  * fpi_ssm_get_error() in ordater to determine whether the #FpiSsm completed or
  * failed. An error code of zero indicates successful completion.
+ *
+ * Setting the FP_DEBUG_SSM_PROFILE environment variable makes every
+ * machine record how long it stays in each of its states. Time spent in a
+ * child machine started with fpi_ssm_start_subsm() is accounted to the
+ * child and not to the state of the parent that started it. The timings
+ * are logged whenever a device action completes, as a table or, with
+ * FP_DEBUG_SSM_PROFILE=folded, as folded stacks that can be fed directly
+ * into flamegraph.pl. See also fpi_ssm_profile_to_string().
+ *
+ * Machines are allocated from a small free list, and a machine created with
+ * fpi_ssm_new_with_data() carries its data in the same allocation. Short
+ * helper machines that are created for every single command (and freed
+ * right after) therefore do not need to go through the allocator.
  */
 
 struct _FpiSsm
@@ -88,14 +103,254 @@ struct _FpiSsm
   int                     nr_states;
   int                     cur_state;
   gboolean                completed;
-  GSource                *timeout;
+  FpiDeviceTimer          timeout;
   GCancellable           *cancellable;
   gulong                  cancellable_id;
   GError                 *error;
   FpiSsmCompletedCallback callback;
   FpiSsmHandlerCallback   handler;
+  int                     delayed_state;
+  gsize                   alloc_size;
+
+  /* Profiling, all zero unless FP_DEBUG_SSM_PROFILE is set */
+  gint64                  start_time;
+  gint64                  state_start_time;
+  gint64                  child_time;
 };
 
+/* Inline data is placed after the machine, suitably aligned for any type */
+#define FPI_SSM_DATA_OFFSET \
+  ((sizeof (FpiSsm) + 2 * sizeof (gpointer) - 1) & ~(2 * sizeof (gpointer) - 1))
+
+/* Machines with at most this much inline data are recycled */
+#define FPI_SSM_POOLED_DATA_SIZE 64
+#define FPI_SSM_POOLED_SIZE (FPI_SSM_DATA_OFFSET + FPI_SSM_POOLED_DATA_SIZE)
+#define FPI_SSM_POOL_MAX 16
+
+/* Released machines, linked through their first pointer */
+G_LOCK_DEFINE_STATIC (ssm_pool);
+static gpointer ssm_pool = NULL;
+static guint ssm_pool_len = 0;
+
+static FpiSsm *
+fpi_ssm_alloc (gsize data_size)
+{
+  gpointer block = NULL;
+  gsize size;
+
+  if (data_size <= FPI_SSM_POOLED_DATA_SIZE)
+    {
+      size = FPI_SSM_POOLED_SIZE;
+
+      G_LOCK (ssm_pool);
+      if (ssm_pool)
+        {
+          block = ssm_pool;
+          ssm_pool = *(gpointer *) block;
+          ssm_pool_len--;
+        }
+      G_UNLOCK (ssm_pool);
+
+      if (block)
+        memset (block, 0, size);
+      else
+        block = g_malloc0 (size);
+    }
+  else
+    {
+      size = FPI_SSM_DATA_OFFSET + data_size;
+      block = g_malloc0 (size);
+    }
+
+  ((FpiSsm *) block)->alloc_size = size;
+
+  return block;
+}
+
+static void
+fpi_ssm_release (FpiSsm *machine)
+{
+  if (machine->alloc_size == FPI_SSM_POOLED_SIZE)
+    {
+      G_LOCK (ssm_pool);
+      if (ssm_pool_len < FPI_SSM_POOL_MAX)
+        {
+          *(gpointer *) machine = ssm_pool;
+          ssm_pool = machine;
+          ssm_pool_len++;
+          machine = NULL;
+        }
+      G_UNLOCK (ssm_pool);
+    }
+
+  g_free (machine);
+}
+
+typedef struct
+{
+  guint  count;
+  gint64 total_us;
+  gint64 self_us;
+  gint64 max_us;
+} FpiSsmProfileEntry;
+
+static gboolean
+fpi_ssm_profile_enabled (void)
+{
+  static gsize enabled = 0;
+
+  if (g_once_init_enter (&enabled))
+    g_once_init_leave (&enabled, g_getenv ("FP_DEBUG_SSM_PROFILE") ? 2 : 1);
+
+  return enabled == 2;
+}
+
+static void
+fpi_ssm_profile_append_stack (GString *stack, FpiSsm *machine)
+{
+  if (machine->parentsm)
+    {
+      fpi_ssm_profile_append_stack (stack, machine->parentsm);
+      g_string_append_c (stack, ';');
+    }
+
+  g_string_append_printf (stack, "%s:%d",
+                          machine->name ? machine->name : "ssm",
+                          machine->cur_state);
+}
+
+/* Accounts the time spent in the current state to the device, minus
+ * the time spent in child machines, which account for it themselves. */
+static void
+fpi_ssm_profile_state_done (FpiSsm *machine)
+{
+  FpiSsmProfileEntry *entry;
+  GHashTable *profile;
+  GString *stack;
+  gint64 total, self;
+
+  if (machine->state_start_time == 0)
+    return;
+
+  total = g_get_monotonic_time () - machine->state_start_time;
+  self = MAX (total - machine->child_time, 0);
+  machine->state_start_time = 0;
+
+  stack = g_string_new (fp_device_get_driver (machine->dev));
+  g_string_append_c (stack, ';');
+  fpi_ssm_profile_append_stack (stack, machine);
+
+  profile = fpi_device_get_ssm_profile (machine->dev);
+  entry = g_hash_table_lookup (profile, stack->str);
+  if (entry)
+    {
+      g_string_free (stack, TRUE);
+    }
+  else
+    {
+      entry = g_new0 (FpiSsmProfileEntry, 1);
+      g_hash_table_insert (profile, g_string_free (stack, FALSE), entry);
+    }
+
+  entry->count++;
+  entry->total_us += total;
+  entry->self_us += self;
+  entry->max_us = MAX (entry->max_us, total);
+}
+
+static gint
+fpi_ssm_profile_compare_total (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  GHashTable *profile = user_data;
+  const FpiSsmProfileEntry *ea = g_hash_table_lookup (profile, *(const gchar **) a);
+  const FpiSsmProfileEntry *eb = g_hash_table_lookup (profile, *(const gchar **) b);
+
+  if (ea->total_us != eb->total_us)
+    return ea->total_us < eb->total_us ? 1 : -1;
+
+  return g_strcmp0 (*(const gchar **) a, *(const gchar **) b);
+}
+
+/**
+ * fpi_ssm_profile_to_string:
+ * @dev: a #FpDevice
+ * @folded: whether to use the folded stack format
+ *
+ * Formats the state timings recorded for @dev since the last device
+ * action completed. These are only collected when the FP_DEBUG_SSM_PROFILE
+ * environment variable is set.
+ *
+ * If @folded is %TRUE, there is one line per state stack with the time
+ * spent in the innermost state in microseconds, as understood by
+ * flamegraph.pl. Otherwise a table sorted by the total time is returned.
+ *
+ * Returns: (transfer full): A newly allocated string
+ */
+gchar *
+fpi_ssm_profile_to_string (FpDevice *dev, gboolean folded)
+{
+  g_autoptr(GPtrArray) stacks = NULL;
+  GHashTable *profile;
+  GHashTableIter iter;
+  gpointer key;
+  GString *str;
+
+  g_return_val_if_fail (FP_IS_DEVICE (dev), NULL);
+
+  profile = fpi_device_get_ssm_profile (dev);
+  stacks = g_ptr_array_new ();
+
+  g_hash_table_iter_init (&iter, profile);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (stacks, key);
+  g_ptr_array_sort_with_data (stacks, fpi_ssm_profile_compare_total, profile);
+
+  str = g_string_new (NULL);
+  if (!folded)
+    g_string_append_printf (str, "%8s %12s %12s %12s  %s\n",
+                            "count", "total us", "self us", "max us", "state");
+
+  for (guint i = 0; i < stacks->len; i++)
+    {
+      const gchar *stack = g_ptr_array_index (stacks, i);
+      const FpiSsmProfileEntry *entry = g_hash_table_lookup (profile, stack);
+
+      if (folded)
+        g_string_append_printf (str, "%s %" G_GINT64_FORMAT "\n",
+                                stack, entry->self_us);
+      else
+        g_string_append_printf (str, "%8u %12" G_GINT64_FORMAT " %12" G_GINT64_FORMAT
+                                " %12" G_GINT64_FORMAT "  %s\n",
+                                entry->count, entry->total_us, entry->self_us,
+                                entry->max_us, stack);
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+/* Logs and clears the state timings, done whenever a device action
+ * completes. */
+void
+fpi_ssm_profile_dump (FpDevice *dev)
+{
+  g_autofree gchar *str = NULL;
+  GHashTable *profile;
+
+  if (!fpi_ssm_profile_enabled ())
+    return;
+
+  profile = fpi_device_get_ssm_profile (dev);
+  if (g_hash_table_size (profile) == 0)
+    return;
+
+  str = fpi_ssm_profile_to_string (dev,
+                                   g_strcmp0 (g_getenv ("FP_DEBUG_SSM_PROFILE"), "folded") == 0);
+  g_message ("[%s] SSM profile of action %d:\n%s",
+             fp_device_get_driver (dev), fpi_device_get_current_action (dev), str);
+
+  g_hash_table_remove_all (profile);
+}
+
 /**
  * fpi_ssm_new:
  * @dev: a #fp_dev fingerprint device
@@ -127,18 +382,59 @@ fpi_ssm_new_full (FpDevice             *dev,
                   FpiSsmHandlerCallback handler,
                   int                   nr_states,
                   const char           *machine_name)
+{
+  return fpi_ssm_new_with_data_full (dev, handler, nr_states, machine_name, 0);
+}
+
+/**
+ * fpi_ssm_new_with_data:
+ * @dev: a #fp_dev fingerprint device
+ * @handler: the callback function
+ * @nr_states: the number of states
+ * @data_size: the size of the machine data
+ *
+ * Like fpi_ssm_new(), but the machine carries @data_size bytes of zeroed
+ * data that are returned by fpi_ssm_get_data() and released together with
+ * the machine.
+ *
+ * Returns: a new #FpiSsm state machine
+ */
+
+/**
+ * fpi_ssm_new_with_data_full:
+ * @dev: a #fp_dev fingerprint device
+ * @handler: the callback function
+ * @nr_states: the number of states
+ * @machine_name: the name of the state machine (for debug purposes)
+ * @data_size: the size of the machine data
+ *
+ * Like fpi_ssm_new_full(), but the machine carries @data_size bytes of
+ * zeroed data that are returned by fpi_ssm_get_data() and released
+ * together with the machine. Small machines are recycled, so this is
+ * cheaper than setting separately allocated data with fpi_ssm_set_data().
+ *
+ * Returns: a new #FpiSsm state machine
+ */
+FpiSsm *
+fpi_ssm_new_with_data_full (FpDevice             *dev,
+                            FpiSsmHandlerCallback handler,
+                            int                   nr_states,
+                            const char           *machine_name,
+                            gsize                 data_size)
 {
   FpiSsm *machine;
 
   BUG_ON (nr_states < 1);
   BUG_ON (handler == NULL);
 
-  machine = g_new0 (FpiSsm, 1);
+  machine = fpi_ssm_alloc (data_size);
   machine->handler = handler;
   machine->nr_states = nr_states;
   machine->dev = dev;
   machine->name = g_strdup (machine_name);
   machine->completed = TRUE;
+  if (data_size > 0)
+    machine->ssm_data = (guint8 *) machine + FPI_SSM_DATA_OFFSET;
   return machine;
 }
 
@@ -186,7 +482,7 @@ fpi_ssm_clear_delayed_action (FpiSsm *machine)
     }
 
   g_clear_object (&machine->cancellable);
-  g_clear_pointer (&machine->timeout, g_source_destroy);
+  fpi_device_timer_stop (machine->dev, &machine->timeout);
 }
 
 typedef struct _CancelledActionIdleData
@@ -212,19 +508,23 @@ on_delayed_action_cancelled (GCancellable *cancellable,
                              FpiSsm       *machine)
 {
   CancelledActionIdleData *data;
+  GSource *source;
 
   fp_dbg ("[%s] %s cancelled delayed state change",
           fp_device_get_driver (machine->dev), machine->name);
 
-  g_clear_pointer (&machine->timeout, g_source_destroy);
+  fpi_device_timer_stop (machine->dev, &machine->timeout);
 
   data = g_new0 (CancelledActionIdleData, 1);
   data->cancellable = g_steal_pointer (&machine->cancellable);
   data->cancellable_id = machine->cancellable_id;
   machine->cancellable_id = 0;
 
-  g_idle_add_full (G_PRIORITY_HIGH_IDLE, on_delayed_action_cancelled_idle,
-                   data, NULL);
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_HIGH_IDLE);
+  g_source_set_callback (source, on_delayed_action_cancelled_idle, data, NULL);
+  g_source_attach (source, fpi_device_get_main_context (machine->dev));
+  g_source_unref (source);
 }
 
 static void
@@ -232,11 +532,10 @@ fpi_ssm_set_delayed_action_timeout (FpiSsm        *machine,
                                     int            delay,
                                     FpTimeoutFunc  callback,
                                     GCancellable  *cancellable,
-                                    gpointer       user_data,
-                                    GDestroyNotify destroy_func)
+                                    gpointer       user_data)
 {
   BUG_ON (machine->completed);
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_device_timer_is_active (&machine->timeout));
 
   fpi_ssm_clear_delayed_action (machine);
 
@@ -250,8 +549,8 @@ fpi_ssm_set_delayed_action_timeout (FpiSsm        *machine,
                                machine, NULL);
     }
 
-  machine->timeout = fpi_device_add_timeout (machine->dev, delay, callback,
-                                             user_data, destroy_func);
+  fpi_device_timer_start (machine->dev, &machine->timeout, delay, callback,
+                          user_data);
 }
 
 /**
@@ -267,14 +566,14 @@ fpi_ssm_free (FpiSsm *machine)
   if (!machine)
     return;
 
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_device_timer_is_active (&machine->timeout));
 
   if (machine->ssm_data_destroy)
     g_clear_pointer (&machine->ssm_data, machine->ssm_data_destroy);
   g_clear_pointer (&machine->error, g_error_free);
   g_clear_pointer (&machine->name, g_free);
   fpi_ssm_clear_delayed_action (machine);
-  g_free (machine);
+  fpi_ssm_release (machine);
 }
 
 /* Invoke the state handler */
@@ -283,6 +582,14 @@ __ssm_call_handler (FpiSsm *machine)
 {
   fp_dbg ("[%s] %s entering state %d", fp_device_get_driver (machine->dev),
           machine->name, machine->cur_state);
+  FPI_TRACE2 (ssm_state, machine->name, machine->cur_state);
+
+  if (fpi_ssm_profile_enabled ())
+    {
+      machine->state_start_time = g_get_monotonic_time ();
+      machine->child_time = 0;
+    }
+
   machine->handler (machine, machine->dev);
 }
 
@@ -307,6 +614,10 @@ fpi_ssm_start (FpiSsm *ssm, FpiSsmCompletedCallback callback)
   ssm->cur_state = 0;
   ssm->completed = FALSE;
   ssm->error = NULL;
+
+  if (fpi_ssm_profile_enabled ())
+    ssm->start_time = g_get_monotonic_time ();
+
   __ssm_call_handler (ssm);
 }
 
@@ -336,7 +647,7 @@ __subsm_complete (FpiSsm *ssm, FpDevice *_dev, GError *error)
 void
 fpi_ssm_start_subsm (FpiSsm *parent, FpiSsm *child)
 {
-  BUG_ON (parent->timeout);
+  BUG_ON (fpi_device_timer_is_active (&parent->timeout));
   child->parentsm = parent;
 
   fpi_ssm_clear_delayed_action (parent);
@@ -356,12 +667,16 @@ void
 fpi_ssm_mark_completed (FpiSsm *machine)
 {
   BUG_ON (machine->completed);
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_device_timer_is_active (&machine->timeout));
 
   fpi_ssm_clear_delayed_action (machine);
 
   machine->completed = TRUE;
 
+  fpi_ssm_profile_state_done (machine);
+  if (machine->start_time && machine->parentsm)
+    machine->parentsm->child_time += g_get_monotonic_time () - machine->start_time;
+
   if (machine->error)
     fp_dbg ("[%s] %s completed with error: %s", fp_device_get_driver (machine->dev),
             machine->name, machine->error->message);
@@ -383,7 +698,6 @@ on_device_timeout_complete (FpDevice *dev,
 {
   FpiSsm *machine = user_data;
 
-  machine->timeout = NULL;
   fpi_ssm_mark_completed (machine);
 }
 
@@ -403,18 +717,11 @@ fpi_ssm_mark_completed_delayed (FpiSsm       *machine,
                                 int           delay,
                                 GCancellable *cancellable)
 {
-  g_autofree char *source_name = NULL;
-
   g_return_if_fail (machine != NULL);
 
   fpi_ssm_set_delayed_action_timeout (machine, delay,
                                       on_device_timeout_complete, cancellable,
-                                      machine, NULL);
-
-  source_name = g_strdup_printf ("[%s] ssm %s complete %d",
-                                 fp_device_get_device_id (machine->dev),
-                                 machine->name, machine->cur_state + 1);
-  g_source_set_name (machine->timeout, source_name);
+                                      machine);
 }
 
 /**
@@ -457,9 +764,10 @@ fpi_ssm_next_state (FpiSsm *machine)
   g_return_if_fail (machine != NULL);
 
   BUG_ON (machine->completed);
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_device_timer_is_active (&machine->timeout));
 
   fpi_ssm_clear_delayed_action (machine);
+  fpi_ssm_profile_state_done (machine);
 
   machine->cur_state++;
   if (machine->cur_state == machine->nr_states)
@@ -473,7 +781,7 @@ fpi_ssm_cancel_delayed_state_change (FpiSsm *machine)
 {
   g_return_if_fail (machine);
   BUG_ON (machine->completed);
-  BUG_ON (machine->timeout == NULL);
+  BUG_ON (!fpi_device_timer_is_active (&machine->timeout));
 
   fp_dbg ("[%s] %s cancelled delayed state change",
           fp_device_get_driver (machine->dev), machine->name);
@@ -487,7 +795,6 @@ on_device_timeout_next_state (FpDevice *dev,
 {
   FpiSsm *machine = user_data;
 
-  machine->timeout = NULL;
   fpi_ssm_next_state (machine);
 }
 
@@ -508,18 +815,11 @@ fpi_ssm_next_state_delayed (FpiSsm       *machine,
                             int           delay,
                             GCancellable *cancellable)
 {
-  g_autofree char *source_name = NULL;
-
   g_return_if_fail (machine != NULL);
 
   fpi_ssm_set_delayed_action_timeout (machine, delay,
                                       on_device_timeout_next_state, cancellable,
-                                      machine, NULL);
-
-  source_name = g_strdup_printf ("[%s] ssm %s jump to next state %d",
-                                 fp_device_get_device_id (machine->dev),
-                                 machine->name, machine->cur_state + 1);
-  g_source_set_name (machine->timeout, source_name);
+                                      machine);
 }
 
 /**
@@ -536,28 +836,22 @@ fpi_ssm_jump_to_state (FpiSsm *machine, int state)
 {
   BUG_ON (machine->completed);
   BUG_ON (state < 0 || state >= machine->nr_states);
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_device_timer_is_active (&machine->timeout));
 
   fpi_ssm_clear_delayed_action (machine);
+  fpi_ssm_profile_state_done (machine);
 
   machine->cur_state = state;
   __ssm_call_handler (machine);
 }
 
-typedef struct
-{
-  FpiSsm *machine;
-  int     next_state;
-} FpiSsmJumpToStateDelayedData;
-
 static void
 on_device_timeout_jump_to_state (FpDevice *dev,
                                  gpointer  user_data)
 {
-  FpiSsmJumpToStateDelayedData *data = user_data;
+  FpiSsm *machine = user_data;
 
-  data->machine->timeout = NULL;
-  fpi_ssm_jump_to_state (data->machine, data->next_state);
+  fpi_ssm_jump_to_state (machine, machine->delayed_state);
 }
 
 /**
@@ -578,24 +872,13 @@ fpi_ssm_jump_to_state_delayed (FpiSsm       *machine,
                                int           delay,
                                GCancellable *cancellable)
 {
-  FpiSsmJumpToStateDelayedData *data;
-  g_autofree char *source_name = NULL;
-
   g_return_if_fail (machine != NULL);
   BUG_ON (state < 0 || state >= machine->nr_states);
 
-  data = g_new0 (FpiSsmJumpToStateDelayedData, 1);
-  data->machine = machine;
-  data->next_state = state;
-
   fpi_ssm_set_delayed_action_timeout (machine, delay,
                                       on_device_timeout_jump_to_state,
-                                      cancellable, data, g_free);
-
-  source_name = g_strdup_printf ("[%s] ssm %s jump to state %d",
-                                 fp_device_get_device_id (machine->dev),
-                                 machine->name, state);
-  g_source_set_name (machine->timeout, source_name);
+                                      cancellable, machine);
+  machine->delayed_state = state;
 }
 
 /**
@@ -65,6 +65,13 @@ FpiSsm *fpi_ssm_new_full (FpDevice             *dev,
                           FpiSsmHandlerCallback handler,
                           int                   nr_states,
                           const char           *machine_name);
+#define fpi_ssm_new_with_data(dev, handler, nr_states, data_size) \
+  fpi_ssm_new_with_data_full (dev, handler, nr_states, #nr_states, data_size)
+FpiSsm *fpi_ssm_new_with_data_full (FpDevice             *dev,
+                                    FpiSsmHandlerCallback handler,
+                                    int                   nr_states,
+                                    const char           *machine_name,
+                                    gsize                 data_size);
 void fpi_ssm_free (FpiSsm *machine);
 void fpi_ssm_start (FpiSsm                 *ssm,
                     FpiSsmCompletedCallback callback);
@@ -97,6 +104,9 @@ GError * fpi_ssm_get_error (FpiSsm *machine);
 GError * fpi_ssm_dup_error (FpiSsm *machine);
 int fpi_ssm_get_cur_state (FpiSsm *machine);
 
+gchar *fpi_ssm_profile_to_string (FpDevice *dev,
+                                  gboolean  folded);
+
 /* Callbacks to be used by the driver instead of implementing their own
  * logic.
  */
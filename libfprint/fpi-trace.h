@@ -0,0 +1,66 @@
+/*
+ * Static tracepoints
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <config.h>
+#include <glib.h>
+
+/*
+ * USDT probes in the "libfprint" provider, enabled with the "tracing"
+ * build option. Each one compiles to a single nop that perf, bpftrace or
+ * systemtap can attach to, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/lib64/libfprint-2.so.2:libfprint:match_end { @[arg1] = count(); }'
+ *
+ * The arguments are only recorded in the ELF notes, so keep them to values
+ * that are already at hand; they are evaluated even if nothing is attached.
+ * Without the option the probes compile to nothing.
+ *
+ * The probes are:
+ *   usb_submit (transfer, endpoint, length)
+ *   usb_complete (transfer, endpoint, actual_length, error code or 0)
+ *   ssm_state (machine name, state)
+ *   image_captured (device, width, height)
+ *   minutiae_start (width, height)
+ *   minutiae_end (mindtct result, number of minutiae)
+ *   match_start (template, number of prints in the template)
+ *   match_end (template, best score)
+ */
+
+#if FPI_TRACING
+#include <sys/sdt.h>
+
+#define FPI_TRACE(name) \
+  DTRACE_PROBE (libfprint, name)
+#define FPI_TRACE1(name, a1) \
+  DTRACE_PROBE1 (libfprint, name, a1)
+#define FPI_TRACE2(name, a1, a2) \
+  DTRACE_PROBE2 (libfprint, name, a1, a2)
+#define FPI_TRACE3(name, a1, a2, a3) \
+  DTRACE_PROBE3 (libfprint, name, a1, a2, a3)
+#define FPI_TRACE4(name, a1, a2, a3, a4) \
+  DTRACE_PROBE4 (libfprint, name, a1, a2, a3, a4)
+#else
+#define FPI_TRACE(name) G_STMT_START { } G_STMT_END
+#define FPI_TRACE1(name, a1) G_STMT_START { } G_STMT_END
+#define FPI_TRACE2(name, a1, a2) G_STMT_START { } G_STMT_END
+#define FPI_TRACE3(name, a1, a2, a3) G_STMT_START { } G_STMT_END
+#define FPI_TRACE4(name, a1, a2, a3, a4) G_STMT_START { } G_STMT_END
+#endif
@@ -18,6 +18,9 @@
  */
 
 #include "fpi-usb-transfer.h"
+#include "fp-device-private.h"
+#include "fpi-image.h"
+#include "fpi-trace.h"
 
 /**
  * SECTION:fpi-usb-transfer
@@ -30,11 +33,157 @@
  *
  * Drivers should use this API only rather than accessing the GUsbDevice
  * directly in most cases.
+ *
+ * Every completed transfer is accounted in per-endpoint counters and a
+ * latency histogram, see fpi_usb_transfer_get_stats(). Setting the
+ * FP_DEBUG_TRANSFER_STATS environment variable logs them when the device
+ * is closed.
+ *
+ * The same accounting keeps a smoothed round-trip time per endpoint, from
+ * which fpi_usb_transfer_get_adaptive_timeout() derives a timeout. Drivers
+ * can use it instead of a fixed worst case timeout, so that a stalled
+ * transfer is noticed after a few round-trip times.
+ *
+ * Every transfer submitted with fpi_usb_transfer_submit() is also tracked
+ * until its callback ran. fpi_usb_transfer_abort_all() cancels all of them
+ * at once and calls back as soon as the last one reported back, so that
+ * drivers can deactivate or close without waiting for transfer timeouts.
  */
 
 
 G_DEFINE_BOXED_TYPE (FpiUsbTransfer, fpi_usb_transfer, fpi_usb_transfer_ref, fpi_usb_transfer_unref)
 
+/* Number of released IN buffers a device keeps around for reuse */
+#define USB_BUFFER_POOL_SIZE 8
+
+/*
+ * Buffers for IN transfers are taken from a per-device pool and given back
+ * to it when the transfer is freed. A streaming driver that allocates a
+ * transfer per chunk will then keep reusing the same few buffers. The pool
+ * is reference counted by every buffer that is in use, so that buffers can
+ * outlive the device.
+ */
+struct _FpiUsbBufferPool
+{
+  guint    ref_count;
+  gboolean closed;
+  GQueue   free;
+};
+
+typedef struct
+{
+  FpiUsbBufferPool *pool;
+  gsize             size;
+} FpiUsbBuffer;
+
+/* Keep the data behind the header suitably aligned */
+#define USB_BUFFER_HEADER_SIZE (((sizeof (FpiUsbBuffer) + 15) / 16) * 16)
+#define USB_BUFFER_DATA(b) ((guint8 *) (b) + USB_BUFFER_HEADER_SIZE)
+#define USB_BUFFER_FROM_DATA(d) ((FpiUsbBuffer *) ((guint8 *) (d) - USB_BUFFER_HEADER_SIZE))
+
+FpiUsbBufferPool *
+fpi_usb_buffer_pool_new (void)
+{
+  FpiUsbBufferPool *pool = g_new0 (FpiUsbBufferPool, 1);
+
+  pool->ref_count = 1;
+  g_queue_init (&pool->free);
+
+  return pool;
+}
+
+static void
+fpi_usb_buffer_pool_unref (FpiUsbBufferPool *pool)
+{
+  if (--pool->ref_count > 0)
+    return;
+
+  g_assert (g_queue_is_empty (&pool->free));
+  g_free (pool);
+}
+
+/* Called when the device goes away, buffers in use are freed on release */
+void
+fpi_usb_buffer_pool_close (FpiUsbBufferPool *pool)
+{
+  FpiUsbBuffer *buf;
+
+  pool->closed = TRUE;
+  while ((buf = g_queue_pop_head (&pool->free)))
+    {
+      g_free (buf);
+      fpi_usb_buffer_pool_unref (pool);
+    }
+
+  fpi_usb_buffer_pool_unref (pool);
+}
+
+static void
+usb_buffer_release (gpointer data)
+{
+  FpiUsbBuffer *buf = USB_BUFFER_FROM_DATA (data);
+  FpiUsbBufferPool *pool = buf->pool;
+
+  if (pool->closed)
+    {
+      g_free (buf);
+      fpi_usb_buffer_pool_unref (pool);
+      return;
+    }
+
+  /* Most recently used buffers are reused first, drop the oldest one */
+  g_queue_push_head (&pool->free, buf);
+  if (g_queue_get_length (&pool->free) > USB_BUFFER_POOL_SIZE)
+    {
+      g_free (g_queue_pop_tail (&pool->free));
+      fpi_usb_buffer_pool_unref (pool);
+    }
+}
+
+/* Returns an uninitialized buffer of @length bytes from the device pool,
+ * free it again using usb_buffer_release(). */
+static guint8 *
+usb_buffer_acquire (FpDevice *device, gsize length)
+{
+  FpiUsbBufferPool *pool = fpi_device_get_usb_buffer_pool (device);
+  FpiUsbBuffer *buf;
+  GList *l;
+
+  for (l = pool->free.head; l; l = l->next)
+    {
+      buf = l->data;
+      if (buf->size == length)
+        {
+          g_queue_delete_link (&pool->free, l);
+          return USB_BUFFER_DATA (buf);
+        }
+    }
+
+  g_assert (length <= G_MAXSIZE - USB_BUFFER_HEADER_SIZE);
+  buf = g_malloc (USB_BUFFER_HEADER_SIZE + length);
+  buf->pool = pool;
+  buf->size = length;
+  pool->ref_count++;
+
+  return USB_BUFFER_DATA (buf);
+}
+
+/* Pooled buffers are not zeroed up-front as the device overwrites them.
+ * To behave the same as a freshly allocated buffer, clear whatever the
+ * device did not write after the transfer completed. */
+static void
+usb_buffer_clear_tail (FpiUsbTransfer *transfer)
+{
+  gssize written;
+
+  if (transfer->free_buffer != usb_buffer_release)
+    return;
+
+  written = CLAMP (transfer->actual_length, 0, transfer->length);
+  if (written < transfer->length)
+    memset (transfer->buffer + written, 0, transfer->length - written);
+}
+
 static void
 log_transfer (FpiUsbTransfer *transfer, gboolean submit, GError *error)
 {
@@ -88,6 +237,275 @@ log_transfer (FpiUsbTransfer *transfer, gboolean submit, GError *error)
     }
 }
 
+/**
+ * fpi_usb_transfer_stats_endpoint_index:
+ * @endpoint: The endpoint address
+ *
+ * Maps an endpoint address to its index in #FpiUsbTransferStats.endpoints,
+ * IN endpoints are stored in the upper half.
+ *
+ * Returns: The index
+ */
+guint
+fpi_usb_transfer_stats_endpoint_index (guint8 endpoint)
+{
+  return (endpoint & 0x0f) | ((endpoint & FPI_USB_ENDPOINT_IN) ? 0x10 : 0);
+}
+
+static guint
+latency_bucket (guint64 latency_us)
+{
+  guint bucket = 0;
+
+  while (latency_us > 1 && bucket < FPI_USB_TRANSFER_STATS_BUCKETS - 1)
+    {
+      latency_us >>= 1;
+      bucket++;
+    }
+
+  return bucket;
+}
+
+/* Number of round-trip samples needed before the timeout adapts */
+#define RTT_MIN_SAMPLES 4
+/* Limit of the exponential backoff after timeouts */
+#define RTT_MAX_BACKOFF 6
+
+/* The round-trip estimator of TCP (RFC 6298), with gains of 1/8 for the
+ * average and 1/4 for the deviation */
+static void
+update_rtt (FpiUsbEndpointStats *ep, guint64 latency)
+{
+  guint64 delta;
+
+  ep->timeout_backoff = 0;
+
+  if (ep->rtt_samples++ == 0)
+    {
+      ep->rtt_avg_us = latency;
+      ep->rtt_var_us = latency / 2;
+      return;
+    }
+
+  delta = latency > ep->rtt_avg_us ? latency - ep->rtt_avg_us : ep->rtt_avg_us - latency;
+  ep->rtt_var_us = (3 * ep->rtt_var_us + delta) / 4;
+  ep->rtt_avg_us = (7 * ep->rtt_avg_us + latency) / 8;
+}
+
+static void
+record_transfer (FpiUsbTransfer *transfer, const GError *error)
+{
+  FpiUsbTransferStats *stats;
+  FpiUsbEndpointStats *ep;
+  FpiUsbTransferRecord *record;
+  FpiUsbTransferStatus status;
+  guint8 endpoint;
+  gint64 now;
+  guint64 latency;
+
+  /* All completions are dispatched on the main context of the device, so
+   * there is only ever one writer and no locking is needed. */
+  stats = fpi_device_get_usb_transfer_stats (transfer->device);
+
+  now = g_get_monotonic_time ();
+  latency = MAX (now - transfer->submit_time, 0);
+
+  if (transfer->type == FP_TRANSFER_CONTROL)
+    endpoint = transfer->direction == G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST ? FPI_USB_ENDPOINT_IN : FPI_USB_ENDPOINT_OUT;
+  else
+    endpoint = transfer->endpoint;
+
+  ep = &stats->endpoints[fpi_usb_transfer_stats_endpoint_index (endpoint)];
+
+  if (!error)
+    status = FPI_USB_TRANSFER_STATUS_OK;
+  else if (g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_TIMED_OUT))
+    status = FPI_USB_TRANSFER_STATUS_TIMEOUT;
+  else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+           g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_CANCELLED))
+    status = FPI_USB_TRANSFER_STATUS_CANCELLED;
+  else
+    status = FPI_USB_TRANSFER_STATUS_ERROR;
+
+  ep->completed++;
+  switch (status)
+    {
+    case FPI_USB_TRANSFER_STATUS_OK:
+      ep->bytes += transfer->actual_length;
+      if (transfer->actual_length < transfer->length)
+        ep->short_transfers++;
+      update_rtt (ep, latency);
+      break;
+
+    case FPI_USB_TRANSFER_STATUS_TIMEOUT:
+      ep->timeouts++;
+      ep->timeout_backoff = MIN (ep->timeout_backoff + 1, RTT_MAX_BACKOFF);
+      break;
+
+    case FPI_USB_TRANSFER_STATUS_CANCELLED:
+      ep->cancelled++;
+      break;
+
+    case FPI_USB_TRANSFER_STATUS_ERROR:
+    default:
+      ep->errors++;
+    }
+
+  ep->total_latency_us += latency;
+  ep->max_latency_us = MAX (ep->max_latency_us, latency);
+  ep->latency_histogram[latency_bucket (latency)]++;
+
+  record = &stats->records[stats->n_records % FPI_USB_TRANSFER_STATS_RECORDS];
+  record->time = now;
+  record->latency_us = MIN (latency, G_MAXUINT32);
+  record->length = transfer->length;
+  record->actual_length = error ? -1 : transfer->actual_length;
+  record->type = transfer->type;
+  record->endpoint = endpoint;
+  record->status = status;
+  stats->n_records++;
+}
+
+/**
+ * fpi_usb_transfer_get_stats:
+ * @device: The #FpDevice
+ *
+ * Returns the statistics of all USB transfers of @device that completed
+ * since it was created or since the last fpi_usb_transfer_reset_stats().
+ *
+ * Returns: (transfer none): The #FpiUsbTransferStats
+ */
+const FpiUsbTransferStats *
+fpi_usb_transfer_get_stats (FpDevice *device)
+{
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+
+  return fpi_device_get_usb_transfer_stats (device);
+}
+
+/**
+ * fpi_usb_transfer_reset_stats:
+ * @device: The #FpDevice
+ *
+ * Clears the USB transfer statistics of @device.
+ */
+void
+fpi_usb_transfer_reset_stats (FpDevice *device)
+{
+  g_return_if_fail (FP_IS_DEVICE (device));
+
+  memset (fpi_device_get_usb_transfer_stats (device), 0, sizeof (FpiUsbTransferStats));
+}
+
+/**
+ * fpi_usb_transfer_stats_to_string:
+ * @device: The #FpDevice
+ *
+ * Formats the USB transfer statistics of @device for humans, listing the
+ * counters and the latency histogram of every endpoint that was used.
+ *
+ * Returns: (transfer full): A newly allocated string
+ */
+gchar *
+fpi_usb_transfer_stats_to_string (FpDevice *device)
+{
+  const FpiUsbTransferStats *stats;
+  GString *str;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+
+  stats = fpi_device_get_usb_transfer_stats (device);
+  str = g_string_new (NULL);
+
+  for (guint i = 0; i < FPI_USB_TRANSFER_STATS_ENDPOINTS; i++)
+    {
+      const FpiUsbEndpointStats *ep = &stats->endpoints[i];
+      guint8 endpoint = (i & 0x0f) | ((i & 0x10) ? FPI_USB_ENDPOINT_IN : 0);
+
+      if (ep->completed == 0)
+        continue;
+
+      g_string_append_printf (str,
+                              "endpoint 0x%02x: %" G_GUINT64_FORMAT " transfers, %" G_GUINT64_FORMAT " bytes, "
+                              "%u short, %u errors, %u timeouts, %u cancelled, "
+                              "latency avg %" G_GUINT64_FORMAT " us max %" G_GUINT64_FORMAT " us, "
+                              "rtt %" G_GUINT64_FORMAT " +- %" G_GUINT64_FORMAT " us\n",
+                              endpoint, ep->completed, ep->bytes,
+                              ep->short_transfers, ep->errors, ep->timeouts, ep->cancelled,
+                              ep->total_latency_us / ep->completed, ep->max_latency_us,
+                              ep->rtt_avg_us, ep->rtt_var_us);
+
+      for (guint b = 0; b < FPI_USB_TRANSFER_STATS_BUCKETS; b++)
+        {
+          if (ep->latency_histogram[b] == 0)
+            continue;
+
+          if (b == FPI_USB_TRANSFER_STATS_BUCKETS - 1)
+            g_string_append_printf (str, "  >= %8u us: %u\n", 1u << b, ep->latency_histogram[b]);
+          else
+            g_string_append_printf (str, "  < %9u us: %u\n", 2u << b, ep->latency_histogram[b]);
+        }
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+/**
+ * fpi_usb_transfer_get_adaptive_timeout:
+ * @device: The #FpDevice
+ * @endpoint: The endpoint the transfer is for, %FPI_USB_ENDPOINT_IN or
+ *   %FPI_USB_ENDPOINT_OUT for control transfers
+ * @floor_ms: The smallest timeout to return
+ * @ceiling_ms: The largest timeout to return, usually the worst case
+ *   timeout the driver used so far
+ *
+ * Derives a timeout for the next transfer on @endpoint from the round-trip
+ * times observed so far, as the smoothed round-trip time plus four times
+ * its mean deviation. Every timeout on the endpoint doubles the result
+ * until a transfer succeeds again. Until a few transfers have succeeded,
+ * @ceiling_ms is returned.
+ *
+ * Only use this for transfers that the device answers right away, not for
+ * ones that wait for the user such as finger interrupts.
+ *
+ * Returns: The timeout in ms, between @floor_ms and @ceiling_ms
+ */
+guint
+fpi_usb_transfer_get_adaptive_timeout (FpDevice *device,
+                                       guint8    endpoint,
+                                       guint     floor_ms,
+                                       guint     ceiling_ms)
+{
+  const FpiUsbEndpointStats *ep;
+  guint64 timeout_us;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), ceiling_ms);
+  g_return_val_if_fail (floor_ms <= ceiling_ms, ceiling_ms);
+
+  ep = &fpi_device_get_usb_transfer_stats (device)->endpoints[fpi_usb_transfer_stats_endpoint_index (endpoint)];
+  if (ep->rtt_samples < RTT_MIN_SAMPLES)
+    return ceiling_ms;
+
+  timeout_us = (ep->rtt_avg_us + 4 * ep->rtt_var_us) << ep->timeout_backoff;
+
+  return CLAMP ((timeout_us + 999) / 1000, floor_ms, ceiling_ms);
+}
+
+/* Logs the statistics if FP_DEBUG_TRANSFER_STATS is set, this is done
+ * whenever a USB device is closed. */
+void
+fpi_usb_transfer_stats_dump (FpDevice *device)
+{
+  g_autofree gchar *str = NULL;
+
+  if (!g_getenv ("FP_DEBUG_TRANSFER_STATS"))
+    return;
+
+  str = fpi_usb_transfer_stats_to_string (device);
+  g_message ("USB transfer statistics of %s:\n%s",
+             fp_device_get_name (device), str);
+}
+
 /**
  * fpi_usb_transfer_new:
  * @device: The #FpDevice the transfer is for
@@ -118,9 +536,11 @@ fpi_usb_transfer_free (FpiUsbTransfer *self)
   g_assert_cmpint (self->ref_count, ==, 0);
 
   if (self->free_buffer && self->buffer)
-    self->free_buffer (self->buffer);
+    self->free_buffer (self->buffer_owner ? self->buffer_owner : self->buffer);
   self->buffer = NULL;
 
+  g_clear_object (&self->cancellable);
+
   g_slice_free (FpiUsbTransfer, self);
 }
 
@@ -169,17 +589,28 @@ fpi_usb_transfer_unref (FpiUsbTransfer *self)
  * Prepare a bulk transfer. A buffer will be created for you, use
  * fpi_usb_transfer_fill_bulk_full() if you want to send a static buffer
  * or receive a pre-defined buffer.
+ *
+ * Buffers for IN endpoints are recycled by the device once the transfer is
+ * freed. Their content is undefined until the transfer completes, at which
+ * point any bytes not written by the device are zero.
  */
 void
 fpi_usb_transfer_fill_bulk (FpiUsbTransfer *transfer,
                             guint8          endpoint,
                             gsize           length)
 {
-  fpi_usb_transfer_fill_bulk_full (transfer,
-                                   endpoint,
-                                   g_malloc0 (length),
-                                   length,
-                                   g_free);
+  if (endpoint & FPI_USB_ENDPOINT_IN)
+    fpi_usb_transfer_fill_bulk_full (transfer,
+                                     endpoint,
+                                     usb_buffer_acquire (transfer->device, length),
+                                     length,
+                                     usb_buffer_release);
+  else
+    fpi_usb_transfer_fill_bulk_full (transfer,
+                                     endpoint,
+                                     g_malloc0 (length),
+                                     length,
+                                     g_free);
 }
 
 /**
@@ -210,6 +641,61 @@ fpi_usb_transfer_fill_bulk_full (FpiUsbTransfer *transfer,
   transfer->free_buffer = free_func;
 }
 
+/**
+ * fpi_usb_transfer_fill_bulk_static:
+ * @transfer: The #FpiUsbTransfer
+ * @endpoint: The OUT endpoint to send the transfer to
+ * @buffer: The data to send
+ * @length: The size of @buffer
+ *
+ * Prepare a bulk transfer that sends @buffer as it is, without copying it.
+ * The caller keeps ownership of @buffer, which must stay valid until the
+ * transfer completes; this is meant for static const command data.
+ */
+void
+fpi_usb_transfer_fill_bulk_static (FpiUsbTransfer *transfer,
+                                   guint8          endpoint,
+                                   const guint8   *buffer,
+                                   gsize           length)
+{
+  g_assert ((endpoint & FPI_USB_ENDPOINT_IN) == 0);
+
+  fpi_usb_transfer_fill_bulk_full (transfer, endpoint,
+                                   (guint8 *) buffer, length, NULL);
+}
+
+/**
+ * fpi_usb_transfer_fill_bulk_image:
+ * @transfer: The #FpiUsbTransfer
+ * @endpoint: The endpoint to read from
+ * @image: The #FpImage to read into
+ * @offset: Byte offset into the image data, e.g. the start of a row
+ * @length: Number of bytes to read
+ *
+ * Prepare a bulk transfer that reads straight into the data of @image,
+ * avoiding a copy from a separate transfer buffer. The transfer holds a
+ * reference on @image until it is freed.
+ */
+void
+fpi_usb_transfer_fill_bulk_image (FpiUsbTransfer *transfer,
+                                  guint8          endpoint,
+                                  FpImage        *image,
+                                  gsize           offset,
+                                  gsize           length)
+{
+  g_assert (FP_IS_IMAGE (image));
+  g_assert (endpoint & FPI_USB_ENDPOINT_IN);
+  g_assert (offset <= (gsize) image->width * image->height &&
+            length <= (gsize) image->width * image->height - offset);
+
+  fpi_usb_transfer_fill_bulk_full (transfer,
+                                   endpoint,
+                                   image->data + offset,
+                                   length,
+                                   g_object_unref);
+  transfer->buffer_owner = g_object_ref (image);
+}
+
 /**
  * fpi_usb_transfer_fill_control:
  * @transfer: The #FpiUsbTransfer
@@ -257,17 +743,27 @@ fpi_usb_transfer_fill_control (FpiUsbTransfer       *transfer,
  *
  * Prepare an interrupt transfer. The function will create a new buffer,
  * you can initialize the buffer after calling this function.
+ *
+ * As with fpi_usb_transfer_fill_bulk(), buffers for IN endpoints are
+ * recycled and only defined once the transfer completed.
  */
 void
 fpi_usb_transfer_fill_interrupt (FpiUsbTransfer *transfer,
                                  guint8          endpoint,
                                  gsize           length)
 {
-  fpi_usb_transfer_fill_interrupt_full (transfer,
-                                        endpoint,
-                                        g_malloc0 (length),
-                                        length,
-                                        g_free);
+  if (endpoint & FPI_USB_ENDPOINT_IN)
+    fpi_usb_transfer_fill_interrupt_full (transfer,
+                                          endpoint,
+                                          usb_buffer_acquire (transfer->device, length),
+                                          length,
+                                          usb_buffer_release);
+  else
+    fpi_usb_transfer_fill_interrupt_full (transfer,
+                                          endpoint,
+                                          g_malloc0 (length),
+                                          length,
+                                          g_free);
 }
 
 /**
@@ -298,11 +794,125 @@ fpi_usb_transfer_fill_interrupt_full (FpiUsbTransfer *transfer,
   transfer->free_buffer = free_func;
 }
 
+typedef struct
+{
+  FpiUsbTransferIdleCallback callback;
+  gpointer                   user_data;
+} UsbTransferIdleWaiter;
+
+struct _FpiUsbTransferTracker
+{
+  GQueue        in_flight;
+  /* Shared by the transfers that were submitted without a cancellable */
+  GCancellable *abort_cancellable;
+  gboolean      aborting;
+  GSList       *idle_waiters;
+};
+
+FpiUsbTransferTracker *
+fpi_usb_transfer_tracker_new (void)
+{
+  FpiUsbTransferTracker *tracker = g_new0 (FpiUsbTransferTracker, 1);
+
+  g_queue_init (&tracker->in_flight);
+  tracker->abort_cancellable = g_cancellable_new ();
+
+  return tracker;
+}
+
+void
+fpi_usb_transfer_tracker_free (FpiUsbTransferTracker *tracker)
+{
+  /* Every in flight transfer is owned by a GTask that keeps the device alive */
+  g_warn_if_fail (g_queue_is_empty (&tracker->in_flight));
+  g_warn_if_fail (tracker->idle_waiters == NULL);
+
+  g_slist_free_full (tracker->idle_waiters, g_free);
+  g_clear_object (&tracker->abort_cancellable);
+  g_free (tracker);
+}
+
+static void
+usb_transfer_chain_cancel (GCancellable *cancellable, GCancellable *own)
+{
+  g_cancellable_cancel (own);
+}
+
+/* Adds @transfer to the in flight transfers of its device, and returns the
+ * cancellable that it needs to be submitted with. */
+static GCancellable *
+usb_transfer_track (FpiUsbTransfer *transfer, GCancellable *cancellable)
+{
+  FpiUsbTransferTracker *tracker = fpi_device_get_usb_transfer_tracker (transfer->device);
+
+  transfer->in_flight_link.data = transfer;
+  g_queue_push_tail_link (&tracker->in_flight, &transfer->in_flight_link);
+
+  if (!cancellable)
+    return tracker->abort_cancellable;
+
+  /* A recycled transfer keeps its cancellable, nothing is pending on it */
+  if (!transfer->cancellable)
+    transfer->cancellable = g_cancellable_new ();
+  else
+    g_cancellable_reset (transfer->cancellable);
+
+  transfer->user_cancellable = g_object_ref (cancellable);
+  transfer->user_cancellable_id = g_cancellable_connect (cancellable,
+                                                         G_CALLBACK (usb_transfer_chain_cancel),
+                                                         transfer->cancellable,
+                                                         NULL);
+  if (tracker->aborting)
+    g_cancellable_cancel (transfer->cancellable);
+
+  return transfer->cancellable;
+}
+
+static void
+usb_transfer_untrack (FpiUsbTransfer *transfer)
+{
+  FpiUsbTransferTracker *tracker = fpi_device_get_usb_transfer_tracker (transfer->device);
+
+  g_queue_unlink (&tracker->in_flight, &transfer->in_flight_link);
+
+  if (transfer->user_cancellable)
+    {
+      g_cancellable_disconnect (transfer->user_cancellable,
+                                transfer->user_cancellable_id);
+      transfer->user_cancellable_id = 0;
+      g_clear_object (&transfer->user_cancellable);
+    }
+}
+
+static void
+usb_transfer_check_idle (FpDevice *device)
+{
+  FpiUsbTransferTracker *tracker = fpi_device_get_usb_transfer_tracker (device);
+  GSList *waiters, *l;
+
+  if (!tracker->aborting || !g_queue_is_empty (&tracker->in_flight))
+    return;
+
+  /* Transfers submitted from the callbacks are not cancelled anymore */
+  tracker->aborting = FALSE;
+  g_cancellable_reset (tracker->abort_cancellable);
+
+  waiters = g_slist_reverse (g_steal_pointer (&tracker->idle_waiters));
+  for (l = waiters; l; l = l->next)
+    {
+      UsbTransferIdleWaiter *waiter = l->data;
+
+      waiter->callback (device, waiter->user_data);
+    }
+  g_slist_free_full (waiters, g_free);
+}
+
 static void
 transfer_finish_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
   GError *error = NULL;
   FpiUsbTransfer *transfer = user_data;
+  FpDevice *device = transfer->device;
   FpiUsbTransferCallback callback;
 
   switch (transfer->type)
@@ -333,7 +943,11 @@ transfer_finish_cb (GObject *source_object, GAsyncResult *res, gpointer user_dat
       g_assert_not_reached ();
     }
 
+  usb_buffer_clear_tail (transfer);
+  FPI_TRACE4 (usb_complete, transfer, transfer->endpoint,
+              transfer->actual_length, error ? error->code : 0);
   log_transfer (transfer, FALSE, error);
+  record_transfer (transfer, error);
 
   /* Check for short error, and set an error if requested */
   if (error == NULL &&
@@ -346,11 +960,16 @@ transfer_finish_cb (GObject *source_object, GAsyncResult *res, gpointer user_dat
                            "Unexpected short error of %zd size (expected %zd)", transfer->actual_length, transfer->length);
     }
 
+  /* Untrack first, the callback may submit the transfer again */
+  usb_transfer_untrack (transfer);
+
   callback = transfer->callback;
   transfer->callback = NULL;
   callback (transfer, transfer->device, transfer->user_data, error);
 
   fpi_usb_transfer_unref (transfer);
+
+  usb_transfer_check_idle (device);
 }
 
 
@@ -367,6 +986,9 @@ transfer_finish_cb (GObject *source_object, GAsyncResult *res, gpointer user_dat
  * Note that #FpiUsbTransfer will be stolen when this function is called.
  * So that all associated data will be free'ed automatically, after the
  * callback ran unless fpi_usb_transfer_ref() is explicitly called.
+ *
+ * The transfer counts as in flight until @callback returned, and is
+ * cancelled by fpi_usb_transfer_abort_all() in addition to @cancellable.
  */
 void
 fpi_usb_transfer_submit (FpiUsbTransfer        *transfer,
@@ -385,6 +1007,11 @@ fpi_usb_transfer_submit (FpiUsbTransfer        *transfer,
   transfer->user_data = user_data;
 
   log_transfer (transfer, TRUE, NULL);
+  FPI_TRACE3 (usb_submit, transfer, transfer->endpoint, transfer->length);
+  transfer->submit_time = g_get_monotonic_time ();
+
+  if (transfer->type != FP_TRANSFER_NONE)
+    cancellable = usb_transfer_track (transfer, cancellable);
 
   switch (transfer->type)
     {
@@ -433,6 +1060,82 @@ fpi_usb_transfer_submit (FpiUsbTransfer        *transfer,
     }
 }
 
+/**
+ * fpi_usb_transfer_abort_all:
+ * @device: The #FpDevice
+ * @callback: Called once no transfer is in flight anymore
+ * @user_data: Data to pass to @callback
+ *
+ * Cancels every transfer of @device that was submitted with
+ * fpi_usb_transfer_submit() and did not complete yet, no matter which
+ * cancellable it was submitted with. Transfers that are submitted before
+ * the last one reported back are cancelled right away.
+ *
+ * @callback runs after the callback of the last transfer returned, or
+ * right away if none is in flight. Deactivation and close handlers can
+ * therefore complete as soon as the device is idle, rather than waiting
+ * for transfer timeouts.
+ *
+ * Transfers of a #FpiUsbTransferStream on the USB thread and synchronous
+ * transfers are not affected, use fpi_usb_transfer_stream_stop() for the
+ * former.
+ */
+void
+fpi_usb_transfer_abort_all (FpDevice                  *device,
+                            FpiUsbTransferIdleCallback callback,
+                            gpointer                   user_data)
+{
+  FpiUsbTransferTracker *tracker;
+  UsbTransferIdleWaiter *waiter;
+  GList *l;
+
+  g_return_if_fail (FP_IS_DEVICE (device));
+  g_return_if_fail (callback);
+
+  tracker = fpi_device_get_usb_transfer_tracker (device);
+
+  if (g_queue_is_empty (&tracker->in_flight))
+    {
+      callback (device, user_data);
+      return;
+    }
+
+  waiter = g_new0 (UsbTransferIdleWaiter, 1);
+  waiter->callback = callback;
+  waiter->user_data = user_data;
+  tracker->idle_waiters = g_slist_prepend (tracker->idle_waiters, waiter);
+
+  if (tracker->aborting)
+    return;
+
+  g_debug ("Aborting %u in flight USB transfers", tracker->in_flight.length);
+  tracker->aborting = TRUE;
+  g_cancellable_cancel (tracker->abort_cancellable);
+
+  for (l = tracker->in_flight.head; l; l = l->next)
+    {
+      FpiUsbTransfer *transfer = l->data;
+
+      if (transfer->user_cancellable)
+        g_cancellable_cancel (transfer->cancellable);
+    }
+}
+
+/**
+ * fpi_usb_transfer_get_n_in_flight:
+ * @device: The #FpDevice
+ *
+ * Returns: The number of transfers of @device that were submitted with
+ *   fpi_usb_transfer_submit() and whose callback did not run yet
+ */
+guint
+fpi_usb_transfer_get_n_in_flight (FpDevice *device)
+{
+  g_return_val_if_fail (FP_IS_DEVICE (device), 0);
+
+  return fpi_device_get_usb_transfer_tracker (device)->in_flight.length;
+}
+
 /**
  * fpi_usb_transfer_submit_sync:
  * @transfer: The transfer to submit, must have been filled.
@@ -453,6 +1156,7 @@ fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
                               guint           timeout_ms,
                               GError        **error)
 {
+  g_autoptr(GError) local_error = NULL;
   gboolean res;
   gsize actual_length;
 
@@ -462,6 +1166,8 @@ fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
   g_return_val_if_fail (transfer->callback == NULL, FALSE);
 
   log_transfer (transfer, TRUE, NULL);
+  FPI_TRACE3 (usb_submit, transfer, transfer->endpoint, transfer->length);
+  transfer->submit_time = g_get_monotonic_time ();
 
   switch (transfer->type)
     {
@@ -473,7 +1179,7 @@ fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
                                         &actual_length,
                                         timeout_ms,
                                         NULL,
-                                        error);
+                                        &local_error);
       break;
 
     case FP_TRANSFER_CONTROL:
@@ -489,7 +1195,7 @@ fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
                                            &actual_length,
                                            timeout_ms,
                                            NULL,
-                                           error);
+                                           &local_error);
       break;
 
     case FP_TRANSFER_INTERRUPT:
@@ -500,7 +1206,7 @@ fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
                                              &actual_length,
                                              timeout_ms,
                                              NULL,
-                                             error);
+                                             &local_error);
       break;
 
     case FP_TRANSFER_NONE:
@@ -508,12 +1214,644 @@ fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
       g_return_val_if_reached (FALSE);
     }
 
-  log_transfer (transfer, FALSE, *error);
+  log_transfer (transfer, FALSE, local_error);
 
   if (!res)
     transfer->actual_length = -1;
   else
     transfer->actual_length = actual_length;
 
+  usb_buffer_clear_tail (transfer);
+  FPI_TRACE4 (usb_complete, transfer, transfer->endpoint,
+              transfer->actual_length, local_error ? local_error->code : 0);
+  record_transfer (transfer, local_error);
+
+  if (local_error)
+    g_propagate_error (error, g_steal_pointer (&local_error));
+
   return res;
 }
+
+/**
+ * SECTION:fpi-usb-transfer-stream
+ * @title: Streaming USB transfers
+ * @short_description: Keep several transfers on an endpoint in flight
+ *
+ * A #FpiUsbTransferStream keeps a fixed number of bulk or interrupt
+ * transfers queued on an IN endpoint so that the bus never runs idle
+ * while a driver processes data. Completed transfers are handed to the
+ * driver in submission order and then submitted again.
+ *
+ * Stopping the stream cancels all transfers, the done callback runs once
+ * the last one of them has returned.
+ *
+ * If the FP_USB_EVENT_THREAD environment variable is set, the transfers of
+ * a stream are handled on a USB thread owned by libfprint instead. It
+ * copies the data of each completed transfer and submits the transfer
+ * again right away, and the copies are then handed to the driver in the
+ * main context of the device. A busy application main loop then delays the
+ * processing of the data, but no data is lost as long as the stream is
+ * running.
+ */
+
+typedef struct
+{
+  FpiUsbTransferStream *stream;
+  FpiUsbTransfer       *transfer;
+  gboolean              done;
+  GError               *error;
+} FpiUsbTransferStreamSlot;
+
+/* A completed transfer of a stream, queued by the USB thread */
+typedef struct
+{
+  gssize  actual_length;
+  gint64  submit_time;
+  GError *error;
+  guint8  data[];
+} FpiUsbTransferStreamResult;
+
+struct _FpiUsbTransferStream
+{
+  FpDevice                        *device;
+
+  FpiUsbTransferStreamSlot        *slots;
+  guint                            n_slots;
+  guint                            head;
+  guint                            n_flying;
+
+  gboolean                         running;
+  gboolean                         dispatching;
+  gboolean                         free_when_done;
+  GError                          *error;
+
+  guint                            timeout_ms;
+  GCancellable                    *cancellable;
+  GCancellable                    *user_cancellable;
+  gulong                           user_cancellable_id;
+
+  FpiUsbTransferStreamCallback     callback;
+  FpiUsbTransferStreamDoneCallback done_callback;
+  gpointer                         user_data;
+
+  /* Only used if the stream runs on the USB thread, the lock protects
+   * n_flying, the result queues and dispatch_pending. */
+  gboolean                         threaded;
+  GMutex                           lock;
+  GMainContext                    *context;
+  GQueue                           results;
+  GQueue                           free_results;
+  gboolean                         dispatch_pending;
+  FpiUsbTransfer                  *delivery;
+};
+
+static void stream_transfer_cb (FpiUsbTransfer *transfer,
+                                FpDevice       *dev,
+                                gpointer        user_data,
+                                GError         *error);
+
+/**
+ * fpi_usb_transfer_stream_new:
+ * @device: The #FpDevice the stream is for
+ * @type: Either #FP_TRANSFER_BULK or #FP_TRANSFER_INTERRUPT
+ * @endpoint: The IN endpoint to read from
+ * @length: The size of each transfer
+ * @n_transfers: The number of transfers to keep in flight
+ *
+ * Creates a stream of @n_transfers transfers of @length bytes each.
+ *
+ * Returns: (transfer full): A new #FpiUsbTransferStream
+ */
+FpiUsbTransferStream *
+fpi_usb_transfer_stream_new (FpDevice       *device,
+                             FpiTransferType type,
+                             guint8          endpoint,
+                             gsize           length,
+                             guint           n_transfers)
+{
+  FpiUsbTransferStream *stream;
+  guint i;
+
+  g_assert (device != NULL);
+  g_assert (type == FP_TRANSFER_BULK || type == FP_TRANSFER_INTERRUPT);
+  g_assert (endpoint & FPI_USB_ENDPOINT_IN);
+  g_assert (n_transfers > 0);
+
+  stream = g_new0 (FpiUsbTransferStream, 1);
+  stream->device = device;
+  stream->slots = g_new0 (FpiUsbTransferStreamSlot, n_transfers);
+  stream->n_slots = n_transfers;
+
+  for (i = 0; i < n_transfers; i++)
+    {
+      FpiUsbTransfer *transfer = fpi_usb_transfer_new (device);
+
+      if (type == FP_TRANSFER_BULK)
+        fpi_usb_transfer_fill_bulk (transfer, endpoint, length);
+      else
+        fpi_usb_transfer_fill_interrupt (transfer, endpoint, length);
+
+      stream->slots[i].stream = stream;
+      stream->slots[i].transfer = transfer;
+    }
+
+  g_mutex_init (&stream->lock);
+  g_queue_init (&stream->results);
+  g_queue_init (&stream->free_results);
+
+  return stream;
+}
+
+static void
+stream_free_result (FpiUsbTransferStreamResult *result)
+{
+  g_clear_error (&result->error);
+  g_free (result);
+}
+
+static void
+stream_destroy (FpiUsbTransferStream *stream)
+{
+  FpiUsbTransferStreamResult *result;
+  guint i;
+
+  for (i = 0; i < stream->n_slots; i++)
+    fpi_usb_transfer_unref (stream->slots[i].transfer);
+
+  while ((result = g_queue_pop_head (&stream->results)))
+    stream_free_result (result);
+  while ((result = g_queue_pop_head (&stream->free_results)))
+    stream_free_result (result);
+  g_clear_pointer (&stream->delivery, fpi_usb_transfer_unref);
+  g_clear_pointer (&stream->context, g_main_context_unref);
+  g_mutex_clear (&stream->lock);
+
+  g_free (stream->slots);
+  g_free (stream);
+}
+
+/**
+ * fpi_usb_transfer_stream_free:
+ * @stream: The #FpiUsbTransferStream
+ *
+ * Frees @stream. An active stream is stopped and freed once all of its
+ * transfers have returned, its done callback is not called in that case.
+ */
+void
+fpi_usb_transfer_stream_free (FpiUsbTransferStream *stream)
+{
+  g_return_if_fail (stream);
+
+  if (!fpi_usb_transfer_stream_is_active (stream))
+    {
+      stream_destroy (stream);
+      return;
+    }
+
+  stream->free_when_done = TRUE;
+  fpi_usb_transfer_stream_stop (stream);
+}
+
+static gpointer
+usb_event_thread_func (gpointer user_data)
+{
+  GMainContext *context = user_data;
+
+  g_main_context_push_thread_default (context);
+
+  while (TRUE)
+    g_main_context_iteration (context, TRUE);
+
+  return NULL;
+}
+
+/* The USB thread is started when it is first needed and then stays
+ * around, like the minutiae detection threads. GUsb dispatches the
+ * completion of a transfer in the thread-default context of the thread
+ * that submitted it, so all transfers of threaded streams are submitted
+ * from this thread. */
+static GMainContext *
+usb_event_thread_get_context (void)
+{
+  static gsize context = 0;
+
+  if (g_once_init_enter (&context))
+    {
+      GMainContext *ctx = g_main_context_new ();
+
+      g_thread_unref (g_thread_new ("fprint-usb", usb_event_thread_func,
+                                    g_main_context_ref (ctx)));
+      g_once_init_leave (&context, (gsize) ctx);
+    }
+
+  return (GMainContext *) context;
+}
+
+/* Unlike g_main_context_invoke(), this never runs @func right away in the
+ * calling thread, even if @context is not owned by any thread. */
+static void
+stream_invoke_in (GMainContext *context, GSourceFunc func, gpointer data)
+{
+  GSource *source = g_idle_source_new ();
+
+  g_source_set_priority (source, G_PRIORITY_DEFAULT);
+  g_source_set_callback (source, func, data, NULL);
+  g_source_set_name (source, "[libfprint] USB stream");
+  g_source_attach (source, context);
+  g_source_unref (source);
+}
+
+static void stream_thread_transfer_cb (GObject      *source_object,
+                                       GAsyncResult *res,
+                                       gpointer      user_data);
+
+/* Runs on the USB thread */
+static void
+stream_thread_submit (FpiUsbTransferStreamSlot *slot)
+{
+  FpiUsbTransferStream *stream = slot->stream;
+  FpiUsbTransfer *transfer = slot->transfer;
+
+  FPI_TRACE3 (usb_submit, transfer, transfer->endpoint, transfer->length);
+  transfer->submit_time = g_get_monotonic_time ();
+
+  if (transfer->type == FP_TRANSFER_BULK)
+    g_usb_device_bulk_transfer_async (fpi_device_get_usb_device (transfer->device),
+                                      transfer->endpoint,
+                                      transfer->buffer,
+                                      transfer->length,
+                                      stream->timeout_ms,
+                                      stream->cancellable,
+                                      stream_thread_transfer_cb,
+                                      slot);
+  else
+    g_usb_device_interrupt_transfer_async (fpi_device_get_usb_device (transfer->device),
+                                           transfer->endpoint,
+                                           transfer->buffer,
+                                           transfer->length,
+                                           stream->timeout_ms,
+                                           stream->cancellable,
+                                           stream_thread_transfer_cb,
+                                           slot);
+}
+
+static gboolean
+stream_thread_submit_cb (gpointer user_data)
+{
+  stream_thread_submit (user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean stream_thread_dispatch_cb (gpointer user_data);
+
+/* Runs on the USB thread */
+static void
+stream_thread_transfer_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  FpiUsbTransferStreamSlot *slot = user_data;
+  FpiUsbTransferStream *stream = slot->stream;
+  FpiUsbTransfer *transfer = slot->transfer;
+  FpiUsbTransferStreamResult *result;
+  GError *error = NULL;
+  gssize actual_length;
+  gboolean resubmit;
+
+  if (transfer->type == FP_TRANSFER_BULK)
+    actual_length = g_usb_device_bulk_transfer_finish (G_USB_DEVICE (source_object),
+                                                       res, &error);
+  else
+    actual_length = g_usb_device_interrupt_transfer_finish (G_USB_DEVICE (source_object),
+                                                            res, &error);
+
+  FPI_TRACE4 (usb_complete, transfer, transfer->endpoint,
+              actual_length, error ? error->code : 0);
+
+  g_mutex_lock (&stream->lock);
+
+  result = g_queue_pop_head (&stream->free_results);
+  if (!result)
+    result = g_malloc (sizeof (FpiUsbTransferStreamResult) + transfer->length);
+
+  result->actual_length = actual_length;
+  result->submit_time = transfer->submit_time;
+  result->error = error;
+  if (!error)
+    memcpy (result->data, transfer->buffer, CLAMP (actual_length, 0, transfer->length));
+  g_queue_push_tail (&stream->results, result);
+
+  /* Stopping the stream cancels the cancellable */
+  resubmit = !error && !g_cancellable_is_cancelled (stream->cancellable);
+  if (!resubmit)
+    stream->n_flying--;
+
+  if (!stream->dispatch_pending)
+    {
+      stream->dispatch_pending = TRUE;
+      stream_invoke_in (stream->context, stream_thread_dispatch_cb, stream);
+    }
+
+  g_mutex_unlock (&stream->lock);
+
+  if (resubmit)
+    stream_thread_submit (slot);
+}
+
+static void stream_check_done (FpiUsbTransferStream *stream);
+
+static gboolean
+stream_thread_dispatch_cb (gpointer user_data)
+{
+  FpiUsbTransferStream *stream = user_data;
+  FpiUsbTransfer *delivery = stream->delivery;
+  FpiUsbTransferStreamResult *result;
+  GQueue results;
+
+  g_mutex_lock (&stream->lock);
+  results = stream->results;
+  g_queue_init (&stream->results);
+  stream->dispatch_pending = FALSE;
+  g_mutex_unlock (&stream->lock);
+
+  stream->dispatching = TRUE;
+
+  for (GList *l = results.head; l; l = l->next)
+    {
+      result = l->data;
+
+      /* Results that arrive once the stream stopped are dropped */
+      if (!stream->running)
+        {
+          g_clear_error (&result->error);
+          continue;
+        }
+
+      delivery->actual_length = result->error ? -1 : result->actual_length;
+      delivery->submit_time = result->submit_time;
+      if (!result->error)
+        memcpy (delivery->buffer, result->data,
+                CLAMP (result->actual_length, 0, delivery->length));
+      usb_buffer_clear_tail (delivery);
+      /* Submissions happened on the USB thread, log them here instead */
+      log_transfer (delivery, TRUE, NULL);
+      log_transfer (delivery, FALSE, result->error);
+      record_transfer (delivery, result->error);
+
+      if (result->error)
+        {
+          stream->error = g_steal_pointer (&result->error);
+          fpi_usb_transfer_stream_stop (stream);
+          continue;
+        }
+
+      stream->callback (stream, delivery, stream->device, stream->user_data);
+    }
+
+  stream->dispatching = FALSE;
+
+  g_mutex_lock (&stream->lock);
+  while ((result = g_queue_pop_head (&results)))
+    g_queue_push_head (&stream->free_results, result);
+  g_mutex_unlock (&stream->lock);
+
+  stream_check_done (stream);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+stream_submit (FpiUsbTransferStreamSlot *slot)
+{
+  FpiUsbTransferStream *stream = slot->stream;
+
+  slot->done = FALSE;
+  stream->n_flying++;
+
+  /* The stream keeps its own reference for resubmission */
+  fpi_usb_transfer_submit (fpi_usb_transfer_ref (slot->transfer),
+                           stream->timeout_ms,
+                           stream->cancellable,
+                           stream_transfer_cb,
+                           slot);
+}
+
+static void
+stream_user_cancelled (GCancellable *cancellable, FpiUsbTransferStream *stream)
+{
+  g_cancellable_cancel (stream->cancellable);
+}
+
+static void
+stream_check_done (FpiUsbTransferStream *stream)
+{
+  FpiUsbTransferStreamDoneCallback done_callback;
+  GError *error;
+
+  if (fpi_usb_transfer_stream_is_active (stream))
+    return;
+
+  if (stream->user_cancellable)
+    {
+      g_cancellable_disconnect (stream->user_cancellable,
+                                stream->user_cancellable_id);
+      stream->user_cancellable_id = 0;
+      g_clear_object (&stream->user_cancellable);
+    }
+  g_clear_object (&stream->cancellable);
+
+  done_callback = stream->done_callback;
+  stream->done_callback = NULL;
+  error = g_steal_pointer (&stream->error);
+
+  if (stream->free_when_done)
+    {
+      g_clear_error (&error);
+      stream_destroy (stream);
+      return;
+    }
+
+  if (done_callback)
+    done_callback (stream, stream->device, stream->user_data, error);
+  else
+    g_clear_error (&error);
+}
+
+static void
+stream_dispatch (FpiUsbTransferStream *stream)
+{
+  stream->dispatching = TRUE;
+
+  while (stream->running)
+    {
+      FpiUsbTransferStreamSlot *slot = &stream->slots[stream->head];
+
+      if (!slot->done)
+        break;
+
+      if (slot->error)
+        {
+          stream->error = g_steal_pointer (&slot->error);
+          fpi_usb_transfer_stream_stop (stream);
+          break;
+        }
+
+      stream->head = (stream->head + 1) % stream->n_slots;
+      stream->callback (stream, slot->transfer, stream->device, stream->user_data);
+
+      if (stream->running)
+        stream_submit (slot);
+    }
+
+  stream->dispatching = FALSE;
+
+  /* Results that arrive once the stream stopped are dropped */
+  if (!stream->running)
+    {
+      guint i;
+
+      for (i = 0; i < stream->n_slots; i++)
+        g_clear_error (&stream->slots[i].error);
+    }
+
+  stream_check_done (stream);
+}
+
+static void
+stream_transfer_cb (FpiUsbTransfer *transfer, FpDevice *dev,
+                    gpointer user_data, GError *error)
+{
+  FpiUsbTransferStreamSlot *slot = user_data;
+  FpiUsbTransferStream *stream = slot->stream;
+
+  stream->n_flying--;
+  slot->done = TRUE;
+  slot->error = error;
+
+  stream_dispatch (stream);
+}
+
+/**
+ * fpi_usb_transfer_stream_start:
+ * @stream: The #FpiUsbTransferStream
+ * @timeout_ms: Timeout for each transfer in ms
+ * @cancellable: (nullable): Cancellable to use, e.g. fpi_device_get_cancellable()
+ * @callback: Callback for every completed transfer
+ * @done_callback: (nullable): Callback once the stream has ended
+ * @user_data: Data to pass to the callbacks
+ *
+ * Submits all transfers of @stream. The stream runs until it is stopped,
+ * a transfer fails or @cancellable is cancelled. In the latter two cases
+ * @done_callback receives the error.
+ */
+void
+fpi_usb_transfer_stream_start (FpiUsbTransferStream            *stream,
+                               guint                            timeout_ms,
+                               GCancellable                    *cancellable,
+                               FpiUsbTransferStreamCallback     callback,
+                               FpiUsbTransferStreamDoneCallback done_callback,
+                               gpointer                         user_data)
+{
+  guint i;
+
+  g_return_if_fail (stream);
+  g_return_if_fail (callback);
+  g_return_if_fail (!fpi_usb_transfer_stream_is_active (stream));
+
+  stream->timeout_ms = timeout_ms;
+  stream->callback = callback;
+  stream->done_callback = done_callback;
+  stream->user_data = user_data;
+  stream->head = 0;
+  stream->running = TRUE;
+  stream->cancellable = g_cancellable_new ();
+  stream->threaded = g_getenv ("FP_USB_EVENT_THREAD") != NULL;
+
+  if (cancellable)
+    {
+      stream->user_cancellable = g_object_ref (cancellable);
+      stream->user_cancellable_id =
+        g_cancellable_connect (cancellable,
+                               G_CALLBACK (stream_user_cancelled),
+                               stream, NULL);
+    }
+
+  if (!stream->threaded)
+    {
+      for (i = 0; i < stream->n_slots; i++)
+        stream_submit (&stream->slots[i]);
+      return;
+    }
+
+  /* The data is handed to the driver in a transfer of its own, as the
+   * ones of the slots are resubmitted by the USB thread. */
+  if (!stream->delivery)
+    {
+      FpiUsbTransfer *transfer = stream->slots[0].transfer;
+
+      stream->delivery = fpi_usb_transfer_new (stream->device);
+      if (transfer->type == FP_TRANSFER_BULK)
+        fpi_usb_transfer_fill_bulk (stream->delivery, transfer->endpoint, transfer->length);
+      else
+        fpi_usb_transfer_fill_interrupt (stream->delivery, transfer->endpoint, transfer->length);
+    }
+
+  g_clear_pointer (&stream->context, g_main_context_unref);
+  stream->context = fpi_device_get_main_context (stream->device);
+  stream->context = g_main_context_ref (stream->context ? stream->context : g_main_context_default ());
+
+  g_mutex_lock (&stream->lock);
+  stream->n_flying = stream->n_slots;
+  g_mutex_unlock (&stream->lock);
+
+  for (i = 0; i < stream->n_slots; i++)
+    stream_invoke_in (usb_event_thread_get_context (),
+                      stream_thread_submit_cb,
+                      &stream->slots[i]);
+}
+
+/**
+ * fpi_usb_transfer_stream_stop:
+ * @stream: The #FpiUsbTransferStream
+ *
+ * Stops @stream by cancelling all transfers in flight. No further
+ * transfers are delivered and the done callback is called without an
+ * error once all transfers have returned. Does nothing if the stream is
+ * not running.
+ */
+void
+fpi_usb_transfer_stream_stop (FpiUsbTransferStream *stream)
+{
+  g_return_if_fail (stream);
+
+  if (!stream->running)
+    return;
+
+  stream->running = FALSE;
+  g_cancellable_cancel (stream->cancellable);
+
+  stream_check_done (stream);
+}
+
+/**
+ * fpi_usb_transfer_stream_is_active:
+ * @stream: The #FpiUsbTransferStream
+ *
+ * Returns: %TRUE if @stream is running or still waiting for transfers to
+ *   return after it was stopped
+ */
+gboolean
+fpi_usb_transfer_stream_is_active (FpiUsbTransferStream *stream)
+{
+  gboolean active;
+
+  g_return_val_if_fail (stream, FALSE);
+
+  if (stream->running || stream->dispatching)
+    return TRUE;
+
+  g_mutex_lock (&stream->lock);
+  active = stream->n_flying > 0 || stream->dispatch_pending;
+  g_mutex_unlock (&stream->lock);
+
+  return active;
+}
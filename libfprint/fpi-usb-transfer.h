@@ -29,14 +29,61 @@ G_BEGIN_DECLS
 #define FPI_USB_ENDPOINT_IN 0x80
 #define FPI_USB_ENDPOINT_OUT 0x00
 
-typedef struct _FpiUsbTransfer FpiUsbTransfer;
-typedef struct _FpiSsm         FpiSsm;
+typedef struct _FpiUsbTransfer       FpiUsbTransfer;
+typedef struct _FpiUsbTransferStream FpiUsbTransferStream;
+typedef struct _FpiUsbTransferStats  FpiUsbTransferStats;
+typedef struct _FpiSsm               FpiSsm;
 
 typedef void (*FpiUsbTransferCallback)(FpiUsbTransfer *transfer,
                                        FpDevice       *dev,
                                        gpointer        user_data,
                                        GError         *error);
 
+/**
+ * FpiUsbTransferStreamCallback:
+ * @stream: The #FpiUsbTransferStream
+ * @transfer: The completed #FpiUsbTransfer
+ * @dev: The #FpDevice the stream belongs to
+ * @user_data: User data passed to fpi_usb_transfer_stream_start()
+ *
+ * Called for every successfully completed transfer of a stream, in the
+ * order the transfers were submitted. The transfer is submitted again once
+ * the callback returns, unless the stream was stopped from it. If the
+ * stream runs on the USB thread, @transfer holds a copy of the data instead
+ * and was already submitted again. In both cases it is only valid during
+ * the callback.
+ */
+typedef void (*FpiUsbTransferStreamCallback)(FpiUsbTransferStream *stream,
+                                             FpiUsbTransfer       *transfer,
+                                             FpDevice             *dev,
+                                             gpointer              user_data);
+
+/**
+ * FpiUsbTransferIdleCallback:
+ * @device: The #FpDevice
+ * @user_data: User data passed to fpi_usb_transfer_abort_all()
+ *
+ * Called by fpi_usb_transfer_abort_all() once no transfer of @device is
+ * in flight anymore.
+ */
+typedef void (*FpiUsbTransferIdleCallback)(FpDevice *device,
+                                           gpointer  user_data);
+
+/**
+ * FpiUsbTransferStreamDoneCallback:
+ * @stream: The #FpiUsbTransferStream
+ * @dev: The #FpDevice the stream belongs to
+ * @user_data: User data passed to fpi_usb_transfer_stream_start()
+ * @error: The error that ended the stream, or %NULL if it was stopped
+ *
+ * Called once a stream has ended and none of its transfers are in flight
+ * anymore. The stream may be started again or freed from the callback.
+ */
+typedef void (*FpiUsbTransferStreamDoneCallback)(FpiUsbTransferStream *stream,
+                                                 FpDevice             *dev,
+                                                 gpointer              user_data,
+                                                 GError               *error);
+
 /**
  * FpiTransferType:
  * @FP_TRANSFER_NONE: Type not set
@@ -95,12 +142,22 @@ struct _FpiUsbTransfer
   /* Flags */
   gboolean short_is_error;
 
+  /* Submission time for the transfer statistics */
+  gint64 submit_time;
+
+  /* Cancellation of the submitted transfer, see fpi_usb_transfer_abort_all() */
+  GCancellable *cancellable;
+  GCancellable *user_cancellable;
+  gulong        user_cancellable_id;
+  GList         in_flight_link;
+
   /* Callbacks */
   gpointer               user_data;
   FpiUsbTransferCallback callback;
 
-  /* Data free function */
+  /* Data free function, called with buffer_owner if set */
   GDestroyNotify free_buffer;
+  gpointer       buffer_owner;
 };
 
 GType              fpi_usb_transfer_get_type (void) G_GNUC_CONST;
@@ -121,6 +178,17 @@ void               fpi_usb_transfer_fill_bulk_full (FpiUsbTransfer *transfer,
                                                     gsize           length,
                                                     GDestroyNotify  free_func);
 
+void               fpi_usb_transfer_fill_bulk_static (FpiUsbTransfer *transfer,
+                                                      guint8          endpoint,
+                                                      const guint8   *buffer,
+                                                      gsize           length);
+
+void               fpi_usb_transfer_fill_bulk_image (FpiUsbTransfer *transfer,
+                                                     guint8          endpoint,
+                                                     FpImage        *image,
+                                                     gsize           offset,
+                                                     gsize           length);
+
 void               fpi_usb_transfer_fill_control (FpiUsbTransfer       *transfer,
                                                   GUsbDeviceDirection   direction,
                                                   GUsbDeviceRequestType request_type,
@@ -146,10 +214,139 @@ void               fpi_usb_transfer_submit (FpiUsbTransfer        *transfer,
                                             FpiUsbTransferCallback callback,
                                             gpointer               user_data);
 
+void               fpi_usb_transfer_abort_all (FpDevice                  *device,
+                                               FpiUsbTransferIdleCallback callback,
+                                               gpointer                   user_data);
+guint              fpi_usb_transfer_get_n_in_flight (FpDevice *device);
+
 gboolean           fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
                                                  guint           timeout_ms,
                                                  GError        **error);
 
+#define FPI_USB_TRANSFER_STATS_ENDPOINTS 32
+#define FPI_USB_TRANSFER_STATS_BUCKETS 24
+#define FPI_USB_TRANSFER_STATS_RECORDS 64
+
+/**
+ * FpiUsbTransferStatus:
+ * @FPI_USB_TRANSFER_STATUS_OK: The transfer succeeded
+ * @FPI_USB_TRANSFER_STATUS_ERROR: The transfer failed
+ * @FPI_USB_TRANSFER_STATUS_TIMEOUT: The transfer timed out
+ * @FPI_USB_TRANSFER_STATUS_CANCELLED: The transfer was cancelled
+ *
+ * Outcome of a transfer as recorded in #FpiUsbTransferRecord.
+ */
+typedef enum {
+  FPI_USB_TRANSFER_STATUS_OK,
+  FPI_USB_TRANSFER_STATUS_ERROR,
+  FPI_USB_TRANSFER_STATUS_TIMEOUT,
+  FPI_USB_TRANSFER_STATUS_CANCELLED,
+} FpiUsbTransferStatus;
+
+/**
+ * FpiUsbEndpointStats:
+ * @completed: Number of completed transfers
+ * @bytes: Number of bytes actually transferred
+ * @errors: Number of failed transfers, excluding timeouts and cancellations
+ * @timeouts: Number of transfers that timed out
+ * @cancelled: Number of cancelled transfers
+ * @short_transfers: Number of successful transfers shorter than requested
+ * @total_latency_us: Sum of the submit to completion latencies
+ * @max_latency_us: Largest submit to completion latency
+ * @latency_histogram: Number of transfers per latency bucket, bucket @i
+ *   counts latencies below 2^(@i + 1) microseconds, the last one all others
+ * @rtt_samples: Number of successful transfers in the round-trip estimate
+ * @rtt_avg_us: Smoothed round-trip time of successful transfers
+ * @rtt_var_us: Smoothed mean deviation of the round-trip time
+ * @timeout_backoff: Number of timeouts since the last successful transfer
+ *
+ * Statistics of one endpoint (use fpi_usb_transfer_stats_endpoint_index()
+ * to find it). Control transfers are accounted to endpoint 0 of their
+ * direction. The round-trip estimate is used by
+ * fpi_usb_transfer_get_adaptive_timeout().
+ */
+typedef struct
+{
+  guint64 completed;
+  guint64 bytes;
+  guint   errors;
+  guint   timeouts;
+  guint   cancelled;
+  guint   short_transfers;
+  guint64 total_latency_us;
+  guint64 max_latency_us;
+  guint   latency_histogram[FPI_USB_TRANSFER_STATS_BUCKETS];
+  guint   rtt_samples;
+  guint64 rtt_avg_us;
+  guint64 rtt_var_us;
+  guint   timeout_backoff;
+} FpiUsbEndpointStats;
+
+/**
+ * FpiUsbTransferRecord:
+ * @time: Monotonic completion time
+ * @latency_us: Submit to completion latency
+ * @length: Requested length
+ * @actual_length: Actual length, -1 on error
+ * @type: The #FpiTransferType
+ * @endpoint: The endpoint
+ * @status: The #FpiUsbTransferStatus
+ *
+ * A completed transfer in the #FpiUsbTransferStats ring buffer.
+ */
+typedef struct
+{
+  gint64               time;
+  guint32              latency_us;
+  gssize               length;
+  gssize               actual_length;
+  FpiTransferType      type;
+  guint8               endpoint;
+  FpiUsbTransferStatus status;
+} FpiUsbTransferRecord;
+
+/**
+ * FpiUsbTransferStats:
+ * @endpoints: Per endpoint statistics
+ * @records: Ring buffer of the most recently completed transfers
+ * @n_records: Total number of records written, the latest one is at
+ *   index (@n_records - 1) % %FPI_USB_TRANSFER_STATS_RECORDS
+ *
+ * Transfer statistics of a device. They are always collected and only cost
+ * a timestamp and a few counters per transfer. Set FP_DEBUG_TRANSFER_STATS
+ * to have them dumped whenever the device is closed.
+ */
+struct _FpiUsbTransferStats
+{
+  FpiUsbEndpointStats  endpoints[FPI_USB_TRANSFER_STATS_ENDPOINTS];
+  FpiUsbTransferRecord records[FPI_USB_TRANSFER_STATS_RECORDS];
+  guint64              n_records;
+};
+
+guint                      fpi_usb_transfer_stats_endpoint_index (guint8 endpoint);
+const FpiUsbTransferStats *fpi_usb_transfer_get_stats (FpDevice *device);
+void                       fpi_usb_transfer_reset_stats (FpDevice *device);
+gchar                     *fpi_usb_transfer_stats_to_string (FpDevice *device);
+guint                      fpi_usb_transfer_get_adaptive_timeout (FpDevice *device,
+                                                                  guint8    endpoint,
+                                                                  guint     floor_ms,
+                                                                  guint     ceiling_ms);
+
+FpiUsbTransferStream *fpi_usb_transfer_stream_new (FpDevice       *device,
+                                                   FpiTransferType type,
+                                                   guint8          endpoint,
+                                                   gsize           length,
+                                                   guint           n_transfers);
+void                  fpi_usb_transfer_stream_free (FpiUsbTransferStream *stream);
+
+void                  fpi_usb_transfer_stream_start (FpiUsbTransferStream            *stream,
+                                                     guint                            timeout_ms,
+                                                     GCancellable                    *cancellable,
+                                                     FpiUsbTransferStreamCallback     callback,
+                                                     FpiUsbTransferStreamDoneCallback done_callback,
+                                                     gpointer                         user_data);
+void                  fpi_usb_transfer_stream_stop (FpiUsbTransferStream *stream);
+gboolean              fpi_usb_transfer_stream_is_active (FpiUsbTransferStream *stream);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiUsbTransfer, fpi_usb_transfer_unref)
 
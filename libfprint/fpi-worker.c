@@ -0,0 +1,263 @@
+/*
+ * Worker thread configuration
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "worker"
+
+#include "fpi-log.h"
+#include "fpi-worker.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+/**
+ * SECTION: fpi-worker
+ * @title: Worker threads
+ * @short_description: CPU budget of the libfprint worker threads
+ *
+ * Minutiae detection, frame assembling and identification run on thread
+ * pools that libfprint owns. These pools are created with
+ * fpi_worker_pool_new(), which keeps them within a process wide budget:
+ *
+ * - The maximum number of threads of every pool, which is also the number
+ *   of parts that work is split into. It defaults to the number of
+ *   processors, and can be set with the FP_WORKER_THREADS environment
+ *   variable or the #FpContext:max-worker-threads property.
+ * - The nice value of the worker threads, from the FP_WORKER_NICE
+ *   environment variable or the #FpContext:worker-nice property. It is
+ *   only applied on Linux, where it can be set per thread.
+ * - The efficiency mode, from the FP_EFFICIENCY_MODE environment variable
+ *   or the #FpContext:efficiency-mode property. Algorithms that have a
+ *   cheaper variant use it, trading a little accuracy for less CPU time.
+ */
+
+typedef struct
+{
+  GThreadPool *pool;
+  GFunc        func;
+  guint        max_threads;
+} WorkerPool;
+
+static GMutex worker_mutex;
+static GPtrArray *worker_pools;
+static gint worker_max_threads = -1;
+static gint worker_nice = -1;
+static gint worker_efficiency = -1;
+
+/* The nice value that was applied to the current thread, plus one */
+static GPrivate applied_nice;
+
+static void
+worker_init_defaults (void)
+{
+  const gchar *env;
+
+  if (worker_max_threads >= 0)
+    return;
+
+  env = g_getenv ("FP_WORKER_THREADS");
+  worker_max_threads = env ? CLAMP (atoi (env), 0, 1024) : 0;
+
+  env = g_getenv ("FP_WORKER_NICE");
+  worker_nice = env ? CLAMP (atoi (env), 0, 19) : 0;
+
+  env = g_getenv ("FP_EFFICIENCY_MODE");
+  worker_efficiency = env && g_strcmp0 (env, "0") != 0;
+}
+
+static guint
+worker_effective_max_threads (void)
+{
+  return worker_max_threads > 0 ? worker_max_threads : MAX (g_get_num_processors (), 1);
+}
+
+static void
+worker_apply_nice (void)
+{
+  gint nice = fpi_worker_get_nice ();
+
+  if (GPOINTER_TO_INT (g_private_get (&applied_nice)) == nice + 1)
+    return;
+
+  g_private_set (&applied_nice, GINT_TO_POINTER (nice + 1));
+
+#ifdef __linux__
+  /* Linux applies PRIO_PROCESS to the calling thread only. Lowering the
+   * nice value again needs privileges, which is fine to fail. */
+  if (setpriority (PRIO_PROCESS, 0, nice) < 0)
+    fp_dbg ("Could not set the nice value of a worker to %d: %s",
+            nice, g_strerror (errno));
+#endif
+}
+
+static void
+worker_run (gpointer data, gpointer user_data)
+{
+  WorkerPool *worker = user_data;
+
+  worker_apply_nice ();
+  worker->func (data, NULL);
+}
+
+/**
+ * fpi_worker_pool_new:
+ * @func: The function to run for every item pushed to the pool
+ * @max_threads: The number of threads the pool should never exceed
+ * @exclusive: Whether the threads are owned by the pool
+ *
+ * Creates a thread pool that runs @func like g_thread_pool_new() does,
+ * but with at most fpi_worker_get_max_threads() threads and at the
+ * configured nice value. The pool is never freed.
+ *
+ * Returns: (transfer none): A new #GThreadPool
+ */
+GThreadPool *
+fpi_worker_pool_new (GFunc func, guint max_threads, gboolean exclusive)
+{
+  WorkerPool *worker = g_new0 (WorkerPool, 1);
+
+  worker->func = func;
+  worker->max_threads = MAX (max_threads, 1);
+
+  g_mutex_lock (&worker_mutex);
+  worker_init_defaults ();
+  worker->pool = g_thread_pool_new (worker_run, worker,
+                                    MIN (worker->max_threads, worker_effective_max_threads ()),
+                                    exclusive, NULL);
+  if (!worker_pools)
+    worker_pools = g_ptr_array_new ();
+  g_ptr_array_add (worker_pools, worker);
+  g_mutex_unlock (&worker_mutex);
+
+  return worker->pool;
+}
+
+/**
+ * fpi_worker_get_max_threads:
+ *
+ * Returns: The number of threads that a pool may use, at least 1
+ */
+guint
+fpi_worker_get_max_threads (void)
+{
+  guint n;
+
+  g_mutex_lock (&worker_mutex);
+  worker_init_defaults ();
+  n = worker_effective_max_threads ();
+  g_mutex_unlock (&worker_mutex);
+
+  return n;
+}
+
+/**
+ * fpi_worker_set_max_threads:
+ * @n_threads: The maximum number of threads of a pool, 0 for the number
+ *   of processors
+ *
+ * Sets the maximum number of threads of every pool, including the
+ * existing ones. Pools that have more threads running only finish the
+ * items they are working on.
+ */
+void
+fpi_worker_set_max_threads (guint n_threads)
+{
+  guint i;
+
+  g_mutex_lock (&worker_mutex);
+  worker_init_defaults ();
+  worker_max_threads = MIN (n_threads, 1024);
+
+  for (i = 0; worker_pools && i < worker_pools->len; i++)
+    {
+      WorkerPool *worker = g_ptr_array_index (worker_pools, i);
+
+      g_thread_pool_set_max_threads (worker->pool,
+                                     MIN (worker->max_threads, worker_effective_max_threads ()),
+                                     NULL);
+    }
+  g_mutex_unlock (&worker_mutex);
+}
+
+/**
+ * fpi_worker_get_nice:
+ *
+ * Returns: The nice value of the worker threads
+ */
+gint
+fpi_worker_get_nice (void)
+{
+  gint nice;
+
+  g_mutex_lock (&worker_mutex);
+  worker_init_defaults ();
+  nice = worker_nice;
+  g_mutex_unlock (&worker_mutex);
+
+  return nice;
+}
+
+/**
+ * fpi_worker_set_nice:
+ * @nice: The nice value, from 0 to 19
+ *
+ * Sets the nice value of the worker threads, each thread applies it before
+ * it picks up its next item.
+ */
+void
+fpi_worker_set_nice (gint nice)
+{
+  g_mutex_lock (&worker_mutex);
+  worker_init_defaults ();
+  worker_nice = CLAMP (nice, 0, 19);
+  g_mutex_unlock (&worker_mutex);
+}
+
+/**
+ * fpi_worker_get_efficiency_mode:
+ *
+ * Returns: Whether the cheaper variants of algorithms should be used
+ */
+gboolean
+fpi_worker_get_efficiency_mode (void)
+{
+  gboolean efficiency;
+
+  g_mutex_lock (&worker_mutex);
+  worker_init_defaults ();
+  efficiency = worker_efficiency;
+  g_mutex_unlock (&worker_mutex);
+
+  return efficiency;
+}
+
+/**
+ * fpi_worker_set_efficiency_mode:
+ * @efficiency: Whether to use the cheaper variants of algorithms
+ *
+ * Sets the efficiency mode, it affects work that starts afterwards.
+ */
+void
+fpi_worker_set_efficiency_mode (gboolean efficiency)
+{
+  g_mutex_lock (&worker_mutex);
+  worker_init_defaults ();
+  worker_efficiency = !!efficiency;
+  g_mutex_unlock (&worker_mutex);
+}
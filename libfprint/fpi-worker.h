@@ -0,0 +1,34 @@
+/*
+ * Worker thread configuration
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <config.h>
+#include <glib.h>
+
+GThreadPool *fpi_worker_pool_new (GFunc    func,
+                                  guint    max_threads,
+                                  gboolean exclusive);
+
+guint        fpi_worker_get_max_threads (void);
+void         fpi_worker_set_max_threads (guint n_threads);
+gint         fpi_worker_get_nice (void);
+void         fpi_worker_set_nice (gint nice);
+gboolean     fpi_worker_get_efficiency_mode (void);
+void         fpi_worker_set_efficiency_mode (gboolean efficiency);
@@ -0,0 +1,381 @@
+/*
+ * Offline minutiae extraction for archived captures
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs minutiae detection on every PGM (P5, 8 bit) or headerless raw
+ * 8 bit image in a directory and writes a serialized NBIS print next to
+ * each of them (or into --output). Detections run concurrently, one per
+ * processor core, and the time taken by each image is reported.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <glib/gstdio.h>
+
+#include "fpi-image.h"
+#include "fpi-print.h"
+
+static gint raw_width = 0;
+static gint raw_height = 0;
+static gchar *output_dir = NULL;
+static gint jobs = 0;
+
+static const GOptionEntry entries[] = {
+  { "width", 0, 0, G_OPTION_ARG_INT, &raw_width, "Width of raw images", "PIXELS" },
+  { "height", 0, 0, G_OPTION_ARG_INT, &raw_height, "Height of raw images", "PIXELS" },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir, "Directory to write the prints to", "DIR" },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "Number of concurrent detections (default: one per core)", "N" },
+  { NULL }
+};
+
+typedef struct
+{
+  GMainLoop *loop;
+  GPtrArray *paths;
+  guint      next;
+  guint      running;
+  guint      failed;
+} ExtractData;
+
+typedef struct
+{
+  ExtractData *data;
+  gchar       *path;
+  gint64       start;
+} ExtractJob;
+
+static void extract_next (ExtractData *data);
+
+static const guchar *
+pgm_skip_space (const guchar *p, const guchar *end)
+{
+  while (p < end)
+    {
+      if (*p == '#')
+        {
+          while (p < end && *p != '\n')
+            p++;
+        }
+      else if (g_ascii_isspace (*p))
+        {
+          p++;
+        }
+      else
+        {
+          break;
+        }
+    }
+
+  return p;
+}
+
+static const guchar *
+pgm_read_uint (const guchar *p, const guchar *end, guint *value)
+{
+  guint64 v = 0;
+
+  p = pgm_skip_space (p, end);
+  if (p >= end || !g_ascii_isdigit (*p))
+    return NULL;
+
+  while (p < end && g_ascii_isdigit (*p))
+    {
+      v = v * 10 + (*p - '0');
+      if (v > G_MAXINT)
+        return NULL;
+      p++;
+    }
+
+  *value = v;
+  return p;
+}
+
+static FpImage *
+load_pgm (const guchar *contents, gsize length, GError **error)
+{
+  const guchar *p = contents + 2;
+  const guchar *end = contents + length;
+  guint width, height, maxval;
+  FpImage *img;
+
+  if (!(p = pgm_read_uint (p, end, &width)) ||
+      !(p = pgm_read_uint (p, end, &height)) ||
+      !(p = pgm_read_uint (p, end, &maxval)) ||
+      p >= end || !g_ascii_isspace (*p))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Malformed PGM header");
+      return NULL;
+    }
+  /* Exactly one whitespace character separates the header from the data */
+  p++;
+
+  if (maxval == 0 || maxval > 255)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Only 8 bit PGM images are supported");
+      return NULL;
+    }
+
+  if (width == 0 || height == 0 || (gsize) (end - p) / width < height)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "PGM image data is truncated");
+      return NULL;
+    }
+
+  img = fp_image_new (width, height);
+  memcpy (img->data, p, (gsize) width * height);
+
+  return img;
+}
+
+static FpImage *
+load_image (const gchar *path, GError **error)
+{
+  g_autofree guchar *contents = NULL;
+  FpImage *img;
+  gsize length;
+
+  if (!g_file_get_contents (path, (gchar **) &contents, &length, error))
+    return NULL;
+
+  if (length >= 2 && contents[0] == 'P' && contents[1] == '5')
+    return load_pgm (contents, length, error);
+
+  if (raw_width <= 0 || raw_height <= 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Raw images need --width and --height");
+      return NULL;
+    }
+
+  if (length != (gsize) raw_width * raw_height)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Raw image has %" G_GSIZE_FORMAT " bytes, expected %dx%d",
+                   length, raw_width, raw_height);
+      return NULL;
+    }
+
+  img = fp_image_new (raw_width, raw_height);
+  memcpy (img->data, contents, length);
+
+  return img;
+}
+
+static gboolean
+save_print (FpImage *img, const gchar *path, GError **error)
+{
+  g_autoptr(FpPrint) print = NULL;
+  g_autofree guchar *data = NULL;
+  g_autofree gchar *base = NULL;
+  g_autofree gchar *name = NULL;
+  g_autofree gchar *out = NULL;
+  gchar *dot;
+  gsize length;
+
+  print = g_object_new (FP_TYPE_PRINT,
+                        "driver", "offline",
+                        "device-id", "offline",
+                        NULL);
+  g_object_ref_sink (print);
+  fpi_print_set_type (print, FPI_PRINT_NBIS);
+
+  base = g_path_get_basename (path);
+  dot = strrchr (base, '.');
+  if (dot)
+    *dot = '\0';
+  fp_print_set_description (print, base);
+
+  if (!fpi_print_add_from_image (print, img, error))
+    return FALSE;
+
+  if (!fp_print_serialize (print, &data, &length, error))
+    return FALSE;
+
+  name = g_strconcat (base, ".fpr", NULL);
+  if (output_dir)
+    {
+      out = g_build_filename (output_dir, name, NULL);
+    }
+  else
+    {
+      g_autofree gchar *dir = g_path_get_dirname (path);
+      out = g_build_filename (dir, name, NULL);
+    }
+
+  return g_file_set_contents (out, (gchar *) data, length, error);
+}
+
+static void
+detect_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  ExtractJob *job = user_data;
+  ExtractData *data = job->data;
+  FpImage *img = FP_IMAGE (source);
+  g_autoptr(GError) error = NULL;
+  gint64 elapsed = g_get_monotonic_time () - job->start;
+
+  if (!fp_image_detect_minutiae_finish (img, res, &error) ||
+      !save_print (img, job->path, &error))
+    {
+      g_printerr ("%s: %s\n", job->path, error->message);
+      data->failed++;
+    }
+  else
+    {
+      g_print ("%s\t%u minutiae\t%.1f ms\n", job->path,
+               fp_image_get_minutiae (img)->len, elapsed / 1000.0);
+    }
+
+  g_object_unref (img);
+  g_free (job->path);
+  g_free (job);
+
+  data->running--;
+  extract_next (data);
+}
+
+static void
+extract_next (ExtractData *data)
+{
+  while (data->next < data->paths->len && data->running < (guint) jobs)
+    {
+      const gchar *path = g_ptr_array_index (data->paths, data->next++);
+      g_autoptr(GError) error = NULL;
+      ExtractJob *job;
+      FpImage *img;
+
+      img = load_image (path, &error);
+      if (!img)
+        {
+          g_printerr ("%s: %s\n", path, error->message);
+          data->failed++;
+          continue;
+        }
+
+      job = g_new0 (ExtractJob, 1);
+      job->data = data;
+      job->path = g_strdup (path);
+      job->start = g_get_monotonic_time ();
+
+      data->running++;
+      fp_image_detect_minutiae (img, NULL, detect_cb, job);
+    }
+
+  if (data->running == 0)
+    g_main_loop_quit (data->loop);
+}
+
+static gint
+compare_paths (gconstpointer a, gconstpointer b)
+{
+  return g_strcmp0 (*(const gchar **) a, *(const gchar **) b);
+}
+
+static GPtrArray *
+list_images (const gchar *dir_path, GError **error)
+{
+  g_autoptr(GDir) dir = NULL;
+  GPtrArray *paths;
+  const gchar *name;
+
+  dir = g_dir_open (dir_path, 0, error);
+  if (!dir)
+    return NULL;
+
+  paths = g_ptr_array_new_with_free_func (g_free);
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      if (!g_str_has_suffix (name, ".pgm") && !g_str_has_suffix (name, ".raw"))
+        continue;
+
+      g_ptr_array_add (paths, g_build_filename (dir_path, name, NULL));
+    }
+
+  /* Report in a stable order */
+  g_ptr_array_sort (paths, compare_paths);
+
+  return paths;
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GPtrArray) paths = NULL;
+  g_autoptr(GError) error = NULL;
+  ExtractData data = { 0 };
+  gint64 start;
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("DIRECTORY");
+  g_option_context_set_summary (context,
+                                "Detect the minutiae of every PGM or raw image in DIRECTORY "
+                                "and store them as serialized NBIS prints.");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (argc != 2)
+    {
+      g_printerr ("Expected exactly one image directory\n");
+      return EXIT_FAILURE;
+    }
+
+  if (jobs <= 0)
+    jobs = g_get_num_processors ();
+
+  paths = list_images (argv[1], &error);
+  if (!paths)
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (output_dir && g_mkdir_with_parents (output_dir, 0755) != 0)
+    {
+      g_printerr ("Could not create output directory %s\n", output_dir);
+      return EXIT_FAILURE;
+    }
+
+  data.loop = g_main_loop_new (NULL, FALSE);
+  data.paths = paths;
+
+  start = g_get_monotonic_time ();
+  extract_next (&data);
+  if (data.running > 0)
+    g_main_loop_run (data.loop);
+
+  g_print ("%u images, %u failed, %.1f ms total\n", paths->len, data.failed,
+           (g_get_monotonic_time () - start) / 1000.0);
+
+  g_main_loop_unref (data.loop);
+  g_free (output_dir);
+
+  return data.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
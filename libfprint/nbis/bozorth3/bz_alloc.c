@@ -60,11 +60,20 @@ of the software.
 #cat:        specified length exiting directly upon system error
 #cat: malloc_or_return_error - allocates a buffer of bytes from the heap
 #cat:        of specified length returning an error code upon system error
+#cat: bz_match_context_new - allocates the work buffers needed to run
+#cat:        a match, several contexts may be used concurrently
+#cat: bz_match_context_free - releases a match context
+#cat: bz_gallery_web_new - allocates a cached gallery Web with room
+#cat:        for the specified number of edges
+#cat: bz_gallery_web_new_view - creates a gallery Web that refers to
+#cat:        rows and keys kept elsewhere
+#cat: bz_gallery_web_free - releases a cached gallery Web
 
 ***********************************************************************/
 
 #include <stdio.h>
 #include <string.h>
+#include <glib.h>
 #include <bozorth.h>
 
 
@@ -72,3 +81,55 @@ of the software.
 
 /***********************************************************************/
 /* returns CNULL on error */
+
+/***********************************************************************/
+/* The context is large (mostly due to ctp[], yy[] and sct[]), but it is */
+/* zero filled on allocation so pages are only touched once used.        */
+BzMatchContext * bz_match_context_new( void )
+{
+return g_malloc0( sizeof( BzMatchContext ) );
+}
+
+/***********************************************************************/
+void bz_match_context_free( BzMatchContext * ctx )
+{
+g_free( ctx );
+}
+
+/***********************************************************************/
+BzGalleryWeb * bz_gallery_web_new( int len )
+{
+BzGalleryWeb * web;
+
+/* The key columns follow the rows in the same allocation */
+web = g_malloc( sizeof( BzGalleryWeb ) + len * ( sizeof( web->cols[0] ) + 3 * sizeof( short ) ) );
+web->len = len;
+web->cols = (int (*)[ COLS_SIZE_2 ]) ( web + 1 );
+web->dist = (short *) &web->cols[len];
+web->beta1 = web->dist + len;
+web->beta2 = web->beta1 + len;
+return web;
+}
+
+/***********************************************************************/
+/* The data must stay valid for the lifetime of the view, as with the    */
+/* Webs from bz_gallery_web_new() it is only ever read.                  */
+BzGalleryWeb * bz_gallery_web_new_view( int len, const int cols[][ COLS_SIZE_2 ],
+	const short * dist, const short * beta1, const short * beta2 )
+{
+BzGalleryWeb * web;
+
+web = g_malloc( sizeof( BzGalleryWeb ) );
+web->len = len;
+web->cols = (int (*)[ COLS_SIZE_2 ]) cols;
+web->dist = (short *) dist;
+web->beta1 = (short *) beta1;
+web->beta2 = (short *) beta2;
+return web;
+}
+
+/***********************************************************************/
+void bz_gallery_web_free( BzGalleryWeb * web )
+{
+g_free( web );
+}
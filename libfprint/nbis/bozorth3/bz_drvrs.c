@@ -64,6 +64,25 @@ of the software.
 #cat:                        same probe fingerprint is matches repeatedly
 #cat:                        to multiple gallery fingerprints as in
 #cat:                        identification mode
+#cat: bozorth_probe_init_ctx, bozorth_gallery_init_ctx,
+#cat: bozorth_to_gallery_ctx - variants of the above operating on the
+#cat:                        work buffers of the given match context
+#cat:                        rather than the shared default one
+#cat: bozorth_probe_web_new_ctx - builds the probe comparison table
+#cat:                        and keeps a copy of it, so that it can be
+#cat:                        reused for subsequent matches
+#cat: bozorth_probe_web_load_ctx - makes a cached probe comparison
+#cat:                        table the current one of the match context
+#cat: bozorth_gallery_web_new_ctx - builds the gallery comparison table
+#cat:                        and keeps a copy of it, so that it can be
+#cat:                        reused for subsequent matches
+#cat: bozorth_gallery_web_load_ctx - makes a cached gallery comparison
+#cat:                        table the current one of the match context
+#cat: bozorth_to_gallery_web_ctx - variant of bozorth_to_gallery_ctx
+#cat:                        using a cached gallery comparison table
+#cat: bozorth_to_gallery_web_threshold_ctx - variant of
+#cat:                        bozorth_to_gallery_web_ctx that stops as soon
+#cat:                        as the score is known to reach a threshold
 #cat: bozorth_main -         supports the matching scenario where a
 #cat:                        single probe fingerprint is to be matched
 #cat:                        to a single gallery fingerprint as in
@@ -77,8 +96,24 @@ of the software.
 #include <bozorth.h>
 
 /**************************************************************************/
+/* Copies the distance and beta columns of the first n sorted rows. */
+/* The distance is at most DM^2 and the betas are in ( -180, 180 ], */
+/* so they all fit in a short. */
 
-int bozorth_probe_init( struct xyt_struct * pstruct )
+static void bz_fill_keys( int n, int * colpt[], short dist[], short beta1[], short beta2[] )
+{
+int i;
+
+for ( i = 0; i < n; i++ ) {
+	dist[i]  = (short) colpt[i][0];
+	beta1[i] = (short) colpt[i][1];
+	beta2[i] = (short) colpt[i][2];
+}
+}
+
+/**************************************************************************/
+
+int bozorth_probe_init_ctx( BzMatchContext * ctx, struct xyt_struct * pstruct )
 {
 int sim;	/* number of pointwise comparisons for Subject's record*/
 int msim;	/* Pruned length of Subject's comparison pointer list */
@@ -93,22 +128,25 @@ bz_comp(
 	pstruct->ycol,
 	pstruct->thetacol,
 	&sim,
-	scols,
-	scolpt );
+	ctx->scols,
+	ctx->scolpt,
+	ctx->colpt_scratch );
 
 msim = sim;	/* Init search to end of Subject's pointwise comparison table (last edge in Web) */
 
 
 
-bz_find( &msim, scolpt );
+bz_find( &msim, ctx->scolpt );
 
 
 
 if ( msim < FDD )	/* Makes sure there are a reasonable number of edges (at least 500, if possible) to analyze in the Web */
 	msim = ( sim > FDD ) ? FDD : sim;
 
-
-
+bz_fill_keys( msim, ctx->scolpt, ctx->skeys[0], ctx->skeys[1], ctx->skeys[2] );
+ctx->sdist = ctx->skeys[0];
+ctx->sbeta1 = ctx->skeys[1];
+ctx->sbeta2 = ctx->skeys[2];
 
 
 return msim;
@@ -116,7 +154,7 @@ return msim;
 
 /**************************************************************************/
 
-int bozorth_gallery_init( struct xyt_struct * gstruct )
+int bozorth_gallery_init_ctx( BzMatchContext * ctx, struct xyt_struct * gstruct )
 {
 int fim;	/* number of pointwise comparisons for On-File record*/
 int mfim;	/* Pruned length of On-File Record's pointer list */
@@ -130,22 +168,25 @@ bz_comp(
 	gstruct->ycol,
 	gstruct->thetacol,
 	&fim,
-	fcols,
-	fcolpt );
+	ctx->fcols,
+	ctx->fcolpt,
+	ctx->colpt_scratch );
 
 mfim = fim;	/* Init search to end of On-File Record's pointwise comparison table (last edge in Web) */
 
 
 
-bz_find( &mfim, fcolpt );
+bz_find( &mfim, ctx->fcolpt );
 
 
 
 if ( mfim < FDD )	/* Makes sure there are a reasonable number of edges (at least 500, if possible) to analyze in the Web */
 	mfim = ( fim > FDD ) ? FDD : fim;
 
-
-
+bz_fill_keys( mfim, ctx->fcolpt, ctx->fkeys[0], ctx->fkeys[1], ctx->fkeys[2] );
+ctx->fdist = ctx->fkeys[0];
+ctx->fbeta1 = ctx->fkeys[1];
+ctx->fbeta2 = ctx->fkeys[2];
 
 
 return mfim;
@@ -153,7 +194,8 @@ return mfim;
 
 /**************************************************************************/
 
-int bozorth_to_gallery(
+int bozorth_to_gallery_ctx(
+		BzMatchContext * ctx,
 		int probe_len,
 		struct xyt_struct * pstruct,
 		struct xyt_struct * gstruct
@@ -162,9 +204,144 @@ int bozorth_to_gallery(
 int np;
 int gallery_len;
 
-gallery_len = bozorth_gallery_init( gstruct );
-np = bz_match( probe_len, gallery_len );
-return bz_match_score( np, pstruct, gstruct );
+gallery_len = bozorth_gallery_init_ctx( ctx, gstruct );
+np = bz_match( ctx, probe_len, gallery_len );
+return bz_match_score( ctx, np, pstruct, gstruct );
+}
+
+/**************************************************************************/
+
+BzGalleryWeb * bozorth_probe_web_new_ctx( BzMatchContext * ctx, struct xyt_struct * pstruct )
+{
+BzGalleryWeb * web;
+int msim;
+int i;
+
+msim = bozorth_probe_init_ctx( ctx, pstruct );
+
+/* As for the gallery, bz_match() only looks at the first msim rows of the sorted pointer list. */
+web = bz_gallery_web_new( msim );
+for ( i = 0; i < msim; i++ )
+	memcpy( web->cols[i], ctx->scolpt[i], sizeof( web->cols[i] ) );
+memcpy( web->dist, ctx->sdist, msim * sizeof( short ) );
+memcpy( web->beta1, ctx->sbeta1, msim * sizeof( short ) );
+memcpy( web->beta2, ctx->sbeta2, msim * sizeof( short ) );
+
+return web;
+}
+
+/**************************************************************************/
+
+int bozorth_probe_web_load_ctx( BzMatchContext * ctx, BzGalleryWeb * web )
+{
+int i;
+
+for ( i = 0; i < web->len; i++ )
+	ctx->scolpt[i] = web->cols[i];
+ctx->sdist = web->dist;
+ctx->sbeta1 = web->beta1;
+ctx->sbeta2 = web->beta2;
+
+return web->len;
+}
+
+/**************************************************************************/
+
+BzGalleryWeb * bozorth_gallery_web_new_ctx( BzMatchContext * ctx, struct xyt_struct * gstruct )
+{
+BzGalleryWeb * web;
+int mfim;
+int i;
+
+mfim = bozorth_gallery_init_ctx( ctx, gstruct );
+
+/* Only the first mfim rows of the sorted pointer list are ever looked at by bz_match(), */
+/* so store just those, in sorted order. */
+web = bz_gallery_web_new( mfim );
+for ( i = 0; i < mfim; i++ )
+	memcpy( web->cols[i], ctx->fcolpt[i], sizeof( web->cols[i] ) );
+memcpy( web->dist, ctx->fdist, mfim * sizeof( short ) );
+memcpy( web->beta1, ctx->fbeta1, mfim * sizeof( short ) );
+memcpy( web->beta2, ctx->fbeta2, mfim * sizeof( short ) );
+
+return web;
+}
+
+/**************************************************************************/
+
+int bozorth_gallery_web_load_ctx( BzMatchContext * ctx, BzGalleryWeb * web )
+{
+int i;
+
+for ( i = 0; i < web->len; i++ )
+	ctx->fcolpt[i] = web->cols[i];
+ctx->fdist = web->dist;
+ctx->fbeta1 = web->beta1;
+ctx->fbeta2 = web->beta2;
+
+return web->len;
+}
+
+/**************************************************************************/
+
+int bozorth_to_gallery_web_ctx(
+		BzMatchContext * ctx,
+		int probe_len,
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct,
+		BzGalleryWeb * web
+		)
+{
+int np;
+int gallery_len;
+
+gallery_len = bozorth_gallery_web_load_ctx( ctx, web );
+np = bz_match( ctx, probe_len, gallery_len );
+return bz_match_score( ctx, np, pstruct, gstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_to_gallery_web_threshold_ctx(
+		BzMatchContext * ctx,
+		int probe_len,
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct,
+		BzGalleryWeb * web,
+		int threshold
+		)
+{
+int np;
+int gallery_len;
+
+gallery_len = bozorth_gallery_web_load_ctx( ctx, web );
+np = bz_match( ctx, probe_len, gallery_len );
+return bz_match_score_threshold( ctx, np, pstruct, gstruct, threshold );
+}
+
+/**************************************************************************/
+
+int bozorth_probe_init( struct xyt_struct * pstruct )
+{
+return bozorth_probe_init_ctx( bz_default_match_context(), pstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_gallery_init( struct xyt_struct * gstruct )
+{
+return bozorth_gallery_init_ctx( bz_default_match_context(), gstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_to_gallery(
+		int probe_len,
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct
+		)
+{
+return bozorth_to_gallery_ctx( bz_default_match_context(), probe_len, pstruct, gstruct );
 }
 
 /**************************************************************************/
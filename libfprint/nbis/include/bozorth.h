@@ -223,29 +223,67 @@ extern FILE *stderr;
 /**************************************************************************/
 /* In: BZ_GBLS.C */
 /**************************************************************************/
-/* Global arrays supporting "core" bozorth algorithm */
-extern int colp[ COLP_SIZE_1 ][ COLP_SIZE_2 ];
-extern int scols[ SCOLS_SIZE_1 ][ COLS_SIZE_2 ];
-extern int fcols[ FCOLS_SIZE_1 ][ COLS_SIZE_2 ];
-extern int * scolpt[ SCOLPT_SIZE ];
-extern int * fcolpt[ FCOLPT_SIZE ];
-extern int sc[ SC_SIZE ];
-extern int yl[ YL_SIZE_1 ][ YL_SIZE_2 ];
-/* Global arrays supporting "core" bozorth algorithm continued: */
-/*    Globals used significantly by sift() */
-extern int rq[ RQ_SIZE ];
-extern int tq[ TQ_SIZE ];
-extern int zz[ ZZ_SIZE ];
-extern int rx[ RX_SIZE ];
-extern int mm[ MM_SIZE ];
-extern int nn[ NN_SIZE ];
-extern int qq[ QQ_SIZE ];
-extern int rk[ RK_SIZE ];
-extern int cp[ CP_SIZE ];
-extern int rp[ RP_SIZE ];
-extern int rf[RF_SIZE_1][RF_SIZE_2];
-extern int cf[CF_SIZE_1][CF_SIZE_2];
-extern int bz_y[20000];
+/* Work buffers supporting the "core" bozorth algorithm. These used to be */
+/* process-wide globals; bundling them allows running several matches at  */
+/* once, each one using its own context. */
+typedef struct bz_match_context {
+	int colp[ COLP_SIZE_1 ][ COLP_SIZE_2 ];
+	int scols[ SCOLS_SIZE_1 ][ COLS_SIZE_2 ];
+	int fcols[ FCOLS_SIZE_1 ][ COLS_SIZE_2 ];
+	int * scolpt[ SCOLPT_SIZE ];
+	int * fcolpt[ FCOLPT_SIZE ];
+	/* Distance and beta columns of the rows in scolpt and fcolpt, in the */
+	/* same order, for the edge pair scan of bz_match(). They point into  */
+	/* skeys and fkeys below, or into a loaded Web. */
+	const short * sdist, * sbeta1, * sbeta2;
+	const short * fdist, * fbeta1, * fbeta2;
+	short skeys[ 3 ][ SCOLPT_SIZE ];
+	short fkeys[ 3 ][ FCOLPT_SIZE ];
+	/* Used by bz_comp() only, to sort scolpt or fcolpt */
+	int * colpt_scratch[ SCOLPT_SIZE > FCOLPT_SIZE ? SCOLPT_SIZE : FCOLPT_SIZE ];
+	int sc[ SC_SIZE ];
+	int yl[ YL_SIZE_1 ][ YL_SIZE_2 ];
+	/* Used significantly by sift() */
+	int rq[ RQ_SIZE ];
+	int tq[ TQ_SIZE ];
+	int zz[ ZZ_SIZE ];
+	int rx[ RX_SIZE ];
+	int mm[ MM_SIZE ];
+	int nn[ NN_SIZE ];
+	int qq[ QQ_SIZE ];
+	int rk[ RK_SIZE ];
+	int cp[ CP_SIZE ];
+	int rp[ RP_SIZE ];
+	int rf[ RF_SIZE_1 ][ RF_SIZE_2 ];
+	int cf[ CF_SIZE_1 ][ CF_SIZE_2 ];
+	int bz_y[ Y_SIZE ];
+	/* Used by bz_match() only */
+	int rot[ ROT_SIZE_1 ][ ROT_SIZE_2 ];
+	int * rtp[ ROT_SIZE_1 ];
+	/* Used between bz_match_score() & bz_final_loop() only */
+	int ct[ CT_SIZE ];
+	int gct[ GCT_SIZE ];
+	int ctt[ CTT_SIZE ];
+	int ctp[ CTP_SIZE_1 ][ CTP_SIZE_2 ];
+	int yy[ YY_SIZE_1 ][ YY_SIZE_2 ][ YY_SIZE_3 ];
+	int sct[ SCT_SIZE_1 ][ SCT_SIZE_2 ];
+} BzMatchContext;
+
+/* Pruned and sorted pointwise comparison table ("Web") of a gallery      */
+/* fingerprint as built by bozorth_gallery_init(). It only depends on the */
+/* gallery fingerprint, so it may be built once and reused for every      */
+/* match against it. The same table is used to keep the Web of a probe    */
+/* fingerprint built by bozorth_probe_init(). The distance and beta     */
+/* columns are also kept apart, see BzMatchContext. The rows and keys    */
+/* follow the structure unless it is a view onto data kept elsewhere,     */
+/* from bz_gallery_web_new_view(). Webs are never modified once built.    */
+typedef struct bz_gallery_web {
+	int len;
+	short * dist;
+	short * beta1;
+	short * beta2;
+	int ( * cols )[ COLS_SIZE_2 ];
+} BzGalleryWeb;
 
 /**************************************************************************/
 /**************************************************************************/
@@ -255,17 +293,44 @@ extern int bz_y[20000];
 extern int bozorth_probe_init( struct xyt_struct *);
 extern int bozorth_gallery_init( struct xyt_struct *);
 extern int bozorth_to_gallery(int, struct xyt_struct *, struct xyt_struct *);
+extern int bozorth_probe_init_ctx(BzMatchContext *, struct xyt_struct *);
+extern int bozorth_gallery_init_ctx(BzMatchContext *, struct xyt_struct *);
+extern int bozorth_to_gallery_ctx(BzMatchContext *, int, struct xyt_struct *,
+                    struct xyt_struct *);
+extern BzGalleryWeb *bozorth_probe_web_new_ctx(BzMatchContext *,
+                    struct xyt_struct *);
+extern int bozorth_probe_web_load_ctx(BzMatchContext *, BzGalleryWeb *);
+extern BzGalleryWeb *bozorth_gallery_web_new_ctx(BzMatchContext *,
+                    struct xyt_struct *);
+extern int bozorth_gallery_web_load_ctx(BzMatchContext *, BzGalleryWeb *);
+extern int bozorth_to_gallery_web_ctx(BzMatchContext *, int,
+                    struct xyt_struct *, struct xyt_struct *, BzGalleryWeb *);
+extern int bozorth_to_gallery_web_threshold_ctx(BzMatchContext *, int,
+                    struct xyt_struct *, struct xyt_struct *, BzGalleryWeb *,
+                    int);
 extern int bozorth_main(struct xyt_struct *, struct xyt_struct *);
 /* In: BOZORTH3.C */
 extern void bz_comp(int, int [], int [], int [], int *, int [][COLS_SIZE_2],
-                    int *[]);
+                    int *[], int *[]);
 extern void bz_find(int *, int *[]);
-extern int bz_match(int, int);
-extern int bz_match_score(int, struct xyt_struct *, struct xyt_struct *);
-extern void bz_sift(int *, int, int *, int, int, int, int *, int *);
+extern int bz_match(BzMatchContext *, int, int);
+extern int bz_match_score(BzMatchContext *, int, struct xyt_struct *,
+                    struct xyt_struct *);
+extern int bz_match_score_threshold(BzMatchContext *, int,
+                    struct xyt_struct *, struct xyt_struct *, int);
+extern void bz_sift(BzMatchContext *, int *, int, int *, int, int, int, int *,
+                    int *);
 /* In: BZ_ALLOC.C */
 extern char *malloc_or_exit(int, const char *);
 extern char *malloc_or_return_error(int, const char *);
+extern BzMatchContext *bz_match_context_new(void);
+extern void bz_match_context_free(BzMatchContext *);
+extern BzGalleryWeb *bz_gallery_web_new(int);
+extern BzGalleryWeb *bz_gallery_web_new_view(int, const int [][COLS_SIZE_2],
+                    const short *, const short *, const short *);
+extern void bz_gallery_web_free(BzGalleryWeb *);
+/* In: BZ_GBLS.C */
+extern BzMatchContext *bz_default_match_context(void);
 /* In: BZ_IO.C */
 extern int parse_line_range(const char *, int *, int *);
 extern void set_progname(int, char *, pid_t);
@@ -138,4 +138,7 @@ rp[x] == ctp[][x] :: sct[x][]
 #define CP_SIZE 20000
 #define RP_SIZE 20000
 
+#define ROT_SIZE_1 20000
+#define ROT_SIZE_2 5
+
 #endif /* !_BZ_ARRAY_H */
@@ -145,6 +145,45 @@ typedef struct rotgrids{
    int **grids;
 } ROTGRIDS;
 
+/* Lookup tables used by LFS Version 2 that only depend on the LFS  */
+/* parameters and the image dimensions.  They are built once and    */
+/* may then be shared (read-only) by any number of detections on    */
+/* images of the same size, including concurrent ones.              */
+typedef struct lfsdetector{
+   int iw;
+   int ih;
+   int maxpad;
+   DIR2RAD *dir2rad;
+   DFTWAVES *dftwaves;
+   ROTGRIDS *dftgrids;
+   ROTGRIDS *dirbingrids;
+} LFSDETECTOR;
+
+/* Scratch memory of a single detection.  Temporary lists (such as     */
+/* contours) are carved out of large chunks instead of being allocated */
+/* one by one on the heap.  Allocations are released in reverse order  */
+/* as soon as everything above them has been freed, and the chunks are */
+/* all returned to the heap at the end of the detection.               */
+#define LFS_ARENA_CHUNK_SIZE   (64 * 1024)
+
+typedef struct lfsarenablock{
+   struct lfsarenablock *prev;
+   struct lfsarenachunk *chunk;
+   int freed;
+} LFSARENABLOCK;
+
+typedef struct lfsarenachunk{
+   struct lfsarenachunk *prev;
+   struct lfsarenachunk *next;
+   size_t size;
+   size_t used;
+} LFSARENACHUNK;
+
+typedef struct lfsarena{
+   LFSARENACHUNK *chunk;
+   LFSARENABLOCK *top;
+} LFSARENA;
+
 /*************************************************************************/
 /* 10, 2X3 pixel pair feature patterns used to define ridge endings      */
 /* and bifurcations.                                                     */
@@ -264,8 +303,19 @@ typedef struct g_lfsparms{
    /* Ridge Counting Controls */
    int    max_nbrs;
    int    max_ridge_steps;
+
+   /* Cancellation, checked between the detection stages if set */
+   int    (*cancelled)(void *);
+   void   *cancel_data;
+
+   /* Maximum number of threads the block analysis is spread over, 0 for */
+   /* the number of processors.  1 analyzes all blocks inline.          */
+   int    max_threads;
 } LFSPARMS;
 
+/* Return code of a detection abandoned through LFSPARMS.cancelled */
+#define LFS_CANCELLED          -590
+
 /*************************************************************************/
 /*        LFS CONSTANT DEFINITIONS                                       */
 /*************************************************************************/
@@ -781,6 +831,11 @@ extern int lfs_detect_minutiae_V2(MINUTIAE **,
                      unsigned char **, int *, int *,
                      unsigned char *, const int, const int,
                      const LFSPARMS *);
+extern int lfs_detect_minutiae_V2_ctx(MINUTIAE **,
+                     int **, int **, int **, int **, int *, int *,
+                     unsigned char **, int *, int *,
+                     unsigned char *, const int, const int,
+                     const LFSPARMS *, const LFSDETECTOR *);
 
 /* dft.c */
 extern int dft_dir_powers(double **, unsigned char *, const int,
@@ -799,6 +854,7 @@ extern void free_dir2rad(DIR2RAD *);
 extern void free_dftwaves(DFTWAVES *);
 extern void free_rotgrids(ROTGRIDS *);
 extern void free_dir_powers(double **, const int);
+extern void free_lfsdetector(LFSDETECTOR *);
 
 /* getmin.c */
 extern int get_minutiae(MINUTIAE **, int **, int **, int **,
@@ -806,6 +862,12 @@ extern int get_minutiae(MINUTIAE **, int **, int **, int **,
                  unsigned char **, int *, int *, int *,
                  unsigned char *, const int, const int,
                  const int, const double, const LFSPARMS *);
+extern int get_minutiae_ctx(MINUTIAE **, int **, int **, int **,
+                 int **, int **, int *, int *,
+                 unsigned char **, int *, int *, int *,
+                 unsigned char *, const int, const int,
+                 const int, const double, const LFSPARMS *,
+                 const LFSDETECTOR *);
 
 /* imgutil.c */
 extern void bits_6to8(unsigned char *, const int, const int);
@@ -815,7 +877,12 @@ extern void gray2bin(const int, const int, const int,
 extern int pad_uchar_image(unsigned char **, int *, int *,
                      unsigned char *, const int, const int, const int,
                      const int);
+extern int pad_uchar_image_8to6(unsigned char **, int *, int *,
+                     unsigned char *, const int, const int, const int,
+                     const int);
 extern void fill_holes(unsigned char *, const int, const int);
+extern void fill_binary_holes(unsigned char *, const int, const int,
+                     const int);
 extern int free_path(const int, const int, const int, const int,
                      unsigned char *, const int, const int, const LFSPARMS *);
 extern int search_in_direction(int *, int *, int *, int *, const int,
@@ -829,6 +896,8 @@ extern int get_max_padding(const int, const int, const int, const int);
 extern int get_max_padding_V2(const int, const int, const int, const int);
 extern int init_rotgrids(ROTGRIDS **, const int, const int, const int,
                      const double, const int, const int, const int, const int);
+extern int init_lfsdetector(LFSDETECTOR **, const int, const int,
+                     const LFSPARMS *);
 extern int alloc_dir_powers(double ***, const int, const int);
 extern int alloc_power_stats(int **, double **, int **, double **, const int);
 
@@ -840,6 +909,8 @@ extern int is_qmap_empty(int *, const int, const int);
 /* line.c */
 extern int line_points(int **, int **, int *,
                      const int, const int, const int, const int);
+extern int line_points_buf(int *, int *, const int, int *,
+                     const int, const int, const int, const int);
 extern int bresenham_line_points(int **, int **, int *,
                      const int, const int, const int, const int);
 
@@ -1200,6 +1271,11 @@ extern double angle2line(const int, const int, const int, const int);
 extern int line2direction(const int, const int, const int, const int,
                      const int);
 extern int closest_dir_dist(const int, const int, const int);
+extern void init_lfsarena(LFSARENA *);
+extern void free_lfsarena(LFSARENA *);
+extern LFSARENA *set_lfsarena(LFSARENA *);
+extern void *lfs_arena_alloc(const size_t);
+extern void lfs_arena_free(void *);
 
 /* xytreps.c */
 extern void lfs2nist_minutia_XYT(int *, int *, int *,
@@ -1210,12 +1286,14 @@ extern void lfs2nist_format(MINUTIAE *, int, int);
 /*************************************************************************/
 /*        EXTERNAL GLOBAL VARIABLE DEFINITIONS                           */
 /*************************************************************************/
-extern double g_dft_coefs[];
-extern LFSPARMS g_lfsparms;
-extern LFSPARMS g_lfsparms_V2;
-extern int g_nbr8_dx[];
-extern int g_nbr8_dy[];
-extern int g_chaincodes_nbr8[];
-extern FEATURE_PATTERN g_feature_patterns[];
+extern const double g_dft_coefs[];
+extern const LFSPARMS g_lfsparms;
+extern const LFSPARMS g_lfsparms_V2;
+extern const DIR2RAD g_dir2rad_V2;
+extern const DFTWAVES g_dftwaves_V2;
+extern const int g_nbr8_dx[];
+extern const int g_nbr8_dy[];
+extern const int g_chaincodes_nbr8[];
+extern const FEATURE_PATTERN g_feature_patterns[];
 
 #endif
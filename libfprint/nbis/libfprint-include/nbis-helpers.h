@@ -19,6 +19,14 @@
 
 #include <glib.h>
 
+/* Kernels that are specialized on the default parameters are called with
+ * constant dimensions, which only helps if they are inlined. */
+#if defined(__GNUC__) || defined(__clang__)
+#define NBIS_ALWAYS_INLINE inline __attribute__((__always_inline__))
+#else
+#define NBIS_ALWAYS_INLINE inline
+#endif
+
 #define ASSERT_SIZE_MUL(a,b)					\
 	{							\
 		gsize dest;					\
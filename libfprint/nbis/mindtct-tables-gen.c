@@ -0,0 +1,179 @@
+/*
+ * mindtct lookup table generator
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Run at build time to compute the tables of init_dir2rad() and
+ * init_dftwaves() for the default LFS parameters, so that mindtct does not
+ * need to compute them when the first detector is set up. The computation
+ * must stay the same as in init.c. This runs on the build machine, so it
+ * must not depend on GLib (and with it lfs.h). The output is included by
+ * init.c after lfs.h, which defines DFTWAVE.
+ *
+ * Usage: mindtct_tables_gen OUTPUT NDIRS BLOCKSIZE DFT_COEF...
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* As TRUNC_SCALE and trunc_dbl_precision() in lfs.h */
+#define TRUNC_SCALE 16384.0
+#define trunc_dbl_precision(x, scale) ((double) (((x) < 0.0) \
+                                                 ? ((int) (((x) * (scale)) - 0.5)) / (scale) \
+                                                 : ((int) (((x) * (scale)) + 0.5)) / (scale)))
+
+static void
+die (const char *msg)
+{
+  fprintf (stderr, "mindtct_tables_gen: %s\n", msg);
+  exit (1);
+}
+
+static int
+parse_int (const char *str)
+{
+  char *end;
+  long res = strtol (str, &end, 10);
+
+  if (*end != '\0' || res <= 0 || res > 1024)
+    die ("invalid size");
+
+  return res;
+}
+
+/* Hex floats, so that the values are exactly the ones computed here */
+static void
+write_doubles (FILE *out, const double *values, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    fprintf (out, "%s%a,", i % 4 == 0 ? "\n    " : " ", values[i]);
+  fprintf (out, "\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  FILE *out;
+  double *cs, *sn;
+  double *coefs;
+  double pi_factor;
+  int ndirs, blocksize, nwaves;
+  int i, j;
+
+  if (argc < 5)
+    die ("usage: mindtct_tables_gen OUTPUT NDIRS BLOCKSIZE DFT_COEF...");
+
+  ndirs = parse_int (argv[2]);
+  blocksize = parse_int (argv[3]);
+  nwaves = argc - 4;
+
+  cs = calloc (ndirs > blocksize ? ndirs : blocksize, sizeof (double));
+  sn = calloc (ndirs > blocksize ? ndirs : blocksize, sizeof (double));
+  coefs = calloc (nwaves, sizeof (double));
+  if (!cs || !sn || !coefs)
+    die ("out of memory");
+
+  for (i = 0; i < nwaves; i++)
+    coefs[i] = parse_int (argv[4 + i]);
+
+  out = fopen (argv[1], "w");
+  if (!out)
+    die ("cannot open output file");
+
+  fprintf (out, "/* Generated by mindtct_tables_gen, do not edit */\n\n");
+  fprintf (out, "#define MINDTCT_TABLES_NDIRS %d\n", ndirs);
+  fprintf (out, "#define MINDTCT_TABLES_NWAVES %d\n", nwaves);
+  fprintf (out, "#define MINDTCT_TABLES_WAVELEN %d\n\n", blocksize);
+
+  fprintf (out, "static const double mindtct_dft_coefs[%d] = {", nwaves);
+  write_doubles (out, coefs, nwaves);
+  fprintf (out, "};\n\n");
+
+  /* init_dir2rad () */
+  pi_factor = 2.0 * M_PI / (double) ndirs;
+  for (i = 0; i < ndirs; i++)
+    {
+      double theta = (double) (i * pi_factor);
+
+      cs[i] = trunc_dbl_precision (cos (theta), TRUNC_SCALE);
+      sn[i] = trunc_dbl_precision (sin (theta), TRUNC_SCALE);
+    }
+
+  fprintf (out, "static const double mindtct_dir2rad_cos[%d] = {", ndirs);
+  write_doubles (out, cs, ndirs);
+  fprintf (out, "};\n\n");
+  fprintf (out, "static const double mindtct_dir2rad_sin[%d] = {", ndirs);
+  write_doubles (out, sn, ndirs);
+  fprintf (out, "};\n\n");
+
+  /* init_dftwaves () */
+  pi_factor = 2.0 * M_PI / (double) blocksize;
+  fprintf (out, "static const double mindtct_dftwaves_cos[%d][%d] = {\n", nwaves, blocksize);
+  for (i = 0; i < nwaves; i++)
+    {
+      double freq = pi_factor * coefs[i];
+
+      for (j = 0; j < blocksize; j++)
+        cs[j] = cos (freq * (double) j);
+
+      fprintf (out, "  {");
+      write_doubles (out, cs, blocksize);
+      fprintf (out, "  },\n");
+    }
+  fprintf (out, "};\n\n");
+
+  fprintf (out, "static const double mindtct_dftwaves_sin[%d][%d] = {\n", nwaves, blocksize);
+  for (i = 0; i < nwaves; i++)
+    {
+      double freq = pi_factor * coefs[i];
+
+      for (j = 0; j < blocksize; j++)
+        sn[j] = sin (freq * (double) j);
+
+      fprintf (out, "  {");
+      write_doubles (out, sn, blocksize);
+      fprintf (out, "  },\n");
+    }
+  fprintf (out, "};\n\n");
+
+  /* The DFTWAVE structures pointing to them, see lfs.h */
+  fprintf (out, "static const DFTWAVE mindtct_dftwaves[%d] = {\n", nwaves);
+  for (i = 0; i < nwaves; i++)
+    fprintf (out, "  { (double *) mindtct_dftwaves_cos[%d], (double *) mindtct_dftwaves_sin[%d] },\n", i, i);
+  fprintf (out, "};\n\n");
+
+  fprintf (out, "static DFTWAVE *const mindtct_dftwaves_list[%d] = {\n", nwaves);
+  for (i = 0; i < nwaves; i++)
+    fprintf (out, "  (DFTWAVE *) &mindtct_dftwaves[%d],\n", i);
+  fprintf (out, "};\n");
+
+  if (fclose (out) != 0)
+    die ("cannot write output file");
+
+  free (cs);
+  free (sn);
+  free (coefs);
+
+  return 0;
+}
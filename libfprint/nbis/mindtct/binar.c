@@ -61,14 +61,75 @@ of the software.
                         binarize_V2()
 			binarize_image()
 			binarize_image_V2()
+                        binarize_run()
                         dirbinarize()
+                        dirbinarize_n()
+                        dirbinarize8()
                         isobinarize()
 
 ***********************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 #include <lfs.h>
 
+#if defined(__SSE2__) && !defined(NBIS_NO_SIMD)
+#define DIRBINARIZE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* The grid dimensions and center row of the directional binarization */
+/* with the default parameters.  binarize_image_V2() runs a copy of   */
+/* the kernels with these constants, which the compiler can unroll.   */
+/* The center row matches the one computed in dirbinarize() as        */
+/* DIRBIN_GRID_H is odd.                                              */
+#define DIRBIN_GRID_CY_V2   ((DIRBIN_GRID_H-1)/2)
+
+/*************************************************************************
+**************************************************************************
+#cat: dirbinarize_n - Inline body of dirbinarize, for a grid of the
+#cat:               given dimensions and center row.
+**************************************************************************/
+static NBIS_ALWAYS_INLINE int dirbinarize_n(const unsigned char *pptr,
+                const int *grid, const int grid_w, const int grid_h,
+                const int cy)
+{
+   int gx, gy, gi;
+   int rsum, gsum, csum = 0;
+
+   /* Initialize grid's pixel offset index to zero. */
+   gi = 0;
+   /* Initialize grid's pixel accumulator to zero */
+   gsum = 0;
+
+   /* Foreach row in grid ... */
+   for(gy = 0; gy < grid_h; gy++){
+      /* Initialize row pixel sum to zero. */
+      rsum = 0;
+      /* Foreach column in grid ... */
+      for(gx = 0; gx < grid_w; gx++){
+         /* Accumulate next pixel along rotated row in grid. */
+         rsum += *(pptr+grid[gi]);
+         /* Bump grid's pixel offset index. */
+         gi++;
+      }
+      /* Accumulate row sum into grid pixel sum. */
+      gsum += rsum;
+      /* If current row is center row, then save row sum separately. */
+      if(gy == cy)
+         csum = rsum;
+   }
+
+   /* If the center row sum treated as an average is less than the */
+   /* total pixel sum in the rotated grid ...                      */
+   if((csum * grid_h) < gsum)
+      /* Set the binary pixel to BLACK. */
+      return(BLACK_PIXEL);
+   else
+      /* Otherwise set the binary pixel to WHITE. */
+      return(WHITE_PIXEL);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: binarize - Takes a padded grayscale input image and its associated ridge
@@ -129,7 +190,7 @@ int binarize_V2(unsigned char **odata, int *ow, int *oh,
           const ROTGRIDS *dirbingrids, const LFSPARMS *lfsparms)
 {
    unsigned char *bdata;
-   int i, bw, bh, ret; /* return code */
+   int bw, bh, ret; /* return code */
 
    /* 1. Binarize the padded input image using directional block info. */
    if((ret = binarize_image_V2(&bdata, &bw, &bh, pdata, pw, ph,
@@ -140,8 +201,7 @@ int binarize_V2(unsigned char **odata, int *ow, int *oh,
 
    /* 2. Fill black and white holes in binary image. */
    /* LFS scans the binary image, filling holes, 3 times. */
-   for(i = 0; i < lfsparms->num_fill_holes; i++)
-      fill_holes(bdata, bw, bh);
+   fill_binary_holes(bdata, bw, bh, lfsparms->num_fill_holes);
 
    /* Return binarized input image. */
    *odata = bdata;
@@ -176,6 +236,97 @@ int binarize_V2(unsigned char **odata, int *ow, int *oh,
       Negative - system error
 **************************************************************************/
 
+#ifdef DIRBINARIZE_SSE2
+/*************************************************************************
+**************************************************************************
+#cat: dirbinarize8 - Determines the binary values of eight consecutive
+#cat:               grayscale pixels sharing the same VALID IMAP ridge
+#cat:               flow direction, one per SSE2 lane.  Each lane sums
+#cat:               the same pixels as dirbinarize, so the results are
+#cat:               identical as long as the grid sums fit in 16 bits.
+
+   CAUTION: The image to which the input pixels point must be appropriately
+            padded to account for the radius of the rotated grid.
+
+   Input:
+      pptr        - pointer to the first of the grayscale pixels
+      grid        - the rotated grid offsets of the pixels' direction
+      grid_w      - width of the grid
+      grid_h      - height of the grid
+      cy          - center (0-oriented) row in the grid
+   Output:
+      bptr        - the eight binary pixels
+**************************************************************************/
+static NBIS_ALWAYS_INLINE void dirbinarize8(unsigned char *bptr,
+                         const unsigned char *pptr, const int *grid,
+                         const int grid_w, const int grid_h, const int cy)
+{
+   int gx, gy, gi;
+   __m128i zero, pix, rsum, gsum, csum, black;
+
+   zero = _mm_setzero_si128();
+   gsum = zero;
+   csum = zero;
+   gi = 0;
+
+   /* Foreach row in grid ... */
+   for(gy = 0; gy < grid_h; gy++){
+      rsum = zero;
+      /* Accumulate the rotated row of each of the eight pixels. */
+      for(gx = 0; gx < grid_w; gx++){
+         pix = _mm_loadl_epi64((const __m128i *)(pptr+grid[gi]));
+         rsum = _mm_add_epi16(rsum, _mm_unpacklo_epi8(pix, zero));
+         gi++;
+      }
+      gsum = _mm_add_epi16(gsum, rsum);
+      if(gy == cy)
+         csum = rsum;
+   }
+
+   /* BLACK where the center row sum treated as an average is less */
+   /* than the total pixel sum, otherwise WHITE.                   */
+   black = _mm_cmplt_epi16(_mm_mullo_epi16(csum,
+                              _mm_set1_epi16(grid_h)), gsum);
+   pix = _mm_or_si128(_mm_and_si128(black, _mm_set1_epi16(BLACK_PIXEL)),
+                      _mm_andnot_si128(black, _mm_set1_epi16(WHITE_PIXEL)));
+   _mm_storel_epi64((__m128i *)bptr, _mm_packus_epi16(pix, pix));
+}
+#endif
+
+/*************************************************************************
+**************************************************************************
+#cat: binarize_run - Binarizes a run of consecutive pixels that share the
+#cat:               same VALID IMAP ridge flow direction, eight pixels at
+#cat:               a time if possible.
+
+   Input:
+      pptr        - pointer to the first of the grayscale pixels
+      run         - the number of pixels
+      grid        - the rotated grid offsets of the pixels' direction
+      grid_w      - width of the grid
+      grid_h      - height of the grid
+      cy          - center (0-oriented) row in the grid
+      use_sse2    - whether the grid sums fit the SSE2 kernel
+   Output:
+      bptr        - the binary pixels
+**************************************************************************/
+static NBIS_ALWAYS_INLINE void binarize_run(unsigned char *bptr,
+                         const unsigned char *pptr, const int run,
+                         const int *grid, const int grid_w,
+                         const int grid_h, const int cy, const int use_sse2)
+{
+   int bx = 0;
+
+#ifdef DIRBINARIZE_SSE2
+   if(use_sse2){
+      for(; bx + 8 <= run; bx += 8)
+         dirbinarize8(bptr + bx, pptr + bx, grid, grid_w, grid_h, cy);
+   }
+#endif
+   for(; bx < run; bx++)
+      bptr[bx] = dirbinarize_n(pptr + bx, grid, grid_w, grid_h, cy);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: binarize_image_V2 - Takes a grayscale input image and its associated
@@ -206,9 +357,23 @@ int binarize_image_V2(unsigned char **odata, int *ow, int *oh,
                    const int *direction_map, const int mw, const int mh,
                    const int blocksize, const ROTGRIDS *dirbingrids)
 {
-   int ix, iy, bw, bh, bx, by, mapval;
+   int ix, iy, bw, bh, bx, by, mapval, run;
    unsigned char *bdata, *bptr;
    unsigned char *pptr, *spptr;
+   int cy, use_sse2, fixed;
+   double dcy;
+
+   /* The center row of the grids, computed as in dirbinarize(). */
+   dcy = (dirbingrids->grid_h-1)/(double)2.0;
+   dcy = trunc_dbl_precision(dcy, TRUNC_SCALE);
+   cy = sround(dcy);
+   /* The SSE2 kernel sums in 16 bits, so the grid sums must fit. */
+   use_sse2 = (dirbingrids->grid_w * dirbingrids->grid_h * WHITE_PIXEL
+               <= 0x7fff);
+   /* The default grids use the specialized copy of the kernels. */
+   fixed = (dirbingrids->grid_w == DIRBIN_GRID_W &&
+            dirbingrids->grid_h == DIRBIN_GRID_H &&
+            cy == DIRBIN_GRID_CY_V2);
 
    /* Compute dimensions of "unpadded" binary image results. */
    bw = pw - (dirbingrids->pad<<1);
@@ -221,25 +386,39 @@ int binarize_image_V2(unsigned char **odata, int *ow, int *oh,
    for(iy = 0; iy < bh; iy++){
       /* Set pixel pointer to start of next row in grid. */
       pptr = spptr;
-      for(ix = 0; ix < bw; ix++){
-
-         /* Compute which block the current pixel is in. */
+      by = (int)(iy/blocksize);
+      /* Foreach run of consecutive blocks along the row that share */
+      /* the same direction ...                                     */
+      for(ix = 0; ix < bw; ix += run){
          bx = (int)(ix/blocksize);
-         by = (int)(iy/blocksize);
          /* Get corresponding value in Direction Map. */
          mapval = *(direction_map + (by*mw) + bx);
-         /* If current block has has INVALID direction ... */
-         if(mapval == INVALID_DIR)
-            /* Set binary pixel to white (255). */
-            *bptr = WHITE_PIXEL;
-         /* Otherwise, if block has a valid direction ... */
-         else /*if(mapval >= 0)*/
-            /* Use directional binarization based on block's direction. */
-            *bptr = dirbinarize(pptr, mapval, dirbingrids);
-
+         for(bx++; bx < mw && (bx*blocksize) < bw &&
+                   *(direction_map + (by*mw) + bx) == mapval; bx++);
+         run = min(bx*blocksize, bw) - ix;
+
+         /* If the blocks have INVALID direction ... */
+         if(mapval == INVALID_DIR){
+            /* Set binary pixels to white (255). */
+            memset(bptr, WHITE_PIXEL, run);
+            pptr += run;
+            bptr += run;
+            continue;
+         }
+
+         /* Otherwise, use directional binarization based on the */
+         /* blocks' direction.                                    */
+         if(fixed)
+            binarize_run(bptr, pptr, run, dirbingrids->grids[mapval],
+                         DIRBIN_GRID_W, DIRBIN_GRID_H, DIRBIN_GRID_CY_V2,
+                         use_sse2);
+         else
+            binarize_run(bptr, pptr, run, dirbingrids->grids[mapval],
+                         dirbingrids->grid_w, dirbingrids->grid_h, cy,
+                         use_sse2);
          /* Bump input and output pixel pointers. */
-         pptr++;
-         bptr++;
+         pptr += run;
+         bptr += run;
       }
       /* Bump pointer to the next row in padded input image. */
       spptr += pw;
@@ -272,50 +451,18 @@ int binarize_image_V2(unsigned char **odata, int *ow, int *oh,
 int dirbinarize(const unsigned char *pptr, const int idir,
                 const ROTGRIDS *dirbingrids)
 {
-   int gx, gy, gi, cy;
-   int rsum, gsum, csum = 0;
-   int *grid;
+   int cy;
    double dcy;
 
-   /* Assign nickname pointer. */
-   grid = dirbingrids->grids[idir];
    /* Calculate center (0-oriented) row in grid. */
    dcy = (dirbingrids->grid_h-1)/(double)2.0;
    /* Need to truncate precision so that answers are consistent */
    /* on different computer architectures when rounding doubles. */
    dcy = trunc_dbl_precision(dcy, TRUNC_SCALE);
    cy = sround(dcy);
-   /* Initialize grid's pixel offset index to zero. */
-   gi = 0;
-   /* Initialize grid's pixel accumulator to zero */
-   gsum = 0;
-
-   /* Foreach row in grid ... */
-   for(gy = 0; gy < dirbingrids->grid_h; gy++){
-      /* Initialize row pixel sum to zero. */
-      rsum = 0;
-      /* Foreach column in grid ... */
-      for(gx = 0; gx < dirbingrids->grid_w; gx++){
-         /* Accumulate next pixel along rotated row in grid. */
-         rsum += *(pptr+grid[gi]);
-         /* Bump grid's pixel offset index. */
-         gi++;
-      }
-      /* Accumulate row sum into grid pixel sum. */
-      gsum += rsum;
-      /* If current row is center row, then save row sum separately. */
-      if(gy == cy)
-         csum = rsum;
-   }
 
-   /* If the center row sum treated as an average is less than the */
-   /* total pixel sum in the rotated grid ...                      */
-   if((csum * dirbingrids->grid_h) < gsum)
-      /* Set the binary pixel to BLACK. */
-      return(BLACK_PIXEL);
-   else
-      /* Otherwise set the binary pixel to WHITE. */
-      return(WHITE_PIXEL);
+   return(dirbinarize_n(pptr, dirbingrids->grids[idir],
+                        dirbingrids->grid_w, dirbingrids->grid_h, cy));
 }
 
 /*************************************************************************
@@ -58,6 +58,7 @@ of the software.
 ***********************************************************************
                ROUTINES:
                         block_offsets()
+                        block_histogram_n()
                         low_contrast_block()
                         find_valid_block()
                         set_margin_blocks()
@@ -195,6 +196,34 @@ int block_offsets(int **optr, int *ow, int *oh,
    return(0);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: block_histogram_n - Accumulates the pixel intensities of a square
+#cat:             image block into a histogram.  low_contrast_block()
+#cat:             calls it with a constant block size for the windows of
+#cat:             the default parameters, so that the compiler can unroll
+#cat:             the rows.
+
+   Input:
+      sptr      - pointer to the origin of the block in the padded image
+      pw        - width (in pixels) of the padded input image
+      blocksize - dimension (in pixels) of the width and height of the block
+   Output:
+      pixtable  - the histogram, which must be zeroed by the caller
+**************************************************************************/
+static NBIS_ALWAYS_INLINE void block_histogram_n(int *pixtable,
+                       const unsigned char *sptr, const int pw,
+                       const int blocksize)
+{
+   int px, py;
+
+   for(py = 0; py < blocksize; py++){
+      for(px = 0; px < blocksize; px++)
+         pixtable[sptr[px]]++;
+      sptr += pw;
+   }
+}
+
 /*************************************************************************
 #cat: low_contrast_block - Takes the offset to an image block of specified
 #cat:             dimension, and analyzes the pixel intensities in the block
@@ -221,8 +250,7 @@ int low_contrast_block(const int blkoffset, const int blocksize,
                        const LFSPARMS *lfsparms)
 {
    int pixtable[IMG_6BIT_PIX_LIMIT], numpix;
-   int px, py, pi;
-   unsigned char *sptr, *pptr;
+   int pi;
    int delta;
    double tdbl;
    int prctmin = 0, prctmax = 0, prctthresh;
@@ -235,15 +263,10 @@ int low_contrast_block(const int blkoffset, const int blocksize,
    tdbl = trunc_dbl_precision(tdbl, TRUNC_SCALE);
    prctthresh = sround(tdbl);
 
-   sptr = pdata+blkoffset;
-   for(py = 0; py < blocksize; py++){
-      pptr = sptr;
-      for(px = 0; px < blocksize; px++){
-         pixtable[*pptr]++;
-         pptr++;
-      }
-      sptr += pw;
-   }
+   if(blocksize == MAP_WINDOWSIZE_V2)
+      block_histogram_n(pixtable, pdata+blkoffset, pw, MAP_WINDOWSIZE_V2);
+   else
+      block_histogram_n(pixtable, pdata+blkoffset, pw, blocksize);
 
    pi = 0;
    pixsum = 0;
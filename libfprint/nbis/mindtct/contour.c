@@ -107,19 +107,14 @@ int allocate_contour(int **ocontour_x, int **ocontour_y,
 {
    int *contour_x, *contour_y, *contour_ex, *contour_ey;
 
-   ASSERT_SIZE_MUL(ncontour, sizeof(int));
+   ASSERT_SIZE_MUL(ncontour, 4 * sizeof(int));
 
-   /* Allocate contour's x-coord list. */
-   contour_x = (int *)g_malloc(ncontour * sizeof(int));
-
-   /* Allocate contour's y-coord list. */
-   contour_y = (int *)g_malloc(ncontour * sizeof(int));
-
-   /* Allocate contour's edge x-coord list. */
-   contour_ex = (int *)g_malloc(ncontour * sizeof(int));
-
-   /* Allocate contour's edge y-coord list. */
-   contour_ey = (int *)g_malloc(ncontour * sizeof(int));
+   /* Allocate all four lists in one piece from the detection's arena. */
+   /* The x-coord list marks the start of the piece.                   */
+   contour_x = (int *)lfs_arena_alloc(ncontour * 4 * sizeof(int));
+   contour_y = contour_x + ncontour;
+   contour_ex = contour_y + ncontour;
+   contour_ey = contour_ex + ncontour;
 
    /* Otherwise, allocations successful, so assign output pointers. */
    *ocontour_x = contour_x;
@@ -152,10 +147,8 @@ int allocate_contour(int **ocontour_x, int **ocontour_y,
 void free_contour(int *contour_x, int *contour_y,
                   int *contour_ex, int *contour_ey)
 {
-   g_free(contour_x);
-   g_free(contour_y);
-   g_free(contour_ex);
-   g_free(contour_ey);
+   /* All lists were allocated in one piece by allocate_contour(). */
+   lfs_arena_free(contour_x);
 }
 
 /*************************************************************************
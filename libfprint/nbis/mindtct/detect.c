@@ -58,6 +58,7 @@ of the software.
                ROUTINES:
                         lfs_detect_minutiae()
                         lfs_detect_minutiae_V2()
+                        lfs_detect_minutiae_V2_ctx()
 
 ***********************************************************************/
 
@@ -138,17 +139,62 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
                         unsigned char **obdata, int *obw, int *obh,
                         unsigned char *idata, const int iw, const int ih,
                         const LFSPARMS *lfsparms)
+{
+   LFSDETECTOR *detector;
+   int ret;
+
+   /* Build the lookup tables for this image only. */
+   if((ret = init_lfsdetector(&detector, iw, ih, lfsparms)))
+      return(ret);
+
+   ret = lfs_detect_minutiae_V2_ctx(ominutiae, odmap, olcmap, olfmap, ohcmap,
+                                    omw, omh, obdata, obw, obh,
+                                    idata, iw, ih, lfsparms, detector);
+
+   free_lfsdetector(detector);
+   return(ret);
+}
+
+/*************************************************************************
+#cat: lfs_detect_minutiae_V2_ctx - Same as lfs_detect_minutiae_V2, but uses
+#cat:          lookup tables that were previously built by init_lfsdetector
+#cat:          for images of the same dimensions and the same LFS
+#cat:          parameters.  The tables are only read, so one detector may
+#cat:          be shared by concurrent detections.
+
+   Input:
+      idata     - input 8-bit grayscale fingerprint image data
+      iw        - width (in pixels) of the image
+      ih        - height (in pixels) of the image
+      lfsparms  - parameters and thresholds for controlling LFS
+      detector  - lookup tables built by init_lfsdetector
+   Output:
+      see lfs_detect_minutiae_V2
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int lfs_cancelled(const LFSPARMS *lfsparms)
+{
+   return((lfsparms->cancelled != NULL) &&
+          lfsparms->cancelled(lfsparms->cancel_data));
+}
+
+int lfs_detect_minutiae_V2_ctx(MINUTIAE **ominutiae,
+                        int **odmap, int **olcmap, int **olfmap, int **ohcmap,
+                        int *omw, int *omh,
+                        unsigned char **obdata, int *obw, int *obh,
+                        unsigned char *idata, const int iw, const int ih,
+                        const LFSPARMS *lfsparms, const LFSDETECTOR *detector)
 {
    unsigned char *pdata, *bdata;
    int pw, ph, bw, bh;
-   DIR2RAD *dir2rad;
-   DFTWAVES *dftwaves;
-   ROTGRIDS *dftgrids;
-   ROTGRIDS *dirbingrids;
    int *direction_map, *low_contrast_map, *low_flow_map, *high_curve_map;
    int mw, mh;
    int ret, maxpad;
    MINUTIAE *minutiae;
+   LFSARENA arena;
+   LFSARENA *prev_arena;
 
    set_timer(total_timer);
 
@@ -156,70 +202,32 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    /* INITIALIZATION */
    /******************/
 
+   /* The lookup tables must have been built for this image size. */
+   if((detector->iw != iw) || (detector->ih != ih)){
+      fprintf(stderr, "ERROR : lfs_detect_minutiae_V2_ctx : ");
+      fprintf(stderr, "detector built for %d x %d, image is %d x %d\n",
+              detector->iw, detector->ih, iw, ih);
+      return(-582);
+   }
+
    /* If LOG_REPORT defined, open log report file. */
    if((ret = open_logfile()))
       /* If system error, exit with error code. */
       return(ret);
 
-   /* Determine the maximum amount of image padding required to support */
-   /* LFS processes.                                                    */
-   maxpad = get_max_padding_V2(lfsparms->windowsize, lfsparms->windowoffset,
-                          lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h);
-
-   /* Initialize lookup table for converting integer directions */
-   /* to angles in radians.                                     */
-   if((ret = init_dir2rad(&dir2rad, lfsparms->num_directions))){
-      /* Free memory allocated to this point. */
-      return(ret);
-   }
-
-   /* Initialize wave form lookup tables for DFT analyses. */
-   /* used for direction binarization.                             */
-   if((ret = init_dftwaves(&dftwaves, g_dft_coefs, lfsparms->num_dft_waves,
-                        lfsparms->windowsize))){
-      /* Free memory allocated to this point. */
-      free_dir2rad(dir2rad);
-      return(ret);
-   }
-
-   /* Initialize lookup table for pixel offsets to rotated grids */
-   /* used for DFT analyses.                                     */
-   if((ret = init_rotgrids(&dftgrids, iw, ih, maxpad,
-                        lfsparms->start_dir_angle, lfsparms->num_directions,
-                        lfsparms->windowsize, lfsparms->windowsize,
-                        RELATIVE2ORIGIN))){
-      /* Free memory allocated to this point. */
-      free_dir2rad(dir2rad);
-      free_dftwaves(dftwaves);
-      return(ret);
-   }
+   maxpad = detector->maxpad;
 
-   /* Pad input image based on max padding. */
-   if(maxpad > 0){   /* May not need to pad at all */
-      if((ret = pad_uchar_image(&pdata, &pw, &ph, idata, iw, ih,
-                             maxpad, lfsparms->pad_value))){
-         /* Free memory allocated to this point. */
-         free_dir2rad(dir2rad);
-         free_dftwaves(dftwaves);
-         free_rotgrids(dftgrids);
-         return(ret);
-      }
-   }
-   else{
-      /* If padding is unnecessary, then copy the input image. */
-      pdata = (unsigned char *)g_malloc(iw * ih);
-      memcpy(pdata, idata, iw*ih);
-      pw = iw;
-      ph = ih;
-   }
-
-   /* Scale input image to 6 bits [0..63] */
+   /* Pad input image based on max padding (which may be zero) and */
+   /* scale it to 6 bits [0..63] while copying it.                 */
    /* !!! Would like to remove this dependency eventualy !!!     */
    /* But, the DFT computations will need to be changed, and     */
    /* could not get this work upon first attempt. Also, if not   */
    /* careful, I think accumulated power magnitudes may overflow */
    /* doubles.                                                   */
-   bits_8to6(pdata, pw, ph);
+   if((ret = pad_uchar_image_8to6(&pdata, &pw, &ph, idata, iw, ih,
+                                  maxpad, lfsparms->pad_value))){
+      return(ret);
+   }
 
    print2log("\nINITIALIZATION AND PADDING DONE\n");
 
@@ -231,65 +239,51 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    /* Generate block maps from the input image. */
    if((ret = gen_image_maps(&direction_map, &low_contrast_map,
                     &low_flow_map, &high_curve_map, &mw, &mh,
-                    pdata, pw, ph, dir2rad, dftwaves, dftgrids, lfsparms))){
+                    pdata, pw, ph, detector->dir2rad, detector->dftwaves,
+                    detector->dftgrids, lfsparms))){
       /* Free memory allocated to this point. */
-      free_dir2rad(dir2rad);
-      free_dftwaves(dftwaves);
-      free_rotgrids(dftgrids);
       g_free(pdata);
       return(ret);
    }
-   /* Deallocate working memories. */
-   free_dir2rad(dir2rad);
-   free_dftwaves(dftwaves);
-   free_rotgrids(dftgrids);
 
    print2log("\nMAPS DONE\n");
 
    time_accum(imap_timer, imap_time);
 
-   /******************/
-   /* BINARIZARION   */
-   /******************/
-   set_timer(bin_timer);
-
-   /* Initialize lookup table for pixel offsets to rotated grids */
-   /* used for directional binarization.                         */
-   if((ret = init_rotgrids(&dirbingrids, iw, ih, maxpad,
-                        lfsparms->start_dir_angle, lfsparms->num_directions,
-                        lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h,
-                        RELATIVE2CENTER))){
-      /* Free memory allocated to this point. */
+   if(lfs_cancelled(lfsparms)){
       g_free(pdata);
       g_free(direction_map);
       g_free(low_contrast_map);
       g_free(low_flow_map);
       g_free(high_curve_map);
-      return(ret);
+      return(LFS_CANCELLED);
    }
 
+   /******************/
+   /* BINARIZARION   */
+   /******************/
+   set_timer(bin_timer);
+
    /* Binarize input image based on NMAP information. */
    if((ret = binarize_V2(&bdata, &bw, &bh,
                       pdata, pw, ph, direction_map, mw, mh,
-                      dirbingrids, lfsparms))){
+                      detector->dirbingrids, lfsparms))){
       /* Free memory allocated to this point. */
       g_free(pdata);
       g_free(direction_map);
       g_free(low_contrast_map);
       g_free(low_flow_map);
       g_free(high_curve_map);
-      free_rotgrids(dirbingrids);
       return(ret);
    }
 
-   /* Deallocate working memory. */
-   free_rotgrids(dirbingrids);
+   /* The padded image is only needed for the maps and binarization. */
+   g_free(pdata);
 
    /* Check dimension of binary image.  If they are different from */
    /* the input image, then ERROR.                                 */
    if((iw != bw) || (ih != bh)){
       /* Free memory allocated to this point. */
-      g_free(pdata);
       g_free(direction_map);
       g_free(low_contrast_map);
       g_free(low_flow_map);
@@ -305,6 +299,15 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
 
    time_accum(bin_timer, bin_time);
 
+   if(lfs_cancelled(lfsparms)){
+      g_free(direction_map);
+      g_free(low_contrast_map);
+      g_free(low_flow_map);
+      g_free(high_curve_map);
+      g_free(bdata);
+      return(LFS_CANCELLED);
+   }
+
    /******************/
    /*   DETECTION    */
    /******************/
@@ -319,12 +322,19 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
       return(ret);
    }
 
+   /* Temporary contours, chain codes and ridge counting buffers of */
+   /* the detection are taken from a scratch arena that is released */
+   /* in one piece when done.                                       */
+   init_lfsarena(&arena);
+   prev_arena = set_lfsarena(&arena);
+
    /* Detect the minutiae in the binarized image. */
    if((ret = detect_minutiae_V2(minutiae, bdata, iw, ih,
                              direction_map, low_flow_map, high_curve_map,
                              mw, mh, lfsparms))){
+      set_lfsarena(prev_arena);
+      free_lfsarena(&arena);
       /* Free memory allocated to this point. */
-      g_free(pdata);
       g_free(direction_map);
       g_free(low_contrast_map);
       g_free(low_flow_map);
@@ -335,13 +345,26 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
 
    time_accum(minutia_timer, minutia_time);
 
+   if(lfs_cancelled(lfsparms)){
+      set_lfsarena(prev_arena);
+      free_lfsarena(&arena);
+      g_free(direction_map);
+      g_free(low_contrast_map);
+      g_free(low_flow_map);
+      g_free(high_curve_map);
+      g_free(bdata);
+      free_minutiae(minutiae);
+      return(LFS_CANCELLED);
+   }
+
    set_timer(rm_minutia_timer);
 
    if((ret = remove_false_minutia_V2(minutiae, bdata, iw, ih,
                        direction_map, low_flow_map, high_curve_map, mw, mh,
                        lfsparms))){
+      set_lfsarena(prev_arena);
+      free_lfsarena(&arena);
       /* Free memory allocated to this point. */
-      g_free(pdata);
       g_free(direction_map);
       g_free(low_contrast_map);
       g_free(low_flow_map);
@@ -355,14 +378,27 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
 
    time_accum(rm_minutia_timer, rm_minutia_time);
 
+   if(lfs_cancelled(lfsparms)){
+      set_lfsarena(prev_arena);
+      free_lfsarena(&arena);
+      g_free(direction_map);
+      g_free(low_contrast_map);
+      g_free(low_flow_map);
+      g_free(high_curve_map);
+      g_free(bdata);
+      free_minutiae(minutiae);
+      return(LFS_CANCELLED);
+   }
+
    /******************/
    /*  RIDGE COUNTS  */
    /******************/
    set_timer(ridge_count_timer);
 
    if((ret = count_minutiae_ridges(minutiae, bdata, iw, ih, lfsparms))){
+      set_lfsarena(prev_arena);
+      free_lfsarena(&arena);
       /* Free memory allocated to this point. */
-      g_free(pdata);
       g_free(direction_map);
       g_free(low_contrast_map);
       g_free(low_flow_map);
@@ -376,6 +412,9 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
 
    time_accum(ridge_count_timer, ridge_count_time);
 
+   set_lfsarena(prev_arena);
+   free_lfsarena(&arena);
+
    /******************/
    /*    WRAP-UP     */
    /******************/
@@ -384,9 +423,6 @@ int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    /* grayscale binary image [0,255].           */
    gray2bin(1, 255, 0, bdata, iw, ih);
 
-   /* Deallocate working memory. */
-   g_free(pdata);
-
    /* Assign results to output pointers. */
    *odmap = direction_map;
    *olcmap = low_contrast_map;
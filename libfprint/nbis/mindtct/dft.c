@@ -57,8 +57,12 @@ of the software.
 ***********************************************************************
                ROUTINES:
                         dft_dir_powers()
+                        dft_dir_powers_n()
                         sum_rot_block_rows()
+                        sum_rot_block_rows_n()
                         dft_power()
+                        dft_power_n()
+                        dft_power_pair()
                         dft_power_stats()
                         get_max_norm()
                         sort_dft_waves()
@@ -67,6 +71,163 @@ of the software.
 #include <stdio.h>
 #include <lfs.h>
 
+/* The SSE2 kernel is only bit compatible with dft_power as long as the */
+/* compiler cannot contract the scalar multiply-adds into FMAs.         */
+#if defined(__SSE2__) && !defined(__FMA__) && !defined(NBIS_NO_SIMD)
+#define DFT_POWER_SSE2
+#include <emmintrin.h>
+#endif
+
+/* The dimensions of the DFT analysis with the default parameters.   */
+/* dft_dir_powers() runs a copy of the kernels with these constants, */
+/* which the compiler can unroll.  Other parameters use the same      */
+/* kernels with the dimensions read at runtime.                       */
+#define DFT_NDIRS_V2        NUM_DIRECTIONS
+#define DFT_NWAVES_V2       NUM_DFT_WAVES
+#define DFT_BLOCKSIZE_V2    MAP_WINDOWSIZE_V2
+
+/*************************************************************************
+**************************************************************************
+#cat: sum_rot_block_rows_n - Inline body of sum_rot_block_rows.
+**************************************************************************/
+static NBIS_ALWAYS_INLINE void sum_rot_block_rows_n(int *rowsums,
+                        const unsigned char *blkptr,
+                        const int *grid_offsets, const int blocksize)
+{
+   int ix, iy, rowsum;
+
+   /* For each row in block ... */
+   for(iy = 0; iy < blocksize; iy++){
+      /* The sums are accumlated along the rotated rows of the grid. */
+      rowsum = 0;
+      /* Foreach column in block ... */
+      for(ix = 0; ix < blocksize; ix++){
+         /* Accumulate pixel value at rotated grid position in image */
+         rowsum += blkptr[grid_offsets[ix]];
+      }
+      rowsums[iy] = rowsum;
+      grid_offsets += blocksize;
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: dft_power_n - Inline body of dft_power.
+**************************************************************************/
+static NBIS_ALWAYS_INLINE void dft_power_n(double *power, const int *rowsums,
+               const DFTWAVE *wave, const int wavelen)
+{
+   int i;
+   double cospart, sinpart;
+
+   /* Initialize accumulators */
+   cospart = 0.0;
+   sinpart = 0.0;
+
+   /* Accumulate cos and sin components of DFT. */
+   for(i = 0; i < wavelen; i++){
+      /* Multiply each rotated row sum by its        */
+      /* corresponding cos or sin point in DFT wave. */
+      cospart += (rowsums[i] * wave->cos[i]);
+      sinpart += (rowsums[i] * wave->sin[i]);
+   }
+
+   /* Power is the sum of the squared cos and sin components */
+   *power = (cospart * cospart) + (sinpart * sinpart);
+}
+
+#ifdef DFT_POWER_SSE2
+/*************************************************************************
+**************************************************************************
+#cat: dft_power_pair - Computes the DFT power of two wave forms at once,
+#cat:             one per SSE2 lane.  Each lane performs exactly the same
+#cat:             operations in the same order as dft_power, so the
+#cat:             resulting powers are identical to the scalar ones.
+
+   Input:
+      rowsums - accumulated rows of pixels from within a rotated grid
+                overlaying an input image block
+      wave0   - the first wave form (cosine and sine components)
+      wave1   - the second wave form (cosine and sine components)
+      wavelen - the length of the wave forms
+   Output:
+      power0  - the computed DFT power for wave0
+      power1  - the computed DFT power for wave1
+**************************************************************************/
+static NBIS_ALWAYS_INLINE void dft_power_pair(double *power0, double *power1,
+               const int *rowsums, const DFTWAVE *wave0,
+               const DFTWAVE *wave1, const int wavelen)
+{
+   int i;
+   __m128d cospart, sinpart, rowsum, power;
+
+   /* Initialize accumulators */
+   cospart = _mm_setzero_pd();
+   sinpart = _mm_setzero_pd();
+
+   /* Accumulate cos and sin components of both DFTs. */
+   for(i = 0; i < wavelen; i++){
+      rowsum = _mm_set1_pd((double)rowsums[i]);
+      cospart = _mm_add_pd(cospart, _mm_mul_pd(rowsum,
+                           _mm_set_pd(wave1->cos[i], wave0->cos[i])));
+      sinpart = _mm_add_pd(sinpart, _mm_mul_pd(rowsum,
+                           _mm_set_pd(wave1->sin[i], wave0->sin[i])));
+   }
+
+   /* Power is the sum of the squared cos and sin components */
+   power = _mm_add_pd(_mm_mul_pd(cospart, cospart),
+                      _mm_mul_pd(sinpart, sinpart));
+   _mm_storel_pd(power0, power);
+   _mm_storeh_pd(power1, power);
+}
+#endif
+
+/*************************************************************************
+**************************************************************************
+#cat: dft_dir_powers_n - Inline body of dft_dir_powers, for the given
+#cat:         number of directions and waves and the given block size.
+
+   Input:
+      blkptr    - the pixel address of the origin of the current block
+      rowsums   - scratch space for blocksize pixel row sums
+      dftwaves  - structure containing the DFT wave forms
+      dftgrids  - structure containing the rotated pixel grid offsets
+      ndirs     - the number of rotated grids in dftgrids
+      nwaves    - the number of wave forms in dftwaves
+      blocksize - the width and height of the grids
+      wavelen   - the length of the wave forms
+   Output:
+      powers    - DFT power computed from each wave form frequencies at each
+                  orientation (direction) in the current image block
+**************************************************************************/
+static NBIS_ALWAYS_INLINE void dft_dir_powers_n(double **powers,
+               const unsigned char *blkptr, int *rowsums,
+               const DFTWAVES *dftwaves, const ROTGRIDS *dftgrids,
+               const int ndirs, const int nwaves, const int blocksize,
+               const int wavelen)
+{
+   int w, dir;
+
+   /* Foreach direction ... */
+   for(dir = 0; dir < ndirs; dir++){
+      /* Compute vector of line sums from rotated grid */
+      sum_rot_block_rows_n(rowsums, blkptr, dftgrids->grids[dir], blocksize);
+
+      /* Foreach DFT wave ... */
+      w = 0;
+#ifdef DFT_POWER_SSE2
+      /* ... two at a time if possible, */
+      for(; w + 1 < nwaves; w += 2){
+         dft_power_pair(&(powers[w][dir]), &(powers[w+1][dir]), rowsums,
+                        dftwaves->waves[w], dftwaves->waves[w+1], wavelen);
+      }
+#endif
+      for(; w < nwaves; w++){
+         dft_power_n(&(powers[w][dir]), rowsums, dftwaves->waves[w], wavelen);
+      }
+   }
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: dft_dir_powers - Conducts the DFT analysis on a block of image data.
@@ -103,32 +264,35 @@ int dft_dir_powers(double **powers, unsigned char *pdata,
                const int blkoffset, const int pw, const int ph,
                const DFTWAVES *dftwaves, const ROTGRIDS *dftgrids)
 {
-   int w, dir;
    int *rowsums;
-   unsigned char *blkptr;
 
-   /* Allocate line sum vector, and initialize to zeros */
    /* This routine requires square block (grid), so ERROR otherwise. */
    if(dftgrids->grid_w != dftgrids->grid_h){
       fprintf(stderr, "ERROR : dft_dir_powers : DFT grids must be square\n");
       return(-90);
    }
+
+   /* The default parameters use the specialized copy of the kernels, */
+   /* with the line sums on the stack.                                */
+   if(dftgrids->ngrids == DFT_NDIRS_V2 &&
+      dftwaves->nwaves == DFT_NWAVES_V2 &&
+      dftgrids->grid_w == DFT_BLOCKSIZE_V2 &&
+      dftwaves->wavelen == DFT_BLOCKSIZE_V2){
+      int rowsums_V2[DFT_BLOCKSIZE_V2];
+
+      dft_dir_powers_n(powers, pdata + blkoffset, rowsums_V2,
+                       dftwaves, dftgrids, DFT_NDIRS_V2, DFT_NWAVES_V2,
+                       DFT_BLOCKSIZE_V2, DFT_BLOCKSIZE_V2);
+      return(0);
+   }
+
+   /* Allocate line sum vector, and initialize to zeros */
    rowsums = (int *)g_malloc(dftgrids->grid_w * sizeof(int));
    memset(rowsums, 0, dftgrids->grid_w * sizeof(int));
 
-   /* Foreach direction ... */
-   for(dir = 0; dir < dftgrids->ngrids; dir++){
-      /* Compute vector of line sums from rotated grid */
-      blkptr = pdata + blkoffset;
-      sum_rot_block_rows(rowsums, blkptr,
-                         dftgrids->grids[dir], dftgrids->grid_w);
-
-      /* Foreach DFT wave ... */
-      for(w = 0; w < dftwaves->nwaves; w++){
-         dft_power(&(powers[w][dir]), rowsums,
-                   dftwaves->waves[w], dftwaves->wavelen);
-      }
-   }
+   dft_dir_powers_n(powers, pdata + blkoffset, rowsums, dftwaves, dftgrids,
+                    dftgrids->ngrids, dftwaves->nwaves, dftgrids->grid_w,
+                    dftwaves->wavelen);
 
    /* Deallocate working memory. */
    g_free(rowsums);
@@ -156,23 +320,7 @@ int dft_dir_powers(double **powers, unsigned char *pdata,
 void sum_rot_block_rows(int *rowsums, const unsigned char *blkptr,
                         const int *grid_offsets, const int blocksize)
 {
-   int ix, iy, gi;
-
-   /* Initialize rotation offset index. */
-   gi = 0;
-
-   /* For each row in block ... */
-   for(iy = 0; iy < blocksize; iy++){
-      /* The sums are accumlated along the rotated rows of the grid, */
-      /* so initialize row sum to 0.                                 */
-      rowsums[iy] = 0;
-      /* Foreach column in block ... */
-      for(ix = 0; ix < blocksize; ix++){
-         /* Accumulate pixel value at rotated grid position in image */
-         rowsums[iy] += *(blkptr + grid_offsets[gi]);
-         gi++;
-      }
-   }
+   sum_rot_block_rows_n(rowsums, blkptr, grid_offsets, blocksize);
 }
 
 /*************************************************************************
@@ -195,23 +343,7 @@ void sum_rot_block_rows(int *rowsums, const unsigned char *blkptr,
 void dft_power(double *power, const int *rowsums,
                const DFTWAVE *wave, const int wavelen)
 {
-   int i;
-   double cospart, sinpart;
-
-   /* Initialize accumulators */
-   cospart = 0.0;
-   sinpart = 0.0;
-
-   /* Accumulate cos and sin components of DFT. */
-   for(i = 0; i < wavelen; i++){
-      /* Multiply each rotated row sum by its        */
-      /* corresponding cos or sin point in DFT wave. */
-      cospart += (rowsums[i] * wave->cos[i]);
-      sinpart += (rowsums[i] * wave->sin[i]);
-   }
-
-   /* Power is the sum of the squared cos and sin components */
-   *power = (cospart * cospart) + (sinpart * sinpart);
+   dft_power_n(power, rowsums, wave, wavelen);
 }
 
 /*************************************************************************
@@ -58,6 +58,7 @@ of the software.
                         free_dftwaves()
                         free_rotgrids()
                         free_dir_powers()
+                        free_lfsdetector()
 ***********************************************************************/
 
 #include <stdio.h>
@@ -134,3 +135,29 @@ void free_dir_powers(double **powers, const int nwaves)
    g_free(powers);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: free_lfsdetector - Deallocates memory associated with a LFSDETECTOR
+#cat:                structure and all of its lookup tables.
+
+   Input:
+      detector - pointer to memory to be freed
+**************************************************************************/
+void free_lfsdetector(LFSDETECTOR *detector)
+{
+   if(detector == (LFSDETECTOR *)NULL)
+      return;
+
+   /* The tables generated at build time are not allocated. */
+   if(detector->dir2rad != (DIR2RAD *)NULL &&
+      detector->dir2rad != &g_dir2rad_V2)
+      free_dir2rad(detector->dir2rad);
+   if(detector->dftwaves != (DFTWAVES *)NULL &&
+      detector->dftwaves != &g_dftwaves_V2)
+      free_dftwaves(detector->dftwaves);
+   if(detector->dftgrids != (ROTGRIDS *)NULL)
+      free_rotgrids(detector->dftgrids);
+   if(detector->dirbingrids != (ROTGRIDS *)NULL)
+      free_rotgrids(detector->dirbingrids);
+   g_free(detector);
+}
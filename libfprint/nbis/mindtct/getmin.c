@@ -58,6 +58,7 @@ of the software.
 ***********************************************************************
                ROUTINES:
                         get_minutiae()
+                        get_minutiae_ctx()
 
 ***********************************************************************/
 
@@ -103,6 +104,38 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
                  unsigned char **obdata, int *obw, int *obh, int *obd,
                  unsigned char *idata, const int iw, const int ih,
                  const int id, const double ppmm, const LFSPARMS *lfsparms)
+{
+   return(get_minutiae_ctx(ominutiae, oquality_map, odirection_map,
+                           olow_contrast_map, olow_flow_map, ohigh_curve_map,
+                           omap_w, omap_h, obdata, obw, obh, obd,
+                           idata, iw, ih, id, ppmm, lfsparms,
+                           (LFSDETECTOR *)NULL));
+}
+
+/*************************************************************************
+**************************************************************************
+#cat:   get_minutiae_ctx - Same as get_minutiae, but reuses the lookup tables
+#cat:                of a detector built by init_lfsdetector for images of
+#cat:                the same dimensions.  If no detector is passed, the
+#cat:                tables are built and released for this image only.
+
+   Input:
+      see get_minutiae
+      detector - lookup tables built by init_lfsdetector, or NULL
+   Output:
+      see get_minutiae
+   Return Code:
+      Zero     - successful completion
+      Negative - system error
+**************************************************************************/
+int get_minutiae_ctx(MINUTIAE **ominutiae, int **oquality_map,
+                 int **odirection_map, int **olow_contrast_map,
+                 int **olow_flow_map, int **ohigh_curve_map,
+                 int *omap_w, int *omap_h,
+                 unsigned char **obdata, int *obw, int *obh, int *obd,
+                 unsigned char *idata, const int iw, const int ih,
+                 const int id, const double ppmm, const LFSPARMS *lfsparms,
+                 const LFSDETECTOR *detector)
 {
    int ret;
    MINUTIAE *minutiae;
@@ -120,12 +153,21 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
    }
 
    /* Detect minutiae in grayscale fingerpeint image. */
-   if((ret = lfs_detect_minutiae_V2(&minutiae,
+   if(detector != (LFSDETECTOR *)NULL)
+      ret = lfs_detect_minutiae_V2_ctx(&minutiae,
+                                   &direction_map, &low_contrast_map,
+                                   &low_flow_map, &high_curve_map,
+                                   &map_w, &map_h,
+                                   &bdata, &bw, &bh,
+                                   idata, iw, ih, lfsparms, detector);
+   else
+      ret = lfs_detect_minutiae_V2(&minutiae,
                                    &direction_map, &low_contrast_map,
                                    &low_flow_map, &high_curve_map,
                                    &map_w, &map_h,
                                    &bdata, &bw, &bh,
-                                   idata, iw, ih, lfsparms))){
+                                   idata, iw, ih, lfsparms);
+   if(ret){
       return(ret);
    }
 
@@ -59,7 +59,10 @@ of the software.
                         bits_8to6()
                         gray2bin()
                         pad_uchar_image()
+                        pad_uchar_image_8to6()
                         fill_holes()
+                        fill_packed_row_holes()
+                        fill_binary_holes()
                         free_path()
                         search_in_direction()
 
@@ -211,6 +214,66 @@ int pad_uchar_image(unsigned char **optr, int *ow, int *oh,
    return(0);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: pad_uchar_image_8to6 - Same as pad_uchar_image followed by bits_8to6
+#cat:                   on the padded image, but done in a single pass.
+#cat:                   Only the border is set to the (scaled) pad value
+#cat:                   and each input scanline is scaled as it is copied.
+
+   Input:
+      idata     - input 8-bit grayscale image
+      iw        - width (in pixels) of the input image
+      ih        - height (in pixels) of the input image
+      pad       - size of padding (in pixels) to be added, may be zero
+      pad_value - 8-bit intensity of the padded area
+   Output:
+      optr      - points to the newly padded 6-bit image
+      ow        - width (in pixels) of the padded image
+      oh        - height (in pixels) of the padded image
+   Return Code:
+      Zero     - successful completion
+      Negative - system error
+**************************************************************************/
+int pad_uchar_image_8to6(unsigned char **optr, int *ow, int *oh,
+                    unsigned char *idata, const int iw, const int ih,
+                    const int pad, const int pad_value)
+{
+   unsigned char *pdata, *pptr, *iptr;
+   unsigned char pad6;
+   int i, j, pw, ph;
+
+   /* Compute new pad sizes */
+   pw = iw + (pad<<1);
+   ph = ih + (pad<<1);
+   pad6 = (unsigned char)pad_value >> 2;
+
+   /* Allocate padded image */
+   pdata = (unsigned char *)g_malloc(pw * ph * sizeof(unsigned char));
+
+   /* Top and bottom pad rows */
+   memset(pdata, pad6, pad * pw);
+   memset(pdata + (pad + ih) * pw, pad6, pad * pw);
+
+   /* Scanlines with their left and right pad */
+   iptr = idata;
+   pptr = pdata + (pad * pw);
+   for(i = 0; i < ih; i++){
+      memset(pptr, pad6, pad);
+      /* Divide every pixel value by 4 so that [0..256) -> [0..64) */
+      for(j = 0; j < iw; j++)
+         pptr[pad + j] = iptr[j] >> 2;
+      memset(pptr + pad + iw, pad6, pad);
+      iptr += iw;
+      pptr += pw;
+   }
+
+   *optr = pdata;
+   *ow = pw;
+   *oh = ph;
+   return(0);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: fill_holes - Takes an input image and analyzes triplets of horizontal
@@ -301,6 +364,136 @@ void fill_holes(unsigned char *bdata, const int iw, const int ih)
    }
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: fill_packed_row_holes - Takes one row of a binary image packed one bit
+#cat:              per pixel and fills its horizontal holes of width 1, as
+#cat:              the first pass of fill_holes() does.
+
+   Input:
+      row   - packed row, pixel x in bit (x%64) of word (x/64)
+      hmask - bits of the pixels that have a left and right neighbor
+      ww    - width (in words) of the packed row
+   Output:
+      row   - points to the results
+**************************************************************************/
+static void fill_packed_row_holes(guint64 *row, const guint64 *hmask,
+                                  const int ww)
+{
+   int j;
+   guint64 cur, prev, next, lft, rgt, holes, filled, carry, bit;
+
+   prev = 0;
+   carry = 0;
+   for(j = 0; j < ww; j++){
+      cur = row[j];
+      next = (j+1 < ww) ? row[j+1] : 0;
+      /* Left and right neighbor of each pixel in the word. */
+      lft = (cur << 1) | (prev >> 63);
+      rgt = (cur >> 1) | (next << 63);
+      holes = (lft ^ cur) & ~(lft ^ rgt) & hmask[j];
+
+      /* fill_holes() steps over the pixel right of a filled hole, so  */
+      /* of consecutive holes only every other one, starting with the */
+      /* first, is filled.                                            */
+      filled = 0;
+      while(holes){
+         bit = holes & -holes;
+         if(!(((filled << 1) | carry) & bit))
+            filled |= bit;
+         holes &= holes - 1;
+      }
+
+      carry = filled >> 63;
+      prev = cur;
+      row[j] = cur ^ filled;
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: fill_binary_holes - Takes a binary image of WHITE_PIXEL and BLACK_PIXEL
+#cat:              values and applies fill_holes() to it the specified number
+#cat:              of times.  The passes work on a copy of the image packed
+#cat:              one bit per pixel, so the vertical pass handles 64
+#cat:              columns per operation, and only the pixels that changed
+#cat:              are written back.  This routine modifies the input image.
+
+   Input:
+      bdata   - binary image data to be processed
+      iw      - width (in pixels) of the binary input image
+      ih      - height (in pixels) of the binary input image
+      npasses - number of times fill_holes() is applied
+   Output:
+      bdata   - points to the results
+**************************************************************************/
+void fill_binary_holes(unsigned char *bdata, const int iw, const int ih,
+                       const int npasses)
+{
+   int ix, iy, j, ww, n;
+   guint64 *bits, *orig, *skip, *hmask, *tptr, *mptr, *bptr;
+   guint64 holes, diff;
+   unsigned char *sptr;
+
+   if(iw <= 0 || ih <= 0 || npasses <= 0)
+      return;
+
+   ww = (iw + 63) >> 6;
+   bits = (guint64 *)g_malloc0(((gsize)ww * ih * 2 + ww * 2) *
+                               sizeof(guint64));
+   orig = bits + (gsize)ww * ih;
+   skip = orig + (gsize)ww * ih;
+   hmask = skip + ww;
+
+   /* Pack the image, white pixels become set bits. */
+   sptr = bdata;
+   for(iy = 0; iy < ih; iy++){
+      mptr = bits + (gsize)iy * ww;
+      for(ix = 0; ix < iw; ix++)
+         mptr[ix >> 6] |= (guint64)(*sptr++ != BLACK_PIXEL) << (ix & 63);
+   }
+   memcpy(orig, bits, (gsize)ww * ih * sizeof(guint64));
+
+   /* Only pixels 1 through iw-2 of a row can be horizontal holes. */
+   for(ix = 1; ix < iw-1; ix++)
+      hmask[ix >> 6] |= (guint64)1 << (ix & 63);
+
+   for(n = 0; n < npasses; n++){
+      /* 1. Fill 1-pixel wide holes in horizontal runs first ... */
+      for(iy = 0; iy < ih; iy++)
+         fill_packed_row_holes(bits + (gsize)iy * ww, hmask, ww);
+
+      /* 2. Now, fill 1-pixel wide holes in vertical runs ...       */
+      /* Every column is done at once, row by row.  As in the       */
+      /* horizontal pass, the pixel below a filled hole is skipped. */
+      memset(skip, 0, ww * sizeof(guint64));
+      for(iy = 1; iy < ih-1; iy++){
+         tptr = bits + (gsize)(iy-1) * ww;
+         mptr = tptr + ww;
+         bptr = mptr + ww;
+         for(j = 0; j < ww; j++){
+            holes = (tptr[j] ^ mptr[j]) & ~(tptr[j] ^ bptr[j]) & ~skip[j];
+            mptr[j] ^= holes;
+            skip[j] = holes;
+         }
+      }
+   }
+
+   /* Write back the pixels that changed. */
+   for(iy = 0; iy < ih; iy++){
+      sptr = bdata + (gsize)iy * iw;
+      for(j = 0; j < ww; j++){
+         diff = bits[(gsize)iy * ww + j] ^ orig[(gsize)iy * ww + j];
+         for(ix = j << 6; diff; ix++, diff >>= 1)
+            if(diff & 1)
+               sptr[ix] = (sptr[ix] == BLACK_PIXEL) ? WHITE_PIXEL :
+                                                      BLACK_PIXEL;
+      }
+   }
+
+   g_free(bits);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: free_path - Traverses a straight line between 2 pixel points in an
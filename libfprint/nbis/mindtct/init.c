@@ -61,13 +61,30 @@ of the software.
                         get_max_padding()
                         get_max_padding_V2()
                         init_rotgrids()
+                        init_lfsdetector()
                         alloc_dir_powers()
                         alloc_power_stats()
 ***********************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 #include <lfs.h>
 
+/* Tables for the default LFS parameters, generated at build time */
+#include "mindtct-tables.h"
+
+const DIR2RAD g_dir2rad_V2 = {
+   MINDTCT_TABLES_NDIRS,
+   (double *)mindtct_dir2rad_cos,
+   (double *)mindtct_dir2rad_sin
+};
+
+const DFTWAVES g_dftwaves_V2 = {
+   MINDTCT_TABLES_NWAVES,
+   MINDTCT_TABLES_WAVELEN,
+   (DFTWAVE **)mindtct_dftwaves_list
+};
+
 /*************************************************************************
 **************************************************************************
 #cat: init_dir2rad - Allocates and initializes a lookup table containing
@@ -530,6 +547,89 @@ int init_rotgrids(ROTGRIDS **optr, const int iw, const int ih, const int ipad,
    return(0);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: init_lfsdetector - Allocates and initializes all lookup tables used
+#cat:                by LFS Version 2 for images of a given size.  These
+#cat:                only depend on the LFS parameters and the image
+#cat:                dimensions, so the resulting structure may be reused
+#cat:                across detections.
+
+   Input:
+      iw        - width (in pixels) of the input image
+      ih        - height (in pixels) of the input image
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      optr      - points to the allocated/initialized LFSDETECTOR structure
+   Return Code:
+      Zero     - successful completion
+      Negative - system error
+**************************************************************************/
+int init_lfsdetector(LFSDETECTOR **optr, const int iw, const int ih,
+                     const LFSPARMS *lfsparms)
+{
+   LFSDETECTOR *detector;
+   int ret;
+
+   /* Allocate structure, with all tables unset. */
+   detector = (LFSDETECTOR *)g_malloc(sizeof(LFSDETECTOR));
+   memset(detector, 0, sizeof(LFSDETECTOR));
+   detector->iw = iw;
+   detector->ih = ih;
+
+   /* Determine the maximum amount of image padding required to support */
+   /* LFS processes.                                                    */
+   detector->maxpad = get_max_padding_V2(lfsparms->windowsize,
+                          lfsparms->windowoffset,
+                          lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h);
+
+   /* Initialize lookup table for converting integer directions */
+   /* to angles in radians.  The table for the default number of */
+   /* directions was generated at build time.                   */
+   if(lfsparms->num_directions == g_dir2rad_V2.ndirs)
+      detector->dir2rad = (DIR2RAD *)&g_dir2rad_V2;
+   else if((ret = init_dir2rad(&(detector->dir2rad),
+                               lfsparms->num_directions))){
+      free_lfsdetector(detector);
+      return(ret);
+   }
+
+   /* Initialize wave form lookup tables for DFT analyses, unless */
+   /* the ones generated at build time fit.                       */
+   if(lfsparms->num_dft_waves == g_dftwaves_V2.nwaves &&
+      lfsparms->windowsize == g_dftwaves_V2.wavelen &&
+      memcmp(g_dft_coefs, mindtct_dft_coefs, sizeof(mindtct_dft_coefs)) == 0)
+      detector->dftwaves = (DFTWAVES *)&g_dftwaves_V2;
+   else if((ret = init_dftwaves(&(detector->dftwaves), g_dft_coefs,
+                        lfsparms->num_dft_waves, lfsparms->windowsize))){
+      free_lfsdetector(detector);
+      return(ret);
+   }
+
+   /* Initialize lookup table for pixel offsets to rotated grids */
+   /* used for DFT analyses.                                     */
+   if((ret = init_rotgrids(&(detector->dftgrids), iw, ih, detector->maxpad,
+                        lfsparms->start_dir_angle, lfsparms->num_directions,
+                        lfsparms->windowsize, lfsparms->windowsize,
+                        RELATIVE2ORIGIN))){
+      free_lfsdetector(detector);
+      return(ret);
+   }
+
+   /* Initialize lookup table for pixel offsets to rotated grids */
+   /* used for directional binarization.                         */
+   if((ret = init_rotgrids(&(detector->dirbingrids), iw, ih, detector->maxpad,
+                        lfsparms->start_dir_angle, lfsparms->num_directions,
+                        lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h,
+                        RELATIVE2CENTER))){
+      free_lfsdetector(detector);
+      return(ret);
+   }
+
+   *optr = detector;
+   return(0);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: alloc_dir_powers - Allocates the memory associated with DFT power
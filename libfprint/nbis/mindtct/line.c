@@ -56,6 +56,7 @@ of the software.
 ***********************************************************************
                ROUTINES:
                         line_points()
+                        line_points_buf()
 ***********************************************************************/
 
 #include <stdio.h>
@@ -82,13 +83,7 @@ of the software.
 int line_points(int **ox_list, int **oy_list, int *onum,
                 const int x1, const int y1, const int x2, const int y2)
 {
-   int asize;
-   int dx, dy, adx, ady;
-   int x_incr, y_incr;
-   int i, inx, iny, intx, inty;
-   double x_factor, y_factor;
-   double rx, ry;
-   int ix, iy;
+   int ret, asize;
    int *x_list, *y_list;
 
    /* Compute maximum number of points needed to hold line segment. */
@@ -98,6 +93,58 @@ int line_points(int **ox_list, int **oy_list, int *onum,
    x_list = (int *)g_malloc(asize * sizeof(int));
    y_list = (int *)g_malloc(asize * sizeof(int));
 
+   if((ret = line_points_buf(x_list, y_list, asize, onum, x1, y1, x2, y2))){
+      g_free(x_list);
+      g_free(y_list);
+      return(ret);
+   }
+
+   /* Set output pointers. */
+   *ox_list = x_list;
+   *oy_list = y_list;
+
+   /* Return normally. */
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: line_points_buf - Same as line_points, but stores the coordinates
+#cat:               into lists provided by the caller, so they can be
+#cat:               reused for many lines.
+
+   Input:
+      x_list  - list to store the x-coords into
+      y_list  - list to store the y-coords into
+      asize   - length of the lists, max(|x2-x1|, |y2-y1|)+2 always suffices
+      x1      - x-coord of first point
+      y1      - y-coord of first point
+      x2      - x-coord of second point
+      y2      - y-coord of second point
+   Output:
+      x_list  - x-coords along line trajectory
+      y_list  - y-coords along line trajectory
+      onum    - number of points along line trajectory
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+int line_points_buf(int *x_list, int *y_list, const int asize, int *onum,
+                const int x1, const int y1, const int x2, const int y2)
+{
+   int dx, dy, adx, ady;
+   int x_incr, y_incr;
+   int i, inx, iny, intx, inty;
+   double x_factor, y_factor;
+   double rx, ry;
+   int ix, iy;
+
+   /* The lists must hold at least the first point. */
+   if(asize < 1){
+      fprintf(stderr, "ERROR : line_points_buf : coord list overflow\n");
+      return(-412);
+   }
+
    /* Compute delta x and y. */
    dx = x2 - x1;
    dy = y2 - y1;
@@ -181,8 +228,6 @@ int line_points(int **ox_list, int **oy_list, int *onum,
 
       if(i >= asize){
          fprintf(stderr, "ERROR : line_points : coord list overflow\n");
-         g_free(x_list);
-         g_free(y_list);
          return(-412);
       }
 
@@ -204,9 +249,7 @@ int line_points(int **ox_list, int **oy_list, int *onum,
       y_list[i++] = iy;
    }
 
-   /* Set output pointers. */
-   *ox_list = x_list;
-   *oy_list = y_list;
+   /* Set output pointer. */
    *onum = i;
 
    /* Return normally. */
@@ -61,6 +61,9 @@ of the software.
 ***********************************************************************
                ROUTINES:
                         gen_image_maps()
+                        gen_initial_maps_band()
+                        gen_initial_maps_worker()
+                        get_initial_maps_pool()
                         gen_initial_maps()
                         interpolate_direction_map()
                         morph_TF_map()
@@ -216,51 +219,57 @@ int gen_image_maps(int **odmap, int **olcmap, int **olfmap, int **ohcmap,
    return(0);
 }
 
+/* Number of block rows analyzed per band of work in gen_initial_maps. */
+/* Blocks are independent, so the result does not depend on it.        */
+#define INITIAL_MAPS_BAND_ROWS 4
+
+typedef struct initial_maps_job{
+   GMutex mutex;
+   GCond cond;
+   int pending;
+
+   int *direction_map;
+   int *low_contrast_map;
+   int *low_flow_map;
+   int *blkoffs;
+   int mw;
+   unsigned char *pdata;
+   int pw;
+   int ph;
+   const DFTWAVES *dftwaves;
+   const ROTGRIDS *dftgrids;
+   const LFSPARMS *lfsparms;
+} INITIAL_MAPS_JOB;
+
+typedef struct initial_maps_band{
+   INITIAL_MAPS_JOB *job;
+   int from_bi;
+   int to_bi;
+   int ret;
+} INITIAL_MAPS_BAND;
+
 /*************************************************************************
 **************************************************************************
-#cat: gen_initial_maps - Creates an initial Direction Map from the given
-#cat:             input image.  It very important that the image be properly
-#cat:             padded so that rotated grids along the boundary of the image
-#cat:             do not access unkown memory.  The rotated grids are used by a
-#cat:             DFT-based analysis to determine the integer directions
-#cat:             in the map. Typically this initial vector of directions will
-#cat:             subsequently have weak or inconsistent directions removed
-#cat:             followed by a smoothing process.  The resulting Direction
-#cat:             Map contains valid directions >= 0 and INVALID values = -1.
-#cat:             This routine also computes and returns 2 other image maps.
-#cat:             The Low Contrast Map flags blocks in the image with
-#cat:             insufficient contrast.  Blocks with low contrast have a
-#cat:             corresponding direction of INVALID in the Direction Map.
-#cat:             The Low Flow Map flags blocks in which the DFT analyses
-#cat:             could not determine a significant ridge flow.  Blocks with
-#cat:             low ridge flow also have a corresponding direction of
-#cat:             INVALID in the Direction Map.
+#cat: gen_initial_maps_band - Runs the DFT analysis of gen_initial_maps on
+#cat:             a contiguous range of blocks.  Each block only reads the
+#cat:             padded image and writes its own map entries, so separate
+#cat:             ranges may be processed concurrently.
 
    Input:
-      blkoffs   - offsets to the pixel origin of each block in the padded image
-      mw        - number of blocks horizontally in the padded input image
-      mh        - number of blocks vertically in the padded input image
-      pdata     - padded input image data (8 bits [0..256) grayscale)
-      pw        - width (in pixels) of the padded input image
-      ph        - height (in pixels) of the padded input image
-      dftwaves  - structure containing the DFT wave forms
-      dftgrids  - structure containing the rotated pixel grid offsets
-      lfsparms  - parameters and thresholds for controlling LFS
+      band      - the job to work on and the range of blocks [from, to)
    Output:
-      odmap     - points to the newly created Direction Map
-      olcmap    - points to the newly created Low Contrast Map
-   Return Code:
-      Zero     - successful completion
-      Negative - system error
+      band      - the return code of the analysis
 **************************************************************************/
-int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
-                int *blkoffs, const int mw, const int mh,
-                unsigned char *pdata, const int pw, const int ph,
-                const DFTWAVES *dftwaves, const  ROTGRIDS *dftgrids,
-                const LFSPARMS *lfsparms)
+static void gen_initial_maps_band(INITIAL_MAPS_BAND *band)
 {
-   int *direction_map, *low_contrast_map, *low_flow_map;
-   int bi, bsize, blkdir;
+   INITIAL_MAPS_JOB *job = band->job;
+   const DFTWAVES *dftwaves = job->dftwaves;
+   const ROTGRIDS *dftgrids = job->dftgrids;
+   const LFSPARMS *lfsparms = job->lfsparms;
+   const int mw = job->mw;
+   const int pw = job->pw;
+   const int ph = job->ph;
+   int bi, blkdir;
    int *wis, *powmax_dirs;
    double **powers, *powmaxs, *pownorms;
    int nstats;
@@ -269,34 +278,10 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
    int xminlimit, xmaxlimit, yminlimit, ymaxlimit;
    int win_x, win_y, low_contrast_offset;
 
-   print2log("INITIAL MAP\n");
-
-   /* Compute total number of blocks in map */
-   ASSERT_INT_MUL(mw, mh);
-   bsize = mw * mh;
-
-   /* Allocate Direction Map memory */
-   direction_map = (int *)g_malloc(bsize * sizeof(int));
-   /* Initialize the Direction Map to INVALID (-1). */
-   memset(direction_map, INVALID_DIR, bsize * sizeof(int));
-
-   /* Allocate Low Contrast Map memory */
-   low_contrast_map = (int *)g_malloc(bsize * sizeof(int));
-   /* Initialize the Low Contrast Map to FALSE (0). */
-   memset(low_contrast_map, 0, bsize * sizeof(int));
-
-   /* Allocate Low Ridge Flow Map memory */
-   low_flow_map = (int *)g_malloc(bsize * sizeof(int));
-   /* Initialize the Low Flow Map to FALSE (0). */
-   memset(low_flow_map, 0, bsize * sizeof(int));
-
    /* Allocate DFT directional power vectors */
    if((ret = alloc_dir_powers(&powers, dftwaves->nwaves, dftgrids->ngrids))){
-      /* Free memory allocated to this point. */
-      g_free(direction_map);
-      g_free(low_contrast_map);
-      g_free(low_flow_map);
-      return(ret);
+      band->ret = ret;
+      return;
    }
 
    /* Allocate DFT power statistic arrays */
@@ -306,11 +291,9 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
    if((ret = alloc_power_stats(&wis, &powmaxs, &powmax_dirs,
                             &pownorms, nstats))){
       /* Free memory allocated to this point. */
-      g_free(direction_map);
-      g_free(low_contrast_map);
-      g_free(low_flow_map);
       free_dir_powers(powers, dftwaves->nwaves);
-      return(ret);
+      band->ret = ret;
+      return;
    }
 
    /* Compute special window origin limits for determining low contrast.  */
@@ -320,11 +303,13 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
    xmaxlimit = pw - dftgrids->pad - lfsparms->windowsize - 1;
    ymaxlimit = ph - dftgrids->pad - lfsparms->windowsize - 1;
 
-   /* Foreach block in image ... */
-   for(bi = 0; bi < bsize; bi++){
+   ret = 0;
+
+   /* Foreach block in band ... */
+   for(bi = band->from_bi; bi < band->to_bi; bi++){
       /* Adjust block offset from pointing to block origin to pointing */
       /* to surrounding window origin.                                 */
-      dft_offset = blkoffs[bi] - (lfsparms->windowoffset * pw) -
+      dft_offset = job->blkoffs[bi] - (lfsparms->windowoffset * pw) -
                       lfsparms->windowoffset;
 
       /* Compute pixel coords of window origin. */
@@ -343,60 +328,32 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
 
       /* If block is low contrast ... */
       if((ret = low_contrast_block(low_contrast_offset, lfsparms->windowsize,
-                                  pdata, pw, ph, lfsparms))){
+                                  job->pdata, pw, ph, lfsparms))){
          /* If system error ... */
-         if(ret < 0){
-            g_free(direction_map);
-            g_free(low_contrast_map);
-            g_free(low_flow_map);
-            free_dir_powers(powers, dftwaves->nwaves);
-            g_free(wis);
-            g_free(powmaxs);
-            g_free(powmax_dirs);
-            g_free(pownorms);
-            return(ret);
-         }
+         if(ret < 0)
+            break;
 
          /* Otherwise, block is low contrast ... */
          print2log("LOW CONTRAST\n");
-         low_contrast_map[bi] = TRUE;
+         job->low_contrast_map[bi] = TRUE;
          /* Direction Map's block is already set to INVALID. */
+         ret = 0;
       }
       /* Otherwise, sufficient contrast for DFT processing ... */
       else {
          print2log("\n");
 
          /* Compute DFT powers */
-         if((ret = dft_dir_powers(powers, pdata, low_contrast_offset, pw, ph,
-                               dftwaves, dftgrids))){
-            /* Free memory allocated to this point. */
-            g_free(direction_map);
-            g_free(low_contrast_map);
-            g_free(low_flow_map);
-            free_dir_powers(powers, dftwaves->nwaves);
-            g_free(wis);
-            g_free(powmaxs);
-            g_free(powmax_dirs);
-            g_free(pownorms);
-            return(ret);
-         }
+         if((ret = dft_dir_powers(powers, job->pdata, low_contrast_offset,
+                               pw, ph, dftwaves, dftgrids)))
+            break;
 
          /* Compute DFT power statistics, skipping first applied DFT  */
          /* wave.  This is dependent on how the primary and secondary */
          /* direction tests work below.                               */
          if((ret = dft_power_stats(wis, powmaxs, powmax_dirs, pownorms, powers,
-                                1, dftwaves->nwaves, dftgrids->ngrids))){
-            /* Free memory allocated to this point. */
-            g_free(direction_map);
-            g_free(low_contrast_map);
-            g_free(low_flow_map);
-            free_dir_powers(powers, dftwaves->nwaves);
-            g_free(wis);
-            g_free(powmaxs);
-            g_free(powmax_dirs);
-            g_free(pownorms);
-            return(ret);
-         }
+                                1, dftwaves->nwaves, dftgrids->ngrids)))
+            break;
 
 #ifdef LOG_REPORT /*vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv*/
          {  int _w;
@@ -416,17 +373,17 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
                                   pownorms, nstats, lfsparms);
 
          if(blkdir != INVALID_DIR)
-            direction_map[bi] = blkdir;
+            job->direction_map[bi] = blkdir;
          else{
             /* Conduct secondary (fork) direction test */
             blkdir = secondary_fork_test(powers, wis, powmaxs, powmax_dirs,
                                   pownorms, nstats, lfsparms);
             if(blkdir != INVALID_DIR)
-               direction_map[bi] = blkdir;
+               job->direction_map[bi] = blkdir;
             /* Otherwise current direction in Direction Map remains INVALID */
             else
                /* Flag the block as having LOW RIDGE FLOW. */
-               low_flow_map[bi] = TRUE;
+               job->low_flow_map[bi] = TRUE;
          }
 
       } /* End DFT */
@@ -439,12 +396,263 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
    g_free(powmax_dirs);
    g_free(pownorms);
 
-   *odmap = direction_map;
-   *olcmap = low_contrast_map;
-   *olfmap = low_flow_map;
+   band->ret = ret;
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: gen_initial_maps_worker - Thread pool entry point that analyzes one
+#cat:             band of blocks and signals its completion to the job.
+**************************************************************************/
+static void gen_initial_maps_worker(gpointer task, gpointer user_data)
+{
+   INITIAL_MAPS_BAND *band = (INITIAL_MAPS_BAND *)task;
+   INITIAL_MAPS_JOB *job = band->job;
+
+   gen_initial_maps_band(band);
+
+   g_mutex_lock(&(job->mutex));
+   job->pending -= 1;
+   if(job->pending == 0)
+      g_cond_signal(&(job->cond));
+   g_mutex_unlock(&(job->mutex));
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: get_initial_maps_pool - Returns the thread pool shared by all calls
+#cat:             to gen_initial_maps, creating it on first use, with at
+#cat:             most the given number of threads.
+**************************************************************************/
+static GThreadPool *get_initial_maps_pool(const int max_threads)
+{
+   static gsize pool = 0;
+
+   if(g_once_init_enter(&pool)){
+      GThreadPool *p;
+
+      p = g_thread_pool_new(gen_initial_maps_worker, NULL,
+                            max_threads, FALSE, NULL);
+      g_once_init_leave(&pool, (gsize)p);
+   }
+   /* The limit changes with the parameters of the caller. */
+   else if(g_thread_pool_get_max_threads((GThreadPool *)pool) != max_threads)
+      g_thread_pool_set_max_threads((GThreadPool *)pool, max_threads, NULL);
+
+   return((GThreadPool *)pool);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: gen_initial_maps - Creates an initial Direction Map from the given
+#cat:             input image.  It very important that the image be properly
+#cat:             padded so that rotated grids along the boundary of the image
+#cat:             do not access unkown memory.  The rotated grids are used by a
+#cat:             DFT-based analysis to determine the integer directions
+#cat:             in the map. Typically this initial vector of directions will
+#cat:             subsequently have weak or inconsistent directions removed
+#cat:             followed by a smoothing process.  The resulting Direction
+#cat:             Map contains valid directions >= 0 and INVALID values = -1.
+#cat:             This routine also computes and returns 2 other image maps.
+#cat:             The Low Contrast Map flags blocks in the image with
+#cat:             insufficient contrast.  Blocks with low contrast have a
+#cat:             corresponding direction of INVALID in the Direction Map.
+#cat:             The Low Flow Map flags blocks in which the DFT analyses
+#cat:             could not determine a significant ridge flow.  Blocks with
+#cat:             low ridge flow also have a corresponding direction of
+#cat:             INVALID in the Direction Map.
+#cat:             Blocks are analyzed independently, in bands of block rows
+#cat:             that are spread over a thread pool of up to
+#cat:             lfsparms->max_threads threads.
+
+   Input:
+      blkoffs   - offsets to the pixel origin of each block in the padded image
+      mw        - number of blocks horizontally in the padded input image
+      mh        - number of blocks vertically in the padded input image
+      pdata     - padded input image data (8 bits [0..256) grayscale)
+      pw        - width (in pixels) of the padded input image
+      ph        - height (in pixels) of the padded input image
+      dftwaves  - structure containing the DFT wave forms
+      dftgrids  - structure containing the rotated pixel grid offsets
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      odmap     - points to the newly created Direction Map
+      olcmap    - points to the newly created Low Contrast Map
+   Return Code:
+      Zero     - successful completion
+      Negative - system error
+**************************************************************************/
+int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
+                int *blkoffs, const int mw, const int mh,
+                unsigned char *pdata, const int pw, const int ph,
+                const DFTWAVES *dftwaves, const  ROTGRIDS *dftgrids,
+                const LFSPARMS *lfsparms)
+{
+   INITIAL_MAPS_JOB job;
+   INITIAL_MAPS_BAND *bands;
+   int bsize, nbands, band_blocks, i;
+#ifndef LOG_REPORT
+   int max_threads;
+#endif
+   int ret; /* return code */
+
+   print2log("INITIAL MAP\n");
+
+   /* Compute total number of blocks in map */
+   ASSERT_INT_MUL(mw, mh);
+   bsize = mw * mh;
+
+   /* Allocate Direction Map memory */
+   job.direction_map = (int *)g_malloc(bsize * sizeof(int));
+   /* Initialize the Direction Map to INVALID (-1). */
+   memset(job.direction_map, INVALID_DIR, bsize * sizeof(int));
+
+   /* Allocate Low Contrast Map memory */
+   job.low_contrast_map = (int *)g_malloc(bsize * sizeof(int));
+   /* Initialize the Low Contrast Map to FALSE (0). */
+   memset(job.low_contrast_map, 0, bsize * sizeof(int));
+
+   /* Allocate Low Ridge Flow Map memory */
+   job.low_flow_map = (int *)g_malloc(bsize * sizeof(int));
+   /* Initialize the Low Flow Map to FALSE (0). */
+   memset(job.low_flow_map, 0, bsize * sizeof(int));
+
+   job.blkoffs = blkoffs;
+   job.mw = mw;
+   job.pdata = pdata;
+   job.pw = pw;
+   job.ph = ph;
+   job.dftwaves = dftwaves;
+   job.dftgrids = dftgrids;
+   job.lfsparms = lfsparms;
+   job.pending = 0;
+
+   /* Split the map into bands of block rows. */
+   band_blocks = INITIAL_MAPS_BAND_ROWS * mw;
+   nbands = (bsize + band_blocks - 1) / band_blocks;
+   bands = (INITIAL_MAPS_BAND *)g_malloc(max(nbands, 1) *
+                                         sizeof(INITIAL_MAPS_BAND));
+   for(i = 0; i < nbands; i++){
+      bands[i].job = &job;
+      bands[i].from_bi = i * band_blocks;
+      bands[i].to_bi = min((i + 1) * band_blocks, bsize);
+      bands[i].ret = 0;
+   }
+
+#ifndef LOG_REPORT
+   /* The log report is written block by block, so keep it serial. */
+   max_threads = lfsparms->max_threads > 0 ? lfsparms->max_threads :
+                                            (int)g_get_num_processors();
+   if((nbands > 1) && (max_threads > 1)){
+      GThreadPool *pool = get_initial_maps_pool(max_threads);
+
+      g_mutex_init(&(job.mutex));
+      g_cond_init(&(job.cond));
+
+      g_mutex_lock(&(job.mutex));
+      for(i = 0; i < nbands; i++){
+         job.pending += 1;
+         g_thread_pool_push(pool, &(bands[i]), NULL);
+      }
+      while(job.pending > 0)
+         g_cond_wait(&(job.cond), &(job.mutex));
+      g_mutex_unlock(&(job.mutex));
+
+      g_mutex_clear(&(job.mutex));
+      g_cond_clear(&(job.cond));
+   }
+   else
+#endif
+   {
+      for(i = 0; i < nbands; i++){
+         gen_initial_maps_band(&(bands[i]));
+         if(bands[i].ret)
+            break;
+      }
+   }
+
+   /* Report the error of the first failing band, if any. */
+   ret = 0;
+   for(i = 0; (i < nbands) && !ret; i++)
+      ret = bands[i].ret;
+   g_free(bands);
+
+   if(ret){
+      /* Free memory allocated to this point. */
+      g_free(job.direction_map);
+      g_free(job.low_contrast_map);
+      g_free(job.low_flow_map);
+      return(ret);
+   }
+
+   *odmap = job.direction_map;
+   *olcmap = job.low_contrast_map;
+   *olfmap = job.low_flow_map;
    return(0);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: find_valid_nbrs - Finds for every block the nearest block with a
+#cat:             valid direction in each of the four directions, as
+#cat:             find_valid_block() would, but in one pass over the maps
+#cat:             per direction instead of one walk per block.
+
+   Input:
+      direction_map    - map of blocks containing directional ridge flow
+      low_contrast_map - map of blocks flagged as LOW CONTRAST
+      mw        - number of blocks horizontally in the maps
+      mh        - number of blocks vertically in the maps
+   Output:
+      nbrs      - four maps with the index of the neighbor to the north,
+                  east, south and west of each block, -1 if there is none
+**************************************************************************/
+static void find_valid_nbrs(int *nbrs, const int *direction_map,
+                      const int *low_contrast_map, const int mw, const int mh)
+{
+   int *n_nbrs = nbrs, *e_nbrs = nbrs + mw*mh;
+   int *s_nbrs = nbrs + 2*mw*mh, *w_nbrs = nbrs + 3*mw*mh;
+   int x, y, i, nbr;
+
+   /* A walk stops at the first LOW CONTRAST or valid block, so the   */
+   /* neighbor of a block is the one of the block before it, unless   */
+   /* that block itself stops the walk.                               */
+#define NEXT_NBR(i, nbr) \
+   ((low_contrast_map[i]) ? -1 : ((direction_map[i] >= 0) ? (i) : (nbr)))
+
+   for(x = 0; x < mw; x++){
+      nbr = -1;
+      for(y = 0; y < mh; y++){
+         i = y*mw + x;
+         n_nbrs[i] = nbr;
+         nbr = NEXT_NBR(i, nbr);
+      }
+      nbr = -1;
+      for(y = mh-1; y >= 0; y--){
+         i = y*mw + x;
+         s_nbrs[i] = nbr;
+         nbr = NEXT_NBR(i, nbr);
+      }
+   }
+
+   for(y = 0; y < mh; y++){
+      nbr = -1;
+      for(x = 0; x < mw; x++){
+         i = y*mw + x;
+         w_nbrs[i] = nbr;
+         nbr = NEXT_NBR(i, nbr);
+      }
+      nbr = -1;
+      for(x = mw-1; x >= 0; x--){
+         i = y*mw + x;
+         e_nbrs[i] = nbr;
+         nbr = NEXT_NBR(i, nbr);
+      }
+   }
+
+#undef NEXT_NBR
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: interpolate_direction_map - Take a Direction Map and Low Contrast
@@ -478,8 +686,9 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
    int n_dist = 0, e_dist = 0, s_dist = 0, w_dist = 0, total_dist;
    int n_found, e_found, s_found, w_found, total_found;
    int n_delta = 0, e_delta = 0, s_delta = 0, w_delta = 0, total_delta;
-   int nbr_x, nbr_y;
+   int nbr, nbr_x, nbr_y;
    int *omap, *dptr, *cptr, *optr;
+   int *nbrs;
    double avr_dir;
 
    print2log("INTERPOLATE DIRECTION MAP\n");
@@ -489,6 +698,11 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
    ASSERT_SIZE_MUL(mw * mh, sizeof(int));
    omap = (int *)g_malloc(mw * mh * sizeof(int));
 
+   /* The neighbors only depend on the input maps. */
+   ASSERT_SIZE_MUL(mw * mh * sizeof(int), 4);
+   nbrs = (int *)g_malloc(4 * mw * mh * sizeof(int));
+   find_valid_nbrs(nbrs, direction_map, low_contrast_map, mw, mh);
+
    /* Set pointers to the first block in the maps. */
    dptr = direction_map;
    cptr = low_contrast_map;
@@ -506,9 +720,11 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
             total_dist = 0;
 
             /* Find north neighbor. */
-            if((n_found = find_valid_block(&n_dir, &nbr_x, &nbr_y,
-                                            direction_map, low_contrast_map,
-                                            x, y, mw, mh, 0, -1)) == FOUND){
+            nbr = nbrs[0*mw*mh + y*mw + x];
+            if((n_found = (nbr >= 0) ? FOUND : NOT_FOUND) == FOUND){
+               n_dir = direction_map[nbr];
+               nbr_x = nbr % mw;
+               nbr_y = nbr / mw;
                /* Compute north distance. */
                n_dist = y - nbr_y;
                /* Accumulate neighbor distance. */
@@ -518,9 +734,11 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
             }
 
             /* Find east neighbor. */
-            if((e_found = find_valid_block(&e_dir, &nbr_x, &nbr_y,
-                                            direction_map, low_contrast_map,
-                                            x, y, mw, mh, 1, 0)) == FOUND){
+            nbr = nbrs[1*mw*mh + y*mw + x];
+            if((e_found = (nbr >= 0) ? FOUND : NOT_FOUND) == FOUND){
+               e_dir = direction_map[nbr];
+               nbr_x = nbr % mw;
+               nbr_y = nbr / mw;
                /* Compute east distance. */
                e_dist = nbr_x - x;
                /* Accumulate neighbor distance. */
@@ -530,9 +748,11 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
             }
 
             /* Find south neighbor. */
-            if((s_found = find_valid_block(&s_dir, &nbr_x, &nbr_y,
-                                            direction_map, low_contrast_map,
-                                            x, y, mw, mh, 0, 1)) == FOUND){
+            nbr = nbrs[2*mw*mh + y*mw + x];
+            if((s_found = (nbr >= 0) ? FOUND : NOT_FOUND) == FOUND){
+               s_dir = direction_map[nbr];
+               nbr_x = nbr % mw;
+               nbr_y = nbr / mw;
                /* Compute south distance. */
                s_dist = nbr_y - y;
                /* Accumulate neighbor distance. */
@@ -542,9 +762,11 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
             }
 
             /* Find west neighbor. */
-            if((w_found = find_valid_block(&w_dir, &nbr_x, &nbr_y,
-                                            direction_map, low_contrast_map,
-                                            x, y, mw, mh, -1, 0)) == FOUND){
+            nbr = nbrs[3*mw*mh + y*mw + x];
+            if((w_found = (nbr >= 0) ? FOUND : NOT_FOUND) == FOUND){
+               w_dir = direction_map[nbr];
+               nbr_x = nbr % mw;
+               nbr_y = nbr / mw;
                /* Compute west distance. */
                w_dist = x - nbr_x;
                /* Accumulate neighbor distance. */
@@ -628,6 +850,7 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
    memcpy(direction_map, omap, mw*mh*sizeof(int));
    /* Deallocate the working memory. */
    g_free(omap);
+   g_free(nbrs);
 
    /* Return normally. */
    return(0);
@@ -78,6 +78,8 @@ of the software.
                         choose_scan_direction()
                         scan4minutiae()
                         scan4minutiae_horizontally()
+                        next_scan_transition()
+                        next_vertical_transition()
                         scan4minutiae_horizontally_V2()
                         scan4minutiae_vertically()
                         scan4minutiae_vertically_V2()
@@ -99,8 +101,17 @@ of the software.
 ***********************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 #include <lfs.h>
 
+/* Whether a pixel pair of the 0/1 binary image differs from the pair  */
+/* before it along the scan while its own two pixels differ.  Only such */
+/* pairs can be the second pair of one of the g_feature_patterns[], as  */
+/* all of those are made of two different pixels and follow a first    */
+/* pair that is not the same. This also works bytewise on 64-bit words. */
+#define SCAN_TRANSITION(p1, p2, p1prev, p2prev) \
+      (((p1) ^ (p2)) & (((p1) ^ (p1prev)) | ((p2) ^ (p2prev))))
+
 /*************************************************************************
 **************************************************************************
 #cat: alloc_minutiae - Allocates and initializes a minutia list based on the
@@ -1025,6 +1036,76 @@ int choose_scan_direction(const int imapval, const int ndirs)
       Negative  - system error
 **************************************************************************/
 
+/*************************************************************************
+**************************************************************************
+#cat: next_scan_transition - Returns the index of the next pixel pair along
+#cat:                a scan that could be the second pair of a feature, in
+#cat:                the sense of SCAN_TRANSITION.  Pixel pairs are compared
+#cat:                eight at a time by skipping 64-bit words with none.
+
+   Input:
+      p1      - first pixels of the pixel pairs
+      p2      - second pixels of the pixel pairs
+      p1prev  - first pixels of the pairs preceding each pair in the scan
+      p2prev  - second pixels of the pairs preceding each pair in the scan
+      i       - index of the pixel pair to start from
+      n       - number of pixel pairs
+   Return Code:
+      index of the next transition, or n if there is none
+**************************************************************************/
+static int next_scan_transition(const unsigned char *p1,
+                const unsigned char *p2, const unsigned char *p1prev,
+                const unsigned char *p2prev, int i, const int n)
+{
+   guint64 w1, w2, w1prev, w2prev;
+
+   for(; i + 8 <= n; i += 8){
+      memcpy(&w1, p1+i, sizeof(w1));
+      memcpy(&w2, p2+i, sizeof(w2));
+      memcpy(&w1prev, p1prev+i, sizeof(w1prev));
+      memcpy(&w2prev, p2prev+i, sizeof(w2prev));
+      if(SCAN_TRANSITION(w1, w2, w1prev, w2prev))
+         break;
+   }
+
+   for(; i < n; i++){
+      if(SCAN_TRANSITION(p1[i], p2[i], p1prev[i], p2prev[i]))
+         return(i);
+   }
+
+   return(n);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: next_vertical_transition - Returns the next y-coord along a vertical
+#cat:                scan at which the pixel pair could be the second pair
+#cat:                of a feature, in the sense of SCAN_TRANSITION.
+
+   Input:
+      bdata     - binary image data (0==while & 1==black)
+      iw        - width (in pixels) of image
+      cx        - x-coord of the first of the two scan columns
+      cy        - y-coord to start at, at least 1
+      ey        - y-coord of the end of the scan columns
+   Return Code:
+      y-coord of the next transition, or ey if there is none
+**************************************************************************/
+static int next_vertical_transition(const unsigned char *bdata,
+                const int iw, const int cx, int cy, const int ey)
+{
+   const unsigned char *pptr;
+
+   pptr = bdata+(cy*iw)+cx;
+   for(; cy < ey; cy++){
+      if(SCAN_TRANSITION(pptr[0], pptr[1], pptr[-iw], pptr[1-iw]))
+         return(cy);
+      pptr += iw;
+   }
+
+   return(ey);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: scan4minutiae_horizontally_V2 - Scans an entire binary image
@@ -1052,7 +1133,7 @@ int scan4minutiae_horizontally_V2(MINUTIAE *minutiae,
                 const LFSPARMS *lfsparms)
 {
    int sx, sy, ex, ey, cx, cy, x2;
-   unsigned char *p1ptr, *p2ptr;
+   unsigned char *p1ptr, *p2ptr, *p1row, *p2row;
    int possible[NFEATURES], nposs;
    int ret;
 
@@ -1068,12 +1149,19 @@ int scan4minutiae_horizontally_V2(MINUTIAE *minutiae,
    while(cy+1 < ey){
       /* Start at beginning of new scan row in region. */
       cx = sx;
+      p1row = bdata+(cy*iw);
+      p2row = p1row+iw;
       /* While not at end of region's current scan row. */
       while(cx < ex){
+         /* Pixel pairs up to the one before the next transition can */
+         /* neither start nor continue a feature, so skip them.      */
+         if(cx+1 < ex)
+            cx = next_scan_transition(p1row, p2row, p1row-1, p2row-1,
+                                      cx+1, ex) - 1;
          /* Get pixel pair from current x position in current and next */
          /* scan rows. */
-         p1ptr = bdata+(cy*iw)+cx;
-         p2ptr = bdata+((cy+1)*iw)+cx;
+         p1ptr = p1row+cx;
+         p2ptr = p2row+cx;
          /* If scan pixel pair matches first pixel pair of */
          /* 1 or more features... */
          if(match_1st_pair(*p1ptr, *p2ptr, possible, &nposs)){
@@ -1221,6 +1309,10 @@ int scan4minutiae_vertically_V2(MINUTIAE *minutiae,
       cy = sy;
       /* While not at end of region's current scan column. */
       while(cy < ey){
+         /* Pixel pairs up to the one before the next transition can */
+         /* neither start nor continue a feature, so skip them.      */
+         if(cy+1 < ey)
+            cy = next_vertical_transition(bdata, iw, cx, cy+1, ey) - 1;
          /* Get pixel pair from current y position in current and next */
          /* scan columns. */
          p1ptr = bdata+(cy*iw)+cx;
@@ -214,13 +214,29 @@ int gen_quality_map(int **oqmap, int *direction_map, int *low_contrast_map,
       Zero       - successful completion
       Negative   - system error
 ************************************************************************/
+/* Looks up the block of the quality map that covers an image pixel, the */
+/* same way pixelize_map() would expand it: the last column and row of   */
+/* blocks are aligned to the right and bottom edges of the image and    */
+/* cover the blocks before them where they overlap.                     */
+static int quality_map_value(const int *quality_map, const int mw,
+             const int mh, const int blocksize, const int iw, const int ih,
+             const int x, const int y)
+{
+   int bx, by;
+
+   bx = (x >= iw - blocksize) ? mw - 1 : x / blocksize;
+   by = (y >= ih - blocksize) ? mh - 1 : y / blocksize;
+
+   return(quality_map[(by * mw) + bx]);
+}
+
 int combined_minutia_quality(MINUTIAE *minutiae,
              int *quality_map, const int mw, const int mh, const int blocksize,
              unsigned char *idata, const int iw, const int ih, const int id,
              const double ppmm)
 {
-   int ret, i, index, radius_pix;
-   int *pquality_map, qmap_value;
+   int i, radius_pix;
+   int qmap_value;
    MINUTIA *minutia;
    double gs_reliability, reliability;
 
@@ -235,10 +251,14 @@ int combined_minutia_quality(MINUTIAE *minutiae,
    /* Compute pixel radius of neighborhood based on image's scan resolution. */
    radius_pix = sround(RADIUS_MM * ppmm);
 
-   /* Expand block map values to pixel map. */
-   if((ret = pixelize_map(&pquality_map, iw, ih,
-                         quality_map, mw, mh, blocksize))){
-      return(ret);
+   /* Only the blocks under the minutiae are looked at, so the map is */
+   /* not expanded to a pixel map first.                              */
+   if((iw < blocksize) || (ih < blocksize) ||
+      (mw != (iw + blocksize - 1) / blocksize) ||
+      (mh != (ih + blocksize - 1) / blocksize)){
+      fprintf(stderr,
+         "ERROR : combined_minutia_quality : block dimensions do not match\n");
+      return(-591);
    }
 
    /* Foreach minutiae detected ... */
@@ -251,10 +271,8 @@ int combined_minutia_quality(MINUTIAE *minutiae,
                                              idata, iw, ih, radius_pix);
 
       /* Lookup quality map value. */
-      /* Compute minutia pixel index. */
-      index = (minutia->y * iw) + minutia->x;
-      /* Switch on pixel's quality value ... */
-      qmap_value = pquality_map[index];
+      qmap_value = quality_map_value(quality_map, mw, mh, blocksize,
+                                     iw, ih, minutia->x, minutia->y);
 
       /* Combine grayscale reliability and quality map value. */
       switch(qmap_value){
@@ -283,15 +301,11 @@ int combined_minutia_quality(MINUTIAE *minutiae,
             fprintf(stderr, "ERROR : combined_miutia_quality : ");
             fprintf(stderr, "unexpected quality map value %d ", qmap_value);
             fprintf(stderr, "not in range [0..4]\n");
-            g_free(pquality_map);
             return(-3);
       }
       minutia->reliability = reliability;
    }
 
-   /* NEW 05-08-2002 */
-   g_free(pquality_map);
-
    /* Return normally. */
    return(0);
 }
@@ -359,12 +373,8 @@ void get_neighborhood_stats(double *mean, double *stdev, MINUTIA *minutia,
                      unsigned char *idata, const int iw, const int ih,
                      const int radius_pix)
 {
-   int i, x, y, rows, cols;
-   int n = 0, sumX = 0, sumXX = 0;
-   int histogram[256];
-
-   /* Zero out histogram. */
-   memset(histogram, 0, 256 * sizeof(int));
+   int x, y, rows, cols;
+   int n, sumX = 0, sumXX = 0;
 
    /* Set minutia's coordinate variables. */
    x = minutia->x;
@@ -385,26 +395,21 @@ void get_neighborhood_stats(double *mean, double *stdev, MINUTIA *minutia,
    for(rows = y - radius_pix;
        rows <= y + radius_pix;
        rows++){
-      /* Foreach column in neighborhood ... */
-      for(cols = x - radius_pix;
-          cols <= x + radius_pix;
-          cols++){
-         /* Bump neighbor's pixel value bin in histogram. */
-         histogram[*(idata+(rows * iw)+cols)]++;
+      const unsigned char *row = idata + (rows * iw) + x - radius_pix;
+      int rowX = 0, rowXX = 0;
+
+      /* Accumulate Sum(X[i]) and Sum(X[i]^2) directly, which gives */
+      /* the same sums as going through a histogram and vectorizes. */
+      for(cols = 0; cols <= 2 * radius_pix; cols++){
+         rowX += row[cols];
+         rowXX += row[cols] * row[cols];
       }
+      sumX += rowX;
+      sumXX += rowXX;
    }
 
-   /* Foreach grayscale pixel bin ... */
-   for(i = 0; i < 256; i++){
-      if(histogram[i]){
-         /* Accumulate Sum(X[i]) */
-         sumX += (i * histogram[i]);
-         /* Accumulate Sum(X[i]^2) */
-         sumXX += (i * i * histogram[i]);
-         /* Accumulate N samples */
-         n += histogram[i];
-      }
-   }
+   /* N samples */
+   n = (2 * radius_pix + 1) * (2 * radius_pix + 1);
 
    /* Mean = Sum(X[i])/N */
    *mean = sumX/(double)n;
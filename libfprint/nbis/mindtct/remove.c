@@ -76,6 +76,7 @@ of the software.
 ***********************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <lfs.h>
 #include <log.h>
 
@@ -291,7 +292,7 @@ int remove_hooks(MINUTIAE *minutiae,
 {
    int *to_remove;
    int i, f, s, ret;
-   int delta_y, full_ndirs, qtr_ndirs, deltadir, min_deltadir;
+   int delta_x, delta_y, full_ndirs, qtr_ndirs, deltadir, min_deltadir;
    MINUTIA *minutia1, *minutia2;
    double dist;
 
@@ -367,9 +368,16 @@ int remove_hooks(MINUTIAE *minutiae,
 
                   print2log("1DY ");
 
+                  /* A pair further apart than the threshold along x is */
+                  /* also too far apart, so skip the square root.       */
+                  delta_x = abs(minutia2->x - minutia1->x);
+
                   /* Compute Euclidean distance between 1st & 2nd mintuae. */
-                  dist = distance(minutia1->x, minutia1->y,
-                                  minutia2->x, minutia2->y);
+                  if(delta_x > lfsparms->max_rmtest_dist)
+                     dist = delta_x;
+                  else
+                     dist = distance(minutia1->x, minutia1->y,
+                                     minutia2->x, minutia2->y);
                   /* If distance is NOT too large (ex. < 8 pixels) ... */
                   if(dist <= lfsparms->max_rmtest_dist){
 
@@ -537,7 +545,7 @@ int remove_islands_and_lakes(MINUTIAE *minutiae,
 {
    int *to_remove;
    int i, f, s, ret;
-   int delta_y, full_ndirs, qtr_ndirs, deltadir, min_deltadir;
+   int delta_x, delta_y, full_ndirs, qtr_ndirs, deltadir, min_deltadir;
    int *loop_x, *loop_y, *loop_ex, *loop_ey, nloop;
    MINUTIA *minutia1, *minutia2;
    double dist;
@@ -626,10 +634,18 @@ int remove_islands_and_lakes(MINUTIAE *minutiae,
 
                      print2log("1DY ");
 
+                     /* A pair further apart than the threshold along */
+                     /* x is also too far apart, so skip the square   */
+                     /* root.                                         */
+                     delta_x = abs(minutia2->x - minutia1->x);
+
                      /* Compute Euclidean distance between 1st & 2nd */
                      /* mintuae.                                     */
-                     dist = distance(minutia1->x, minutia1->y,
-                                     minutia2->x, minutia2->y);
+                     if(delta_x > dist_thresh)
+                        dist = delta_x;
+                     else
+                        dist = distance(minutia1->x, minutia1->y,
+                                        minutia2->x, minutia2->y);
 
                      /* If distance is NOT too large (ex. <16 pixels)... */
                      if(dist <= dist_thresh){
@@ -1060,11 +1076,11 @@ int remove_near_invblock_V2(MINUTIAE *minutiae, int *direction_map,
    /*                           |    |                       */
 
    /* LUT for starting neighbor index given (ix, iy).        */
-   static int startblk[9] = { 6, 0, 0,
+   static const int startblk[9] = { 6, 0, 0,
                               6,-1, 2,
                               4, 4, 2 };
    /* LUT for ending neighbor index given (ix, iy).          */
-   static int endblk[9] =   { 8, 0, 2,
+   static const int endblk[9] =   { 8, 0, 2,
                               6,-1, 2,
                               6, 4, 4 };
 
@@ -1078,8 +1094,8 @@ int remove_near_invblock_V2(MINUTIAE *minutiae, int *direction_map,
    /*                      5 4 3                                    */
    /*                                                               */
    /*                       0  1  2  3  4  5  6  7  8                    */
-   static int blkdx[9] = {  0, 1, 1, 1, 0,-1,-1,-1, 0 };  /* Delta-X     */
-   static int blkdy[9] = { -1,-1, 0, 1, 1, 1, 0,-1,-1 };  /* Delta-Y     */
+   static const int blkdx[9] = {  0, 1, 1, 1, 0,-1,-1,-1, 0 };  /* Delta-X     */
+   static const int blkdy[9] = { -1,-1, 0, 1, 1, 1, 0,-1,-1 };  /* Delta-Y     */
 
    print2log("\nREMOVING MINUTIA NEAR INVALID BLOCKS:\n");
 
@@ -1355,7 +1371,7 @@ int remove_overlaps(MINUTIAE *minutiae,
 {
    int *to_remove;
    int i, f, s, ret;
-   int delta_y, full_ndirs, qtr_ndirs, deltadir, min_deltadir;
+   int delta_x, delta_y, full_ndirs, qtr_ndirs, deltadir, min_deltadir;
    MINUTIA *minutia1, *minutia2;
    double dist;
    int joindir, opp1dir, half_ndirs;
@@ -1434,9 +1450,16 @@ int remove_overlaps(MINUTIAE *minutiae,
 
                   print2log("1DY ");
 
+                  /* A pair further apart than the threshold along x is */
+                  /* also too far apart, so skip the square root.       */
+                  delta_x = abs(minutia2->x - minutia1->x);
+
                   /* Compute Euclidean distance between 1st & 2nd mintuae. */
-                  dist = distance(minutia1->x, minutia1->y,
-                                  minutia2->x, minutia2->y);
+                  if(delta_x > lfsparms->max_overlap_dist)
+                     dist = delta_x;
+                  else
+                     dist = distance(minutia1->x, minutia1->y,
+                                     minutia2->x, minutia2->y);
                   /* If distance is NOT too large (ex. < 8 pixels) ... */
                   if(dist <= lfsparms->max_overlap_dist){
 
@@ -69,6 +69,34 @@ of the software.
 
 #include <stdio.h>
 #include <lfs.h>
+
+/* Coordinate lists for the trajectories between minutiae, allocated */
+/* once large enough for any line within the image and then reused.  */
+typedef struct linebuf{
+   int *xlist;
+   int *ylist;
+   int size;
+} LINEBUF;
+
+static void init_linebuf(LINEBUF *linebuf, const int iw, const int ih)
+{
+   linebuf->size = max(iw, ih) + 2;
+   /* Both lists in one piece from the detection's arena. */
+   linebuf->xlist = (int *)lfs_arena_alloc(linebuf->size * 2 * sizeof(int));
+   linebuf->ylist = linebuf->xlist + linebuf->size;
+}
+
+static void free_linebuf(LINEBUF *linebuf)
+{
+   lfs_arena_free(linebuf->xlist);
+}
+
+static int count_minutia_ridges_buf(const int, MINUTIAE *,
+                  unsigned char *, const int, const int,
+                  const LFSPARMS *, LINEBUF *);
+static int ridge_count_buf(const int, const int, MINUTIAE *,
+                  unsigned char *, const int, const int, const LFSPARMS *,
+                  LINEBUF *);
 #include <log.h>
 
 /*************************************************************************
@@ -96,6 +124,7 @@ int count_minutiae_ridges(MINUTIAE *minutiae,
 {
    int ret;
    int i;
+   LINEBUF linebuf;
 
    print2log("\nFINDING NBRS AND COUNTING RIDGES:\n");
 
@@ -109,16 +138,22 @@ int count_minutiae_ridges(MINUTIAE *minutiae,
       return(ret);
    }
 
+   init_linebuf(&linebuf, iw, ih);
+
    /* Foreach remaining sorted minutia in list ... */
    for(i = 0; i < minutiae->num-1; i++){
       /* Located neighbors and count number of ridges in between. */
       /* NOTE: neighbor and ridge count results are stored in     */
       /*       minutiae->list[i].                                 */
-      if((ret = count_minutia_ridges(i, minutiae, bdata, iw, ih, lfsparms))){
+      if((ret = count_minutia_ridges_buf(i, minutiae, bdata, iw, ih,
+                                         lfsparms, &linebuf))){
+         free_linebuf(&linebuf);
          return(ret);
       }
    }
 
+   free_linebuf(&linebuf);
+
    /* Return normally. */
    return(0);
 }
@@ -144,6 +179,21 @@ int count_minutiae_ridges(MINUTIAE *minutiae,
 int count_minutia_ridges(const int first, MINUTIAE *minutiae,
                       unsigned char *bdata, const int iw, const int ih,
                       const LFSPARMS *lfsparms)
+{
+   int ret;
+   LINEBUF linebuf;
+
+   init_linebuf(&linebuf, iw, ih);
+   ret = count_minutia_ridges_buf(first, minutiae, bdata, iw, ih,
+                                  lfsparms, &linebuf);
+   free_linebuf(&linebuf);
+
+   return(ret);
+}
+
+static int count_minutia_ridges_buf(const int first, MINUTIAE *minutiae,
+                      unsigned char *bdata, const int iw, const int ih,
+                      const LFSPARMS *lfsparms, LINEBUF *linebuf)
 {
    int i, ret, *nbr_list, *nbr_nridges, nnbrs;
 
@@ -180,7 +230,8 @@ int count_minutia_ridges(const int first, MINUTIAE *minutiae,
    /* Foreach neighbor found and sorted in list ... */
    for(i = 0; i < nnbrs; i++){
       /* Count the ridges between the primary minutia and the neighbor. */
-      ret = ridge_count(first, nbr_list[i], minutiae, bdata, iw, ih, lfsparms);
+      ret = ridge_count_buf(first, nbr_list[i], minutiae, bdata, iw, ih,
+                            lfsparms, linebuf);
       /* If system error ... */
       if(ret < 0){
          /* Deallocate working memories. */
@@ -236,7 +287,9 @@ int find_neighbors(int **onbr_list, int *onnbrs, const int max_nbrs,
 
    /* Allocate list of squared euclidean distances between neighbors */
    /* and current primary minutia point.                             */
-   nbr_sqr_dists = (double *)g_malloc(max_nbrs * sizeof(double));
+   /* It is only needed here, unlike the neighbor list that is kept  */
+   /* with the minutia, so it is taken from the detection's arena.   */
+   nbr_sqr_dists = (double *)lfs_arena_alloc(max_nbrs * sizeof(double));
 
    /* Initialize number of stored neighbors to 0. */
    nnbrs = 0;
@@ -267,7 +320,7 @@ int find_neighbors(int **onbr_list, int *onnbrs, const int max_nbrs,
          /* Append or insert the new neighbor into the neighbor lists. */
          if((ret = update_nbr_dists(nbr_list, nbr_sqr_dists, &nnbrs, max_nbrs,
                           first, second, minutiae))){
-            g_free(nbr_sqr_dists);
+            lfs_arena_free(nbr_sqr_dists);
             g_free(nbr_list);
             return(ret);
          }
@@ -284,7 +337,7 @@ int find_neighbors(int **onbr_list, int *onnbrs, const int max_nbrs,
    }
 
    /* Deallocate working memory. */
-   g_free(nbr_sqr_dists);
+   lfs_arena_free(nbr_sqr_dists);
 
    /* If no neighbors found ... */
    if(nnbrs == 0){
@@ -482,11 +535,11 @@ int sort_neighbors(int *nbr_list, const int nnbrs, const int first,
 {
    double *join_thetas, theta;
    int i;
-   static double pi2 = M_PI*2.0;
+   static const double pi2 = M_PI*2.0;
 
    /* List of angles of lines joining the current primary to each */
    /* of the secondary neighbors.                                 */
-   join_thetas = (double *)g_malloc(nnbrs * sizeof(double));
+   join_thetas = (double *)lfs_arena_alloc(nnbrs * sizeof(double));
 
    for(i = 0; i < nnbrs; i++){
       /* Compute angle to line connecting the 2 points.             */
@@ -508,7 +561,7 @@ int sort_neighbors(int *nbr_list, const int nnbrs, const int first,
    bubble_sort_double_inc_2(join_thetas, nbr_list, nnbrs);
 
    /* Deallocate the list of angles. */
-   g_free(join_thetas);
+   lfs_arena_free(join_thetas);
 
    /* Return normally. */
    return(0);
@@ -535,10 +588,27 @@ int sort_neighbors(int *nbr_list, const int nnbrs, const int first,
 int ridge_count(const int first, const int second, MINUTIAE *minutiae,
                 unsigned char *bdata, const int iw, const int ih,
                 const LFSPARMS *lfsparms)
+{
+   int ret;
+   LINEBUF linebuf;
+
+   init_linebuf(&linebuf, iw, ih);
+   ret = ridge_count_buf(first, second, minutiae, bdata, iw, ih,
+                         lfsparms, &linebuf);
+   free_linebuf(&linebuf);
+
+   return(ret);
+}
+
+static int ridge_count_buf(const int first, const int second,
+                MINUTIAE *minutiae, unsigned char *bdata,
+                const int iw, const int ih, const LFSPARMS *lfsparms,
+                LINEBUF *linebuf)
 {
    MINUTIA *minutia1, *minutia2;
    int i, ret, found;
-   int *xlist, *ylist, num;
+   const int *xlist = linebuf->xlist, *ylist = linebuf->ylist;
+   int num;
    int ridge_count, ridge_start, ridge_end;
    int prevpix, curpix;
 
@@ -553,16 +623,15 @@ int ridge_count(const int first, const int second, MINUTIAE *minutiae,
 
    /* Compute linear trajectory of contiguous pixels between first */
    /* and second minutia points.                                   */
-   if((ret = line_points(&xlist, &ylist, &num,
-                        minutia1->x, minutia1->y, minutia2->x, minutia2->y))){
+   if((ret = line_points_buf(linebuf->xlist, linebuf->ylist, linebuf->size,
+                        &num, minutia1->x, minutia1->y,
+                        minutia2->x, minutia2->y))){
       return(ret);
    }
 
    /* It there are no points on the line trajectory, then no ridges */
    /* to count (this should not happen, but just in case) ...       */
    if(num == 0){
-      g_free(xlist);
-      g_free(ylist);
       return(0);
    }
 
@@ -582,8 +651,6 @@ int ridge_count(const int first, const int second, MINUTIAE *minutiae,
 
    /* If opposite pixel not found ... then no ridges to count */
    if(!found){
-      g_free(xlist);
-      g_free(ylist);
       return(0);
    }
 
@@ -598,8 +665,6 @@ int ridge_count(const int first, const int second, MINUTIAE *minutiae,
       /* If 0-to-1 transition not found ... */
       if(!find_transition(&i, 0, 1, xlist, ylist, num, bdata, iw, ih)){
          /* Then we are done looking for ridges. */
-         g_free(xlist);
-         g_free(ylist);
 
          print2log("\n");
 
@@ -615,8 +680,6 @@ int ridge_count(const int first, const int second, MINUTIAE *minutiae,
       /* If 1-to-0 transition not found ... */
       if(!find_transition(&i, 1, 0, xlist, ylist, num, bdata, iw, ih)){
          /* Then we are done looking for ridges. */
-         g_free(xlist);
-         g_free(ylist);
 
          print2log("\n");
 
@@ -642,8 +705,6 @@ int ridge_count(const int first, const int second, MINUTIAE *minutiae,
 
       /* If system error ... */
       if(ret < 0){
-         g_free(xlist);
-         g_free(ylist);
          /* Return the error code. */
          return(ret);
       }
@@ -662,8 +723,6 @@ int ridge_count(const int first, const int second, MINUTIAE *minutiae,
    }
 
    /* Deallocate working memories. */
-   g_free(xlist);
-   g_free(ylist);
 
    print2log("\n");
 
@@ -57,6 +57,8 @@ of the software.
                ROUTINES:
                         sort_indices_int_inc()
                         sort_indices_double_inc()
+                        insertion_sort_int_inc_2()
+                        merge_sort_int_inc_2()
                         bubble_sort_int_inc_2()
                         bubble_sort_double_inc_2()
                         bubble_sort_double_dec_2()
@@ -64,8 +66,13 @@ of the software.
 ***********************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 #include <lfs.h>
 
+/* Lists up to this length are insertion sorted, longer ones are merge */
+/* sorted in runs of this length.                                      */
+#define SORT_RUN_LEN 16
+
 /*************************************************************************
 **************************************************************************
 #cat: sort_indices_int_inc - Takes a list of integers and returns a list of
@@ -123,10 +130,44 @@ int sort_indices_int_inc(int **optr, int *ranks, const int num)
 
 /*************************************************************************
 **************************************************************************
-#cat: bubble_sort_int_inc_2 - Takes a list of integer ranks and a corresponding
+#cat: insertion_sort_int_inc_2 - Takes a list of integer ranks and a
+#cat:              corresponding list of integer attributes, and sorts the
+#cat:              ranks into increasing order with a stable insertion sort,
+#cat:              moving the attributes correspondingly.
+
+   Input:
+      ranks     - list of integers to be sort on
+      items     - list of corresponding integer attributes
+      len       - number of items in list
+   Output:
+      ranks     - list of integers sorted in increasing order
+      items     - list of attributes in corresponding sorted order
+**************************************************************************/
+static void insertion_sort_int_inc_2(int *ranks, int *items, const int len)
+{
+   int i, j, trank, titem;
+
+   for(i = 1; i < len; i++){
+      trank = ranks[i];
+      titem = items[i];
+      /* Shift larger ranks up, equal ones stay in front. */
+      for(j = i; (j > 0) && (ranks[j-1] > trank); j--){
+         ranks[j] = ranks[j-1];
+         items[j] = items[j-1];
+      }
+      ranks[j] = trank;
+      items[j] = titem;
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: merge_sort_int_inc_2 - Takes a list of integer ranks and a corresponding
 #cat:                         list of integer attributes, and sorts the ranks
-#cat:                         into increasing order moving the attributes
-#cat:                         correspondingly.
+#cat:                         into increasing order with a stable bottom-up
+#cat:                         merge sort, moving the attributes
+#cat:                         correspondingly.  Runs of SORT_RUN_LEN entries
+#cat:                         are insertion sorted first.
 
    Input:
       ranks     - list of integers to be sort on
@@ -136,40 +177,86 @@ int sort_indices_int_inc(int **optr, int *ranks, const int num)
       ranks     - list of integers sorted in increasing order
       items     - list of attributes in corresponding sorted order
 **************************************************************************/
-void bubble_sort_int_inc_2(int *ranks, int *items, const int len)
+static void merge_sort_int_inc_2(int *ranks, int *items, const int len)
 {
-   int done = 0;
-   int i, p, n, trank, titem;
-
-   /* Set counter to the length of the list being sorted. */
-   n = len;
-
-   /* While swaps in order continue to occur from the */
-   /* previous iteration...                           */
-   while(!done){
-      /* Reset the done flag to TRUE. */
-      done = TRUE;
-      /* Foreach rank in list up to current end index...               */
-      /* ("p" points to current rank and "i" points to the next rank.) */
-      for (i=1, p = 0; i<n; i++, p++){
-         /* If previous rank is < current rank ... */
-         if(ranks[p] > ranks[i]){
-            /* Swap ranks. */
-            trank = ranks[i];
-            ranks[i] = ranks[p];
-            ranks[p] = trank;
-            /* Swap items. */
-            titem = items[i];
-            items[i] = items[p];
-            items[p] = titem;
-            /* Changes were made, so set done flag to FALSE. */
-            done = FALSE;
+   int *tmp, *src_r, *src_i, *dst_r, *dst_i, *t;
+   int width, lo, mid, hi, a, b, k;
+
+   /* Sort short runs in place first. */
+   for(lo = 0; lo < len; lo += SORT_RUN_LEN)
+      insertion_sort_int_inc_2(ranks+lo, items+lo, min(SORT_RUN_LEN, len-lo));
+
+   tmp = (int *)g_malloc(len * 2 * sizeof(int));
+   src_r = ranks;
+   src_i = items;
+   dst_r = tmp;
+   dst_i = tmp+len;
+
+   /* Merge pairs of sorted runs, doubling their length each time. */
+   for(width = SORT_RUN_LEN; width < len; width <<= 1){
+      for(lo = 0; lo < len; lo += width<<1){
+         mid = min(lo+width, len);
+         hi = min(lo+(width<<1), len);
+         a = lo;
+         b = mid;
+         k = lo;
+         while((a < mid) && (b < hi)){
+            /* Only take from the second run if strictly smaller, so */
+            /* that equal ranks keep their order.                    */
+            if(src_r[b] < src_r[a]){
+               dst_r[k] = src_r[b];
+               dst_i[k++] = src_i[b++];
+            }
+            else{
+               dst_r[k] = src_r[a];
+               dst_i[k++] = src_i[a++];
+            }
+         }
+         while(a < mid){
+            dst_r[k] = src_r[a];
+            dst_i[k++] = src_i[a++];
+         }
+         while(b < hi){
+            dst_r[k] = src_r[b];
+            dst_i[k++] = src_i[b++];
          }
-         /* Otherwise, rank pair is in order, so continue. */
       }
-      /* Decrement the ending index. */
-      n--;
+      t = src_r; src_r = dst_r; dst_r = t;
+      t = src_i; src_i = dst_i; dst_i = t;
+   }
+
+   /* Copy the result back if it ended up in the scratch lists. */
+   if(src_r != ranks){
+      memcpy(ranks, src_r, len * sizeof(int));
+      memcpy(items, src_i, len * sizeof(int));
    }
+
+   g_free(tmp);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: bubble_sort_int_inc_2 - Takes a list of integer ranks and a corresponding
+#cat:                         list of integer attributes, and sorts the ranks
+#cat:                         into increasing order moving the attributes
+#cat:                         correspondingly.  The sort is stable, so the
+#cat:                         order is the same as that of a bubble sort;
+#cat:                         long lists are merge sorted.
+
+   Input:
+      ranks     - list of integers to be sort on
+      items     - list of corresponding integer attributes
+      len       - number of items in list
+   Output:
+      ranks     - list of integers sorted in increasing order
+      items     - list of attributes in corresponding sorted order
+**************************************************************************/
+void bubble_sort_int_inc_2(int *ranks, int *items, const int len)
+{
+   if(len > SORT_RUN_LEN)
+      merge_sort_int_inc_2(ranks, items, len);
+   else
+      insertion_sort_int_inc_2(ranks, items, len);
 }
 
 /*************************************************************************
@@ -177,7 +264,9 @@ void bubble_sort_int_inc_2(int *ranks, int *items, const int len)
 #cat: bubble_sort_double_inc_2 - Takes a list of double ranks and a
 #cat:              corresponding list of integer attributes, and sorts the
 #cat:              ranks into increasing order moving the attributes
-#cat:              correspondingly.
+#cat:              correspondingly.  The lists are short, so a stable
+#cat:              insertion sort is used, which orders them the same way
+#cat:              as a bubble sort.
 
    Input:
       ranks     - list of double to be sort on
@@ -189,46 +278,28 @@ void bubble_sort_int_inc_2(int *ranks, int *items, const int len)
 **************************************************************************/
 void bubble_sort_double_inc_2(double *ranks, int *items, const int len)
 {
-   int done = 0;
-   int i, p, n, titem;
+   int i, j, titem;
    double trank;
 
-   /* Set counter to the length of the list being sorted. */
-   n = len;
-
-   /* While swaps in order continue to occur from the */
-   /* previous iteration...                           */
-   while(!done){
-      /* Reset the done flag to TRUE. */
-      done = TRUE;
-      /* Foreach rank in list up to current end index...               */
-      /* ("p" points to current rank and "i" points to the next rank.) */
-      for (i=1, p = 0; i<n; i++, p++){
-         /* If previous rank is < current rank ... */
-         if(ranks[p] > ranks[i]){
-            /* Swap ranks. */
-            trank = ranks[i];
-            ranks[i] = ranks[p];
-            ranks[p] = trank;
-            /* Swap items. */
-            titem = items[i];
-            items[i] = items[p];
-            items[p] = titem;
-            /* Changes were made, so set done flag to FALSE. */
-            done = FALSE;
-         }
-         /* Otherwise, rank pair is in order, so continue. */
+   for(i = 1; i < len; i++){
+      trank = ranks[i];
+      titem = items[i];
+      /* Shift larger ranks up, equal ones stay in front. */
+      for(j = i; (j > 0) && (ranks[j-1] > trank); j--){
+         ranks[j] = ranks[j-1];
+         items[j] = items[j-1];
       }
-      /* Decrement the ending index. */
-      n--;
+      ranks[j] = trank;
+      items[j] = titem;
    }
 }
 
 /***************************************************************************
 **************************************************************************
-#cat: bubble_sort_double_dec_2 - Conducts a simple bubble sort returning a list
-#cat:        of ranks in decreasing order and their associated items in sorted
-#cat:        order as well.
+#cat: bubble_sort_double_dec_2 - Sorts a list of ranks into decreasing order
+#cat:        and their associated items in sorted order as well.  The lists
+#cat:        are short, so a stable insertion sort is used, which orders
+#cat:        them the same way as a bubble sort.
 
    Input:
       ranks - list of values to be sorted
@@ -242,35 +313,27 @@ void bubble_sort_double_inc_2(double *ranks, int *items, const int len)
 ****************************************************************************/
 void bubble_sort_double_dec_2(double *ranks, int *items,  const int len)
 {
-   int done = 0;
-   int i, p, n, titem;
+   int i, j, titem;
    double trank;
 
-   n = len;
-   while(!done){
-      done = 1;
-      for (i=1, p = 0;i<n;i++, p++){
-         /* If previous rank is < current rank ... */
-         if(ranks[p] < ranks[i]){
-            /* Swap ranks */
-            trank = ranks[i];
-            ranks[i] = ranks[p];
-            ranks[p] = trank;
-            /* Swap corresponding items */
-            titem = items[i];
-            items[i] = items[p];
-            items[p] = titem;
-            done = 0;
-         }
+   for(i = 1; i < len; i++){
+      trank = ranks[i];
+      titem = items[i];
+      /* Shift smaller ranks up, equal ones stay in front. */
+      for(j = i; (j > 0) && (ranks[j-1] < trank); j--){
+         ranks[j] = ranks[j-1];
+         items[j] = items[j-1];
       }
-      n--;
+      ranks[j] = trank;
+      items[j] = titem;
    }
 }
 
 /*************************************************************************
 **************************************************************************
 #cat: bubble_sort_int_inc - Takes a list of integers and sorts them into
-#cat:            increasing order using a simple bubble sort.
+#cat:            increasing order.  The lists are short, so an insertion
+#cat:            sort is used.
 
    Input:
       ranks     - list of integers to be sort on
@@ -280,34 +343,12 @@ void bubble_sort_double_dec_2(double *ranks, int *items,  const int len)
 **************************************************************************/
 void bubble_sort_int_inc(int *ranks, const int len)
 {
-   int done = 0;
-   int i, p, n;
-   int trank;
-
-   /* Set counter to the length of the list being sorted. */
-   n = len;
-
-   /* While swaps in order continue to occur from the */
-   /* previous iteration...                           */
-   while(!done){
-      /* Reset the done flag to TRUE. */
-      done = TRUE;
-      /* Foreach rank in list up to current end index...               */
-      /* ("p" points to current rank and "i" points to the next rank.) */
-      for (i=1, p = 0; i<n; i++, p++){
-         /* If previous rank is < current rank ... */
-         if(ranks[p] > ranks[i]){
-            /* Swap ranks. */
-            trank = ranks[i];
-            ranks[i] = ranks[p];
-            ranks[p] = trank;
-            /* Changes were made, so set done flag to FALSE. */
-            done = FALSE;
-         }
-         /* Otherwise, rank pair is in order, so continue. */
-      }
-      /* Decrement the ending index. */
-      n--;
+   int i, j, trank;
+
+   for(i = 1; i < len; i++){
+      trank = ranks[i];
+      for(j = i; (j > 0) && (ranks[j-1] > trank); j--)
+         ranks[j] = ranks[j-1];
+      ranks[j] = trank;
    }
 }
-
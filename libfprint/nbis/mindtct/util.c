@@ -65,6 +65,11 @@ of the software.
                         angle2line()
                         line2direction()
                         closest_dir_dist()
+                        init_lfsarena()
+                        free_lfsarena()
+                        set_lfsarena()
+                        lfs_arena_alloc()
+                        lfs_arena_free()
 ***********************************************************************/
 
 #include <stdio.h>
@@ -518,7 +523,7 @@ int line2direction(const int fx, const int fy,
 {
    double theta, pi_factor;
    int idir, full_ndirs;
-   static double pi2 = M_PI*2.0;
+   static const double pi2 = M_PI*2.0;
 
    /* Compute angle to line connecting the 2 points.             */
    /* Coordinates are swapped and order of points reversed to    */
@@ -587,3 +592,180 @@ int closest_dir_dist(const int dir1, const int dir2, const int ndirs)
    return(dist);
 }
 
+/* The arena of the detection running on the current thread, if any. */
+static GPrivate lfs_thread_arena;
+
+/* Offset of the first block in a chunk and size granularity of blocks. */
+#define LFS_ARENA_ALIGN     16
+#define LFS_ARENA_ROUND(n)  (((n) + LFS_ARENA_ALIGN - 1) & \
+                             ~((size_t)LFS_ARENA_ALIGN - 1))
+#define LFS_ARENA_HEADER    LFS_ARENA_ROUND(sizeof(LFSARENACHUNK))
+#define LFS_ARENA_BLOCK     LFS_ARENA_ROUND(sizeof(LFSARENABLOCK))
+
+/*************************************************************************
+**************************************************************************
+#cat: init_lfsarena - Initializes an empty scratch arena.  No memory is
+#cat:            allocated until the first allocation is made from it.
+
+   Input:
+      arena - arena to be initialized
+   Output:
+      arena - empty arena
+**************************************************************************/
+void init_lfsarena(LFSARENA *arena)
+{
+   arena->chunk = (LFSARENACHUNK *)NULL;
+   arena->top = (LFSARENABLOCK *)NULL;
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: free_lfsarena - Returns all chunks of a scratch arena to the heap,
+#cat:            invalidating every allocation still made from it.
+
+   Input:
+      arena - arena to be released
+**************************************************************************/
+void free_lfsarena(LFSARENA *arena)
+{
+   LFSARENACHUNK *chunk, *next;
+
+   if(arena->chunk == (LFSARENACHUNK *)NULL)
+      return;
+
+   /* Go back to the first chunk and free the whole chain. */
+   chunk = arena->chunk;
+   while(chunk->prev != (LFSARENACHUNK *)NULL)
+      chunk = chunk->prev;
+   while(chunk != (LFSARENACHUNK *)NULL){
+      next = chunk->next;
+      g_free(chunk);
+      chunk = next;
+   }
+
+   init_lfsarena(arena);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: set_lfsarena - Makes lfs_arena_alloc() on the calling thread draw
+#cat:            from the given arena.  Passing NULL restores the default
+#cat:            of allocating from the heap.
+
+   Input:
+      arena - arena to be used, or NULL
+   Return Code:
+      The arena that was in use before, or NULL
+**************************************************************************/
+LFSARENA *set_lfsarena(LFSARENA *arena)
+{
+   LFSARENA *prev = (LFSARENA *)g_private_get(&lfs_thread_arena);
+
+   g_private_set(&lfs_thread_arena, arena);
+
+   return(prev);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_arena_alloc - Allocates temporary memory from the arena of the
+#cat:            calling thread, or from the heap if no arena is set.
+#cat:            The memory must be released with lfs_arena_free() while
+#cat:            the same arena is still set.
+
+   Input:
+      size - number of bytes to allocate
+   Return Code:
+      Pointer to the allocated memory
+**************************************************************************/
+void *lfs_arena_alloc(const size_t size)
+{
+   LFSARENA *arena = (LFSARENA *)g_private_get(&lfs_thread_arena);
+   LFSARENACHUNK *chunk;
+   LFSARENABLOCK *block;
+   size_t need;
+
+   if(arena == (LFSARENA *)NULL)
+      return(g_malloc(size));
+
+   g_assert(size <= G_MAXSIZE - LFS_ARENA_HEADER - LFS_ARENA_BLOCK -
+                    LFS_ARENA_ALIGN);
+   need = LFS_ARENA_BLOCK + LFS_ARENA_ROUND(size);
+
+   chunk = arena->chunk;
+   if((chunk == (LFSARENACHUNK *)NULL) || (chunk->used + need > chunk->size)){
+      /* Continue in the next chunk if it was kept and is large enough. */
+      if((chunk != (LFSARENACHUNK *)NULL) &&
+         (chunk->next != (LFSARENACHUNK *)NULL) &&
+         (LFS_ARENA_HEADER + need <= chunk->next->size)){
+         chunk = chunk->next;
+      }
+      else{
+         LFSARENACHUNK *next;
+         size_t csize = max(LFS_ARENA_CHUNK_SIZE, LFS_ARENA_HEADER + need);
+
+         /* Kept chunks that are too small are replaced by a new one. */
+         if(chunk != (LFSARENACHUNK *)NULL){
+            next = chunk->next;
+            while(next != (LFSARENACHUNK *)NULL){
+               LFSARENACHUNK *tmp = next->next;
+               g_free(next);
+               next = tmp;
+            }
+         }
+
+         next = (LFSARENACHUNK *)g_malloc(csize);
+         next->prev = chunk;
+         next->next = (LFSARENACHUNK *)NULL;
+         next->size = csize;
+         if(chunk != (LFSARENACHUNK *)NULL)
+            chunk->next = next;
+         chunk = next;
+      }
+      chunk->used = LFS_ARENA_HEADER;
+      arena->chunk = chunk;
+   }
+
+   block = (LFSARENABLOCK *)((unsigned char *)chunk + chunk->used);
+   block->prev = arena->top;
+   block->chunk = chunk;
+   block->freed = FALSE;
+   chunk->used += need;
+   arena->top = block;
+
+   return((unsigned char *)block + LFS_ARENA_BLOCK);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfs_arena_free - Releases memory from lfs_arena_alloc().  Memory
+#cat:            is reused once all allocations made after it have been
+#cat:            released as well.
+
+   Input:
+      ptr - memory to be released
+**************************************************************************/
+void lfs_arena_free(void *ptr)
+{
+   LFSARENA *arena = (LFSARENA *)g_private_get(&lfs_thread_arena);
+   LFSARENABLOCK *block;
+
+   if(arena == (LFSARENA *)NULL){
+      g_free(ptr);
+      return;
+   }
+
+   if(ptr == NULL)
+      return;
+
+   block = (LFSARENABLOCK *)((unsigned char *)ptr - LFS_ARENA_BLOCK);
+   block->freed = TRUE;
+
+   /* Pop all released blocks from the top of the arena. */
+   while((arena->top != (LFSARENABLOCK *)NULL) && arena->top->freed){
+      block = arena->top;
+      arena->chunk = block->chunk;
+      block->chunk->used = (unsigned char *)block - (unsigned char *)block->chunk;
+      arena->top = block->prev;
+   }
+}
@@ -0,0 +1,169 @@
+/*
+ * Allocation counting for the libfprint tests
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Preloaded into the allocation tests with LD_PRELOAD. It replaces the
+ * malloc family with wrappers around the glibc implementation that count
+ * every allocation while counting is enabled. It must not allocate itself,
+ * so it does not use GLib.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <stddef.h>
+
+#include "alloc-counter.h"
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+extern void  __libc_free (void *ptr);
+
+#define EXPORT __attribute__((visibility ("default")))
+
+static int counting;
+static uint64_t n_allocs;
+static uint64_t n_bytes;
+static int64_t live_bytes;
+
+static inline int
+is_counting (void)
+{
+  return __atomic_load_n (&counting, __ATOMIC_RELAXED);
+}
+
+static inline void
+count_alloc (void *ptr, size_t size)
+{
+  if (!ptr || !is_counting ())
+    return;
+
+  __atomic_add_fetch (&n_allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&n_bytes, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&live_bytes, (int64_t) malloc_usable_size (ptr), __ATOMIC_RELAXED);
+}
+
+static inline void
+count_free (void *ptr)
+{
+  if (!ptr || !is_counting ())
+    return;
+
+  __atomic_sub_fetch (&live_bytes, (int64_t) malloc_usable_size (ptr), __ATOMIC_RELAXED);
+}
+
+EXPORT void *
+malloc (size_t size)
+{
+  void *ptr = __libc_malloc (size);
+
+  count_alloc (ptr, size);
+
+  return ptr;
+}
+
+EXPORT void *
+calloc (size_t n, size_t size)
+{
+  void *ptr = __libc_calloc (n, size);
+
+  count_alloc (ptr, n * size);
+
+  return ptr;
+}
+
+EXPORT void *
+realloc (void *ptr, size_t size)
+{
+  int64_t old_size = ptr ? (int64_t) malloc_usable_size (ptr) : 0;
+  void *res;
+
+  res = __libc_realloc (ptr, size);
+
+  /* A failed realloc keeps the old block */
+  if (!res && size > 0)
+    return NULL;
+
+  if (is_counting ())
+    __atomic_sub_fetch (&live_bytes, old_size, __ATOMIC_RELAXED);
+  count_alloc (res, size);
+
+  return res;
+}
+
+EXPORT void *
+memalign (size_t alignment, size_t size)
+{
+  void *ptr = __libc_memalign (alignment, size);
+
+  count_alloc (ptr, size);
+
+  return ptr;
+}
+
+EXPORT void *
+aligned_alloc (size_t alignment, size_t size)
+{
+  return memalign (alignment, size);
+}
+
+EXPORT int
+posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+  void *ptr;
+
+  if (alignment % sizeof (void *) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+
+  ptr = memalign (alignment, size);
+  if (!ptr && size > 0)
+    return ENOMEM;
+
+  *memptr = ptr;
+
+  return 0;
+}
+
+EXPORT void
+free (void *ptr)
+{
+  count_free (ptr);
+  __libc_free (ptr);
+}
+
+EXPORT void
+fpt_alloc_counter_start (void)
+{
+  __atomic_store_n (&n_allocs, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&n_bytes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&live_bytes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&counting, 1, __ATOMIC_SEQ_CST);
+}
+
+EXPORT void
+fpt_alloc_counter_stop (FptAllocCounts *counts)
+{
+  __atomic_store_n (&counting, 0, __ATOMIC_SEQ_CST);
+
+  counts->n_allocs = __atomic_load_n (&n_allocs, __ATOMIC_RELAXED);
+  counts->n_bytes = __atomic_load_n (&n_bytes, __ATOMIC_RELAXED);
+  counts->live_bytes = __atomic_load_n (&live_bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,39 @@
+/*
+ * Allocation counting for the libfprint tests
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* The allocations of all threads between fpt_alloc_counter_start() and
+ * fpt_alloc_counter_stop(). live_bytes is the growth of the memory in use,
+ * it is negative if more was freed than allocated. */
+typedef struct
+{
+  uint64_t n_allocs;
+  uint64_t n_bytes;
+  int64_t  live_bytes;
+} FptAllocCounts;
+
+typedef void (*FptAllocCounterStart)(void);
+typedef void (*FptAllocCounterStop)(FptAllocCounts *counts);
+
+/* The symbols that the counter exports when it is preloaded */
+#define FPT_ALLOC_COUNTER_START "fpt_alloc_counter_start"
+#define FPT_ALLOC_COUNTER_STOP "fpt_alloc_counter_stop"
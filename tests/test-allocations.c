@@ -0,0 +1,391 @@
+/*
+ * Allocation regression tests for libfprint
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+#include <cairo.h>
+#include <dlfcn.h>
+#include <gio/gunixsocketaddress.h>
+
+#include "drivers_api.h"
+#include "alloc-counter.h"
+#include "test-config.h"
+#include "test-device-fake.h"
+#include "test-utils.h"
+
+/*
+ * The steady state paths are run a few times to fill the pools and caches,
+ * and then measured over a number of iterations. The averages must stay
+ * below the bounds, which leave some headroom over what the paths use
+ * today so that only real regressions fail.
+ *
+ * The counter is preloaded by the build, the tests are skipped without it.
+ */
+
+#define WARMUP_ITERATIONS 3
+#define MEASURED_ITERATIONS 16
+
+/* A machine with a sub machine, none of them carrying separate data */
+#define SSM_MAX_ALLOCS 8
+#define SSM_MAX_BYTES 1024
+
+/* A verify or identify of the virtual image device, which includes
+ * receiving the image and detecting its minutiae */
+#define MATCH_MAX_ALLOCS 8192
+#define MATCH_MAX_BYTES (8 * 1024 * 1024)
+
+/* Memory that an iteration may keep, e.g. for the log of the last one */
+#define MAX_LIVE_BYTES_PER_ITERATION 1024
+
+static FptAllocCounterStart counter_start;
+static FptAllocCounterStop counter_stop;
+
+static gboolean
+counter_available (void)
+{
+  if (counter_start)
+    return TRUE;
+
+  g_test_skip ("The allocation counter is not preloaded");
+
+  return FALSE;
+}
+
+static void
+assert_counts (const char          *what,
+               const FptAllocCounts *counts,
+               guint64              max_allocs,
+               guint64              max_bytes)
+{
+  guint64 allocs = counts->n_allocs / MEASURED_ITERATIONS;
+  guint64 bytes = counts->n_bytes / MEASURED_ITERATIONS;
+  gint64 live = counts->live_bytes / MEASURED_ITERATIONS;
+
+  g_test_message ("%s: %" G_GUINT64_FORMAT " allocations, %" G_GUINT64_FORMAT
+                  " bytes, %" G_GINT64_FORMAT " bytes kept per iteration",
+                  what, allocs, bytes, live);
+
+  g_assert_cmpuint (allocs, <=, max_allocs);
+  g_assert_cmpuint (bytes, <=, max_bytes);
+  g_assert_cmpint (live, <=, MAX_LIVE_BYTES_PER_ITERATION);
+}
+
+/* State machines of the fake device */
+
+static FpDevice *fake_device = NULL;
+
+enum {
+  SSM_STATE_0,
+  SSM_STATE_SUBSM,
+  SSM_STATE_2,
+  SSM_STATE_NUM
+};
+
+static void
+child_ssm_handler (FpiSsm *ssm, FpDevice *dev)
+{
+  fpi_ssm_next_state (ssm);
+}
+
+static void
+parent_ssm_handler (FpiSsm *ssm, FpDevice *dev)
+{
+  guint *counter = fpi_ssm_get_data (ssm);
+
+  *counter += 1;
+
+  if (fpi_ssm_get_cur_state (ssm) == SSM_STATE_SUBSM)
+    fpi_ssm_start_subsm (ssm, fpi_ssm_new (dev, child_ssm_handler, SSM_STATE_NUM));
+  else
+    fpi_ssm_next_state (ssm);
+}
+
+static void
+parent_ssm_completed (FpiSsm *ssm, FpDevice *dev, GError *error)
+{
+  g_assert_no_error (error);
+  g_assert_cmpuint (*(guint *) fpi_ssm_get_data (ssm), ==, SSM_STATE_NUM);
+}
+
+static void
+run_ssm (void)
+{
+  FpiSsm *ssm;
+
+  ssm = fpi_ssm_new_with_data (fake_device, parent_ssm_handler,
+                               SSM_STATE_NUM, sizeof (guint));
+  fpi_ssm_start (ssm, parent_ssm_completed);
+}
+
+static void
+test_allocations_ssm (void)
+{
+  FptAllocCounts counts;
+  guint i;
+
+  if (!counter_available ())
+    return;
+
+  for (i = 0; i < WARMUP_ITERATIONS; i++)
+    run_ssm ();
+
+  counter_start ();
+  for (i = 0; i < MEASURED_ITERATIONS; i++)
+    run_ssm ();
+  counter_stop (&counts);
+
+  assert_counts ("SSM", &counts, SSM_MAX_ALLOCS, SSM_MAX_BYTES);
+}
+
+/* Matching with the virtual image device */
+
+typedef struct
+{
+  FptContext        *tctx;
+  GSocketConnection *connection;
+  FpImage           *image;
+  FpPrint           *template;
+} MatchContext;
+
+static FpImage *
+load_print_image (const char *name)
+{
+  g_autofree char *filename = g_strconcat (name, ".png", NULL);
+  g_autofree char *path = NULL;
+  cairo_surface_t *surf;
+  FpImage *img;
+  guchar *data;
+  int stride;
+
+  path = g_build_path (G_DIR_SEPARATOR_S, SOURCE_ROOT, "examples", "prints", filename, NULL);
+
+  surf = cairo_image_surface_create_from_png (path);
+  g_assert_cmpint (cairo_surface_status (surf), ==, CAIRO_STATUS_SUCCESS);
+
+  img = fp_image_new (cairo_image_surface_get_width (surf),
+                      cairo_image_surface_get_height (surf));
+  data = cairo_image_surface_get_data (surf);
+  stride = cairo_image_surface_get_stride (surf);
+
+  /* The prints are in the alpha channel, as for virtual-image.py */
+  for (int y = 0; y < img->height; y++)
+    for (int x = 0; x < img->width; x++)
+      img->data[x + y * img->width] = ((guint32 *) (data + y * stride))[x] >> 24;
+
+  cairo_surface_destroy (surf);
+
+  return img;
+}
+
+static void
+on_minutiae_detected (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  gboolean *done = user_data;
+
+  g_assert_true (fp_image_detect_minutiae_finish (FP_IMAGE (source), res, &error));
+  g_assert_no_error (error);
+  *done = TRUE;
+}
+
+static FpPrint *
+create_template (FpDevice *device, FpImage *image)
+{
+  g_autoptr(GError) error = NULL;
+  FpPrint *template;
+  gboolean done = FALSE;
+
+  fp_image_detect_minutiae (image, NULL, on_minutiae_detected, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  template = fp_print_new (device);
+  fpi_print_set_type (template, FPI_PRINT_NBIS);
+  g_assert_true (fpi_print_add_from_image (template, image, &error));
+  g_assert_no_error (error);
+
+  return template;
+}
+
+static void
+send_command (MatchContext *mctx, gint32 command, gint32 value)
+{
+  g_autoptr(GError) error = NULL;
+  gint32 msg[2] = { command, value };
+  GOutputStream *out = g_io_stream_get_output_stream (G_IO_STREAM (mctx->connection));
+
+  g_assert_true (g_output_stream_write_all (out, msg, sizeof (msg), NULL, NULL, &error));
+  g_assert_no_error (error);
+}
+
+static void
+send_image (MatchContext *mctx)
+{
+  g_autoptr(GError) error = NULL;
+  GOutputStream *out = g_io_stream_get_output_stream (G_IO_STREAM (mctx->connection));
+
+  send_command (mctx, mctx->image->width, mctx->image->height);
+  g_assert_true (g_output_stream_write_all (out, mctx->image->data,
+                                            mctx->image->width * mctx->image->height,
+                                            NULL, NULL, &error));
+  g_assert_no_error (error);
+}
+
+static MatchContext *
+match_context_new (void)
+{
+  g_autoptr(GSocketClient) client = g_socket_client_new ();
+  g_autoptr(GSocketAddress) address = NULL;
+  g_autoptr(GError) error = NULL;
+  MatchContext *mctx = g_new0 (MatchContext, 1);
+
+  mctx->tctx = fpt_context_new_with_virtual_imgdev ();
+
+  fp_device_open_sync (mctx->tctx->device, NULL, &error);
+  g_assert_no_error (error);
+
+  address = g_unix_socket_address_new (g_getenv ("FP_VIRTUAL_IMAGE"));
+  mctx->connection = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (address),
+                                              NULL, &error);
+  g_assert_no_error (error);
+
+  /* Queue the images, and keep the device active in between operations
+   * so that only the steady state is measured */
+  send_command (mctx, -5, 1);
+  send_command (mctx, -6, 10000);
+
+  mctx->image = load_print_image ("whorl");
+  mctx->template = create_template (mctx->tctx->device, mctx->image);
+
+  return mctx;
+}
+
+static void
+match_context_free (MatchContext *mctx)
+{
+  g_io_stream_close (G_IO_STREAM (mctx->connection), NULL, NULL);
+  g_clear_object (&mctx->connection);
+  g_clear_object (&mctx->template);
+  g_clear_object (&mctx->image);
+  fpt_context_free (mctx->tctx);
+  g_free (mctx);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MatchContext, match_context_free)
+
+static void
+run_verify (MatchContext *mctx)
+{
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean match = FALSE;
+
+  send_image (mctx);
+  fp_device_verify_sync (mctx->tctx->device, mctx->template, NULL, NULL, NULL,
+                         &match, &print, &error);
+  g_assert_no_error (error);
+  g_assert_true (match);
+}
+
+static void
+run_identify (MatchContext *mctx, GPtrArray *gallery)
+{
+  g_autoptr(FpPrint) match = NULL;
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(GError) error = NULL;
+
+  send_image (mctx);
+  fp_device_identify_sync (mctx->tctx->device, gallery, NULL, NULL, NULL,
+                           &match, &print, &error);
+  g_assert_no_error (error);
+  g_assert_true (match == mctx->template);
+}
+
+static void
+test_allocations_verify (void)
+{
+  g_autoptr(MatchContext) mctx = NULL;
+  FptAllocCounts counts;
+  guint i;
+
+  if (!counter_available ())
+    return;
+
+  mctx = match_context_new ();
+
+  for (i = 0; i < WARMUP_ITERATIONS; i++)
+    run_verify (mctx);
+
+  counter_start ();
+  for (i = 0; i < MEASURED_ITERATIONS; i++)
+    run_verify (mctx);
+  counter_stop (&counts);
+
+  assert_counts ("Verify", &counts, MATCH_MAX_ALLOCS, MATCH_MAX_BYTES);
+}
+
+static void
+test_allocations_identify (void)
+{
+  g_autoptr(MatchContext) mctx = NULL;
+  g_autoptr(GPtrArray) gallery = NULL;
+  g_autoptr(FpImage) other = NULL;
+  FptAllocCounts counts;
+  guint i;
+
+  if (!counter_available ())
+    return;
+
+  mctx = match_context_new ();
+
+  other = load_print_image ("tented_arch");
+  gallery = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (gallery, create_template (mctx->tctx->device, other));
+  g_ptr_array_add (gallery, g_object_ref (mctx->template));
+
+  for (i = 0; i < WARMUP_ITERATIONS; i++)
+    run_identify (mctx, gallery);
+
+  counter_start ();
+  for (i = 0; i < MEASURED_ITERATIONS; i++)
+    run_identify (mctx, gallery);
+  counter_stop (&counts);
+
+  assert_counts ("Identify", &counts, MATCH_MAX_ALLOCS, MATCH_MAX_BYTES);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(FpDevice) device = NULL;
+
+  g_test_init (&argc, &argv, NULL);
+
+  counter_start = (FptAllocCounterStart) dlsym (RTLD_DEFAULT, FPT_ALLOC_COUNTER_START);
+  counter_stop = (FptAllocCounterStop) dlsym (RTLD_DEFAULT, FPT_ALLOC_COUNTER_STOP);
+
+  device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  fake_device = device;
+  g_object_add_weak_pointer (G_OBJECT (device), (gpointer) & fake_device);
+
+  g_test_add_func ("/allocations/ssm", test_allocations_ssm);
+  g_test_add_func ("/allocations/virtual-image/verify", test_allocations_verify);
+  g_test_add_func ("/allocations/virtual-image/identify", test_allocations_identify);
+
+  return g_test_run ();
+}
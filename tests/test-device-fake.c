@@ -82,6 +82,29 @@ fpi_device_fake_close (FpDevice *device)
   fpi_device_close_complete (device, fake_dev->ret_error);
 }
 
+static void
+fpi_device_fake_suspend (FpDevice *device)
+{
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+
+  fake_dev->last_called_function = fpi_device_fake_suspend;
+  g_assert_cmpuint (fpi_device_get_current_action (device), ==, FPI_DEVICE_ACTION_SUSPEND);
+
+  fpi_device_suspend_complete (device, fake_dev->ret_error);
+}
+
+static void
+fpi_device_fake_resume (FpDevice *device)
+{
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+
+  fake_dev->last_called_function = fpi_device_fake_resume;
+  g_assert_cmpuint (fpi_device_get_current_action (device), ==, FPI_DEVICE_ACTION_RESUME);
+
+  /* A failed resume reopens the device, which must succeed */
+  fpi_device_resume_complete (device, g_steal_pointer (&fake_dev->ret_error));
+}
+
 static void
 fpi_device_fake_enroll (FpDevice *device)
 {
@@ -219,6 +242,15 @@ fpi_device_fake_list (FpDevice *device)
       return;
     }
 
+  if (fake_dev->report_list && fake_dev->ret_list)
+    {
+      g_autoptr(GPtrArray) prints = g_steal_pointer (&fake_dev->ret_list);
+
+      for (guint i = 0; i < prints->len; i++)
+        if (!fpi_device_list_report (device, g_ptr_array_index (prints, i)))
+          break;
+    }
+
   fpi_device_list_complete (device, fake_dev->ret_list, fake_dev->ret_error);
 }
 
@@ -269,6 +301,8 @@ fpi_device_fake_class_init (FpiDeviceFakeClass *klass)
   dev_class->probe = fpi_device_fake_probe;
   dev_class->open = fpi_device_fake_open;
   dev_class->close = fpi_device_fake_close;
+  dev_class->suspend = fpi_device_fake_suspend;
+  dev_class->resume = fpi_device_fake_resume;
   dev_class->enroll = fpi_device_fake_enroll;
   dev_class->verify = fpi_device_fake_verify;
   dev_class->identify = fpi_device_fake_identify;
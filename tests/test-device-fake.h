@@ -38,6 +38,7 @@ struct _FpiDeviceFake
   FpiMatchResult ret_result;
   FpImage       *ret_image;
   GPtrArray     *ret_list;
+  gboolean       report_list;
 
   gpointer       action_data;
   gpointer       user_data;
@@ -92,6 +92,96 @@ test_context_enumerates_new_devices (void)
   fpt_teardown_virtual_device_environment ();
 }
 
+typedef struct
+{
+  FpContext *context;
+  GPtrArray *devices;
+  gint       done;
+} ThreadEnumerateData;
+
+static gpointer
+thread_enumerate (gpointer user_data)
+{
+  ThreadEnumerateData *data = user_data;
+
+  data->devices = fp_context_dup_devices (data->context);
+  g_atomic_int_set (&data->done, TRUE);
+  g_main_context_wakeup (NULL);
+
+  return NULL;
+}
+
+static void
+test_context_enumerates_from_thread (void)
+{
+  g_autoptr(FpContext) context = NULL;
+  g_autoptr(GPtrArray) devices = NULL;
+  ThreadEnumerateData data = { 0, };
+  GThread *thread;
+
+  fpt_setup_virtual_device_environment ();
+
+  context = fp_context_new ();
+  data.context = context;
+
+  /* The enumeration runs in whichever thread gets the main context */
+  thread = g_thread_new ("enumerate", thread_enumerate, &data);
+  while (!g_atomic_int_get (&data.done))
+    g_main_context_iteration (NULL, TRUE);
+  g_thread_join (thread);
+
+  devices = g_steal_pointer (&data.devices);
+  g_assert_nonnull (devices);
+  g_assert_cmpuint (devices->len, ==, 1);
+
+  /* Both views agree once enumerated */
+  g_assert_cmpuint (fp_context_get_devices (context)->len, ==, 1);
+  g_assert_true (g_ptr_array_index (devices, 0) ==
+                 g_ptr_array_index (fp_context_get_devices (context), 0));
+
+  fpt_teardown_virtual_device_environment ();
+}
+
+static void
+test_context_worker_budget (void)
+{
+  g_autoptr(FpContext) context = fp_context_new ();
+  gboolean efficiency_mode;
+  guint max_threads;
+  gint nice;
+
+  g_object_get (context, "max-worker-threads", &max_threads, NULL);
+  g_assert_cmpuint (max_threads, ==, MAX (g_get_num_processors (), 1));
+
+  g_object_set (context,
+                "max-worker-threads", 1,
+                "worker-nice", 5,
+                "efficiency-mode", TRUE,
+                NULL);
+  g_object_get (context,
+                "max-worker-threads", &max_threads,
+                "worker-nice", &nice,
+                "efficiency-mode", &efficiency_mode,
+                NULL);
+  g_assert_cmpuint (max_threads, ==, 1);
+  g_assert_cmpint (nice, ==, 5);
+  g_assert_true (efficiency_mode);
+
+  /* The settings are process wide */
+  g_clear_object (&context);
+  context = fp_context_new ();
+  g_object_get (context, "max-worker-threads", &max_threads, NULL);
+  g_assert_cmpuint (max_threads, ==, 1);
+
+  g_object_set (context,
+                "max-worker-threads", 0,
+                "worker-nice", 0,
+                "efficiency-mode", FALSE,
+                NULL);
+  g_object_get (context, "max-worker-threads", &max_threads, NULL);
+  g_assert_cmpuint (max_threads, ==, MAX (g_get_num_processors (), 1));
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -101,6 +191,8 @@ main (int argc, char *argv[])
   g_test_add_func ("/context/no-devices", test_context_has_no_devices);
   g_test_add_func ("/context/has-virtual-device", test_context_has_virtual_device);
   g_test_add_func ("/context/enumerates-new-devices", test_context_enumerates_new_devices);
+  g_test_add_func ("/context/enumerates-from-thread", test_context_enumerates_from_thread);
+  g_test_add_func ("/context/worker-budget", test_context_worker_budget);
 
   return g_test_run ();
 }
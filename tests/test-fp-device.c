@@ -214,6 +214,27 @@ test_device_has_storage (void)
   g_assert_false (fp_device_has_storage (tctx->device));
 }
 
+static void
+test_device_get_last_operation_stats (void)
+{
+  g_autoptr(FptContext) tctx = fpt_context_new_with_virtual_imgdev ();
+  FpOperationStats stats;
+
+  fp_device_open_sync (tctx->device, NULL, NULL);
+  g_assert_true (fp_device_get_last_operation_stats (tctx->device, &stats));
+
+  /* Opening does not scan or match anything */
+  g_assert_cmpint (stats.duration, >=, 0);
+  g_assert_cmpint (stats.time_to_finger, ==, -1);
+  g_assert_cmpint (stats.capture_time, ==, -1);
+  g_assert_cmpint (stats.minutiae_time, ==, -1);
+  g_assert_cmpint (stats.n_minutiae, ==, -1);
+  g_assert_cmpint (stats.match_time, ==, -1);
+  g_assert_cmpuint (stats.n_candidates, ==, 0);
+  g_assert_cmpuint (stats.usb_transfers, ==, 0);
+  g_assert_cmpuint (stats.retries, ==, 0);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -233,6 +254,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/device/sync/supports_identify", test_device_supports_identify);
   g_test_add_func ("/device/sync/supports_capture", test_device_supports_capture);
   g_test_add_func ("/device/sync/has_storage", test_device_has_storage);
+  g_test_add_func ("/device/sync/get_last_operation_stats", test_device_get_last_operation_stats);
 
   return g_test_run ();
 }
@@ -0,0 +1,798 @@
+/*
+ * Unit tests for libfprint image handling
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <cairo.h>
+#include "fpi-image.h"
+#include "fpi-capture-recorder.h"
+#include "fpi-worker.h"
+#include "fp-print-private.h"
+#include <nbis.h>
+#include "test-config.h"
+
+#define N_CONCURRENT_DETECTIONS 16
+
+static FpImage *
+load_capture (void)
+{
+  g_autofree char *path = NULL;
+  cairo_surface_t *surf;
+  FpImage *img;
+  guchar *data;
+  int stride;
+
+  path = g_build_path (G_DIR_SEPARATOR_S, SOURCE_ROOT, "tests", "vfs5011", "capture.png", NULL);
+
+  surf = cairo_image_surface_create_from_png (path);
+  g_assert_cmpint (cairo_surface_status (surf), ==, CAIRO_STATUS_SUCCESS);
+
+  img = fp_image_new (cairo_image_surface_get_width (surf),
+                      cairo_image_surface_get_height (surf));
+  data = cairo_image_surface_get_data (surf);
+  stride = cairo_image_surface_get_stride (surf);
+
+  for (int y = 0; y < img->height; y++)
+    for (int x = 0; x < img->width; x++)
+      img->data[x + y * img->width] = data[x * 4 + y * stride + 1];
+
+  cairo_surface_destroy (surf);
+
+  return img;
+}
+
+static FpImage *
+crop_image (FpImage *src, gint width, gint height)
+{
+  FpImage *img = fp_image_new (width, height);
+
+  for (gint y = 0; y < height; y++)
+    memcpy (img->data + y * width, src->data + y * src->width, width);
+
+  return img;
+}
+
+typedef struct
+{
+  gint pending;
+  GError *error;
+} DetectData;
+
+static void
+detect_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  DetectData *data = user_data;
+  g_autoptr(GError) error = NULL;
+
+  if (!fp_image_detect_minutiae_finish (FP_IMAGE (source), res, &error) && !data->error)
+    data->error = g_steal_pointer (&error);
+
+  data->pending--;
+}
+
+static void
+run_detection (FpImage **images, gint n_images)
+{
+  DetectData data = { .pending = n_images };
+
+  for (gint i = 0; i < n_images; i++)
+    fp_image_detect_minutiae (images[i], NULL, detect_cb, &data);
+
+  while (data.pending > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_no_error (data.error);
+}
+
+static void
+run_owned_detection (FpImage *image)
+{
+  DetectData data = { .pending = 1 };
+
+  fpi_image_detect_minutiae_owned (image, FP_IMAGE_DETECT_KEEP_BINARIZED,
+                                   NULL, detect_cb, &data);
+  while (data.pending > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_no_error (data.error);
+}
+
+static void
+assert_minutiae_coords_equal (FpImage *a, FpImage *b)
+{
+  GPtrArray *ma = fp_image_get_minutiae (a);
+  GPtrArray *mb = fp_image_get_minutiae (b);
+
+  g_assert_cmpuint (ma->len, ==, mb->len);
+  for (guint i = 0; i < ma->len; i++)
+    {
+      gint ax, ay, bx, by;
+
+      fp_minutia_get_coords (g_ptr_array_index (ma, i), &ax, &ay);
+      fp_minutia_get_coords (g_ptr_array_index (mb, i), &bx, &by);
+      g_assert_cmpint (ax, ==, bx);
+      g_assert_cmpint (ay, ==, by);
+    }
+}
+
+static void
+assert_minutiae_equal (FpImage *a, FpImage *b)
+{
+  const guchar *ba, *bb;
+  gsize la, lb;
+
+  assert_minutiae_coords_equal (a, b);
+
+  ba = fp_image_get_binarized (a, &la);
+  bb = fp_image_get_binarized (b, &lb);
+  g_assert_nonnull (ba);
+  g_assert_nonnull (bb);
+  g_assert_cmpmem (ba, la, bb, lb);
+}
+
+#define N_CONCURRENT_CAPTURES 4
+
+static void
+test_image_detect_minutiae_concurrent (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  FpImage *references[N_CONCURRENT_CAPTURES];
+  FpImage *images[N_CONCURRENT_DETECTIONS];
+
+  /* Captures of different sizes, each detected on its own first */
+  for (gint i = 0; i < N_CONCURRENT_CAPTURES; i++)
+    {
+      references[i] = crop_image (capture, capture->width - i * 24,
+                                  capture->height - i * 40);
+      run_detection (&references[i], 1);
+      g_assert_cmpuint (fp_image_get_minutiae (references[i])->len, >, 0);
+    }
+
+  for (gint i = 0; i < N_CONCURRENT_DETECTIONS; i++)
+    {
+      FpImage *reference = references[i % N_CONCURRENT_CAPTURES];
+
+      images[i] = crop_image (capture, reference->width, reference->height);
+    }
+
+  /* All detections run at the same time and must not affect each other */
+  run_detection (images, N_CONCURRENT_DETECTIONS);
+
+  for (gint i = 0; i < N_CONCURRENT_DETECTIONS; i++)
+    {
+      assert_minutiae_equal (references[i % N_CONCURRENT_CAPTURES], images[i]);
+      g_object_unref (images[i]);
+    }
+
+  for (gint i = 0; i < N_CONCURRENT_CAPTURES; i++)
+    g_object_unref (references[i]);
+}
+
+static void
+test_image_detect_minutiae_budget (void)
+{
+  g_autoptr(FpImage) reference = load_capture ();
+  g_autoptr(FpImage) inline_image = load_capture ();
+
+  run_detection (&reference, 1);
+
+  /* A budget of one thread analyzes the map blocks inline */
+  fpi_worker_set_max_threads (1);
+  run_detection (&inline_image, 1);
+  fpi_worker_set_max_threads (0);
+
+  assert_minutiae_equal (reference, inline_image);
+}
+
+static void
+test_image_detect_minutiae_sizes (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+
+  /* More sizes than detectors are cached, so both the cached and the
+   * uncached lookup tables are used, each one twice. */
+  for (gint i = 0; i < 12; i++)
+    {
+      g_autoptr(FpImage) first = crop_image (capture, capture->width - i * 2,
+                                             capture->height - i * 4);
+      g_autoptr(FpImage) second = crop_image (capture, first->width,
+                                              first->height);
+
+      run_detection (&first, 1);
+      run_detection (&second, 1);
+      assert_minutiae_equal (first, second);
+    }
+}
+
+static void
+test_image_detect_minutiae_normalize (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  g_autoptr(FpImage) flipped = fp_image_new (capture->width, capture->height);
+  gsize size = capture->width * capture->height;
+
+  /* Store the capture rotated by 180 degrees with inverted colors */
+  for (gsize i = 0; i < size; i++)
+    flipped->data[i] = 0xff - capture->data[size - i - 1];
+  flipped->flags = FPI_IMAGE_H_FLIPPED | FPI_IMAGE_V_FLIPPED | FPI_IMAGE_COLORS_INVERTED;
+
+  run_detection (&capture, 1);
+  run_detection (&flipped, 1);
+
+  g_assert_cmpint (flipped->flags, ==, 0);
+  g_assert_cmpmem (flipped->data, size, capture->data, size);
+  assert_minutiae_equal (capture, flipped);
+}
+
+static void
+test_image_detect_minutiae_in_place (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  g_autoptr(FpImage) reference = crop_image (capture, capture->width, capture->height - 1);
+  g_autoptr(FpImage) exclusive = fp_image_new (reference->width, reference->height);
+  g_autoptr(FpImage) shared = fp_image_new (reference->width, reference->height);
+  g_autoptr(FpImage) public = fp_image_new (reference->width, reference->height);
+  g_autoptr(FpImage) extra_ref = NULL;
+  gsize size = reference->width * reference->height;
+  const guchar *exclusive_data;
+  const guchar *shared_data;
+  const guchar *public_data;
+
+  /* An odd number of rows, so the middle one stays in place */
+  g_assert_cmpint (reference->height % 2, ==, 1);
+  for (gsize i = 0; i < size; i++)
+    exclusive->data[i] = shared->data[i] = public->data[i] = reference->data[size - i - 1];
+  exclusive->flags = FPI_IMAGE_H_FLIPPED | FPI_IMAGE_V_FLIPPED;
+  shared->flags = FPI_IMAGE_H_FLIPPED | FPI_IMAGE_V_FLIPPED;
+  public->flags = FPI_IMAGE_H_FLIPPED | FPI_IMAGE_V_FLIPPED;
+
+  /* Only an owned image that nobody else holds is normalized in place,
+   * the public API never modifies the data the caller may look at */
+  extra_ref = g_object_ref (shared);
+  exclusive_data = exclusive->data;
+  shared_data = shared->data;
+  public_data = public->data;
+
+  run_detection (&reference, 1);
+  run_owned_detection (exclusive);
+  run_owned_detection (shared);
+  run_detection (&public, 1);
+
+  g_assert (exclusive->data == exclusive_data);
+  g_assert (shared->data != shared_data);
+  g_assert (public->data != public_data);
+  g_assert_cmpmem (exclusive->data, size, reference->data, size);
+  g_assert_cmpmem (shared->data, size, reference->data, size);
+  g_assert_cmpmem (public->data, size, reference->data, size);
+  assert_minutiae_equal (reference, exclusive);
+  assert_minutiae_equal (reference, shared);
+  assert_minutiae_equal (reference, public);
+}
+
+static void
+test_image_detect_minutiae_same_image (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  g_autoptr(FpImage) flipped = fp_image_new (capture->width, capture->height);
+  gsize size = capture->width * capture->height;
+  FpImage *images[] = { flipped, flipped };
+
+  for (gsize i = 0; i < size; i++)
+    flipped->data[i] = capture->data[size - i - 1];
+  flipped->flags = FPI_IMAGE_H_FLIPPED | FPI_IMAGE_V_FLIPPED;
+
+  /* Both detections read the flipped data, which is normalized once */
+  run_detection (&capture, 1);
+  run_detection (images, G_N_ELEMENTS (images));
+
+  g_assert_cmpint (flipped->flags, ==, 0);
+  g_assert_cmpmem (flipped->data, size, capture->data, size);
+  assert_minutiae_equal (capture, flipped);
+}
+
+static void
+test_image_detect_minutiae_flags (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  g_autoptr(FpImage) image = load_capture ();
+  DetectData data = { .pending = 1 };
+
+  fp_image_detect_minutiae_full (image, FP_IMAGE_DETECT_NONE, NULL, detect_cb, &data);
+  while (data.pending > 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_no_error (data.error);
+
+  g_assert_null (image->binarized);
+  g_assert_null (fp_image_get_binarized (image, NULL));
+  g_assert_nonnull (fp_image_get_minutiae (image));
+
+  /* Only the binarized image is missing */
+  run_detection (&capture, 1);
+  assert_minutiae_coords_equal (capture, image);
+  g_assert_nonnull (fp_image_get_binarized (capture, NULL));
+}
+
+static FpPrint *
+new_nbis_print (void)
+{
+  FpPrint *print = g_object_new (FP_TYPE_PRINT,
+                                 "driver", "test_driver",
+                                 "device-id", "test_device",
+                                 NULL);
+
+  fpi_print_set_type (print, FPI_PRINT_NBIS);
+  return g_object_ref_sink (print);
+}
+
+static void
+test_image_print_add_after_match (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  g_autoptr(FpImage) cropped = crop_image (capture, capture->width - 32, capture->height - 48);
+  g_autoptr(FpPrint) template = new_nbis_print ();
+  g_autoptr(FpPrint) fresh = new_nbis_print ();
+  g_autoptr(FpPrint) probe = new_nbis_print ();
+  g_autoptr(FpPrint) cropped_probe = new_nbis_print ();
+  g_autoptr(GError) error = NULL;
+  FpImage *images[] = { capture, cropped };
+
+  run_detection (images, G_N_ELEMENTS (images));
+
+  g_assert_true (fpi_print_add_from_image (template, capture, &error));
+  g_assert_true (fpi_print_add_from_image (probe, capture, &error));
+  g_assert_true (fpi_print_add_from_image (cropped_probe, cropped, &error));
+  g_assert_no_error (error);
+
+  /* Builds the cached match data for a single print */
+  g_assert_cmpint (fpi_print_bz3_match (template, probe, 40, &error), ==, FPI_MATCH_SUCCESS);
+  g_assert_no_error (error);
+  fp_print_get_digest (template);
+
+  /* Which must not be used once another print is added */
+  g_assert_true (fpi_print_add_from_image (template, cropped, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (fpi_print_get_n_xyt (template), ==, 2);
+
+  g_assert_true (fpi_print_add_from_image (fresh, capture, &error));
+  g_assert_true (fpi_print_add_from_image (fresh, cropped, &error));
+  g_assert_no_error (error);
+  g_assert_cmpstr (fp_print_get_digest (template), ==, fp_print_get_digest (fresh));
+
+  g_assert_cmpint (fpi_print_bz3_match (template, cropped_probe, 40, &error), ==,
+                   fpi_print_bz3_match (fresh, cropped_probe, 40, NULL));
+  g_assert_no_error (error);
+  g_assert_cmpint (fpi_print_bz3_match (template, probe, 40, &error), ==, FPI_MATCH_SUCCESS);
+  g_assert_no_error (error);
+}
+
+static void
+test_image_detect_minutiae_region (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  g_autoptr(FpImage) framed = NULL;
+  GPtrArray *minutiae;
+  const guchar *binarized;
+  gint x0 = 96, y0 = 64;
+  gint x, y, w, h;
+  gsize len;
+
+  /* The capture in the middle of a much larger, empty, sensor area */
+  framed = fp_image_new (capture->width * 3, capture->height * 3);
+  memset (framed->data, 0xff, framed->width * framed->height);
+  for (y = 0; y < capture->height; y++)
+    memcpy (framed->data + (y0 + y) * framed->width + x0,
+            capture->data + y * capture->width, capture->width);
+
+  g_assert_true (fpi_image_get_covered_area (framed, 16, 64, &x, &y, &w, &h));
+  g_assert_cmpint (x, >=, x0);
+  g_assert_cmpint (y, >=, y0);
+  g_assert_cmpint (x + w, <=, x0 + capture->width);
+  g_assert_cmpint (y + h, <=, y0 + capture->height);
+
+  run_detection (&framed, 1);
+
+  /* Results are in the coordinates of the full image */
+  minutiae = fp_image_get_minutiae (framed);
+  g_assert_cmpuint (minutiae->len, >, 0);
+  for (guint i = 0; i < minutiae->len; i++)
+    {
+      fp_minutia_get_coords (g_ptr_array_index (minutiae, i), &x, &y);
+      g_assert_cmpint (x, >=, x0);
+      g_assert_cmpint (y, >=, y0);
+      g_assert_cmpint (x, <, x0 + capture->width);
+      g_assert_cmpint (y, <, y0 + capture->height);
+    }
+
+  binarized = fp_image_get_binarized (framed, &len);
+  g_assert_cmpuint (len, ==, framed->width * framed->height);
+  g_assert_cmpint (binarized[0], ==, 0xff);
+  g_assert_cmpint (binarized[len - 1], ==, 0xff);
+}
+
+static void
+test_image_coverage (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  g_autoptr(FpImage) blank = fp_image_new (capture->width, capture->height);
+
+  g_assert_cmpfloat (fpi_image_get_coverage (capture, 16, 64), >, 0.5);
+
+  memset (blank->data, 0xc0, blank->width * blank->height);
+  g_assert_cmpfloat (fpi_image_get_coverage (blank, 16, 64), ==, 0.0);
+}
+
+static void
+test_image_resize (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  g_autoptr(FpImage) same = fpi_image_resize (capture, 1, 1);
+  g_autoptr(FpImage) wide = fpi_image_resize (capture, 3, 1);
+  g_autoptr(FpImage) flat = fp_image_new (17, 9);
+  g_autoptr(FpImage) flat_large = NULL;
+
+  g_assert_cmpmem (same->data, same->width * same->height,
+                   capture->data, capture->width * capture->height);
+
+  /* Pixels centered on a source pixel keep its value */
+  g_assert_cmpint (wide->width, ==, capture->width * 3);
+  g_assert_cmpint (wide->height, ==, capture->height);
+  for (gint y = 0; y < capture->height; y++)
+    for (gint x = 0; x < capture->width; x++)
+      g_assert_cmpint (wide->data[x * 3 + 1 + y * wide->width], ==,
+                       capture->data[x + y * capture->width]);
+
+  memset (flat->data, 0x80, flat->width * flat->height);
+  flat_large = fpi_image_resize (flat, 2, 3);
+  for (gint i = 0; i < flat_large->width * flat_large->height; i++)
+    g_assert_cmpint (flat_large->data[i], ==, 0x80);
+}
+
+static void
+test_image_row_helpers (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  const guint8 *a = capture->data;
+  const guint8 *b = capture->data + capture->width;
+  g_autofree guint8 *row = g_memdup (a, capture->width);
+  guint64 sum = 0, sq_sum = 0, sq_dev = 0;
+  gint n = capture->width;
+  gint mean;
+
+  /* Odd length so that the vectorized and the scalar paths are used */
+  n -= (n % 16) == 0 ? 1 : 0;
+
+  for (gint i = 0; i < n; i++)
+    {
+      sum += a[i];
+      sq_sum += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+  mean = sum / n;
+  for (gint i = 0; i < n; i++)
+    sq_dev += (a[i] - mean) * (a[i] - mean);
+
+  g_assert_cmpint (fpi_std_sq_dev (a, n), ==, sq_dev / n);
+  g_assert_cmpint (fpi_mean_sq_diff_norm (a, b, n), ==, sq_sum / n);
+
+  sum = 0;
+  for (gint i = 0; i < n; i++)
+    sum += ABS (a[i] - b[i]);
+  g_assert_cmpuint (fpi_sum_abs_diff (a, b, n), ==, sum);
+  g_assert_cmpuint (fpi_sum_abs_diff (a, a, n), ==, 0);
+
+  fpi_saturate_above (row, n, 0x80);
+  for (gint i = 0; i < n; i++)
+    g_assert_cmpint (row[i], ==, a[i] > 0x80 ? 0xff : a[i]);
+}
+
+static void
+test_image_row_helpers_perf (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  gint rows = capture->height - 1;
+  gint64 checksum = 0;
+  gdouble ns_per_line;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Only run in performance mode");
+      return;
+    }
+
+  /* Compare every line to the previous one, like the swipe drivers do */
+  g_test_timer_start ();
+  for (gint i = 0; i < 1000; i++)
+    for (gint y = 0; y < rows; y++)
+      {
+        const guint8 *line = capture->data + y * capture->width;
+
+        checksum += fpi_std_sq_dev (line, capture->width);
+        checksum += fpi_mean_sq_diff_norm (line, line + capture->width, capture->width);
+      }
+  ns_per_line = g_test_timer_elapsed () * 1e9 / (1000.0 * rows);
+
+  g_test_minimized_result (ns_per_line, "%.1f ns per line (checksum %" G_GINT64_FORMAT ")",
+                           ns_per_line, checksum);
+}
+
+static gint n_freed = 0;
+
+static void
+free_counted (gpointer data)
+{
+  n_freed++;
+  g_free (data);
+}
+
+static void
+test_image_adopt_data (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  gsize size = capture->width * capture->height;
+  FpImage *img;
+  guint8 *data;
+
+  /* The buffer is used as is and released through the destroy notify */
+  data = g_memdup (capture->data, size);
+  img = fpi_image_new_for_data (capture->width, capture->height, data, free_counted);
+  g_assert_true (img->data == data);
+  g_object_unref (img);
+  g_assert_cmpint (n_freed, ==, 1);
+
+  /* Sole owner GBytes are adopted without a copy */
+  data = g_memdup (capture->data, size);
+  img = fpi_image_new_from_bytes (capture->width, capture->height,
+                                  g_bytes_new_take (data, size));
+  g_assert_true (img->data == data);
+
+  run_detection (&img, 1);
+  run_detection (&capture, 1);
+  assert_minutiae_equal (capture, img);
+  g_object_unref (img);
+}
+
+static void
+test_image_capture_archive (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  g_autoptr(FpImage) frame = fpi_image_downsample (capture, 2);
+  g_autoptr(FpiCaptureRecorder) recorder = NULL;
+  g_autoptr(FpiCaptureReader) reader = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *contents = NULL;
+  FpiCaptureRecord record;
+  gsize length;
+  gint fd;
+
+  fd = g_file_open_tmp ("fprint-capture-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  capture->flags = FPI_IMAGE_V_FLIPPED;
+
+  recorder = fpi_capture_recorder_new (path, FPI_LZ4, &error);
+  g_assert_no_error (error);
+  fpi_capture_recorder_add_session (recorder, "virtual_image", "test");
+  fpi_capture_recorder_add_finger_status (recorder, TRUE);
+  fpi_capture_recorder_add_image (recorder, FPI_CAPTURE_RECORD_FRAME, frame);
+  fpi_capture_recorder_add_image (recorder, FPI_CAPTURE_RECORD_IMAGE, capture);
+  g_clear_pointer (&recorder, fpi_capture_recorder_free);
+
+  /* A record cut short by a killed process ends the archive, and the
+   * archive is not appended to anymore */
+  g_file_get_contents (path, &contents, &length, &error);
+  g_assert_no_error (error);
+  g_file_set_contents (path, contents, length - 1, &error);
+  g_assert_no_error (error);
+
+  reader = fpi_capture_reader_new (path, &error);
+  g_assert_no_error (error);
+  g_assert_true (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_true (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_true (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_cmpint (record.type, ==, FPI_CAPTURE_RECORD_FRAME);
+  g_assert_false (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&reader, fpi_capture_reader_free);
+
+  recorder = fpi_capture_recorder_new (path, FALSE, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (recorder);
+  g_clear_error (&error);
+
+  g_file_set_contents (path, contents, length, &error);
+  g_assert_no_error (error);
+  recorder = fpi_capture_recorder_new (path, FALSE, &error);
+  g_assert_no_error (error);
+  fpi_capture_recorder_add_finger_status (recorder, FALSE);
+  g_clear_pointer (&recorder, fpi_capture_recorder_free);
+
+  reader = fpi_capture_reader_new (path, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_cmpint (record.type, ==, FPI_CAPTURE_RECORD_SESSION);
+  g_assert_cmpstr (record.driver, ==, "virtual_image");
+  g_assert_cmpstr (record.device_id, ==, "test");
+
+  g_assert_true (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_cmpint (record.type, ==, FPI_CAPTURE_RECORD_FINGER);
+  g_assert_true (record.finger_present);
+
+  g_assert_true (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_cmpint (record.type, ==, FPI_CAPTURE_RECORD_FRAME);
+  g_assert_cmpuint (record.image->width, ==, frame->width);
+  g_assert_cmpuint (record.image->height, ==, frame->height);
+  g_assert_cmpmem (record.image->data, frame->width * frame->height,
+                   frame->data, frame->width * frame->height);
+
+  g_assert_true (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_cmpint (record.type, ==, FPI_CAPTURE_RECORD_IMAGE);
+  g_assert_cmpfloat (record.image->ppmm, ==, capture->ppmm);
+  g_assert_cmpint (record.image->flags, ==, FPI_IMAGE_V_FLIPPED);
+  g_assert_cmpmem (record.image->data, capture->width * capture->height,
+                   capture->data, capture->width * capture->height);
+  g_assert_cmpint (record.timestamp, >=, 0);
+
+  g_assert_true (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_cmpint (record.type, ==, FPI_CAPTURE_RECORD_FINGER);
+  g_assert_false (record.finger_present);
+
+  g_assert_false (fpi_capture_reader_next (reader, &record, &error));
+  g_assert_no_error (error);
+
+  g_unlink (path);
+}
+
+static void
+test_image_dft_powers (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  const LFSPARMS *lfsparms = &g_lfsparms_V2;
+  g_autofree int *rowsums = NULL;
+  LFSDETECTOR *detector;
+  DFTWAVES odd_waves;
+  const DFTWAVES *waves;
+  const ROTGRIDS *grids;
+  unsigned char *pdata;
+  double **powers, **ref;
+  int pw, ph;
+
+  g_assert_cmpint (init_lfsdetector (&detector, capture->width, capture->height, lfsparms), ==, 0);
+  g_assert_cmpint (pad_uchar_image (&pdata, &pw, &ph, capture->data,
+                                    capture->width, capture->height,
+                                    detector->maxpad, lfsparms->pad_value), ==, 0);
+  bits_8to6 (pdata, pw, ph);
+
+  waves = detector->dftwaves;
+  grids = detector->dftgrids;
+  g_assert_cmpint (alloc_dir_powers (&powers, waves->nwaves, grids->ngrids), ==, 0);
+  g_assert_cmpint (alloc_dir_powers (&ref, waves->nwaves, grids->ngrids), ==, 0);
+  rowsums = g_new (int, grids->grid_w);
+
+  /* One less wave takes the generic kernel, which has a scalar tail */
+  odd_waves = *waves;
+  odd_waves.nwaves--;
+  g_assert_cmpint (odd_waves.nwaves % 2, ==, 1);
+
+  /* The (possibly vectorized) powers must match the scalar reference */
+  for (gint pass = 0; pass < 2; pass++)
+    {
+      const DFTWAVES *pass_waves = pass == 0 ? waves : &odd_waves;
+
+      for (gint y = 0; y + grids->grid_h <= capture->height; y += lfsparms->blocksize)
+        for (gint x = 0; x + grids->grid_w <= capture->width; x += lfsparms->blocksize)
+          {
+            gint offset = (y + detector->maxpad) * pw + x + detector->maxpad;
+
+            g_assert_cmpint (dft_dir_powers (powers, pdata, offset, pw, ph, pass_waves, grids), ==, 0);
+
+            for (gint dir = 0; dir < grids->ngrids; dir++)
+              {
+                sum_rot_block_rows (rowsums, pdata + offset, grids->grids[dir], grids->grid_w);
+                for (gint w = 0; w < pass_waves->nwaves; w++)
+                  dft_power (&ref[w][dir], rowsums, pass_waves->waves[w], pass_waves->wavelen);
+              }
+
+            for (gint w = 0; w < pass_waves->nwaves; w++)
+              g_assert_cmpmem (powers[w], grids->ngrids * sizeof (double),
+                               ref[w], grids->ngrids * sizeof (double));
+          }
+    }
+
+  free_dir_powers (powers, waves->nwaves);
+  free_dir_powers (ref, waves->nwaves);
+  free_lfsdetector (detector);
+  g_free (pdata);
+}
+
+static void
+test_image_binarize (void)
+{
+  g_autoptr(FpImage) capture = load_capture ();
+  const LFSPARMS *lfsparms = &g_lfsparms_V2;
+  g_autofree int *direction_map = NULL;
+  LFSDETECTOR *detector;
+  const ROTGRIDS *grids;
+  unsigned char *pdata, *bdata;
+  int pw, ph, bw, bh, mw, mh;
+
+  g_assert_cmpint (init_lfsdetector (&detector, capture->width, capture->height, lfsparms), ==, 0);
+  grids = detector->dirbingrids;
+  g_assert_cmpint (pad_uchar_image (&pdata, &pw, &ph, capture->data,
+                                    capture->width, capture->height,
+                                    grids->pad, lfsparms->pad_value), ==, 0);
+  bits_8to6 (pdata, pw, ph);
+
+  /* Every direction and invalid blocks, with runs of equal blocks */
+  mw = (capture->width + lfsparms->blocksize - 1) / lfsparms->blocksize;
+  mh = (capture->height + lfsparms->blocksize - 1) / lfsparms->blocksize;
+  direction_map = g_new (int, mw * mh);
+  for (gint i = 0; i < mw * mh; i++)
+    direction_map[i] = (i / 3) % (grids->ngrids + 1) - 1;
+
+  g_assert_cmpint (binarize_image_V2 (&bdata, &bw, &bh, pdata, pw, ph,
+                                      direction_map, mw, mh,
+                                      lfsparms->blocksize, grids), ==, 0);
+  g_assert_cmpint (bw, ==, capture->width);
+  g_assert_cmpint (bh, ==, capture->height);
+
+  /* The specialized kernels must match the generic scalar one */
+  for (gint y = 0; y < bh; y++)
+    for (gint x = 0; x < bw; x++)
+      {
+        int dir = direction_map[(y / lfsparms->blocksize) * mw + x / lfsparms->blocksize];
+        int expected = WHITE_PIXEL;
+
+        if (dir != INVALID_DIR)
+          expected = dirbinarize (pdata + (y + grids->pad) * pw + x + grids->pad, dir, grids);
+        g_assert_cmpint (bdata[y * bw + x], ==, expected);
+      }
+
+  free_lfsdetector (detector);
+  g_free (pdata);
+  g_free (bdata);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/image/detect-minutiae-concurrent", test_image_detect_minutiae_concurrent);
+  g_test_add_func ("/image/detect-minutiae-budget", test_image_detect_minutiae_budget);
+  g_test_add_func ("/image/detect-minutiae-sizes", test_image_detect_minutiae_sizes);
+  g_test_add_func ("/image/detect-minutiae-normalize", test_image_detect_minutiae_normalize);
+  g_test_add_func ("/image/detect-minutiae-in-place", test_image_detect_minutiae_in_place);
+  g_test_add_func ("/image/detect-minutiae-same-image", test_image_detect_minutiae_same_image);
+  g_test_add_func ("/image/detect-minutiae-flags", test_image_detect_minutiae_flags);
+  g_test_add_func ("/image/detect-minutiae-region", test_image_detect_minutiae_region);
+  g_test_add_func ("/image/print-add-after-match", test_image_print_add_after_match);
+  g_test_add_func ("/image/coverage", test_image_coverage);
+  g_test_add_func ("/image/resize", test_image_resize);
+  g_test_add_func ("/image/row-helpers", test_image_row_helpers);
+  g_test_add_func ("/image/row-helpers-perf", test_image_row_helpers_perf);
+  g_test_add_func ("/image/adopt-data", test_image_adopt_data);
+  g_test_add_func ("/image/capture-archive", test_image_capture_archive);
+  g_test_add_func ("/image/dft-powers", test_image_dft_powers);
+  g_test_add_func ("/image/binarize", test_image_binarize);
+
+  return g_test_run ();
+}
@@ -19,6 +19,7 @@
  */
 
 #include <glib.h>
+#include <string.h>
 #include <cairo.h>
 #include "fpi-assembling.h"
 #include "fpi-image.h"
@@ -53,6 +54,35 @@ cairo_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
   return c_frame->data[x * 4 + y * c_frame->stride + 1];
 }
 
+typedef struct
+{
+  struct fpi_frame frame;
+  guchar          *data;
+  guint            width;
+  guint            y;
+} packed_frame;
+
+static unsigned char
+packed_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
+                  struct fpi_frame           *frame,
+                  unsigned int                x,
+                  unsigned int                y)
+{
+  packed_frame *p_frame = (void *) frame;
+
+  return p_frame->data[x + (y + p_frame->y) * p_frame->width];
+}
+
+static const unsigned char *
+packed_get_row (struct fpi_frame_asmbl_ctx *ctx,
+                struct fpi_frame           *frame,
+                unsigned int                y)
+{
+  packed_frame *p_frame = (void *) frame;
+
+  return p_frame->data + (y + p_frame->y) * p_frame->width;
+}
+
 static void
 test_frame_assembling (void)
 {
@@ -126,12 +156,551 @@ test_frame_assembling (void)
   g_assert (1);
 }
 
+/* Converts the green channel of the test capture to rows of 8-bit pixels */
+static guchar *
+load_packed_capture (int *width, int *height)
+{
+  g_autofree char *path = NULL;
+  cairo_surface_t *img = NULL;
+  guchar *packed, *data;
+  int stride;
+
+  path = g_build_path (G_DIR_SEPARATOR_S, SOURCE_ROOT, "tests", "vfs5011", "capture.png", NULL);
+
+  img = cairo_image_surface_create_from_png (path);
+  data = cairo_image_surface_get_data (img);
+  *width = cairo_image_surface_get_width (img);
+  *height = cairo_image_surface_get_height (img);
+  stride = cairo_image_surface_get_stride (img);
+
+  packed = g_malloc (*width * *height);
+  for (int y = 0; y < *height; y++)
+    for (int x = 0; x < *width; x++)
+      packed[x + y * *width] = data[x * 4 + y * stride + 1];
+
+  cairo_surface_destroy (img);
+
+  return packed;
+}
+
+static GSList *
+packed_frames_new (guchar *packed, int width, int height, int frame_height, int offset)
+{
+  GSList *frames = NULL;
+
+  for (int y = 0; y + frame_height < height; y += offset)
+    {
+      packed_frame *frame = g_new0 (packed_frame, 1);
+
+      frame->data = packed;
+      frame->width = width;
+      frame->y = y;
+
+      frames = g_slist_append (frames, frame);
+    }
+
+  return frames;
+}
+
+static void
+assert_frame_deltas (GSList *frames, int offset)
+{
+  for (GSList *l = frames->next; l != NULL; l = l->next)
+    {
+      packed_frame *frame = l->data;
+
+      g_assert_cmpint (frame->frame.delta_x, ==, 0);
+      g_assert_cmpint (frame->frame.delta_y, ==, offset);
+    }
+}
+
+static void
+test_frame_assembling_rows (void)
+{
+  g_autofree guchar *packed = NULL;
+  g_autoptr(FpImage) img_pixels = NULL;
+  g_autoptr(FpImage) img_rows = NULL;
+  struct fpi_frame_asmbl_ctx ctx = { 0, };
+  GSList *frames = NULL;
+  gsize len_pixels, len_rows;
+  int width, height;
+  int offset = 7;
+
+  packed = load_packed_capture (&width, &height);
+
+  ctx.get_pixel = packed_get_pixel;
+  ctx.frame_width = width;
+  ctx.frame_height = 20;
+  ctx.image_width = width;
+
+  frames = packed_frames_new (packed, width, height, ctx.frame_height, offset);
+
+  fpi_do_movement_estimation (&ctx, frames);
+  assert_frame_deltas (frames, offset);
+
+  /* The row based error calculation must give the same result */
+  ctx.get_row = packed_get_row;
+  fpi_do_movement_estimation (&ctx, frames);
+  assert_frame_deltas (frames, offset);
+
+  /* And so must blitting whole rows */
+  ctx.get_row = NULL;
+  img_pixels = fpi_assemble_frames (&ctx, frames);
+  ctx.get_row = packed_get_row;
+  img_rows = fpi_assemble_frames (&ctx, frames);
+  g_assert_cmpuint (fp_image_get_height (img_rows), ==, fp_image_get_height (img_pixels));
+  g_assert_cmpmem (fp_image_get_data (img_rows, &len_rows), len_rows,
+                   fp_image_get_data (img_pixels, &len_pixels), len_pixels);
+
+  g_slist_free_full (frames, g_free);
+}
+
+static void
+test_frame_assembling_hierarchical (void)
+{
+  g_autofree guchar *packed = NULL;
+  struct fpi_frame_asmbl_ctx ctx = { 0, };
+  int width, height;
+
+  packed = load_packed_capture (&width, &height);
+
+  ctx.get_pixel = packed_get_pixel;
+  ctx.frame_width = width;
+  ctx.frame_height = 16;
+  ctx.image_width = width;
+  ctx.hierarchical_search = TRUE;
+
+  for (int offset = 2; offset < ctx.frame_height; offset += 3)
+    {
+      GSList *frames = packed_frames_new (packed, width, height, ctx.frame_height, offset);
+
+      fpi_do_movement_estimation (&ctx, frames);
+      assert_frame_deltas (frames, offset);
+
+      ctx.get_row = packed_get_row;
+      fpi_do_movement_estimation (&ctx, frames);
+      assert_frame_deltas (frames, offset);
+      ctx.get_row = NULL;
+
+      g_slist_free_full (frames, g_free);
+    }
+}
+
+static void
+test_frame_assembling_stream (void)
+{
+  g_autofree guchar *packed = NULL;
+  g_autoptr(FpImage) img = NULL;
+  g_autoptr(FpImage) stream_img = NULL;
+  struct fpi_frame_asmbl_ctx ctx = { 0, };
+  struct fpi_frame_asmbl_stream *stream;
+  GSList *frames = NULL;
+  int width, height;
+  int offset = 9;
+
+  packed = load_packed_capture (&width, &height);
+
+  ctx.get_pixel = packed_get_pixel;
+  ctx.frame_width = width;
+  ctx.frame_height = 20;
+  ctx.image_width = width;
+
+  /* Swipe in the reverse direction */
+  frames = g_slist_reverse (packed_frames_new (packed, width, height, ctx.frame_height, offset));
+
+  stream = fpi_frame_asmbl_stream_new (&ctx);
+  for (GSList *l = frames; l != NULL; l = l->next)
+    fpi_frame_asmbl_stream_push_frame (stream, g_memdup (l->data, sizeof (packed_frame)));
+  stream_img = fpi_frame_asmbl_stream_finish (stream);
+
+  fpi_do_movement_estimation (&ctx, frames);
+  img = fpi_assemble_frames (&ctx, frames);
+
+  /* Assembling incrementally must give the same image */
+  g_assert_nonnull (stream_img);
+  g_assert_cmpint (stream_img->width, ==, img->width);
+  g_assert_cmpint (stream_img->height, ==, img->height);
+  g_assert_cmpint (stream_img->flags, ==, img->flags);
+  g_assert_cmpmem (stream_img->data, stream_img->width * stream_img->height,
+                   img->data, img->width * img->height);
+
+  g_slist_free_full (frames, g_free);
+}
+
+static void
+test_frame_assembling_duplicates (void)
+{
+  g_autofree guchar *packed = NULL;
+  g_autoptr(FpImage) img = NULL;
+  g_autoptr(FpImage) dup_img = NULL;
+  g_autoptr(FpImage) stream_img = NULL;
+  struct fpi_frame_asmbl_ctx ctx = { 0, };
+  struct fpi_frame_asmbl_stream *stream;
+  GSList *frames = NULL;
+  GSList *dup_frames = NULL;
+  int width, height;
+  int offset = 7;
+  int i = 0;
+
+  packed = load_packed_capture (&width, &height);
+
+  ctx.get_pixel = packed_get_pixel;
+  ctx.get_row = packed_get_row;
+  ctx.frame_width = width;
+  ctx.frame_height = 20;
+  ctx.image_width = width;
+  ctx.duplicate_threshold = 1;
+
+  frames = packed_frames_new (packed, width, height, ctx.frame_height, offset);
+
+  /* The finger rests for a few frames now and then */
+  for (GSList *l = frames; l != NULL; l = l->next, i++)
+    for (int n = 0; n <= i % 3; n++)
+      dup_frames = g_slist_append (dup_frames, g_memdup (l->data, sizeof (packed_frame)));
+
+  stream = fpi_frame_asmbl_stream_new (&ctx);
+  for (GSList *l = dup_frames; l != NULL; l = l->next)
+    fpi_frame_asmbl_stream_push_frame (stream, g_memdup (l->data, sizeof (packed_frame)));
+  stream_img = fpi_frame_asmbl_stream_finish (stream);
+
+  fpi_do_movement_estimation (&ctx, frames);
+  img = fpi_assemble_frames (&ctx, frames);
+
+  fpi_do_movement_estimation (&ctx, dup_frames);
+  for (GSList *l = dup_frames->next; l != NULL; l = l->next)
+    {
+      packed_frame *frame = l->data;
+
+      g_assert_cmpint (frame->frame.delta_x, ==, 0);
+      g_assert (frame->frame.delta_y == 0 || frame->frame.delta_y == offset);
+    }
+  dup_img = fpi_assemble_frames (&ctx, dup_frames);
+
+  /* Resting does not change the image */
+  g_assert_cmpint (dup_img->height, ==, img->height);
+  g_assert_cmpmem (dup_img->data, dup_img->width * dup_img->height,
+                   img->data, img->width * img->height);
+  g_assert_nonnull (stream_img);
+  g_assert_cmpmem (stream_img->data, stream_img->width * stream_img->height,
+                   img->data, img->width * img->height);
+
+  g_slist_free_full (frames, g_free);
+  g_slist_free_full (dup_frames, g_free);
+}
+
+static const unsigned char *
+ring_get_row (struct fpi_frame_asmbl_ctx *ctx,
+              struct fpi_frame           *frame,
+              unsigned int                y)
+{
+  return frame->data + y * ctx->frame_width;
+}
+
+static unsigned char
+ring_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
+                struct fpi_frame           *frame,
+                unsigned int                x,
+                unsigned int                y)
+{
+  return frame->data[x + y * ctx->frame_width];
+}
+
+static void
+test_frame_assembling_ring (void)
+{
+  g_autofree guchar *packed = NULL;
+  g_autoptr(FpImage) img = NULL;
+  g_autoptr(FpImage) ring_img = NULL;
+  struct fpi_frame_asmbl_ctx ctx = { 0, };
+  struct fpi_frame_ring *ring;
+  GSList *frames = NULL;
+  guint n_frames, i;
+  int width, height;
+  int offset = 9;
+
+  packed = load_packed_capture (&width, &height);
+
+  ctx.frame_width = width;
+  ctx.frame_height = 20;
+  ctx.image_width = width;
+
+  frames = packed_frames_new (packed, width, height, ctx.frame_height, offset);
+  n_frames = g_slist_length (frames);
+
+  /* Pushing more frames than fit drops the oldest ones */
+  ring = fpi_frame_ring_new (&ctx, n_frames);
+  for (i = 0; i < 3; i++)
+    fpi_frame_ring_push (ring);
+  g_assert_cmpuint (fpi_frame_ring_get_length (ring), ==, 3);
+  fpi_frame_ring_clear (ring);
+  g_assert_cmpuint (fpi_frame_ring_get_length (ring), ==, 0);
+
+  for (i = 0; i < 3; i++)
+    fpi_frame_ring_push (ring);
+  for (GSList *l = frames; l != NULL; l = l->next)
+    {
+      packed_frame *p_frame = l->data;
+      struct fpi_frame *frame = fpi_frame_ring_push (ring);
+
+      memcpy (frame->data, p_frame->data + p_frame->y * width, width * ctx.frame_height);
+    }
+  g_assert_cmpuint (fpi_frame_ring_get_length (ring), ==, n_frames);
+
+  ctx.get_pixel = packed_get_pixel;
+  ctx.get_row = packed_get_row;
+  fpi_do_movement_estimation (&ctx, frames);
+  img = fpi_assemble_frames (&ctx, frames);
+
+  /* The ring must give the same result as the list */
+  ctx.get_pixel = ring_get_pixel;
+  ctx.get_row = ring_get_row;
+  fpi_do_movement_estimation_ring (&ctx, ring);
+  for (i = 1; i < n_frames; i++)
+    {
+      g_assert_cmpint (fpi_frame_ring_get_frame (ring, i)->delta_x, ==, 0);
+      g_assert_cmpint (fpi_frame_ring_get_frame (ring, i)->delta_y, ==, offset);
+    }
+  ring_img = fpi_assemble_frames_ring (&ctx, ring);
+
+  g_assert_cmpint (ring_img->width, ==, img->width);
+  g_assert_cmpint (ring_img->height, ==, img->height);
+  g_assert_cmpint (ring_img->flags, ==, img->flags);
+  g_assert_cmpmem (ring_img->data, ring_img->width * ring_img->height,
+                   img->data, img->width * img->height);
+
+  fpi_frame_ring_free (ring);
+  g_slist_free_full (frames, g_free);
+}
+
+typedef struct
+{
+  guchar *data;
+  int     index;
+} packed_line;
+
+static unsigned char
+packed_line_get_pixel (struct fpi_line_asmbl_ctx *ctx,
+                       GSList                    *line,
+                       unsigned int               x)
+{
+  packed_line *l = line->data;
+
+  return l->data[x];
+}
+
+static const unsigned char *
+packed_line_get_line (struct fpi_line_asmbl_ctx *ctx,
+                      GSList                    *line)
+{
+  packed_line *l = line->data;
+
+  return l->data;
+}
+
+static int
+packed_line_get_deviation (struct fpi_line_asmbl_ctx *ctx,
+                           GSList                    *line1,
+                           GSList                    *line2)
+{
+  const unsigned char *p1 = packed_line_get_line (ctx, line1);
+  const unsigned char *p2 = packed_line_get_line (ctx, line2);
+  int res = 0;
+
+  for (int i = 0; i < ctx->line_width; i++)
+    res += (p1[i] - p2[i]) * (p1[i] - p2[i]);
+
+  return res;
+}
+
+/* Picks an arbitrary line, so that offsets cover the whole search range */
+static int
+packed_line_get_random_deviation (struct fpi_line_asmbl_ctx *ctx,
+                                  GSList                    *line1,
+                                  GSList                    *line2)
+{
+  packed_line *l1 = line1->data;
+  packed_line *l2 = line2->data;
+
+  return (l1->index * 7919 + l2->index * 104729) % 1009;
+}
+
+static int
+ref_cmpint (const void *p1, const void *p2, gpointer data)
+{
+  int a = *((int *) p1);
+  int b = *((int *) p2);
+
+  return (a > b) - (a < b);
+}
+
+/* Reference of the original sort based line assembling */
+static guchar *
+ref_assemble_lines (struct fpi_line_asmbl_ctx *ctx,
+                    GSList *lines, size_t num_lines, int *height)
+{
+  int size = num_lines / 2 - 1;
+  g_autofree int *offsets = g_new0 (int, num_lines / 2);
+  g_autofree int *filtered = g_new0 (int, num_lines / 2);
+  g_autofree int *sortbuf = g_new0 (int, ctx->median_filter_size);
+  guchar *output = g_malloc0 (ctx->line_width * ctx->max_height);
+  GSList *row1, *row2;
+  gint32 y_f = 0;
+  int line_ind = 0;
+  int i;
+
+  row1 = lines;
+  for (i = 0; (i < num_lines - 1) && row1; i += 2)
+    {
+      int bestmatch = i;
+      int bestdiff = 0;
+      int j;
+
+      row2 = g_slist_next (row1);
+      for (j = i + 1; j <= MIN (i + ctx->max_search_offset, num_lines - 1); j++)
+        {
+          int diff = ctx->get_deviation (ctx, row1, row2);
+          if ((j == i + 1) || (diff < bestdiff))
+            {
+              bestdiff = diff;
+              bestmatch = j;
+            }
+          row2 = g_slist_next (row2);
+        }
+      offsets[i / 2] = bestmatch - i;
+      row1 = g_slist_next (row1);
+      if (row1)
+        row1 = g_slist_next (row1);
+    }
+
+  for (i = 0; i < size; i++)
+    {
+      int i1 = MAX (i - (int) (ctx->median_filter_size - 1) / 2, 0);
+      int i2 = MIN (i + (int) (ctx->median_filter_size - 1) / 2, size - 1);
+
+      memcpy (sortbuf, offsets + i1, (i2 - i1 + 1) * sizeof (int));
+      g_qsort_with_data (sortbuf, i2 - i1 + 1, sizeof (int), ref_cmpint, NULL);
+      filtered[i] = sortbuf[(i2 - i1 + 1) / 2];
+    }
+  if (size > 0)
+    memcpy (offsets, filtered, size * sizeof (int));
+
+  row1 = lines;
+  for (i = 0; i < num_lines - 1; i++, row1 = g_slist_next (row1))
+    {
+      gint32 ynext_f;
+
+      if (offsets[i / 2] <= 0)
+        continue;
+
+      ynext_f = y_f + (ctx->resolution << 16) / offsets[i / 2];
+      for (; (line_ind << 16) < ynext_f; line_ind++)
+        {
+          gint32 yi_f = line_ind << 16;
+
+          if (line_ind > ctx->max_height - 1)
+            goto out;
+
+          for (int x = 0; x < ctx->line_width; x++)
+            {
+              guchar p1 = ctx->get_pixel (ctx, row1, x);
+              guchar p2 = ctx->get_pixel (ctx, row1->next, x);
+              gint unscaled = (yi_f - y_f) * p2 + (ynext_f - yi_f) * p1;
+
+              output[line_ind * ctx->line_width + x] = unscaled / (ynext_f - y_f);
+            }
+        }
+      y_f = ynext_f;
+    }
+
+out:
+  *height = line_ind;
+  return output;
+}
+
+static void
+assert_lines_match_reference (struct fpi_line_asmbl_ctx *ctx,
+                              GSList *lines, size_t num_lines)
+{
+  g_autofree guchar *ref = NULL;
+  g_autoptr(FpImage) img = NULL;
+  int height;
+
+  ref = ref_assemble_lines (ctx, lines, num_lines, &height);
+  img = fpi_assemble_lines (ctx, lines, num_lines);
+
+  g_assert_cmpint (img->width, ==, ctx->line_width);
+  g_assert_cmpint (img->height, ==, height);
+  g_assert_cmpmem (img->data, img->width * img->height,
+                   ref, ctx->line_width * height);
+}
+
+static void
+test_line_assembling (void)
+{
+  g_autofree guchar *packed = NULL;
+  g_autoptr(GPtrArray) rows = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GSList) lines = NULL;
+  int width, height;
+  double y = 0;
+  struct fpi_line_asmbl_ctx ctx = {
+    .resolution = 10,
+    .median_filter_size = 25,
+    .max_search_offset = 30,
+    .get_deviation = packed_line_get_deviation,
+    .get_pixel = packed_line_get_pixel,
+  };
+
+  packed = load_packed_capture (&width, &height);
+  ctx.line_width = width;
+  ctx.max_height = height * 2;
+
+  /* Sample the capture as a swipe with varying speed */
+  for (int i = 0; y < height; i++)
+    {
+      packed_line *line = g_new0 (packed_line, 1);
+
+      line->data = packed + (int) y * width;
+      line->index = i;
+      g_ptr_array_add (rows, line);
+      lines = g_slist_prepend (lines, line);
+
+      y += 0.2 + 0.15 * (1 + (i / 40) % 3);
+    }
+  lines = g_slist_reverse (lines);
+
+  assert_lines_match_reference (&ctx, lines, rows->len);
+  assert_lines_match_reference (&ctx, lines, rows->len - 7);
+
+  ctx.get_line = packed_line_get_line;
+  assert_lines_match_reference (&ctx, lines, rows->len);
+
+  /* Offsets spread beyond the histogram range use the sorting filter */
+  ctx.get_deviation = packed_line_get_random_deviation;
+  ctx.max_search_offset = 400;
+  assert_lines_match_reference (&ctx, lines, rows->len);
+  ctx.max_search_offset = 100;
+  assert_lines_match_reference (&ctx, lines, rows->len);
+
+  /* Filter windows wider than the input */
+  ctx.median_filter_size = 3 * rows->len;
+  assert_lines_match_reference (&ctx, lines, rows->len);
+
+  /* A single pair of lines */
+  assert_lines_match_reference (&ctx, lines, 3);
+}
+
 int
 main (int argc, char *argv[])
 {
   g_test_init (&argc, &argv, NULL);
 
   g_test_add_func ("/assembling/frames", test_frame_assembling);
+  g_test_add_func ("/assembling/frames-rows", test_frame_assembling_rows);
+  g_test_add_func ("/assembling/frames-hierarchical", test_frame_assembling_hierarchical);
+  g_test_add_func ("/assembling/frames-stream", test_frame_assembling_stream);
+  g_test_add_func ("/assembling/frames-ring", test_frame_assembling_ring);
+  g_test_add_func ("/assembling/frames-duplicates", test_frame_assembling_duplicates);
+  g_test_add_func ("/assembling/lines", test_line_assembling);
 
   return g_test_run ();
 }
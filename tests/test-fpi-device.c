@@ -24,6 +24,9 @@
 #include "fpi-device.h"
 #include "fpi-compat.h"
 #include "fpi-log.h"
+#include "fpi-ssm.h"
+#include "fpi-usb-transfer.h"
+#include "fpi-image.h"
 #include "test-device-fake.h"
 
 /* Utility functions */
@@ -231,6 +234,29 @@ test_driver_set_nr_enroll_stages (void)
   g_assert_cmpstr (pspec->name, ==, "nr-enroll-stages");
 }
 
+static void
+test_driver_autosuspend_delay (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+
+  g_assert_cmpint (fp_device_get_autosuspend_delay (device), ==, -1);
+
+  fp_device_set_autosuspend_delay (device, 2000);
+  g_assert_cmpint (fp_device_get_autosuspend_delay (device), ==, 2000);
+
+  fp_device_set_autosuspend_delay (device, 0);
+  g_assert_cmpint (fp_device_get_autosuspend_delay (device), ==, 0);
+
+  fp_device_set_autosuspend_delay (device, -1);
+  g_assert_cmpint (fp_device_get_autosuspend_delay (device), ==, -1);
+
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_CRITICAL,
+                         "*delay_ms >= -1*");
+  fp_device_set_autosuspend_delay (device, -2);
+  g_test_assert_expected_messages ();
+  g_assert_cmpint (fp_device_get_autosuspend_delay (device), ==, -1);
+}
+
 static void
 test_driver_get_usb_device (void)
 {
@@ -280,6 +306,65 @@ test_driver_get_driver_data (void)
   g_assert_cmpuint (fpi_device_get_driver_data (device), ==, driver_data);
 }
 
+static void
+test_driver_usb_buffer_recycle (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  FpiUsbTransfer *transfer;
+  FpiUsbTransfer *kept;
+  guchar *buffer;
+
+  /* Released IN buffers of the same size are handed out again */
+  transfer = fpi_usb_transfer_new (device);
+  fpi_usb_transfer_fill_bulk (transfer, FPI_USB_ENDPOINT_IN | 1, 1024);
+  buffer = transfer->buffer;
+  fpi_usb_transfer_unref (transfer);
+
+  transfer = fpi_usb_transfer_new (device);
+  fpi_usb_transfer_fill_interrupt (transfer, FPI_USB_ENDPOINT_IN | 2, 1024);
+  g_assert_true (transfer->buffer == buffer);
+  fpi_usb_transfer_unref (transfer);
+
+  /* OUT buffers are still zero initialized */
+  transfer = fpi_usb_transfer_new (device);
+  fpi_usb_transfer_fill_bulk (transfer, FPI_USB_ENDPOINT_OUT | 1, 1024);
+  for (gint i = 0; i < 1024; i++)
+    g_assert_cmpint (transfer->buffer[i], ==, 0);
+  fpi_usb_transfer_unref (transfer);
+
+  /* A buffer in use may outlive its device */
+  kept = fpi_usb_transfer_new (device);
+  fpi_usb_transfer_fill_bulk (kept, FPI_USB_ENDPOINT_IN | 1, 1024);
+  g_clear_object (&device);
+  fpi_usb_transfer_unref (kept);
+}
+
+static void
+test_driver_image_buffer_recycle (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  FpImage *image;
+  FpImage *kept;
+  guint8 *data;
+
+  /* Released image buffers of the same size are handed out again */
+  image = fpi_image_new_pooled (device, 64, 32, FALSE);
+  data = image->data;
+  memset (data, 0xaa, 64 * 32);
+  g_object_unref (image);
+
+  image = fpi_image_new_pooled (device, 32, 64, TRUE);
+  g_assert_true (image->data == data);
+  for (gint i = 0; i < 64 * 32; i++)
+    g_assert_cmpint (image->data[i], ==, 0);
+  g_object_unref (image);
+
+  /* An image may outlive its device */
+  kept = fpi_image_new_pooled (device, 64, 32, FALSE);
+  g_clear_object (&device);
+  g_object_unref (kept);
+}
+
 static void
 on_driver_probe_async (GObject *initable, GAsyncResult *res, gpointer user_data)
 {
@@ -450,6 +535,62 @@ test_driver_close_error (void)
   g_assert_true (fp_device_is_open (device));
 }
 
+static void
+test_driver_resume (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FpAutoCloseDevice) device = auto_close_fake_device_new ();
+  FpDeviceClass *dev_class = FP_DEVICE_GET_CLASS (device);
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+
+  g_assert_true (fp_device_suspend_sync (device, NULL, &error));
+  g_assert (fake_dev->last_called_function == dev_class->suspend);
+  g_assert_no_error (error);
+
+  g_assert_true (fp_device_resume_sync (device, NULL, &error));
+  g_assert (fake_dev->last_called_function == dev_class->resume);
+  g_assert_no_error (error);
+  g_assert_true (fp_device_is_open (device));
+
+  /* Not suspended, nothing to do */
+  fake_dev->last_called_function = NULL;
+  g_assert_true (fp_device_resume_sync (device, NULL, &error));
+  g_assert_null (fake_dev->last_called_function);
+  g_assert_no_error (error);
+}
+
+static void
+test_driver_resume_error (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FpAutoCloseDevice) device = auto_close_fake_device_new ();
+  FpDeviceClass *dev_class = FP_DEVICE_GET_CLASS (device);
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+
+  g_assert_true (fp_device_suspend_sync (device, NULL, &error));
+  g_assert_no_error (error);
+
+  /* The session is lost, so the device is closed and opened again */
+  fake_dev->ret_error = fpi_device_error_new (FP_DEVICE_ERROR_PROTO);
+  g_assert_true (fp_device_resume_sync (device, NULL, &error));
+  g_assert (fake_dev->last_called_function == dev_class->open);
+  g_assert_no_error (error);
+  g_assert_true (fp_device_is_open (device));
+}
+
+static void
+test_driver_suspend_not_open (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  FpDeviceClass *dev_class = FP_DEVICE_GET_CLASS (device);
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+
+  g_assert_false (fp_device_suspend_sync (device, NULL, &error));
+  g_assert (fake_dev->last_called_function != dev_class->suspend);
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_OPEN);
+}
+
 static void
 test_driver_enroll (void)
 {
@@ -795,6 +936,64 @@ test_driver_verify_retry (void)
   g_assert_false (match);
 }
 
+static void
+test_driver_verify_retry_continue_cb (FpDevice *device)
+{
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+  FpPrint *print;
+
+  fake_dev->last_called_function = test_driver_verify_retry_continue_cb;
+  fpi_device_get_verify_data (device, &print);
+
+  fpi_device_verify_report (device, FPI_MATCH_ERROR, NULL,
+                            fpi_device_retry_new (FP_DEVICE_RETRY_CENTER_FINGER));
+  fpi_device_retry_continue (device);
+  fpi_device_verify_report (device, FPI_MATCH_SUCCESS, print, NULL);
+  fpi_device_verify_complete (device, NULL);
+}
+
+static void
+test_driver_verify_retry_continue_match_cb (FpDevice *device,
+                                            FpPrint  *match,
+                                            FpPrint  *print,
+                                            gpointer  user_data,
+                                            GError   *error)
+{
+  guint *calls = user_data;
+
+  if ((*calls)++ == 0)
+    g_assert_error (error, FP_DEVICE_RETRY, FP_DEVICE_RETRY_CENTER_FINGER);
+  else
+    g_assert_no_error (error);
+}
+
+static void
+test_driver_verify_retry_continue (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FpAutoResetClass) dev_class = auto_reset_device_class ();
+  g_autoptr(FpAutoCloseDevice) device = NULL;
+  g_autoptr(FpPrint) enrolled_print = NULL;
+  g_autoptr(FpPrint) out_print = NULL;
+  FpOperationStats stats;
+  gboolean match;
+  guint calls = 0;
+
+  dev_class->verify = test_driver_verify_retry_continue_cb;
+  device = auto_close_fake_device_new ();
+  enrolled_print = g_object_ref_sink (fp_print_new (device));
+
+  g_assert_true (fp_device_verify_sync (device, enrolled_print, NULL,
+                                        test_driver_verify_retry_continue_match_cb, &calls,
+                                        &match, &out_print, &error));
+  g_assert_no_error (error);
+  g_assert_true (match);
+  g_assert_cmpuint (calls, ==, 2);
+
+  g_assert_true (fp_device_get_last_operation_stats (device, &stats));
+  g_assert_cmpuint (stats.retries, ==, 1);
+}
+
 static void
 test_driver_verify_error (void)
 {
@@ -1102,6 +1301,73 @@ test_driver_identify (void)
   g_assert (expected_matched == matched_print);
 }
 
+typedef struct
+{
+  GCancellable *cancellable;
+  FpPrint      *expected_match;
+  guint         touches;
+  gboolean      completed;
+  GError       *error;
+} ContinuousIdentifyData;
+
+static void
+test_driver_identify_continuous_match_cb (FpDevice *device,
+                                          FpPrint  *match,
+                                          FpPrint  *print,
+                                          gpointer  user_data,
+                                          GError   *error)
+{
+  ContinuousIdentifyData *data = user_data;
+
+  g_assert_no_error (error);
+  g_assert_true (match == data->expected_match);
+
+  data->touches++;
+  if (data->touches == 3)
+    g_cancellable_cancel (data->cancellable);
+}
+
+static void
+test_driver_identify_continuous_cb (GObject      *object,
+                                    GAsyncResult *res,
+                                    gpointer      user_data)
+{
+  ContinuousIdentifyData *data = user_data;
+
+  g_assert_false (fp_device_identify_continuous_finish (FP_DEVICE (object), res,
+                                                        &data->error));
+  data->completed = TRUE;
+}
+
+static void
+test_driver_identify_continuous (void)
+{
+  g_autoptr(FpAutoCloseDevice) device = auto_close_fake_device_new ();
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+  ContinuousIdentifyData data = { 0 };
+
+  g_ptr_array_add (prints, g_object_ref_sink (fp_print_new (device)));
+  g_ptr_array_add (prints, g_object_ref_sink (fp_print_new (device)));
+  fp_print_set_description (g_ptr_array_index (prints, 1), "fake-verified");
+
+  data.cancellable = cancellable;
+  data.expected_match = g_ptr_array_index (prints, 1);
+  fake_dev->ret_print = fp_print_new (device);
+
+  fp_device_identify_continuous (device, prints, cancellable,
+                                 test_driver_identify_continuous_match_cb, &data, NULL,
+                                 test_driver_identify_continuous_cb, &data);
+
+  while (!data.completed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (data.touches, ==, 3);
+  g_assert_error (data.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_clear_error (&data.error);
+}
+
 static void
 test_driver_identify_fail (void)
 {
@@ -1390,6 +1656,164 @@ test_driver_identify_report_no_callback (void)
   g_assert_false (match);
 }
 
+
+static void
+fake_device_identify_any_identify (FpDevice *device)
+{
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+
+  fake_dev->last_called_function = fake_device_identify_any_identify;
+
+  /* Only devices with a print see a finger, the others wait */
+  if (fake_dev->ret_print)
+    {
+      fpi_device_identify_report (device, fake_dev->ret_match,
+                                  g_steal_pointer (&fake_dev->ret_print), NULL);
+      fpi_device_identify_complete (device, NULL);
+    }
+}
+
+static void
+fake_device_identify_any_cancel (FpDevice *device)
+{
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+
+  fake_dev->last_called_function = fake_device_identify_any_cancel;
+  fpi_device_identify_complete (device,
+                                g_error_new (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                             "Cancelled"));
+}
+
+static void
+test_driver_identify_any_cb (GObject      *source_object,
+                             GAsyncResult *res,
+                             gpointer      user_data)
+{
+  GAsyncResult **result = user_data;
+
+  *result = g_object_ref (res);
+}
+
+static void
+test_driver_identify_any (void)
+{
+  g_autoptr(FpAutoResetClass) dev_class = auto_reset_device_class ();
+  g_autoptr(GPtrArray) devices = g_ptr_array_new_with_free_func ((GDestroyNotify) auto_close_fake_device_free);
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(FpDevice) device = NULL;
+  g_autoptr(FpPrint) match = NULL;
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(GError) error = NULL;
+  FpiDeviceFake *winner;
+  guint i;
+
+  dev_class->identify = fake_device_identify_any_identify;
+  dev_class->cancel = fake_device_identify_any_cancel;
+
+  for (i = 0; i < 3; i++)
+    g_ptr_array_add (devices, auto_close_fake_device_new ());
+  for (i = 0; i < 10; i++)
+    g_ptr_array_add (prints, g_object_ref_sink (fp_print_new (devices->pdata[0])));
+
+  winner = FPI_DEVICE_FAKE (devices->pdata[1]);
+  winner->ret_match = prints->pdata[3];
+  winner->ret_print = g_object_ref_sink (fp_print_new (devices->pdata[1]));
+
+  fp_device_identify_any (devices, prints, NULL, test_driver_identify_any_cb, &result);
+  while (!result)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (fp_device_identify_any_finish (result, &device, &match, &print, &error));
+  g_assert_no_error (error);
+  g_assert_true (device == devices->pdata[1]);
+  g_assert_true (match == prints->pdata[3]);
+  g_assert_nonnull (print);
+
+  /* The other devices were cancelled and are idle again */
+  g_assert_true (FPI_DEVICE_FAKE (devices->pdata[0])->last_called_function ==
+                 fake_device_identify_any_cancel);
+  g_assert_true (FPI_DEVICE_FAKE (devices->pdata[2])->last_called_function ==
+                 fake_device_identify_any_cancel);
+  g_clear_object (&result);
+  g_clear_object (&device);
+  g_clear_object (&match);
+  g_clear_object (&print);
+
+  /* Without a finger, only the caller can stop the identification */
+  fp_device_identify_any (devices, prints, cancellable, test_driver_identify_any_cb, &result);
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+  g_assert_null (result);
+
+  g_cancellable_cancel (cancellable);
+  while (!result)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (fp_device_identify_any_finish (result, &device, &match, &print, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (device);
+  g_assert_null (match);
+  g_assert_null (print);
+}
+static FpPrint *
+make_raw_print (FpDevice *device, const gchar *device_id, guint id)
+{
+  return g_object_new (FP_TYPE_PRINT,
+                       "driver", fp_device_get_driver (device),
+                       "device-id", device_id,
+                       "fpi-type", FPI_PRINT_RAW,
+                       "fpi-data", g_variant_new_uint32 (id),
+                       NULL);
+}
+
+static void
+test_driver_identify_gallery_compatible (void)
+{
+  g_autoptr(FpAutoCloseDevice) device = auto_close_fake_device_new ();
+  g_autoptr(FpGallery) gallery = fp_gallery_new ();
+  g_autoptr(GPtrArray) prints = NULL;
+  FpPrint *p[6];
+  guint i;
+
+  /* Every second print belongs to another device */
+  for (i = 0; i < G_N_ELEMENTS (p); i++)
+    {
+      p[i] = g_object_ref_sink (make_raw_print (device,
+                                                i % 2 ? "other_device" : fp_device_get_device_id (device),
+                                                i));
+      fp_gallery_add_print (gallery, p[i]);
+    }
+
+  prints = fp_gallery_get_compatible_prints (gallery, device);
+  g_assert_cmpuint (prints->len, ==, 3);
+  g_assert_true (g_ptr_array_index (prints, 0) == p[0]);
+  g_assert_true (g_ptr_array_index (prints, 1) == p[2]);
+  g_assert_true (g_ptr_array_index (prints, 2) == p[4]);
+  g_clear_pointer (&prints, g_ptr_array_unref);
+
+  /* Moving p[4] to the front of the gallery overtakes p[2] */
+  fp_gallery_set_adaptive_order (gallery, TRUE);
+  fp_gallery_report_match (gallery, p[4]);
+  prints = fp_gallery_get_compatible_prints (gallery, device);
+  g_assert_true (g_ptr_array_index (prints, 0) == p[0]);
+  g_assert_true (g_ptr_array_index (prints, 1) == p[4]);
+  g_assert_true (g_ptr_array_index (prints, 2) == p[2]);
+
+  /* The returned array is not modified later on */
+  g_assert_true (fp_gallery_remove_print (gallery, p[0]));
+  g_assert_cmpuint (prints->len, ==, 3);
+  g_clear_pointer (&prints, g_ptr_array_unref);
+
+  prints = fp_gallery_get_compatible_prints (gallery, device);
+  g_assert_cmpuint (prints->len, ==, 2);
+  g_assert_true (g_ptr_array_index (prints, 0) == p[4]);
+
+  for (i = 0; i < G_N_ELEMENTS (p); i++)
+    g_object_unref (p[i]);
+}
+
 static void
 fake_device_stub_capture (FpDevice *device)
 {
@@ -1508,6 +1932,145 @@ test_driver_list (void)
   g_assert (prints == fake_dev->ret_list);
 }
 
+static void
+test_driver_list_reported (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FpAutoCloseDevice) device = auto_close_fake_device_new ();
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+  g_autoptr(GPtrArray) expected = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) prints = NULL;
+  unsigned int i;
+
+  fake_dev->ret_list = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; i < 5; ++i)
+    {
+      FpPrint *print = g_object_ref_sink (fp_print_new (device));
+
+      g_ptr_array_add (fake_dev->ret_list, print);
+      g_ptr_array_add (expected, g_object_ref (print));
+    }
+
+  fake_dev->report_list = TRUE;
+  prints = fp_device_list_prints_sync (device, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (prints);
+
+  g_assert_cmpuint (prints->len, ==, expected->len);
+  for (i = 0; i < expected->len; ++i)
+    g_assert (g_ptr_array_index (prints, i) == g_ptr_array_index (expected, i));
+}
+
+typedef struct
+{
+  guint     listed;
+  guint     stop_after;
+  gboolean  completed;
+  gboolean  ret;
+  gboolean  destroyed;
+  GError   *error;
+} ListStreamedData;
+
+static gboolean
+test_driver_list_streamed_list_cb (FpDevice *device,
+                                   FpPrint  *print,
+                                   gpointer  user_data)
+{
+  ListStreamedData *data = user_data;
+
+  g_assert_true (FP_IS_PRINT (print));
+  data->listed++;
+
+  return data->listed < data->stop_after;
+}
+
+static void
+test_driver_list_streamed_destroy (gpointer user_data)
+{
+  ListStreamedData *data = user_data;
+
+  data->destroyed = TRUE;
+}
+
+static void
+test_driver_list_streamed_cb (GObject      *object,
+                              GAsyncResult *res,
+                              gpointer      user_data)
+{
+  ListStreamedData *data = user_data;
+
+  data->ret = fp_device_list_prints_streamed_finish (FP_DEVICE (object), res,
+                                                     &data->error);
+  data->completed = TRUE;
+}
+
+static void
+test_driver_list_streamed_run (gboolean report)
+{
+  g_autoptr(FpAutoCloseDevice) device = auto_close_fake_device_new ();
+  FpDeviceClass *dev_class = FP_DEVICE_GET_CLASS (device);
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+  ListStreamedData data = { .stop_after = 2 };
+  unsigned int i;
+
+  fake_dev->ret_list = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; i < 5; ++i)
+    g_ptr_array_add (fake_dev->ret_list, g_object_ref_sink (fp_print_new (device)));
+  fake_dev->report_list = report;
+
+  fp_device_list_prints_streamed (device, NULL,
+                                  test_driver_list_streamed_list_cb, &data,
+                                  test_driver_list_streamed_destroy,
+                                  test_driver_list_streamed_cb, &data);
+
+  while (!data.completed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert (fake_dev->last_called_function == dev_class->list);
+  g_assert_no_error (data.error);
+  g_assert_true (data.ret);
+  g_assert_cmpuint (data.listed, ==, 2);
+  g_assert_true (data.destroyed);
+}
+
+static void
+test_driver_list_streamed (void)
+{
+  test_driver_list_streamed_run (FALSE);
+}
+
+static void
+test_driver_list_streamed_reported (void)
+{
+  test_driver_list_streamed_run (TRUE);
+}
+
+static void
+test_driver_list_streamed_no_storage (void)
+{
+  g_autoptr(FpAutoResetClass) dev_class = auto_reset_device_class ();
+  g_autoptr(FpAutoCloseDevice) device = NULL;
+  ListStreamedData data = { .stop_after = G_MAXUINT };
+
+  dev_class->list = NULL;
+
+  device = auto_close_fake_device_new ();
+
+  fp_device_list_prints_streamed (device, NULL,
+                                  test_driver_list_streamed_list_cb, &data,
+                                  test_driver_list_streamed_destroy,
+                                  test_driver_list_streamed_cb, &data);
+
+  while (!data.completed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (data.ret);
+  g_assert_error (data.error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_SUPPORTED);
+  g_assert_cmpuint (data.listed, ==, 0);
+  g_assert_true (data.destroyed);
+  g_clear_error (&data.error);
+}
+
 static void
 test_driver_list_error (void)
 {
@@ -1581,6 +2144,156 @@ test_driver_delete_error (void)
   g_assert_false (ret);
 }
 
+static void
+fake_device_delete_record (FpDevice *device)
+{
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+  GPtrArray *deleted = fake_dev->user_data;
+  FpPrint *print = NULL;
+
+  fake_dev->last_called_function = fake_device_delete_record;
+  g_assert_cmpuint (fpi_device_get_current_action (device), ==, FPI_DEVICE_ACTION_DELETE);
+
+  fpi_device_get_delete_data (device, &print);
+  g_ptr_array_add (deleted, print);
+
+  fpi_device_delete_complete (device, g_steal_pointer (&fake_dev->ret_error));
+}
+
+static void
+test_driver_delete_prints (void)
+{
+  g_autoptr(FpAutoResetClass) dev_class = auto_reset_device_class ();
+  g_autoptr(FpAutoCloseDevice) device = NULL;
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) deleted = g_ptr_array_new ();
+  g_autoptr(GError) error = NULL;
+  FpiDeviceFake *fake_dev;
+  guint i;
+
+  dev_class->delete = fake_device_delete_record;
+  device = auto_close_fake_device_new ();
+  fake_dev = FPI_DEVICE_FAKE (device);
+  fake_dev->user_data = deleted;
+
+  for (i = 0; i < 3; i++)
+    g_ptr_array_add (prints, fp_print_new (device));
+
+  /* Without delete_prints, each print is deleted in turn */
+  g_assert_true (fp_device_delete_prints_sync (device, prints, NULL, &error));
+  g_assert_no_error (error);
+
+  g_assert_cmpuint (deleted->len, ==, prints->len);
+  for (i = 0; i < prints->len; i++)
+    g_assert_true (g_ptr_array_index (deleted, i) == g_ptr_array_index (prints, i));
+
+  /* The first error ends the operation */
+  g_ptr_array_set_size (deleted, 0);
+  fake_dev->ret_error = fpi_device_error_new (FP_DEVICE_ERROR_DATA_NOT_FOUND);
+  g_assert_false (fp_device_delete_prints_sync (device, prints, NULL, &error));
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_NOT_FOUND);
+  g_assert_cmpuint (deleted->len, ==, 1);
+
+  fake_dev->user_data = NULL;
+}
+
+static void
+fake_device_delete_prints (FpDevice *device)
+{
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+  GPtrArray *prints = NULL;
+
+  fake_dev->last_called_function = fake_device_delete_prints;
+  fpi_device_get_delete_prints_data (device, &prints);
+  fake_dev->action_data = g_ptr_array_ref (prints);
+
+  fpi_device_delete_complete (device, NULL);
+}
+
+static void
+test_driver_delete_prints_native (void)
+{
+  g_autoptr(FpAutoResetClass) dev_class = auto_reset_device_class ();
+  g_autoptr(FpAutoCloseDevice) device = NULL;
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) passed = NULL;
+  g_autoptr(GError) error = NULL;
+  FpiDeviceFake *fake_dev;
+
+  dev_class->delete_prints = fake_device_delete_prints;
+  device = auto_close_fake_device_new ();
+  fake_dev = FPI_DEVICE_FAKE (device);
+
+  g_ptr_array_add (prints, fp_print_new (device));
+  g_ptr_array_add (prints, fp_print_new (device));
+
+  g_assert_true (fp_device_delete_prints_sync (device, prints, NULL, &error));
+  g_assert_no_error (error);
+  g_assert (fake_dev->last_called_function == fake_device_delete_prints);
+
+  passed = g_steal_pointer (&fake_dev->action_data);
+  g_assert_cmpuint (passed->len, ==, 2);
+  g_assert_true (g_ptr_array_index (passed, 1) == g_ptr_array_index (prints, 1));
+}
+
+static void
+fake_device_clear_storage (FpDevice *device)
+{
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+
+  fake_dev->last_called_function = fake_device_clear_storage;
+  g_assert_cmpuint (fpi_device_get_current_action (device), ==, FPI_DEVICE_ACTION_CLEAR_STORAGE);
+
+  fpi_device_clear_storage_complete (device, NULL);
+}
+
+static void
+test_driver_clear_storage (void)
+{
+  g_autoptr(FpAutoResetClass) dev_class = auto_reset_device_class ();
+  g_autoptr(FpAutoCloseDevice) device = NULL;
+  g_autoptr(GPtrArray) deleted = g_ptr_array_new ();
+  g_autoptr(GError) error = NULL;
+  FpiDeviceFake *fake_dev;
+
+  dev_class->delete = fake_device_delete_record;
+  device = auto_close_fake_device_new ();
+  fake_dev = FPI_DEVICE_FAKE (device);
+  fake_dev->user_data = deleted;
+
+  /* Without clear_storage, the listed prints are deleted */
+  fake_dev->ret_list = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (fake_dev->ret_list, fp_print_new (device));
+  g_ptr_array_add (fake_dev->ret_list, fp_print_new (device));
+
+  g_assert_true (fp_device_clear_storage_sync (device, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (deleted->len, ==, 2);
+  fake_dev->ret_list = NULL;
+
+  dev_class->clear_storage = fake_device_clear_storage;
+  g_assert_true (fp_device_clear_storage_sync (device, NULL, &error));
+  g_assert_no_error (error);
+  g_assert (fake_dev->last_called_function == fake_device_clear_storage);
+  g_assert_cmpuint (deleted->len, ==, 2);
+
+  fake_dev->user_data = NULL;
+}
+
+static void
+test_driver_clear_storage_no_storage (void)
+{
+  g_autoptr(FpAutoResetClass) dev_class = auto_reset_device_class ();
+  g_autoptr(FpAutoCloseDevice) device = NULL;
+  g_autoptr(GError) error = NULL;
+
+  dev_class->list = NULL;
+
+  device = auto_close_fake_device_new ();
+  g_assert_false (fp_device_clear_storage_sync (device, NULL, &error));
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_SUPPORTED);
+}
+
 static gboolean
 fake_device_delete_wait_for_cancel_timeout (gpointer data)
 {
@@ -2116,6 +2829,51 @@ test_driver_add_timeout_cancelled (void)
   g_assert_null (fake_dev->last_called_function);
 }
 
+static void
+test_driver_timer_func (FpDevice *device, gpointer user_data)
+{
+  guint *calls = user_data;
+
+  *calls += 1;
+}
+
+static void
+test_driver_timer (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  FpiDeviceTimer short_timer = { 0 };
+  FpiDeviceTimer long_timer = { 0 };
+  FpiDeviceTimer stopped_timer = { 0 };
+  guint short_calls = 0;
+  guint long_calls = 0;
+  guint stopped_calls = 0;
+
+  fpi_device_timer_start (device, &long_timer, 60, test_driver_timer_func, &long_calls);
+  fpi_device_timer_start (device, &stopped_timer, 10, test_driver_timer_func, &stopped_calls);
+  fpi_device_timer_start (device, &short_timer, 20, test_driver_timer_func, &short_calls);
+  g_assert_true (fpi_device_timer_is_active (&stopped_timer));
+
+  fpi_device_timer_stop (device, &stopped_timer);
+  g_assert_false (fpi_device_timer_is_active (&stopped_timer));
+
+  while (fpi_device_timer_is_active (&short_timer))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (short_calls, ==, 1);
+  g_assert_cmpuint (long_calls, ==, 0);
+  g_assert_true (fpi_device_timer_is_active (&long_timer));
+
+  /* A fired timer can be started again */
+  fpi_device_timer_start (device, &short_timer, 0, test_driver_timer_func, &short_calls);
+
+  while (fpi_device_timer_is_active (&long_timer))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (short_calls, ==, 2);
+  g_assert_cmpuint (long_calls, ==, 1);
+  g_assert_cmpuint (stopped_calls, ==, 0);
+}
+
 static void
 test_driver_error_types (void)
 {
@@ -2174,6 +2932,185 @@ test_driver_retry_error_types (void)
   g_test_assert_expected_messages ();
 }
 
+/* Benchmarks of the framework overhead that every driver pays, only run
+ * with -m perf */
+
+#define PERF_SSM_STATES 64
+
+static void
+perf_ssm_next_handler (FpiSsm *ssm, FpDevice *dev)
+{
+  fpi_ssm_next_state (ssm);
+}
+
+static void
+perf_ssm_delayed_handler (FpiSsm *ssm, FpDevice *dev)
+{
+  fpi_ssm_next_state_delayed (ssm, 0, NULL);
+}
+
+static void
+perf_ssm_completed (FpiSsm *ssm, FpDevice *dev, GError *error)
+{
+  gint *n_completed = fpi_ssm_get_data (ssm);
+
+  g_assert_no_error (error);
+  *n_completed += 1;
+}
+
+static void
+perf_ssm_child_handler (FpiSsm *ssm, FpDevice *dev)
+{
+  fpi_ssm_mark_completed (ssm);
+}
+
+static void
+perf_ssm_parent_handler (FpiSsm *ssm, FpDevice *dev)
+{
+  fpi_ssm_start_subsm (ssm, fpi_ssm_new (dev, perf_ssm_child_handler, 1));
+}
+
+static void
+test_driver_perf_ssm (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  const gint n_machines = 20000;
+  gint n_completed = 0;
+  guint n_iterations = 0;
+  gdouble ns;
+  gint i;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Only run in performance mode");
+      return;
+    }
+
+  /* Handlers that advance right away, as after a synchronous check */
+  g_test_timer_start ();
+  for (i = 0; i < n_machines; i++)
+    {
+      FpiSsm *ssm = fpi_ssm_new (device, perf_ssm_next_handler, PERF_SSM_STATES);
+
+      fpi_ssm_set_data (ssm, &n_completed, NULL);
+      fpi_ssm_start (ssm, perf_ssm_completed);
+    }
+  ns = g_test_timer_elapsed () * 1e9 / (n_machines * PERF_SSM_STATES);
+  g_assert_cmpint (n_completed, ==, n_machines);
+  g_test_message ("%.1f ns per fpi_ssm_next_state()", ns);
+
+  /* Each child machine is created, started and completes */
+  n_completed = 0;
+  g_test_timer_start ();
+  for (i = 0; i < n_machines; i++)
+    {
+      FpiSsm *ssm = fpi_ssm_new (device, perf_ssm_parent_handler, PERF_SSM_STATES);
+
+      fpi_ssm_set_data (ssm, &n_completed, NULL);
+      fpi_ssm_start (ssm, perf_ssm_completed);
+    }
+  ns = g_test_timer_elapsed () * 1e9 / (n_machines * PERF_SSM_STATES);
+  g_assert_cmpint (n_completed, ==, n_machines);
+  g_test_message ("%.1f ns per fpi_ssm_start_subsm()", ns);
+
+  /* Transitions through the main loop, like after a USB transfer */
+  n_completed = 0;
+  g_test_timer_start ();
+  for (i = 0; i < n_machines / 10; i++)
+    {
+      FpiSsm *ssm = fpi_ssm_new (device, perf_ssm_delayed_handler, PERF_SSM_STATES);
+
+      fpi_ssm_set_data (ssm, &n_completed, NULL);
+      fpi_ssm_start (ssm, perf_ssm_completed);
+      while (n_completed <= i)
+        {
+          g_main_context_iteration (NULL, TRUE);
+          n_iterations++;
+        }
+    }
+  ns = g_test_timer_elapsed () * 1e9 / (n_machines / 10 * PERF_SSM_STATES);
+  g_test_message ("%.2f main loop iterations per delayed state change",
+                  (gdouble) n_iterations / (n_machines / 10 * PERF_SSM_STATES));
+  g_test_minimized_result (ns, "%.1f ns per fpi_ssm_next_state_delayed()", ns);
+}
+
+static void
+test_driver_perf_usb_transfer (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  const gint n_transfers = 200000;
+  gdouble ns;
+  gint i;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Only run in performance mode");
+      return;
+    }
+
+  /* Submitting needs a USB device, this only covers the transfer setup
+   * and teardown that every submission goes through. */
+  g_test_timer_start ();
+  for (i = 0; i < n_transfers; i++)
+    {
+      FpiUsbTransfer *transfer = fpi_usb_transfer_new (device);
+
+      fpi_usb_transfer_fill_bulk (transfer, FPI_USB_ENDPOINT_IN | 1, 64);
+      fpi_usb_transfer_unref (transfer);
+    }
+  ns = g_test_timer_elapsed () * 1e9 / n_transfers;
+
+  g_test_minimized_result (ns, "%.1f ns per transfer", ns);
+}
+
+static void
+perf_open_close_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  gboolean *done = user_data;
+
+  *done = TRUE;
+}
+
+static void
+test_driver_perf_task_return (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  const gint n_actions = 5000;
+  guint n_iterations = 0;
+  gdouble ns;
+  gint i;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Only run in performance mode");
+      return;
+    }
+
+  /* The fake driver completes right away, so this is the cost of
+   * starting an action and returning its task from an idle source. */
+  g_test_timer_start ();
+  for (i = 0; i < n_actions; i++)
+    {
+      gboolean done = FALSE;
+
+      if (i % 2 == 0)
+        fp_device_open (device, NULL, perf_open_close_cb, &done);
+      else
+        fp_device_close (device, NULL, perf_open_close_cb, &done);
+
+      while (!done)
+        {
+          g_main_context_iteration (NULL, TRUE);
+          n_iterations++;
+        }
+    }
+  ns = g_test_timer_elapsed () * 1e9 / n_actions;
+
+  g_test_message ("%.2f main loop iterations per action",
+                  (gdouble) n_iterations / n_actions);
+  g_test_minimized_result (ns, "%.1f ns per action", ns);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -2195,9 +3132,12 @@ main (int argc, char *argv[])
   g_test_add_func ("/driver/do_not_support_identify", test_driver_do_not_support_identify);
   g_test_add_func ("/driver/do_not_support_capture", test_driver_do_not_support_capture);
   g_test_add_func ("/driver/has_not_storage", test_driver_has_not_storage);
+  g_test_add_func ("/driver/autosuspend_delay", test_driver_autosuspend_delay);
   g_test_add_func ("/driver/get_usb_device", test_driver_get_usb_device);
   g_test_add_func ("/driver/get_virtual_env", test_driver_get_virtual_env);
   g_test_add_func ("/driver/get_driver_data", test_driver_get_driver_data);
+  g_test_add_func ("/driver/usb_buffer_recycle", test_driver_usb_buffer_recycle);
+  g_test_add_func ("/driver/image_buffer_recycle", test_driver_image_buffer_recycle);
 
   g_test_add_func ("/driver/probe", test_driver_probe);
   g_test_add_func ("/driver/probe/error", test_driver_probe_error);
@@ -2206,6 +3146,9 @@ main (int argc, char *argv[])
   g_test_add_func ("/driver/open/error", test_driver_open_error);
   g_test_add_func ("/driver/close", test_driver_close);
   g_test_add_func ("/driver/close/error", test_driver_close_error);
+  g_test_add_func ("/driver/resume", test_driver_resume);
+  g_test_add_func ("/driver/resume/error", test_driver_resume_error);
+  g_test_add_func ("/driver/suspend/not_open", test_driver_suspend_not_open);
   g_test_add_func ("/driver/enroll", test_driver_enroll);
   g_test_add_func ("/driver/enroll/error", test_driver_enroll_error);
   g_test_add_func ("/driver/enroll/error/no_print", test_driver_enroll_error_no_print);
@@ -2213,24 +3156,36 @@ main (int argc, char *argv[])
   g_test_add_func ("/driver/verify", test_driver_verify);
   g_test_add_func ("/driver/verify/fail", test_driver_verify_fail);
   g_test_add_func ("/driver/verify/retry", test_driver_verify_retry);
+  g_test_add_func ("/driver/verify/retry/continue", test_driver_verify_retry_continue);
   g_test_add_func ("/driver/verify/error", test_driver_verify_error);
   g_test_add_func ("/driver/verify/report_no_cb", test_driver_verify_report_no_callback);
   g_test_add_func ("/driver/verify/not_reported", test_driver_verify_not_reported);
   g_test_add_func ("/driver/verify/complete_retry", test_driver_verify_complete_retry);
   g_test_add_func ("/driver/identify", test_driver_identify);
   g_test_add_func ("/driver/identify/fail", test_driver_identify_fail);
+  g_test_add_func ("/driver/identify/continuous", test_driver_identify_continuous);
   g_test_add_func ("/driver/identify/retry", test_driver_identify_retry);
   g_test_add_func ("/driver/identify/error", test_driver_identify_error);
   g_test_add_func ("/driver/identify/not_reported", test_driver_identify_not_reported);
   g_test_add_func ("/driver/identify/complete_retry", test_driver_identify_complete_retry);
   g_test_add_func ("/driver/identify/report_no_cb", test_driver_identify_report_no_callback);
+  g_test_add_func ("/driver/identify/any", test_driver_identify_any);
+  g_test_add_func ("/driver/identify/gallery-compatible", test_driver_identify_gallery_compatible);
   g_test_add_func ("/driver/capture", test_driver_capture);
   g_test_add_func ("/driver/capture/error", test_driver_capture_error);
   g_test_add_func ("/driver/list", test_driver_list);
+  g_test_add_func ("/driver/list/reported", test_driver_list_reported);
+  g_test_add_func ("/driver/list/streamed", test_driver_list_streamed);
+  g_test_add_func ("/driver/list/streamed/reported", test_driver_list_streamed_reported);
+  g_test_add_func ("/driver/list/streamed/no_storage", test_driver_list_streamed_no_storage);
   g_test_add_func ("/driver/list/error", test_driver_list_error);
   g_test_add_func ("/driver/list/no_storage", test_driver_list_no_storage);
   g_test_add_func ("/driver/delete", test_driver_delete);
   g_test_add_func ("/driver/delete/error", test_driver_delete_error);
+  g_test_add_func ("/driver/delete/prints", test_driver_delete_prints);
+  g_test_add_func ("/driver/delete/prints/native", test_driver_delete_prints_native);
+  g_test_add_func ("/driver/clear_storage", test_driver_clear_storage);
+  g_test_add_func ("/driver/clear_storage/no_storage", test_driver_clear_storage_no_storage);
   g_test_add_func ("/driver/cancel", test_driver_cancel);
   g_test_add_func ("/driver/cancel/fail", test_driver_cancel_fail);
 
@@ -2248,9 +3203,14 @@ main (int argc, char *argv[])
 
   g_test_add_func ("/driver/timeout", test_driver_add_timeout);
   g_test_add_func ("/driver/timeout/cancelled", test_driver_add_timeout_cancelled);
+  g_test_add_func ("/driver/timer", test_driver_timer);
 
   g_test_add_func ("/driver/error_types", test_driver_error_types);
   g_test_add_func ("/driver/retry_error_types", test_driver_retry_error_types);
 
+  g_test_add_func ("/driver/perf/ssm", test_driver_perf_ssm);
+  g_test_add_func ("/driver/perf/usb-transfer", test_driver_perf_usb_transfer);
+  g_test_add_func ("/driver/perf/task-return", test_driver_perf_task_return);
+
   return g_test_run ();
 }
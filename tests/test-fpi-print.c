@@ -0,0 +1,938 @@
+/*
+ * Unit tests for libfprint print handling
+ * Copyright (C) 2019 Benjamin Berg <bberg@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+#include <glib/gstdio.h>
+#include <unistd.h>
+#include "fp-print-private.h"
+
+static FpPrint *
+make_nbis_print (guint seed, guint n_xyt)
+{
+  FpPrint *print;
+  guint i;
+
+  print = g_object_new (FP_TYPE_PRINT,
+                        "driver", "test_driver",
+                        "device-id", "test_device",
+                        NULL);
+  fpi_print_set_type (print, FPI_PRINT_NBIS);
+  fp_print_set_username (print, "testuser");
+  fp_print_set_finger (print, FP_FINGER_RIGHT_INDEX);
+
+  for (i = 0; i < n_xyt; i++)
+    {
+      struct xyt_struct *xyt = g_new0 (struct xyt_struct, 1);
+      gint j;
+
+      xyt->nrows = 20 + (seed + i) % 40;
+      for (j = 0; j < xyt->nrows; j++)
+        {
+          xyt->xcol[j] = (seed * 7 + j * 13) % 300;
+          xyt->ycol[j] = (seed * 11 + j * 17) % 400;
+          xyt->thetacol[j] = (gint) ((seed + j * 23) % 360) - 179;
+        }
+      g_ptr_array_add (print->prints, xyt);
+    }
+
+  return print;
+}
+
+static void
+test_print_packed (void)
+{
+  g_autoptr(FpPrint) print = g_object_ref_sink (make_nbis_print (1, 3));
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *data = NULL;
+  gsize length;
+
+  g_assert_true (fp_print_serialize_packed (print, &data, &length, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (length % 4, ==, 0);
+
+  loaded = fp_print_deserialize (data, length, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (loaded);
+
+  g_assert_true (fp_print_equal (print, loaded));
+  g_assert_cmpstr (fp_print_get_username (loaded), ==, "testuser");
+  g_assert_cmpint (fp_print_get_finger (loaded), ==, FP_FINGER_RIGHT_INDEX);
+  g_assert_null (fp_print_get_description (loaded));
+
+  /* Truncated data must be rejected */
+  g_assert_null (fp_print_deserialize (data, length - 4, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+}
+
+static void
+test_print_packed_compressed (void)
+{
+  g_autoptr(FpPrint) print = g_object_ref_sink (make_nbis_print (2, 4));
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) gallery = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *data = NULL;
+  g_autofree guchar *plain = NULL;
+  g_autofree gchar *path = NULL;
+  struct xyt_struct *xyt;
+  gsize length, plain_length;
+  gint fd;
+  guint i;
+
+  /* Sorted by x like extracted minutiae, plus values that need wrapping
+   * deltas and the longest varints */
+  xyt = g_ptr_array_index (print->prints, 0);
+  for (i = 0; i < (guint) xyt->nrows; i++)
+    xyt->xcol[i] = i * 3;
+  xyt = g_ptr_array_index (print->prints, 1);
+  xyt->xcol[0] = G_MAXINT32;
+  xyt->xcol[1] = G_MININT32;
+  xyt->ycol[0] = G_MININT32;
+
+  g_assert_true (fp_print_serialize_full (print, FP_PRINT_SERIALIZE_COMPRESSED,
+                                          &data, &length, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (data[3], ==, 2);
+  g_assert_cmpint (length % 4, ==, 0);
+
+  g_assert_true (fp_print_serialize_packed (print, &plain, &plain_length, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (length, <, plain_length);
+
+  loaded = fp_print_deserialize (data, length, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_equal (print, loaded));
+
+  /* Truncated or corrupted data must be rejected */
+  g_assert_null (fp_print_deserialize (data, length - 4, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_clear_error (&error);
+
+  memset (data + length - 8, 0xff, 8);
+  g_assert_null (fp_print_deserialize (data, length, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_clear_error (&error);
+
+  fd = g_file_open_tmp ("test-gallery-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  for (i = 0; i < 20; i++)
+    g_ptr_array_add (prints, g_object_ref_sink (make_nbis_print (i, 1 + i % 5)));
+
+  g_assert_true (fp_print_save_gallery_full (prints, path,
+                                             FP_GALLERY_SAVE_COMPRESSED | FP_GALLERY_SAVE_WEBS,
+                                             &error));
+  g_assert_no_error (error);
+
+  gallery = fp_print_load_gallery (path, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (gallery->len, ==, prints->len);
+
+  for (i = 0; i < prints->len; i++)
+    g_assert_true (fp_print_equal (g_ptr_array_index (prints, i),
+                                   g_ptr_array_index (gallery, i)));
+
+  g_unlink (path);
+}
+
+static void
+test_print_serialize (void)
+{
+  /* Covers 1 and 2 byte GVariant framing offsets and no samples at all */
+  const guint n_xyts[] = { 0, 1, 3, 20 };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (n_xyts); i++)
+    {
+      g_autoptr(FpPrint) print = g_object_ref_sink (make_nbis_print (i, n_xyts[i]));
+      g_autoptr(FpPrint) loaded = NULL;
+      g_autoptr(GError) error = NULL;
+      g_autofree guchar *data = NULL;
+      gsize length;
+
+      g_assert_true (fp_print_serialize (print, &data, &length, &error));
+      g_assert_no_error (error);
+
+      loaded = fp_print_deserialize (data, length, &error);
+      g_assert_no_error (error);
+      g_assert_nonnull (loaded);
+
+      g_assert_cmpuint (loaded->prints->len, ==, n_xyts[i]);
+      g_assert_true (fp_print_equal (print, loaded));
+    }
+}
+
+static void
+test_print_gallery (void)
+{
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) loaded = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = NULL;
+  gint fd;
+  guint i;
+
+  fd = g_file_open_tmp ("test-gallery-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  for (i = 0; i < 50; i++)
+    g_ptr_array_add (prints, g_object_ref_sink (make_nbis_print (i, 1 + i % 5)));
+
+  g_assert_true (fp_print_save_gallery (prints, path, &error));
+  g_assert_no_error (error);
+
+  loaded = fp_print_load_gallery (path, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (loaded->len, ==, prints->len);
+
+  for (i = 0; i < prints->len; i++)
+    g_assert_true (fp_print_equal (g_ptr_array_index (prints, i),
+                                   g_ptr_array_index (loaded, i)));
+
+  g_unlink (path);
+}
+
+static void
+gallery_progress_cb (guint n_loaded, guint n_total, gpointer user_data)
+{
+  guint *last_loaded = user_data;
+
+  g_assert_cmpuint (n_loaded, >, *last_loaded);
+  g_assert_cmpuint (n_loaded, <=, n_total);
+  *last_loaded = n_loaded;
+}
+
+static void
+gallery_loaded_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GPtrArray **loaded = user_data;
+  g_autoptr(GError) error = NULL;
+
+  *loaded = fp_print_load_gallery_finish (res, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_print_gallery_async (void)
+{
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) loaded = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = NULL;
+  guint last_loaded = 0;
+  gint fd;
+  guint i;
+
+  fd = g_file_open_tmp ("test-gallery-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  /* Enough prints to be loaded in several chunks */
+  for (i = 0; i < 600; i++)
+    g_ptr_array_add (prints, g_object_ref_sink (make_nbis_print (i, 1)));
+
+  g_assert_true (fp_print_save_gallery (prints, path, &error));
+  g_assert_no_error (error);
+
+  fp_print_load_gallery_async (path, NULL, gallery_progress_cb, &last_loaded, NULL,
+                               gallery_loaded_cb, &loaded);
+  while (!loaded)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (last_loaded, ==, prints->len);
+  g_assert_cmpuint (loaded->len, ==, prints->len);
+  for (i = 0; i < prints->len; i++)
+    g_assert_true (fp_print_equal (g_ptr_array_index (prints, i),
+                                   g_ptr_array_index (loaded, i)));
+
+  g_unlink (path);
+}
+
+static void
+test_print_many (void)
+{
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) loaded = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *data = NULL;
+  gsize length;
+  FpPrint *raw;
+  guint i;
+
+  for (i = 0; i < 10; i++)
+    g_ptr_array_add (prints, g_object_ref_sink (make_nbis_print (i, 1 + i % 3)));
+
+  raw = g_object_new (FP_TYPE_PRINT,
+                      "fpi-type", FPI_PRINT_RAW,
+                      "driver", "test_driver",
+                      "device-id", "other_device",
+                      "device-stored", TRUE,
+                      "fpi-data", g_variant_new_string ("raw data"),
+                      NULL);
+  g_ptr_array_add (prints, g_object_ref_sink (raw));
+
+  g_assert_true (fp_print_serialize_many (prints, &data, &length, &error));
+  g_assert_no_error (error);
+
+  loaded = fp_print_deserialize_many (data, length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (loaded->len, ==, prints->len);
+
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *a = g_ptr_array_index (prints, i);
+      FpPrint *b = g_ptr_array_index (loaded, i);
+
+      g_assert_true (fp_print_equal (a, b));
+      g_assert_cmpstr (fp_print_get_username (a), ==, fp_print_get_username (b));
+      g_assert_cmpint (fp_print_get_device_stored (a), ==, fp_print_get_device_stored (b));
+    }
+
+  g_assert_null (fp_print_deserialize_many (data, length / 2, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+}
+
+static struct xyt_struct *
+random_xyt (guint32 seed, gint n)
+{
+  struct xyt_struct *xyt = g_new0 (struct xyt_struct, 1);
+  gint i;
+
+  /* xorshift, so that the minutiae are scattered but reproducible */
+  for (i = 0; i < n * 3; i++)
+    {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+
+      if (i % 3 == 0)
+        xyt->xcol[i / 3] = 20 + seed % 260;
+      else if (i % 3 == 1)
+        xyt->ycol[i / 3] = 20 + seed % 360;
+      else
+        xyt->thetacol[i / 3] = (gint) (seed % 360) - 179;
+    }
+  xyt->nrows = n;
+
+  return xyt;
+}
+
+static struct xyt_struct *
+transform_xyt (const struct xyt_struct *src, gint dx, gint dy, gint skip)
+{
+  struct xyt_struct *xyt = g_new0 (struct xyt_struct, 1);
+  gint i;
+
+  for (i = 0; i < src->nrows; i++)
+    {
+      if (skip && i % skip == 0)
+        continue;
+
+      xyt->xcol[xyt->nrows] = src->xcol[i] + dx;
+      xyt->ycol[xyt->nrows] = src->ycol[i] + dy;
+      xyt->thetacol[xyt->nrows] = src->thetacol[i];
+      xyt->nrows++;
+    }
+
+  return xyt;
+}
+
+static void
+test_print_consolidate (void)
+{
+  g_autoptr(FpPrint) print = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) probe = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) other = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(GError) error = NULL;
+  struct xyt_struct *base = random_xyt (3, 40);
+  struct xyt_struct scratch;
+
+  /* Two shifted partial captures of the same finger and an unrelated one */
+  g_ptr_array_add (print->prints, base);
+  g_ptr_array_add (print->prints, transform_xyt (base, 12, -8, 4));
+  g_ptr_array_add (print->prints, transform_xyt (base, -5, 10, 3));
+  g_ptr_array_add (print->prints, random_xyt (100, 40));
+
+  g_ptr_array_add (probe->prints, transform_xyt (base, 3, 3, 5));
+  g_ptr_array_add (other->prints, random_xyt (100, 40));
+
+  g_assert_true (fpi_print_consolidate (print, 40));
+  g_assert_cmpuint (fpi_print_get_n_xyt (print), ==, 2);
+
+  /* Duplicates were merged */
+  g_assert_cmpint (fpi_print_get_xyt (print, 0, &scratch)->nrows, <, 60);
+
+  /* Both fingers still match */
+  g_assert_cmpint (fpi_print_bz3_match (print, probe, 40, &error), ==, FPI_MATCH_SUCCESS);
+  g_assert_no_error (error);
+  g_assert_cmpint (fpi_print_bz3_match (print, other, 40, &error), ==, FPI_MATCH_SUCCESS);
+  g_assert_no_error (error);
+}
+
+static void
+test_print_identify_indexed (void)
+{
+  g_autoptr(GPtrArray) templates = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(FpPrint) probe = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(GError) error = NULL;
+  FpPrint *target;
+  FpPrint *match;
+  guint i;
+
+  /* Large enough for the gallery to be ranked before matching */
+  for (i = 0; i < 64; i++)
+    {
+      FpPrint *template = g_object_ref_sink (make_nbis_print (0, 0));
+
+      g_ptr_array_add (template->prints, random_xyt (i + 1, 40));
+      g_ptr_array_add (templates, template);
+    }
+
+  target = g_ptr_array_index (templates, 45);
+  g_ptr_array_add (probe->prints,
+                   transform_xyt (g_ptr_array_index (target->prints, 0), 7, -4, 6));
+
+  match = fpi_print_bz3_identify (templates, probe, 40, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (match == target);
+}
+
+static void
+test_print_identify_cylinder (void)
+{
+  g_autoptr(GPtrArray) templates = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(FpPrint) probe = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) other = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(GError) error = NULL;
+  FpPrint *target;
+  FpPrint *match;
+  gint bz3_score;
+  gint score;
+  guint i;
+
+  for (i = 0; i < 64; i++)
+    {
+      FpPrint *template = g_object_ref_sink (make_nbis_print (0, 0));
+
+      g_ptr_array_add (template->prints, random_xyt (i + 1, 40));
+      g_ptr_array_add (templates, template);
+    }
+
+  target = g_ptr_array_index (templates, 45);
+  g_ptr_array_add (probe->prints,
+                   transform_xyt (g_ptr_array_index (target->prints, 0), 7, -4, 6));
+
+  match = fpi_print_bz3_identify (templates, probe, 40, &bz3_score, &error);
+  g_assert_no_error (error);
+  g_assert_true (match == target);
+
+  /* Bozorth3 makes the decision, so the score is the same */
+  match = fpi_print_identify (templates, probe, FPI_MATCHER_CYLINDER_RANK, 40, &score, &error);
+  g_assert_no_error (error);
+  g_assert_true (match == target);
+  g_assert_cmpint (score, ==, bz3_score);
+
+  match = fpi_print_identify (templates, probe, FPI_MATCHER_CYLINDER, 40, &score, &error);
+  g_assert_no_error (error);
+  g_assert_true (match == target);
+  g_assert_cmpint (score, ==, bz3_score);
+
+  /* An unrelated finger is not found either way */
+  g_ptr_array_add (other->prints, random_xyt (1000, 40));
+  match = fpi_print_identify (templates, other, FPI_MATCHER_CYLINDER_RANK, 40, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_null (match);
+}
+
+static void
+test_print_identify_scores (void)
+{
+  g_autoptr(GPtrArray) templates = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(FpPrint) probe = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(GArray) results = NULL;
+  g_autoptr(GError) error = NULL;
+  FpPrint *target;
+  guint i;
+
+  for (i = 0; i < 16; i++)
+    {
+      FpPrint *template = g_object_ref_sink (make_nbis_print (0, 0));
+
+      g_ptr_array_add (template->prints, random_xyt (i + 1, 40));
+      g_ptr_array_add (templates, template);
+    }
+
+  target = g_ptr_array_index (templates, 9);
+  g_ptr_array_add (probe->prints,
+                   transform_xyt (g_ptr_array_index (target->prints, 0), 7, -4, 6));
+
+  results = fpi_print_bz3_identify_scores (templates, probe, 0, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (results->len, ==, templates->len);
+
+  /* Best first, and the scores agree with a one-off match */
+  g_assert_true (g_array_index (results, FpiBz3Score, 0).template == target);
+  for (i = 0; i < results->len; i++)
+    {
+      FpiBz3Score *result = &g_array_index (results, FpiBz3Score, i);
+      FpiMatchResult match = fpi_print_bz3_match (result->template, probe, 40, NULL);
+
+      if (i > 0)
+        g_assert_cmpint (result->score, <=, g_array_index (results, FpiBz3Score, i - 1).score);
+      g_assert_cmpint (match == FPI_MATCH_SUCCESS, ==, result->score >= 40);
+    }
+  g_clear_pointer (&results, g_array_unref);
+
+  results = fpi_print_bz3_identify_scores (templates, probe, 3, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (results->len, ==, 3);
+  g_assert_true (g_array_index (results, FpiBz3Score, 0).template == target);
+}
+
+static void
+test_print_gallery_webs (void)
+{
+  g_autoptr(GPtrArray) templates = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(FpPrint) probe = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(GArray) expected = NULL;
+  g_autoptr(GArray) results = NULL;
+  g_autoptr(GPtrArray) loaded = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize length, offset;
+  FpPrint *template;
+  gint fd;
+  guint i;
+
+  fd = g_file_open_tmp ("test-gallery-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  for (i = 0; i < 16; i++)
+    {
+      template = g_object_ref_sink (make_nbis_print (0, 0));
+      g_ptr_array_add (template->prints, random_xyt (i + 1, 40));
+      if (i % 2)
+        g_ptr_array_add (template->prints, random_xyt (i + 100, 30));
+      g_ptr_array_add (templates, template);
+    }
+
+  template = g_ptr_array_index (templates, 9);
+  g_ptr_array_add (probe->prints,
+                   transform_xyt (g_ptr_array_index (template->prints, 0), 7, -4, 6));
+
+  expected = fpi_print_bz3_identify_scores (templates, probe, 0, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (fp_print_save_gallery_full (templates, path, FP_GALLERY_SAVE_WEBS, &error));
+  g_assert_no_error (error);
+
+  /* Make the first row of the first Web invalid, so that it gets rebuilt */
+  g_assert_true (g_file_get_contents (path, &contents, &length, &error));
+  offset = 8 + GUINT32_FROM_LE (*(guint32 *) (contents + 8 + 4));
+  g_assert_cmpmem (contents + offset, 3, "FPW", 3);
+  *(gint32 *) (contents + offset + 12 + 4 + 4 * 4) = GINT32_TO_LE (1000);
+  g_assert_true (g_file_set_contents (path, contents, length, &error));
+
+  loaded = fp_print_load_gallery (path, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (loaded->len, ==, templates->len);
+
+  for (i = 0; i < loaded->len; i++)
+    {
+      template = g_ptr_array_index (loaded, i);
+      g_assert_nonnull (template->packed_webs);
+      g_assert_true (fp_print_equal (template, g_ptr_array_index (templates, i)));
+    }
+
+  /* The same scores as with freshly built Webs */
+  results = fpi_print_bz3_identify_scores (loaded, probe, 0, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (results->len, ==, expected->len);
+  for (i = 0; i < results->len; i++)
+    g_assert_cmpint (g_array_index (results, FpiBz3Score, i).score, ==,
+                     g_array_index (expected, FpiBz3Score, i).score);
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+  /* The Webs refer to the file, except for the one that was broken */
+  for (i = 0; i < loaded->len; i++)
+    {
+      gconstpointer start;
+      gsize size;
+      BzGalleryWeb *web;
+
+      template = g_ptr_array_index (loaded, i);
+      start = g_bytes_get_data (template->packed_webs, &size);
+      web = g_ptr_array_index (template->bz3_webs, 0);
+
+      g_assert_cmpint ((const guchar *) web->cols >= (const guchar *) start &&
+                       (const guchar *) web->cols < (const guchar *) start + size, ==, i != 0);
+    }
+#endif
+
+  g_unlink (path);
+}
+
+static void
+test_print_identify_prints (void)
+{
+  g_autoptr(GPtrArray) templates = g_ptr_array_new_with_free_func (g_object_unref);
+  GPtrArray *shards[2];
+  GArray *shard_scores[2];
+  g_autoptr(FpPrint) probe = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(GArray) expected = NULL;
+  g_autoptr(GError) error = NULL;
+  FpPrint *template;
+  guint i, s;
+
+  for (i = 0; i < 16; i++)
+    {
+      template = g_object_ref_sink (make_nbis_print (0, 0));
+      g_ptr_array_add (template->prints, random_xyt (i + 1, 40));
+      g_ptr_array_add (templates, template);
+    }
+
+  template = g_ptr_array_index (templates, 11);
+  g_ptr_array_add (probe->prints,
+                   transform_xyt (g_ptr_array_index (template->prints, 0), 3, 5, -8));
+
+  expected = fpi_print_bz3_identify_scores (templates, probe, 3, &error);
+  g_assert_no_error (error);
+
+  /* Search both halves on their own, as separate hosts would */
+  for (s = 0; s < 2; s++)
+    {
+      g_autoptr(GPtrArray) half = g_ptr_array_new ();
+
+      for (i = s * 8; i < (s + 1) * 8; i++)
+        g_ptr_array_add (half, g_ptr_array_index (templates, i));
+
+      shards[s] = fp_print_identify_prints (probe, half, 3, &shard_scores[s], &error);
+      g_assert_no_error (error);
+      g_assert_cmpuint (shards[s]->len, ==, 3);
+      g_assert_cmpuint (shard_scores[s]->len, ==, 3);
+    }
+
+  /* Merging them by score gives the result for the whole gallery */
+  for (i = 0; i < expected->len; i++)
+    {
+      const FpiBz3Score *score = &g_array_index (expected, FpiBz3Score, i);
+      gint a = shard_scores[0]->len ? g_array_index (shard_scores[0], gint, 0) : -1;
+      gint b = shard_scores[1]->len ? g_array_index (shard_scores[1], gint, 0) : -1;
+
+      /* The first half comes first in gallery order for equal scores */
+      s = a >= b ? 0 : 1;
+      g_assert_true (g_ptr_array_index (shards[s], 0) == score->template);
+      g_assert_cmpint (g_array_index (shard_scores[s], gint, 0), ==, score->score);
+      g_ptr_array_remove_index (shards[s], 0);
+      g_array_remove_index (shard_scores[s], 0);
+    }
+
+  for (s = 0; s < 2; s++)
+    {
+      g_ptr_array_unref (shards[s]);
+      g_array_unref (shard_scores[s]);
+    }
+}
+
+static void
+test_print_identify_gallery_file (void)
+{
+  g_autoptr(GPtrArray) templates = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(FpPrint) probe = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(GArray) expected = NULL;
+  g_autoptr(GArray) scores = NULL;
+  g_autoptr(GPtrArray) results = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = NULL;
+  FpPrint *template;
+  gint fd;
+  guint i;
+
+  fd = g_file_open_tmp ("test-gallery-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  for (i = 0; i < 16; i++)
+    {
+      template = g_object_ref_sink (make_nbis_print (0, 0));
+      g_ptr_array_add (template->prints, random_xyt (i + 1, 40));
+      g_ptr_array_add (templates, template);
+    }
+
+  template = g_ptr_array_index (templates, 5);
+  g_ptr_array_add (probe->prints,
+                   transform_xyt (g_ptr_array_index (template->prints, 0), 3, 5, -8));
+
+  expected = fpi_print_bz3_identify_scores (templates, probe, 3, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (fp_print_save_gallery_full (templates, path, FP_GALLERY_SAVE_WEBS, &error));
+  g_assert_no_error (error);
+
+  results = fp_print_identify_gallery_file (probe, path, 3, &scores, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (results->len, ==, 3);
+  g_assert_cmpuint (scores->len, ==, 3);
+
+  for (i = 0; i < results->len; i++)
+    {
+      const FpiBz3Score *score = &g_array_index (expected, FpiBz3Score, i);
+
+      g_assert_true (fp_print_equal (g_ptr_array_index (results, i), score->template));
+      g_assert_cmpint (g_array_index (scores, gint, i), ==, score->score);
+    }
+
+  g_unlink (path);
+}
+
+static void
+test_print_serialize_webs (void)
+{
+  g_autoptr(FpPrint) template = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) probe = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) plain = NULL;
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(FpPrint) broken = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *plain_data = NULL;
+  g_autofree guchar *data = NULL;
+  gsize plain_length, length, i;
+  guchar *record;
+
+  g_ptr_array_add (template->prints, random_xyt (5, 40));
+  g_ptr_array_add (template->prints, random_xyt (6, 30));
+  g_ptr_array_add (probe->prints,
+                   transform_xyt (g_ptr_array_index (template->prints, 1), 4, 2, 5));
+
+  g_assert_true (fp_print_serialize (template, &plain_data, &plain_length, &error));
+  g_assert_true (fp_print_serialize_full (template, FP_PRINT_SERIALIZE_WEBS,
+                                          &data, &length, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (length, >, plain_length);
+
+  plain = fp_print_deserialize (plain_data, plain_length, &error);
+  g_assert_no_error (error);
+  g_assert_null (plain->packed_webs);
+
+  loaded = fp_print_deserialize (data, length, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (loaded->packed_webs);
+  g_assert_true (fp_print_equal (template, loaded));
+  g_assert_cmpint (fpi_print_bz3_match (loaded, probe, 40, &error), ==,
+                   fpi_print_bz3_match (template, probe, 40, NULL));
+  g_assert_no_error (error);
+
+  /* Damaged matching data is ignored, the print itself still loads */
+  for (record = NULL, i = 0; !record && i + 3 <= length; i++)
+    if (memcmp (data + i, "FPW", 3) == 0)
+      record = data + i;
+  g_assert_nonnull (record);
+  for (i = 16; i < 64; i++)
+    record[i] ^= 0x55;
+
+  broken = fp_print_deserialize (data, length, &error);
+  g_assert_no_error (error);
+  g_assert_null (broken->packed_webs);
+  g_assert_true (fp_print_equal (template, broken));
+}
+
+static void
+test_print_digest (void)
+{
+  g_autoptr(FpPrint) a = g_object_ref_sink (make_nbis_print (1, 2));
+  g_autoptr(FpPrint) b = g_object_ref_sink (make_nbis_print (1, 2));
+  g_autoptr(FpPrint) add = g_object_ref_sink (make_nbis_print (2, 1));
+  g_autoptr(FpPrint) raw = NULL;
+  g_autofree gchar *digest = NULL;
+
+  /* The metadata is not part of the digest */
+  fp_print_set_username (b, "otheruser");
+  g_assert_cmpstr (fp_print_get_digest (a), ==, fp_print_get_digest (b));
+  g_assert_cmpuint (strlen (fp_print_get_digest (a)), ==, 64);
+  g_assert_true (fp_print_equal (a, b));
+
+  /* Changing the print data invalidates it */
+  digest = g_strdup (fp_print_get_digest (a));
+  fpi_print_add_print (a, add);
+  g_assert_cmpstr (fp_print_get_digest (a), !=, digest);
+  g_assert_false (fp_print_equal (a, b));
+
+  raw = g_object_new (FP_TYPE_PRINT,
+                      "driver", "test_driver",
+                      "device-id", "test_device",
+                      "fpi-type", FPI_PRINT_RAW,
+                      "fpi-data", g_variant_new_string ("handle"),
+                      NULL);
+  g_clear_pointer (&digest, g_free);
+  digest = g_strdup (fp_print_get_digest (raw));
+  g_object_set (raw, "fpi-data", g_variant_new_string ("other"), NULL);
+  g_assert_cmpstr (fp_print_get_digest (raw), !=, digest);
+}
+
+static void
+test_gallery (void)
+{
+  g_autoptr(FpGallery) gallery = fp_gallery_new ();
+  g_autoptr(FpPrint) a = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) b = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) copy = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(GPtrArray) snapshot = NULL;
+  g_autoptr(GPtrArray) prints = NULL;
+
+  g_ptr_array_add (a->prints, random_xyt (1, 40));
+  g_ptr_array_add (b->prints, random_xyt (2, 40));
+  g_ptr_array_add (copy->prints, random_xyt (1, 40));
+
+  fp_gallery_add_print (gallery, a);
+  fp_gallery_add_print (gallery, a);
+  g_assert_cmpuint (fp_gallery_get_n_prints (gallery), ==, 1);
+
+  /* An equal print is a duplicate as well */
+  fp_gallery_add_print (gallery, copy);
+  g_assert_cmpuint (fp_gallery_get_n_prints (gallery), ==, 1);
+  g_assert_false (fp_gallery_remove_print (gallery, copy));
+
+  /* The match data is built when adding */
+  g_assert_nonnull (a->bz3_webs);
+  g_assert_nonnull (a->bz3_template);
+
+  /* Later changes do not affect a returned array */
+  snapshot = fp_gallery_get_prints (gallery);
+  fp_gallery_add_print (gallery, b);
+  g_assert_true (fp_gallery_remove_print (gallery, a));
+  g_assert_false (fp_gallery_remove_print (gallery, a));
+
+  g_assert_cmpuint (snapshot->len, ==, 1);
+  g_assert_true (g_ptr_array_index (snapshot, 0) == a);
+
+  prints = fp_gallery_get_prints (gallery);
+  g_assert_cmpuint (prints->len, ==, 1);
+  g_assert_true (g_ptr_array_index (prints, 0) == b);
+}
+
+static void
+test_gallery_adaptive_order (void)
+{
+  g_autoptr(FpGallery) gallery = fp_gallery_new ();
+  g_autoptr(GPtrArray) prints = NULL;
+  FpPrint *p[4];
+  gint i;
+
+  for (i = 0; i < 4; i++)
+    {
+      p[i] = g_object_ref_sink (make_nbis_print (0, 0));
+      g_ptr_array_add (p[i]->prints, random_xyt (10 + i, 40));
+      fp_gallery_add_print (gallery, p[i]);
+    }
+
+  /* Ignored unless enabled */
+  fp_gallery_report_match (gallery, p[3]);
+  prints = fp_gallery_get_prints (gallery);
+  g_assert_true (g_ptr_array_index (prints, 3) == p[3]);
+  g_clear_pointer (&prints, g_ptr_array_unref);
+
+  fp_gallery_set_adaptive_order (gallery, TRUE);
+  g_assert_true (fp_gallery_get_adaptive_order (gallery));
+
+  /* A match moves the print halfway to the front */
+  fp_gallery_report_match (gallery, p[3]);
+  prints = fp_gallery_get_prints (gallery);
+  g_assert_true (g_ptr_array_index (prints, 0) == p[0]);
+  g_assert_true (g_ptr_array_index (prints, 1) == p[3]);
+  g_assert_true (g_ptr_array_index (prints, 2) == p[1]);
+  g_assert_true (g_ptr_array_index (prints, 3) == p[2]);
+  g_clear_pointer (&prints, g_ptr_array_unref);
+
+  fp_gallery_report_match (gallery, p[3]);
+  prints = fp_gallery_get_prints (gallery);
+  g_assert_true (g_ptr_array_index (prints, 0) == p[3]);
+  g_assert_true (g_ptr_array_index (prints, 1) == p[0]);
+
+  for (i = 0; i < 4; i++)
+    g_object_unref (p[i]);
+}
+
+static void
+test_print_probe (void)
+{
+  g_autoptr(FpPrint) print = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) same = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) other = g_object_ref_sink (make_nbis_print (0, 0));
+  g_autoptr(FpPrint) raw = NULL;
+  g_autoptr(FpiBz3Probe) probe = NULL;
+  g_autoptr(GError) error = NULL;
+  struct xyt_struct *base = random_xyt (7, 40);
+  gint i;
+
+  g_ptr_array_add (print->prints, transform_xyt (base, -6, 9, 5));
+  g_ptr_array_add (same->prints, base);
+  g_ptr_array_add (other->prints, random_xyt (200, 40));
+
+  probe = fpi_print_bz3_probe_new (print, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (probe);
+
+  /* The probe can be reused and agrees with a one-off match */
+  for (i = 0; i < 2; i++)
+    {
+      g_assert_cmpint (fpi_print_bz3_probe_match (probe, same, 40, &error), ==,
+                       fpi_print_bz3_match (same, print, 40, NULL));
+      g_assert_cmpint (fpi_print_bz3_probe_match (probe, other, 40, &error), ==,
+                       fpi_print_bz3_match (other, print, 40, NULL));
+      g_assert_no_error (error);
+    }
+  g_assert_cmpint (fpi_print_bz3_probe_match (probe, same, 40, NULL), ==, FPI_MATCH_SUCCESS);
+
+  raw = g_object_ref_sink (g_object_new (FP_TYPE_PRINT, "fpi-type", FPI_PRINT_RAW, NULL));
+  g_assert_null (fpi_print_bz3_probe_new (raw, &error));
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_SUPPORTED);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/print/serialize", test_print_serialize);
+  g_test_add_func ("/print/packed", test_print_packed);
+  g_test_add_func ("/print/packed-compressed", test_print_packed_compressed);
+  g_test_add_func ("/print/serialize-webs", test_print_serialize_webs);
+  g_test_add_func ("/print/gallery", test_print_gallery);
+  g_test_add_func ("/print/gallery-async", test_print_gallery_async);
+  g_test_add_func ("/print/many", test_print_many);
+  g_test_add_func ("/print/consolidate", test_print_consolidate);
+  g_test_add_func ("/print/probe", test_print_probe);
+  g_test_add_func ("/print/identify-indexed", test_print_identify_indexed);
+  g_test_add_func ("/print/identify-cylinder", test_print_identify_cylinder);
+  g_test_add_func ("/print/identify-scores", test_print_identify_scores);
+  g_test_add_func ("/print/gallery-webs", test_print_gallery_webs);
+  g_test_add_func ("/print/identify-prints", test_print_identify_prints);
+  g_test_add_func ("/print/identify-gallery-file", test_print_identify_gallery_file);
+  g_test_add_func ("/print/digest", test_print_digest);
+  g_test_add_func ("/print/gallery-object", test_gallery);
+  g_test_add_func ("/print/gallery-adaptive-order", test_gallery_adaptive_order);
+
+  return g_test_run ();
+}
@@ -0,0 +1,290 @@
+/*
+ * SIMD kernel unit tests
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "fpi-simd.h"
+
+/* Long enough for every vector width plus all tail lengths, and for the
+ * large sums to exceed 32 bits. */
+#define MAX_SIZE 300
+#define LARGE_SIZE (1 << 20)
+
+typedef void (*KernelCheck) (const FpiSimdKernels *kernels,
+                             const FpiSimdKernels *ref,
+                             const guint8         *a,
+                             const guint8         *b,
+                             gsize                 size);
+
+/* Runs @check for all kernel tables against the scalar one, on random
+ * and on extreme data, for all sizes and a few misalignments. */
+static void
+run_check (KernelCheck check)
+{
+  g_autoptr(GPtrArray) all = fpi_simd_list_kernels ();
+  g_autofree guint8 *a = g_malloc (MAX_SIZE + 16);
+  g_autofree guint8 *b = g_malloc (MAX_SIZE + 16);
+  const FpiSimdKernels *ref;
+  guint k, pattern, i;
+  gsize size, offset;
+
+  ref = g_ptr_array_index (all, all->len - 1);
+  g_assert_cmpint (ref->features, ==, FPI_SIMD_NONE);
+
+  for (k = 0; k < all->len; k++)
+    {
+      const FpiSimdKernels *kernels = g_ptr_array_index (all, k);
+
+      g_test_message ("Checking %s kernels", kernels->name);
+
+      for (pattern = 0; pattern < 3; pattern++)
+        {
+          for (i = 0; i < MAX_SIZE + 16; i++)
+            {
+              switch (pattern)
+                {
+                case 0:
+                  a[i] = g_test_rand_int_range (0, 256);
+                  b[i] = g_test_rand_int_range (0, 256);
+                  break;
+
+                case 1:
+                  a[i] = 0xff;
+                  b[i] = 0x00;
+                  break;
+
+                default:
+                  a[i] = 0x00;
+                  b[i] = 0xff;
+                }
+            }
+
+          for (offset = 0; offset < 4; offset++)
+            for (size = 0; size <= MAX_SIZE; size++)
+              check (kernels, ref, a + offset, b, size);
+        }
+    }
+}
+
+static void
+check_sum (const FpiSimdKernels *kernels,
+           const FpiSimdKernels *ref,
+           const guint8         *a,
+           const guint8         *b,
+           gsize                 size)
+{
+  g_assert_cmpuint (kernels->sum_u8 (a, size), ==, ref->sum_u8 (a, size));
+}
+
+static void
+check_sum_abs_diff (const FpiSimdKernels *kernels,
+                    const FpiSimdKernels *ref,
+                    const guint8         *a,
+                    const guint8         *b,
+                    gsize                 size)
+{
+  g_assert_cmpuint (kernels->sum_abs_diff_u8 (a, b, size), ==,
+                    ref->sum_abs_diff_u8 (a, b, size));
+}
+
+static void
+check_sum_sq_diff (const FpiSimdKernels *kernels,
+                   const FpiSimdKernels *ref,
+                   const guint8         *a,
+                   const guint8         *b,
+                   gsize                 size)
+{
+  guint8 value = b[0];
+
+  g_assert_cmpuint (kernels->sum_sq_diff_u8 (a, b, 0, size), ==,
+                    ref->sum_sq_diff_u8 (a, b, 0, size));
+  g_assert_cmpuint (kernels->sum_sq_diff_u8 (a, NULL, value, size), ==,
+                    ref->sum_sq_diff_u8 (a, NULL, value, size));
+}
+
+static void
+check_saturate_above (const FpiSimdKernels *kernels,
+                      const FpiSimdKernels *ref,
+                      const guint8         *a,
+                      const guint8         *b,
+                      gsize                 size)
+{
+  const guint8 levels[] = { 0x00, 0x01, 0x7f, 0x80, 0xfe, 0xff, b[0] };
+  guint8 res[MAX_SIZE];
+  guint8 expected[MAX_SIZE];
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (levels); i++)
+    {
+      memcpy (res, a, size);
+      memcpy (expected, a, size);
+
+      kernels->saturate_above_u8 (res, size, levels[i]);
+      ref->saturate_above_u8 (expected, size, levels[i]);
+      g_assert_cmpmem (res, size, expected, size);
+    }
+}
+
+static void
+check_blend (const FpiSimdKernels *kernels,
+             const FpiSimdKernels *ref,
+             const guint8         *a,
+             const guint8         *b,
+             gsize                 size)
+{
+  const guint weights[] = { 0, 1, 127, 128, 255, 256, b[0] };
+  guint8 res[MAX_SIZE];
+  guint8 expected[MAX_SIZE];
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (weights); i++)
+    {
+      kernels->blend_u8 (res, a, b, weights[i], size);
+      ref->blend_u8 (expected, a, b, weights[i], size);
+      g_assert_cmpmem (res, size, expected, size);
+    }
+}
+
+static void
+check_normalize_row (const FpiSimdKernels *kernels,
+                     const FpiSimdKernels *ref,
+                     const guint8         *a,
+                     const guint8         *b,
+                     gsize                 size)
+{
+  const guint8 xors[] = { 0x00, 0xff, b[0] };
+  guint8 res[MAX_SIZE];
+  guint8 expected[MAX_SIZE];
+  guint i, mirror;
+
+  for (mirror = 0; mirror < 2; mirror++)
+    {
+      for (i = 0; i < G_N_ELEMENTS (xors); i++)
+        {
+          kernels->normalize_row_u8 (res, a, size, mirror, xors[i]);
+          ref->normalize_row_u8 (expected, a, size, mirror, xors[i]);
+          g_assert_cmpmem (res, size, expected, size);
+        }
+    }
+}
+
+static void
+test_simd_kernels (void)
+{
+  g_autoptr(GPtrArray) all = fpi_simd_list_kernels ();
+  const FpiSimdKernels *best = fpi_simd_get_kernels ();
+  FpiSimdFeatures features = fpi_simd_get_features ();
+  guint i;
+
+  /* The fastest usable table is selected, and all need known features */
+  g_assert_cmpuint (all->len, >=, 1);
+  g_assert (best == g_ptr_array_index (all, 0));
+
+  for (i = 0; i < all->len; i++)
+    {
+      const FpiSimdKernels *kernels = g_ptr_array_index (all, i);
+
+      g_assert_nonnull (kernels->name);
+      g_assert_cmpuint (kernels->features & ~features, ==, 0);
+    }
+
+#if !FPI_SIMD
+  g_assert_cmpint (features, ==, FPI_SIMD_NONE);
+  g_assert_cmpuint (all->len, ==, 1);
+#endif
+}
+
+static void
+test_simd_sum (void)
+{
+  run_check (check_sum);
+}
+
+static void
+test_simd_sum_abs_diff (void)
+{
+  run_check (check_sum_abs_diff);
+}
+
+static void
+test_simd_sum_sq_diff (void)
+{
+  run_check (check_sum_sq_diff);
+}
+
+static void
+test_simd_saturate_above (void)
+{
+  run_check (check_saturate_above);
+}
+
+static void
+test_simd_blend (void)
+{
+  run_check (check_blend);
+}
+
+static void
+test_simd_normalize_row (void)
+{
+  run_check (check_normalize_row);
+}
+
+static void
+test_simd_large_sums (void)
+{
+  g_autoptr(GPtrArray) all = fpi_simd_list_kernels ();
+  g_autofree guint8 *white = g_malloc (LARGE_SIZE);
+  g_autofree guint8 *black = g_malloc0 (LARGE_SIZE);
+  guint k;
+
+  memset (white, 0xff, LARGE_SIZE);
+
+  for (k = 0; k < all->len; k++)
+    {
+      const FpiSimdKernels *kernels = g_ptr_array_index (all, k);
+
+      g_assert_cmpuint (kernels->sum_u8 (white, LARGE_SIZE), ==,
+                        (guint64) 0xff * LARGE_SIZE);
+      g_assert_cmpuint (kernels->sum_abs_diff_u8 (white, black, LARGE_SIZE), ==,
+                        (guint64) 0xff * LARGE_SIZE);
+      g_assert_cmpuint (kernels->sum_sq_diff_u8 (white, black, 0, LARGE_SIZE), ==,
+                        (guint64) 0xff * 0xff * LARGE_SIZE);
+      g_assert_cmpuint (kernels->sum_sq_diff_u8 (black, NULL, 0xff, LARGE_SIZE), ==,
+                        (guint64) 0xff * 0xff * LARGE_SIZE);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/simd/kernels", test_simd_kernels);
+  g_test_add_func ("/simd/sum", test_simd_sum);
+  g_test_add_func ("/simd/sum-abs-diff", test_simd_sum_abs_diff);
+  g_test_add_func ("/simd/sum-sq-diff", test_simd_sum_sq_diff);
+  g_test_add_func ("/simd/saturate-above", test_simd_saturate_above);
+  g_test_add_func ("/simd/blend", test_simd_blend);
+  g_test_add_func ("/simd/normalize-row", test_simd_normalize_row);
+  g_test_add_func ("/simd/large-sums", test_simd_large_sums);
+
+  return g_test_run ();
+}
@@ -17,6 +17,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <string.h>
 #include "fp-device.h"
 #define FP_COMPONENT "SSM"
 
@@ -197,6 +198,32 @@ test_ssm_new_full (void)
   fpi_ssm_free (ssm);
 }
 
+static void
+test_ssm_new_with_data (void)
+{
+  const gsize sizes[] = { 1, 64, 4096 };
+
+  /* Run twice, so that recycled machines are used the second time */
+  for (guint i = 0; i < G_N_ELEMENTS (sizes) * 2; i++)
+    {
+      gsize size = sizes[i % G_N_ELEMENTS (sizes)];
+      g_autofree guint8 *zeros = g_malloc0 (size);
+      FpiSsm *ssm;
+      guint8 *data;
+
+      ssm = fpi_ssm_new_with_data (fake_device, test_ssm_handler,
+                                   FPI_TEST_SSM_STATE_NUM, size);
+
+      data = fpi_ssm_get_data (ssm);
+      g_assert_nonnull (data);
+      g_assert_cmpmem (data, size, zeros, size);
+      g_assert_cmpint (fpi_ssm_get_cur_state (ssm), ==, FPI_TEST_SSM_STATE_0);
+      memset (data, 0xff, size);
+
+      fpi_ssm_free (ssm);
+    }
+}
+
 static void
 test_ssm_new_no_handler (void)
 {
@@ -1345,6 +1372,48 @@ test_ssm_subssm_start_with_delayed (void)
   g_assert_no_error (data->error);
 }
 
+static void
+test_ssm_profile (void)
+{
+  g_autoptr(FpiSsm) ssm = NULL;
+  g_autoptr(FpiSsm) subssm = NULL;
+  FpiSsmTestData *data;
+  g_autofree gchar *folded = NULL;
+  g_autofree gchar *table = NULL;
+
+  /* Profiling is enabled once per process, so only enable it for a
+   * subprocess that runs this test alone. */
+  if (!g_test_subprocess ())
+    {
+      g_setenv ("FP_DEBUG_SSM_PROFILE", "1", TRUE);
+      g_test_trap_subprocess (NULL, 0, G_TEST_SUBPROCESS_INHERIT_STDERR);
+      g_unsetenv ("FP_DEBUG_SSM_PROFILE");
+      g_test_trap_assert_passed ();
+      return;
+    }
+
+  ssm = ssm_test_new ();
+  subssm = ssm_test_new_full (FPI_TEST_SSM_STATE_NUM, "FPI_TEST_SUB_SSM");
+  data = fpi_ssm_get_data (ssm);
+
+  fpi_ssm_start (ssm, test_ssm_completed_callback);
+  fpi_ssm_start_subsm (ssm, subssm);
+  fpi_ssm_next_state (subssm);
+  fpi_ssm_mark_completed (g_steal_pointer (&subssm));
+  fpi_ssm_mark_completed (g_steal_pointer (&ssm));
+  g_assert_true (data->completed);
+
+  /* Child states are nested below the parent state that started them */
+  folded = fpi_ssm_profile_to_string (fake_device, TRUE);
+  g_assert_nonnull (strstr (folded, "fake_test_dev;FPI_TEST_SSM:0 "));
+  g_assert_nonnull (strstr (folded, "fake_test_dev;FPI_TEST_SSM:1 "));
+  g_assert_nonnull (strstr (folded, "fake_test_dev;FPI_TEST_SSM:0;FPI_TEST_SUB_SSM:0 "));
+  g_assert_nonnull (strstr (folded, "fake_test_dev;FPI_TEST_SSM:0;FPI_TEST_SUB_SSM:1 "));
+
+  table = fpi_ssm_profile_to_string (fake_device, FALSE);
+  g_assert_nonnull (strstr (table, "  fake_test_dev;FPI_TEST_SSM:0;FPI_TEST_SUB_SSM:1\n"));
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -1358,6 +1427,7 @@ main (int argc, char *argv[])
 
   g_test_add_func ("/ssm/new", test_ssm_new);
   g_test_add_func ("/ssm/new/full", test_ssm_new_full);
+  g_test_add_func ("/ssm/new/with_data", test_ssm_new_with_data);
   g_test_add_func ("/ssm/new/no_handler", test_ssm_new_no_handler);
   g_test_add_func ("/ssm/new/wrong_states", test_ssm_new_wrong_states);
   g_test_add_func ("/ssm/set_data", test_ssm_set_data);
@@ -1399,6 +1469,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/ssm/subssm/start/with_started", test_ssm_subssm_start_with_started);
   g_test_add_func ("/ssm/subssm/start/with_delayed", test_ssm_subssm_start_with_delayed);
   g_test_add_func ("/ssm/subssm/mark_failed", test_ssm_subssm_mark_failed);
+  g_test_add_func ("/ssm/profile", test_ssm_profile);
 
   return g_test_run ();
 }
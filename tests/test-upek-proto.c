@@ -0,0 +1,78 @@
+/*
+ * UPEK protocol helper unit tests
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+
+#include "drivers/upek_proto.h"
+
+/* CRC-16 with the 0x1021 polynomial, computed bit by bit */
+static guint16
+reference_crc (const guint8 *buffer, gsize size)
+{
+  guint16 crc = 0;
+
+  while (size--)
+    {
+      crc ^= *buffer++ << 8;
+      for (gint i = 0; i < 8; i++)
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+  return crc;
+}
+
+static void
+test_udf_crc_check_value (void)
+{
+  guint8 check[] = "123456789";
+
+  g_assert_cmpuint (udf_crc (check, 9), ==, 0x31c3);
+  g_assert_cmpuint (udf_crc (check, 0), ==, 0);
+}
+
+static void
+test_udf_crc_reference (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (0);
+  guint8 buffer[1024];
+  gsize offset, size;
+
+  for (gsize i = 0; i < sizeof (buffer); i++)
+    buffer[i] = g_rand_int_range (rand, 0, 256);
+
+  /* All alignments and lengths around the 8 byte steps */
+  for (offset = 0; offset < 8; offset++)
+    for (size = 0; size + offset <= 64; size++)
+      g_assert_cmpuint (udf_crc (buffer + offset, size), ==,
+                        reference_crc (buffer + offset, size));
+
+  g_assert_cmpuint (udf_crc (buffer, sizeof (buffer)), ==,
+                    reference_crc (buffer, sizeof (buffer)));
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/upek-proto/crc/check-value", test_udf_crc_check_value);
+  g_test_add_func ("/upek-proto/crc/reference", test_udf_crc_reference);
+
+  return g_test_run ();
+}
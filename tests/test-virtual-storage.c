@@ -0,0 +1,134 @@
+/*
+ * Virtual storage device tests
+ * Copyright (C) 2020 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+
+#include "test-utils.h"
+
+static FpDevice *
+find_storage_device (FpContext *context)
+{
+  GPtrArray *devices = fp_context_get_devices (context);
+  guint i;
+
+  for (i = 0; i < devices->len; ++i)
+    {
+      FpDevice *device = g_ptr_array_index (devices, i);
+
+      if (g_strcmp0 (fp_device_get_driver (device), "virtual_storage") == 0)
+        return device;
+    }
+
+  return NULL;
+}
+
+static FpPrint *
+enroll_print (FpDevice *device, FpFinger finger, GError **error)
+{
+  FpPrint *template = fp_print_new (device);
+
+  fp_print_set_finger (template, finger);
+  fp_print_set_username (template, "testuser");
+
+  return fp_device_enroll_sync (device, template, NULL, NULL, NULL, error);
+}
+
+static void
+test_virtual_storage_flows (void)
+{
+  g_autoptr(FpContext) context = NULL;
+  g_autoptr(GPtrArray) prints = NULL;
+  g_autoptr(FpPrint) enrolled = NULL;
+  g_autoptr(FpPrint) full = NULL;
+  g_autoptr(FpPrint) match = NULL;
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(GError) error = NULL;
+  FpDevice *device;
+  gboolean matched;
+
+  g_setenv ("FP_VIRTUAL_STORAGE", "prints=3,capacity=4,fail-delete=2", TRUE);
+
+  context = fp_context_new ();
+  device = find_storage_device (context);
+  g_assert_true (FP_IS_DEVICE (device));
+  g_assert_true (fp_device_has_storage (device));
+
+  g_assert_true (fp_device_open_sync (device, NULL, &error));
+  g_assert_no_error (error);
+
+  prints = fp_device_list_prints_sync (device, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (prints->len, ==, 3);
+  g_assert_cmpstr (fp_print_get_username (g_ptr_array_index (prints, 0)), ==, "user1");
+
+  /* The last free slot is used, after that the storage is full */
+  enrolled = enroll_print (device, FP_FINGER_LEFT_INDEX, &error);
+  g_assert_no_error (error);
+  g_assert_true (fp_print_get_device_stored (enrolled));
+
+  full = enroll_print (device, FP_FINGER_RIGHT_INDEX, &error);
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_FULL);
+  g_assert_null (full);
+  g_clear_error (&error);
+
+  g_assert_true (fp_device_verify_sync (device, enrolled, NULL, NULL, NULL,
+                                        &matched, &print, &error));
+  g_assert_no_error (error);
+  g_assert_true (matched);
+  g_assert_true (fp_print_equal (print, enrolled));
+  g_clear_object (&print);
+
+  /* Identification goes through the stored prints in order */
+  g_assert_true (fp_device_identify_sync (device, prints, NULL, NULL, NULL,
+                                          &match, &print, &error));
+  g_assert_no_error (error);
+  g_assert_true (match == g_ptr_array_index (prints, 0));
+  g_clear_object (&match);
+  g_clear_object (&print);
+
+  /* Every second delete fails */
+  g_assert_true (fp_device_delete_print_sync (device, enrolled, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_false (fp_device_delete_print_sync (device, g_ptr_array_index (prints, 0),
+                                               NULL, &error));
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL);
+  g_clear_error (&error);
+
+  g_assert_true (fp_device_clear_storage_sync (device, NULL, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&prints, g_ptr_array_unref);
+  prints = fp_device_list_prints_sync (device, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (prints->len, ==, 0);
+
+  g_assert_true (fp_device_close_sync (device, NULL, &error));
+  g_assert_no_error (error);
+
+  g_unsetenv ("FP_VIRTUAL_STORAGE");
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/virtual-storage/flows", test_virtual_storage_flows);
+
+  return g_test_run ();
+}
@@ -126,6 +126,22 @@ class VirtualImage(unittest.TestCase):
         while iterate and ctx.pending():
             ctx.iteration(False)
 
+    def send_throughput(self, enabled, iterate=True):
+        # Queue images and feed them into the captures as they start
+        self.con.sendall(struct.pack('ii', -5, 1 if enabled else 0))
+        while iterate and ctx.pending():
+            ctx.iteration(False)
+
+    def send_keep_active(self, timeout_ms, iterate=True):
+        # Keep the device active for a while after each operation
+        self.con.sendall(struct.pack('ii', -6, timeout_ms))
+        while iterate and ctx.pending():
+            ctx.iteration(False)
+
+    def get_image_device_state(self):
+        # 0 is FPI_IMAGE_DEVICE_STATE_INACTIVE
+        return int(self.dev.get_property('fpi-image-device-state'))
+
     def send_image(self, image, iterate=True):
         img = self.prints[image]
 
@@ -161,6 +177,31 @@ class VirtualImage(unittest.TestCase):
         while not self._cancelled:
             ctx.iteration(True)
 
+    def test_capture_frames(self):
+        frames = []
+        def frame_cb(dev, frame):
+            frames.append(frame)
+
+        def done_cb(dev, res):
+            self._image = dev.capture_finish(res)
+
+        handler = self.dev.connect('frame', frame_cb)
+        self.dev.props.frame_downsample = 2
+        try:
+            self._image = None
+            self.dev.capture(True, None, done_cb)
+            self.send_image('whorl')
+            while self._image is None:
+                ctx.iteration(True)
+        finally:
+            self.dev.disconnect(handler)
+            self.dev.props.frame_downsample = 1
+
+        img = self.prints['whorl']
+        self.assertEqual(len(frames), 1)
+        self.assertEqual(frames[0].get_width(), img.get_width() // 2)
+        self.assertEqual(frames[0].get_height(), img.get_height() // 2)
+
     def enroll_print(self, image):
         self._step = 0
         self._enrolled = None
@@ -307,6 +348,104 @@ class VirtualImage(unittest.TestCase):
         assert(self._identify_error is not None)
         assert(self._identify_error.matches(FPrint.device_error_quark(), FPrint.DeviceError.GENERAL))
 
+    def test_identify_gallery(self):
+        fp_whorl = self.enroll_print('whorl')
+        fp_tented_arch = self.enroll_print('tented_arch')
+
+        gallery = FPrint.Gallery.new()
+        gallery.add_print(fp_whorl)
+        gallery.add_print(fp_tented_arch)
+
+        def identify_cb(dev, res):
+            self._identify_match, self._identify_fp = self.dev.identify_finish(res)
+
+        self._identify_fp = None
+        self.dev.identify_gallery(gallery, callback=identify_cb)
+        # Changes do not affect the running operation
+        gallery.remove_print(fp_tented_arch)
+        self.send_image('tented_arch')
+        while self._identify_fp is None:
+            ctx.iteration(True)
+        assert(self._identify_match is fp_tented_arch)
+
+        self._identify_fp = None
+        self.dev.identify_gallery(gallery, callback=identify_cb)
+        self.send_image('tented_arch')
+        while self._identify_fp is None:
+            ctx.iteration(True)
+        assert(self._identify_match is None)
+
+    def test_enroll_duplicate(self):
+        fp_whorl = self.enroll_print('whorl')
+
+        gallery = FPrint.Gallery.new()
+        gallery.add_print(fp_whorl)
+        self.dev.set_enroll_duplicate_gallery(gallery)
+        try:
+            # A different finger can still be enrolled
+            fp_tented_arch = self.enroll_print('tented_arch')
+            self.assertIsNotNone(fp_tented_arch)
+
+            self._step = 0
+            self._error = None
+            def progress_cb(dev, step, fp, user_data):
+                self._step = step
+
+            def done_cb(dev, res):
+                try:
+                    dev.enroll_finish(res)
+                except GLib.GError as e:
+                    self._error = e
+
+            template = FPrint.Print.new(self.dev)
+            self.dev.enroll(template, None, progress_cb, tuple(), done_cb)
+
+            while self._error is None:
+                step = self._step
+                self.send_image('whorl')
+                while self._step == step and self._error is None:
+                    ctx.iteration(True)
+
+            assert self._error.matches(FPrint.device_error_quark(),
+                                       FPrint.DeviceError.DATA_DUPLICATE)
+        finally:
+            self.dev.set_enroll_duplicate_gallery(None)
+
+        while self.get_image_device_state() != 0:
+            ctx.iteration(True)
+
+    def test_identify_scores(self):
+        fp_whorl = self.enroll_print('whorl')
+        fp_tented_arch = self.enroll_print('tented_arch')
+
+        def identify_cb(dev, res):
+            self._identify_match, self._identify_fp = self.dev.identify_finish(res)
+            self._identify_candidates, self._identify_scores = self.dev.identify_get_scores(res)
+
+        self.dev.set_identify_max_results(1)
+        try:
+            self._identify_fp = None
+            self.dev.identify([fp_whorl, fp_tented_arch], callback=identify_cb)
+            self.send_image('tented_arch')
+            while self._identify_fp is None:
+                ctx.iteration(True)
+        finally:
+            self.dev.set_identify_max_results(0)
+
+        assert(self._identify_match is fp_tented_arch)
+        assert(len(self._identify_candidates) == 1)
+        assert(self._identify_candidates[0] is fp_tented_arch)
+        assert(self._identify_scores[0] >= 40)
+
+        # Without the request, no scores are reported
+        self._identify_fp = None
+        self.dev.identify([fp_whorl, fp_tented_arch], callback=identify_cb)
+        self.send_image('whorl')
+        while self._identify_fp is None:
+            ctx.iteration(True)
+        assert(self._identify_match is fp_whorl)
+        assert(self._identify_candidates is None)
+
     def test_verify_serialized(self):
         done = False
 
@@ -348,6 +487,54 @@ class VirtualImage(unittest.TestCase):
             ctx.iteration(True)
         assert(not self._verify_match)
 
+    def test_throughput(self):
+        self.send_throughput(True)
+
+        # Stream all images up front, they are queued by the driver
+        for i in range(5):
+            self.send_image('whorl', iterate=False)
+        for image in ['whorl', 'tented_arch', 'whorl']:
+            self.send_image(image, iterate=False)
+
+        template = FPrint.Print.new(self.dev)
+        template.props.finger = FPrint.Finger.LEFT_THUMB
+        fp_whorl = self.dev.enroll_sync(template, None, None, None)
+
+        match, fp = self.dev.verify_sync(fp_whorl)
+        assert(match)
+        match, fp = self.dev.verify_sync(fp_whorl)
+        assert(not match)
+        match, fp = self.dev.verify_sync(fp_whorl)
+        assert(match)
+
+    def test_keep_active(self):
+        def verify_cb(dev, res):
+            self._verify_match, self._verify_fp = dev.verify_finish(res)
+
+        def verify(image):
+            self._verify_match = None
+            self.dev.verify(fp_whorl, callback=verify_cb)
+            self.send_image(image)
+            while self._verify_match is None:
+                ctx.iteration(True)
+            return self._verify_match
+
+        self.send_keep_active(60000)
+        fp_whorl = self.enroll_print('whorl')
+
+        # Both verifies re-use the device that was kept active
+        assert(self.get_image_device_state() != 0)
+        assert(verify('whorl'))
+        assert(self.get_image_device_state() != 0)
+        assert(not verify('tented_arch'))
+        assert(self.get_image_device_state() != 0)
+
+        # The device is deactivated once the window expires
+        self.send_keep_active(10)
+        assert(verify('whorl'))
+        while self.get_image_device_state() != 0:
+            ctx.iteration(True)
+
 if __name__ == '__main__':
     try:
         gi.require_version('FPrint', '2.0')